@@ -104,6 +104,9 @@ BOARD_HAL_STATIC_LIBRARIES := libdumpstate.tuna
 
 TARGET_TUNA_AUDIO_HDMI := true
 
+# systrace markers of the audio, sensors, RIL client and keymaster HALs
+TARGET_TUNA_TRACE := false
+
 # Bootanimation
 TARGET_BOOTANIMATION_HALF_RES := true
 
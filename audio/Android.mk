@@ -18,11 +18,13 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := audio.primary.tuna
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SRC_FILES := audio_hw.c ril_interface.c
+LOCAL_SRC_FILES := audio_hw.c fir_resampler.c ril_interface.c
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
 	$(call include-path-for, audio-utils) \
 	$(call include-path-for, audio-effects) \
+	$(LOCAL_PATH)/../include \
+	$(LOCAL_PATH)/../power \
 	$(LOCAL_PATH)/../ril/libsecril-client
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils libdl libsecril-client
 LOCAL_MODULE_TAGS := optional
@@ -31,4 +33,35 @@ ifeq ($(TARGET_TUNA_AUDIO_HDMI),true)
 LOCAL_CFLAGS += -DUSE_HDMI_AUDIO
 endif
 
+ifeq ($(TARGET_TUNA_TRACE),true)
+LOCAL_CFLAGS += -DTUNA_TRACE
+endif
+
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_bench_tuna
+LOCAL_SRC_FILES := \
+	audio_hw.c \
+	fir_resampler.c \
+	bench/audio_hw_bench.c \
+	bench/fake_tinyalsa.c \
+	bench/fake_ril.c
+LOCAL_C_INCLUDES += \
+	external/tinyalsa/include \
+	$(call include-path-for, audio-utils) \
+	$(call include-path-for, audio-effects) \
+	$(LOCAL_PATH) \
+	$(LOCAL_PATH)/../include \
+	$(LOCAL_PATH)/../power \
+	$(LOCAL_PATH)/../ril/libsecril-client
+LOCAL_SHARED_LIBRARIES := liblog libcutils libaudioutils libdl libhardware
+LOCAL_MODULE_TAGS := optional
+
+# the HAL is built as in audio.primary.tuna: the benchmark reads its device structure
+ifeq ($(TARGET_TUNA_AUDIO_HDMI),true)
+LOCAL_CFLAGS += -DUSE_HDMI_AUDIO
+endif
+
+include $(BUILD_EXECUTABLE)
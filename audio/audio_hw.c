@@ -17,16 +17,28 @@
 #define LOG_TAG "audio_hw_primary"
 /*#define LOG_NDEBUG 0*/
 
+#include <dlfcn.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <sound/asound.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
 #include <cutils/properties.h>
 
 #include <hardware/hardware.h>
+#include <hardware/power.h>
 
 #include "audio_hw.h"
+#include "tuna_boot_profile.h"
+#include "tuna_trace.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
@@ -43,6 +55,17 @@ struct pcm_config pcm_config_mm = {
 #endif
 };
 
+/* low power: the PCM is started explicitly by out_write_low_power() */
+struct pcm_config pcm_config_mm_lp = {
+    .channels = 2,
+    .rate = MM_LOW_POWER_SAMPLING_RATE, /* changed based on audio policy setting */
+    .period_size = LOW_POWER_PERIOD_SIZE,
+    .period_count = LOW_POWER_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = LOW_POWER_PERIOD_SIZE * LOW_POWER_PERIOD_COUNT,
+    .avail_min = LOW_POWER_PERIOD_SIZE,
+};
+
 /* low latency */
 struct pcm_config pcm_config_tones = {
     .channels = 2,
@@ -66,8 +89,9 @@ struct pcm_config pcm_config_hdmi_multi = {
     .period_size = HDMI_MULTI_PERIOD_SIZE,
     .period_count = HDMI_MULTI_PERIOD_COUNT,
     .format = PCM_FORMAT_S16_LE,
-    .start_threshold = 0,
-    .avail_min = 0,
+    /* start once the silence priming and the first audio period are queued */
+    .start_threshold = HDMI_MULTI_PERIOD_SIZE * (HDMI_MULTI_PRIME_PERIODS + 1),
+    .avail_min = HDMI_MULTI_PERIOD_SIZE,
 };
 #endif
 
@@ -88,11 +112,176 @@ struct pcm_config pcm_config_vx = {
 };
 
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* deep buffer period levels, in short deep buffer periods */
+static const unsigned int deep_buffer_period_multipliers[DEEP_BUFFER_PERIOD_LEVELS] = {
+    1, 2, 4, DEEP_BUFFER_LONG_PERIOD_MULTIPLIER
+};
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* upper bounds of the read/write duration histogram buckets, the last bucket is open */
+static const unsigned int stats_io_bucket_us[STATS_IO_HISTOGRAM_BUCKETS - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000
+};
+
+/* each statistic has a single writer at a time: the max values do not need a CAS loop */
+static void stats_update_max(atomic_ullong *max, uint64_t value)
+{
+    if (value > atomic_load_explicit(max, memory_order_relaxed))
+        atomic_store_explicit(max, value, memory_order_relaxed);
+}
+
+static uint64_t get_thread_cpu_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_io_begin(struct stats_io_clock *clock)
+{
+    clock->wall_ns = get_time_ns();
+    clock->cpu_ns = get_thread_cpu_time_ns();
+}
+
+static void stats_record_io(struct stream_stats *stats, const struct stats_io_clock *start)
+{
+    uint64_t duration_ns = get_time_ns() - start->wall_ns;
+    uint64_t cpu_ns = get_thread_cpu_time_ns() - start->cpu_ns;
+    unsigned int i;
+
+    for (i = 0; i < STATS_IO_HISTOGRAM_BUCKETS - 1; i++)
+        if (duration_ns < (uint64_t)stats_io_bucket_us[i] * 1000)
+            break;
+    atomic_fetch_add_explicit(&stats->io_histogram[i], 1, memory_order_relaxed);
+    stats_update_max(&stats->io_max_ns, duration_ns);
+    atomic_fetch_add_explicit(&stats->io_cpu_ns, cpu_ns, memory_order_relaxed);
+    stats_update_max(&stats->io_cpu_max_ns, cpu_ns);
+}
+
+/* returns the upper bound in us of the histogram bucket containing the given percentile of
+ * the calls, 0 if there is no call and UINT_MAX if it falls in the last, open bucket */
+static unsigned int stats_io_percentile_us(const unsigned int *histogram, unsigned int count,
+                                           unsigned int percent)
+{
+    unsigned int rank = (count * (uint64_t)percent + 99) / 100;
+    unsigned int sum = 0;
+    unsigned int i;
+
+    if (count == 0)
+        return 0;
+
+    for (i = 0; i < STATS_IO_HISTOGRAM_BUCKETS - 1; i++) {
+        sum += histogram[i];
+        if (sum >= rank)
+            return stats_io_bucket_us[i];
+    }
+    return UINT_MAX;
+}
+
+/* locks the hw device mutex, accounting for the time spent waiting for it */
+static void stats_lock_device(struct stream_stats *stats, struct tuna_audio_device *adev)
+{
+    uint64_t start_ns;
+    uint64_t wait_ns;
+
+    if (pthread_mutex_trylock(&adev->lock) == 0)
+        return;
+
+    start_ns = get_time_ns();
+    pthread_mutex_lock(&adev->lock);
+    wait_ns = get_time_ns() - start_ns;
+    atomic_fetch_add_explicit(&stats->lock_wait_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->lock_wait_ns, wait_ns, memory_order_relaxed);
+    stats_update_max(&stats->lock_wait_max_ns, wait_ns);
+}
+
+static void stats_inc(atomic_uint *counter)
+{
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static void stats_record_route(struct route_stats *stats, uint64_t start_ns)
+{
+    uint64_t duration_ns = get_time_ns() - start_ns;
+
+    atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->total_ns, duration_ns, memory_order_relaxed);
+    stats_update_max(&stats->max_ns, duration_ns);
+}
+
+static void stats_dump(int fd, const struct stream_stats *stats)
+{
+    static const unsigned int percents[] = { 50, 90, 99 };
+    unsigned int lock_waits =
+            atomic_load_explicit(&stats->lock_wait_count, memory_order_relaxed);
+    unsigned int histogram[STATS_IO_HISTOGRAM_BUCKETS];
+    unsigned int count = 0;
+    unsigned int i;
+
+    dprintf(fd, "  io duration histogram (ms <1 <2 <5 <10 <20 <50 <100 >=100):");
+    for (i = 0; i < STATS_IO_HISTOGRAM_BUCKETS; i++) {
+        histogram[i] = atomic_load_explicit(&stats->io_histogram[i], memory_order_relaxed);
+        count += histogram[i];
+        dprintf(fd, " %u", histogram[i]);
+    }
+    dprintf(fd, "\n  io duration percentiles:");
+    for (i = 0; i < sizeof(percents) / sizeof(percents[0]); i++) {
+        unsigned int us = stats_io_percentile_us(histogram, count, percents[i]);
+
+        if (us == UINT_MAX)
+            dprintf(fd, " p%u >=%u ms", percents[i],
+                    stats_io_bucket_us[STATS_IO_HISTOGRAM_BUCKETS - 2] / 1000);
+        else
+            dprintf(fd, " p%u <%u ms", percents[i], us / 1000);
+    }
+    dprintf(fd, "\n  io max: %llu us\n", (unsigned long long)
+            atomic_load_explicit(&stats->io_max_ns, memory_order_relaxed) / 1000);
+    dprintf(fd, "  io cpu time: avg %llu us, max %llu us\n",
+            (unsigned long long)(count ?
+                atomic_load_explicit(&stats->io_cpu_ns, memory_order_relaxed) /
+                    count / 1000 : 0),
+            (unsigned long long)
+                atomic_load_explicit(&stats->io_cpu_max_ns, memory_order_relaxed) / 1000);
+    dprintf(fd, "  hw device lock waits: %u, avg %llu us, max %llu us\n", lock_waits,
+            (unsigned long long)(lock_waits ?
+                atomic_load_explicit(&stats->lock_wait_ns, memory_order_relaxed) /
+                    lock_waits / 1000 : 0),
+            (unsigned long long)
+                atomic_load_explicit(&stats->lock_wait_max_ns, memory_order_relaxed) / 1000);
+    dprintf(fd, "  io errors: %u, xruns: %u\n",
+            atomic_load_explicit(&stats->io_errors, memory_order_relaxed),
+            atomic_load_explicit(&stats->xruns, memory_order_relaxed));
+    dprintf(fd, "  standby enter: %u, exit: %u\n",
+            atomic_load_explicit(&stats->standby_enter, memory_order_relaxed),
+            atomic_load_explicit(&stats->standby_exit, memory_order_relaxed));
+}
+
+static void route_stats_dump(int fd, const char *name, const struct route_stats *stats)
+{
+    unsigned int count = atomic_load_explicit(&stats->count, memory_order_relaxed);
+
+    dprintf(fd, "  %s route switches: %u, avg %llu us, max %llu us\n", name, count,
+            (unsigned long long)(count ?
+                atomic_load_explicit(&stats->total_ns, memory_order_relaxed) / count / 1000 : 0),
+            (unsigned long long)
+                atomic_load_explicit(&stats->max_ns, memory_order_relaxed) / 1000);
+}
 
 
 /**
  * NOTE: when multiple mutexes have to be acquired, always respect the following order:
  *        hw device > in stream > out stream
+ *        the capture hub mutex is acquired last: no other mutex is taken while holding it
  */
 
 
@@ -101,35 +290,92 @@ static void select_input_device(struct tuna_audio_device *adev);
 static int adev_set_voice_volume(struct audio_hw_device *dev, float volume);
 static int do_input_standby(struct tuna_stream_in *in);
 static int do_output_standby(struct tuna_stream_out *out);
+static void pcm_pool_flush(struct tuna_audio_device *adev);
+static void capture_hub_standby(struct tuna_audio_device *adev);
 static void in_update_aux_channels(struct tuna_stream_in *in, effect_handle_t effect);
+static int in_alloc_buffers(struct tuna_stream_in *in);
+static void echo_ring_attach(struct tuna_stream_in *in);
+static void echo_ring_detach(struct tuna_stream_in *in);
+
+/* Resolve the mixer controls of all route tables once. Controls shared by several tables
+ * (e.g. the MM UL muxes) get a single cache entry so that their last written value is
+ * tracked across tables. */
+static int init_route_cache(struct tuna_audio_device *adev)
+{
+    struct route_setting **table;
+    unsigned int i, j;
+
+    adev->num_route_ctls = 0;
+
+    for (table = route_tables; *table != NULL; table++) {
+        struct route_setting *route = *table;
+
+        for (i = 0; route[i].ctl_name; i++) {
+            struct route_ctl *cache = NULL;
+
+            for (j = 0; j < adev->num_route_ctls; j++) {
+                if (strcmp(adev->route_ctls[j].name, route[i].ctl_name) == 0) {
+                    cache = &adev->route_ctls[j];
+                    break;
+                }
+            }
+
+            if (cache == NULL) {
+                if (adev->num_route_ctls >= MAX_ROUTE_CTLS) {
+                    ALOGE("init_route_cache(): too many route controls");
+                    return -ENOMEM;
+                }
+                cache = &adev->route_ctls[adev->num_route_ctls++];
+                cache->name = route[i].ctl_name;
+                cache->ctl = mixer_get_ctl_by_name(adev->mixer, route[i].ctl_name);
+                cache->valid = false;
+                if (!cache->ctl) {
+                    ALOGE("init_route_cache(): cannot find control %s", route[i].ctl_name);
+                    return -EINVAL;
+                }
+            }
+            route[i].cache = cache;
+        }
+    }
+
+    return 0;
+}
 
 /* The enable flag when 0 makes the assumption that enums are disabled by
- * "Off" and integers/booleans by 0 */
-static int set_route_by_array(struct mixer *mixer, struct route_setting *route,
+ * "Off" and integers/booleans by 0.
+ * Only the controls whose value differs from the last one written are updated. */
+static int set_route_by_array(struct mixer *mixer __unused, struct route_setting *route,
                               int enable)
 {
-    struct mixer_ctl *ctl;
+    struct route_ctl *cache;
     unsigned int i, j;
 
     /* Go through the route array and set each value */
     i = 0;
     while (route[i].ctl_name) {
-        ctl = mixer_get_ctl_by_name(mixer, route[i].ctl_name);
-        if (!ctl)
+        cache = route[i].cache;
+        if (!cache)
             return -EINVAL;
 
         if (route[i].strval) {
-            if (enable)
-                mixer_ctl_set_enum_by_string(ctl, route[i].strval);
-            else
-                mixer_ctl_set_enum_by_string(ctl, "Off");
+            const char *strval = enable ? route[i].strval : "Off";
+
+            if (!cache->valid || !cache->strval || strcmp(cache->strval, strval) != 0) {
+                cache->valid = (mixer_ctl_set_enum_by_string(cache->ctl, strval) == 0);
+                cache->strval = strval;
+            }
         } else {
-            /* This ensures multiple (i.e. stereo) values are set jointly */
-            for (j = 0; j < mixer_ctl_get_num_values(ctl); j++) {
-                if (enable)
-                    mixer_ctl_set_value(ctl, j, route[i].intval);
-                else
-                    mixer_ctl_set_value(ctl, j, 0);
+            int intval = enable ? route[i].intval : 0;
+
+            if (!cache->valid || cache->strval || cache->intval != intval) {
+                cache->valid = true;
+                /* This ensures multiple (i.e. stereo) values are set jointly */
+                for (j = 0; j < mixer_ctl_get_num_values(cache->ctl); j++) {
+                    if (mixer_ctl_set_value(cache->ctl, j, intval) != 0)
+                        cache->valid = false;
+                }
+                cache->intval = intval;
+                cache->strval = NULL;
             }
         }
         i++;
@@ -253,7 +499,7 @@ static void set_incall_device(struct tuna_audio_device *adev)
     }
 
     /* if output device isn't supported, open modem side to handset by default */
-    ril_set_call_audio_path(adev->ril_handle, device_type);
+    ril_queue_call_audio_path(adev->ril_handle, device_type);
 }
 
 static void set_input_volumes(struct tuna_audio_device *adev, int main_mic_on,
@@ -305,9 +551,42 @@ static void set_input_volumes(struct tuna_audio_device *adev, int main_mic_on,
         mixer_ctl_set_value(adev->mixer_ctls.amic_ul_volume, channel, volume);
 }
 
-static void set_output_volumes(struct tuna_audio_device *adev, bool tty_volume)
+/* set_output_gains() only writes the gains differing from the values last written: most
+ * mode and device changes leave the majority of them unchanged.
+ * gains[] entries set to OUTPUT_GAIN_NONE are left as they are. */
+static void set_output_gains(struct tuna_audio_device *adev, const int *gains)
 {
+    struct mixer_ctl *ctls[OUTPUT_GAIN_TOTAL] = {
+        [OUTPUT_GAIN_SPEAKER] = adev->mixer_ctls.speaker_volume,
+        [OUTPUT_GAIN_HEADSET] = adev->mixer_ctls.headset_volume,
+        [OUTPUT_GAIN_TONES_DL1] = adev->mixer_ctls.tones_dl1_volume,
+        [OUTPUT_GAIN_VX_DL2] = adev->mixer_ctls.vx_dl2_volume,
+        [OUTPUT_GAIN_TONES_DL2] = adev->mixer_ctls.tones_dl2_volume,
+        [OUTPUT_GAIN_MM_DL1] = adev->mixer_ctls.mm_dl1_volume,
+        [OUTPUT_GAIN_MM_DL2] = adev->mixer_ctls.mm_dl2_volume,
+        [OUTPUT_GAIN_EARPIECE] = adev->mixer_ctls.earpiece_volume,
+    };
+    unsigned int i;
     unsigned int channel;
+    unsigned int channels;
+
+    for (i = 0; i < OUTPUT_GAIN_TOTAL; i++) {
+        if (gains[i] == OUTPUT_GAIN_NONE || gains[i] == adev->output_gains[i])
+            continue;
+
+        /* the analog headset and speaker gains are stereo */
+        channels = (i == OUTPUT_GAIN_SPEAKER || i == OUTPUT_GAIN_HEADSET) ? 2 : 1;
+        adev->output_gains[i] = gains[i];
+        for (channel = 0; channel < channels; channel++) {
+            if (mixer_ctl_set_value(ctls[i], channel, gains[i]) != 0)
+                adev->output_gains[i] = OUTPUT_GAIN_NONE;
+        }
+    }
+}
+
+static void set_output_volumes(struct tuna_audio_device *adev, bool tty_volume)
+{
+    int gains[OUTPUT_GAIN_TOTAL];
     int speaker_volume;
     int headset_volume;
     int earpiece_volume;
@@ -369,48 +648,36 @@ static void set_output_volumes(struct tuna_audio_device *adev, bool tty_volume)
         speaker_volume = speaker_max_db;
     }
 
-    for (channel = 0; channel < 2; channel++) {
-        mixer_ctl_set_value(adev->mixer_ctls.speaker_volume, channel,
-            DB_TO_SPEAKER_VOLUME(speaker_volume));
-        mixer_ctl_set_value(adev->mixer_ctls.headset_volume, channel,
-            DB_TO_HEADSET_VOLUME(headset_volume));
-    }
+    gains[OUTPUT_GAIN_SPEAKER] = DB_TO_SPEAKER_VOLUME(speaker_volume);
+    gains[OUTPUT_GAIN_HEADSET] = DB_TO_HEADSET_VOLUME(headset_volume);
 
     if (!speaker_on)
         speaker_volume_overrange = MIXER_ABE_GAIN_0DB;
 
+    /* VX DL2 is only driven in call */
+    gains[OUTPUT_GAIN_VX_DL2] = OUTPUT_GAIN_NONE;
     if (adev->mode == AUDIO_MODE_IN_CALL) {
-        mixer_ctl_set_value(adev->mixer_ctls.tones_dl1_volume, 0,
-                            MIXER_ABE_GAIN_0DB + dl1_volume_correction);
-        mixer_ctl_set_value(adev->mixer_ctls.vx_dl2_volume, 0,
-                                speaker_volume_overrange);
-        mixer_ctl_set_value(adev->mixer_ctls.tones_dl2_volume, 0,
-                                speaker_volume_overrange + dl2_volume_correction);
+        gains[OUTPUT_GAIN_TONES_DL1] = MIXER_ABE_GAIN_0DB + dl1_volume_correction;
+        gains[OUTPUT_GAIN_VX_DL2] = speaker_volume_overrange;
+        gains[OUTPUT_GAIN_TONES_DL2] = speaker_volume_overrange + dl2_volume_correction;
     } else if ((adev->mode == AUDIO_MODE_IN_COMMUNICATION) ||
 		    (adev->mode == AUDIO_MODE_RINGTONE)) {
-        mixer_ctl_set_value(adev->mixer_ctls.tones_dl1_volume, 0,
-                            MIXER_ABE_GAIN_0DB);
-        mixer_ctl_set_value(adev->mixer_ctls.tones_dl2_volume, 0,
-                                speaker_volume_overrange);
+        gains[OUTPUT_GAIN_TONES_DL1] = MIXER_ABE_GAIN_0DB;
+        gains[OUTPUT_GAIN_TONES_DL2] = speaker_volume_overrange;
     } else {
-        mixer_ctl_set_value(adev->mixer_ctls.tones_dl1_volume, 0,
-                            MIXER_ABE_GAIN_0DB + dl1_volume_correction);
-        mixer_ctl_set_value(adev->mixer_ctls.tones_dl2_volume, 0,
-                                speaker_volume_overrange + dl2_volume_correction);
+        gains[OUTPUT_GAIN_TONES_DL1] = MIXER_ABE_GAIN_0DB + dl1_volume_correction;
+        gains[OUTPUT_GAIN_TONES_DL2] = speaker_volume_overrange + dl2_volume_correction;
     }
 
-    mixer_ctl_set_value(adev->mixer_ctls.mm_dl1_volume, 0,
-                        MIXER_ABE_GAIN_0DB + dl1_volume_correction);
-    mixer_ctl_set_value(adev->mixer_ctls.mm_dl2_volume, 0,
-                            speaker_volume_overrange + dl2_volume_correction);
+    gains[OUTPUT_GAIN_MM_DL1] = MIXER_ABE_GAIN_0DB + dl1_volume_correction;
+    gains[OUTPUT_GAIN_MM_DL2] = speaker_volume_overrange + dl2_volume_correction;
+    gains[OUTPUT_GAIN_EARPIECE] = DB_TO_EARPIECE_VOLUME(earpiece_volume);
 
-    mixer_ctl_set_value(adev->mixer_ctls.earpiece_volume, 0,
-        DB_TO_EARPIECE_VOLUME(earpiece_volume));
+    set_output_gains(adev, gains);
 }
 
 static void force_all_standby(struct tuna_audio_device *adev)
 {
-    struct tuna_stream_in *in;
     struct tuna_stream_out *out;
 
     /* only needed for low latency output streams as other streams are not used
@@ -422,13 +689,10 @@ static void force_all_standby(struct tuna_audio_device *adev)
         do_output_standby(out);
         pthread_mutex_unlock(&out->lock);
     }
+    /* the voice paths are set up with the low latency PCMs closed */
+    pcm_pool_flush(adev);
 
-    if (adev->active_input) {
-        in = adev->active_input;
-        pthread_mutex_lock(&in->lock);
-        do_input_standby(in);
-        pthread_mutex_unlock(&in->lock);
-    }
+    capture_hub_standby(adev);
 }
 
 static void select_mode(struct tuna_audio_device *adev)
@@ -453,8 +717,10 @@ static void select_mode(struct tuna_audio_device *adev)
             } else
                 adev->out_device &= ~AUDIO_DEVICE_OUT_SPEAKER;
             select_output_device(adev);
+            /* the modem audio path must be set before the modem PCMs are started */
+            ril_wait_queue();
             start_call(adev);
-            ril_set_call_volume(adev->ril_handle, SOUND_TYPE_VOICE, adev->voice_volume);
+            ril_queue_call_volume(adev->ril_handle, SOUND_TYPE_VOICE, adev->voice_volume);
             adev->in_call = 1;
         }
     } else {
@@ -472,6 +738,7 @@ static void select_mode(struct tuna_audio_device *adev)
 
 static void select_output_device(struct tuna_audio_device *adev)
 {
+    uint64_t start_ns = get_time_ns();
     int headset_on;
     int headphone_on;
     int speaker_on;
@@ -482,6 +749,8 @@ static void select_output_device(struct tuna_audio_device *adev)
     bool tty_volume = false;
     unsigned int channel;
 
+    TUNA_TRACE_SCOPE("select_output_device");
+
     /* Mute VX_UL to avoid pop noises in the tx path
      * during call before switch changes.
      */
@@ -613,10 +882,13 @@ static void select_output_device(struct tuna_audio_device *adev)
     }
 
     mixer_ctl_set_value(adev->mixer_ctls.sidetone_capture, 0, sidetone_capture_on);
+
+    stats_record_route(&adev->output_route_stats, start_ns);
 }
 
 static void select_input_device(struct tuna_audio_device *adev)
 {
+    uint64_t start_ns = get_time_ns();
     int headset_on = 0;
     int main_mic_on = 0;
     int sub_mic_on = 0;
@@ -679,23 +951,226 @@ static void select_input_device(struct tuna_audio_device *adev)
     }
 
     set_input_volumes(adev, main_mic_on, headset_on, sub_mic_on);
+
+    stats_record_route(&adev->input_route_stats, start_ns);
+}
+
+static bool pcm_config_equal(const struct pcm_config *a, const struct pcm_config *b)
+{
+    return a->channels == b->channels &&
+            a->rate == b->rate &&
+            a->period_size == b->period_size &&
+            a->period_count == b->period_count &&
+            a->format == b->format &&
+            a->start_threshold == b->start_threshold &&
+            a->stop_threshold == b->stop_threshold &&
+            a->silence_threshold == b->silence_threshold &&
+            a->avail_min == b->avail_min;
+}
+
+/* returns the PCM kept open for this port if it has the same flags and configuration,
+ * prepared for a new start, or opens a new one. A PCM kept for the same port with another
+ * configuration is closed first as a port can only be opened once.
+ * must be called with hw device mutex locked */
+static struct pcm *pcm_pool_open(struct tuna_audio_device *adev, unsigned int card,
+                                 unsigned int port, unsigned int flags,
+                                 struct pcm_config *config)
+{
+    int i;
+
+    for (i = 0; i < PCM_POOL_SIZE; i++) {
+        struct pcm_pool_entry *entry = &adev->pcm_pool[i];
+        struct pcm *pcm = entry->pcm;
+
+        if (pcm == NULL || entry->card != card || entry->port != port)
+            continue;
+
+        entry->pcm = NULL;
+        if (entry->flags == flags && pcm_config_equal(&entry->config, config)) {
+            if (pcm_prepare(pcm) == 0)
+                return pcm;
+            ALOGW("pcm_pool_open() cannot prepare kept pcm: %s", pcm_get_error(pcm));
+        }
+        pcm_close(pcm);
+    }
+
+    return pcm_open(card, port, flags, config);
+}
+
+/* stops the PCM and keeps it open for the standby hold, or closes it if the pool is full.
+ * must be called with hw device mutex locked */
+static void pcm_pool_release(struct tuna_audio_device *adev, unsigned int card,
+                             unsigned int port, unsigned int flags,
+                             const struct pcm_config *config, struct pcm *pcm)
+{
+    int i;
+
+    pcm_stop(pcm);
+    for (i = 0; i < PCM_POOL_SIZE; i++) {
+        struct pcm_pool_entry *entry = &adev->pcm_pool[i];
+
+        if (entry->pcm == NULL) {
+            entry->pcm = pcm;
+            entry->card = card;
+            entry->port = port;
+            entry->flags = flags;
+            entry->config = *config;
+            return;
+        }
+    }
+    pcm_close(pcm);
+}
+
+/* must be called with hw device mutex locked */
+static void pcm_pool_flush_port(struct tuna_audio_device *adev, unsigned int card,
+                                unsigned int port)
+{
+    int i;
+
+    for (i = 0; i < PCM_POOL_SIZE; i++) {
+        struct pcm_pool_entry *entry = &adev->pcm_pool[i];
+
+        if (entry->pcm != NULL && entry->card == card && entry->port == port) {
+            pcm_close(entry->pcm);
+            entry->pcm = NULL;
+        }
+    }
+}
+
+/* must be called with hw device mutex locked */
+static void pcm_pool_flush(struct tuna_audio_device *adev)
+{
+    int i;
+
+    for (i = 0; i < PCM_POOL_SIZE; i++) {
+        if (adev->pcm_pool[i].pcm != NULL) {
+            pcm_close(adev->pcm_pool[i].pcm);
+            adev->pcm_pool[i].pcm = NULL;
+        }
+    }
+}
+
+/* card and port of each low latency output PCM */
+static void out_get_low_latency_port(int pcm_index, unsigned int *card, unsigned int *port)
+{
+    *card = CARD_TUNA_DEFAULT;
+    switch (pcm_index) {
+    case PCM_SPDIF:
+        *port = PORT_SPDIF;
+        break;
+#ifdef USE_HDMI_AUDIO
+    case PCM_HDMI:
+        *card = CARD_OMAP4_HDMI;
+        *port = PORT_HDMI;
+        break;
+#endif
+    case PCM_NORMAL:
+    default:
+        *port = PORT_TONES;
+        break;
+    }
+}
+
+/* must be called with hw device mutex locked */
+static bool outputs_all_standby(struct tuna_audio_device *adev)
+{
+    int i;
+
+    for (i = 0; i < OUTPUT_TOTAL; i++) {
+        if (adev->outputs[i] != NULL && !adev->outputs[i]->standby)
+            return false;
+    }
+    return true;
+}
+
+/* (re)starts the standby hold timer of the route worker.
+ * must be called with hw device mutex locked */
+static void standby_hold_schedule(struct tuna_audio_device *adev)
+{
+    pthread_mutex_lock(&adev->route_lock);
+    adev->standby_hold_deadline_ns = get_time_ns() +
+            (uint64_t)adev->standby_hold_ms * 1000000ULL;
+    pthread_cond_signal(&adev->route_cond);
+    pthread_mutex_unlock(&adev->route_lock);
+}
+
+/* end of the standby hold: closes the kept PCMs and turns the output stage off unless an
+ * output was started in the meantime.
+ * must be called with hw device mutex locked */
+static void standby_hold_expire(struct tuna_audio_device *adev)
+{
+    pcm_pool_flush(adev);
+
+    if (adev->output_stage_warm) {
+        adev->output_stage_warm = false;
+        if (outputs_all_standby(adev) && adev->mode != AUDIO_MODE_IN_CALL) {
+            set_route_by_array(adev->mixer, hs_output, 0);
+            set_route_by_array(adev->mixer, hf_output, 0);
+        }
+    }
+}
+
+/* holds the CPU frequency floor for a starting low latency stream and pins the calling
+ * thread, which runs the stream I/O, to AUDIO_PERF_CPU until perf_lock_release() */
+static void perf_lock_acquire(struct tuna_audio_device *adev, struct perf_lock *lock)
+{
+    cpu_set_t cpus;
+    pid_t tid = gettid();
+
+    if (lock->handle < 0 && adev->perf_lock_acquire) {
+        lock->handle = adev->perf_lock_acquire(AUDIO_PERF_MIN_FREQ_KHZ);
+        if (lock->handle < 0)
+            ALOGW("perf_lock_acquire() cannot hold %u kHz: %s", AUDIO_PERF_MIN_FREQ_KHZ,
+                  strerror(-lock->handle));
+    }
+
+    if (lock->tid == tid)
+        return;
+    if (lock->tid != 0)
+        sched_setaffinity(lock->tid, sizeof(lock->saved_cpus), &lock->saved_cpus);
+    lock->tid = 0;
+
+    if (sched_getaffinity(tid, sizeof(lock->saved_cpus), &lock->saved_cpus) != 0)
+        return;
+    CPU_ZERO(&cpus);
+    CPU_SET(AUDIO_PERF_CPU, &cpus);
+    if (sched_setaffinity(tid, sizeof(cpus), &cpus) != 0) {
+        ALOGW("perf_lock_acquire() cannot pin thread %d: %s", tid, strerror(errno));
+        return;
+    }
+    lock->tid = tid;
+}
+
+/* may be called from any thread: the affinity is restored on the pinned one */
+static void perf_lock_release(struct tuna_audio_device *adev, struct perf_lock *lock)
+{
+    if (lock->handle >= 0) {
+        adev->perf_lock_release(lock->handle);
+        lock->handle = -1;
+    }
+    /* fails harmlessly if the thread has exited */
+    if (lock->tid != 0) {
+        sched_setaffinity(lock->tid, sizeof(lock->saved_cpus), &lock->saved_cpus);
+        lock->tid = 0;
+    }
 }
 
 /* must be called with hw device and output stream mutexes locked */
 static int start_output_stream_low_latency(struct tuna_stream_out *out)
 {
     struct tuna_audio_device *adev = out->dev;
-#ifdef PLAYBACK_MMAP
-    unsigned int flags = PCM_OUT | PCM_MMAP | PCM_NOIRQ;
-#else
-    unsigned int flags = PCM_OUT;
-#endif
+    unsigned int flags = LOW_LATENCY_PCM_FLAGS;
+    unsigned int card;
+    unsigned int port;
     int i;
     bool success = true;
 
-    if (adev->mode != AUDIO_MODE_IN_CALL) {
+    /* the output stage left on during the standby hold is still routed to out_device:
+     * every routing change since then went through select_output_device() */
+    if (adev->mode != AUDIO_MODE_IN_CALL && !adev->output_stage_warm) {
         select_output_device(adev);
     }
+    adev->output_stage_warm = false;
 
     /* default to low power: will be corrected in out_write if necessary before first write to
      * tinyalsa.
@@ -708,8 +1183,9 @@ static int start_output_stream_low_latency(struct tuna_stream_out *out)
             out->config[PCM_NORMAL].rate = MM_FULL_POWER_SAMPLING_RATE;
         else
             out->config[PCM_NORMAL].rate = MM_LOW_POWER_SAMPLING_RATE;
-        out->pcm[PCM_NORMAL] = pcm_open(CARD_TUNA_DEFAULT, PORT_TONES,
-                                            flags, &out->config[PCM_NORMAL]);
+        out_get_low_latency_port(PCM_NORMAL, &card, &port);
+        out->pcm[PCM_NORMAL] = pcm_pool_open(adev, card, port,
+                                             flags, &out->config[PCM_NORMAL]);
     }
 
     if (adev->out_device & AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET) {
@@ -719,8 +1195,9 @@ static int start_output_stream_low_latency(struct tuna_stream_out *out)
             out->config[PCM_SPDIF].rate = MM_FULL_POWER_SAMPLING_RATE;
         else
             out->config[PCM_SPDIF].rate = MM_LOW_POWER_SAMPLING_RATE;
-        out->pcm[PCM_SPDIF] = pcm_open(CARD_TUNA_DEFAULT, PORT_SPDIF,
-                                           flags, &out->config[PCM_SPDIF]);
+        out_get_low_latency_port(PCM_SPDIF, &card, &port);
+        out->pcm[PCM_SPDIF] = pcm_pool_open(adev, card, port,
+                                            flags, &out->config[PCM_SPDIF]);
     }
 
 #ifdef USE_HDMI_AUDIO
@@ -730,8 +1207,9 @@ static int start_output_stream_low_latency(struct tuna_stream_out *out)
         /* HDMI output in use */
         out->config[PCM_HDMI] = pcm_config_tones;
         out->config[PCM_HDMI].rate = MM_LOW_POWER_SAMPLING_RATE;
-        out->pcm[PCM_HDMI] = pcm_open(CARD_OMAP4_HDMI, PORT_HDMI,
-                                          flags, &out->config[PCM_HDMI]);
+        out_get_low_latency_port(PCM_HDMI, &card, &port);
+        out->pcm[PCM_HDMI] = pcm_pool_open(adev, card, port,
+                                           flags, &out->config[PCM_HDMI]);
     }
 #endif
 
@@ -746,15 +1224,102 @@ static int start_output_stream_low_latency(struct tuna_stream_out *out)
     }
 
     if (success) {
-        if (adev->echo_reference != NULL)
-            out->echo_reference = adev->echo_reference;
-
+        perf_lock_acquire(adev, &out->perf_lock);
         return 0;
     }
 
     return -ENOMEM;
 }
 
+/* must be called with output stream mutex locked */
+static int deep_buffer_wake_threshold(struct tuna_stream_out *out, int level)
+{
+    int period = DEEP_BUFFER_SHORT_PERIOD_SIZE * deep_buffer_period_multipliers[level];
+    int write_threshold = MIN(period + MAX(DEEP_BUFFER_MIN_WAKE_MARGIN, period),
+                              (int)pcm_get_buffer_size(out->pcm[PCM_NORMAL]));
+
+    return write_threshold - period;
+}
+
+/* must be called with output stream mutex locked */
+static void deep_buffer_set_period_level(struct tuna_stream_out *out, int level)
+{
+    int period = DEEP_BUFFER_SHORT_PERIOD_SIZE * deep_buffer_period_multipliers[level];
+
+    out->wake_threshold = deep_buffer_wake_threshold(out, level);
+    out->write_threshold = out->wake_threshold + period;
+    out->period_level = level;
+    out->clean_wakeups = 0;
+}
+
+/* deep_buffer_update_period_level() picks the period for the next wakeup from the underrun
+ * history and from how late the previous wakeups were compared to the margin a longer period
+ * would leave. must be called with output stream mutex locked */
+static void deep_buffer_update_period_level(struct tuna_stream_out *out, bool allow_long,
+                                            bool woke_up, bool underrun)
+{
+    int max_level;
+
+    if (underrun) {
+        ALOGV("deep buffer underrun at period level %d", out->period_level);
+        stats_inc(&out->stats.xruns);
+        out->period_ceiling = MAX(out->period_level - 1, 0);
+        out->underrun_hold = DEEP_BUFFER_UNDERRUN_HOLD_WAKEUPS;
+        deep_buffer_set_period_level(out, out->period_ceiling);
+        return;
+    }
+
+    if (!woke_up)
+        return;
+
+    if (out->underrun_hold > 0 && --out->underrun_hold == 0)
+        out->period_ceiling = DEEP_BUFFER_PERIOD_LEVELS - 1;
+
+    max_level = allow_long ? out->period_ceiling : 0;
+    if (out->period_level > max_level) {
+        deep_buffer_set_period_level(out, max_level);
+    } else if (out->period_level < max_level &&
+            ++out->clean_wakeups >= DEEP_BUFFER_PROMOTE_WAKEUPS) {
+        int next_margin = deep_buffer_wake_threshold(out, out->period_level + 1);
+
+        if (out->wake_late_frames < (unsigned int)next_margin / 2)
+            deep_buffer_set_period_level(out, out->period_level + 1);
+        else
+            out->clean_wakeups = 0;
+    }
+}
+
+/* deep_buffer_wait() waits until no more than 'target' frames are left in the kernel buffer.
+ * The PCM is polled rather than slept on so that xruns are reported right away.
+ * Returns the number of frames in the kernel buffer or a negative error.
+ * must be called with output stream mutex locked */
+static int deep_buffer_wait(struct tuna_stream_out *out, int target)
+{
+    for (;;) {
+        struct timespec time_stamp;
+        unsigned int avail;
+        int kernel_frames;
+        int timeout_ms;
+        int ret;
+
+        if (pcm_get_htimestamp(out->pcm[PCM_NORMAL], &avail, &time_stamp) < 0)
+            return -ENODATA;
+        kernel_frames = pcm_get_buffer_size(out->pcm[PCM_NORMAL]) - avail;
+        if (kernel_frames <= target)
+            return kernel_frames;
+
+        timeout_ms = ((int64_t)(kernel_frames - target) * 1000) / out->sample_rate;
+        timeout_ms = MAX(timeout_ms, MIN_WRITE_SLEEP_US / 1000);
+        ret = pcm_wait(out->pcm[PCM_NORMAL], timeout_ms);
+        if (ret < 0)
+            return ret;
+        /* In NOIRQ mode the driver does not wake poll() up: it only returns early if the
+         * ALSA avail_min is already met, in which case sleep for the remaining time */
+        if (ret > 0)
+            usleep(timeout_ms * 1000);
+    }
+}
+
 /* must be called with hw device and output stream mutexes locked */
 static int start_output_stream_deep_buffer(struct tuna_stream_out *out)
 {
@@ -779,15 +1344,45 @@ static int start_output_stream_deep_buffer(struct tuna_stream_out *out)
         return -ENOMEM;
     }
 
-    out->use_long_periods = adev->screen_off && !adev->active_input;
-    if (out->use_long_periods) {
-        pcm_set_avail_min(out->pcm[PCM_NORMAL], DEEP_BUFFER_LONG_PERIOD_SIZE);
-        out->write_threshold = DEEP_BUFFER_LONG_PERIOD_WRITE_THRES;
-    } else {
-        pcm_set_avail_min(out->pcm[PCM_NORMAL], DEEP_BUFFER_SHORT_PERIOD_SIZE);
-        out->write_threshold = DEEP_BUFFER_SHORT_PERIOD_WRITE_THRES;
+    /* the scheduler in out_write_deep_buffer() decides when to wake up: tinyalsa must not
+     * block a write as long as there is room for one buffer */
+    pcm_set_avail_min(out->pcm[PCM_NORMAL], DEEP_BUFFER_SHORT_PERIOD_SIZE);
+    out->deep_buffer_primed = false;
+    out->period_ceiling = DEEP_BUFFER_PERIOD_LEVELS - 1;
+    out->underrun_hold = 0;
+    out->wake_late_frames = 0;
+    deep_buffer_set_period_level(out, 0);
+
+    return 0;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static int start_output_stream_low_power(struct tuna_stream_out *out)
+{
+    struct tuna_audio_device *adev = out->dev;
+
+    if (adev->mode != AUDIO_MODE_IN_CALL) {
+        select_output_device(adev);
     }
 
+    out->config[PCM_NORMAL] = pcm_config_mm_lp;
+    if (out->sample_rate % 48 == 0)
+        out->config[PCM_NORMAL].rate = MM_FULL_POWER_SAMPLING_RATE;
+    else
+        out->config[PCM_NORMAL].rate = MM_LOW_POWER_SAMPLING_RATE;
+
+    /* period interrupts are kept so that poll() and the callback thread only wake up
+     * once per period */
+    out->pcm[PCM_NORMAL] = pcm_open(CARD_TUNA_DEFAULT, PORT_MM_LP,
+                                    PCM_OUT | PCM_MMAP, &out->config[PCM_NORMAL]);
+    if (out->pcm[PCM_NORMAL] && !pcm_is_ready(out->pcm[PCM_NORMAL])) {
+        ALOGE("cannot open pcm_out driver: %s", pcm_get_error(out->pcm[PCM_NORMAL]));
+        pcm_close(out->pcm[PCM_NORMAL]);
+        out->pcm[PCM_NORMAL] = NULL;
+        return -ENOMEM;
+    }
+    out->offload_started = false;
+
     return 0;
 }
 
@@ -795,6 +1390,8 @@ static int start_output_stream_deep_buffer(struct tuna_stream_out *out)
 static int start_output_stream_hdmi(struct tuna_stream_out *out)
 {
     struct tuna_audio_device *adev = out->dev;
+    unsigned int i;
+    int ret;
 
     /* force standby on low latency output stream to close HDMI driver in case it was in use */
     if (adev->outputs[OUTPUT_LOW_LATENCY] != NULL &&
@@ -804,8 +1401,10 @@ static int start_output_stream_hdmi(struct tuna_stream_out *out)
         do_output_standby(ll_out);
         pthread_mutex_unlock(&ll_out->lock);
     }
+    pcm_pool_flush_port(adev, CARD_OMAP4_HDMI, PORT_HDMI);
 
-    out->pcm[PCM_HDMI] = pcm_open(CARD_OMAP4_HDMI, PORT_HDMI, PCM_OUT, &out->config[PCM_HDMI]);
+    out->pcm[PCM_HDMI] = pcm_open(CARD_OMAP4_HDMI, PORT_HDMI, PCM_OUT | PCM_MMAP,
+                                  &out->config[PCM_HDMI]);
 
     if (out->pcm[PCM_HDMI] && !pcm_is_ready(out->pcm[PCM_HDMI])) {
         ALOGE("cannot open pcm_out driver: %s", pcm_get_error(out->pcm[PCM_HDMI]));
@@ -813,24 +1412,92 @@ static int start_output_stream_hdmi(struct tuna_stream_out *out)
         out->pcm[PCM_HDMI] = NULL;
         return -ENOMEM;
     }
+
+    /* The HDMI audio FIFO assigns samples to speakers in arrival order: if the DMA does
+     * not start on a frame boundary the channels come out swapped. Queue whole periods of
+     * silence in the stream layout first so that the sink locks on to the layout before
+     * any audio reaches it. Being in kernel buffer before the audio frames, the silence is
+     * correctly excluded from the presentation position. */
+    out->hdmi_buf_frames = 0;
+    memset(out->hdmi_buf, 0, pcm_frames_to_bytes(out->pcm[PCM_HDMI], HDMI_MULTI_PERIOD_SIZE));
+    for (i = 0; i < HDMI_MULTI_PRIME_PERIODS; i++) {
+        ret = pcm_mmap_write(out->pcm[PCM_HDMI], out->hdmi_buf,
+                             pcm_frames_to_bytes(out->pcm[PCM_HDMI], HDMI_MULTI_PERIOD_SIZE));
+        if (ret != 0) {
+            ALOGE("cannot prime pcm_out driver: %s", pcm_get_error(out->pcm[PCM_HDMI]));
+            pcm_close(out->pcm[PCM_HDMI]);
+            out->pcm[PCM_HDMI] = NULL;
+            return ret;
+        }
+    }
     return 0;
 }
-#endif
 
-static int check_input_parameters(uint32_t sample_rate, audio_format_t format, int channel_count)
+/* must be called with output stream mutex locked */
+static int out_write_hdmi_periods(struct tuna_stream_out *out, const void *buffer,
+                                  size_t frames)
 {
-    if (format != AUDIO_FORMAT_PCM_16_BIT)
-        return -EINVAL;
+    int ret;
 
-    if ((channel_count < 1) || (channel_count > 2))
-        return -EINVAL;
+    ret = pcm_mmap_write(out->pcm[PCM_HDMI], buffer,
+                         pcm_frames_to_bytes(out->pcm[PCM_HDMI], frames));
+    if (ret == 0)
+        out->written += frames;
+    return ret;
+}
 
-    switch(sample_rate) {
-    case 8000:
-    case 11025:
-    case 16000:
-    case 22050:
-    case 24000:
+/* keeps the DMA fed in whole periods: completes a pending partial period first, writes the
+ * aligned part of the 16 bit frames directly and holds the remainder.
+ * must be called with output stream mutex locked */
+static int out_queue_hdmi_frames(struct tuna_stream_out *out, const int16_t *src,
+                                 size_t in_frames)
+{
+    size_t frame_size = pcm_frames_to_bytes(out->pcm[PCM_HDMI], 1);
+    int ret = 0;
+
+    while (in_frames > 0) {
+        size_t frames;
+
+        if (out->hdmi_buf_frames == 0 && in_frames >= HDMI_MULTI_PERIOD_SIZE) {
+            frames = in_frames - (in_frames % HDMI_MULTI_PERIOD_SIZE);
+            ret = out_write_hdmi_periods(out, src, frames);
+            if (ret != 0)
+                break;
+        } else {
+            frames = HDMI_MULTI_PERIOD_SIZE - out->hdmi_buf_frames;
+            if (frames > in_frames)
+                frames = in_frames;
+            memcpy((char *)out->hdmi_buf + out->hdmi_buf_frames * frame_size, src,
+                   frames * frame_size);
+            out->hdmi_buf_frames += frames;
+            if (out->hdmi_buf_frames == HDMI_MULTI_PERIOD_SIZE) {
+                out->hdmi_buf_frames = 0;
+                ret = out_write_hdmi_periods(out, out->hdmi_buf, HDMI_MULTI_PERIOD_SIZE);
+                if (ret != 0)
+                    break;
+            }
+        }
+        src = (const int16_t *)((const char *)src + frames * frame_size);
+        in_frames -= frames;
+    }
+    return ret;
+}
+#endif
+
+static int check_input_parameters(uint32_t sample_rate, audio_format_t format, int channel_count)
+{
+    if (format != AUDIO_FORMAT_PCM_16_BIT)
+        return -EINVAL;
+
+    if ((channel_count < 1) || (channel_count > 2))
+        return -EINVAL;
+
+    switch(sample_rate) {
+    case 8000:
+    case 11025:
+    case 16000:
+    case 22050:
+    case 24000:
     case 32000:
     case 44100:
     case 48000:
@@ -859,103 +1526,151 @@ static size_t get_input_buffer_size(uint32_t sample_rate, audio_format_t format,
     return size * channel_count * sizeof(short);
 }
 
-static void add_echo_reference(struct tuna_stream_out *out,
-                               struct echo_reference_itfe *reference)
-{
-    pthread_mutex_lock(&out->lock);
-    out->echo_reference = reference;
-    pthread_mutex_unlock(&out->lock);
-}
-
-static void remove_echo_reference(struct tuna_stream_out *out,
-                                  struct echo_reference_itfe *reference)
-{
-    pthread_mutex_lock(&out->lock);
-    if (out->echo_reference == reference) {
-        /* stop writing to echo reference */
-        reference->write(reference, NULL);
-        out->echo_reference = NULL;
-    }
-    pthread_mutex_unlock(&out->lock);
-}
-
-static void put_echo_reference(struct tuna_audio_device *adev,
-                          struct echo_reference_itfe *reference)
+static bool out_format_is_supported(audio_format_t format)
 {
-    if (adev->echo_reference != NULL &&
-            reference == adev->echo_reference) {
-        /* echo reference is taken from the low latency output stream used
-         * for voice use cases */
-        if (adev->outputs[OUTPUT_LOW_LATENCY] != NULL &&
-                !adev->outputs[OUTPUT_LOW_LATENCY]->standby)
-            remove_echo_reference(adev->outputs[OUTPUT_LOW_LATENCY], reference);
-        release_echo_reference(reference);
-        adev->echo_reference = NULL;
-    }
+    return format == AUDIO_FORMAT_PCM_16_BIT || format == AUDIO_FORMAT_PCM_FLOAT ||
+            format == AUDIO_FORMAT_PCM_8_24_BIT;
 }
 
-static struct echo_reference_itfe *get_echo_reference(struct tuna_audio_device *adev,
-                                               audio_format_t format __unused,
-                                               uint32_t channel_count,
-                                               uint32_t sampling_rate)
+/* converts samples from a float, 8.24 or 16 bit stream to the 16 bit PCM format and applies
+ * the gain in the same pass. gain is linear, 1.0 being 0 dB */
+static void pcm_convert_to_16(int16_t *dst, const void *src, audio_format_t format,
+                              size_t samples, float gain)
 {
-    put_echo_reference(adev, adev->echo_reference);
-    /* echo reference is taken from the low latency output stream used
-     * for voice use cases */
-    if (adev->outputs[OUTPUT_LOW_LATENCY] != NULL &&
-            !adev->outputs[OUTPUT_LOW_LATENCY]->standby) {
-        struct audio_stream *stream =
-                &adev->outputs[OUTPUT_LOW_LATENCY]->stream.common;
-        uint32_t wr_channel_count = popcount(stream->get_channels(stream));
-        uint32_t wr_sampling_rate = stream->get_sample_rate(stream);
+    size_t i = 0;
+
+    if (format == AUDIO_FORMAT_PCM_FLOAT || format == AUDIO_FORMAT_PCM_8_24_BIT) {
+        const float *src_f = (const float *)src;
+        const int32_t *src_q = (const int32_t *)src;
+        /* 8.24 samples have 23 fractional bits */
+        float scale = (format == AUDIO_FORMAT_PCM_FLOAT) ? gain * 32768.0f : gain / 256.0f;
+
+#ifdef __ARM_NEON__
+        /* vcvtq_s32_f32() and vqmovn_s32() both saturate */
+        if (format == AUDIO_FORMAT_PCM_FLOAT) {
+            for (; i + 4 <= samples; i += 4) {
+                float32x4_t v = vmulq_n_f32(vld1q_f32(src_f + i), scale);
+                vst1_s16(dst + i, vqmovn_s32(vcvtq_s32_f32(v)));
+            }
+        } else {
+            for (; i + 4 <= samples; i += 4) {
+                float32x4_t v = vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(src_q + i)), scale);
+                vst1_s16(dst + i, vqmovn_s32(vcvtq_s32_f32(v)));
+            }
+        }
+#endif
+        for (; i < samples; i++) {
+            float v = ((format == AUDIO_FORMAT_PCM_FLOAT) ? src_f[i] : (float)src_q[i]) * scale;
 
-        int status = create_echo_reference(AUDIO_FORMAT_PCM_16_BIT,
-                                           channel_count,
-                                           sampling_rate,
-                                           AUDIO_FORMAT_PCM_16_BIT,
-                                           wr_channel_count,
-                                           wr_sampling_rate,
-                                           &adev->echo_reference);
-        if (status == 0)
-            add_echo_reference(adev->outputs[OUTPUT_LOW_LATENCY],
-                               adev->echo_reference);
+            if (v >= 32767.0f)
+                dst[i] = INT16_MAX;
+            else if (v <= -32768.0f)
+                dst[i] = INT16_MIN;
+            else
+                dst[i] = (int16_t)v;
+        }
+    } else {
+        const int16_t *src_16 = (const int16_t *)src;
+        /* Q15 gain, unity gain is handled by the copy */
+        int16_t gain_q15 = (int16_t)(gain * 32768.0f);
+
+        if (gain >= 1.0f) {
+            if (dst != src_16)
+                memmove(dst, src_16, samples * sizeof(int16_t));
+            return;
+        }
+#ifdef __ARM_NEON__
+        for (; i + 8 <= samples; i += 8)
+            vst1q_s16(dst + i, vqrdmulhq_n_s16(vld1q_s16(src_16 + i), gain_q15));
+#endif
+        for (; i < samples; i++)
+            dst[i] = (int16_t)((src_16[i] * gain_q15 + (1 << 14)) >> 15);
     }
-    return adev->echo_reference;
 }
 
-static int get_playback_delay(struct tuna_stream_out *out,
-                       size_t frames,
-                       struct echo_reference_buffer *buffer)
+/* get_playback_delay() returns the time before the next frame written to the low latency
+ * output is rendered.
+ * must be called with output stream mutex locked */
+static int get_playback_delay(struct tuna_stream_out *out, int64_t *delay_ns)
 {
+    struct timespec time_stamp;
+    unsigned int avail;
     size_t kernel_frames;
-    int status;
     int primary_pcm = 0;
 
     /* Find the first active PCM to act as primary */
     while ((primary_pcm < PCM_TOTAL) && !out->pcm[primary_pcm])
         primary_pcm++;
 
-    status = pcm_get_htimestamp(out->pcm[primary_pcm], &kernel_frames, &buffer->time_stamp);
-    if (status < 0) {
-        buffer->time_stamp.tv_sec  = 0;
-        buffer->time_stamp.tv_nsec = 0;
-        buffer->delay_ns           = 0;
-        ALOGV("get_playback_delay(): pcm_get_htimestamp error,"
-                "setting playbackTimestamp to 0");
-        return status;
+    if (primary_pcm == PCM_TOTAL ||
+            pcm_get_htimestamp(out->pcm[primary_pcm], &avail, &time_stamp) < 0) {
+        ALOGV("get_playback_delay(): pcm_get_htimestamp error");
+        return -ENODATA;
     }
 
-    kernel_frames = pcm_get_buffer_size(out->pcm[primary_pcm]) - kernel_frames;
-
-    /* adjust render time stamp with delay added by current driver buffer.
-     * Add the duration of current frame as we want the render time of the last
-     * sample being written. */
-    buffer->delay_ns = (long)(((int64_t)(kernel_frames + frames)* 1000000000)/
-                            out->sample_rate);
+    kernel_frames = pcm_get_buffer_size(out->pcm[primary_pcm]) - avail;
+    *delay_ns = ((int64_t)kernel_frames * 1000000000) / out->sample_rate;
 
     return 0;
 }
 
+/* echo_ring_write() copies frames played on the low latency output to the echo ring.
+ * Only called by the low latency output, with its stream mutex locked */
+static void echo_ring_write(struct tuna_stream_out *out, const int16_t *frames, size_t count)
+{
+    struct echo_ring *ring = &out->dev->echo_ring;
+    uint64_t wr = atomic_load_explicit(&ring->wr, memory_order_relaxed);
+    unsigned int seq;
+    int64_t delay_ns;
+
+    if (get_playback_delay(out, &delay_ns) == 0) {
+        seq = atomic_load_explicit(&ring->anchor_seq, memory_order_relaxed);
+        atomic_store_explicit(&ring->anchor_seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&ring->anchor_pos, wr, memory_order_relaxed);
+        atomic_store_explicit(&ring->anchor_ns, (int64_t)get_time_ns() + delay_ns,
+                              memory_order_relaxed);
+        atomic_store_explicit(&ring->rate, out->sample_rate, memory_order_relaxed);
+        atomic_store_explicit(&ring->anchor_seq, seq + 2, memory_order_release);
+    }
+
+    /* frames older than the ring size are overwritten: the consumer detects it */
+    if (count > ECHO_RING_FRAMES) {
+        frames += (count - ECHO_RING_FRAMES) * ECHO_RING_CHANNELS;
+        wr += count - ECHO_RING_FRAMES;
+        count = ECHO_RING_FRAMES;
+    }
+    while (count > 0) {
+        size_t offset = wr & (ECHO_RING_FRAMES - 1);
+        size_t chunk = MIN(count, ECHO_RING_FRAMES - offset);
+
+        memcpy(ring->buf + offset * ECHO_RING_CHANNELS, frames,
+               chunk * ECHO_RING_CHANNELS * sizeof(int16_t));
+        frames += chunk * ECHO_RING_CHANNELS;
+        wr += chunk;
+        count -= chunk;
+    }
+    atomic_store_explicit(&ring->wr, wr, memory_order_release);
+}
+
+/* reads the last anchor published by echo_ring_write(), returns false before the first one */
+static bool echo_ring_get_anchor(struct echo_ring *ring, uint64_t *pos, int64_t *ns,
+                                 uint32_t *rate)
+{
+    unsigned int seq;
+
+    do {
+        seq = atomic_load_explicit(&ring->anchor_seq, memory_order_acquire);
+        *pos = atomic_load_explicit(&ring->anchor_pos, memory_order_relaxed);
+        *ns = atomic_load_explicit(&ring->anchor_ns, memory_order_relaxed);
+        *rate = atomic_load_explicit(&ring->rate, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) ||
+             seq != atomic_load_explicit(&ring->anchor_seq, memory_order_relaxed));
+
+    return *rate != 0;
+}
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
     struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
@@ -999,6 +1714,11 @@ static size_t out_get_buffer_size_deep_buffer(const struct audio_stream *stream)
     return size * audio_stream_out_frame_size((const struct audio_stream_out *)stream);
 }
 
+static size_t out_get_buffer_size_low_power(const struct audio_stream *stream)
+{
+    return LOW_POWER_PERIOD_SIZE * audio_stream_out_frame_size((const struct audio_stream_out *)stream);
+}
+
 #ifdef USE_HDMI_AUDIO
 static size_t out_get_buffer_size_hdmi(const struct audio_stream *stream)
 {
@@ -1013,9 +1733,11 @@ static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
     return out->channel_mask;
 }
 
-static audio_format_t out_get_format(const struct audio_stream *stream __unused)
+static audio_format_t out_get_format(const struct audio_stream *stream)
 {
-    return AUDIO_FORMAT_PCM_16_BIT;
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+
+    return out->format;
 }
 
 static int out_set_format(struct audio_stream *stream __unused, audio_format_t format __unused)
@@ -1028,30 +1750,46 @@ static int do_output_standby(struct tuna_stream_out *out)
 {
     struct tuna_audio_device *adev = out->dev;
     int i;
-    bool all_outputs_in_standby = true;
+    /* UI sounds come seconds apart: keep the low latency PCMs and the output stage ready
+     * for the next one during the standby hold */
+    bool hold = out == adev->outputs[OUTPUT_LOW_LATENCY] && adev->standby_hold_ms != 0 &&
+            adev->mode != AUDIO_MODE_IN_CALL;
 
     if (!out->standby) {
         out->standby = 1;
+        stats_inc(&out->stats.standby_enter);
+        perf_lock_release(adev, &out->perf_lock);
 
         for (i = 0; i < PCM_TOTAL; i++) {
             if (out->pcm[i]) {
-                pcm_close(out->pcm[i]);
+                if (hold) {
+                    unsigned int card;
+                    unsigned int port;
+
+                    out_get_low_latency_port(i, &card, &port);
+                    pcm_pool_release(adev, card, port, LOW_LATENCY_PCM_FLAGS,
+                                     &out->config[i], out->pcm[i]);
+                } else {
+                    pcm_close(out->pcm[i]);
+                }
                 out->pcm[i] = NULL;
             }
         }
 
-        for (i = 0; i < OUTPUT_TOTAL; i++) {
-            if (adev->outputs[i] != NULL && !adev->outputs[i]->standby) {
-                all_outputs_in_standby = false;
-                break;
-            }
-        }
         /* if in call, don't turn off the output stage. This will
         be done when the call is ended */
-        if (all_outputs_in_standby && adev->mode != AUDIO_MODE_IN_CALL) {
-            set_route_by_array(adev->mixer, hs_output, 0);
-            set_route_by_array(adev->mixer, hf_output, 0);
+        if (outputs_all_standby(adev) && adev->mode != AUDIO_MODE_IN_CALL) {
+            if (hold) {
+                /* turned off by standby_hold_expire() */
+                adev->output_stage_warm = true;
+            } else {
+                set_route_by_array(adev->mixer, hs_output, 0);
+                set_route_by_array(adev->mixer, hf_output, 0);
+                adev->output_stage_warm = false;
+            }
         }
+        if (hold)
+            standby_hold_schedule(adev);
 
 #ifdef USE_HDMI_AUDIO
         /* force standby on low latency output stream so that it can reuse HDMI driver if
@@ -1066,12 +1804,6 @@ static int do_output_standby(struct tuna_stream_out *out)
             }
         }
 #endif
-
-        /* stop writing to echo reference */
-        if (out->echo_reference != NULL) {
-            out->echo_reference->write(out->echo_reference, NULL);
-            out->echo_reference = NULL;
-        }
     }
     return 0;
 }
@@ -1089,34 +1821,57 @@ static int out_standby(struct audio_stream *stream)
     return status;
 }
 
-static int out_dump(const struct audio_stream *stream __unused, int fd __unused)
+static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+
+    dprintf(fd, "  standby: %d, frames written: %llu\n", out->standby,
+            (unsigned long long)out->written);
+    if (out == out->dev->outputs[OUTPUT_DEEP_BUF])
+        dprintf(fd, "  deep buffer period: %u frames (level %d, ceiling %d)\n",
+                DEEP_BUFFER_SHORT_PERIOD_SIZE * deep_buffer_period_multipliers[out->period_level],
+                out->period_level, out->period_ceiling);
+    stats_dump(fd, &out->stats);
+
     return 0;
 }
 
-static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+/* route_request() queues a routing request for the route worker. Only the last requested
+ * output device is kept. */
+static void route_request(struct tuna_audio_device *adev, int flags, int out_device)
 {
-    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
-    struct tuna_audio_device *adev = out->dev;
-    struct tuna_stream_in *in;
-    struct str_parms *parms;
-    char *str;
-    char value[32];
-    int ret, val = 0;
-    bool force_input_standby = false;
-
-    parms = str_parms_create_str(kvpairs);
+    pthread_mutex_lock(&adev->route_lock);
+    if (flags & ROUTE_REQ_OUTPUT)
+        adev->route_out_device = out_device;
+    adev->route_pending |= flags;
+    adev->route_seq++;
+    pthread_cond_signal(&adev->route_cond);
+    pthread_mutex_unlock(&adev->route_lock);
+}
 
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING, value, sizeof(value));
-    if (ret >= 0) {
-        val = atoi(value);
-        pthread_mutex_lock(&adev->lock);
-        pthread_mutex_lock(&out->lock);
-        if ((adev->out_device != val) && (val != 0)) {
-            /* this is needed only when changing device on low latency output
-             * as other output streams are not used for voice use cases nor
-             * handle duplication to HDMI or SPDIF */
-            if (out == adev->outputs[OUTPUT_LOW_LATENCY] && !out->standby) {
+/* route_apply_pending() applies the routing requests queued so far. The low latency output
+ * stream mutex is only held while deciding and performing its standby.
+ * must be called with hw device mutex locked */
+static void route_apply_pending(struct tuna_audio_device *adev)
+{
+    struct tuna_stream_out *out = adev->outputs[OUTPUT_LOW_LATENCY];
+    bool force_input_standby = false;
+    int pending;
+    int val;
+
+    pthread_mutex_lock(&adev->route_lock);
+    pending = adev->route_pending;
+    val = adev->route_out_device;
+    adev->route_pending = 0;
+    pthread_mutex_unlock(&adev->route_lock);
+
+    if ((pending & ROUTE_REQ_OUTPUT) && (adev->out_device != val)) {
+        /* this is needed only when changing device on low latency output
+         * as other output streams are not used for voice use cases nor
+         * handle duplication to HDMI or SPDIF */
+        if ((pending & ROUTE_REQ_LL_OUTPUT) && out != NULL) {
+            pthread_mutex_lock(&out->lock);
+            if (!out->standby) {
                 /* a change in output device may change the microphone selection */
                 if (adev->active_input &&
                         adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION) {
@@ -1145,26 +1900,131 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
                                          AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET)) ||
                         ((val & AUDIO_DEVICE_OUT_SPEAKER) ^
                         (adev->out_device & AUDIO_DEVICE_OUT_SPEAKER)) ||
-                        (adev->mode == AUDIO_MODE_IN_CALL))
+                        (adev->mode == AUDIO_MODE_IN_CALL)) {
                     do_output_standby(out);
+                    /* reopen on the new path rather than restart the kept PCMs */
+                    pcm_pool_flush(adev);
+                }
             }
-#ifdef USE_HDMI_AUDIO
-            if (out != adev->outputs[OUTPUT_HDMI]) {
-#endif
-                adev->out_device = val;
-                select_output_device(adev);
-#ifdef USE_HDMI_AUDIO
+            pthread_mutex_unlock(&out->lock);
+        }
+        adev->out_device = val;
+        select_output_device(adev);
+    } else if ((pending & ROUTE_REQ_RESELECT) && adev->mode == AUDIO_MODE_IN_CALL) {
+        select_output_device(adev);
+    }
+
+    if (force_input_standby)
+        capture_hub_standby(adev);
+}
+
+/* must be called with route_lock locked */
+static void route_cond_timedwait(struct tuna_audio_device *adev, uint64_t timeout_ns)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ns / 1000000000;
+    ts.tv_nsec += timeout_ns % 1000000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&adev->route_cond, &adev->route_lock, &ts);
+}
+
+static void *route_thread_loop(void *context)
+{
+    struct tuna_audio_device *adev = (struct tuna_audio_device *)context;
+
+    pthread_mutex_lock(&adev->route_lock);
+    for (;;) {
+        unsigned int seq;
+
+        while (!adev->route_pending && !adev->route_thread_exit) {
+            uint64_t now;
+
+            if (adev->standby_hold_deadline_ns == 0) {
+                pthread_cond_wait(&adev->route_cond, &adev->route_lock);
+                continue;
             }
-#endif
+            now = get_time_ns();
+            if (now >= adev->standby_hold_deadline_ns)
+                break;
+            route_cond_timedwait(adev, adev->standby_hold_deadline_ns - now);
         }
-        pthread_mutex_unlock(&out->lock);
-        if (force_input_standby) {
-            in = adev->active_input;
-            pthread_mutex_lock(&in->lock);
-            do_input_standby(in);
-            pthread_mutex_unlock(&in->lock);
+        if (adev->route_thread_exit)
+            break;
+
+        if (!adev->route_pending) {
+            bool rescheduled;
+
+            /* end of the standby hold, unless an output entered standby again while
+             * route_lock was released */
+            adev->standby_hold_deadline_ns = 0;
+            pthread_mutex_unlock(&adev->route_lock);
+            pthread_mutex_lock(&adev->lock);
+            pthread_mutex_lock(&adev->route_lock);
+            rescheduled = adev->standby_hold_deadline_ns != 0;
+            pthread_mutex_unlock(&adev->route_lock);
+            if (!rescheduled)
+                standby_hold_expire(adev);
+            pthread_mutex_unlock(&adev->lock);
+            pthread_mutex_lock(&adev->route_lock);
+            continue;
         }
+
+        /* wait for the requests to settle */
+        do {
+            seq = adev->route_seq;
+            route_cond_timedwait(adev, ROUTE_SETTLE_MS * 1000000ULL);
+        } while (seq != adev->route_seq && !adev->route_thread_exit);
+        pthread_mutex_unlock(&adev->route_lock);
+
+        /* the hw device mutex must be acquired before route_lock */
+        pthread_mutex_lock(&adev->lock);
+        route_apply_pending(adev);
         pthread_mutex_unlock(&adev->lock);
+
+        pthread_mutex_lock(&adev->route_lock);
+    }
+    pthread_mutex_unlock(&adev->route_lock);
+
+    return NULL;
+}
+
+static void stop_route_thread(struct tuna_audio_device *adev)
+{
+    pthread_mutex_lock(&adev->route_lock);
+    adev->route_thread_exit = true;
+    pthread_cond_signal(&adev->route_cond);
+    pthread_mutex_unlock(&adev->route_lock);
+    pthread_join(adev->route_thread, NULL);
+}
+
+static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+    struct tuna_audio_device *adev = out->dev;
+    struct str_parms *parms;
+    char *str;
+    char value[32];
+    int ret, val = 0;
+
+    parms = str_parms_create_str(kvpairs);
+
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING, value, sizeof(value));
+    if (ret >= 0) {
+        val = atoi(value);
+        /* the route is applied asynchronously by the route worker */
+#ifdef USE_HDMI_AUDIO
+        if (val != 0 && out != adev->outputs[OUTPUT_HDMI])
+#else
+        if (val != 0)
+#endif
+            route_request(adev, ROUTE_REQ_OUTPUT |
+                          (out == adev->outputs[OUTPUT_LOW_LATENCY] ? ROUTE_REQ_LL_OUTPUT : 0),
+                          val);
     }
 
     str_parms_destroy(parms);
@@ -1214,7 +2074,13 @@ static uint32_t out_get_latency_low_latency(const struct audio_stream_out *strea
 {
     struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
 
+#ifdef PLAYBACK_WRITER_THREAD
+    /* account for the buffers queued in the writer ring */
+    return (SHORT_PERIOD_SIZE * (PLAYBACK_SHORT_PERIOD_COUNT + PLAYBACK_WRITER_RING_SLOTS) * 1000) /
+            out->sample_rate;
+#else
     return (SHORT_PERIOD_SIZE * PLAYBACK_SHORT_PERIOD_COUNT * 1000) / out->sample_rate;
+#endif
 }
 
 static uint32_t out_get_latency_deep_buffer(const struct audio_stream_out *stream)
@@ -1224,6 +2090,13 @@ static uint32_t out_get_latency_deep_buffer(const struct audio_stream_out *strea
     return (DEEP_BUFFER_LONG_PERIOD_SIZE * PLAYBACK_DEEP_BUFFER_LONG_PERIOD_COUNT * 1000) / out->sample_rate;
 }
 
+static uint32_t out_get_latency_low_power(const struct audio_stream_out *stream)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+
+    return (LOW_POWER_PERIOD_SIZE * LOW_POWER_PERIOD_COUNT * 1000) / out->sample_rate;
+}
+
 #ifdef USE_HDMI_AUDIO
 static uint32_t out_get_latency_hdmi(const struct audio_stream_out *stream)
 {
@@ -1239,6 +2112,24 @@ static int out_set_volume(struct audio_stream_out *stream __unused, float left _
     return -ENOSYS;
 }
 
+/* the low power output is not mixed by AudioFlinger: the volume is applied in
+ * out_write_low_power() */
+static int out_set_volume_low_power(struct audio_stream_out *stream, float left,
+                                    float right)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+
+    if (left < 0.0f || left > 1.0f || right < 0.0f || right > 1.0f)
+        return -EINVAL;
+
+    pthread_mutex_lock(&out->lock);
+    out->gain[0] = (int)(left * LOW_POWER_UNITY_GAIN);
+    out->gain[1] = (int)(right * LOW_POWER_UNITY_GAIN);
+    pthread_mutex_unlock(&out->lock);
+
+    return 0;
+}
+
 #ifdef USE_HDMI_AUDIO
 static int out_set_volume_hdmi(struct audio_stream_out *stream, float left,
                           float right __unused)
@@ -1251,47 +2142,155 @@ static int out_set_volume_hdmi(struct audio_stream_out *stream, float left,
 }
 #endif
 
-static ssize_t out_write_low_latency(struct audio_stream_out *stream, const void* buffer,
-                         size_t bytes)
+/* must be called with hw device and output stream mutexes locked */
+static int out_leave_standby_low_latency(struct tuna_stream_out *out, bool *force_input_standby)
 {
-    int ret;
-    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
     struct tuna_audio_device *adev = out->dev;
-    size_t frames = bytes / audio_stream_out_frame_size(stream);
-    bool force_input_standby = false;
-    struct tuna_stream_in *in;
+    int ret;
+
+    if (!out->standby)
+        return 0;
+
+    ret = start_output_stream_low_latency(out);
+    if (ret != 0)
+        return ret;
+    out->standby = 0;
+    stats_inc(&out->stats.standby_exit);
+    /* a change in output device may change the microphone selection */
+    if (adev->active_input &&
+            adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
+        *force_input_standby = true;
+
+    return 0;
+}
+
+#ifdef PLAYBACK_WRITER_THREAD
+static void ring_sem_wait(sem_t *sem)
+{
+    while (sem_wait(sem) != 0 && errno == EINTR)
+        ;
+}
+#endif
+
+#ifdef PLAYBACK_PARALLEL_SINKS
+static void *out_sink_thread_loop(void *context)
+{
+    struct pcm_sink *sink = (struct pcm_sink *)context;
+
+    for (;;) {
+        ring_sem_wait(&sink->go);
+        if (!sink->buffer)
+            break;
+        sink->ret = PCM_WRITE(sink->out->pcm[sink->pcm], (void *)sink->buffer, sink->bytes);
+        sem_post(&sink->done);
+    }
+
+    return NULL;
+}
+
+static void out_start_sink_threads(struct tuna_stream_out *out)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
     int i;
 
-    /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-     * on the output stream mutex - e.g. executing select_mode() while holding the hw device
-     * mutex
-     */
-    pthread_mutex_lock(&adev->lock);
-    pthread_mutex_lock(&out->lock);
-    if (out->standby) {
-        ret = start_output_stream_low_latency(out);
+    pthread_attr_init(&attr);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = PLAYBACK_WRITER_PRIORITY;
+    pthread_attr_setschedparam(&attr, &param);
+
+    for (i = PCM_NORMAL + 1; i < PCM_TOTAL; i++) {
+        struct pcm_sink *sink = &out->sinks[i];
+        int ret;
+
+        sink->out = out;
+        sink->pcm = i;
+        sem_init(&sink->go, 0, 0);
+        sem_init(&sink->done, 0, 0);
+        ret = pthread_create(&sink->thread, &attr, out_sink_thread_loop, sink);
+        if (ret != 0)
+            ret = pthread_create(&sink->thread, NULL, out_sink_thread_loop, sink);
         if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            goto exit;
+            /* the PCMs are then written one after the other by the writer thread */
+            ALOGW("out_start_sink_threads() cannot create sink thread: %s", strerror(ret));
+            sem_destroy(&sink->go);
+            sem_destroy(&sink->done);
+            while (--i > PCM_NORMAL) {
+                sink = &out->sinks[i];
+                sink->buffer = NULL;
+                sem_post(&sink->go);
+                pthread_join(sink->thread, NULL);
+                sem_destroy(&sink->go);
+                sem_destroy(&sink->done);
+            }
+            break;
         }
-        out->standby = 0;
-        /* a change in output device may change the microphone selection */
-        if (adev->active_input &&
-                adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
-            force_input_standby = true;
     }
-    pthread_mutex_unlock(&adev->lock);
+    pthread_attr_destroy(&attr);
+
+    out->sinks_running = i == PCM_TOTAL;
+}
+
+static void out_stop_sink_threads(struct tuna_stream_out *out)
+{
+    int i;
+
+    if (!out->sinks_running)
+        return;
+
+    for (i = PCM_NORMAL + 1; i < PCM_TOTAL; i++) {
+        struct pcm_sink *sink = &out->sinks[i];
+
+        sink->buffer = NULL;
+        sem_post(&sink->go);
+        pthread_join(sink->thread, NULL);
+        sem_destroy(&sink->go);
+        sem_destroy(&sink->done);
+    }
+    out->sinks_running = false;
+}
+#endif
 
-    if (out->echo_reference != NULL) {
-        struct echo_reference_buffer b;
-        b.raw = (void *)buffer;
-        b.frame_count = frames;
+/* writes one buffer to all active PCMs of a low latency output. When it is duplicated the
+ * secondary PCMs are written by their sink threads, in the same period as PCM_NORMAL.
+ * must be called with output stream mutex locked */
+static int out_write_pcms(struct tuna_stream_out *out, const void *buffer, size_t bytes)
+{
+    int ret = 0;
+    int i;
+#ifdef PLAYBACK_PARALLEL_SINKS
+    bool posted[PCM_TOTAL] = { false };
+    int active = 0;
+
+    for (i = 0; i < PCM_TOTAL; i++) {
+        if (out->pcm[i])
+            active++;
+    }
 
-        get_playback_delay(out, frames, &b);
-        out->echo_reference->write(out->echo_reference, &b);
+    if (out->sinks_running && active > 1) {
+        for (i = PCM_NORMAL + 1; i < PCM_TOTAL; i++) {
+            struct pcm_sink *sink = &out->sinks[i];
+
+            if (!out->pcm[i])
+                continue;
+            sink->buffer = buffer;
+            sink->bytes = bytes;
+            sem_post(&sink->go);
+            posted[i] = true;
+        }
+        if (out->pcm[PCM_NORMAL])
+            ret = PCM_WRITE(out->pcm[PCM_NORMAL], (void *)buffer, bytes);
+        for (i = PCM_NORMAL + 1; i < PCM_TOTAL; i++) {
+            if (!posted[i])
+                continue;
+            ring_sem_wait(&out->sinks[i].done);
+            if (ret == 0)
+                ret = out->sinks[i].ret;
+        }
+        return ret;
     }
+#endif
 
-    /* Write to all active PCMs */
     for (i = 0; i < PCM_TOTAL; i++) {
         if (out->pcm[i]) {
             ret = PCM_WRITE(out->pcm[i], (void *)buffer, bytes);
@@ -1299,26 +2298,238 @@ static ssize_t out_write_low_latency(struct audio_stream_out *stream, const void
                 break;
         }
     }
+    return ret;
+}
 
-exit:
-    pthread_mutex_unlock(&out->lock);
+/* writes one buffer to all active low latency PCMs, starting the stream if needed */
+static void out_write_low_latency_pcms(struct tuna_stream_out *out, const void* buffer,
+                                       size_t bytes)
+{
+    int ret;
+    struct tuna_audio_device *adev = out->dev;
+    size_t frame_size = audio_stream_out_frame_size(&out->stream);
+    size_t frames = bytes / frame_size;
+    bool force_input_standby = false;
 
-    if (ret != 0) {
-        usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
-               out_get_sample_rate(&stream->common));
+    TUNA_TRACE_SCOPE("out_write_low_latency_pcms");
+
+#ifdef PLAYBACK_WRITER_THREAD
+    /* the writer thread only needs the hw device mutex to leave standby: this keeps the
+     * PCM writes running while routing changes hold it */
+    pthread_mutex_lock(&out->lock);
+    ret = 0;
+    if (out->standby) {
+        pthread_mutex_unlock(&out->lock);
+        stats_lock_device(&out->stats, adev);
+        pthread_mutex_lock(&out->lock);
+        ret = out_leave_standby_low_latency(out, &force_input_standby);
+        pthread_mutex_unlock(&adev->lock);
+    }
+#else
+    /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
+     * on the output stream mutex - e.g. executing select_mode() while holding the hw device
+     * mutex
+     */
+    stats_lock_device(&out->stats, adev);
+    pthread_mutex_lock(&out->lock);
+    ret = out_leave_standby_low_latency(out, &force_input_standby);
+    pthread_mutex_unlock(&adev->lock);
+#endif
+    if (ret != 0)
+        goto exit;
+
+    if (atomic_load_explicit(&adev->echo_ring.users, memory_order_relaxed) != 0)
+        echo_ring_write(out, (const int16_t *)buffer, frames);
+
+    ret = out_write_pcms(out, buffer, bytes);
+    if (ret == 0)
+        out->written += frames;
+
+exit:
+    pthread_mutex_unlock(&out->lock);
+
+    if (ret != 0) {
+        stats_inc(&out->stats.io_errors);
+        usleep(frames * 1000000 / out_get_sample_rate(&out->stream.common));
     }
 
     if (force_input_standby) {
         pthread_mutex_lock(&adev->lock);
-        if (adev->active_input) {
-            in = adev->active_input;
-            pthread_mutex_lock(&in->lock);
-            do_input_standby(in);
-            pthread_mutex_unlock(&in->lock);
-        }
+        capture_hub_standby(adev);
         pthread_mutex_unlock(&adev->lock);
     }
+}
+
+#ifdef PLAYBACK_WRITER_THREAD
+/* consumer side of the low latency ring: drains the slots queued by out_write_low_latency()
+ * into the PCMs and executes the commands posted by the AudioFlinger thread */
+static void *out_writer_thread_loop(void *context)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)context;
+    bool standby_requested = false;
+    unsigned int standby_wr = 0;
+
+    for (;;) {
+        unsigned int wr;
+        int cmd;
+
+        ring_sem_wait(&out->ring_filled);
+
+        cmd = atomic_exchange(&out->writer_cmd, 0);
+        if (cmd & WRITER_CMD_EXIT)
+            break;
+        if (cmd & WRITER_CMD_STANDBY) {
+            standby_requested = true;
+            standby_wr = atomic_load(&out->writer_standby_wr);
+        }
+
+        /* a wake up may have been posted by a command rather than a slot: drain every
+         * published slot so that none is left behind */
+        wr = atomic_load_explicit(&out->ring_wr, memory_order_acquire);
+        for (;;) {
+            unsigned int slot;
+
+            /* enter standby once all frames queued before the request are written */
+            if (standby_requested && out->ring_rd == standby_wr) {
+                standby_requested = false;
+                out_standby(&out->stream.common);
+                sem_post(&out->standby_done);
+            }
+            if (out->ring_rd == wr)
+                break;
+
+            slot = out->ring_rd % PLAYBACK_WRITER_RING_SLOTS;
+            out_write_low_latency_pcms(out, out->ring_buf + slot * out->ring_slot_size,
+                                       out->ring_slot_bytes[slot]);
+            out->ring_rd++;
+            sem_post(&out->ring_free);
+        }
+    }
+
+    return NULL;
+}
+
+static int out_start_writer_thread(struct tuna_stream_out *out)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    int ret;
+
+    out->ring_slot_size = out->stream.common.get_buffer_size(&out->stream.common);
+    out->ring_buf = (char *)malloc(out->ring_slot_size * PLAYBACK_WRITER_RING_SLOTS);
+    if (!out->ring_buf)
+        return -ENOMEM;
+
+    out->ring_rd = 0;
+    atomic_init(&out->ring_wr, 0);
+    atomic_init(&out->writer_cmd, 0);
+    atomic_init(&out->writer_standby_wr, 0);
+    sem_init(&out->ring_filled, 0, 0);
+    sem_init(&out->ring_free, 0, PLAYBACK_WRITER_RING_SLOTS);
+    sem_init(&out->standby_done, 0, 0);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = PLAYBACK_WRITER_PRIORITY;
+    pthread_attr_setschedparam(&attr, &param);
+    ret = pthread_create(&out->writer_thread, &attr, out_writer_thread_loop, out);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        ALOGW("out_start_writer_thread() cannot use SCHED_FIFO (%s), using default policy",
+              strerror(ret));
+        ret = pthread_create(&out->writer_thread, NULL, out_writer_thread_loop, out);
+    }
+
+    if (ret != 0) {
+        ALOGE("out_start_writer_thread() cannot create writer thread: %s", strerror(ret));
+        sem_destroy(&out->ring_filled);
+        sem_destroy(&out->ring_free);
+        sem_destroy(&out->standby_done);
+        free(out->ring_buf);
+        out->ring_buf = NULL;
+        return -ret;
+    }
+
+    out->writer_running = true;
+#ifdef PLAYBACK_PARALLEL_SINKS
+    out_start_sink_threads(out);
+#endif
+    return 0;
+}
+
+static void out_stop_writer_thread(struct tuna_stream_out *out)
+{
+    if (!out->writer_running)
+        return;
+
+    atomic_fetch_or(&out->writer_cmd, WRITER_CMD_EXIT);
+    sem_post(&out->ring_filled);
+    pthread_join(out->writer_thread, NULL);
+    out->writer_running = false;
+#ifdef PLAYBACK_PARALLEL_SINKS
+    out_stop_sink_threads(out);
+#endif
+
+    sem_destroy(&out->ring_filled);
+    sem_destroy(&out->ring_free);
+    sem_destroy(&out->standby_done);
+    free(out->ring_buf);
+    out->ring_buf = NULL;
+}
+
+/* called from the AudioFlinger thread: standby is executed by the writer thread once the
+ * frames queued so far have been written, so that the hw device mutex is never taken here.
+ * Returns when the PCMs are closed, as AudioFlinger releases its wake lock after this call */
+static int out_standby_low_latency(struct audio_stream *stream)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+
+    atomic_store(&out->writer_standby_wr,
+                 atomic_load_explicit(&out->ring_wr, memory_order_relaxed));
+    atomic_fetch_or(&out->writer_cmd, WRITER_CMD_STANDBY);
+    sem_post(&out->ring_filled);
+    ring_sem_wait(&out->standby_done);
+
+    return 0;
+}
+#endif
+
+static ssize_t out_write_low_latency(struct audio_stream_out *stream, const void* buffer,
+                         size_t bytes)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+    struct stats_io_clock io_clock;
+#ifdef PLAYBACK_WRITER_THREAD
+    const char *src = (const char *)buffer;
+    size_t remaining = bytes;
+#endif
+
+    TUNA_TRACE_SCOPE("out_write_low_latency");
+#ifdef PLAYBACK_WRITER_THREAD
+    stats_io_begin(&io_clock);
+
+    /* producer side of the ring: neither the hw device nor the output stream mutex is
+     * taken, the only blocking point is waiting for the writer thread to free a slot */
+    while (remaining > 0) {
+        unsigned int wr = atomic_load_explicit(&out->ring_wr, memory_order_relaxed);
+        unsigned int slot = wr % PLAYBACK_WRITER_RING_SLOTS;
+        size_t chunk = MIN(remaining, out->ring_slot_size);
+
+        ring_sem_wait(&out->ring_free);
+        memcpy(out->ring_buf + slot * out->ring_slot_size, src, chunk);
+        out->ring_slot_bytes[slot] = chunk;
+        atomic_store_explicit(&out->ring_wr, wr + 1, memory_order_release);
+        sem_post(&out->ring_filled);
+
+        src += chunk;
+        remaining -= chunk;
+    }
+#else
+    stats_io_begin(&io_clock);
+    out_write_low_latency_pcms(out, buffer, bytes);
+#endif
 
+    stats_record_io(&out->stats, &io_clock);
     return bytes;
 }
 
@@ -1329,14 +2540,20 @@ static ssize_t out_write_deep_buffer(struct audio_stream_out *stream, const void
     struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
     struct tuna_audio_device *adev = out->dev;
     size_t frames = bytes / audio_stream_out_frame_size(&out->stream);
-    bool use_long_periods;
+    bool allow_long_periods;
+    bool woke_up = false;
+    bool underrun = false;
     int kernel_frames;
+    struct stats_io_clock io_clock;
+
+    TUNA_TRACE_SCOPE("out_write_deep_buffer");
+    stats_io_begin(&io_clock);
 
     /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
      * on the output stream mutex - e.g. executing select_mode() while holding the hw device
      * mutex
      */
-    pthread_mutex_lock(&adev->lock);
+    stats_lock_device(&out->stats, adev);
     pthread_mutex_lock(&out->lock);
     if (out->standby) {
         ret = start_output_stream_deep_buffer(out);
@@ -1345,67 +2562,409 @@ static ssize_t out_write_deep_buffer(struct audio_stream_out *stream, const void
             goto exit;
         }
         out->standby = 0;
+        stats_inc(&out->stats.standby_exit);
     }
-    use_long_periods = adev->screen_off && !adev->active_input;
+    allow_long_periods = adev->screen_off && !adev->active_input;
     pthread_mutex_unlock(&adev->lock);
 
-    if (use_long_periods != out->use_long_periods) {
-        if (use_long_periods) {
-            pcm_set_avail_min(out->pcm[PCM_NORMAL], DEEP_BUFFER_LONG_PERIOD_SIZE);
-            out->write_threshold = DEEP_BUFFER_LONG_PERIOD_WRITE_THRES;
-        } else {
-            pcm_set_avail_min(out->pcm[PCM_NORMAL], DEEP_BUFFER_SHORT_PERIOD_SIZE);
-            out->write_threshold = DEEP_BUFFER_SHORT_PERIOD_WRITE_THRES;
+    /* buffers are written back to back until the write threshold is reached, then the
+     * kernel buffer is left to drain to the wake threshold for one period */
+    kernel_frames = deep_buffer_wait(out, INT_MAX);
+    TUNA_TRACE_INT("kernel_frames", kernel_frames);
+    if (kernel_frames >= 0) {
+        underrun = out->deep_buffer_primed && kernel_frames == 0;
+        if (kernel_frames + (int)frames > out->write_threshold) {
+            woke_up = true;
+            kernel_frames = deep_buffer_wait(out, out->wake_threshold);
+            if (kernel_frames == -EPIPE) {
+                underrun = true;
+            } else if (kernel_frames >= 0) {
+                unsigned int late = out->wake_threshold - kernel_frames;
+                out->wake_late_frames = (out->wake_late_frames * 7 + late) / 8;
+            }
         }
-        out->use_long_periods = use_long_periods;
     }
+    deep_buffer_update_period_level(out, allow_long_periods, woke_up, underrun);
 
-    /* do not allow more than out->write_threshold frames in kernel pcm driver buffer */
-    do {
-        struct timespec time_stamp;
-
-        if (pcm_get_htimestamp(out->pcm[PCM_NORMAL],
-                               (unsigned int *)&kernel_frames, &time_stamp) < 0)
-            break;
-        kernel_frames = pcm_get_buffer_size(out->pcm[PCM_NORMAL]) - kernel_frames;
+    if (out->format == AUDIO_FORMAT_PCM_16_BIT) {
+        ret = pcm_mmap_write(out->pcm[PCM_NORMAL], buffer, bytes);
+    } else {
+        /* AudioFlinger already applied the volume: convert only */
+        const char *src = (const char *)buffer;
+        size_t frame_size = audio_stream_out_frame_size(&out->stream);
+        size_t remaining = frames;
 
-        if (kernel_frames > out->write_threshold) {
-            unsigned long time = (unsigned long)
-                    (((int64_t)(kernel_frames - out->write_threshold) * 1000000) / out->sample_rate);
-            if (time < MIN_WRITE_SLEEP_US)
-                time = MIN_WRITE_SLEEP_US;
-            usleep(time);
+        ret = 0;
+        while (remaining > 0 && ret == 0) {
+            size_t chunk = MIN(remaining, PCM_CONVERT_FRAMES);
+
+            pcm_convert_to_16(out->conv_buf, src, out->format,
+                              chunk * out->config[PCM_NORMAL].channels, 1.0f);
+            ret = pcm_mmap_write(out->pcm[PCM_NORMAL], out->conv_buf,
+                                 pcm_frames_to_bytes(out->pcm[PCM_NORMAL], chunk));
+            src += chunk * frame_size;
+            remaining -= chunk;
         }
-    } while (kernel_frames > out->write_threshold);
-
-    ret = pcm_mmap_write(out->pcm[PCM_NORMAL], buffer, bytes);
+    }
+    if (ret == 0) {
+        out->written += frames;
+        out->deep_buffer_primed = true;
+    }
 
 exit:
     pthread_mutex_unlock(&out->lock);
 
     if (ret != 0) {
+        stats_inc(&out->stats.io_errors);
         usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
                out_get_sample_rate(&stream->common));
     }
 
+    stats_record_io(&out->stats, &io_clock);
     return bytes;
 }
 
+/* out_write_low_power() never blocks: only the frames that fit in the kernel buffer are
+ * written and, if the buffer is full, the callback thread signals STREAM_CBK_EVENT_WRITE_READY
+ * once a period can be written */
+static ssize_t out_write_low_power(struct audio_stream_out *stream, const void* buffer,
+                         size_t bytes)
+{
+    int ret;
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+    struct tuna_audio_device *adev = out->dev;
+    size_t frame_size = audio_stream_out_frame_size(&out->stream);
+    size_t frames = bytes / frame_size;
+    const int16_t *src = (const int16_t *)buffer;
+    struct stats_io_clock io_clock;
+    int avail;
+
+    TUNA_TRACE_SCOPE("out_write_low_power");
+    stats_io_begin(&io_clock);
+
+    stats_lock_device(&out->stats, adev);
+    pthread_mutex_lock(&out->lock);
+    if (out->standby) {
+        ret = start_output_stream_low_power(out);
+        if (ret != 0) {
+            pthread_mutex_unlock(&adev->lock);
+            goto exit;
+        }
+        out->standby = 0;
+        stats_inc(&out->stats.standby_exit);
+    }
+    pthread_mutex_unlock(&adev->lock);
+
+    avail = pcm_mmap_avail(out->pcm[PCM_NORMAL]);
+    if (avail < 0 || avail > (int)pcm_get_buffer_size(out->pcm[PCM_NORMAL])) {
+        /* underrun: the PCM is restarted with the next frames written */
+        stats_inc(&out->stats.xruns);
+        pcm_prepare(out->pcm[PCM_NORMAL]);
+        out->offload_started = false;
+        avail = pcm_get_buffer_size(out->pcm[PCM_NORMAL]);
+    }
+    /* tinyalsa would block on writes smaller than avail_min */
+    if (avail < (int)out->config[PCM_NORMAL].avail_min)
+        frames = 0;
+    frames = MIN(frames, (size_t)avail);
+
+    if (frames > 0) {
+        if (out->gain[0] != LOW_POWER_UNITY_GAIN || out->gain[1] != LOW_POWER_UNITY_GAIN) {
+            size_t i;
+
+            for (i = 0; i < frames; i++) {
+                out->gain_buf[2 * i] = (src[2 * i] * out->gain[0]) >> 12;
+                out->gain_buf[2 * i + 1] = (src[2 * i + 1] * out->gain[1]) >> 12;
+            }
+            src = out->gain_buf;
+        }
+        ret = pcm_mmap_write(out->pcm[PCM_NORMAL], src, frames * frame_size);
+        if (ret != 0)
+            goto exit;
+        out->written += frames;
+        if (!out->offload_started && !out->paused) {
+            pcm_start(out->pcm[PCM_NORMAL]);
+            out->offload_started = true;
+        }
+    }
+    if (frames * frame_size < bytes && out->offload_callback != NULL) {
+        out->offload_cmd |= OFFLOAD_CMD_WAIT_WRITE;
+        pthread_cond_signal(&out->offload_cond);
+    }
+    ret = 0;
+
+exit:
+    pthread_mutex_unlock(&out->lock);
+
+    if (ret != 0) {
+        stats_inc(&out->stats.io_errors);
+        usleep(bytes * 1000000 / frame_size / out_get_sample_rate(&stream->common));
+        frames = bytes / frame_size;
+    }
+
+    stats_record_io(&out->stats, &io_clock);
+    return frames * frame_size;
+}
+
+/* must be called with output stream mutex locked */
+static bool offload_cmd_ready(struct tuna_stream_out *out, int cmd, unsigned int *wait_frames)
+{
+    struct pcm *pcm = out->pcm[PCM_NORMAL];
+    struct timespec time_stamp;
+    unsigned int avail;
+    unsigned int period = out->config[PCM_NORMAL].period_size;
+    unsigned int kernel_frames;
+    unsigned int target;
+
+    /* a stream in standby can be written and has nothing left to play */
+    if (pcm == NULL || !out->offload_started)
+        return true;
+    if (pcm_get_htimestamp(pcm, &avail, &time_stamp) < 0)
+        return true;
+    kernel_frames = pcm_get_buffer_size(pcm) - MIN(avail, pcm_get_buffer_size(pcm));
+    TUNA_TRACE_INT("low_power_kernel_frames", kernel_frames);
+
+    if (cmd == OFFLOAD_CMD_WAIT_WRITE)
+        target = pcm_get_buffer_size(pcm) - period;
+    else if (cmd == OFFLOAD_CMD_DRAIN_EARLY)
+        target = period;
+    else
+        target = 0;
+
+    if (kernel_frames <= target)
+        return true;
+
+    *wait_frames = kernel_frames - target;
+    return false;
+}
+
+static void *out_offload_thread_loop(void *context)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)context;
+    static const int cmds[] = { OFFLOAD_CMD_WAIT_WRITE, OFFLOAD_CMD_DRAIN_EARLY,
+                                OFFLOAD_CMD_DRAIN };
+
+    pthread_mutex_lock(&out->lock);
+    for (;;) {
+        unsigned int wait_frames = UINT_MAX;
+        stream_callback_event_t event;
+        int ready = 0;
+        unsigned int i;
+
+        while (!out->offload_thread_exit && (!out->offload_cmd || out->paused))
+            pthread_cond_wait(&out->offload_cond, &out->lock);
+        if (out->offload_thread_exit)
+            break;
+
+        for (i = 0; i < ARRAY_SIZE(cmds); i++) {
+            unsigned int frames;
+
+            if (!(out->offload_cmd & cmds[i]))
+                continue;
+            if (offload_cmd_ready(out, cmds[i], &frames))
+                ready |= cmds[i];
+            else
+                wait_frames = MIN(wait_frames, frames);
+        }
+
+        if (ready) {
+            out->offload_cmd &= ~ready;
+            if ((ready & OFFLOAD_CMD_DRAIN) && out->pcm[PCM_NORMAL] != NULL) {
+                /* the PCM is restarted with the next frames written */
+                pcm_stop(out->pcm[PCM_NORMAL]);
+                pcm_prepare(out->pcm[PCM_NORMAL]);
+                out->offload_started = false;
+            }
+            pthread_mutex_unlock(&out->lock);
+            if (ready & OFFLOAD_CMD_WAIT_WRITE)
+                out->offload_callback(STREAM_CBK_EVENT_WRITE_READY, NULL, out->offload_cookie);
+            if (ready & (OFFLOAD_CMD_DRAIN | OFFLOAD_CMD_DRAIN_EARLY))
+                out->offload_callback(STREAM_CBK_EVENT_DRAIN_READY, NULL, out->offload_cookie);
+            pthread_mutex_lock(&out->lock);
+        } else {
+            struct timespec ts;
+            uint64_t wait_ns = (uint64_t)wait_frames * 1000000000ULL /
+                                    out->config[PCM_NORMAL].rate;
+
+            wait_ns = MAX(wait_ns, (uint64_t)MIN_WRITE_SLEEP_US * 1000);
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += wait_ns / 1000000000ULL;
+            ts.tv_nsec += wait_ns % 1000000000ULL;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&out->offload_cond, &out->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return NULL;
+}
+
+static int out_set_callback(struct audio_stream_out *stream, stream_callback_t callback,
+                            void *cookie)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    out->offload_callback = callback;
+    out->offload_cookie = cookie;
+    pthread_mutex_unlock(&out->lock);
+
+    return 0;
+}
+
+static int out_pause(struct audio_stream_out *stream)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+    int ret = 0;
+
+    pthread_mutex_lock(&out->lock);
+    if (!out->paused) {
+        if (out->offload_started)
+            ret = pcm_ioctl(out->pcm[PCM_NORMAL], SNDRV_PCM_IOCTL_PAUSE, 1);
+        if (ret == 0)
+            out->paused = true;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_resume(struct audio_stream_out *stream)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+    int ret = 0;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->paused) {
+        if (out->offload_started)
+            ret = pcm_ioctl(out->pcm[PCM_NORMAL], SNDRV_PCM_IOCTL_PAUSE, 0);
+        else if (out->pcm[PCM_NORMAL] != NULL && pcm_mmap_avail(out->pcm[PCM_NORMAL]) <
+                    (int)pcm_get_buffer_size(out->pcm[PCM_NORMAL])) {
+            /* frames were written while paused */
+            ret = pcm_start(out->pcm[PCM_NORMAL]);
+            out->offload_started = (ret == 0);
+        }
+        if (ret == 0) {
+            out->paused = false;
+            pthread_cond_signal(&out->offload_cond);
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_drain(struct audio_stream_out *stream, audio_drain_type_t type)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->offload_callback == NULL) {
+        pthread_mutex_unlock(&out->lock);
+        return -ENOSYS;
+    }
+    out->offload_cmd |= (type == AUDIO_DRAIN_EARLY_NOTIFY) ?
+                            OFFLOAD_CMD_DRAIN_EARLY : OFFLOAD_CMD_DRAIN;
+    pthread_cond_signal(&out->offload_cond);
+    pthread_mutex_unlock(&out->lock);
+
+    return 0;
+}
+
+/* only called while paused: discards the frames not played yet */
+static int out_flush(struct audio_stream_out *stream)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->pcm[PCM_NORMAL] != NULL) {
+        pcm_stop(out->pcm[PCM_NORMAL]);
+        pcm_prepare(out->pcm[PCM_NORMAL]);
+    }
+    out->offload_started = false;
+    out->offload_cmd &= ~(OFFLOAD_CMD_DRAIN | OFFLOAD_CMD_DRAIN_EARLY);
+    out->written = 0;
+    pthread_mutex_unlock(&out->lock);
+
+    return 0;
+}
+
+static int out_standby_low_power(struct audio_stream *stream)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+    int status;
+
+    pthread_mutex_lock(&out->dev->lock);
+    pthread_mutex_lock(&out->lock);
+    status = do_output_standby(out);
+    out->offload_started = false;
+    out->paused = false;
+    /* pending events complete immediately once in standby */
+    pthread_cond_signal(&out->offload_cond);
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&out->dev->lock);
+    return status;
+}
+
+static int out_start_offload_thread(struct tuna_stream_out *out)
+{
+    int ret;
+
+    out->gain_buf = (int16_t *)malloc(out_get_buffer_size_low_power(&out->stream.common));
+    if (!out->gain_buf)
+        return -ENOMEM;
+
+    out->gain[0] = LOW_POWER_UNITY_GAIN;
+    out->gain[1] = LOW_POWER_UNITY_GAIN;
+    pthread_cond_init(&out->offload_cond, NULL);
+    ret = pthread_create(&out->offload_thread, NULL, out_offload_thread_loop, out);
+    if (ret != 0) {
+        ALOGE("out_start_offload_thread() cannot create callback thread: %s", strerror(ret));
+        pthread_cond_destroy(&out->offload_cond);
+        free(out->gain_buf);
+        out->gain_buf = NULL;
+        return -ret;
+    }
+
+    return 0;
+}
+
+static void out_stop_offload_thread(struct tuna_stream_out *out)
+{
+    pthread_mutex_lock(&out->lock);
+    out->offload_thread_exit = true;
+    pthread_cond_signal(&out->offload_cond);
+    pthread_mutex_unlock(&out->lock);
+    pthread_join(out->offload_thread, NULL);
+
+    pthread_cond_destroy(&out->offload_cond);
+    free(out->gain_buf);
+    out->gain_buf = NULL;
+}
+
 #ifdef USE_HDMI_AUDIO
 static ssize_t out_write_hdmi(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
-    int ret;
+    int ret = 0;
     struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
     struct tuna_audio_device *adev = out->dev;
     size_t frame_size = audio_stream_out_frame_size(&out->stream);
     size_t in_frames = bytes / frame_size;
+    const char *src;
+    struct stats_io_clock io_clock;
+
+    TUNA_TRACE_SCOPE("out_write_hdmi");
+    stats_io_begin(&io_clock);
 
     /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
      * on the output stream mutex - e.g. executing select_mode() while holding the hw device
      * mutex
      */
-    pthread_mutex_lock(&adev->lock);
+    stats_lock_device(&out->stats, adev);
     pthread_mutex_lock(&out->lock);
     if (out->standby) {
         ret = start_output_stream_hdmi(out);
@@ -1414,37 +2973,118 @@ static ssize_t out_write_hdmi(struct audio_stream_out *stream, const void* buffe
             goto exit;
         }
         out->standby = 0;
+        stats_inc(&out->stats.standby_exit);
     }
     pthread_mutex_unlock(&adev->lock);
 
-    if (out->muted)
-        memset((void *)buffer, 0, bytes);
-
-    ret = pcm_write(out->pcm[PCM_HDMI],
-                   buffer,
-                   pcm_frames_to_bytes(out->pcm[PCM_HDMI], in_frames));
+    /* muting and format conversion are done in a single pass into conv_buf, the
+     * AudioFlinger buffer itself is never modified */
+    src = (const char *)buffer;
+    while (in_frames > 0 && ret == 0) {
+        size_t frames = in_frames;
+        const int16_t *pcm_frames = (const int16_t *)src;
+
+        if (out->format != AUDIO_FORMAT_PCM_16_BIT || out->muted) {
+            frames = MIN(in_frames, PCM_CONVERT_FRAMES);
+            pcm_convert_to_16(out->conv_buf, src, out->format,
+                              frames * out->config[PCM_HDMI].channels,
+                              out->muted ? 0.0f : 1.0f);
+            pcm_frames = out->conv_buf;
+        }
+        ret = out_queue_hdmi_frames(out, pcm_frames, frames);
+        src += frames * frame_size;
+        in_frames -= frames;
+    }
 
 exit:
     pthread_mutex_unlock(&out->lock);
 
     if (ret != 0) {
+        stats_inc(&out->stats.io_errors);
         usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
                out_get_sample_rate_hdmi(&stream->common));
     }
-    /* FIXME: workaround for HDMI multi channel channel swap on first playback after opening
-     * the output stream: force reopening the pcm driver after writing a few periods. */
-    if ((out->restart_periods_cnt > 0) &&
-            (--out->restart_periods_cnt == 0))
-        out_standby(&stream->common);
 
+    stats_record_io(&out->stats, &io_clock);
     return bytes;
 }
 #endif
 
-static int out_get_render_position(const struct audio_stream_out *stream __unused,
-                                   uint32_t *dsp_frames __unused)
+/* must be called with output stream mutex locked */
+static int out_get_presented_frames(struct tuna_stream_out *out, uint64_t *frames,
+                                    struct timespec *timestamp)
 {
-    return -EINVAL;
+    unsigned int avail;
+    size_t kernel_frames;
+    int primary_pcm = 0;
+
+    /* Find the first active PCM to act as primary */
+    while ((primary_pcm < PCM_TOTAL) && !out->pcm[primary_pcm])
+        primary_pcm++;
+
+    if (primary_pcm == PCM_TOTAL)
+        return -ENODATA;
+
+    if (pcm_get_htimestamp(out->pcm[primary_pcm], &avail, timestamp) < 0)
+        return -ENODATA;
+
+    /* frames still queued in the kernel driver buffer have not been presented yet */
+    kernel_frames = pcm_get_buffer_size(out->pcm[primary_pcm]) - avail;
+    if (out->written < kernel_frames)
+        return -ENODATA;
+
+    *frames = out->written - kernel_frames;
+    return 0;
+}
+
+static int out_get_render_position(const struct audio_stream_out *stream,
+                                   uint32_t *dsp_frames)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+    struct timespec timestamp;
+    uint64_t frames;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_presented_frames(out, &frames, &timestamp);
+    pthread_mutex_unlock(&out->lock);
+
+    if (ret != 0)
+        return -EINVAL;
+
+    *dsp_frames = (uint32_t)frames;
+    return 0;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
+    struct timespec realtime;
+    struct timespec monotonic;
+    int64_t offset_ns;
+    int64_t ts_ns;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_presented_frames(out, frames, timestamp);
+    pthread_mutex_unlock(&out->lock);
+
+    if (ret != 0)
+        return ret;
+
+    /* the PCMs are not opened with PCM_MONOTONIC as the ABE driver does not support it:
+     * translate the CLOCK_REALTIME driver timestamp to the CLOCK_MONOTONIC base expected
+     * by AudioFlinger */
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    offset_ns = (monotonic.tv_sec - realtime.tv_sec) * 1000000000LL +
+                (monotonic.tv_nsec - realtime.tv_nsec);
+    ts_ns = timestamp->tv_sec * 1000000000LL + timestamp->tv_nsec + offset_ns;
+    timestamp->tv_sec = ts_ns / 1000000000LL;
+    timestamp->tv_nsec = ts_ns % 1000000000LL;
+
+    return 0;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream __unused, effect_handle_t effect __unused)
@@ -1459,18 +3099,299 @@ static int out_remove_audio_effect(const struct audio_stream *stream __unused, e
 
 /** audio_stream_in implementation **/
 
-/* must be called with hw device and input stream mutexes locked */
-static int start_input_stream(struct tuna_stream_in *in)
+static int in_create_resampler(struct tuna_stream_in *in)
+{
+#ifdef CAPTURE_FIR_RESAMPLER
+    if (create_fir_resampler(in->config.rate,
+                             in->requested_rate,
+                             in->config.channels,
+                             &in->buf_provider,
+                             &in->resampler) == 0) {
+        in->resampler_fir = true;
+        return 0;
+    }
+#endif
+    in->resampler_fir = false;
+    return create_resampler(in->config.rate,
+                            in->requested_rate,
+                            in->config.channels,
+                            RESAMPLER_QUALITY_DEFAULT,
+                            &in->buf_provider,
+                            &in->resampler);
+}
+
+static void in_release_resampler(struct tuna_stream_in *in)
+{
+    if (in->resampler == NULL)
+        return;
+
+#ifdef CAPTURE_FIR_RESAMPLER
+    if (in->resampler_fir)
+        release_fir_resampler(in->resampler);
+    else
+#endif
+        release_resampler(in->resampler);
+    in->resampler = NULL;
+}
+
+/* in_source_priority() ranks the sources of concurrent input streams: the input device is
+ * selected for the active stream of highest priority, the primary stream */
+static int in_source_priority(const struct tuna_stream_in *in)
+{
+    switch (in->source) {
+    case AUDIO_SOURCE_VOICE_COMMUNICATION:
+        return 3;
+    case AUDIO_SOURCE_CAMCORDER:
+        return 2;
+    case AUDIO_SOURCE_VOICE_RECOGNITION:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/* in_is_voice_only() tells the sources which only carry speech: the MM-UL may run at a narrow
+ * band rate for them, the other sources would leave a later client upsampled from it for its
+ * whole session */
+static bool in_is_voice_only(const struct tuna_stream_in *in)
+{
+    return in->source == AUDIO_SOURCE_VOICE_COMMUNICATION ||
+           in->source == AUDIO_SOURCE_VOICE_RECOGNITION;
+}
+
+/* capture_native_rate_bit() returns the CAPTURE_NATIVE_RATE_xxx bit of rate, 0 if the MM-UL
+ * is only opened at MM_UL_SAMPLING_RATE for it */
+static unsigned int capture_native_rate_bit(unsigned int rate)
+{
+    switch (rate) {
+    case 8000:
+        return CAPTURE_NATIVE_RATE_8K;
+    case 16000:
+        return CAPTURE_NATIVE_RATE_16K;
+    default:
+        return 0;
+    }
+}
+
+/* in_select_rate() sets the capture rate of in: the MM-UL runs at the rate of its first
+ * client if it is a voice only source at a native rate, at MM_UL_SAMPLING_RATE otherwise, and
+ * later clients join it at its running rate. The capture configuration and the resampler
+ * follow the rate of the capture hub.
+ * must be called with hw device and input stream mutexes locked */
+static int in_select_rate(struct tuna_stream_in *in)
+{
+    struct tuna_audio_device *adev = in->dev;
+    struct capture_hub *hub = &adev->capture_hub;
+    unsigned int rate;
+    unsigned int period_size;
+    unsigned int period_count;
+
+    if (hub->pcm != NULL) {
+        rate = hub->config.rate;
+        period_size = hub->config.period_size;
+        period_count = hub->config.period_count;
+        if (rate < in->requested_rate)
+            ALOGW("in_select_rate() %u Hz requested while capturing at %u Hz: upsampled",
+                  in->requested_rate, rate);
+    } else if (in_is_voice_only(in) &&
+               (capture_native_rate_bit(in->requested_rate) & adev->capture_native_rates)) {
+        rate = in->requested_rate;
+        period_size = (rate * CAPTURE_NATIVE_PERIOD_MS) / 1000;
+        period_count = pcm_config_mm_ul.period_count;
+    } else {
+        rate = pcm_config_mm_ul.rate;
+        period_size = pcm_config_mm_ul.period_size;
+        period_count = pcm_config_mm_ul.period_count;
+    }
+
+    if (in->config.rate == rate)
+        return 0;
+
+    in->config.rate = rate;
+    in->config.period_size = period_size;
+    in->config.period_count = period_count;
+    in_release_resampler(in);
+    if (in->requested_rate != rate)
+        return in_create_resampler(in);
+    return 0;
+}
+
+/* in_native_rate_refused() returns true if the MM-UL could not be opened at the native rate
+ * selected for in, which is then no longer tried.
+ * must be called with hw device and input stream mutexes locked */
+static bool in_native_rate_refused(struct tuna_stream_in *in)
 {
-    int ret = 0;
     struct tuna_audio_device *adev = in->dev;
 
-    adev->active_input = in;
+    if (adev->capture_hub.pcm != NULL ||
+            !(capture_native_rate_bit(in->config.rate) & adev->capture_native_rates))
+        return false;
+
+    ALOGW("MM-UL refused %u Hz, capturing at %u Hz", in->config.rate, pcm_config_mm_ul.rate);
+    adev->capture_native_rates &= ~capture_native_rate_bit(in->config.rate);
+    return true;
+}
 
+/* capture_primary() returns the primary stream among the capture hub clients and extra if
+ * not NULL. Streams started first win ties.
+ * must be called with hw device mutex locked */
+static struct tuna_stream_in *capture_primary(struct tuna_audio_device *adev,
+                                             struct tuna_stream_in *extra)
+{
+    struct capture_hub *hub = &adev->capture_hub;
+    struct tuna_stream_in *primary = NULL;
+    unsigned int i;
+
+    for (i = 0; i < hub->num_clients; i++) {
+        if (primary == NULL ||
+                in_source_priority(hub->clients[i]) > in_source_priority(primary))
+            primary = hub->clients[i];
+    }
+    if (extra != NULL &&
+            (primary == NULL || in_source_priority(extra) > in_source_priority(primary)))
+        primary = extra;
+
+    return primary;
+}
+
+/* must be called with hw device mutex locked */
+static void capture_set_primary(struct tuna_audio_device *adev, struct tuna_stream_in *primary)
+{
+    if (adev->active_input == primary)
+        return;
+
+    adev->active_input = primary;
     if (adev->mode != AUDIO_MODE_IN_CALL) {
-        adev->in_device = in->device;
+        adev->in_device = primary ? primary->device : AUDIO_DEVICE_NONE;
         select_input_device(adev);
     }
+}
+
+/* capture_hub_add() registers in as a client of the capture hub. The MM-UL PCM is opened and
+ * started with the configuration of the first client, later clients read from the next frame
+ * captured.
+ * must be called with hw device and input stream mutexes locked */
+static int capture_hub_add(struct tuna_stream_in *in)
+{
+    struct capture_hub *hub = &in->dev->capture_hub;
+    int ret = 0;
+
+    pthread_mutex_lock(&hub->lock);
+    if (hub->num_clients == CAPTURE_HUB_MAX_CLIENTS) {
+        ALOGE("capture_hub_add() too many concurrent input streams");
+        ret = -EBUSY;
+        goto exit;
+    }
+
+    if (hub->pcm == NULL) {
+        hub->config = in->config;
+        hub->frames = hub->config.period_size * CAPTURE_HUB_PERIODS;
+        hub->buf = (int16_t *)malloc(hub->frames * hub->config.channels * sizeof(int16_t));
+        if (hub->buf == NULL) {
+            ret = -ENOMEM;
+            goto exit;
+        }
+
+        /* this assumes routing is done previously */
+#ifdef CAPTURE_MMAP
+        hub->pcm = pcm_open(0, PORT_MM2_UL, PCM_IN | PCM_MMAP, &hub->config);
+#else
+        hub->pcm = pcm_open(0, PORT_MM2_UL, PCM_IN, &hub->config);
+#endif
+        if (!pcm_is_ready(hub->pcm)) {
+            ALOGE("cannot open pcm_in driver: %s", pcm_get_error(hub->pcm));
+            ret = -ENOMEM;
+            goto err_close;
+        }
+
+#ifdef CAPTURE_MMAP
+        /* pcm_read() is not used to implicitly start the capture in mmap mode */
+        if (pcm_start(hub->pcm) != 0) {
+            ALOGE("cannot start pcm_in driver: %s", pcm_get_error(hub->pcm));
+            ret = -ENOMEM;
+            goto err_close;
+        }
+#endif
+        hub->wr = 0;
+        hub->ring_base = 0;
+    } else if (in->config.channels > hub->config.channels) {
+        /* the PCM is not reopened under the running clients */
+        ALOGW("capture_hub_add() %u channels requested while capturing %u: last channel "
+              "duplicated", in->config.channels, hub->config.channels);
+    }
+
+    in->hub_rd = hub->wr;
+    in->hub_synced = false;
+    in->hub_direct = false;
+    hub->clients[hub->num_clients++] = in;
+    goto exit;
+
+err_close:
+    pcm_close(hub->pcm);
+    hub->pcm = NULL;
+    free(hub->buf);
+    hub->buf = NULL;
+exit:
+    pthread_mutex_unlock(&hub->lock);
+    return ret;
+}
+
+/* capture_hub_remove() unregisters in from the capture hub, closing the MM-UL PCM after the
+ * last client.
+ * must be called with hw device and input stream mutexes locked */
+static void capture_hub_remove(struct tuna_stream_in *in)
+{
+    struct capture_hub *hub = &in->dev->capture_hub;
+    unsigned int i;
+
+    pthread_mutex_lock(&hub->lock);
+    for (i = 0; i < hub->num_clients; i++) {
+        if (hub->clients[i] == in) {
+            /* keep the start order for capture_primary() */
+            memmove(&hub->clients[i], &hub->clients[i + 1],
+                    (hub->num_clients - i - 1) * sizeof(hub->clients[0]));
+            hub->num_clients--;
+            break;
+        }
+    }
+
+    /* the DMA area is left uncommitted: the next client reads it again */
+    if (hub->direct_owner == in) {
+        hub->direct_owner = NULL;
+        pthread_cond_broadcast(&hub->cond);
+    }
+    in->hub_direct = false;
+
+    if (hub->num_clients == 0) {
+        pcm_close(hub->pcm);
+        hub->pcm = NULL;
+        free(hub->buf);
+        hub->buf = NULL;
+    }
+    pthread_mutex_unlock(&hub->lock);
+}
+
+/* capture_hub_standby() puts all the input streams in standby.
+ * must be called with hw device mutex locked */
+static void capture_hub_standby(struct tuna_audio_device *adev)
+{
+    struct capture_hub *hub = &adev->capture_hub;
+
+    /* do_input_standby() removes the stream from the clients */
+    while (hub->num_clients > 0) {
+        struct tuna_stream_in *in = hub->clients[0];
+
+        pthread_mutex_lock(&in->lock);
+        do_input_standby(in);
+        pthread_mutex_unlock(&in->lock);
+    }
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static int start_input_stream(struct tuna_stream_in *in)
+{
+    int ret = 0;
+    struct tuna_audio_device *adev = in->dev;
 
     if (in->aux_channels_changed)
     {
@@ -1479,47 +3400,57 @@ static int start_input_stream(struct tuna_stream_in *in)
 
         if (in->resampler) {
             /* release and recreate the resampler with the new number of channel of the input */
-            release_resampler(in->resampler);
-            in->resampler = NULL;
-            ret = create_resampler(in->config.rate,
-                               in->requested_rate,
-                               in->config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
+            in_release_resampler(in);
+            ret = in_create_resampler(in);
         }
         ALOGV("start_input_stream(): New channel configuration, "
                 "main_channels = [%04x], aux_channels = [%04x], config.channels = %d",
                 in->main_channels, in->aux_channels, in->config.channels);
     }
 
-    if (in->need_echo_reference && in->echo_reference == NULL)
-        in->echo_reference = get_echo_reference(adev,
-                                        AUDIO_FORMAT_PCM_16_BIT,
-                                        popcount(in->main_channels),
-                                        in->requested_rate);
+    ret = in_select_rate(in);
+    if (ret != 0)
+        return ret;
 
-    /* this assumes routing is done previously */
-    in->pcm = pcm_open(0, PORT_MM2_UL, PCM_IN, &in->config);
-    if (!pcm_is_ready(in->pcm)) {
-        ALOGE("cannot open pcm_in driver: %s", pcm_get_error(in->pcm));
-        pcm_close(in->pcm);
-        adev->active_input = NULL;
+    /* size the capture buffers for the channel count now in effect: in_read() never
+     * allocates */
+    if (in_alloc_buffers(in) != 0)
         return -ENOMEM;
+
+    /* the input device follows the primary stream */
+    capture_set_primary(adev, capture_primary(adev, in));
+
+    if (in->need_echo_reference && !in->echo_ring_attached)
+        echo_ring_attach(in);
+
+    ret = capture_hub_add(in);
+    if (ret != 0 && in_native_rate_refused(in)) {
+        ret = in_select_rate(in);
+        if (ret == 0 && in_alloc_buffers(in) != 0)
+            ret = -ENOMEM;
+        if (ret == 0)
+            ret = capture_hub_add(in);
+    }
+    if (ret != 0) {
+        if (in->echo_ring_attached)
+            echo_ring_detach(in);
+        capture_set_primary(adev, capture_primary(adev, NULL));
+        return ret;
     }
 
-    /* force read and proc buf reallocation case of frame size or channel count change */
+    /* frames buffered before standby were captured with the previous configuration */
     in->read_buf_frames = 0;
-    in->read_buf_size = 0;
     in->proc_buf_frames = 0;
-    in->proc_buf_size = 0;
+    in->proc_buf_offset = 0;
     /* if no supported sample rate is available, use the resampler */
     if (in->resampler) {
         in->resampler->reset(in->resampler);
     }
+    perf_lock_acquire(adev, &in->perf_lock);
     return 0;
 }
 
+/* the MM-UL runs at this rate when it is native, see in_select_rate() */
 static uint32_t in_get_sample_rate(const struct audio_stream *stream)
 {
     struct tuna_stream_in *in = (struct tuna_stream_in *)stream;
@@ -1564,23 +3495,15 @@ static int do_input_standby(struct tuna_stream_in *in)
     struct tuna_audio_device *adev = in->dev;
 
     if (!in->standby) {
-        pcm_close(in->pcm);
-        in->pcm = NULL;
+        capture_hub_remove(in);
+        capture_set_primary(adev, capture_primary(adev, NULL));
 
-        adev->active_input = 0;
-        if (adev->mode != AUDIO_MODE_IN_CALL) {
-            adev->in_device = AUDIO_DEVICE_NONE;
-            select_input_device(adev);
-        }
-
-        if (in->echo_reference != NULL) {
-            /* stop reading from echo reference */
-            in->echo_reference->read(in->echo_reference, NULL);
-            put_echo_reference(adev, in->echo_reference);
-            in->echo_reference = NULL;
-        }
+        if (in->echo_ring_attached)
+            echo_ring_detach(in);
 
         in->standby = 1;
+        stats_inc(&in->stats.standby_enter);
+        perf_lock_release(adev, &in->perf_lock);
     }
     return 0;
 }
@@ -1598,8 +3521,26 @@ static int in_standby(struct audio_stream *stream)
     return status;
 }
 
-static int in_dump(const struct audio_stream *stream __unused, int fd __unused)
+static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct tuna_stream_in *in = (struct tuna_stream_in *)stream;
+    int i;
+
+    dprintf(fd, "  standby: %d, source: %d, device: %#x, primary: %d\n", in->standby,
+            in->source, in->device, in->dev->active_input == in);
+    stats_dump(fd, &in->stats);
+    dprintf(fd, "  capture buffers: %zu bytes, %zu frames x %u channels per pass\n",
+            in->buffers_bytes, in->buffers_frames, in->buffers_channels);
+    dprintf(fd, "  preprocessing chain: %d effect(s)\n", in->num_preprocessors);
+    for (i = 0; i < in->num_preprocessors; i++) {
+        struct effect_info_s *stage = &in->preprocessors[i];
+
+        dprintf(fd, "    stage %d: %llu calls, avg %llu us\n", i,
+                (unsigned long long)stage->process_count,
+                (unsigned long long)(stage->process_count ?
+                    stage->process_ns / stage->process_count / 1000 : 0));
+    }
+
     return 0;
 }
 
@@ -1655,94 +3596,237 @@ static char * in_get_parameters(const struct audio_stream *stream __unused,
     return strdup("");
 }
 
-static int in_set_gain(struct audio_stream_in *stream __unused, float gain __unused)
+static int in_set_gain(struct audio_stream_in *stream __unused, float gain __unused)
+{
+    return 0;
+}
+
+/* get_capture_delay() returns the time elapsed since the first frame not processed yet
+ * was captured */
+static int64_t get_capture_delay(struct tuna_stream_in *in)
+{
+    /* read frames available in kernel driver buffer */
+    struct capture_hub *hub = &in->dev->capture_hub;
+    unsigned int kernel_frames;
+    size_t hub_frames = 0;
+    struct timespec tstamp;
+    int64_t buf_delay;
+    int64_t rsmp_delay;
+    int64_t kernel_delay;
+
+    pthread_mutex_lock(&hub->lock);
+    if (hub->pcm == NULL || pcm_get_htimestamp(hub->pcm, &kernel_frames, &tstamp) < 0) {
+        ALOGW("read get_capture_delay(): pcm_htimestamp error");
+        kernel_frames = 0;
+    }
+    /* frames captured but not read by this client yet */
+    if (hub->wr > in->hub_rd)
+        hub_frames = hub->wr - MAX(in->hub_rd, hub->ring_base);
+    pthread_mutex_unlock(&hub->lock);
+
+    /* read frames available in audio HAL input buffer
+     * add number of frames being read as we want the capture time of first sample
+     * in current buffer */
+    /* frames in in->buffer are at driver sampling rate while frames in in->proc_buf are
+     * at requested sampling rate */
+    buf_delay = ((int64_t)(in->read_buf_frames + hub_frames) * 1000000000) / in->config.rate +
+                       ((int64_t)(in->proc_buf_frames) * 1000000000) / in->requested_rate;
+
+    /* add delay introduced by resampler */
+    rsmp_delay = 0;
+    if (in->resampler) {
+        rsmp_delay = in->resampler->delay_ns(in->resampler);
+    }
+
+    kernel_delay = ((int64_t)kernel_frames * 1000000000) / in->config.rate;
+
+    ALOGV("get_capture_delay kernel_delay:[%lld], buf_delay:[%lld], rsmp_delay:[%lld], "
+          "kernel_frames:[%u], in->read_buf_frames:[%zu], in->proc_buf_frames:[%zu]",
+          (long long)kernel_delay, (long long)buf_delay, (long long)rsmp_delay, kernel_frames,
+          in->read_buf_frames, in->proc_buf_frames);
+
+    return kernel_delay + buf_delay + rsmp_delay;
+}
+
+/* echo ring buffer provider: converts the playback frames to the reference channel count.
+ * Silence is returned for frames not written yet. */
+static int echo_ring_get_next_buffer(struct resampler_buffer_provider *buffer_provider,
+                                     struct resampler_buffer* buffer)
+{
+    struct tuna_stream_in *in;
+    struct echo_ring *ring;
+    unsigned int ref_channels;
+    uint64_t wr;
+    size_t frames;
+    size_t offset;
+    size_t i;
+
+    if (buffer_provider == NULL || buffer == NULL)
+        return -EINVAL;
+
+    in = (struct tuna_stream_in *)((char *)buffer_provider -
+                                   offsetof(struct tuna_stream_in, echo_buf_provider));
+    ring = &in->dev->echo_ring;
+    ref_channels = popcount(in->main_channels);
+
+    frames = MIN(buffer->frame_count, ECHO_RING_CONV_FRAMES);
+    wr = atomic_load_explicit(&ring->wr, memory_order_acquire);
+    if (wr <= in->echo_rd) {
+        memset(in->echo_conv_buf, 0, frames * ref_channels * sizeof(int16_t));
+    } else {
+        const int16_t *src;
+
+        offset = in->echo_rd & (ECHO_RING_FRAMES - 1);
+        frames = MIN(frames, wr - in->echo_rd);
+        frames = MIN(frames, ECHO_RING_FRAMES - offset);
+        src = ring->buf + offset * ECHO_RING_CHANNELS;
+        if (ref_channels == 1) {
+            for (i = 0; i < frames; i++)
+                in->echo_conv_buf[i] = (src[2 * i] + src[2 * i + 1]) >> 1;
+        } else {
+            memcpy(in->echo_conv_buf, src, frames * ECHO_RING_CHANNELS * sizeof(int16_t));
+        }
+        /* the producer may have overwritten the frames while they were copied */
+        if (atomic_load_explicit(&ring->wr, memory_order_acquire) - in->echo_rd >
+                ECHO_RING_FRAMES)
+            in->echo_synced = false;
+    }
+
+    buffer->i16 = in->echo_conv_buf;
+    buffer->frame_count = frames;
+    return 0;
+}
+
+static void echo_ring_release_buffer(struct resampler_buffer_provider *buffer_provider,
+                                     struct resampler_buffer* buffer)
+{
+    struct tuna_stream_in *in;
+
+    if (buffer_provider == NULL || buffer == NULL)
+        return;
+
+    in = (struct tuna_stream_in *)((char *)buffer_provider -
+                                   offsetof(struct tuna_stream_in, echo_buf_provider));
+    in->echo_rd += buffer->frame_count;
+}
+
+/* reads frames from the echo ring into dst, at the capture rate and reference channel count */
+static void echo_ring_read(struct tuna_stream_in *in, int16_t *dst, size_t frames)
+{
+    unsigned int ref_channels = popcount(in->main_channels);
+
+    if (in->echo_resampler != NULL) {
+        in->echo_resampler->resample_from_provider(in->echo_resampler, dst, &frames);
+        return;
+    }
+
+    while (frames > 0) {
+        struct resampler_buffer buf = { { .raw = NULL, }, .frame_count = frames, };
+
+        echo_ring_get_next_buffer(&in->echo_buf_provider, &buf);
+        memcpy(dst, buf.i16, buf.frame_count * ref_channels * sizeof(int16_t));
+        dst += buf.frame_count * ref_channels;
+        frames -= buf.frame_count;
+        echo_ring_release_buffer(&in->echo_buf_provider, &buf);
+    }
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static void echo_ring_attach(struct tuna_stream_in *in)
+{
+    in->echo_buf_provider.get_next_buffer = echo_ring_get_next_buffer;
+    in->echo_buf_provider.release_buffer = echo_ring_release_buffer;
+    in->echo_synced = false;
+    in->echo_rate = 0;
+    in->ref_buf_frames = 0;
+    in->echo_ring_attached = true;
+    atomic_fetch_add_explicit(&in->dev->echo_ring.users, 1, memory_order_relaxed);
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static void echo_ring_detach(struct tuna_stream_in *in)
 {
-    return 0;
+    atomic_fetch_sub_explicit(&in->dev->echo_ring.users, 1, memory_order_relaxed);
+    in->echo_ring_attached = false;
+    if (in->echo_resampler != NULL) {
+        release_resampler(in->echo_resampler);
+        in->echo_resampler = NULL;
+    }
 }
 
-static void get_capture_delay(struct tuna_stream_in *in,
-                       size_t frames,
-                       struct echo_reference_buffer *buffer)
+/* update_echo_reference() completes in->ref_buf up to frames frames aligned on the capture
+ * time of the frames being processed, and returns the remaining echo delay in *delay_ns.
+ * Returns false if no playback frames have been written yet. */
+static bool update_echo_reference(struct tuna_stream_in *in, size_t frames, int32_t *delay_ns)
 {
-
-    /* read frames available in kernel driver buffer */
-    size_t kernel_frames;
-    struct timespec tstamp;
-    long buf_delay;
-    long rsmp_delay;
-    long kernel_delay;
-    long delay_ns;
-
-    if (pcm_get_htimestamp(in->pcm, &kernel_frames, &tstamp) < 0) {
-        buffer->time_stamp.tv_sec  = 0;
-        buffer->time_stamp.tv_nsec = 0;
-        buffer->delay_ns           = 0;
-        ALOGW("read get_capture_delay(): pcm_htimestamp error");
-        return;
+    struct echo_ring *ring = &in->dev->echo_ring;
+    unsigned int ref_channels = popcount(in->main_channels);
+    uint64_t anchor_pos;
+    int64_t anchor_ns;
+    uint32_t rate;
+    int64_t capture_ns;
+    int64_t target;
+    uint64_t wr;
+
+    if (!echo_ring_get_anchor(ring, &anchor_pos, &anchor_ns, &rate))
+        return false;
+
+    if (rate != in->echo_rate) {
+        if (in->echo_resampler != NULL) {
+            release_resampler(in->echo_resampler);
+            in->echo_resampler = NULL;
+        }
+        if (rate != in->requested_rate &&
+                create_resampler(rate, in->requested_rate, ref_channels,
+                                 RESAMPLER_QUALITY_VOIP, &in->echo_buf_provider,
+                                 &in->echo_resampler) != 0) {
+            ALOGE("update_echo_reference() cannot create resampler");
+            in->echo_resampler = NULL;
+            return false;
+        }
+        in->echo_rate = rate;
+        in->echo_synced = false;
     }
 
-    /* read frames available in audio HAL input buffer
-     * add number of frames being read as we want the capture time of first sample
-     * in current buffer */
-    /* frames in in->buffer are at driver sampling rate while frames in in->proc_buf are
-     * at requested sampling rate */
-    buf_delay = (long)(((int64_t)(in->read_buf_frames) * 1000000000) / in->config.rate +
-                       ((int64_t)(in->proc_buf_frames) * 1000000000) /
-                           in->requested_rate);
-
-    /* add delay introduced by resampler */
-    rsmp_delay = 0;
-    if (in->resampler) {
-        rsmp_delay = in->resampler->delay_ns(in->resampler);
+    if (in->ref_buf_size < frames) {
+        ALOGE("update_echo_reference() %zu frames exceed ref_buf", frames);
+        return false;
     }
 
-    kernel_delay = (long)(((int64_t)kernel_frames * 1000000000) / in->config.rate);
-
-    delay_ns = kernel_delay + buf_delay + rsmp_delay;
-
-    buffer->time_stamp = tstamp;
-    buffer->delay_ns   = delay_ns;
-    ALOGV("get_capture_delay time_stamp = [%ld].[%ld], delay_ns: [%d],"
-         " kernel_delay:[%ld], buf_delay:[%ld], rsmp_delay:[%ld], kernel_frames:[%d], "
-         "in->read_buf_frames:[%d], in->proc_buf_frames:[%d], frames:[%d]",
-         buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, buffer->delay_ns,
-         kernel_delay, buf_delay, rsmp_delay, kernel_frames,
-         in->read_buf_frames, in->proc_buf_frames, frames);
-
-}
+    /* playback frame rendered when the first frame missing in ref_buf was captured */
+    capture_ns = (int64_t)get_time_ns() - get_capture_delay(in) +
+                    ((int64_t)in->ref_buf_frames * 1000000000) / in->requested_rate;
+    target = (int64_t)anchor_pos + ((capture_ns - anchor_ns) * rate) / 1000000000;
+
+    if (!in->echo_synced ||
+            llabs((int64_t)in->echo_rd - target) > (int64_t)rate * ECHO_RING_RESYNC_MS / 1000) {
+        wr = atomic_load_explicit(&ring->wr, memory_order_acquire);
+        if (target > (int64_t)wr)
+            target = wr;
+        if (target < (int64_t)wr - ECHO_RING_FRAMES)
+            target = wr - ECHO_RING_FRAMES;
+        if (target < 0)
+            target = 0;
+        ALOGV("update_echo_reference() realign from %llu to %lld",
+              (unsigned long long)in->echo_rd, (long long)target);
+        in->echo_rd = target;
+        in->echo_synced = true;
+        if (in->echo_resampler != NULL)
+            in->echo_resampler->reset(in->echo_resampler);
+    }
 
-static int32_t update_echo_reference(struct tuna_stream_in *in, size_t frames)
-{
-    struct echo_reference_buffer b;
-    b.delay_ns = 0;
+    *delay_ns = (int32_t)(capture_ns - anchor_ns -
+                          (((int64_t)in->echo_rd - (int64_t)anchor_pos) * 1000000000) / rate);
+    if (in->echo_resampler != NULL)
+        *delay_ns += in->echo_resampler->delay_ns(in->echo_resampler);
 
-    ALOGV("update_echo_reference, frames = [%d], in->ref_buf_frames = [%d],  "
-          "b.frame_count = [%d]",
-         frames, in->ref_buf_frames, frames - in->ref_buf_frames);
     if (in->ref_buf_frames < frames) {
-        if (in->ref_buf_size < frames) {
-            in->ref_buf_size = frames;
-            in->ref_buf = (int16_t *)realloc(in->ref_buf, pcm_frames_to_bytes(in->pcm, frames));
-            ALOG_ASSERT((in->ref_buf != NULL),
-                        "update_echo_reference() failed to reallocate ref_buf");
-            ALOGV("update_echo_reference(): ref_buf %p extended to %d bytes",
-                      in->ref_buf, pcm_frames_to_bytes(in->pcm, frames));
-        }
-        b.frame_count = frames - in->ref_buf_frames;
-        b.raw = (void *)(in->ref_buf + in->ref_buf_frames * in->config.channels);
-
-        get_capture_delay(in, frames, &b);
+        echo_ring_read(in, in->ref_buf + in->ref_buf_frames * ref_channels,
+                       frames - in->ref_buf_frames);
+        in->ref_buf_frames = frames;
+    }
 
-        if (in->echo_reference->read(in->echo_reference, &b) == 0)
-        {
-            in->ref_buf_frames += b.frame_count;
-            ALOGV("update_echo_reference(): in->ref_buf_frames:[%d], "
-                    "in->ref_buf_size:[%d], frames:[%d], b.frame_count:[%d]",
-                 in->ref_buf_frames, in->ref_buf_size, frames, b.frame_count);
-        }
-    } else
-        ALOGW("update_echo_reference(): NOT enough frames to read ref buffer");
-    return b.delay_ns;
+    return true;
 }
 
 static int set_preprocessor_param(effect_handle_t handle,
@@ -1782,10 +3866,16 @@ static void push_echo_reference(struct tuna_stream_in *in, size_t frames)
 {
     /* read frames from echo reference buffer and update echo delay
      * in->ref_buf_frames is updated with frames available in in->ref_buf */
-    int32_t delay_us = update_echo_reference(in, frames)/1000;
+    unsigned int ref_channels = popcount(in->main_channels);
+    int32_t delay_ns;
+    int32_t delay_us;
     int i;
     audio_buffer_t buf;
 
+    if (!update_echo_reference(in, frames, &delay_ns))
+        return;
+    delay_us = delay_ns / 1000;
+
     if (in->ref_buf_frames < frames)
         frames = in->ref_buf_frames;
 
@@ -1804,59 +3894,252 @@ static void push_echo_reference(struct tuna_stream_in *in, size_t frames)
 
     in->ref_buf_frames -= buf.frameCount;
     if (in->ref_buf_frames) {
-        memcpy(in->ref_buf,
-               in->ref_buf + buf.frameCount * in->config.channels,
-               in->ref_buf_frames * in->config.channels * sizeof(int16_t));
+        memmove(in->ref_buf,
+                in->ref_buf + buf.frameCount * ref_channels,
+                in->ref_buf_frames * ref_channels * sizeof(int16_t));
+    }
+}
+
+/* strip_aux_channels() keeps the first dst_channels channels of each interleaved frame.
+ * The 2->1, 3->2 and 4->2 cases used by the dual mic configurations are vectorized. */
+static void strip_aux_channels(int16_t *dst, size_t dst_channels,
+                               const int16_t *src, size_t src_channels, size_t frames)
+{
+#ifdef __ARM_NEON__
+    if (dst_channels == 1 && src_channels == 2) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8x2_t v = vld2q_s16(src);
+            vst1q_s16(dst, v.val[0]);
+            src += 16;
+            dst += 8;
+        }
+    } else if (dst_channels == 2 && src_channels == 3) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8x3_t v = vld3q_s16(src);
+            int16x8x2_t d = { { v.val[0], v.val[1] } };
+            vst2q_s16(dst, d);
+            src += 24;
+            dst += 16;
+        }
+    } else if (dst_channels == 2 && src_channels == 4) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8x4_t v = vld4q_s16(src);
+            int16x8x2_t d = { { v.val[0], v.val[1] } };
+            vst2q_s16(dst, d);
+            src += 32;
+            dst += 16;
+        }
+    }
+#endif
+
+    /* remaining frames, or all of them for other channel counts */
+    if (dst_channels == 1) {
+        for (; frames > 0; frames--) {
+            *dst++ = *src;
+            src += src_channels;
+        }
+    } else {
+        for (; frames > 0; frames--) {
+            memcpy(dst, src, dst_channels * sizeof(int16_t));
+            dst += dst_channels;
+            src += src_channels;
+        }
+    }
+}
+
+/* capture_hub_copy() converts the frames of the capture hub to the channel count of a
+ * client: auxiliary channels are stripped, missing channels duplicate the last one captured */
+static void capture_hub_copy(int16_t *dst, unsigned int dst_channels,
+                             const int16_t *src, unsigned int src_channels, size_t frames)
+{
+    unsigned int c;
+
+    if (dst_channels == src_channels) {
+        memcpy(dst, src, frames * src_channels * sizeof(int16_t));
+    } else if (dst_channels < src_channels) {
+        strip_aux_channels(dst, dst_channels, src, src_channels, frames);
+    } else {
+        for (; frames > 0; frames--) {
+            for (c = 0; c < dst_channels; c++)
+                *dst++ = src[MIN(c, src_channels - 1)];
+            src += src_channels;
+        }
+    }
+}
+
+#ifdef CAPTURE_MMAP
+/* in_mmap_begin() waits for captured frames and returns the next contiguous area of the
+ * DMA buffer, up to *frames frames. The area must be released with pcm_mmap_commit().
+ * must be called with capture hub mutex locked */
+static int in_mmap_begin(struct capture_hub *hub, struct tuna_stream_in *in,
+                         int16_t **data, size_t *frames)
+{
+    void *areas;
+    unsigned int offset;
+    unsigned int mapped;
+    int ret;
+
+    for (;;) {
+        int avail = pcm_mmap_avail(hub->pcm);
+
+        if (avail > (int)pcm_get_buffer_size(hub->pcm))
+            avail = -EPIPE;
+        if (avail > 0)
+            break;
+
+        ret = (avail < 0) ? avail : pcm_wait(hub->pcm, CAPTURE_MMAP_WAIT_MS);
+        if (ret == 0) {
+            ALOGE("in_mmap_begin() timeout waiting for capture frames");
+            return -ETIMEDOUT;
+        }
+        if (ret < 0) {
+            /* overrun: restart the capture, frames lost are not recoverable */
+            ALOGW("in_mmap_begin() capture overrun %d, restarting", ret);
+            stats_inc(&in->stats.xruns);
+            pcm_prepare(hub->pcm);
+            ret = pcm_start(hub->pcm);
+            if (ret != 0)
+                return ret;
+        }
     }
+
+    mapped = *frames;
+    ret = pcm_mmap_begin(hub->pcm, &areas, &offset, &mapped);
+    if (ret < 0)
+        return ret;
+
+    hub->mmap_offset = offset;
+    *data = (int16_t *)((char *)areas + pcm_frames_to_bytes(hub->pcm, offset));
+    *frames = mapped;
+
+    return 0;
+}
+
+/* the speex resampler may hold a buffer across reads: it is never handed the DMA area */
+static bool in_reads_direct(const struct tuna_stream_in *in)
+{
+    return in->resampler == NULL || in->resampler_fir;
+}
+#endif
+
+/* capture_hub_fill() reads the next frames captured into the ring.
+ * must be called with capture hub mutex locked */
+static int capture_hub_fill(struct capture_hub *hub, struct tuna_stream_in *in)
+{
+    size_t offset = hub->wr % hub->frames;
+    int16_t *dst = hub->buf + offset * hub->config.channels;
+    size_t frames;
+    int ret;
+
+#ifdef CAPTURE_MMAP
+    int16_t *data;
+
+    frames = hub->frames - offset;
+    ret = in_mmap_begin(hub, in, &data, &frames);
+    if (ret != 0)
+        return ret;
+    memcpy(dst, data, pcm_frames_to_bytes(hub->pcm, frames));
+    pcm_mmap_commit(hub->pcm, hub->mmap_offset, frames);
+#else
+    (void)in;
+    /* the ring holds whole periods: a period read never wraps */
+    frames = hub->config.period_size;
+    ret = pcm_read(hub->pcm, dst, pcm_frames_to_bytes(hub->pcm, frames));
+    if (ret != 0)
+        return ret;
+#endif
+
+    hub->wr += frames;
+    if (hub->wr - hub->ring_base > hub->frames)
+        hub->ring_base = hub->wr - hub->frames;
+    return 0;
 }
 
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                                    struct resampler_buffer* buffer)
 {
     struct tuna_stream_in *in;
+    struct capture_hub *hub;
+    size_t offset;
+    size_t frames;
+    int ret = 0;
 
     if (buffer_provider == NULL || buffer == NULL)
         return -EINVAL;
 
     in = (struct tuna_stream_in *)((char *)buffer_provider -
                                    offsetof(struct tuna_stream_in, buf_provider));
+    hub = &in->dev->capture_hub;
 
-    if (in->pcm == NULL) {
-        buffer->raw = NULL;
-        buffer->frame_count = 0;
-        in->read_status = -ENODEV;
-        return -ENODEV;
-    }
+    pthread_mutex_lock(&hub->lock);
+    /* the DMA area handed out to another client is committed before anything else is read */
+    while (hub->direct_owner != NULL && hub->direct_owner != in)
+        pthread_cond_wait(&hub->cond, &hub->lock);
 
-    if (in->read_buf_frames == 0) {
-        size_t size_in_bytes = pcm_frames_to_bytes(in->pcm, in->config.period_size);
-        if (in->read_buf_size < in->config.period_size) {
-            in->read_buf_size = in->config.period_size;
-            in->read_buf = (int16_t *) realloc(in->read_buf, size_in_bytes);
-            ALOG_ASSERT((in->read_buf != NULL),
-                        "get_next_buffer() failed to reallocate read_buf");
-            ALOGV("get_next_buffer(): read_buf %p extended to %d bytes",
-                  in->read_buf, size_in_bytes);
-        }
+    if (hub->pcm == NULL) {
+        ret = -ENODEV;
+        goto exit;
+    }
 
-        in->read_status = pcm_read(in->pcm, (void*)in->read_buf, size_in_bytes);
+#ifdef CAPTURE_MMAP
+    if (hub->num_clients == 1 && in->hub_rd == hub->wr &&
+            in->config.channels == hub->config.channels && in_reads_direct(in)) {
+        /* hand out the DMA buffer area itself: no intermediate copy */
+        int16_t *data;
 
-        if (in->read_status != 0) {
-            ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
-            buffer->raw = NULL;
-            buffer->frame_count = 0;
-            return in->read_status;
+        frames = buffer->frame_count;
+        ret = in_mmap_begin(hub, in, &data, &frames);
+        if (ret != 0) {
+            ALOGE("get_next_buffer() pcm_mmap_begin error %d", ret);
+            goto exit;
         }
-        in->read_buf_frames = in->config.period_size;
+        hub->direct_owner = in;
+        in->hub_direct = true;
+        in->hub_synced = true;
+        buffer->i16 = data;
+        buffer->frame_count = frames;
+        goto exit;
     }
+#endif
 
-    buffer->frame_count = (buffer->frame_count > in->read_buf_frames) ?
-                                in->read_buf_frames : buffer->frame_count;
-    buffer->i16 = in->read_buf + (in->config.period_size - in->read_buf_frames) *
-                                                in->config.channels;
+    while (hub->wr <= in->hub_rd) {
+        ret = capture_hub_fill(hub, in);
+        if (ret != 0) {
+            ALOGE("get_next_buffer() capture error %d", ret);
+            goto exit;
+        }
+    }
 
-    return in->read_status;
+    if (in->hub_rd < hub->ring_base) {
+        if (in->hub_synced) {
+            ALOGW("get_next_buffer() %llu frames overwritten before being read",
+                  (unsigned long long)(hub->ring_base - in->hub_rd));
+            stats_inc(&in->stats.xruns);
+        }
+        in->hub_rd = hub->ring_base;
+    }
+    in->hub_synced = true;
+
+    offset = in->hub_rd % hub->frames;
+    frames = MIN(buffer->frame_count, hub->wr - in->hub_rd);
+    frames = MIN(frames, hub->frames - offset);
+    frames = MIN(frames, in->read_buf_size);
+    capture_hub_copy(in->read_buf, in->config.channels,
+                     hub->buf + offset * hub->config.channels, hub->config.channels, frames);
+    in->hub_rd += frames;
+    in->hub_direct = false;
+    in->read_buf_frames = frames;
+    buffer->i16 = in->read_buf;
+    buffer->frame_count = frames;
 
+exit:
+    pthread_mutex_unlock(&hub->lock);
+    in->read_status = ret;
+    if (ret != 0) {
+        buffer->raw = NULL;
+        buffer->frame_count = 0;
+    }
+    return ret;
 }
 
 static void release_buffer(struct resampler_buffer_provider *buffer_provider,
@@ -1870,13 +4153,35 @@ static void release_buffer(struct resampler_buffer_provider *buffer_provider,
     in = (struct tuna_stream_in *)((char *)buffer_provider -
                                    offsetof(struct tuna_stream_in, buf_provider));
 
-    in->read_buf_frames -= buffer->frame_count;
+#ifdef CAPTURE_MMAP
+    if (in->hub_direct) {
+        struct capture_hub *hub = &in->dev->capture_hub;
+
+        pthread_mutex_lock(&hub->lock);
+        in->hub_direct = false;
+        if (hub->direct_owner == in) {
+            if (buffer->frame_count != 0) {
+                pcm_mmap_commit(hub->pcm, hub->mmap_offset, buffer->frame_count);
+                hub->wr += buffer->frame_count;
+            }
+            /* the frames read directly are not in the ring */
+            hub->ring_base = hub->wr;
+            in->hub_rd = hub->wr;
+            hub->direct_owner = NULL;
+            pthread_cond_broadcast(&hub->cond);
+        }
+        pthread_mutex_unlock(&hub->lock);
+        return;
+    }
+#endif
+    in->read_buf_frames -= MIN(buffer->frame_count, in->read_buf_frames);
 }
 
 /* read_frames() reads frames from kernel driver, down samples to capture rate
  * if necessary and output the number of frames requested to the buffer specified */
 static ssize_t read_frames(struct tuna_stream_in *in, void *buffer, ssize_t frames)
 {
+    size_t frame_size = in->config.channels * sizeof(int16_t);
     ssize_t frames_wr = 0;
 
     while (frames_wr < frames) {
@@ -1884,7 +4189,7 @@ static ssize_t read_frames(struct tuna_stream_in *in, void *buffer, ssize_t fram
         if (in->resampler != NULL) {
             in->resampler->resample_from_provider(in->resampler,
                                                   (int16_t *)((char *)buffer +
-                                                      pcm_frames_to_bytes(in->pcm ,frames_wr)),
+                                                      frames_wr * frame_size),
                                                   &frames_rd);
 
         } else {
@@ -1894,10 +4199,9 @@ static ssize_t read_frames(struct tuna_stream_in *in, void *buffer, ssize_t fram
             };
             get_next_buffer(&in->buf_provider, &buf);
             if (buf.raw != NULL) {
-                memcpy((char *)buffer +
-                            pcm_frames_to_bytes(in->pcm, frames_wr),
+                memcpy((char *)buffer + frames_wr * frame_size,
                         buf.raw,
-                        pcm_frames_to_bytes(in->pcm, buf.frame_count));
+                        buf.frame_count * frame_size);
                 frames_rd = buf.frame_count;
             }
             release_buffer(&in->buf_provider, &buf);
@@ -1912,6 +4216,139 @@ static ssize_t read_frames(struct tuna_stream_in *in, void *buffer, ssize_t fram
     return frames_wr;
 }
 
+/* in_alloc_buffers() carves all the buffers of the capture pipeline out of one allocation
+ * sized for the current channel count and for one AudioFlinger buffer per pass:
+ * - read_buf: one capture period, frames of the capture hub converted for this stream
+ * - proc_buf_in: twice the pass size, see process_frames()
+ * - proc_buf_out: one pass, only used when auxiliary channels are captured
+ * - ref_buf: one pass of echo reference
+ * - chain_buf[0..1]: one pass each, passed between chained preprocessors
+ * - echo_conv_buf: the echo ring conversion buffer
+ * must be called with input stream mutex locked */
+static int in_alloc_buffers(struct tuna_stream_in *in)
+{
+    size_t frames = get_input_buffer_size(in->requested_rate, AUDIO_FORMAT_PCM_16_BIT, 1) /
+                        sizeof(int16_t);
+    unsigned int channels = in->config.channels;
+    size_t read_samples = in->config.period_size * channels;
+    size_t proc_samples = frames * 2 * channels;
+    size_t pass_samples = frames * channels;
+    size_t ref_samples = frames * ECHO_RING_CHANNELS;
+    size_t conv_samples = ECHO_RING_CONV_FRAMES * ECHO_RING_CHANNELS;
+    size_t total;
+    int16_t *buf;
+
+    if (in->buffers != NULL && in->buffers_frames == frames &&
+            in->buffers_channels == channels && in->read_buf_size == in->config.period_size)
+        return 0;
+
+    total = read_samples + proc_samples + 3 * pass_samples + ref_samples + conv_samples;
+
+    buf = (int16_t *)malloc(total * sizeof(int16_t));
+    if (buf == NULL) {
+        ALOGE("in_alloc_buffers() cannot allocate %zu bytes", total * sizeof(int16_t));
+        return -ENOMEM;
+    }
+    free(in->buffers);
+    in->buffers = buf;
+    in->buffers_bytes = total * sizeof(int16_t);
+    in->buffers_frames = frames;
+    in->buffers_channels = channels;
+
+    in->read_buf = buf;
+    in->read_buf_size = read_samples / channels;
+    buf += read_samples;
+    in->proc_buf_in = buf;
+    in->proc_buf_size = frames * 2;
+    buf += proc_samples;
+    in->proc_buf_out = buf;
+    buf += pass_samples;
+    in->ref_buf = buf;
+    in->ref_buf_size = frames;
+    buf += ref_samples;
+    in->chain_buf[0] = buf;
+    buf += pass_samples;
+    in->chain_buf[1] = buf;
+    in->chain_buf_frames = frames;
+    buf += pass_samples;
+    in->echo_conv_buf = buf;
+
+    ALOGV("in_alloc_buffers() %zu bytes for %zu frames x %u channels",
+          in->buffers_bytes, frames, channels);
+    return 0;
+}
+
+/* in_run_preprocessors() runs the preprocessors as a chain where each stage processes the
+ * output of the previous one, the last stage writing to out_buf.
+ * A stage returning -ENODATA defers its output to a later effect of the same session (the
+ * platform pre processing library processes the whole session on the last enabled effect):
+ * the next stage then receives the same input buffer, as updated by the stage.
+ * in_buf->frameCount and out_buf->frameCount are updated with the number of frames consumed
+ * from in_buf and produced in out_buf. */
+static void in_run_preprocessors(struct tuna_stream_in *in, audio_buffer_t *in_buf,
+                                 audio_buffer_t *out_buf)
+{
+    audio_buffer_t stage_in = *in_buf;
+    bool input_consumed = false;
+    int i;
+
+    for (i = 0; i < in->num_preprocessors; i++) {
+        struct effect_info_s *stage = &in->preprocessors[i];
+        bool last = (i == in->num_preprocessors - 1);
+        audio_buffer_t stage_out;
+        uint64_t start_ns;
+        int status;
+
+        if (last) {
+            stage_out = *out_buf;
+        } else {
+            stage_out.frameCount = in->chain_buf_frames;
+            stage_out.s16 = (stage_in.s16 == in->chain_buf[0]) ?
+                                in->chain_buf[1] : in->chain_buf[0];
+        }
+
+        start_ns = get_time_ns();
+        status = (*stage->effect_itfe)->process(stage->effect_itfe, &stage_in, &stage_out);
+        stage->process_ns += get_time_ns() - start_ns;
+        stage->process_count++;
+
+        if (status != 0 && status != -ENODATA) {
+            /* bypass a failing stage */
+            ALOGV("in_run_preprocessors() stage %d error %d", i, status);
+            if (!last)
+                continue;
+            stage_out.frameCount = MIN(stage_in.frameCount, out_buf->frameCount);
+            memcpy(stage_out.s16, stage_in.s16,
+                   stage_out.frameCount * in->config.channels * sizeof(int16_t));
+            stage_in.frameCount = stage_out.frameCount;
+        } else if (status == -ENODATA) {
+            if (last)
+                stage_out.frameCount = 0;
+            else
+                continue;
+        }
+
+        /* the first stage producing frames defines how many input frames were consumed */
+        if (!input_consumed) {
+            in_buf->frameCount = stage_in.frameCount;
+            input_consumed = true;
+        } else if (stage_in.frameCount != stage_out.frameCount && !last) {
+            ALOGW("in_run_preprocessors() stage %d consumed %zu of %zu frames",
+                  i, stage_in.frameCount, stage_out.frameCount);
+        }
+
+        if (last) {
+            out_buf->frameCount = stage_out.frameCount;
+        } else {
+            stage_in.frameCount = stage_out.frameCount;
+            stage_in.s16 = stage_out.s16;
+        }
+    }
+
+    if (!input_consumed)
+        in_buf->frameCount = stage_in.frameCount;
+}
+
 /* process_frames() reads frames from kernel driver (via read_frames()),
  * calls the active audio pre processings and output the number of frames requested
  * to the buffer specified */
@@ -1936,25 +4373,18 @@ static ssize_t process_frames(struct tuna_stream_in *in, void* buffer, ssize_t f
         if (in->proc_buf_frames < (size_t)frames) {
             ssize_t frames_rd;
 
-            if (in->proc_buf_size < (size_t)frames) {
-                size_t size_in_bytes = pcm_frames_to_bytes(in->pcm, frames);
-
-                in->proc_buf_size = (size_t)frames;
-                in->proc_buf_in = (int16_t *)realloc(in->proc_buf_in, size_in_bytes);
-                ALOG_ASSERT((in->proc_buf_in != NULL),
-                            "process_frames() failed to reallocate proc_buf_in");
-                if (has_aux_channels) {
-                    in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
-                    ALOG_ASSERT((in->proc_buf_out != NULL),
-                                "process_frames() failed to reallocate proc_buf_out");
-                    proc_buf_out = in->proc_buf_out;
-                }
-                ALOGV("process_frames(): proc_buf_in %p extended to %d bytes",
-                     in->proc_buf_in, size_in_bytes);
+            /* the buffer holds twice the frames of a pass so that the unprocessed frames
+             * only need to be moved back to the front once in a while */
+            if (in->proc_buf_offset + (size_t)frames > in->proc_buf_size) {
+                memmove(in->proc_buf_in,
+                        in->proc_buf_in + in->proc_buf_offset * in->config.channels,
+                        in->proc_buf_frames * in->config.channels * sizeof(int16_t));
+                in->proc_buf_offset = 0;
             }
             frames_rd = read_frames(in,
                                     in->proc_buf_in +
-                                        in->proc_buf_frames * in->config.channels,
+                                        (in->proc_buf_offset + in->proc_buf_frames) *
+                                            in->config.channels,
                                     frames - in->proc_buf_frames);
             if (frames_rd < 0) {
                 frames_wr = frames_rd;
@@ -1962,38 +4392,28 @@ static ssize_t process_frames(struct tuna_stream_in *in, void* buffer, ssize_t f
             }
             in->proc_buf_frames += frames_rd;
         }
+        TUNA_TRACE_INT("proc_buf_frames", in->proc_buf_frames);
 
-        if (in->echo_reference != NULL)
+        if (in->echo_ring_attached)
             push_echo_reference(in, in->proc_buf_frames);
 
          /* in_buf.frameCount and out_buf.frameCount indicate respectively
           * the maximum number of frames to be consumed and produced by process() */
         in_buf.frameCount = in->proc_buf_frames;
-        in_buf.s16 = in->proc_buf_in;
+        in_buf.s16 = in->proc_buf_in + in->proc_buf_offset * in->config.channels;
         out_buf.frameCount = frames - frames_wr;
         out_buf.s16 = (int16_t *)proc_buf_out + frames_wr * in->config.channels;
 
-        /* FIXME: this works because of current pre processing library implementation that
-         * does the actual process only when the last enabled effect process is called.
-         * The generic solution is to have an output buffer for each effect and pass it as
-         * input to the next.
-         */
-        for (i = 0; i < in->num_preprocessors; i++) {
-            (*in->preprocessors[i].effect_itfe)->process(in->preprocessors[i].effect_itfe,
-                                               &in_buf,
-                                               &out_buf);
-        }
+        in_run_preprocessors(in, &in_buf, &out_buf);
 
         /* process() has updated the number of frames consumed and produced in
          * in_buf.frameCount and out_buf.frameCount respectively
-         * move remaining frames to the beginning of in->proc_buf_in */
+         * skip the consumed frames: remaining ones are left in place */
         in->proc_buf_frames -= in_buf.frameCount;
-
-        if (in->proc_buf_frames) {
-            memcpy(in->proc_buf_in,
-                   in->proc_buf_in + in_buf.frameCount * in->config.channels,
-                   in->proc_buf_frames * in->config.channels * sizeof(int16_t));
-        }
+        if (in->proc_buf_frames)
+            in->proc_buf_offset += in_buf.frameCount;
+        else
+            in->proc_buf_offset = 0;
 
         /* if not enough frames were passed to process(), read more and retry. */
         if (out_buf.frameCount == 0) {
@@ -2014,28 +4434,9 @@ static ssize_t process_frames(struct tuna_stream_in *in, void* buffer, ssize_t f
     /* Remove aux_channels that have been added on top of main_channels
      * Assumption is made that the channels are interleaved and that the main
      * channels are first. */
-    if (has_aux_channels)
-    {
-        size_t src_channels = in->config.channels;
-        size_t dst_channels = popcount(in->main_channels);
-        int16_t* src_buffer = (int16_t *)proc_buf_out;
-        int16_t* dst_buffer = (int16_t *)buffer;
-
-        if (dst_channels == 1) {
-            for (i = frames_wr; i > 0; i--)
-            {
-                *dst_buffer++ = *src_buffer;
-                src_buffer += src_channels;
-            }
-        } else {
-            for (i = frames_wr; i > 0; i--)
-            {
-                memcpy(dst_buffer, src_buffer, dst_channels*sizeof(int16_t));
-                dst_buffer += dst_channels;
-                src_buffer += src_channels;
-            }
-        }
-    }
+    if (has_aux_channels && frames_wr > 0)
+        strip_aux_channels((int16_t *)buffer, popcount(in->main_channels),
+                           (int16_t *)proc_buf_out, in->config.channels, frames_wr);
 
     return frames_wr;
 }
@@ -2047,29 +4448,44 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct tuna_stream_in *in = (struct tuna_stream_in *)stream;
     struct tuna_audio_device *adev = in->dev;
     size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
+    struct stats_io_clock io_clock;
+
+    TUNA_TRACE_SCOPE("in_read");
+    stats_io_begin(&io_clock);
 
     /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
      * on the input stream mutex - e.g. executing select_mode() while holding the hw device
      * mutex
      */
-    pthread_mutex_lock(&adev->lock);
+    stats_lock_device(&in->stats, adev);
     pthread_mutex_lock(&in->lock);
     if (in->standby) {
         ret = start_input_stream(in);
-        if (ret == 0)
+        if (ret == 0) {
             in->standby = 0;
+            stats_inc(&in->stats.standby_exit);
+        }
     }
     pthread_mutex_unlock(&adev->lock);
 
     if (ret < 0)
         goto exit;
 
-    if (in->num_preprocessors != 0)
-        ret = process_frames(in, buffer, frames_rq);
-    else if (in->resampler != NULL)
+    if (in->num_preprocessors != 0) {
+        /* the capture buffers are sized for in->buffers_frames per pass */
+        size_t frame_size = audio_stream_in_frame_size(stream);
+        size_t done = 0;
+
+        while (done < frames_rq) {
+            size_t frames = MIN(frames_rq - done, in->buffers_frames);
+
+            ret = process_frames(in, (char *)buffer + done * frame_size, frames);
+            if (ret < 0)
+                break;
+            done += frames;
+        }
+    } else
         ret = read_frames(in, buffer, frames_rq);
-    else
-        ret = pcm_read(in->pcm, buffer, bytes);
 
     if (ret > 0)
         ret = 0;
@@ -2078,11 +4494,14 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         memset(buffer, 0, bytes);
 
 exit:
-    if (ret < 0)
+    if (ret < 0) {
+        stats_inc(&in->stats.io_errors);
         usleep(bytes * 1000000 / audio_stream_in_frame_size(stream) /
                in_get_sample_rate(&stream->common));
+    }
 
     pthread_mutex_unlock(&in->lock);
+    stats_record_io(&in->stats, &io_clock);
     return bytes;
 }
 
@@ -2429,9 +4848,7 @@ static int in_remove_audio_effect(const struct audio_stream *stream,
 
     for (i = 0; i < in->num_preprocessors; i++) {
         if (status == 0) { /* status == 0 means an effect was removed from a previous slot */
-            in->preprocessors[i - 1].effect_itfe = in->preprocessors[i].effect_itfe;
-            in->preprocessors[i - 1].channel_configs = in->preprocessors[i].channel_configs;
-            in->preprocessors[i - 1].num_channel_configs = in->preprocessors[i].num_channel_configs;
+            in->preprocessors[i - 1] = in->preprocessors[i];
             ALOGV("in_remove_audio_effect moving fx from %d to %d", i, i - 1);
             continue;
         }
@@ -2447,9 +4864,7 @@ static int in_remove_audio_effect(const struct audio_stream *stream,
 
     in->num_preprocessors--;
     /* if we remove one effect, at least the last preproc should be reset */
-    in->preprocessors[in->num_preprocessors].num_channel_configs = 0;
-    in->preprocessors[in->num_preprocessors].effect_itfe = NULL;
-    in->preprocessors[in->num_preprocessors].channel_configs = NULL;
+    memset(&in->preprocessors[in->num_preprocessors], 0, sizeof(struct effect_info_s));
 
 
     /* check compatibility between main channel supported and possible auxiliary channels */
@@ -2475,10 +4890,17 @@ exit:
 }
 
 #ifdef USE_HDMI_AUDIO
-static int out_read_hdmi_channel_masks(struct tuna_stream_out *out) {
+/* hdmi_read_sink_caps() reads the speaker layouts of the HDMI sink, unless they are cached
+ * already. A sink without multichannel support is read again on the next call.
+ * must be called with hw device mutex locked */
+static int hdmi_read_sink_caps(struct tuna_audio_device *adev)
+{
     int max_channels = 0;
     struct mixer *mixer_hdmi;
 
+    if (adev->hdmi_caps_valid)
+        return 0;
+
     mixer_hdmi = mixer_open(CARD_OMAP4_HDMI);
     if (mixer_hdmi) {
         struct mixer_ctl *ctl;
@@ -2489,17 +4911,63 @@ static int out_read_hdmi_channel_masks(struct tuna_stream_out *out) {
         mixer_close(mixer_hdmi);
     }
 
-    ALOGV("out_read_hdmi_channel_masks() got %d max channels", max_channels);
+    ALOGV("hdmi_read_sink_caps() got %d max channels", max_channels);
 
     if (max_channels != 6 && max_channels != 8)
         return -ENOSYS;
 
-    out->sup_channel_masks[0] = AUDIO_CHANNEL_OUT_5POINT1;
+    memset(adev->hdmi_channel_masks, 0, sizeof(adev->hdmi_channel_masks));
+    adev->hdmi_channel_masks[0] = AUDIO_CHANNEL_OUT_5POINT1;
     if (max_channels == 8)
-        out->sup_channel_masks[1] = AUDIO_CHANNEL_OUT_7POINT1;
+        adev->hdmi_channel_masks[1] = AUDIO_CHANNEL_OUT_7POINT1;
+    adev->hdmi_caps_valid = true;
 
     return 0;
 }
+
+/* returns true if parms reports the connection or disconnection of an HDMI sink */
+static bool hdmi_hotplug_param(struct str_parms *parms)
+{
+    int device;
+
+    if (str_parms_get_int(parms, AUDIO_PARAMETER_DEVICE_CONNECT, &device) < 0 &&
+            str_parms_get_int(parms, AUDIO_PARAMETER_DEVICE_DISCONNECT, &device) < 0)
+        return false;
+    return device == AUDIO_DEVICE_OUT_AUX_DIGITAL;
+}
+
+static int out_read_hdmi_channel_masks(struct tuna_audio_device *adev,
+                                       struct tuna_stream_out *out)
+{
+    int ret;
+
+    pthread_mutex_lock(&adev->lock);
+    ret = hdmi_read_sink_caps(adev);
+    if (ret == 0)
+        memcpy(out->sup_channel_masks, adev->hdmi_channel_masks,
+               sizeof(out->sup_channel_masks));
+    pthread_mutex_unlock(&adev->lock);
+
+    return ret;
+}
+
+/* the PCM channel count and order are derived from the channel mask: only accept the
+ * speaker layouts the sink reported in out_read_hdmi_channel_masks() so that the samples
+ * of every frame go to the speakers they were mixed for */
+static int out_check_hdmi_layout(struct tuna_stream_out *out)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(out->sup_channel_masks) && out->sup_channel_masks[i] != 0; i++) {
+        if (out->sup_channel_masks[i] == out->channel_mask &&
+                popcount(out->channel_mask) == out->config[PCM_HDMI].channels)
+            return 0;
+    }
+
+    ALOGE("out_check_hdmi_layout() channel mask %#x not supported by the sink",
+          out->channel_mask);
+    return -EINVAL;
+}
 #endif
 
 static int adev_open_output_stream(struct audio_hw_device *dev,
@@ -2520,11 +4988,13 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out = (struct tuna_stream_out *)calloc(1, sizeof(struct tuna_stream_out));
     if (!out)
         return -ENOMEM;
+    out->perf_lock.handle = -1;
     ALOGV("%s: enter: sample_rate(%d) channel_mask(%#x) devices(%#x) flags(%#x)",
            __func__, config->sample_rate, config->channel_mask, devices, flags);
 
     out->sup_channel_masks[0] = AUDIO_CHANNEL_OUT_STEREO;
     out->channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    out->format = AUDIO_FORMAT_PCM_16_BIT;
 
     if (config->sample_rate == 0) {
         config->sample_rate = MM_LOW_POWER_SAMPLING_RATE;
@@ -2539,7 +5009,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
             ret = -ENOSYS;
             goto err_open;
         }
-        ret = out_read_hdmi_channel_masks(out);
+        ret = out_read_hdmi_channel_masks(ladev, out);
         if (ret != 0)
             goto err_open;
         output_type = OUTPUT_HDMI;
@@ -2556,12 +5026,46 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         out->config[PCM_HDMI] = pcm_config_hdmi_multi;
         out->config[PCM_HDMI].rate = config->sample_rate;
         out->config[PCM_HDMI].channels = popcount(config->channel_mask);
-        /* FIXME: workaround for channel swap on first playback after opening the output */
-        out->restart_periods_cnt = out->config[PCM_HDMI].period_count * 2;
-    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        ret = out_check_hdmi_layout(out);
+        if (ret != 0)
+            goto err_open;
+        if (out_format_is_supported(config->format))
+            out->format = config->format;
+        out->hdmi_buf = (int16_t *)malloc(HDMI_MULTI_PERIOD_SIZE *
+                                           out->config[PCM_HDMI].channels * sizeof(int16_t));
+        if (out->hdmi_buf == NULL) {
+            ret = -ENOMEM;
+            goto err_open;
+        }
+    } else if (flags & AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD) {
 #else
-    if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+    if (flags & AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD) {
 #endif
+        ALOGV("adev_open_output_stream() low power");
+        /* the ABE has no compressed audio decoder: only PCM can be offloaded */
+        if (ladev->outputs[OUTPUT_LOW_POWER] != NULL) {
+            ret = -ENOSYS;
+            goto err_open;
+        }
+        if ((config->format != AUDIO_FORMAT_DEFAULT &&
+                config->format != AUDIO_FORMAT_PCM_16_BIT) ||
+                (config->channel_mask != 0 &&
+                config->channel_mask != AUDIO_CHANNEL_OUT_STEREO)) {
+            ret = -EINVAL;
+            goto err_open;
+        }
+        output_type = OUTPUT_LOW_POWER;
+        out->stream.common.get_buffer_size = out_get_buffer_size_low_power;
+        out->stream.common.get_sample_rate = out_get_sample_rate;
+        out->stream.get_latency = out_get_latency_low_power;
+        out->stream.write = out_write_low_power;
+        out->stream.set_volume = out_set_volume_low_power;
+        out->stream.set_callback = out_set_callback;
+        out->stream.pause = out_pause;
+        out->stream.resume = out_resume;
+        out->stream.drain = out_drain;
+        out->stream.flush = out_flush;
+    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
         ALOGV("adev_open_output_stream() deep buffer");
         if (ladev->outputs[OUTPUT_DEEP_BUF] != NULL) {
             ret = -ENOSYS;
@@ -2571,6 +5075,9 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
          *       sampling rate listed in the audio policy */
         output_type = OUTPUT_DEEP_BUF;
         out->channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        /* a float mixer output is written without AudioFlinger's final pass to 16 bit */
+        if (out_format_is_supported(config->format))
+            out->format = config->format;
         out->stream.common.get_buffer_size = out_get_buffer_size_deep_buffer;
         out->stream.common.get_sample_rate = out_get_sample_rate;
         out->stream.get_latency = out_get_latency_deep_buffer;
@@ -2603,11 +5110,40 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.common.add_audio_effect = out_add_audio_effect;
     out->stream.common.remove_audio_effect = out_remove_audio_effect;
     out->stream.get_render_position = out_get_render_position;
+    out->stream.get_presentation_position = out_get_presentation_position;
 
     out->dev = ladev;
     out->standby = 1;
     /* out->muted = false; by calloc() */
 
+#ifdef USE_HDMI_AUDIO
+    if (out->format != AUDIO_FORMAT_PCM_16_BIT || output_type == OUTPUT_HDMI) {
+#else
+    if (out->format != AUDIO_FORMAT_PCM_16_BIT) {
+#endif
+        out->conv_buf = (int16_t *)malloc(PCM_CONVERT_FRAMES *
+                                          popcount(out->channel_mask) * sizeof(int16_t));
+        if (!out->conv_buf) {
+            ret = -ENOMEM;
+            goto err_open;
+        }
+    }
+
+#ifdef PLAYBACK_WRITER_THREAD
+    if (output_type == OUTPUT_LOW_LATENCY) {
+        ret = out_start_writer_thread(out);
+        if (ret != 0)
+            goto err_open;
+        out->stream.common.standby = out_standby_low_latency;
+    }
+#endif
+    if (output_type == OUTPUT_LOW_POWER) {
+        ret = out_start_offload_thread(out);
+        if (ret != 0)
+            goto err_open;
+        out->stream.common.standby = out_standby_low_power;
+    }
+
     /* FIXME: when we support multiple output devices, we will want to
      * do the following:
      * adev->out_device = out->device;
@@ -2625,6 +5161,10 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     return 0;
 
 err_open:
+#ifdef USE_HDMI_AUDIO
+    free(out->hdmi_buf);
+#endif
+    free(out->conv_buf);
     free(out);
     return ret;
 }
@@ -2636,6 +5176,12 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     struct tuna_stream_out *out = (struct tuna_stream_out *)stream;
     int i;
 
+#ifdef PLAYBACK_WRITER_THREAD
+    /* the writer thread must not touch the stream while it is put in standby and freed */
+    out_stop_writer_thread(out);
+#endif
+    if (out == ladev->outputs[OUTPUT_LOW_POWER])
+        out_stop_offload_thread(out);
     out_standby(&stream->common);
     for (i = 0; i < OUTPUT_TOTAL; i++) {
         if (ladev->outputs[i] == out) {
@@ -2644,6 +5190,10 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
         }
     }
 
+#ifdef USE_HDMI_AUDIO
+    free(out->hdmi_buf);
+#endif
+    free(out->conv_buf);
     free(stream);
 }
 
@@ -2675,7 +5225,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         if (tty_mode != adev->tty_mode) {
             adev->tty_mode = tty_mode;
             if (adev->mode == AUDIO_MODE_IN_CALL)
-                select_output_device(adev);
+                route_request(adev, ROUTE_REQ_RESELECT, 0);
         }
         pthread_mutex_unlock(&adev->lock);
     }
@@ -2688,6 +5238,15 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
             adev->bluetooth_nrec = false;
     }
 
+#ifdef USE_HDMI_AUDIO
+    /* relayed by the policy from the HDMI hotplug uevent: the next sink may differ */
+    if (hdmi_hotplug_param(parms)) {
+        pthread_mutex_lock(&adev->lock);
+        adev->hdmi_caps_valid = false;
+        pthread_mutex_unlock(&adev->lock);
+    }
+#endif
+
     ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_SCREEN_STATE, value, sizeof(value));
     if (ret >= 0) {
         if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
@@ -2719,7 +5278,7 @@ static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
     adev->voice_volume = volume;
 
     if (adev->mode == AUDIO_MODE_IN_CALL)
-        ril_set_call_volume(adev->ril_handle, SOUND_TYPE_VOICE, volume);
+        ril_queue_call_volume(adev->ril_handle, SOUND_TYPE_VOICE, volume);
 
     pthread_mutex_unlock(&adev->lock);
     return 0;
@@ -2736,6 +5295,8 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
 
     pthread_mutex_lock(&adev->lock);
     if (adev->mode != mode) {
+        /* routing requested before the mode change must be applied first */
+        route_apply_pending(adev);
         adev->mode = mode;
         select_mode(adev);
     }
@@ -2749,7 +5310,8 @@ static int adev_set_mic_mute(struct audio_hw_device *dev, bool state)
     struct tuna_audio_device *adev = (struct tuna_audio_device *)dev;
 
     if (adev->mode == AUDIO_MODE_IN_CALL) {
-        ril_set_mic_mute(adev->ril_handle, state);
+        /* sent by the RIL queue thread: the mixer below mutes right away */
+        ril_queue_mic_mute(adev->ril_handle, state);
         /* Not all devices work with the ril_set_mic_mute function.
          * the following change is acceptable if sec_mic_mute fails. */
         unsigned int channel;
@@ -2806,6 +5368,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in = (struct tuna_stream_in *)calloc(1, sizeof(struct tuna_stream_in));
     if (!in)
         return -ENOMEM;
+    in->perf_lock.handle = -1;
 
     in->stream.common.get_sample_rate = in_get_sample_rate;
     in->stream.common.set_sample_rate = in_set_sample_rate;
@@ -2833,16 +5396,12 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     /* initialisation of preprocessor structure array is implicit with the calloc.
      * same for in->aux_channels and in->aux_channels_changed */
 
+    /* the resampler may also be created when the stream starts, see in_select_rate() */
+    in->buf_provider.get_next_buffer = get_next_buffer;
+    in->buf_provider.release_buffer = release_buffer;
+
     if (in->requested_rate != in->config.rate) {
-        in->buf_provider.get_next_buffer = get_next_buffer;
-        in->buf_provider.release_buffer = release_buffer;
-
-        ret = create_resampler(in->config.rate,
-                               in->requested_rate,
-                               in->config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
+        ret = in_create_resampler(in);
         if (ret != 0) {
             ret = -EINVAL;
             goto err;
@@ -2857,8 +5416,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     return 0;
 
 err:
-    if (in->resampler)
-        release_resampler(in->resampler);
+    in_release_resampler(in);
 
     free(in);
     return ret;
@@ -2876,23 +5434,30 @@ static void adev_close_input_stream(struct audio_hw_device *dev __unused,
         free(in->preprocessors[i].channel_configs);
     }
 
-    free(in->read_buf);
-    if (in->resampler) {
-        release_resampler(in->resampler);
-    }
-    if (in->proc_buf_in)
-        free(in->proc_buf_in);
-    if (in->proc_buf_out)
-        free(in->proc_buf_out);
-    if (in->ref_buf)
-        free(in->ref_buf);
+    in_release_resampler(in);
+    free(in->buffers);
 
     free(stream);
     return;
 }
 
-static int adev_dump(const audio_hw_device_t *device __unused, int fd __unused)
+static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct tuna_audio_device *adev = (struct tuna_audio_device *)device;
+
+    /* no lock is taken: the values below are only informative */
+    dprintf(fd, "  mode: %d, in call: %d, out device: %#x, in device: %#x\n",
+            adev->mode, adev->in_call, adev->out_device, adev->in_device);
+    dprintf(fd, "  screen off: %d, mic mute: %d\n", adev->screen_off, adev->mic_mute);
+    dprintf(fd, "  capture clients: %u, primary source: %d\n", adev->capture_hub.num_clients,
+            adev->active_input ? adev->active_input->source : -1);
+    dprintf(fd, "  capture rate: %u Hz, native rates: %#x\n",
+            adev->capture_hub.pcm ? adev->capture_hub.config.rate : 0,
+            adev->capture_native_rates);
+    route_stats_dump(fd, "output", &adev->output_route_stats);
+    route_stats_dump(fd, "input", &adev->input_route_stats);
+    ril_dump(adev->ril_handle, fd);
+
     return 0;
 }
 
@@ -2900,6 +5465,13 @@ static int adev_close(hw_device_t *device)
 {
     struct tuna_audio_device *adev = (struct tuna_audio_device *)device;
 
+    stop_route_thread(adev);
+    pthread_cond_destroy(&adev->route_cond);
+    pthread_mutex_destroy(&adev->route_lock);
+    pthread_cond_destroy(&adev->capture_hub.cond);
+    pthread_mutex_destroy(&adev->capture_hub.lock);
+    pcm_pool_flush(adev);
+
     /* RIL */
     ril_close(adev->ril_handle);
 
@@ -2912,11 +5484,16 @@ static int adev_open(const hw_module_t* module, const char* name,
                      hw_device_t** device)
 {
     struct tuna_audio_device *adev;
+    const hw_module_t *power_module;
+    struct tuna_boot_profile profile;
     int ret;
+    int i;
 
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
         return -EINVAL;
 
+    tuna_boot_profile_begin(&profile, "audio");
+
     adev = calloc(1, sizeof(struct tuna_audio_device));
     if (!adev)
         return -ENOMEM;
@@ -2947,6 +5524,7 @@ static int adev_open(const hw_module_t* module, const char* name,
         ALOGE("Unable to open the mixer, aborting.");
         return -EINVAL;
     }
+    tuna_boot_profile_phase(&profile, "mixer_open");
 
     adev->mixer_ctls.dl1_eq = mixer_get_ctl_by_name(adev->mixer,
                                            MIXER_DL1_EQUALIZER);
@@ -3027,6 +5605,17 @@ static int adev_open(const hw_module_t* module, const char* name,
         return -EINVAL;
     }
 
+    for (i = 0; i < OUTPUT_GAIN_TOTAL; i++)
+        adev->output_gains[i] = OUTPUT_GAIN_NONE;
+
+    if (init_route_cache(adev) != 0) {
+        mixer_close(adev->mixer);
+        free(adev);
+        ALOGE("Unable to locate all route mixer controls, aborting.");
+        return -EINVAL;
+    }
+    tuna_boot_profile_phase(&profile, "mixer_controls");
+
     /* Set the default route before the PCM stream is opened */
     pthread_mutex_lock(&adev->lock);
     set_route_by_array(adev->mixer, defaults, 1);
@@ -3041,14 +5630,54 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->tty_mode = TTY_MODE_OFF;
     adev->bluetooth_nrec = true;
     adev->wb_amr = 0;
+    adev->capture_native_rates = CAPTURE_NATIVE_RATES;
+    adev->standby_hold_ms = property_get_int32(STANDBY_HOLD_PROPERTY, STANDBY_HOLD_MS);
+    /* in case the property has been messed with */
+    if ((int)adev->standby_hold_ms < 0)
+        adev->standby_hold_ms = STANDBY_HOLD_MS;
+    tuna_boot_profile_phase(&profile, "default_route");
+
+    /* the frequency floor of the low latency streams comes from the power HAL */
+    if (hw_get_module(POWER_HARDWARE_MODULE_ID, &power_module) == 0 && power_module->dso) {
+        adev->perf_lock_acquire = (power_tuna_perf_lock_acquire_t)dlsym(power_module->dso,
+                POWER_TUNA_PERF_LOCK_ACQUIRE);
+        adev->perf_lock_release = (power_tuna_perf_lock_release_t)dlsym(power_module->dso,
+                POWER_TUNA_PERF_LOCK_RELEASE);
+        if (!adev->perf_lock_acquire || !adev->perf_lock_release) {
+            adev->perf_lock_acquire = NULL;
+            adev->perf_lock_release = NULL;
+        }
+    }
+    if (!adev->perf_lock_acquire)
+        ALOGW("No performance lock in the power HAL, low latency streams may underrun");
+    tuna_boot_profile_phase(&profile, "power_module");
 
     /* RIL */
     ril_open(adev->ril_handle);
     pthread_mutex_unlock(&adev->lock);
     /* register callback for wideband AMR setting */
     ril_register_set_wb_amr_callback(audio_set_wb_amr_callback, (void *)adev);
+    tuna_boot_profile_phase(&profile, "ril_open");
+
+    pthread_mutex_init(&adev->capture_hub.lock, NULL);
+    pthread_cond_init(&adev->capture_hub.cond, NULL);
+    pthread_mutex_init(&adev->route_lock, NULL);
+    pthread_cond_init(&adev->route_cond, NULL);
+    ret = pthread_create(&adev->route_thread, NULL, route_thread_loop, adev);
+    if (ret != 0) {
+        ALOGE("Unable to create route thread: %s", strerror(ret));
+        pthread_cond_destroy(&adev->route_cond);
+        pthread_mutex_destroy(&adev->route_lock);
+        pthread_cond_destroy(&adev->capture_hub.cond);
+        pthread_mutex_destroy(&adev->capture_hub.lock);
+        ril_close(adev->ril_handle);
+        mixer_close(adev->mixer);
+        free(adev);
+        return -ret;
+    }
 
     *device = &adev->hw_device.common;
+    tuna_boot_profile_end(&profile);
 
     return 0;
 }
@@ -18,7 +18,11 @@
 #define TUNA_AUDIO_HW_H
 
 
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -27,10 +31,11 @@
 
 #include <tinyalsa/asoundlib.h>
 #include <audio_utils/resampler.h>
-#include <audio_utils/echo_reference.h>
 #include <hardware/audio_effect.h>
 #include <audio_effects/effect_aec.h>
 
+#include "fir_resampler.h"
+#include "power_tuna.h"
 #include "ril_interface.h"
 
 
@@ -180,6 +185,31 @@
 #define DEEP_BUFFER_LONG_PERIOD_START_THRES \
                             ((DEEP_BUFFER_LONG_PERIOD_SIZE * PLAYBACK_DEEP_BUFFER_LONG_PERIOD_COUNT) / 2)
 
+/* Deep buffer period scheduler: the wakeup period is chosen among several levels, expressed
+ * in short deep buffer periods, between the short (screen on) and the long (screen off)
+ * periods. Longer periods are reached one level at a time, which avoids the underruns seen
+ * when switching directly from short to long periods. */
+#define DEEP_BUFFER_PERIOD_LEVELS 4
+/* minimum number of frames left in the kernel buffer when waking up */
+#define DEEP_BUFFER_MIN_WAKE_MARGIN \
+                            (DEEP_BUFFER_SHORT_PERIOD_WRITE_THRES - DEEP_BUFFER_SHORT_PERIOD_SIZE)
+/* consecutive wakeups without underrun before moving to the next longer period */
+#define DEEP_BUFFER_PROMOTE_WAKEUPS 16
+/* number of wakeups during which the period cannot grow back after an underrun */
+#define DEEP_BUFFER_UNDERRUN_HOLD_WAKEUPS 256
+
+
+/* number of frames per period for the low power output on the MM low power port: the CPU
+ * is only woken up once per period */
+#define LOW_POWER_PERIOD_SIZE (ABE_BASE_FRAME_COUNT * DEEP_BUFFER_LONG_PERIOD_MS * MULTIPLIER_FACTOR)
+/* number of periods for the low power output */
+#define LOW_POWER_PERIOD_COUNT 4
+/* commands pending for the low power output callback thread */
+#define OFFLOAD_CMD_WAIT_WRITE  (1 << 0)    /* signal when a period can be written */
+#define OFFLOAD_CMD_DRAIN       (1 << 1)    /* signal when all frames have been played */
+#define OFFLOAD_CMD_DRAIN_EARLY (1 << 2)    /* signal when one period is left to play */
+/* unity gain of the low power output software volume */
+#define LOW_POWER_UNITY_GAIN (1 << 12)
 
 #ifdef USE_HDMI_AUDIO
 /* number of frames per period for HDMI multichannel output */
@@ -188,19 +218,86 @@
 #define HDMI_MULTI_PERIOD_COUNT 4
 /* default number of channels for HDMI multichannel output */
 #define HDMI_MULTI_DEFAULT_CHANNEL_COUNT 6
+/* periods of silence written to the HDMI DMA buffer before the first audio period */
+#define HDMI_MULTI_PRIME_PERIODS 1
 #endif
 
+/* frames converted per pass from a float or 8.24 output stream to the 16 bit PCM */
+#define PCM_CONVERT_FRAMES 1024
 
-/* write function */
+/* User serviceable */
+/* #define to feed the low latency PCMs from a dedicated SCHED_FIFO writer thread through a
+ * lock-free ring, #undef to write them directly from the AudioFlinger thread */
+#define PLAYBACK_WRITER_THREAD
+/* number of AudioFlinger buffers that can be queued for the writer thread */
+#define PLAYBACK_WRITER_RING_SLOTS 2
+/* SCHED_FIFO priority of the writer thread */
+#define PLAYBACK_WRITER_PRIORITY 3
+/* #define to write each secondary low latency PCM (SPDIF, HDMI) from its own thread, in
+ * parallel with PCM_NORMAL, when the output is duplicated. Needs PLAYBACK_WRITER_THREAD. */
+#define PLAYBACK_PARALLEL_SINKS
+#ifndef PLAYBACK_WRITER_THREAD
+#undef PLAYBACK_PARALLEL_SINKS
+#endif
+
+/* CPU frequency floor held while a low latency stream runs, in kHz: OPP1 wakes up fast
+ * enough for a 3 ms period. The thread doing the PCM I/O is pinned to CPU0, which is never
+ * hotplugged. */
+#define AUDIO_PERF_MIN_FREQ_KHZ 700000
+#define AUDIO_PERF_CPU 0
+
+/* commands posted to the writer thread */
+#define WRITER_CMD_STANDBY (1 << 0)
+#define WRITER_CMD_EXIT    (1 << 1)
+
+/* Routing requests are queued to a worker thread which applies the last requested state:
+ * the worker waits until no new request has been received for ROUTE_SETTLE_MS before
+ * touching the mixer, so that a burst of requests results in a single route change */
+#define ROUTE_SETTLE_MS 20
+
+/* User serviceable */
+/* time during which the low latency output PCMs are kept open but stopped after the stream
+ * enters standby, together with the output stage, so that a new sound restarts without
+ * reopening nor rerouting. 0 closes them at standby. Overridden by STANDBY_HOLD_PROPERTY */
+#define STANDBY_HOLD_MS 5000
+#define STANDBY_HOLD_PROPERTY "ro.config.standby_hold_ms"
+/* number of stopped PCMs kept open during the standby hold */
+#define PCM_POOL_SIZE 4
+
+/* route requests pending for the route worker */
+#define ROUTE_REQ_OUTPUT    (1 << 0)    /* select route_out_device */
+#define ROUTE_REQ_LL_OUTPUT (1 << 1)    /* request comes from the low latency output */
+#define ROUTE_REQ_RESELECT  (1 << 2)    /* reapply the in call output route */
+
+
+/* write function and open flags of the low latency output PCMs */
 #ifdef PLAYBACK_MMAP
 #define PCM_WRITE pcm_mmap_write
+#define LOW_LATENCY_PCM_FLAGS (PCM_OUT | PCM_MMAP | PCM_NOIRQ)
 #else
 #define PCM_WRITE pcm_write
+#define LOW_LATENCY_PCM_FLAGS PCM_OUT
 #endif
 
 
 /* User serviceable */
+/* #define to capture directly from the MM-UL DMA buffer in mmap mode, #undef for pcm_read()
+ * into an intermediate buffer */
+#define CAPTURE_MMAP
+#ifdef CAPTURE_MMAP
+/* in mmap mode the read size is not tied to the period size: shorter periods only reduce
+ * the capture latency */
+#define CAPTURE_PERIOD_MS 10
+#else
 #define CAPTURE_PERIOD_MS 22
+#endif
+/* maximum time to wait for a capture period in mmap mode */
+#define CAPTURE_MMAP_WAIT_MS 100
+
+/* User serviceable */
+/* #define to downsample capture with the fixed ratio polyphase filters of fir_resampler.c
+ * when the requested rate is 16, 8 or 44.1 kHz, #undef to always use the speex resampler */
+#define CAPTURE_FIR_RESAMPLER
 
 /* Number of frames per period for capture.  This cannot be reduced below 96.
  * Possibly related to the following rule in sound/soc/omap/omap-pcm.c:
@@ -215,7 +312,11 @@
  */
 #define CAPTURE_PERIOD_SIZE (ABE_BASE_FRAME_COUNT * CAPTURE_PERIOD_MS * MULTIPLIER_FACTOR)
 /* number of periods for capture */
+#ifdef CAPTURE_MMAP
+#define CAPTURE_PERIOD_COUNT 4
+#else
 #define CAPTURE_PERIOD_COUNT 2
+#endif
 /* minimum sleep time in out_write() when write threshold is not reached */
 #define MIN_WRITE_SLEEP_US 5000
 
@@ -238,6 +339,18 @@
 #define MM_UL_SAMPLING_RATE 48000
 #endif
 
+/* User serviceable */
+/* rates at which the MM-UL is opened for a first client requesting them, so that it reads
+ * without resampling. Only the voice communication and recognition sources open it at those
+ * rates: a wideband client joining them is upsampled until the MM-UL is released. A rate
+ * refused by the driver is not tried again. */
+#define CAPTURE_NATIVE_RATE_8K  (1 << 0)
+#define CAPTURE_NATIVE_RATE_16K (1 << 1)
+#define CAPTURE_NATIVE_RATES (CAPTURE_NATIVE_RATE_8K | CAPTURE_NATIVE_RATE_16K)
+/* capture period at those rates: the buffer must remain a multiple of 96 frames, see
+ * CAPTURE_PERIOD_SIZE */
+#define CAPTURE_NATIVE_PERIOD_MS 12
+
 /* sampling rate when using VX port for narrow band */
 #define VX_NB_SAMPLING_RATE 8000
 /* sampling rate when using VX port for wide band */
@@ -312,6 +425,7 @@
 enum output_type {
     OUTPUT_DEEP_BUF,      // deep PCM buffers output stream
     OUTPUT_LOW_LATENCY,   // low latency output stream
+    OUTPUT_LOW_POWER,     // non-blocking output stream on the MM low power port
 #ifdef USE_HDMI_AUDIO
     OUTPUT_HDMI,
 #endif
@@ -334,6 +448,21 @@ enum tty_modes {
     TTY_MODE_FULL
 };
 
+/* output gains written by set_output_volumes(), as mixer control values */
+enum output_gain {
+    OUTPUT_GAIN_SPEAKER,
+    OUTPUT_GAIN_HEADSET,
+    OUTPUT_GAIN_TONES_DL1,
+    OUTPUT_GAIN_VX_DL2,
+    OUTPUT_GAIN_TONES_DL2,
+    OUTPUT_GAIN_MM_DL1,
+    OUTPUT_GAIN_MM_DL2,
+    OUTPUT_GAIN_EARPIECE,
+    OUTPUT_GAIN_TOTAL,
+};
+/* gain not driven in the current mode, or not known to be written */
+#define OUTPUT_GAIN_NONE INT_MIN
+
 struct mixer_ctls
 {
     struct mixer_ctl *dl1_eq;
@@ -362,12 +491,123 @@ struct mixer_ctls
     struct mixer_ctl *earpiece_volume;
 };
 
+/* Stream statistics reported by the dump hooks. They are updated by the audio path with
+ * relaxed atomics and read without taking any lock so that dumpsys never stalls audio. */
+#define STATS_IO_HISTOGRAM_BUCKETS 8
+
+struct stream_stats {
+    /* read/write call duration: < 1, 2, 5, 10, 20, 50, 100 ms and above */
+    atomic_uint io_histogram[STATS_IO_HISTOGRAM_BUCKETS];
+    atomic_ullong io_max_ns;
+    /* CPU time consumed by the calling thread in read/write calls */
+    atomic_ullong io_cpu_ns;
+    atomic_ullong io_cpu_max_ns;
+    /* time spent waiting for the hw device mutex */
+    atomic_uint lock_wait_count;
+    atomic_ullong lock_wait_ns;
+    atomic_ullong lock_wait_max_ns;
+    atomic_uint io_errors;      /* failed PCM reads/writes, replaced by a sleep */
+    atomic_uint xruns;
+    atomic_uint standby_enter;
+    atomic_uint standby_exit;
+};
+
+/* start time of a read/write call, see stats_io_begin() */
+struct stats_io_clock {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+struct route_stats {
+    atomic_uint count;
+    atomic_ullong total_ns;
+    atomic_ullong max_ns;
+};
+
+/* writer of one secondary low latency PCM: the writer thread hands it the buffer it is
+ * writing to PCM_NORMAL through go and waits on done, so that the buffer stays valid and
+ * out->pcm[] unchanged while the sink writes */
+struct pcm_sink {
+    struct tuna_stream_out *out;
+    int pcm;                    /* index in out->pcm[] */
+    pthread_t thread;
+    sem_t go;
+    sem_t done;
+    const void *buffer;         /* written before go is posted, NULL to exit */
+    size_t bytes;
+    int ret;                    /* written before done is posted */
+};
+
+/* performance lock of a stream, held from its start to its standby */
+struct perf_lock {
+    int handle;                 /* lock of power.tuna, -1 if none */
+    pid_t tid;                  /* thread pinned by the lock, 0 if none */
+    cpu_set_t saved_cpus;       /* its affinity before */
+};
+
+/* Echo reference: the frames played on the low latency output are copied to a ring read by
+ * the capture streams running the AEC. There is one producer (the low latency output) and one
+ * consumer per input stream, each with its own read position: no lock is shared between the
+ * playback and capture paths.
+ * The producer also publishes the CLOCK_MONOTONIC time at which a recent frame is rendered,
+ * from which the consumer aligns the reference on the capture time. */
+/* number of frames in the ring, must be a power of 2 */
+#define ECHO_RING_FRAMES 16384
+#define ECHO_RING_CHANNELS 2
+/* the reference is realigned when the echo delay drifts by more than this */
+#define ECHO_RING_RESYNC_MS 20
+/* number of frames converted at a time by the consumer */
+#define ECHO_RING_CONV_FRAMES 256
+
+struct echo_ring {
+    atomic_uint users;          /* number of input streams using the echo reference */
+    atomic_ullong wr;           /* number of frames written since the device was opened */
+    /* sequence lock protecting the anchor below: odd while it is being updated */
+    atomic_uint anchor_seq;
+    atomic_ullong anchor_pos;   /* index of a frame ... */
+    atomic_llong anchor_ns;     /* ... rendered at this time */
+    atomic_uint rate;           /* playback sampling rate, 0 until the first write */
+    int16_t buf[ECHO_RING_FRAMES * ECHO_RING_CHANNELS];
+};
+
+/* Capture hub: the MM-UL PCM is opened once, with the configuration of the first input
+ * stream started, and the captured frames are fanned out to all the active input streams.
+ * A stream alone and up to date with the capture reads the DMA buffer directly, otherwise the
+ * frames are copied to a ring each client reads at its own position. Streams keep their own
+ * resampler and preprocessors, the echo reference ring is shared. The input device is
+ * selected for the primary stream, see in_source_priority(). */
+#define CAPTURE_HUB_MAX_CLIENTS 4
+/* number of capture periods in the ring: a client falling further behind loses frames */
+#define CAPTURE_HUB_PERIODS 8
+
+struct capture_hub {
+    pthread_mutex_t lock;       /* see note below on mutex acquisition order */
+    pthread_cond_t cond;        /* signaled when the direct area is released */
+    struct pcm *pcm;
+    struct pcm_config config;
+    int16_t *buf;               /* ring of config.channels interleaved frames */
+    size_t frames;              /* ring size in frames */
+    uint64_t wr;                /* number of frames read from the PCM since it was opened */
+    uint64_t ring_base;         /* index of the oldest frame still in the ring */
+    /* DMA area handed out to a client and not committed yet */
+    struct tuna_stream_in *direct_owner;
+#ifdef CAPTURE_MMAP
+    unsigned int mmap_offset;   /* offset of the area returned by the last pcm_mmap_begin() */
+#endif
+    /* also protected by the hw device mutex: either lock is enough to read them */
+    struct tuna_stream_in *clients[CAPTURE_HUB_MAX_CLIENTS];
+    unsigned int num_clients;
+};
+
 #define MAX_PREPROCESSORS 3 /* maximum one AGC + one NS + one AEC per input stream */
 
 struct effect_info_s {
     effect_handle_t effect_itfe;
     size_t num_channel_configs;
     channel_config_t* channel_configs;
+    /* time spent in process() by this stage of the preprocessing chain */
+    uint64_t process_ns;
+    uint64_t process_count;
 };
 
 #define NUM_IN_AUX_CNL_CONFIGS 2
@@ -381,15 +621,34 @@ struct tuna_stream_in {
 
     pthread_mutex_t lock;       /* see note below on mutex acquisition order */
     struct pcm_config config;
-    struct pcm *pcm;
     int device;
     struct resampler_itfe *resampler;
+    bool resampler_fir;         /* resampler was created by create_fir_resampler() */
     struct resampler_buffer_provider buf_provider;
     unsigned int requested_rate;
     int standby;
     int source;
-    struct echo_reference_itfe *echo_reference;
     bool need_echo_reference;
+    /* echo ring consumer state */
+    bool echo_ring_attached;
+    bool echo_synced;
+    uint64_t echo_rd;           /* index of the next echo ring frame to read */
+    uint32_t echo_rate;         /* playback rate echo_resampler was created for */
+    struct resampler_itfe *echo_resampler;
+    struct resampler_buffer_provider echo_buf_provider;
+    int16_t *echo_conv_buf;
+
+    /* capture hub client state: protected by the hub lock */
+    uint64_t hub_rd;            /* index of the next hub frame to read */
+    bool hub_synced;            /* set once reading: frames skipped afterwards are an overrun */
+    bool hub_direct;            /* the last buffer handed out is the DMA area itself */
+
+    /* read_buf, proc_buf_in, proc_buf_out, ref_buf, chain_buf and echo_conv_buf are carved
+     * out of a single allocation sized by in_alloc_buffers() for the stream configuration */
+    int16_t *buffers;
+    size_t buffers_bytes;
+    size_t buffers_frames;      /* frames processed per pass */
+    unsigned int buffers_channels;
 
     int16_t *read_buf;
     size_t read_buf_size;
@@ -399,6 +658,7 @@ struct tuna_stream_in {
     int16_t *proc_buf_out;
     size_t proc_buf_size;
     size_t proc_buf_frames;
+    size_t proc_buf_offset;     /* first unprocessed frame in proc_buf_in */
 
     int16_t *ref_buf;
     size_t ref_buf_size;
@@ -408,10 +668,15 @@ struct tuna_stream_in {
 
     int num_preprocessors;
     struct effect_info_s preprocessors[MAX_PREPROCESSORS];
+    /* ping-pong buffers between the stages of the preprocessing chain */
+    int16_t *chain_buf[2];
+    size_t chain_buf_frames;
 
     bool aux_channels_changed;
     uint32_t main_channels;
     uint32_t aux_channels;
+    struct stream_stats stats;
+    struct perf_lock perf_lock;
     struct tuna_audio_device *dev;
 };
 
@@ -422,24 +687,99 @@ struct tuna_stream_out {
     struct pcm_config config[PCM_TOTAL];
     struct pcm *pcm[PCM_TOTAL];
     int standby;
-    struct echo_reference_itfe *echo_reference;
-    int write_threshold;
-    bool use_long_periods;
+    int write_threshold;        /* wake up when a write would exceed this many frames ... */
+    int wake_threshold;         /* ... once the kernel buffer has drained to this many frames */
+    int period_level;           /* current deep buffer period level */
+    int period_ceiling;         /* highest level allowed by the underrun history */
+    unsigned int clean_wakeups;
+    unsigned int underrun_hold;
+    unsigned int wake_late_frames;  /* average frames drained beyond wake_threshold */
+    bool deep_buffer_primed;
     audio_channel_mask_t channel_mask;
     audio_channel_mask_t sup_channel_masks[3];
+    /* format of the buffers written by AudioFlinger: the PCMs are always 16 bit, other
+     * formats are converted in the write path through conv_buf */
+    audio_format_t format;
+    int16_t *conv_buf;
 
 #ifdef USE_HDMI_AUDIO
-    /* FIXME: workaround for HDMI multi channel channel swap on first playback after opening
-     * the output stream: force reopening the pcm driver after writing a few periods. */
-    int restart_periods_cnt;
+    /* HDMI writes are issued in whole periods: the frames of an incomplete period are
+     * held here until the next write */
+    int16_t *hdmi_buf;
+    size_t hdmi_buf_frames;
 #endif
     bool muted;
+    /* frames written to the PCMs since the stream was opened, used for presentation
+     * position reporting */
+    uint64_t written;
+
+#ifdef PLAYBACK_WRITER_THREAD
+    /* single-producer/single-consumer ring between out_write_low_latency() (producer)
+     * and the writer thread (consumer). ring_wr is only written by the producer and
+     * ring_rd only by the consumer; the semaphores carry the slot accounting. */
+    pthread_t writer_thread;
+    bool writer_running;
+    atomic_int writer_cmd;
+    atomic_uint writer_standby_wr;
+    sem_t ring_filled;
+    sem_t ring_free;
+    /* posted by the writer thread once a WRITER_CMD_STANDBY is executed */
+    sem_t standby_done;
+    char *ring_buf;
+    size_t ring_slot_size;
+    size_t ring_slot_bytes[PLAYBACK_WRITER_RING_SLOTS];
+    unsigned int ring_rd;
+    atomic_uint ring_wr;
+#ifdef PLAYBACK_PARALLEL_SINKS
+    /* sink threads of the secondary PCMs, sinks[PCM_NORMAL] is not used */
+    struct pcm_sink sinks[PCM_TOTAL];
+    bool sinks_running;
+#endif
+#endif
 
+    /* low power output: writes do not block, the callback thread signals when the stream
+     * can accept more frames or has been drained */
+    stream_callback_t offload_callback;
+    void *offload_cookie;
+    pthread_t offload_thread;
+    pthread_cond_t offload_cond;
+    bool offload_thread_exit;
+    int offload_cmd;            /* OFFLOAD_CMD_xxx */
+    bool offload_started;       /* the PCM has been started since the last standby or flush */
+    bool paused;
+    int gain[2];                /* software volume, LOW_POWER_UNITY_GAIN is 0 dB */
+    int16_t *gain_buf;
+
+    struct stream_stats stats;
+    struct perf_lock perf_lock;
     struct tuna_audio_device *dev;
 
     unsigned int sample_rate;
 };
 
+/* last value written to a mixer control referenced by the route tables */
+struct route_ctl
+{
+    const char *name;
+    struct mixer_ctl *ctl;
+    bool valid;
+    int intval;
+    const char *strval;
+};
+
+/* a stopped PCM kept open during the standby hold, reused by the next open of the same
+ * port with the same flags and configuration */
+struct pcm_pool_entry {
+    struct pcm *pcm;
+    unsigned int card;
+    unsigned int port;
+    unsigned int flags;
+    struct pcm_config config;
+};
+
+/* maximum number of distinct mixer controls referenced by the route tables */
+#define MAX_ROUTE_CTLS 32
+
 struct tuna_audio_device {
     struct audio_hw_device hw_device;
 
@@ -457,11 +797,51 @@ struct tuna_audio_device {
     struct tuna_stream_out *outputs[OUTPUT_TOTAL];
     bool mic_mute;
     int tty_mode;
-    struct echo_reference_itfe *echo_reference;
+    struct echo_ring echo_ring;
+    struct capture_hub capture_hub;
+    unsigned int capture_native_rates;  /* CAPTURE_NATIVE_RATE_xxx not refused by the MM-UL */
     bool bluetooth_nrec;
     int wb_amr;
     bool screen_off;
 
+    /* mixer controls of the route tables and their last written values */
+    struct route_ctl route_ctls[MAX_ROUTE_CTLS];
+    unsigned int num_route_ctls;
+    /* last values written by set_output_volumes() */
+    int output_gains[OUTPUT_GAIN_TOTAL];
+
+    /* duration of select_output_device() and select_input_device() */
+    struct route_stats output_route_stats;
+    struct route_stats input_route_stats;
+
+    /* route worker: the fields below are protected by route_lock which must be acquired
+     * after the hw device mutex if both are needed */
+    pthread_t route_thread;
+    pthread_mutex_t route_lock;
+    pthread_cond_t route_cond;
+    bool route_thread_exit;
+    int route_pending;          /* ROUTE_REQ_xxx */
+    int route_out_device;
+    unsigned int route_seq;     /* incremented on each request */
+    uint64_t standby_hold_deadline_ns;  /* end of the standby hold, 0 if none */
+
+    /* standby hold: protected by the hw device mutex */
+    unsigned int standby_hold_ms;
+    struct pcm_pool_entry pcm_pool[PCM_POOL_SIZE];
+    bool output_stage_warm;     /* output stage left on with all outputs in standby */
+
+    /* performance locks of power.tuna, NULL if the module doesn't have them */
+    power_tuna_perf_lock_acquire_t perf_lock_acquire;
+    power_tuna_perf_lock_release_t perf_lock_release;
+
+#ifdef USE_HDMI_AUDIO
+    /* speaker layouts of the HDMI sink, read from its card by the first HDMI output opened
+     * and forgotten when a sink is connected or disconnected: protected by the hw device
+     * mutex */
+    bool hdmi_caps_valid;
+    audio_channel_mask_t hdmi_channel_masks[3];
+#endif
+
     /* RIL */
     void *ril_handle;
 };
@@ -472,6 +852,7 @@ struct route_setting
     char *ctl_name;
     int intval;
     char *strval;
+    struct route_ctl *cache;    /* resolved at adev_open() */
 };
 
 /* These are values that never change */
@@ -713,6 +1094,23 @@ struct route_setting vx_ul_bt[] = {
 };
 
 
+/* all route tables, resolved once at adev_open() */
+struct route_setting *route_tables[] = {
+    defaults,
+    hf_output,
+    hs_output,
+    mm_ul2_bt,
+    mm_ul2_amic_left,
+    mm_ul2_amic_right,
+    mm_ul2_amic_dual_main_sub,
+    mm_ul2_amic_dual_sub_main,
+    vx_ul_amic_left,
+    vx_ul_amic_right,
+    vx_ul_bt,
+    NULL,
+};
+
+
 #define STRING_TO_ENUM(string) { #string, string }
 
 struct string_to_enum {
@@ -0,0 +1,722 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays a workload on audio.primary.tuna linked against a fake tinyalsa backend, so
+ * that no kernel driver is needed, and reports the latency percentiles and the CPU cost
+ * of each read and write call and of the output route switches.
+ *
+ *   audio_hw_bench_tuna [-f] [-v] [workload]
+ *
+ * -f runs the fake hardware instantly instead of in real time, -v dumps the streams and
+ * the device after the workload. A workload is a text file, the built-in one is used if
+ * none is given. Each line is a step run on its own thread, "sync" waits for the steps
+ * started so far, '#' starts a comment:
+ *
+ *   output low_latency|deep_buffer <rate> <frames per write> <writes>
+ *          [route <device>,<device>... <writes per route>]
+ *   input <rate> <channels> <source> <frames per read> <reads> [ns] [aec]
+ *
+ * 0 frames uses the buffer size of the stream. A route list switches the output between
+ * the audio_devices_t given, the time select_output_device() takes for a switch is read
+ * from the device statistics. ns and aec add a fake preprocessor of that type to the
+ * input, which is resampled when its rate differs from the MM-UL one.
+ */
+
+#define LOG_TAG "audio_hw_bench"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/audio.h>
+#include <hardware/audio_effect.h>
+#include <audio_effects/effect_aec.h>
+#include <audio_effects/effect_ns.h>
+
+#include "audio_hw.h"
+#include "fake_tinyalsa.h"
+
+#define MAX_STEPS 16
+#define MAX_ROUTES 8
+#define MAX_LINE 256
+/* longest wait for the route worker to apply a switch requested by the last write */
+#define ROUTE_APPLY_TIMEOUT_MS (ROUTE_SETTLE_MS * 10)
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+enum step_type {
+    STEP_OUTPUT,
+    STEP_INPUT,
+};
+
+struct fake_effect {
+    struct effect_interface_s *itfe;    /* first: an effect_handle_t points to it */
+    effect_descriptor_t desc;
+    effect_config_t config;
+    unsigned int channels;
+    int32_t last_in;
+    int32_t last_out;
+};
+
+struct step {
+    enum step_type type;
+    char name[48];
+    int phase;
+    audio_output_flags_t flags;
+    unsigned int rate;
+    unsigned int channels;
+    audio_source_t source;
+    unsigned int frames;
+    int calls;
+    bool ns;
+    bool aec;
+    audio_devices_t routes[MAX_ROUTES];
+    int num_routes;
+    int route_every;
+
+    struct audio_stream_out *out;
+    struct audio_stream_in *in;
+    struct fake_effect *effects[2];
+    int num_effects;
+    size_t bytes;
+    char *buffer;
+    pthread_t thread;
+
+    int64_t *latency_ns;
+    uint64_t *cost;
+    int done;
+    int failures;
+    int64_t route_ns[MAX_ROUTES * 64];
+    int num_route_ns;
+};
+
+static struct audio_hw_device *sDev;
+static struct step sSteps[MAX_STEPS];
+static int sNumSteps;
+/* the cost is counted in CPU cycles when the kernel gives access to them, else in ns of
+ * thread CPU time */
+static bool sCycles;
+
+static const char *sDefaultWorkload[] = {
+    "# a game with a voice search, a VoIP call, a song through the headset",
+    "output low_latency 48000 0 1500 route 2,4 300",
+    "input 16000 1 1 0 400 ns",
+    "sync",
+    "output low_latency 48000 0 1500",
+    "input 16000 1 7 0 400 ns aec",
+    "sync",
+    "output deep_buffer 44100 0 100 route 2,8 25",
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int64_t cpu_ns(clockid_t clock)
+{
+    struct timespec t;
+
+    clock_gettime(clock, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* CPU cycles counter of the calling thread, -1 if the kernel does not allow it */
+static int cycles_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cost_read(int fd)
+{
+    uint64_t cycles;
+
+    if (fd >= 0 && read(fd, &cycles, sizeof(cycles)) == sizeof(cycles))
+        return cycles;
+    return cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static int32_t fake_effect_process(effect_handle_t self, audio_buffer_t *in_buffer,
+                                   audio_buffer_t *out_buffer)
+{
+    struct fake_effect *effect = (struct fake_effect *)self;
+    size_t samples;
+    size_t i;
+
+    if (!in_buffer || !out_buffer || !in_buffer->s16 || !out_buffer->s16)
+        return -EINVAL;
+
+    /* a DC blocker, for a per sample cost */
+    samples = in_buffer->frameCount * effect->channels;
+    for (i = 0; i < samples; i++) {
+        int32_t x = in_buffer->s16[i];
+        int32_t y = x - effect->last_in + (effect->last_out * 255) / 256;
+
+        effect->last_in = x;
+        effect->last_out = y;
+        out_buffer->s16[i] = y > 32767 ? 32767 : (y < -32768 ? -32768 : y);
+    }
+    return 0;
+}
+
+static int32_t fake_effect_process_reverse(effect_handle_t self, audio_buffer_t *in_buffer,
+                                           audio_buffer_t *out_buffer __unused)
+{
+    struct fake_effect *effect = (struct fake_effect *)self;
+    int32_t energy = 0;
+    size_t i;
+
+    if (!in_buffer || !in_buffer->s16)
+        return -EINVAL;
+
+    for (i = 0; i < in_buffer->frameCount; i++)
+        energy += in_buffer->s16[i] >> 8;
+    effect->last_out += energy & 1;
+    return 0;
+}
+
+static int32_t fake_effect_command(effect_handle_t self, uint32_t cmd, uint32_t cmd_size,
+                                   void *cmd_data, uint32_t *reply_size, void *reply_data)
+{
+    struct fake_effect *effect = (struct fake_effect *)self;
+
+    switch (cmd) {
+    case EFFECT_CMD_GET_CONFIG:
+        if (!reply_data || !reply_size || *reply_size < sizeof(effect_config_t))
+            return -EINVAL;
+        memcpy(reply_data, &effect->config, sizeof(effect_config_t));
+        return 0;
+    case EFFECT_CMD_SET_CONFIG:
+        if (!cmd_data || cmd_size < sizeof(effect_config_t))
+            return -EINVAL;
+        memcpy(&effect->config, cmd_data, sizeof(effect_config_t));
+        break;
+    case EFFECT_CMD_GET_FEATURE_SUPPORTED_CONFIGS:
+    case EFFECT_CMD_GET_FEATURE_CONFIG:
+    case EFFECT_CMD_SET_FEATURE_CONFIG:
+        /* no auxiliary channels */
+        return -EINVAL;
+    default:
+        break;
+    }
+
+    if (reply_data && reply_size && *reply_size >= sizeof(int32_t))
+        *(int32_t *)reply_data = 0;
+    return 0;
+}
+
+static int32_t fake_effect_get_descriptor(effect_handle_t self,
+                                          effect_descriptor_t *descriptor)
+{
+    struct fake_effect *effect = (struct fake_effect *)self;
+
+    *descriptor = effect->desc;
+    return 0;
+}
+
+static struct effect_interface_s sFakeNsInterface = {
+    fake_effect_process,
+    fake_effect_command,
+    fake_effect_get_descriptor,
+    NULL,
+};
+
+static struct effect_interface_s sFakeAecInterface = {
+    fake_effect_process,
+    fake_effect_command,
+    fake_effect_get_descriptor,
+    fake_effect_process_reverse,
+};
+
+static struct fake_effect *fake_effect_create(bool aec, unsigned int channels)
+{
+    struct fake_effect *effect = calloc(1, sizeof(struct fake_effect));
+
+    if (!effect)
+        return NULL;
+
+    effect->itfe = aec ? &sFakeAecInterface : &sFakeNsInterface;
+    memcpy(&effect->desc.type, aec ? FX_IID_AEC : FX_IID_NS, sizeof(effect_uuid_t));
+    effect->desc.apiVersion = EFFECT_CONTROL_API_VERSION;
+    effect->desc.flags = EFFECT_FLAG_TYPE_PRE_PROC;
+    strlcpy(effect->desc.name, aec ? "bench aec" : "bench ns", sizeof(effect->desc.name));
+    strlcpy(effect->desc.implementor, "audio_hw_bench", sizeof(effect->desc.implementor));
+    effect->channels = channels;
+    return effect;
+}
+
+static int parse_routes(struct step *step, char *list)
+{
+    char *save;
+    char *device;
+
+    for (device = strtok_r(list, ",", &save); device; device = strtok_r(NULL, ",", &save)) {
+        if (step->num_routes == MAX_ROUTES)
+            return -EINVAL;
+        step->routes[step->num_routes++] = strtoul(device, NULL, 0);
+    }
+    return step->num_routes > 0 ? 0 : -EINVAL;
+}
+
+/* adds the step of one workload line, returns a negative error if it cannot be parsed */
+static int parse_line(char *line, int *phase)
+{
+    char *args[16];
+    int argc = 0;
+    char *save;
+    char *comment = strchr(line, '#');
+    struct step *step;
+    int i;
+
+    if (comment)
+        *comment = '\0';
+    for (args[argc] = strtok_r(line, " \t\r\n", &save); args[argc] && argc < 15;
+            args[++argc] = strtok_r(NULL, " \t\r\n", &save))
+        ;
+    if (argc == 0)
+        return 0;
+
+    if (strcmp(args[0], "sync") == 0) {
+        (*phase)++;
+        return 0;
+    }
+
+    if (sNumSteps == MAX_STEPS)
+        return -ENOSPC;
+    step = &sSteps[sNumSteps];
+    memset(step, 0, sizeof(*step));
+    step->phase = *phase;
+
+    if (strcmp(args[0], "output") == 0 && argc >= 5) {
+        step->type = STEP_OUTPUT;
+        if (strcmp(args[1], "low_latency") == 0)
+            step->flags = AUDIO_OUTPUT_FLAG_PRIMARY | AUDIO_OUTPUT_FLAG_FAST;
+        else if (strcmp(args[1], "deep_buffer") == 0)
+            step->flags = AUDIO_OUTPUT_FLAG_DEEP_BUFFER;
+        else
+            return -EINVAL;
+        step->rate = atoi(args[2]);
+        step->frames = atoi(args[3]);
+        step->calls = atoi(args[4]);
+        if (argc >= 8 && strcmp(args[5], "route") == 0) {
+            if (parse_routes(step, args[6]) != 0)
+                return -EINVAL;
+            step->route_every = atoi(args[7]);
+            if (step->route_every < 1)
+                return -EINVAL;
+        } else if (argc != 5) {
+            return -EINVAL;
+        }
+        snprintf(step->name, sizeof(step->name), "out_write_%s %u", args[1], step->rate);
+    } else if (strcmp(args[0], "input") == 0 && argc >= 6) {
+        step->type = STEP_INPUT;
+        step->rate = atoi(args[1]);
+        step->channels = atoi(args[2]);
+        step->source = atoi(args[3]);
+        step->frames = atoi(args[4]);
+        step->calls = atoi(args[5]);
+        for (i = 6; i < argc; i++) {
+            if (strcmp(args[i], "ns") == 0)
+                step->ns = true;
+            else if (strcmp(args[i], "aec") == 0)
+                step->aec = true;
+            else
+                return -EINVAL;
+        }
+        snprintf(step->name, sizeof(step->name), "in_read %u/%u source %d%s%s", step->rate,
+                 step->channels, step->source, step->ns ? " ns" : "", step->aec ? " aec" : "");
+    } else {
+        return -EINVAL;
+    }
+
+    if (step->rate == 0 || step->calls < 1)
+        return -EINVAL;
+    sNumSteps++;
+    return 0;
+}
+
+static int load_workload(const char *path)
+{
+    char line[MAX_LINE];
+    FILE *file;
+    int phase = 0;
+    int number = 0;
+    unsigned int i;
+
+    if (!path) {
+        for (i = 0; i < sizeof(sDefaultWorkload) / sizeof(sDefaultWorkload[0]); i++) {
+            strlcpy(line, sDefaultWorkload[i], sizeof(line));
+            if (parse_line(line, &phase) != 0)
+                return -EINVAL;
+        }
+        return 0;
+    }
+
+    file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        if (parse_line(line, &phase) != 0) {
+            fprintf(stderr, "%s:%d: bad step\n", path, number);
+            fclose(file);
+            return -EINVAL;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static void fill_triangle(int16_t *samples, size_t count, unsigned int channels)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        int phase = (i / channels) % 100;
+
+        samples[i] = (phase < 50 ? phase : 100 - phase) * 400 - 10000;
+    }
+}
+
+static int step_open(struct step *step, audio_io_handle_t handle)
+{
+    struct audio_config config;
+    size_t frame_size;
+    int ret;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = step->rate;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+
+    if (step->type == STEP_OUTPUT) {
+        config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        ret = sDev->open_output_stream(sDev, handle, AUDIO_DEVICE_OUT_SPEAKER, step->flags,
+                                       &config, &step->out, NULL);
+        if (ret != 0)
+            return ret;
+        frame_size = audio_stream_out_frame_size(step->out);
+        if (step->frames == 0)
+            step->frames = step->out->common.get_buffer_size(&step->out->common) / frame_size;
+    } else {
+        char parameters[32];
+
+        config.channel_mask = audio_channel_in_mask_from_count(step->channels);
+        ret = sDev->open_input_stream(sDev, handle, AUDIO_DEVICE_IN_BUILTIN_MIC, &config,
+                                      &step->in, AUDIO_INPUT_FLAG_NONE, NULL, step->source);
+        if (ret != 0)
+            return ret;
+        snprintf(parameters, sizeof(parameters), AUDIO_PARAMETER_STREAM_INPUT_SOURCE "=%d",
+                 step->source);
+        step->in->common.set_parameters(&step->in->common, parameters);
+
+        if (step->ns)
+            step->effects[step->num_effects++] = fake_effect_create(false, step->channels);
+        if (step->aec)
+            step->effects[step->num_effects++] = fake_effect_create(true, step->channels);
+        for (i = 0; i < step->num_effects; i++) {
+            if (!step->effects[i])
+                return -ENOMEM;
+            ret = step->in->common.add_audio_effect(&step->in->common,
+                                                    (effect_handle_t)step->effects[i]);
+            if (ret != 0)
+                return ret;
+        }
+
+        frame_size = audio_stream_in_frame_size(step->in);
+        if (step->frames == 0)
+            step->frames = step->in->common.get_buffer_size(&step->in->common) / frame_size;
+    }
+
+    step->bytes = step->frames * frame_size;
+    step->buffer = malloc(step->bytes);
+    step->latency_ns = calloc(step->calls, sizeof(*step->latency_ns));
+    step->cost = calloc(step->calls, sizeof(*step->cost));
+    if (!step->buffer || !step->latency_ns || !step->cost)
+        return -ENOMEM;
+    fill_triangle((int16_t *)step->buffer, step->bytes / sizeof(int16_t),
+                  step->type == STEP_OUTPUT ? 2 : step->channels);
+    return 0;
+}
+
+static void step_close(struct step *step)
+{
+    int i;
+
+    if (step->out)
+        sDev->close_output_stream(sDev, step->out);
+    if (step->in) {
+        for (i = 0; i < step->num_effects; i++)
+            if (step->effects[i])
+                step->in->common.remove_audio_effect(&step->in->common,
+                                                     (effect_handle_t)step->effects[i]);
+        sDev->close_input_stream(sDev, step->in);
+    }
+    for (i = 0; i < step->num_effects; i++)
+        free(step->effects[i]);
+    free(step->buffer);
+    free(step->latency_ns);
+    free(step->cost);
+}
+
+/* records the duration of the route switches applied since the last call, averaged if the
+ * route worker applied several at once */
+static bool route_collect(struct step *step, unsigned int *count, uint64_t *total_ns)
+{
+    struct tuna_audio_device *adev = (struct tuna_audio_device *)sDev;
+    unsigned int new_count = atomic_load(&adev->output_route_stats.count);
+    uint64_t new_total_ns = atomic_load(&adev->output_route_stats.total_ns);
+
+    if (new_count == *count)
+        return false;
+
+    if (step->num_route_ns < (int)(sizeof(step->route_ns) / sizeof(step->route_ns[0])))
+        step->route_ns[step->num_route_ns++] = (new_total_ns - *total_ns) /
+                (new_count - *count);
+    *count = new_count;
+    *total_ns = new_total_ns;
+    return true;
+}
+
+static void *step_loop(void *arg)
+{
+    struct step *step = (struct step *)arg;
+    struct tuna_audio_device *adev = (struct tuna_audio_device *)sDev;
+    int fd = sCycles ? cycles_open() : -1;
+    bool route_pending = false;
+    unsigned int route_count = 0;
+    uint64_t route_total_ns = 0;
+    int i;
+
+    for (i = 0; i < step->calls; i++) {
+        int64_t start;
+        uint64_t start_cost;
+        ssize_t ret;
+
+        if (step->num_routes > 0 && i % step->route_every == 0) {
+            char parameters[32];
+
+            snprintf(parameters, sizeof(parameters), AUDIO_PARAMETER_STREAM_ROUTING "=%d",
+                     step->routes[(i / step->route_every) % step->num_routes]);
+            route_count = atomic_load(&adev->output_route_stats.count);
+            route_total_ns = atomic_load(&adev->output_route_stats.total_ns);
+            step->out->common.set_parameters(&step->out->common, parameters);
+            route_pending = true;
+        }
+
+        start = now_ns();
+        start_cost = cost_read(fd);
+        if (step->type == STEP_OUTPUT)
+            ret = step->out->write(step->out, step->buffer, step->bytes);
+        else
+            ret = step->in->read(step->in, step->buffer, step->bytes);
+        step->cost[i] = cost_read(fd) - start_cost;
+        step->latency_ns[i] = now_ns() - start;
+        if (ret != (ssize_t)step->bytes)
+            step->failures++;
+        step->done++;
+
+        if (route_pending && route_collect(step, &route_count, &route_total_ns))
+            route_pending = false;
+    }
+
+    for (i = 0; route_pending && i < ROUTE_APPLY_TIMEOUT_MS; i++) {
+        usleep(1000);
+        if (route_collect(step, &route_count, &route_total_ns))
+            route_pending = false;
+    }
+
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t la = *(const int64_t *)a;
+    int64_t lb = *(const int64_t *)b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *)a;
+    uint64_t lb = *(const uint64_t *)b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static void print_latency(const char *name, int64_t *latency_ns, int count)
+{
+    qsort(latency_ns, count, sizeof(*latency_ns), compare_int64);
+    printf("%-36s %6d calls  p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us",
+           name, count, latency_ns[count * 50 / 100] / 1e3,
+           latency_ns[count * 90 / 100] / 1e3, latency_ns[count * 99 / 100] / 1e3,
+           latency_ns[count - 1] / 1e3);
+}
+
+static void print_step(struct step *step)
+{
+    if (step->done == 0) {
+        printf("%-36s no call\n", step->name);
+        return;
+    }
+
+    print_latency(step->name, step->latency_ns, step->done);
+    qsort(step->cost, step->done, sizeof(*step->cost), compare_uint64);
+    printf("  %s p50 %10llu p99 %10llu%s\n", sCycles ? "cycles" : "cpu ns",
+           (unsigned long long)step->cost[step->done * 50 / 100],
+           (unsigned long long)step->cost[step->done * 99 / 100],
+           step->failures ? "  FAILURES" : "");
+    if (step->failures)
+        printf("    %d of the calls failed\n", step->failures);
+
+    if (step->num_route_ns > 0) {
+        print_latency("  select_output_device", step->route_ns, step->num_route_ns);
+        printf("\n");
+    }
+}
+
+static int run_phase(int phase, bool verbose)
+{
+    int64_t start = now_ns();
+    int64_t start_cpu = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+    unsigned int start_xruns = fake_pcm_get_xruns();
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < sNumSteps; i++) {
+        if (sSteps[i].phase != phase)
+            continue;
+        ret = step_open(&sSteps[i], i + 1);
+        if (ret != 0) {
+            fprintf(stderr, "Couldn't open the stream of %s: %s\n", sSteps[i].name,
+                    strerror(-ret));
+            break;
+        }
+    }
+    if (ret == 0) {
+        for (i = 0; i < sNumSteps; i++)
+            if (sSteps[i].phase == phase)
+                pthread_create(&sSteps[i].thread, NULL, step_loop, &sSteps[i]);
+        for (i = 0; i < sNumSteps; i++)
+            if (sSteps[i].phase == phase)
+                pthread_join(sSteps[i].thread, NULL);
+
+        printf("phase %d: %.1f ms, process cpu %.1f ms, xruns %u\n", phase,
+               (now_ns() - start) / 1e6,
+               (cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - start_cpu) / 1e6,
+               fake_pcm_get_xruns() - start_xruns);
+        for (i = 0; i < sNumSteps; i++)
+            if (sSteps[i].phase == phase)
+                print_step(&sSteps[i]);
+    }
+
+    for (i = 0; i < sNumSteps; i++) {
+        if (sSteps[i].phase != phase)
+            continue;
+        if (verbose && ret == 0) {
+            struct audio_stream *stream = sSteps[i].out ? &sSteps[i].out->common :
+                    &sSteps[i].in->common;
+
+            fflush(stdout);
+            stream->dump(stream, STDOUT_FILENO);
+        }
+        step_close(&sSteps[i]);
+    }
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f] [-v] [workload]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+    int phases = 0;
+    int err;
+    int fd;
+    int c;
+    int i;
+
+    while ((c = getopt(argc, argv, "fv")) != -1) {
+        switch (c) {
+        case 'f':
+            fake_pcm_set_instant(true);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (load_workload(optind < argc ? argv[optind] : NULL) != 0)
+        return 1;
+    for (i = 0; i < sNumSteps; i++)
+        if (sSteps[i].phase >= phases)
+            phases = sSteps[i].phase + 1;
+
+    fd = cycles_open();
+    sCycles = fd >= 0;
+    if (fd >= 0)
+        close(fd);
+
+    err = audio_hw_device_open(&HAL_MODULE_INFO_SYM.common, &sDev);
+    if (err) {
+        fprintf(stderr, "Couldn't open the audio HAL: %s\n", strerror(-err));
+        return 1;
+    }
+
+    for (i = 0; i < phases && err == 0; i++)
+        err = run_phase(i, verbose);
+
+    if (verbose) {
+        fflush(stdout);
+        sDev->dump(sDev, STDOUT_FILENO);
+    }
+    audio_hw_device_close(sDev);
+
+    return err ? 1 : 0;
+}
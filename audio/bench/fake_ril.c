@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ril_interface.c for audio_hw_bench_tuna: the benchmark must not reach the modem, every
+ * request succeeds without being sent.
+ */
+
+#include "ril_interface.h"
+
+int ril_open(void *ril_handle __unused)
+{
+    return 0;
+}
+
+int ril_close(void *ril_handle __unused)
+{
+    return 0;
+}
+
+int ril_set_call_volume(void *ril_handle __unused, enum _SoundType sound_type __unused,
+                        float volume __unused)
+{
+    return 0;
+}
+
+int ril_set_call_audio_path(void *ril_handle __unused, enum _AudioPath path __unused)
+{
+    return 0;
+}
+
+int ril_set_mic_mute(void *ril_handle __unused, enum _MuteCondition state __unused)
+{
+    return 0;
+}
+
+void ril_register_set_wb_amr_callback(void *function __unused, void *data __unused)
+{
+}
+
+void ril_dump(void *ril_handle __unused, int fd __unused)
+{
+}
+
+void ril_queue_call_volume(void *ril_handle __unused, enum _SoundType sound_type __unused,
+                           float volume __unused)
+{
+}
+
+void ril_queue_call_audio_path(void *ril_handle __unused, enum _AudioPath path __unused)
+{
+}
+
+void ril_queue_mic_mute(void *ril_handle __unused, enum _MuteCondition state __unused)
+{
+}
+
+int ril_wait_queue(void)
+{
+    return 0;
+}
@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The tinyalsa calls of the audio HAL without a kernel driver, for audio_hw_bench_tuna.
+ * Only what audio_hw.c uses is there. A PCM is a ring of period_size * period_count
+ * frames: the HAL moves the application pointer with its reads and writes, the hardware
+ * pointer follows the monotonic clock at the configured rate from the start of the PCM.
+ * Writes and reads block as the driver would, an output stops on underrun and a capture
+ * reports the overrun through its avail as the kernel does.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tinyalsa/asoundlib.h>
+
+#include "fake_tinyalsa.h"
+
+/* values of every mixer control, ranges are not checked */
+#define FAKE_MIXER_NUM_VALUES   2
+#define FAKE_MIXER_RANGE_MAX    127
+/* period of the triangle wave the capture buffers are filled with */
+#define FAKE_CAPTURE_WAVE_FRAMES 48
+
+struct pcm {
+    unsigned int flags;
+    struct pcm_config config;
+    unsigned int buffer_size;   /* in frames */
+    unsigned int frame_bytes;
+    unsigned int avail_min;
+    unsigned int start_threshold;
+    char *buffer;
+
+    bool running;
+    uint64_t start_ns;          /* when the hardware pointer was last at base */
+    uint64_t base;
+    uint64_t hw;                /* frames played or captured so far */
+    uint64_t appl;              /* frames written or read by the HAL so far */
+};
+
+struct mixer_ctl {
+    struct mixer_ctl *next;
+    char *name;
+    int values[FAKE_MIXER_NUM_VALUES];
+};
+
+struct mixer {
+    unsigned int card;
+    struct mixer_ctl *ctls;
+};
+
+static bool fake_instant;
+static atomic_uint fake_xruns;
+
+void fake_pcm_set_instant(bool instant)
+{
+    fake_instant = instant;
+}
+
+unsigned int fake_pcm_get_xruns(void)
+{
+    return atomic_load(&fake_xruns);
+}
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_frames(const struct pcm *pcm, unsigned int frames)
+{
+    uint64_t ns = (uint64_t)frames * 1000000000ULL / pcm->config.rate;
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    nanosleep(&ts, NULL);
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static unsigned int format_bytes(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S8:
+        return 1;
+    case PCM_FORMAT_S16_LE:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+static void pcm_start_clock(struct pcm *pcm)
+{
+    pcm->running = true;
+    pcm->start_ns = get_time_ns();
+    pcm->base = pcm->hw;
+}
+
+/* moves the hardware pointer to the current time */
+static void pcm_update_hw(struct pcm *pcm)
+{
+    uint64_t clock;
+
+    if (!pcm->running)
+        return;
+
+    if (pcm->flags & PCM_IN) {
+        pcm->hw = fake_instant ? pcm->appl + pcm->buffer_size :
+                pcm->base + (get_time_ns() - pcm->start_ns) * pcm->config.rate / 1000000000ULL;
+        return;
+    }
+
+    clock = fake_instant ? pcm->appl :
+            pcm->base + (get_time_ns() - pcm->start_ns) * pcm->config.rate / 1000000000ULL;
+    if (clock > pcm->appl) {
+        /* underrun: the driver stops the stream until the next write */
+        atomic_fetch_add(&fake_xruns, 1);
+        pcm->running = false;
+        clock = pcm->appl;
+    }
+    pcm->hw = clock;
+}
+
+/* frames that can be written to an output, or read from a capture: above the buffer size
+ * after an overrun */
+static int pcm_avail(struct pcm *pcm)
+{
+    pcm_update_hw(pcm);
+    if (pcm->flags & PCM_IN)
+        return pcm->hw - pcm->appl;
+    return pcm->buffer_size - (pcm->appl - pcm->hw);
+}
+
+static void pcm_commit_frames(struct pcm *pcm, unsigned int frames)
+{
+    pcm->appl += frames;
+    if (!(pcm->flags & PCM_IN) && !pcm->running &&
+            pcm->appl - pcm->hw >= pcm->start_threshold)
+        pcm_start_clock(pcm);
+}
+
+/* copies between the HAL buffer and the ring, blocking until all frames are transferred */
+static int pcm_transfer(struct pcm *pcm, char *data, unsigned int frames)
+{
+    while (frames > 0) {
+        unsigned int offset;
+        unsigned int chunk;
+        int avail;
+
+        if ((pcm->flags & PCM_IN) && !pcm->running)
+            pcm_start_clock(pcm);
+
+        avail = pcm_avail(pcm);
+        if ((pcm->flags & PCM_IN) && avail > (int)pcm->buffer_size) {
+            /* overrun: the frames lost are skipped as after a prepare and start */
+            atomic_fetch_add(&fake_xruns, 1);
+            pcm->appl = pcm->hw;
+            continue;
+        }
+        if (avail <= 0) {
+            /* a full output that has not reached its start threshold starts now */
+            if (!pcm->running)
+                pcm_start_clock(pcm);
+            sleep_frames(pcm, frames < pcm->avail_min ? frames : pcm->avail_min);
+            continue;
+        }
+
+        offset = pcm->appl % pcm->buffer_size;
+        chunk = pcm->buffer_size - offset;
+        if (chunk > (unsigned int)avail)
+            chunk = avail;
+        if (chunk > frames)
+            chunk = frames;
+
+        if (pcm->flags & PCM_IN)
+            memcpy(data, pcm->buffer + offset * pcm->frame_bytes, chunk * pcm->frame_bytes);
+        else
+            memcpy(pcm->buffer + offset * pcm->frame_bytes, data, chunk * pcm->frame_bytes);
+        pcm_commit_frames(pcm, chunk);
+        data += chunk * pcm->frame_bytes;
+        frames -= chunk;
+    }
+
+    return 0;
+}
+
+struct pcm *pcm_open(unsigned int card __unused, unsigned int device __unused,
+                     unsigned int flags, struct pcm_config *config)
+{
+    struct pcm *pcm = calloc(1, sizeof(struct pcm));
+
+    if (!pcm)
+        return NULL;
+
+    pcm->flags = flags;
+    pcm->config = *config;
+    pcm->buffer_size = config->period_size * config->period_count;
+    pcm->frame_bytes = config->channels * format_bytes(config->format);
+    pcm->avail_min = config->avail_min ? (unsigned int)config->avail_min : config->period_size;
+    pcm->start_threshold = config->start_threshold ? config->start_threshold :
+            pcm->buffer_size / 2;
+    pcm->buffer = calloc(pcm->buffer_size, pcm->frame_bytes);
+    if (!pcm->buffer) {
+        free(pcm);
+        return NULL;
+    }
+
+    if ((flags & PCM_IN) && config->format == PCM_FORMAT_S16_LE) {
+        int16_t *samples = (int16_t *)pcm->buffer;
+        unsigned int i;
+
+        for (i = 0; i < pcm->buffer_size * config->channels; i++) {
+            int phase = (i / config->channels) % FAKE_CAPTURE_WAVE_FRAMES;
+            int ramp = phase < FAKE_CAPTURE_WAVE_FRAMES / 2 ?
+                    phase : FAKE_CAPTURE_WAVE_FRAMES - phase;
+
+            samples[i] = (ramp * 4 * 8192) / FAKE_CAPTURE_WAVE_FRAMES - 8192;
+        }
+    }
+
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (!pcm)
+        return 0;
+    free(pcm->buffer);
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm != NULL;
+}
+
+const char *pcm_get_error(struct pcm *pcm __unused)
+{
+    return "";
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_size;
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->frame_bytes;
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail, struct timespec *tstamp)
+{
+    int frames = pcm_avail(pcm);
+
+    if (!pcm->running)
+        return -1;
+
+    *avail = frames > (int)pcm->buffer_size ? pcm->buffer_size : (unsigned int)frames;
+    clock_gettime(CLOCK_MONOTONIC, tstamp);
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    return pcm_transfer(pcm, (char *)data, count / pcm->frame_bytes);
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    return pcm_transfer(pcm, (char *)data, count / pcm->frame_bytes);
+}
+
+int pcm_mmap_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    return pcm_transfer(pcm, (char *)data, count / pcm->frame_bytes);
+}
+
+int pcm_mmap_avail(struct pcm *pcm)
+{
+    return pcm_avail(pcm);
+}
+
+int pcm_mmap_begin(struct pcm *pcm, void **areas, unsigned int *offset,
+                   unsigned int *frames)
+{
+    int avail = pcm_avail(pcm);
+    unsigned int contiguous;
+
+    if (avail < 0)
+        avail = 0;
+    if (avail > (int)pcm->buffer_size)
+        avail = pcm->buffer_size;
+
+    *areas = pcm->buffer;
+    *offset = pcm->appl % pcm->buffer_size;
+    contiguous = pcm->buffer_size - *offset;
+    if (*frames > (unsigned int)avail)
+        *frames = avail;
+    if (*frames > contiguous)
+        *frames = contiguous;
+    return 0;
+}
+
+int pcm_mmap_commit(struct pcm *pcm, unsigned int offset __unused, unsigned int frames)
+{
+    pcm_commit_frames(pcm, frames);
+    return frames;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    pcm->running = false;
+    pcm->hw = pcm->appl;
+    return 0;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+    if (pcm->flags & PCM_IN)
+        pcm->hw = pcm->appl;
+    pcm_start_clock(pcm);
+    return 0;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    return pcm_prepare(pcm);
+}
+
+int pcm_set_avail_min(struct pcm *pcm, int avail_min)
+{
+    pcm->avail_min = avail_min;
+    return 0;
+}
+
+/* waits for avail_min frames. In NOIRQ mode the driver never wakes poll() up: it only
+ * returns early if they are already there */
+int pcm_wait(struct pcm *pcm, int timeout)
+{
+    int avail = pcm_avail(pcm);
+    uint64_t needed_ns;
+
+    if (avail >= (int)pcm->avail_min || fake_instant)
+        return 1;
+
+    needed_ns = (uint64_t)(pcm->avail_min - avail) * 1000000000ULL / pcm->config.rate;
+    if (!pcm->running || (pcm->flags & PCM_NOIRQ) ||
+            needed_ns >= (uint64_t)timeout * 1000000ULL) {
+        sleep_ms(timeout);
+        return 0;
+    }
+    sleep_frames(pcm, pcm->avail_min - avail);
+    return 1;
+}
+
+/* only SNDRV_PCM_IOCTL_PAUSE is used: the clock keeps running, as the time paused is not
+ * measured */
+int pcm_ioctl(struct pcm *pcm __unused, int request __unused, ...)
+{
+    return 0;
+}
+
+struct mixer *mixer_open(unsigned int card)
+{
+    struct mixer *mixer = calloc(1, sizeof(struct mixer));
+
+    if (mixer)
+        mixer->card = card;
+    return mixer;
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    struct mixer_ctl *ctl;
+
+    if (!mixer)
+        return;
+    while ((ctl = mixer->ctls) != NULL) {
+        mixer->ctls = ctl->next;
+        free(ctl->name);
+        free(ctl);
+    }
+    free(mixer);
+}
+
+/* every control exists: it is created on its first lookup */
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    struct mixer_ctl *ctl;
+
+    for (ctl = mixer->ctls; ctl; ctl = ctl->next)
+        if (strcmp(ctl->name, name) == 0)
+            return ctl;
+
+    ctl = calloc(1, sizeof(struct mixer_ctl));
+    if (!ctl)
+        return NULL;
+    ctl->name = strdup(name);
+    if (!ctl->name) {
+        free(ctl);
+        return NULL;
+    }
+    ctl->next = mixer->ctls;
+    mixer->ctls = ctl;
+    return ctl;
+}
+
+unsigned int mixer_ctl_get_num_values(struct mixer_ctl *ctl __unused)
+{
+    return FAKE_MIXER_NUM_VALUES;
+}
+
+int mixer_ctl_get_range_max(struct mixer_ctl *ctl __unused)
+{
+    return FAKE_MIXER_RANGE_MAX;
+}
+
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    if (!ctl || id >= FAKE_MIXER_NUM_VALUES)
+        return -EINVAL;
+    return ctl->values[id];
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    if (!ctl || id >= FAKE_MIXER_NUM_VALUES)
+        return -EINVAL;
+    ctl->values[id] = value;
+    return 0;
+}
+
+int mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string __unused)
+{
+    return ctl ? 0 : -EINVAL;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAKE_TINYALSA_H
+#define FAKE_TINYALSA_H
+
+#include <stdbool.h>
+
+/* Controls of the tinyalsa backend audio_hw_bench_tuna links the HAL against: the PCMs
+ * are memory buffers whose hardware pointer runs from the monotonic clock at the
+ * configured rate, so that the HAL paces and schedules as on the device. */
+
+/* in instant mode the hardware pointer is always as far as it can be: output buffers are
+ * drained and capture buffers full whenever the HAL looks at them, nothing ever waits */
+void fake_pcm_set_instant(bool instant);
+
+/* underruns and overruns seen by all the PCMs so far */
+unsigned int fake_pcm_get_xruns(void);
+
+#endif /* FAKE_TINYALSA_H */
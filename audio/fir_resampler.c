@@ -0,0 +1,594 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/cdefs.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include <cutils/log.h>
+
+#include "fir_resampler.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* frames pulled from the provider per refill, on top of the filter history */
+#define FIR_CHUNK_FRAMES 512
+
+/* Filter tables: Kaiser windowed sinc (beta 7), Q15, one row of taps per polyphase
+ * branch. The taps of each branch are stored in reverse order so that an output sample
+ * is a plain dot product with the oldest-first input window, and each branch is
+ * normalized to unity DC gain.
+ * 48000 -> 16000: 48 taps, -6 dB at 7200 Hz
+ * 48000 -> 8000: 96 taps, -6 dB at 3600 Hz
+ * 48000 -> 44100: 147 branches of 16 taps, -6 dB at 20000 Hz
+ */
+static const int16_t fir_coefs_48000_16000[1 * 48] = {
+         0,      4,     12,      9,    -15,    -49,    -51,     16,    122,    164,     38,   -220,
+      -393,   -229,    287,    783,    701,   -195,  -1412,  -1832,   -434,   2843,   6777,   9456,
+      9456,   6777,   2843,   -434,  -1832,  -1412,   -195,    701,    783,    287,   -229,   -393,
+      -220,     38,    164,    122,     16,    -51,    -49,    -15,      9,     12,      4,      0,
+};
+
+static const int16_t fir_coefs_48000_8000[1 * 96] = {
+         0,      0,      2,      4,      6,      7,      7,      3,     -4,    -13,    -22,    -29,
+       -30,    -22,     -4,     22,     50,     75,     86,     77,     44,    -10,    -78,   -144,
+      -190,   -199,   -157,    -63,     71,    220,    350,    421,    403,    276,     46,   -254,
+      -569,   -823,   -937,   -840,   -491,    118,    949,   1919,   2919,   3820,   4501,   4868,
+      4868,   4501,   3820,   2919,   1919,    949,    118,   -491,   -840,   -937,   -823,   -569,
+      -254,     46,    276,    403,    421,    350,    220,     71,    -63,   -157,   -199,   -190,
+      -144,    -78,    -10,     44,     77,     86,     75,     50,     22,     -4,    -22,    -30,
+       -29,    -22,    -13,     -4,      3,      7,      7,      6,      4,      2,      0,      0,
+};
+
+static const int16_t fir_coefs_48000_44100[147 * 16] = {
+       -29,     -2,    259,   -955,   2165,  -3650,   4863,  27314,   5053,  -3706,   2175,   -950,
+       252,      2,    -30,      7,
+       -28,     -5,    265,   -960,   2155,  -3594,   4674,  27311,   5245,  -3761,   2184,   -944,
+       246,      5,    -31,      7,
+       -27,     -9,    271,   -964,   2144,  -3537,   4487,  27305,   5437,  -3815,   2192,   -939,
+       239,      9,    -33,      7,
+       -25,    -12,    277,   -969,   2132,  -3480,   4300,  27296,   5631,  -3868,   2200,   -932,
+       232,     13,    -34,      7,
+       -24,    -16,    283,   -972,   2120,  -3421,   4115,  27284,   5825,  -3921,   2207,   -926,
+       225,     17,    -35,      8,
+       -23,    -19,    288,   -976,   2107,  -3363,   3931,  27268,   6021,  -3972,   2213,   -918,
+       218,     21,    -36,      8,
+       -22,    -22,    294,   -978,   2093,  -3303,   3749,  27250,   6218,  -4023,   2219,   -911,
+       210,     24,    -38,      8,
+       -21,    -25,    299,   -981,   2079,  -3244,   3568,  27229,   6416,  -4073,   2224,   -903,
+       203,     28,    -39,      8,
+       -20,    -29,    304,   -983,   2065,  -3183,   3388,  27205,   6614,  -4123,   2228,   -895,
+       195,     32,    -40,      9,
+       -19,    -32,    309,   -985,   2050,  -3122,   3210,  27177,   6814,  -4171,   2232,   -886,
+       187,     36,    -42,      9,
+       -18,    -35,    314,   -987,   2034,  -3061,   3034,  27147,   7015,  -4218,   2235,   -877,
+       179,     40,    -43,      9,
+       -17,    -38,    319,   -988,   2018,  -2999,   2858,  27114,   7216,  -4265,   2237,   -868,
+       171,     44,    -44,      9,
+       -15,    -41,    323,   -989,   2001,  -2937,   2685,  27078,   7418,  -4310,   2238,   -858,
+       163,     49,    -45,      9,
+       -14,    -44,    327,   -989,   1984,  -2875,   2513,  27039,   7621,  -4355,   2239,   -848,
+       154,     53,    -47,     10,
+       -13,    -46,    331,   -989,   1966,  -2812,   2342,  26997,   7825,  -4398,   2239,   -837,
+       145,     57,    -48,     10,
+       -12,    -49,    335,   -989,   1947,  -2749,   2173,  26952,   8030,  -4440,   2238,   -826,
+       137,     61,    -49,     10,
+       -11,    -52,    339,   -988,   1929,  -2685,   2006,  26904,   8235,  -4482,   2236,   -815,
+       128,     66,    -51,     10,
+       -10,    -55,    343,   -987,   1909,  -2621,   1840,  26853,   8441,  -4522,   2234,   -803,
+       119,     70,    -52,     11,
+        -9,    -57,    346,   -986,   1889,  -2557,   1676,  26799,   8648,  -4561,   2230,   -791,
+       109,     74,    -53,     11,
+        -8,    -60,    349,   -985,   1869,  -2493,   1513,  26742,   8855,  -4599,   2226,   -778,
+       100,     79,    -55,     11,
+        -8,    -62,    353,   -983,   1848,  -2428,   1353,  26682,   9063,  -4636,   2222,   -765,
+        90,     83,    -56,     11,
+        -7,    -64,    356,   -980,   1827,  -2363,   1194,  26620,   9271,  -4672,   2216,   -752,
+        81,     88,    -57,     12,
+        -6,    -67,    358,   -978,   1806,  -2299,   1036,  26555,   9480,  -4706,   2210,   -738,
+        71,     92,    -59,     12,
+        -5,    -69,    361,   -975,   1784,  -2233,    881,  26486,   9689,  -4739,   2202,   -724,
+        61,     97,    -60,     12,
+        -4,    -71,    363,   -972,   1761,  -2168,    727,  26415,   9899,  -4771,   2194,   -710,
+        51,    101,    -61,     12,
+        -3,    -74,    366,   -968,   1739,  -2103,    575,  26341,  10109,  -4802,   2186,   -695,
+        41,    106,    -63,     13,
+        -2,    -76,    368,   -965,   1716,  -2037,    425,  26265,  10320,  -4831,   2176,   -679,
+        31,    110,    -64,     13,
+        -2,    -78,    370,   -961,   1692,  -1972,    277,  26185,  10530,  -4859,   2166,   -664,
+        20,    115,    -65,     13,
+        -1,    -80,    372,   -956,   1668,  -1906,    130,  26103,  10741,  -4886,   2154,   -648,
+        10,    119,    -67,     13,
+         0,    -82,    373,   -952,   1644,  -1841,    -14,  26018,  10953,  -4911,   2142,   -631,
+        -1,    124,    -68,     13,
+         1,    -83,    375,   -947,   1619,  -1775,   -157,  25930,  11164,  -4935,   2129,   -615,
+       -12,    129,    -69,     14,
+         2,    -85,    376,   -942,   1594,  -1709,   -298,  25840,  11376,  -4957,   2115,   -597,
+       -23,    133,    -71,     14,
+         2,    -87,    378,   -936,   1569,  -1644,   -437,  25746,  11588,  -4979,   2101,   -580,
+       -34,    138,    -72,     14,
+         3,    -89,    379,   -930,   1544,  -1578,   -574,  25651,  11799,  -4998,   2085,   -562,
+       -45,    143,    -73,     14,
+         4,    -90,    380,   -924,   1518,  -1513,   -709,  25552,  12011,  -5016,   2069,   -544,
+       -56,    148,    -75,     15,
+         4,    -92,    380,   -918,   1492,  -1448,   -842,  25451,  12223,  -5033,   2052,   -525,
+       -67,    152,    -76,     15,
+         5,    -93,    381,   -912,   1465,  -1383,   -973,  25347,  12435,  -5048,   2034,   -506,
+       -79,    157,    -77,     15,
+         6,    -95,    382,   -905,   1439,  -1317,  -1103,  25241,  12647,  -5062,   2015,   -487,
+       -90,    162,    -78,     15,
+         6,    -96,    382,   -898,   1412,  -1253,  -1230,  25132,  12859,  -5074,   1995,   -467,
+      -102,    166,    -80,     15,
+         7,    -97,    382,   -891,   1385,  -1188,  -1355,  25020,  13070,  -5084,   1975,   -447,
+      -114,    171,    -81,     16,
+         8,    -99,    382,   -883,   1358,  -1123,  -1478,  24906,  13282,  -5093,   1953,   -427,
+      -126,    176,    -82,     16,
+         8,   -100,    382,   -876,   1330,  -1059,  -1600,  24789,  13493,  -5101,   1931,   -406,
+      -137,    181,    -83,     16,
+         9,   -101,    382,   -868,   1302,   -995,  -1719,  24670,  13704,  -5106,   1908,   -385,
+      -149,    185,    -85,     16,
+         9,   -102,    382,   -859,   1274,   -931,  -1836,  24549,  13914,  -5110,   1884,   -364,
+      -161,    190,    -86,     16,
+        10,   -103,    381,   -851,   1246,   -868,  -1951,  24425,  14124,  -5113,   1859,   -342,
+      -173,    195,    -87,     16,
+        10,   -104,    381,   -843,   1218,   -805,  -2064,  24298,  14334,  -5113,   1833,   -320,
+      -186,    199,    -88,     17,
+        11,   -105,    380,   -834,   1190,   -742,  -2175,  24169,  14544,  -5112,   1807,   -298,
+      -198,    204,    -89,     17,
+        11,   -106,    379,   -825,   1161,   -679,  -2284,  24038,  14753,  -5109,   1780,   -276,
+      -210,    209,    -90,     17,
+        12,   -107,    378,   -816,   1132,   -617,  -2391,  23905,  14961,  -5105,   1751,   -253,
+      -223,    213,    -91,     17,
+        12,   -108,    377,   -806,   1104,   -555,  -2496,  23769,  15169,  -5098,   1722,   -229,
+      -235,    218,    -93,     17,
+        13,   -108,    376,   -797,   1075,   -494,  -2599,  23631,  15376,  -5090,   1692,   -206,
+      -247,    223,    -94,     17,
+        13,   -109,    374,   -787,   1046,   -432,  -2699,  23491,  15583,  -5081,   1662,   -182,
+      -260,    227,    -95,     18,
+        13,   -110,    373,   -777,   1017,   -372,  -2798,  23348,  15789,  -5069,   1630,   -158,
+      -273,    232,    -96,     18,
+        14,   -110,    371,   -767,    987,   -311,  -2894,  23203,  15995,  -5055,   1598,   -134,
+      -285,    236,    -97,     18,
+        14,   -111,    370,   -757,    958,   -252,  -2989,  23056,  16199,  -5040,   1564,   -109,
+      -298,    241,    -98,     18,
+        14,   -111,    368,   -746,    929,   -192,  -3081,  22907,  16403,  -5023,   1530,    -84,
+      -310,    245,    -99,     18,
+        15,   -112,    366,   -736,    899,   -133,  -3171,  22756,  16606,  -5004,   1495,    -59,
+      -323,    250,   -100,     18,
+        15,   -112,    364,   -725,    870,    -75,  -3259,  22603,  16808,  -4983,   1460,    -33,
+      -336,    254,   -101,     18,
+        15,   -112,    362,   -714,    841,    -17,  -3345,  22448,  17010,  -4960,   1423,     -8,
+      -348,    259,   -101,     18,
+        16,   -112,    360,   -703,    811,     40,  -3429,  22290,  17210,  -4936,   1386,     18,
+      -361,    263,   -102,     18,
+        16,   -113,    357,   -692,    782,     97,  -3511,  22131,  17410,  -4909,   1347,     44,
+      -374,    267,   -103,     18,
+        16,   -113,    355,   -681,    752,    153,  -3591,  21970,  17608,  -4880,   1309,     71,
+      -387,    271,   -104,     18,
+        16,   -113,    352,   -670,    723,    209,  -3668,  21807,  17805,  -4850,   1269,     97,
+      -399,    276,   -105,     18,
+        17,   -113,    350,   -658,    693,    264,  -3744,  21642,  18002,  -4818,   1228,    124,
+      -412,    280,   -105,     18,
+        17,   -113,    347,   -646,    664,    319,  -3817,  21475,  18197,  -4783,   1187,    151,
+      -425,    284,   -106,     18,
+        17,   -113,    344,   -635,    635,    372,  -3888,  21307,  18391,  -4747,   1145,    178,
+      -438,    288,   -107,     18,
+        17,   -113,    341,   -623,    605,    426,  -3957,  21136,  18584,  -4708,   1102,    206,
+      -450,    292,   -107,     18,
+        17,   -113,    338,   -611,    576,    479,  -4025,  20964,  18775,  -4668,   1058,    233,
+      -463,    296,   -108,     18,
+        18,   -113,    335,   -599,    547,    531,  -4090,  20790,  18965,  -4626,   1014,    261,
+      -476,    300,   -109,     18,
+        18,   -112,    332,   -587,    518,    582,  -4152,  20615,  19154,  -4581,    969,    289,
+      -488,    304,   -109,     18,
+        18,   -112,    329,   -575,    489,    633,  -4213,  20438,  19342,  -4535,    923,    317,
+      -501,    307,   -110,     18,
+        18,   -112,    325,   -563,    460,    683,  -4272,  20259,  19528,  -4486,    876,    346,
+      -513,    311,   -110,     18,
+        18,   -111,    322,   -550,    431,    732,  -4329,  20078,  19713,  -4436,    829,    374,
+      -526,    315,   -111,     18,
+        18,   -111,    318,   -538,    402,    781,  -4383,  19897,  19897,  -4383,    781,    402,
+      -538,    318,   -111,     18,
+        18,   -111,    315,   -526,    374,    829,  -4436,  19713,  20078,  -4329,    732,    431,
+      -550,    322,   -111,     18,
+        18,   -110,    311,   -513,    346,    876,  -4486,  19528,  20259,  -4272,    683,    460,
+      -563,    325,   -112,     18,
+        18,   -110,    307,   -501,    317,    923,  -4535,  19342,  20438,  -4213,    633,    489,
+      -575,    329,   -112,     18,
+        18,   -109,    304,   -488,    289,    969,  -4581,  19154,  20615,  -4152,    582,    518,
+      -587,    332,   -112,     18,
+        18,   -109,    300,   -476,    261,   1014,  -4626,  18965,  20790,  -4090,    531,    547,
+      -599,    335,   -113,     18,
+        18,   -108,    296,   -463,    233,   1058,  -4668,  18775,  20964,  -4025,    479,    576,
+      -611,    338,   -113,     17,
+        18,   -107,    292,   -450,    206,   1102,  -4708,  18584,  21136,  -3957,    426,    605,
+      -623,    341,   -113,     17,
+        18,   -107,    288,   -438,    178,   1145,  -4747,  18391,  21307,  -3888,    372,    635,
+      -635,    344,   -113,     17,
+        18,   -106,    284,   -425,    151,   1187,  -4783,  18197,  21475,  -3817,    319,    664,
+      -646,    347,   -113,     17,
+        18,   -105,    280,   -412,    124,   1228,  -4818,  18002,  21642,  -3744,    264,    693,
+      -658,    350,   -113,     17,
+        18,   -105,    276,   -399,     97,   1269,  -4850,  17805,  21807,  -3668,    209,    723,
+      -670,    352,   -113,     16,
+        18,   -104,    271,   -387,     71,   1309,  -4880,  17608,  21970,  -3591,    153,    752,
+      -681,    355,   -113,     16,
+        18,   -103,    267,   -374,     44,   1347,  -4909,  17410,  22131,  -3511,     97,    782,
+      -692,    357,   -113,     16,
+        18,   -102,    263,   -361,     18,   1386,  -4936,  17210,  22290,  -3429,     40,    811,
+      -703,    360,   -112,     16,
+        18,   -101,    259,   -348,     -8,   1423,  -4960,  17010,  22448,  -3345,    -17,    841,
+      -714,    362,   -112,     15,
+        18,   -101,    254,   -336,    -33,   1460,  -4983,  16808,  22603,  -3259,    -75,    870,
+      -725,    364,   -112,     15,
+        18,   -100,    250,   -323,    -59,   1495,  -5004,  16606,  22756,  -3171,   -133,    899,
+      -736,    366,   -112,     15,
+        18,    -99,    245,   -310,    -84,   1530,  -5023,  16403,  22907,  -3081,   -192,    929,
+      -746,    368,   -111,     14,
+        18,    -98,    241,   -298,   -109,   1564,  -5040,  16199,  23056,  -2989,   -252,    958,
+      -757,    370,   -111,     14,
+        18,    -97,    236,   -285,   -134,   1598,  -5055,  15995,  23203,  -2894,   -311,    987,
+      -767,    371,   -110,     14,
+        18,    -96,    232,   -273,   -158,   1630,  -5069,  15789,  23348,  -2798,   -372,   1017,
+      -777,    373,   -110,     13,
+        18,    -95,    227,   -260,   -182,   1662,  -5081,  15583,  23491,  -2699,   -432,   1046,
+      -787,    374,   -109,     13,
+        17,    -94,    223,   -247,   -206,   1692,  -5090,  15376,  23631,  -2599,   -494,   1075,
+      -797,    376,   -108,     13,
+        17,    -93,    218,   -235,   -229,   1722,  -5098,  15169,  23769,  -2496,   -555,   1104,
+      -806,    377,   -108,     12,
+        17,    -91,    213,   -223,   -253,   1751,  -5105,  14961,  23905,  -2391,   -617,   1132,
+      -816,    378,   -107,     12,
+        17,    -90,    209,   -210,   -276,   1780,  -5109,  14753,  24038,  -2284,   -679,   1161,
+      -825,    379,   -106,     11,
+        17,    -89,    204,   -198,   -298,   1807,  -5112,  14544,  24169,  -2175,   -742,   1190,
+      -834,    380,   -105,     11,
+        17,    -88,    199,   -186,   -320,   1833,  -5113,  14334,  24298,  -2064,   -805,   1218,
+      -843,    381,   -104,     10,
+        16,    -87,    195,   -173,   -342,   1859,  -5113,  14124,  24425,  -1951,   -868,   1246,
+      -851,    381,   -103,     10,
+        16,    -86,    190,   -161,   -364,   1884,  -5110,  13914,  24549,  -1836,   -931,   1274,
+      -859,    382,   -102,      9,
+        16,    -85,    185,   -149,   -385,   1908,  -5106,  13704,  24670,  -1719,   -995,   1302,
+      -868,    382,   -101,      9,
+        16,    -83,    181,   -137,   -406,   1931,  -5101,  13493,  24789,  -1600,  -1059,   1330,
+      -876,    382,   -100,      8,
+        16,    -82,    176,   -126,   -427,   1953,  -5093,  13282,  24906,  -1478,  -1123,   1358,
+      -883,    382,    -99,      8,
+        16,    -81,    171,   -114,   -447,   1975,  -5084,  13070,  25020,  -1355,  -1188,   1385,
+      -891,    382,    -97,      7,
+        15,    -80,    166,   -102,   -467,   1995,  -5074,  12859,  25132,  -1230,  -1253,   1412,
+      -898,    382,    -96,      6,
+        15,    -78,    162,    -90,   -487,   2015,  -5062,  12647,  25241,  -1103,  -1317,   1439,
+      -905,    382,    -95,      6,
+        15,    -77,    157,    -79,   -506,   2034,  -5048,  12435,  25347,   -973,  -1383,   1465,
+      -912,    381,    -93,      5,
+        15,    -76,    152,    -67,   -525,   2052,  -5033,  12223,  25451,   -842,  -1448,   1492,
+      -918,    380,    -92,      4,
+        15,    -75,    148,    -56,   -544,   2069,  -5016,  12011,  25552,   -709,  -1513,   1518,
+      -924,    380,    -90,      4,
+        14,    -73,    143,    -45,   -562,   2085,  -4998,  11799,  25651,   -574,  -1578,   1544,
+      -930,    379,    -89,      3,
+        14,    -72,    138,    -34,   -580,   2101,  -4979,  11588,  25746,   -437,  -1644,   1569,
+      -936,    378,    -87,      2,
+        14,    -71,    133,    -23,   -597,   2115,  -4957,  11376,  25840,   -298,  -1709,   1594,
+      -942,    376,    -85,      2,
+        14,    -69,    129,    -12,   -615,   2129,  -4935,  11164,  25930,   -157,  -1775,   1619,
+      -947,    375,    -83,      1,
+        13,    -68,    124,     -1,   -631,   2142,  -4911,  10953,  26018,    -14,  -1841,   1644,
+      -952,    373,    -82,      0,
+        13,    -67,    119,     10,   -648,   2154,  -4886,  10741,  26103,    130,  -1906,   1668,
+      -956,    372,    -80,     -1,
+        13,    -65,    115,     20,   -664,   2166,  -4859,  10530,  26185,    277,  -1972,   1692,
+      -961,    370,    -78,     -2,
+        13,    -64,    110,     31,   -679,   2176,  -4831,  10320,  26265,    425,  -2037,   1716,
+      -965,    368,    -76,     -2,
+        13,    -63,    106,     41,   -695,   2186,  -4802,  10109,  26341,    575,  -2103,   1739,
+      -968,    366,    -74,     -3,
+        12,    -61,    101,     51,   -710,   2194,  -4771,   9899,  26415,    727,  -2168,   1761,
+      -972,    363,    -71,     -4,
+        12,    -60,     97,     61,   -724,   2202,  -4739,   9689,  26486,    881,  -2233,   1784,
+      -975,    361,    -69,     -5,
+        12,    -59,     92,     71,   -738,   2210,  -4706,   9480,  26555,   1036,  -2299,   1806,
+      -978,    358,    -67,     -6,
+        12,    -57,     88,     81,   -752,   2216,  -4672,   9271,  26620,   1194,  -2363,   1827,
+      -980,    356,    -64,     -7,
+        11,    -56,     83,     90,   -765,   2222,  -4636,   9063,  26682,   1353,  -2428,   1848,
+      -983,    353,    -62,     -8,
+        11,    -55,     79,    100,   -778,   2226,  -4599,   8855,  26742,   1513,  -2493,   1869,
+      -985,    349,    -60,     -8,
+        11,    -53,     74,    109,   -791,   2230,  -4561,   8648,  26799,   1676,  -2557,   1889,
+      -986,    346,    -57,     -9,
+        11,    -52,     70,    119,   -803,   2234,  -4522,   8441,  26853,   1840,  -2621,   1909,
+      -987,    343,    -55,    -10,
+        10,    -51,     66,    128,   -815,   2236,  -4482,   8235,  26904,   2006,  -2685,   1929,
+      -988,    339,    -52,    -11,
+        10,    -49,     61,    137,   -826,   2238,  -4440,   8030,  26952,   2173,  -2749,   1947,
+      -989,    335,    -49,    -12,
+        10,    -48,     57,    145,   -837,   2239,  -4398,   7825,  26997,   2342,  -2812,   1966,
+      -989,    331,    -46,    -13,
+        10,    -47,     53,    154,   -848,   2239,  -4355,   7621,  27039,   2513,  -2875,   1984,
+      -989,    327,    -44,    -14,
+         9,    -45,     49,    163,   -858,   2238,  -4310,   7418,  27078,   2685,  -2937,   2001,
+      -989,    323,    -41,    -15,
+         9,    -44,     44,    171,   -868,   2237,  -4265,   7216,  27114,   2858,  -2999,   2018,
+      -988,    319,    -38,    -17,
+         9,    -43,     40,    179,   -877,   2235,  -4218,   7015,  27147,   3034,  -3061,   2034,
+      -987,    314,    -35,    -18,
+         9,    -42,     36,    187,   -886,   2232,  -4171,   6814,  27177,   3210,  -3122,   2050,
+      -985,    309,    -32,    -19,
+         9,    -40,     32,    195,   -895,   2228,  -4123,   6614,  27205,   3388,  -3183,   2065,
+      -983,    304,    -29,    -20,
+         8,    -39,     28,    203,   -903,   2224,  -4073,   6416,  27229,   3568,  -3244,   2079,
+      -981,    299,    -25,    -21,
+         8,    -38,     24,    210,   -911,   2219,  -4023,   6218,  27250,   3749,  -3303,   2093,
+      -978,    294,    -22,    -22,
+         8,    -36,     21,    218,   -918,   2213,  -3972,   6021,  27268,   3931,  -3363,   2107,
+      -976,    288,    -19,    -23,
+         8,    -35,     17,    225,   -926,   2207,  -3921,   5825,  27284,   4115,  -3421,   2120,
+      -972,    283,    -16,    -24,
+         7,    -34,     13,    232,   -932,   2200,  -3868,   5631,  27296,   4300,  -3480,   2132,
+      -969,    277,    -12,    -25,
+         7,    -33,      9,    239,   -939,   2192,  -3815,   5437,  27305,   4487,  -3537,   2144,
+      -964,    271,     -9,    -27,
+         7,    -31,      5,    246,   -944,   2184,  -3761,   5245,  27311,   4674,  -3594,   2155,
+      -960,    265,     -5,    -28,
+         7,    -30,      2,    252,   -950,   2175,  -3706,   5053,  27314,   4863,  -3650,   2165,
+      -955,    259,     -2,    -29,
+};
+
+struct fir_filter {
+    uint32_t in_rate;
+    uint32_t out_rate;
+    uint32_t up;        /* interpolation factor: number of polyphase branches */
+    uint32_t down;      /* decimation factor */
+    uint32_t taps;      /* taps per branch, multiple of 8 */
+    const int16_t *coefs;
+};
+
+static const struct fir_filter fir_filters[] = {
+    { 48000, 16000, 1, 3, 48, fir_coefs_48000_16000 },
+    { 48000, 8000, 1, 6, 96, fir_coefs_48000_8000 },
+    { 48000, 44100, 147, 160, 16, fir_coefs_48000_44100 },
+};
+
+struct fir_resampler {
+    struct resampler_itfe itfe;             /* must be first */
+    struct resampler_buffer_provider *provider;
+    const struct fir_filter *filter;
+    uint32_t channels;
+    uint32_t phase;     /* polyphase branch of the next output frame */
+    size_t pos;         /* first input frame of the next output window */
+    size_t frames;      /* input frames in the history */
+    size_t capacity;    /* size of each channel's history in frames */
+    int16_t *hist;      /* planar history, capacity frames per channel */
+};
+
+static inline int16_t fir_dot(const int16_t *x, const int16_t *h, uint32_t taps)
+{
+    int32_t sum;
+    uint32_t i;
+
+#ifdef __ARM_NEON__
+    int32x4_t acc = vdupq_n_s32(0);
+    int32x2_t acc2;
+
+    for (i = 0; i < taps; i += 8) {
+        int16x8_t vx = vld1q_s16(x + i);
+        int16x8_t vh = vld1q_s16(h + i);
+
+        acc = vmlal_s16(acc, vget_low_s16(vx), vget_low_s16(vh));
+        acc = vmlal_s16(acc, vget_high_s16(vx), vget_high_s16(vh));
+    }
+    acc2 = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    acc2 = vpadd_s32(acc2, acc2);
+    sum = vget_lane_s32(acc2, 0);
+#else
+    /* the L1 norm of every branch is below 2.0 so 32 bits cannot overflow */
+    sum = 0;
+    for (i = 0; i < taps; i++)
+        sum += (int32_t)x[i] * h[i];
+#endif
+
+    sum = (sum + (1 << 14)) >> 15;
+    if (sum > INT16_MAX)
+        sum = INT16_MAX;
+    else if (sum < INT16_MIN)
+        sum = INT16_MIN;
+    return (int16_t)sum;
+}
+
+/* refill the history from the provider after discarding the frames no longer needed.
+ * Returns false when the provider has no more data */
+static bool fir_refill(struct fir_resampler *rsmp)
+{
+    struct resampler_buffer buf;
+    uint32_t c;
+    size_t i;
+
+    if (rsmp->pos != 0) {
+        for (c = 0; c < rsmp->channels; c++) {
+            int16_t *hist = rsmp->hist + c * rsmp->capacity;
+            memmove(hist, hist + rsmp->pos, (rsmp->frames - rsmp->pos) * sizeof(int16_t));
+        }
+        rsmp->frames -= rsmp->pos;
+        rsmp->pos = 0;
+    }
+
+    buf.frame_count = rsmp->capacity - rsmp->frames;
+    rsmp->provider->get_next_buffer(rsmp->provider, &buf);
+    if (buf.raw == NULL || buf.frame_count == 0)
+        return false;
+
+    for (c = 0; c < rsmp->channels; c++) {
+        int16_t *hist = rsmp->hist + c * rsmp->capacity + rsmp->frames;
+        const int16_t *src = buf.i16 + c;
+
+        for (i = 0; i < buf.frame_count; i++, src += rsmp->channels)
+            hist[i] = *src;
+    }
+    rsmp->frames += buf.frame_count;
+    rsmp->provider->release_buffer(rsmp->provider, &buf);
+    return true;
+}
+
+static int fir_resample_from_provider(struct resampler_itfe *resampler,
+                                      int16_t *out,
+                                      size_t *outFrameCount)
+{
+    struct fir_resampler *rsmp = (struct fir_resampler *)resampler;
+    const struct fir_filter *filter;
+    size_t done;
+
+    if (rsmp == NULL || out == NULL || outFrameCount == NULL)
+        return -EINVAL;
+
+    filter = rsmp->filter;
+
+    for (done = 0; done < *outFrameCount; done++) {
+        const int16_t *coefs;
+        uint32_t c;
+
+        while (rsmp->pos + filter->taps > rsmp->frames) {
+            if (!fir_refill(rsmp))
+                goto exit;
+        }
+
+        coefs = filter->coefs + rsmp->phase * filter->taps;
+        for (c = 0; c < rsmp->channels; c++)
+            *out++ = fir_dot(rsmp->hist + c * rsmp->capacity + rsmp->pos, coefs, filter->taps);
+
+        rsmp->phase += filter->down;
+        rsmp->pos += rsmp->phase / filter->up;
+        rsmp->phase %= filter->up;
+    }
+
+exit:
+    *outFrameCount = done;
+    return 0;
+}
+
+static int fir_resample_from_input(struct resampler_itfe *resampler __unused,
+                                   int16_t *in __unused,
+                                   size_t *inFrameCount __unused,
+                                   int16_t *out __unused,
+                                   size_t *outFrameCount __unused)
+{
+    /* capture always pulls from the provider */
+    return -ENOSYS;
+}
+
+static void fir_reset(struct resampler_itfe *resampler)
+{
+    struct fir_resampler *rsmp = (struct fir_resampler *)resampler;
+
+    /* start from a silent history so that the first output frame needs a single
+     * new input frame */
+    memset(rsmp->hist, 0, rsmp->capacity * rsmp->channels * sizeof(int16_t));
+    rsmp->frames = rsmp->filter->taps - 1;
+    rsmp->pos = 0;
+    rsmp->phase = 0;
+}
+
+static int32_t fir_delay_ns(struct resampler_itfe *resampler)
+{
+    struct fir_resampler *rsmp = (struct fir_resampler *)resampler;
+    const struct fir_filter *filter = rsmp->filter;
+    size_t window_end = rsmp->pos + filter->taps - 1;
+    int64_t delay;
+
+    /* group delay of the prototype filter, in units of the upsampled rate, plus the
+     * input frames buffered past the current window */
+    delay = (int64_t)(filter->taps * filter->up - 1) * 1000000000LL /
+            (2 * (int64_t)filter->up * filter->in_rate);
+    if (rsmp->frames > window_end)
+        delay += (int64_t)(rsmp->frames - window_end) * 1000000000LL / filter->in_rate;
+
+    return (int32_t)delay;
+}
+
+int create_fir_resampler(uint32_t inSampleRate,
+                         uint32_t outSampleRate,
+                         uint32_t channelCount,
+                         struct resampler_buffer_provider *provider,
+                         struct resampler_itfe **resampler)
+{
+    struct fir_resampler *rsmp;
+    const struct fir_filter *filter = NULL;
+    size_t i;
+
+    if (resampler == NULL || provider == NULL || channelCount == 0)
+        return -EINVAL;
+
+    *resampler = NULL;
+
+    for (i = 0; i < ARRAY_SIZE(fir_filters); i++) {
+        if (fir_filters[i].in_rate == inSampleRate &&
+                fir_filters[i].out_rate == outSampleRate) {
+            filter = &fir_filters[i];
+            break;
+        }
+    }
+    if (filter == NULL)
+        return -EINVAL;
+
+    rsmp = (struct fir_resampler *)calloc(1, sizeof(struct fir_resampler));
+    if (rsmp == NULL)
+        return -ENOMEM;
+
+    rsmp->capacity = filter->taps - 1 + FIR_CHUNK_FRAMES;
+    rsmp->hist = (int16_t *)malloc(rsmp->capacity * channelCount * sizeof(int16_t));
+    if (rsmp->hist == NULL) {
+        free(rsmp);
+        return -ENOMEM;
+    }
+
+    rsmp->itfe.reset = fir_reset;
+    rsmp->itfe.resample_from_provider = fir_resample_from_provider;
+    rsmp->itfe.resample_from_input = fir_resample_from_input;
+    rsmp->itfe.delay_ns = fir_delay_ns;
+
+    rsmp->provider = provider;
+    rsmp->filter = filter;
+    rsmp->channels = channelCount;
+    fir_reset(&rsmp->itfe);
+
+    ALOGV("create_fir_resampler() %u -> %u Hz, %u channels, %u x %u taps",
+          inSampleRate, outSampleRate, channelCount, filter->up, filter->taps);
+
+    *resampler = &rsmp->itfe;
+    return 0;
+}
+
+void release_fir_resampler(struct resampler_itfe *resampler)
+{
+    struct fir_resampler *rsmp = (struct fir_resampler *)resampler;
+
+    if (rsmp == NULL)
+        return;
+
+    free(rsmp->hist);
+    free(rsmp);
+}
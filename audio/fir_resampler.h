@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TUNA_FIR_RESAMPLER_H
+#define TUNA_FIR_RESAMPLER_H
+
+#include <stdint.h>
+
+#include <audio_utils/resampler.h>
+
+/* Fixed ratio polyphase FIR resampler for 16 bit PCM capture. Only the ratios used when
+ * downsampling the 48 kHz MM-UL stream are supported (48000 -> 16000, 8000 and 44100);
+ * create_fir_resampler() returns -EINVAL for any other conversion so that the caller can
+ * fall back to the generic resampler. The returned interface behaves like the one from
+ * create_resampler() and must be released with release_fir_resampler().
+ */
+int create_fir_resampler(uint32_t inSampleRate,
+                         uint32_t outSampleRate,
+                         uint32_t channelCount,
+                         struct resampler_buffer_provider *provider,
+                         struct resampler_itfe **resampler);
+
+void release_fir_resampler(struct resampler_itfe *resampler);
+
+#endif /* TUNA_FIR_RESAMPLER_H */
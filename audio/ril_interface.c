@@ -18,7 +18,11 @@
 /*#define LOG_NDEBUG 0*/
 
 #include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <utils/Log.h>
 #include <cutils/properties.h>
@@ -28,6 +32,37 @@
 #define VOLUME_STEPS_DEFAULT  5
 #define VOLUME_STEPS_PROPERTY "ro.config.vc_call_vol_steps"
 
+/* maximum time ril_wait_queue() waits for the queued requests to be sent */
+#define RIL_QUEUE_WAIT_MS 1000
+
+/* requests pending in the RIL queue */
+#define RIL_REQ_VOLUME     (1 << 0)
+#define RIL_REQ_AUDIO_PATH (1 << 1)
+#define RIL_REQ_MUTE       (1 << 2)
+
+struct ril_queue {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signaled when a request is queued or exit is requested */
+    pthread_cond_t done_cond;   /* signaled when the pending requests have been sent */
+    bool running;
+    bool exit;
+    int pending;                /* RIL_REQ_xxx */
+    void *ril_handle;
+    enum _SoundType sound_type;
+    float volume;
+    enum _AudioPath path;
+    enum _MuteCondition mute;
+    unsigned int queued_seq;
+    unsigned int done_seq;
+};
+
+static struct ril_queue ril_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
 /* Audio WB AMR callback */
 void (*_audio_set_wb_amr_callback)(void *, int);
 void *callback_data = NULL;
@@ -72,17 +107,117 @@ static int ril_connect_if_required(void *ril_handle)
     return 0;
 }
 
+static void *ril_queue_thread_loop(void *context)
+{
+    struct ril_queue *q = (struct ril_queue *)context;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        int pending;
+        unsigned int seq;
+        void *ril_handle;
+        enum _SoundType sound_type;
+        float volume;
+        enum _AudioPath path;
+        enum _MuteCondition mute;
+
+        while (!q->pending && !q->exit)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (q->exit)
+            break;
+
+        pending = q->pending;
+        q->pending = 0;
+        seq = q->queued_seq;
+        ril_handle = q->ril_handle;
+        sound_type = q->sound_type;
+        volume = q->volume;
+        path = q->path;
+        mute = q->mute;
+        pthread_mutex_unlock(&q->lock);
+
+        /* the audio path is sent first as the volume applies to the current path,
+         * all in one write when there are several */
+        if (pending & (pending - 1))
+            BeginAudioBatch_RILD(ril_handle);
+        if (pending & RIL_REQ_AUDIO_PATH)
+            ril_set_call_audio_path(ril_handle, path);
+        if (pending & RIL_REQ_VOLUME)
+            ril_set_call_volume(ril_handle, sound_type, volume);
+        if (pending & RIL_REQ_MUTE)
+            ril_set_mic_mute(ril_handle, mute);
+        if (pending & (pending - 1))
+            CommitAudioBatch_RILD(ril_handle, NULL);
+
+        pthread_mutex_lock(&q->lock);
+        q->done_seq = seq;
+        pthread_cond_broadcast(&q->done_cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+static void ril_queue_start(void)
+{
+    struct ril_queue *q = &ril_queue;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->running) {
+        q->exit = false;
+        q->pending = 0;
+        q->done_seq = q->queued_seq;
+        if (pthread_create(&q->thread, NULL, ril_queue_thread_loop, q) == 0)
+            q->running = true;
+        else
+            ALOGE("cannot create RIL queue thread, requests will be sent synchronously");
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void ril_queue_stop(void)
+{
+    struct ril_queue *q = &ril_queue;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->running) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+    q->exit = true;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_join(q->thread, NULL);
+
+    pthread_mutex_lock(&q->lock);
+    q->running = false;
+    /* requests not sent are dropped with the connection */
+    q->pending = 0;
+    q->done_seq = q->queued_seq;
+    pthread_cond_broadcast(&q->done_cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
 int ril_open(void *ril_handle)
 {
+    /* the queue is started even if the client cannot be opened: requests are then
+     * handled as by the synchronous functions */
+    ril_queue_start();
+
     if (!ril_handle)
         return -1;
 
-    ril_handle = OpenClient_RILD();
+    /* other RIL clients of the process share its connection and reader thread */
+    ril_handle = OpenSharedClient_RILD();
     if (!ril_handle) {
-        ALOGE("OpenClient_RILD() failed");
+        ALOGE("OpenSharedClient_RILD() failed");
         return -1;
     }
 
+    /* rild restarts are handled in the background, with the audio state sent again */
+    SetAutoReconnect_RILD(ril_handle, 1);
+
     /* register the wideband AMR callback */
     RegisterUnsolicitedHandler(ril_handle, RIL_UNSOL_WB_AMR_STATE,
                                (RilOnUnsolicited)ril_set_wb_amr_callback);
@@ -97,6 +232,8 @@ int ril_open(void *ril_handle)
 
 int ril_close(void *ril_handle)
 {
+    ril_queue_stop();
+
     if (!ril_handle)
         return -1;
 
@@ -109,6 +246,12 @@ int ril_close(void *ril_handle)
     return 0;
 }
 
+void ril_dump(void *ril_handle, int fd)
+{
+    if (ril_handle)
+        DumpTrace_RILD(ril_handle, fd);
+}
+
 int ril_set_call_volume(void *ril_handle, enum _SoundType sound_type,
                         float volume)
 {
@@ -134,3 +277,88 @@ int ril_set_mic_mute(void *ril_handle, enum _MuteCondition state)
 
     return SetMute(ril_handle, state);
 }
+
+void ril_queue_call_volume(void *ril_handle, enum _SoundType sound_type, float volume)
+{
+    struct ril_queue *q = &ril_queue;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->running) {
+        pthread_mutex_unlock(&q->lock);
+        ril_set_call_volume(ril_handle, sound_type, volume);
+        return;
+    }
+    q->ril_handle = ril_handle;
+    q->sound_type = sound_type;
+    q->volume = volume;
+    q->pending |= RIL_REQ_VOLUME;
+    q->queued_seq++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void ril_queue_call_audio_path(void *ril_handle, enum _AudioPath path)
+{
+    struct ril_queue *q = &ril_queue;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->running) {
+        pthread_mutex_unlock(&q->lock);
+        ril_set_call_audio_path(ril_handle, path);
+        return;
+    }
+    q->ril_handle = ril_handle;
+    q->path = path;
+    q->pending |= RIL_REQ_AUDIO_PATH;
+    q->queued_seq++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void ril_queue_mic_mute(void *ril_handle, enum _MuteCondition state)
+{
+    struct ril_queue *q = &ril_queue;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->running) {
+        pthread_mutex_unlock(&q->lock);
+        ril_set_mic_mute(ril_handle, state);
+        return;
+    }
+    q->ril_handle = ril_handle;
+    q->mute = state;
+    q->pending |= RIL_REQ_MUTE;
+    q->queued_seq++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int ril_wait_queue(void)
+{
+    struct ril_queue *q = &ril_queue;
+    struct timespec ts;
+    unsigned int seq;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += RIL_QUEUE_WAIT_MS / 1000;
+    ts.tv_nsec += (RIL_QUEUE_WAIT_MS % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    seq = q->queued_seq;
+    /* sequence numbers wrap around: compare the distance to the last queued request */
+    while ((int)(seq - q->done_seq) > 0 && ret == 0)
+        ret = pthread_cond_timedwait(&q->done_cond, &q->lock, &ts);
+    pthread_mutex_unlock(&q->lock);
+
+    if (ret != 0) {
+        ALOGE("ril_wait_queue() timeout waiting for RIL requests");
+        return -ret;
+    }
+
+    return 0;
+}
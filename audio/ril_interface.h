@@ -31,5 +31,16 @@ int ril_set_call_volume(void *ril_handle, enum _SoundType sound_type,
 int ril_set_call_audio_path(void *ril_handle, enum _AudioPath path);
 int ril_set_mic_mute(void *ril_handle, enum _MuteCondition state);
 void ril_register_set_wb_amr_callback(void *function, void *data);
+/* Write the timing of the last RIL requests to fd. */
+void ril_dump(void *ril_handle, int fd);
+
+/* Asynchronous versions of ril_set_call_volume(), ril_set_call_audio_path() and
+ * ril_set_mic_mute(): the request is sent by a background thread and only the last value
+ * queued for each is sent, the ones pending together in one write.
+ * ril_wait_queue() waits until the requests queued so far have been sent. */
+void ril_queue_call_volume(void *ril_handle, enum _SoundType sound_type, float volume);
+void ril_queue_call_audio_path(void *ril_handle, enum _AudioPath path);
+void ril_queue_mic_mute(void *ril_handle, enum _MuteCondition state);
+int ril_wait_queue(void);
 
 #endif
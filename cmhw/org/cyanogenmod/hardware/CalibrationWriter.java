@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package org.cyanogenmod.hardware;
+
+import android.os.Handler;
+import android.os.HandlerThread;
+import android.os.SystemClock;
+
+import org.cyanogenmod.internal.util.FileUtils;
+import java.io.File;
+import java.util.Arrays;
+
+/*
+ * Applies the red, green and blue values of a panel calibration as one
+ * update: a single write of the node taking all the channels when the
+ * kernel has it, else a write of each channel which changed. Every write
+ * reprograms the panel, so updates coming closer than MIN_INTERVAL_MS, as
+ * while a slider is dragged, are coalesced and the latest one is applied
+ * from a background thread once the interval is over.
+ */
+class CalibrationWriter {
+    private static final long MIN_INTERVAL_MS = 100;
+
+    private static Handler sHandler;
+
+    private final String mAllPath;
+    private final String[] mChannelPaths;
+    private String[] mWritten;
+    private String[] mPending;
+    private long mLastWrite;
+
+    private final Runnable mApply = new Runnable() {
+        public void run() {
+            synchronized (CalibrationWriter.this) {
+                if (mPending != null) {
+                    write(mPending);
+                }
+            }
+        }
+    };
+
+    CalibrationWriter(String allPath, String[] channelPaths) {
+        mAllPath = allPath;
+        mChannelPaths = channelPaths;
+    }
+
+    boolean hasAllPath() {
+        return new File(mAllPath).exists();
+    }
+
+    /* values not applied yet, or null */
+    synchronized String[] getPending() {
+        return mPending;
+    }
+
+    synchronized boolean set(String[] values) {
+        if (mPending == null && Arrays.equals(values, mWritten)) {
+            return true;
+        }
+
+        long wait = mLastWrite + MIN_INTERVAL_MS - SystemClock.uptimeMillis();
+        if (mPending == null && wait <= 0) {
+            return write(values);
+        }
+
+        if (mPending == null) {
+            getHandler().postDelayed(mApply, Math.max(wait, 0));
+        }
+        mPending = values;
+        return true;
+    }
+
+    private boolean write(String[] values) {
+        boolean result = true;
+
+        mPending = null;
+        mLastWrite = SystemClock.uptimeMillis();
+        if (hasAllPath()) {
+            StringBuilder all = new StringBuilder();
+            for (String value : values) {
+                all.append(value).append(" ");
+            }
+            result = FileUtils.writeLine(mAllPath, all.toString());
+        } else {
+            for (int i = 0; i < values.length && i < mChannelPaths.length; i++) {
+                if (mWritten == null || i >= mWritten.length
+                        || !values[i].equals(mWritten[i])) {
+                    result &= FileUtils.writeLine(mChannelPaths[i], values[i]);
+                }
+            }
+        }
+        // on a failure the next update rewrites every channel
+        mWritten = result ? values : null;
+        return result;
+    }
+
+    private static synchronized Handler getHandler() {
+        if (sHandler == null) {
+            HandlerThread thread = new HandlerThread("DisplayCalibration");
+            thread.start();
+            sHandler = new Handler(thread.getLooper());
+        }
+        return sHandler;
+    }
+}
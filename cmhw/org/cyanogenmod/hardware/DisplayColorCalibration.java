@@ -27,6 +27,9 @@ public class DisplayColorCalibration {
     };
     private static final String COLOR_FILE_V2 = "/sys/class/misc/colorcontrol/multiplier";
 
+    private static final CalibrationWriter sWriter =
+            new CalibrationWriter(COLOR_FILE_V2, COLOR_FILE);
+
     public static boolean isSupported() {
         if (new File(COLOR_FILE_V2).exists()) {
             return true;
@@ -53,36 +56,29 @@ public class DisplayColorCalibration {
 
     public static String getCurColors() {
         StringBuilder values = new StringBuilder();
-        if (new File(COLOR_FILE_V2).exists()) {
-            String[] valuesSplit = FileUtils.readOneLine(COLOR_FILE_V2).split(" ");
-            for (int i = 0; i < valuesSplit.length; i++) {
-                values.append(Long.toString(Long.valueOf(valuesSplit[i]) / 2)).append(" ");
-            }
-        } else {
-            for (String filePath : COLOR_FILE) {
-                values.append(Long.toString(Long.valueOf(
-                        FileUtils.readOneLine(filePath)) / 2)).append(" ");
+        String[] valuesSplit = sWriter.getPending();
+        if (valuesSplit == null) {
+            if (sWriter.hasAllPath()) {
+                valuesSplit = FileUtils.readOneLine(COLOR_FILE_V2).split(" ");
+            } else {
+                valuesSplit = new String[COLOR_FILE.length];
+                for (int i = 0; i < COLOR_FILE.length; i++) {
+                    valuesSplit[i] = FileUtils.readOneLine(COLOR_FILE[i]);
+                }
             }
         }
+        for (int i = 0; i < valuesSplit.length; i++) {
+            values.append(Long.toString(Long.valueOf(valuesSplit[i]) / 2)).append(" ");
+        }
         return values.toString();
     }
 
     public static boolean setColors(String colors) {
         String[] valuesSplit = colors.split(" ");
-        if (new File(COLOR_FILE_V2).exists()) {
-            StringBuilder realColors = new StringBuilder();
-            for (int i = 0; i < valuesSplit.length; i++) {
-                realColors.append(Long.toString(Long.valueOf(valuesSplit[i]) * 2)).append(" ");
-            }
-            return FileUtils.writeLine(COLOR_FILE_V2, realColors.toString());
-        } else {
-            boolean result = true;
-            for (int i = 0; i < valuesSplit.length; i++) {
-                String targetFile = COLOR_FILE[i];
-                result &= FileUtils.writeLine(targetFile, Long.toString(
-                        Long.valueOf(valuesSplit[i]) * 2));
-            }
-            return result;
+        String[] realColors = new String[valuesSplit.length];
+        for (int i = 0; i < valuesSplit.length; i++) {
+            realColors[i] = Long.toString(Long.valueOf(valuesSplit[i]) * 2);
         }
+        return sWriter.set(realColors);
     }
 }
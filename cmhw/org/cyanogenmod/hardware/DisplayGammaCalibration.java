@@ -27,6 +27,9 @@ public class DisplayGammaCalibration {
     };
     private static final String GAMMA_FILE_V2 = "/sys/class/misc/colorcontrol/v1_offset";
 
+    private static final CalibrationWriter sWriter =
+            new CalibrationWriter(GAMMA_FILE_V2, GAMMA_FILE);
+
     public static boolean isSupported() {
         if (new File(GAMMA_FILE_V2).exists()) {
             return true;
@@ -52,7 +55,14 @@ public class DisplayGammaCalibration {
     }
 
     public static String getCurGamma(int control) {
-        if (new File(GAMMA_FILE_V2).exists()) {
+        String[] pending = sWriter.getPending();
+        if (pending != null) {
+            StringBuilder values = new StringBuilder();
+            for (String value : pending) {
+                values.append(value).append(" ");
+            }
+            return values.toString();
+        } else if (sWriter.hasAllPath()) {
             return FileUtils.readOneLine(GAMMA_FILE_V2);
         } else {
             StringBuilder values = new StringBuilder();
@@ -64,16 +74,6 @@ public class DisplayGammaCalibration {
     }
 
     public static boolean setGamma(int control, String gamma) {
-        if (new File(GAMMA_FILE_V2).exists()) {
-            return FileUtils.writeLine(GAMMA_FILE_V2, gamma);
-        } else {
-            String[] valuesSplit = gamma.split(" ");
-            boolean result = true;
-            for (int i = 0; i < valuesSplit.length; i++) {
-                String targetFile = GAMMA_FILE[i];
-                result &= FileUtils.writeLine(targetFile, valuesSplit[i]);
-            }
-            return result;
-        }
+        return sWriter.set(gamma.split(" "));
     }
 }
@@ -51,6 +51,7 @@ PRODUCT_PACKAGES += \
 	libpn544_fw \
 	lights.tuna \
 	nfc.tuna \
+	power.tuna \
 	sensors.tuna
 
 # RIL
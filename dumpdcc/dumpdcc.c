@@ -14,6 +14,9 @@
 #define I2C_ADDRESS 0x3E
 #define MTD_DEVICE "/dev/mtd/mtd0"
 #define DCC_FILE "/data/misc/cameraserver/R5_MVEN003_LD2_ND0_IR0_SH0_FL1_SVEN003_DCCID1044/calib.bin"
+#define DCC_TMP_FILE DCC_FILE ".tmp"
+#define DCC_HEADER_SIZE 0x54
+#define DCC_DATA_SIZE 0x225
 
 int i2c_file;
 unsigned char buf[2];
@@ -80,15 +83,63 @@ void i2c_seq_2() {
 /*
  * Validate the extracted DCC data
  */
-int validate_dcc() {
-	if (dcc_data[0x00] == 0x4F &&
-		dcc_data[0x01] == 0x41 &&
-		dcc_data[0x02] == 0x45 &&
-		dcc_data[0x03] == 0x4A) {
+int validate_dcc(const unsigned char *data) {
+	if (data[0x00] == 0x4F &&
+		data[0x01] == 0x41 &&
+		data[0x02] == 0x45 &&
+		data[0x03] == 0x4A) {
 		return 0;
 	} else return 1;
 }
 
+/*
+ * Header of the DCC file, ahead of the DCC data
+ */
+void fill_dcc_header(unsigned char *dcc_header) {
+	memset(dcc_header, 0, DCC_HEADER_SIZE);
+	dcc_header[0x00] = 0x14;
+	dcc_header[0x01] = 0x04;
+	dcc_header[0x04] = 0x64;
+	dcc_header[0x08] = 0x01;
+	dcc_header[0x14] = 0xCF;
+	dcc_header[0x15] = 0xCA;
+	dcc_header[0x16] = 0x1C;
+	dcc_header[0x17] = 0x2C;
+	dcc_header[0x18] = 0x6D;
+	dcc_header[0x40] = 0x25;
+	dcc_header[0x41] = 0x02;
+	dcc_header[0x4C] = 0x79;
+	dcc_header[0x4D] = 0x02;
+}
+
+/*
+ * Check whether DCC_FILE already holds the DCC data: the header of
+ * fill_dcc_header() followed by data passing validate_dcc(), and nothing else.
+ * write_dcc() only renames a complete file into place, so a file of the right
+ * size was not cut short. The camera module is not identified without the I2C
+ * sequences: the file path carries its IDs.
+ */
+int dcc_file_valid() {
+	unsigned char expected_header[DCC_HEADER_SIZE];
+	unsigned char file_data[DCC_HEADER_SIZE + DCC_DATA_SIZE + 1];
+	int ret;
+
+	int dcc_file = open(DCC_FILE, O_RDONLY);
+	if (dcc_file < 0)
+		return 0;
+
+	ret = read(dcc_file, file_data, sizeof(file_data));
+	close(dcc_file);
+	if (ret != DCC_HEADER_SIZE + DCC_DATA_SIZE)
+		return 0;
+
+	fill_dcc_header(expected_header);
+	if (memcmp(file_data, expected_header, DCC_HEADER_SIZE) != 0)
+		return 0;
+
+	return validate_dcc(file_data + DCC_HEADER_SIZE) == 0;
+}
+
 /*
  * Extract DCC data from flash memory
  */
@@ -97,7 +148,7 @@ int extract_dcc() {
 	i2c_init();
 	i2c_seq_1();
 
-	dcc_data = (unsigned char*) malloc(0x225);
+	dcc_data = (unsigned char*) malloc(DCC_DATA_SIZE);
 
 	int mtd_file = open(MTD_DEVICE, O_RDONLY);
 	if (mtd_file < 0) {
@@ -106,7 +157,7 @@ int extract_dcc() {
 		goto exit;
 	}
 
-	ret = read(mtd_file, dcc_data, 0x225);
+	ret = read(mtd_file, dcc_data, DCC_DATA_SIZE);
 	if (ret < 0) {
 		ALOGE("Error reading from " MTD_DEVICE ": %s", strerror(errno));
 		ret = errno;
@@ -121,56 +172,65 @@ exit:
 }
 
 /*
- * Write DCC file
+ * Write DCC file, through a temporary file renamed once complete
  */
 int write_dcc() {
 	int ret;
-	unsigned char dcc_header[0x54] = {0};
-	dcc_header[0x00] = 0x14;
-	dcc_header[0x01] = 0x04;
-	dcc_header[0x04] = 0x64;
-	dcc_header[0x08] = 0x01;
-	dcc_header[0x14] = 0xCF;
-	dcc_header[0x15] = 0xCA;
-	dcc_header[0x16] = 0x1C;
-	dcc_header[0x17] = 0x2C;
-	dcc_header[0x18] = 0x6D;
-	dcc_header[0x40] = 0x25;
-	dcc_header[0x41] = 0x02;
-	dcc_header[0x4C] = 0x79;
-	dcc_header[0x4D] = 0x02;
+	unsigned char dcc_header[DCC_HEADER_SIZE];
+	fill_dcc_header(dcc_header);
 
-	int dcc_file = open(DCC_FILE, O_CREAT | O_TRUNC | O_WRONLY, S_IRWXU);
+	int dcc_file = open(DCC_TMP_FILE, O_CREAT | O_TRUNC | O_WRONLY, S_IRWXU);
 	if (dcc_file < 0) {
-		ALOGE("Failed to open " DCC_FILE ": %s", strerror(errno));
+		ALOGE("Failed to open " DCC_TMP_FILE ": %s", strerror(errno));
 		return errno;
 	}
 
-	ret = write(dcc_file, dcc_header, 0x54);
+	ret = write(dcc_file, dcc_header, DCC_HEADER_SIZE);
 	if (ret < 0) {
-		ALOGE("Failed writing DCC header to " DCC_FILE ": %s", strerror(errno));
+		ALOGE("Failed writing DCC header to " DCC_TMP_FILE ": %s", strerror(errno));
+		close(dcc_file);
 		return errno;
 	}
 
-	ret = write(dcc_file, dcc_data, 0x225);
+	ret = write(dcc_file, dcc_data, DCC_DATA_SIZE);
 	if (ret < 0) {
-		ALOGE("Failed writing DCC data to " DCC_FILE ": %s", strerror(errno));
+		ALOGE("Failed writing DCC data to " DCC_TMP_FILE ": %s", strerror(errno));
+		close(dcc_file);
 		return errno;
 	}
 
+	if (fsync(dcc_file) < 0) {
+		ALOGE("Failed to sync " DCC_TMP_FILE ": %s", strerror(errno));
+		close(dcc_file);
+		return -1;
+	}
 	close(dcc_file);
 	free(dcc_data);
 
+	if (rename(DCC_TMP_FILE, DCC_FILE) < 0) {
+		ALOGE("Failed to rename " DCC_TMP_FILE ": %s", strerror(errno));
+		return -1;
+	}
+
 	return ret;
 }
 
-int main() {
+/*
+ * The DCC data never changes: unless -f is given, a valid DCC file is kept and
+ * neither the camera nor the flash are accessed.
+ */
+int main(int argc, char **argv) {
+	if (!(argc > 1 && strcmp(argv[1], "-f") == 0) && dcc_file_valid()) {
+		ALOGI("DCC data already saved");
+		return 0;
+	}
+
 	if (extract_dcc() < 0) {
 		ALOGE("Failed to read DCC data, aborting");
 		return 1;
 	}
 
-	if (validate_dcc() != 0) {
+	if (validate_dcc(dcc_data) != 0) {
 		ALOGE("Failed to validate DCC data, aborting");
 		return 1;
 	}
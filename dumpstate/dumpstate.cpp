@@ -14,34 +14,177 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <dumpstate.h>
 
+// how long the nodes get to be read, all together
+#define NODE_TIMEOUT_SEC 5
+// what's kept of each node
+#define NODE_MAX_SIZE (256 * 1024)
+
+static const struct {
+    const char* title;
+    const char* path;
+} sBoardNodes[] = {
+    { "board revision", "/sys/board_properties/revision" },
+    { "soc family", "/sys/board_properties/soc/family" },
+    { "soc revision", "/sys/board_properties/soc/revision" },
+    { "soc type", "/sys/board_properties/soc/type" },
+    { "soc die_id", "/sys/board_properties/soc/die_id" },
+    { "soc production_id", "/sys/board_properties/soc/production_id" },
+    { "pm_debug count", "/d/pm_debug/count" },
+    { "pm_debug time", "/d/pm_debug/time" },
+    { "dsscomp_log", "/d/dsscomp/log" },
+    { "dsscomp_comps", "/d/dsscomp/comps" },
+    { "dsscomp_gralloc", "/d/dsscomp/gralloc" },
+    { "audio media state", "/d/asoc/Tuna/Tuna Media/state" },
+    { "audio modem state", "/d/asoc/Tuna/Tuna MODEM/state" },
+    { "audio codec_reg", "/sys/devices/platform/soc-audio/PDM-DL1/codec_reg" },
+    { "ducati firmware version", "/d/remoteproc/omap-rproc.1/version" },
+    { "ducati trace1", "/d/remoteproc/omap-rproc.1/trace1" },
+    { "ducati trace1_last", "/d/remoteproc/omap-rproc.1/trace1_last" },
+    { "fsa9480 device_type", "/sys/bus/i2c/drivers/fsa9480/4-0025/device_type" },
+    { "fsa9480 control", "/sys/bus/i2c/drivers/fsa9480/4-0025/control" },
+    { "tiler 2x1 map", "/d/tiler/map/2x1" },
+    { "wlan", "/sys/module/bcmdhd/parameters/info_string" },
+    { "bluetooth", "/d/bt" },
+    { "mmc0 name", "/sys/devices/platform/omap/omap_hsmmc.0/mmc_host/mmc0/mmc0:0001/name" },
+    { "mmc0 cid", "/sys/devices/platform/omap/omap_hsmmc.0/mmc_host/mmc0/mmc0:0001/cid" },
+    { "mmc0 csd", "/sys/devices/platform/omap/omap_hsmmc.0/mmc_host/mmc0/mmc0:0001/csd" },
+    { "mmc0 ext_csd", "/d/mmc0/mmc0:0001/ext_csd" },
+};
+
+#define NUM_BOARD_NODES (sizeof(sBoardNodes) / sizeof(sBoardNodes[0]))
+
+/*
+ * One node read by its own thread. A thread stuck in a read is left behind
+ * once the timeout is over, so the node is never freed: the thread may still
+ * write to it until dumpstate exits.
+ */
+struct Node {
+    const char* path;
+    char* data;
+    size_t size;
+    bool truncated;
+    int error;
+    bool done;
+};
+
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sDone = PTHREAD_COND_INITIALIZER;
+
+static void* read_node(void* arg) {
+    Node* node = static_cast<Node*>(arg);
+    char* data = static_cast<char*>(malloc(NODE_MAX_SIZE));
+    size_t size = 0;
+    bool truncated = false;
+    int error = 0;
+
+    int fd = open(node->path, O_RDONLY | O_CLOEXEC);
+    if (data == NULL) {
+        error = ENOMEM;
+    } else if (fd < 0) {
+        error = errno;
+    } else {
+        for (;;) {
+            if (size == NODE_MAX_SIZE) {
+                char c;
+                truncated = read(fd, &c, 1) > 0;
+                break;
+            }
+            ssize_t n = read(fd, data + size, NODE_MAX_SIZE - size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                error = errno;
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            size += n;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    pthread_mutex_lock(&sLock);
+    node->data = data;
+    node->size = size;
+    node->truncated = truncated;
+    node->error = error;
+    node->done = true;
+    pthread_cond_broadcast(&sDone);
+    pthread_mutex_unlock(&sLock);
+    return NULL;
+}
+
+/*
+ * Reads the nodes all at once, each one in a thread, and prints them in the
+ * order of sBoardNodes like dump_file() would, so that a slow node only holds
+ * up the report until the timeout.
+ */
 void dumpstate_board()
 {
-    dump_file("board revision", "/sys/board_properties/revision");
-    dump_file("soc family", "/sys/board_properties/soc/family");
-    dump_file("soc revision", "/sys/board_properties/soc/revision");
-    dump_file("soc type", "/sys/board_properties/soc/type");
-    dump_file("soc die_id", "/sys/board_properties/soc/die_id");
-    dump_file("soc production_id", "/sys/board_properties/soc/production_id");
-    dump_file("pm_debug count", "/d/pm_debug/count");
-    dump_file("pm_debug time", "/d/pm_debug/time");
-    dump_file("dsscomp_log", "/d/dsscomp/log");
-    dump_file("dsscomp_comps", "/d/dsscomp/comps");
-    dump_file("dsscomp_gralloc", "/d/dsscomp/gralloc");
-    dump_file("audio media state", "/d/asoc/Tuna/Tuna Media/state");
-    dump_file("audio modem state", "/d/asoc/Tuna/Tuna MODEM/state");
-    dump_file("audio codec_reg", "/sys/devices/platform/soc-audio/PDM-DL1/codec_reg");
-    dump_file("ducati firmware version", "/d/remoteproc/omap-rproc.1/version");
-    dump_file("ducati trace1", "/d/remoteproc/omap-rproc.1/trace1");
-    dump_file("ducati trace1_last", "/d/remoteproc/omap-rproc.1/trace1_last");
-    dump_file("fsa9480 device_type", "/sys/bus/i2c/drivers/fsa9480/4-0025/device_type");
-    dump_file("fsa9480 control", "/sys/bus/i2c/drivers/fsa9480/4-0025/control");
-    dump_file("tiler 2x1 map", "/d/tiler/map/2x1");
-    dump_file("wlan", "/sys/module/bcmdhd/parameters/info_string");
-    dump_file("bluetooth", "/d/bt");
-    dump_file("mmc0 name", "/sys/devices/platform/omap/omap_hsmmc.0/mmc_host/mmc0/mmc0:0001/name");
-    dump_file("mmc0 cid", "/sys/devices/platform/omap/omap_hsmmc.0/mmc_host/mmc0/mmc0:0001/cid");
-    dump_file("mmc0 csd", "/sys/devices/platform/omap/omap_hsmmc.0/mmc_host/mmc0/mmc0:0001/csd");
-    dump_file("mmc0 ext_csd", "/d/mmc0/mmc0:0001/ext_csd");
-};
+    Node* nodes = static_cast<Node*>(calloc(NUM_BOARD_NODES, sizeof(Node)));
+    if (nodes == NULL) {
+        return;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (size_t i = 0; i < NUM_BOARD_NODES; i++) {
+        pthread_t thread;
+        nodes[i].path = sBoardNodes[i].path;
+        if (pthread_create(&thread, &attr, read_node, &nodes[i]) != 0) {
+            read_node(&nodes[i]);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += NODE_TIMEOUT_SEC;
+
+    for (size_t i = 0; i < NUM_BOARD_NODES; i++) {
+        Node* node = &nodes[i];
+
+        pthread_mutex_lock(&sLock);
+        while (!node->done && pthread_cond_timedwait(&sDone, &sLock, &deadline) != ETIMEDOUT)
+            ;
+        bool done = node->done;
+        pthread_mutex_unlock(&sLock);
+
+        printf("------ %s (%s) ------\n", sBoardNodes[i].title, node->path);
+        if (!done) {
+            printf("*** %s: Timed out after %ds\n", node->path, NODE_TIMEOUT_SEC);
+        } else if (node->error) {
+            printf("*** %s: %s\n", node->path, strerror(node->error));
+        } else {
+            fwrite(node->data, 1, node->size, stdout);
+            if (node->size > 0 && node->data[node->size - 1] != '\n') {
+                printf("\n");
+            }
+            if (node->truncated) {
+                printf("*** %s: Truncated to %d bytes\n", node->path, NODE_MAX_SIZE);
+            }
+        }
+        printf("\n");
+
+        if (done) {
+            free(node->data);
+        }
+    }
+    // nodes timed out still belong to their thread
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TUNA_BOOT_PROFILE_H
+#define TUNA_BOOT_PROFILE_H
+
+/*
+ * Boot profile of the tuna HALs: the phases of their initialization are
+ * timed and logged under the one "tuna_boot" tag, so that
+ *
+ *   adb logcat -b all -s tuna_boot
+ *
+ * shows the whole boot. Each line gives the phase, its duration and when it
+ * ended on the CLOCK_BOOTTIME scale of the kernel log:
+ *
+ *   struct tuna_boot_profile profile;
+ *
+ *   tuna_boot_profile_begin(&profile, "sensors");
+ *   ...
+ *   tuna_boot_profile_phase(&profile, "dmp_open");
+ *   ...
+ *   tuna_boot_profile_end(&profile);
+ *
+ * With ro.tuna.deferred_init set, the HALs leave what they don't need to
+ * return their handle to a background thread.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <android/log.h>
+#include <cutils/properties.h>
+
+#define TUNA_BOOT_PROFILE_TAG "tuna_boot"
+#define TUNA_DEFERRED_INIT_PROPERTY "ro.tuna.deferred_init"
+
+struct tuna_boot_profile {
+    const char *hal;
+    int64_t start_ns;
+    int64_t phase_ns;   /* start of the current phase */
+};
+
+static inline int64_t tuna_boot_profile_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void tuna_boot_profile_begin(struct tuna_boot_profile *profile,
+                                           const char *hal)
+{
+    profile->hal = hal;
+    profile->start_ns = tuna_boot_profile_now_ns();
+    profile->phase_ns = profile->start_ns;
+}
+
+/* ends the phase started by the previous call, or by the begin */
+static inline void tuna_boot_profile_phase(struct tuna_boot_profile *profile,
+                                           const char *phase)
+{
+    int64_t now = tuna_boot_profile_now_ns();
+
+    __android_log_print(ANDROID_LOG_INFO, TUNA_BOOT_PROFILE_TAG,
+                        "%s %s: %.2f ms, at %.3f s", profile->hal, phase,
+                        (now - profile->phase_ns) / 1e6, now / 1e9);
+    profile->phase_ns = now;
+}
+
+static inline void tuna_boot_profile_end(struct tuna_boot_profile *profile)
+{
+    int64_t now = tuna_boot_profile_now_ns();
+
+    __android_log_print(ANDROID_LOG_INFO, TUNA_BOOT_PROFILE_TAG,
+                        "%s total: %.2f ms, at %.3f s", profile->hal,
+                        (now - profile->start_ns) / 1e6, now / 1e9);
+}
+
+static inline bool tuna_deferred_init(void)
+{
+    return property_get_bool(TUNA_DEFERRED_INIT_PROPERTY, false);
+}
+
+#endif  // TUNA_BOOT_PROFILE_H
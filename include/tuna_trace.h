@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TUNA_TRACE_H
+#define TUNA_TRACE_H
+
+/*
+ * Systrace markers of the tuna HALs, all in the "hal" category so that one
+ * trace shows them side by side. They are only compiled in with
+ * TARGET_TUNA_TRACE := true, which defines TUNA_TRACE:
+ *
+ *   TUNA_TRACE_SCOPE(name)        a slice until the end of the enclosing block
+ *   TUNA_TRACE_BEGIN(name)        a slice until the next TUNA_TRACE_END()
+ *   TUNA_TRACE_INT(name, value)   a point of a counter track
+ *
+ * The names must be string literals.
+ */
+
+#ifdef TUNA_TRACE
+
+#include <stdint.h>
+#include <cutils/trace.h>
+
+static inline void tuna_trace_scope_end(int *scope __attribute__((unused)))
+{
+    atrace_end(ATRACE_TAG_HAL);
+}
+
+#define TUNA_TRACE_CONCAT2(a, b) a##b
+#define TUNA_TRACE_CONCAT(a, b) TUNA_TRACE_CONCAT2(a, b)
+
+#define TUNA_TRACE_SCOPE(name) \
+    int TUNA_TRACE_CONCAT(tuna_trace_scope_, __LINE__) \
+        __attribute__((cleanup(tuna_trace_scope_end), unused)) = \
+        (atrace_begin(ATRACE_TAG_HAL, name), 0)
+#define TUNA_TRACE_BEGIN(name) atrace_begin(ATRACE_TAG_HAL, name)
+#define TUNA_TRACE_END() atrace_end(ATRACE_TAG_HAL)
+#define TUNA_TRACE_INT(name, value) atrace_int(ATRACE_TAG_HAL, name, (int32_t)(value))
+
+#else
+
+#define TUNA_TRACE_SCOPE(name) do { } while (0)
+#define TUNA_TRACE_BEGIN(name) do { } while (0)
+#define TUNA_TRACE_END() do { } while (0)
+#define TUNA_TRACE_INT(name, value) do { } while (0)
+
+#endif
+
+#endif  // TUNA_TRACE_H
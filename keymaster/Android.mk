@@ -29,15 +29,38 @@ LOCAL_SRC_FILES := \
 LOCAL_C_INCLUDES := \
 	libcore/include \
 	external/openssl/include \
-	hardware/ti/omap4/security/tf_sdk/include
+	hardware/ti/omap4/security/tf_sdk/include \
+	$(LOCAL_PATH)/../include
 
 LOCAL_CFLAGS := -fvisibility=hidden -Wall -Werror
 
+ifeq ($(TARGET_TUNA_TRACE),true)
+LOCAL_CFLAGS += -DTUNA_TRACE
+endif
+
 LOCAL_SHARED_LIBRARIES := libcutils liblog libcrypto libtf_crypto_sst
 
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
 
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := keymaster_bench_tuna
+
+LOCAL_SRC_FILES := \
+	keymaster_bench.cpp
+
+LOCAL_C_INCLUDES := \
+	external/openssl/include
+
+LOCAL_CFLAGS := -Wall -Werror
+
+LOCAL_SHARED_LIBRARIES := libcrypto libdl libhardware
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
 endif # ifeq ($(BOARD_USES_SECURE_SERVICES),true)
 endif # ifeq ($(TARGET_BOARD_PLATFORM),omap4)
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the keystore.tuna operations on the device: ops/sec and latency
+ * percentiles of each, run from 1 or more threads at once.
+ *
+ *   keymaster_bench [-n iterations] [-g keygen iterations] [-t threads,...]
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/keymaster0.h>
+
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "keymaster_tuna.h"
+
+#define MAX_THREADS 8
+
+struct Key {
+    uint8_t* blob;
+    size_t blobLength;
+};
+
+/** What all the threads of a benchmark share. */
+struct Bench {
+    const char* name;
+    /** One operation, returns 0 on success. */
+    int (*op)(const Bench* bench);
+    keymaster0_device* dev;
+    uint32_t modulusBits;
+    const uint8_t* pkcs8;
+    size_t pkcs8Length;
+    Key key;
+    uint8_t data[256];
+    uint8_t* signature;
+    size_t signatureLength;
+};
+
+struct Worker {
+    pthread_t thread;
+    const Bench* bench;
+    int iterations;
+    int64_t* latencyNs;
+    int failures;
+};
+
+static int64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec) * 1000000000LL + t.tv_nsec;
+}
+
+static const keymaster_rsa_sign_params_t sSignParams = {
+    DIGEST_NONE, PADDING_NONE,
+};
+
+static int op_generate(const Bench* bench) {
+    keymaster_rsa_keygen_params_t params;
+    params.modulus_size = bench->modulusBits;
+    params.public_exponent = 65537;
+
+    uint8_t* blob;
+    size_t blobLength;
+    if (bench->dev->generate_keypair(bench->dev, TYPE_RSA, &params, &blob, &blobLength)) {
+        return -1;
+    }
+    bench->dev->delete_keypair(bench->dev, blob, blobLength);
+    free(blob);
+    return 0;
+}
+
+static int op_import(const Bench* bench) {
+    uint8_t* blob;
+    size_t blobLength;
+    if (bench->dev->import_keypair(bench->dev, bench->pkcs8, bench->pkcs8Length, &blob,
+            &blobLength)) {
+        return -1;
+    }
+    bench->dev->delete_keypair(bench->dev, blob, blobLength);
+    free(blob);
+    return 0;
+}
+
+static int op_get_public(const Bench* bench) {
+    uint8_t* x509;
+    size_t x509Length;
+    if (bench->dev->get_keypair_public(bench->dev, bench->key.blob, bench->key.blobLength,
+            &x509, &x509Length)) {
+        return -1;
+    }
+    free(x509);
+    return 0;
+}
+
+static int op_sign(const Bench* bench) {
+    uint8_t* signature;
+    size_t signatureLength;
+    if (bench->dev->sign_data(bench->dev, &sSignParams, bench->key.blob, bench->key.blobLength,
+            bench->data, sizeof(bench->data), &signature, &signatureLength)) {
+        return -1;
+    }
+    free(signature);
+    return 0;
+}
+
+static int op_verify(const Bench* bench) {
+    return bench->dev->verify_data(bench->dev, &sSignParams, bench->key.blob,
+            bench->key.blobLength, bench->data, sizeof(bench->data), bench->signature,
+            bench->signatureLength);
+}
+
+static void* worker_loop(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+
+    for (int i = 0; i < worker->iterations; i++) {
+        int64_t start = now_ns();
+        if (worker->bench->op(worker->bench)) {
+            worker->failures++;
+        }
+        worker->latencyNs[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static int compare_latency(const void* a, const void* b) {
+    int64_t la = *static_cast<const int64_t*>(a);
+    int64_t lb = *static_cast<const int64_t*>(b);
+    return la < lb ? -1 : la > lb;
+}
+
+static void run_bench(const Bench* bench, int iterations, int threads) {
+    Worker workers[MAX_THREADS];
+    int64_t* latencyNs = new int64_t[iterations];
+    int total = 0;
+
+    int64_t start = now_ns();
+    for (int t = 0; t < threads; t++) {
+        Worker* worker = &workers[t];
+        worker->bench = bench;
+        worker->iterations = iterations / threads + (t < iterations % threads);
+        worker->latencyNs = latencyNs + total;
+        worker->failures = 0;
+        total += worker->iterations;
+        pthread_create(&worker->thread, NULL, worker_loop, worker);
+    }
+
+    int failures = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        failures += workers[t].failures;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    qsort(latencyNs, total, sizeof(*latencyNs), compare_latency);
+    printf("%-22s %2d threads %6d ops %9.2f ops/s  p50 %8.2f ms  p90 %8.2f ms"
+            "  p99 %8.2f ms  max %8.2f ms%s\n",
+            bench->name, threads, total, total / seconds,
+            latencyNs[total * 50 / 100] / 1e6, latencyNs[total * 90 / 100] / 1e6,
+            latencyNs[total * 99 / 100] / 1e6, latencyNs[total - 1] / 1e6,
+            failures ? "  FAILURES" : "");
+    if (failures) {
+        printf("    %d of the operations failed\n", failures);
+    }
+
+    delete[] latencyNs;
+}
+
+/*
+ * Makes the PKCS#8 encoding of a new 2048 bit key, for the import benchmark.
+ */
+static int make_pkcs8(uint8_t** pkcs8, size_t* pkcs8Length) {
+    BIGNUM* e = BN_new();
+    RSA* rsa = RSA_new();
+    EVP_PKEY* pkey = EVP_PKEY_new();
+    PKCS8_PRIV_KEY_INFO* info = NULL;
+    int ret = -1;
+
+    if (e == NULL || rsa == NULL || pkey == NULL || !BN_set_word(e, RSA_F4)
+            || !RSA_generate_key_ex(rsa, 2048, e, NULL)
+            || !EVP_PKEY_set1_RSA(pkey, rsa)) {
+        goto out;
+    }
+
+    info = EVP_PKEY2PKCS8(pkey);
+    if (info != NULL) {
+        int len = i2d_PKCS8_PRIV_KEY_INFO(info, NULL);
+        *pkcs8 = static_cast<uint8_t*>(malloc(len));
+        uint8_t* p = *pkcs8;
+        if (*pkcs8 != NULL && i2d_PKCS8_PRIV_KEY_INFO(info, &p) == len) {
+            *pkcs8Length = len;
+            ret = 0;
+        }
+    }
+
+out:
+    PKCS8_PRIV_KEY_INFO_free(info);
+    EVP_PKEY_free(pkey);
+    RSA_free(rsa);
+    BN_free(e);
+    return ret;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-n iterations] [-g keygen iterations] [-t threads,...]\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+    int iterations = 200;
+    int keygenIterations = 4;
+    int threads[MAX_THREADS] = { 1, 2, 4 };
+    int numThreads = 3;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:g:t:")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'g':
+            keygenIterations = atoi(optarg);
+            break;
+        case 't': {
+            numThreads = 0;
+            char* save;
+            for (char* t = strtok_r(optarg, ",", &save); t != NULL && numThreads < MAX_THREADS;
+                    t = strtok_r(NULL, ",", &save)) {
+                int n = atoi(t);
+                if (n < 1 || n > MAX_THREADS) {
+                    fprintf(stderr, "thread counts go from 1 to %d\n", MAX_THREADS);
+                    return 1;
+                }
+                threads[numThreads++] = n;
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (iterations < 1 || keygenIterations < 0 || numThreads == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const hw_module_t* module;
+    int err = hw_get_module(KEYSTORE_HARDWARE_MODULE_ID, &module);
+    if (err) {
+        fprintf(stderr, "Couldn't load the keymaster: %s\n", strerror(-err));
+        return 1;
+    }
+
+    keymaster0_device* dev;
+    err = keymaster0_open(module, &dev);
+    if (err) {
+        fprintf(stderr, "Couldn't open the keymaster: %s\n", strerror(-err));
+        return 1;
+    }
+
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.dev = dev;
+    // Below any 2048 bit modulus, so that the raw RSA takes it.
+    bench.data[sizeof(bench.data) - 1] = 1;
+
+    if (make_pkcs8(const_cast<uint8_t**>(&bench.pkcs8), &bench.pkcs8Length)) {
+        fprintf(stderr, "Couldn't make a key to import\n");
+        return 1;
+    }
+
+    keymaster_rsa_keygen_params_t params;
+    params.modulus_size = 2048;
+    params.public_exponent = 65537;
+    if (dev->generate_keypair(dev, TYPE_RSA, &params, &bench.key.blob, &bench.key.blobLength)
+            || dev->sign_data(dev, &sSignParams, bench.key.blob, bench.key.blobLength,
+                    bench.data, sizeof(bench.data), &bench.signature, &bench.signatureLength)) {
+        fprintf(stderr, "Couldn't make a key to sign with\n");
+        return 1;
+    }
+
+    for (int t = 0; t < numThreads; t++) {
+        if (keygenIterations > 0) {
+            bench.name = "generate_keypair 1024";
+            bench.op = op_generate;
+            bench.modulusBits = 1024;
+            run_bench(&bench, keygenIterations, threads[t]);
+
+            bench.name = "generate_keypair 2048";
+            bench.modulusBits = 2048;
+            run_bench(&bench, keygenIterations, threads[t]);
+        }
+
+        bench.name = "import_keypair";
+        bench.op = op_import;
+        run_bench(&bench, iterations, threads[t]);
+
+        bench.name = "get_keypair_public";
+        bench.op = op_get_public;
+        run_bench(&bench, iterations, threads[t]);
+
+        bench.name = "sign_data";
+        bench.op = op_sign;
+        run_bench(&bench, iterations, threads[t]);
+
+        bench.name = "verify_data";
+        bench.op = op_verify;
+        run_bench(&bench, iterations, threads[t]);
+    }
+
+    keymaster_tuna_dump_t dump = reinterpret_cast<keymaster_tuna_dump_t>(
+            dlsym(module->dso, KEYMASTER_TUNA_DUMP));
+    if (dump != NULL) {
+        fflush(stdout);
+        dump(dev, STDOUT_FILENO);
+    }
+
+    dev->delete_keypair(dev, bench.key.blob, bench.key.blobLength);
+    free(bench.key.blob);
+    free(bench.signature);
+    free(const_cast<uint8_t*>(bench.pkcs8));
+    keymaster0_close(dev);
+
+    return 0;
+}
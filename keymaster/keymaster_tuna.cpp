@@ -14,8 +14,14 @@
  * limitations under the License.
  */
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 
 // For debugging
 #define LOG_NDEBUG 0
@@ -23,14 +29,21 @@
 // TEE is the Trusted Execution Environment
 #define LOG_TAG "TEEKeyMaster"
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <hardware/keymaster0.h>
 
+#include <openssl/asn1.h>
 #include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/obj.h>
 #include <openssl/rand.h>
+#include <openssl/rsa.h>
 #include <openssl/x509.h>
 
 #include <cryptoki.h>
@@ -38,15 +51,24 @@
 
 #include <UniquePtr.h>
 
+#include <atomic>
+
+#include "keymaster_tuna.h"
+#include "tuna_boot_profile.h"
+#include "tuna_trace.h"
+
 typedef keymaster0_device keymaster_device_t;
 typedef keymaster0_device keymaster_device;
 
 /** The size of a key ID in bytes */
 #define ID_LENGTH 32
 
-/** The current stored key version. */
+/** The stored key version of the RSA keys, with only their ID. */
 const static uint32_t KEY_VERSION = 1;
 
+/** The stored key version of the other keys, with their keymaster_keypair_t after the ID. */
+const static uint32_t KEY_VERSION_TYPED = 2;
+
 
 struct EVP_PKEY_Delete {
     void operator()(EVP_PKEY* p) const {
@@ -62,6 +84,34 @@ struct RSA_Delete {
 };
 typedef UniquePtr<RSA, RSA_Delete> Unique_RSA;
 
+struct EC_KEY_Delete {
+    void operator()(EC_KEY* p) const {
+        EC_KEY_free(p);
+    }
+};
+typedef UniquePtr<EC_KEY, EC_KEY_Delete> Unique_EC_KEY;
+
+struct EC_POINT_Delete {
+    void operator()(EC_POINT* p) const {
+        EC_POINT_free(p);
+    }
+};
+typedef UniquePtr<EC_POINT, EC_POINT_Delete> Unique_EC_POINT;
+
+struct ECDSA_SIG_Delete {
+    void operator()(ECDSA_SIG* p) const {
+        ECDSA_SIG_free(p);
+    }
+};
+typedef UniquePtr<ECDSA_SIG, ECDSA_SIG_Delete> Unique_ECDSA_SIG;
+
+struct ASN1_OBJECT_Delete {
+    void operator()(ASN1_OBJECT* p) const {
+        ASN1_OBJECT_free(p);
+    }
+};
+typedef UniquePtr<ASN1_OBJECT, ASN1_OBJECT_Delete> Unique_ASN1_OBJECT;
+
 struct PKCS8_PRIV_KEY_INFO_Delete {
     void operator()(PKCS8_PRIV_KEY_INFO* p) const {
         PKCS8_PRIV_KEY_INFO_free(p);
@@ -112,30 +162,581 @@ private:
 };
 typedef UniquePtr<ByteArray> Unique_ByteArray;
 
-class CryptoSession {
+/**
+ * What the time of the keymaster goes to: the calls into the TEE and the
+ * keymaster operations they are made for. Each is counted in a histogram
+ * updated without lock, see keymaster_tuna_dump().
+ */
+enum {
+    STAT_OPEN_SESSION,
+    STAT_CLOSE_SESSION,
+    STAT_FIND_OBJECT,
+    STAT_CLOSE_OBJECT,
+    STAT_GET_ATTRIBUTE,
+    STAT_CREATE_OBJECT,
+    STAT_DESTROY_OBJECT,
+    STAT_GENERATE_KEYPAIR,
+    STAT_SIGN_INIT,
+    STAT_SIGN,
+    STAT_VERIFY_RSA,
+    STAT_VERIFY_EC,
+
+    STAT_OP_GENERATE,
+    STAT_OP_IMPORT,
+    STAT_OP_GET_PUBLIC,
+    STAT_OP_DELETE,
+    STAT_OP_SIGN,
+    STAT_OP_VERIFY,
+
+    STAT_COUNT
+};
+
+/** The first bucket is under 128 us, each next one twice as wide. */
+#define LATENCY_BUCKETS 16
+
+struct LatencyStat {
+    std::atomic<uint32_t> count;
+    std::atomic<uint64_t> totalUs;
+    std::atomic<uint32_t> maxUs;
+    std::atomic<uint32_t> buckets[LATENCY_BUCKETS];
+};
+
+static const char* const sStatNames[STAT_COUNT] = {
+    "C_OpenSession",
+    "C_CloseSession",
+    "C_FindObjects",
+    "C_CloseObjectHandle",
+    "C_GetAttributeValue",
+    "C_CreateObject",
+    "C_DestroyObject",
+    "C_GenerateKeyPair",
+    "C_SignInit",
+    "C_Sign",
+    "RSA verify (normal world)",
+    "ECDSA verify (normal world)",
+
+    "generate_keypair",
+    "import_keypair",
+    "get_keypair_public",
+    "delete_keypair",
+    "sign_data",
+    "verify_data",
+};
+
+static LatencyStat sStats[STAT_COUNT];
+
+static int64_t monotonic_ns() {
+    struct timespec t;
+    t.tv_sec = t.tv_nsec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64_t(t.tv_sec) * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * Times its scope into one of the sStats.
+ */
+class StatTimer {
 public:
-    CryptoSession(CK_SESSION_HANDLE masterHandle) :
-            mHandle(masterHandle), mSubsession(CK_INVALID_HANDLE) {
-        CK_SESSION_HANDLE subsessionHandle = mHandle;
-        CK_RV openSessionRV = C_OpenSession(CKV_TOKEN_USER,
+    StatTimer(int stat) :
+            mStat(stat), mStart(monotonic_ns()) {
+    }
+
+    ~StatTimer() {
+        LatencyStat* stat = &sStats[mStat];
+        int64_t us = (monotonic_ns() - mStart) / 1000;
+        uint32_t usClamped = us > UINT32_MAX ? UINT32_MAX : uint32_t(us);
+
+        int b = 0;
+        while (b < LATENCY_BUCKETS - 1 && us >= (128LL << b)) {
+            b++;
+        }
+        stat->buckets[b].fetch_add(1, std::memory_order_relaxed);
+        stat->totalUs.fetch_add(us, std::memory_order_relaxed);
+        stat->count.fetch_add(1, std::memory_order_relaxed);
+
+        uint32_t max = stat->maxUs.load(std::memory_order_relaxed);
+        while (usClamped > max &&
+                !stat->maxUs.compare_exchange_weak(max, usClamped, std::memory_order_relaxed)) {
+        }
+    }
+
+private:
+    int mStat;
+    int64_t mStart;
+};
+
+/** Times a call into the TEE, and evaluates to its result. */
+#define TEE_TIMED(stat, call) ({ StatTimer _timer(stat); call; })
+
+/** The most primary sessions opened, one per core. */
+#define MAX_PRIMARY_SESSIONS 4
+
+/** The number of idle subsessions of each primary session kept open. */
+#define SUBSESSION_POOL_SIZE 2
+
+/** The number of keys whose object handles are kept open. */
+#define KEY_CACHE_SIZE 8
+
+/** The number of public keys kept to verify signatures with or to export. */
+#define PUBLIC_KEY_CACHE_SIZE 8
+
+/**
+ * The object handles of a key found in the TEE, by the ID from its key blob.
+ */
+struct KeyHandles {
+    uint8_t id[ID_LENGTH];
+    /** The primary session of the subsession the handles were found on. */
+    CK_SESSION_HANDLE primary;
+    CK_OBJECT_HANDLE publicKey;
+    CK_OBJECT_HANDLE privateKey;
+    uint32_t lastUse;
+    /** The ObjectHandles currently holding one of the handles. */
+    int users;
+    /** Whether the entry can still be found, false once its key was deleted. */
+    bool valid;
+};
+
+/**
+ * The public key of a key exported from the TEE, by the ID from its key blob.
+ */
+struct PublicKey {
+    uint8_t id[ID_LENGTH];
+    EVP_PKEY* pkey;
+    /** Its X.509 SubjectPublicKeyInfo, once get_keypair_public was asked for it. */
+    uint8_t* der;
+    size_t derLength;
+    uint32_t lastUse;
+};
+
+static void free_public_key(PublicKey* publicKey) {
+    EVP_PKEY_free(publicKey->pkey);
+    publicKey->pkey = NULL;
+    free(publicKey->der);
+    publicKey->der = NULL;
+    publicKey->derLength = 0;
+}
+
+static void close_object_handle(CK_SESSION_HANDLE primary, CK_OBJECT_HANDLE handle) {
+    CK_RV rv = TEE_TIMED(STAT_CLOSE_OBJECT, C_CloseObjectHandle(primary, handle));
+    if (rv != CKR_OK) {
+        ALOGW("Couldn't close object handle 0x%x: 0x%x", handle, rv);
+    } else {
+        ALOGV("Closing object handle 0x%x", handle);
+    }
+}
+
+class KeyPool;
+
+static time_t monotonic_seconds() {
+    struct timespec t;
+    t.tv_sec = t.tv_nsec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec;
+}
+
+/**
+ * The primary TEE sessions of an opened keymaster, one per core so that the
+ * calls of different threads don't queue up behind one session, and the
+ * subsessions the operations ran on. Opening a subsession is a round trip to
+ * the secure world, so those of the finished operations are kept for the next
+ * ones. Each operation takes a subsession of the primary session with the
+ * fewest in use.
+ *
+ * The object handles of the last keys used are kept open as well, so that
+ * operating again on a key doesn't have to search the TEE for it. They are
+ * only valid under the primary session they were found with. The public keys
+ * of the last keys verified with are kept too, since their RSA public
+ * operation or ECDSA verification doesn't need the secure world at all.
+ */
+class TeeContext {
+public:
+    TeeContext(const CK_SESSION_HANDLE* primaries, size_t numPrimaries) :
+            mKeyPool(NULL), mNumPrimaries(numPrimaries), mLastActivity(monotonic_seconds()),
+            mClock(0) {
+        pthread_mutex_init(&mLock, NULL);
+        memset(mPrimaries, 0, sizeof(mPrimaries));
+        for (size_t i = 0; i < numPrimaries; i++) {
+            mPrimaries[i].handle = primaries[i];
+        }
+        memset(mKeys, 0, sizeof(mKeys));
+        memset(mPublicKeys, 0, sizeof(mPublicKeys));
+    }
+
+    ~TeeContext() {
+        for (size_t i = 0; i < PUBLIC_KEY_CACHE_SIZE; i++) {
+            if (mPublicKeys[i].pkey != NULL) {
+                free_public_key(&mPublicKeys[i]);
+            }
+        }
+        for (size_t i = 0; i < KEY_CACHE_SIZE; i++) {
+            if (mKeys[i].valid || mKeys[i].users > 0) {
+                close_object_handle(mKeys[i].primary, mKeys[i].publicKey);
+                close_object_handle(mKeys[i].primary, mKeys[i].privateKey);
+            }
+        }
+        for (size_t p = 0; p < mNumPrimaries; p++) {
+            Primary* primary = &mPrimaries[p];
+            for (size_t i = 0; i < primary->numIdle; i++) {
+                CK_RV rv = TEE_TIMED(STAT_CLOSE_SESSION, C_CloseSession(primary->idle[i]));
+                ALOGV("Closing subsession 0x%x: 0x%x", primary->idle[i], rv);
+            }
+            C_CloseSession(primary->handle);
+        }
+        pthread_mutex_destroy(&mLock);
+    }
+
+    KeyPool* getKeyPool() const {
+        return mKeyPool;
+    }
+
+    void setKeyPool(KeyPool* keyPool) {
+        mKeyPool = keyPool;
+    }
+
+    /** The seconds since a keymaster call last used the TEE. */
+    time_t getIdleTime() {
+        pthread_mutex_lock(&mLock);
+        time_t idle = monotonic_seconds() - mLastActivity;
+        pthread_mutex_unlock(&mLock);
+        return idle;
+    }
+
+    /**
+     * Takes an idle subsession of the least busy primary session, or opens a
+     * new one when all of them are in use, and returns its primary session in
+     * primaryHandle. Returns CK_INVALID_HANDLE if the TEE could not open one.
+     * The background work of the keymaster doesn't count as activity.
+     */
+    CK_SESSION_HANDLE acquire(bool background, CK_SESSION_HANDLE* primaryHandle) {
+        pthread_mutex_lock(&mLock);
+        if (!background) {
+            mLastActivity = monotonic_seconds();
+        }
+        Primary* primary = &mPrimaries[0];
+        for (size_t p = 1; p < mNumPrimaries; p++) {
+            if (mPrimaries[p].busy < primary->busy) {
+                primary = &mPrimaries[p];
+            }
+        }
+        primary->busy++;
+        *primaryHandle = primary->handle;
+        if (primary->numIdle > 0) {
+            CK_SESSION_HANDLE subsessionHandle = primary->idle[--primary->numIdle];
+            pthread_mutex_unlock(&mLock);
+            return subsessionHandle;
+        }
+        pthread_mutex_unlock(&mLock);
+
+        CK_SESSION_HANDLE subsessionHandle = *primaryHandle;
+        CK_RV openSessionRV = TEE_TIMED(STAT_OPEN_SESSION, C_OpenSession(CKV_TOKEN_USER,
                 CKF_SERIAL_SESSION | CKF_RW_SESSION | CKVF_OPEN_SUB_SESSION,
                 NULL,
                 NULL,
-                &subsessionHandle);
+                &subsessionHandle));
 
         if (openSessionRV != CKR_OK || subsessionHandle == CK_INVALID_HANDLE) {
-            (void) C_Finalize(NULL_PTR);
             ALOGE("Error opening secondary session with TEE: 0x%x", openSessionRV);
-        } else {
-            ALOGV("Opening subsession 0x%x", subsessionHandle);
-            mSubsession = subsessionHandle;
+            pthread_mutex_lock(&mLock);
+            primary->busy--;
+            pthread_mutex_unlock(&mLock);
+            return CK_INVALID_HANDLE;
+        }
+        ALOGV("Opening subsession 0x%x of 0x%x", subsessionHandle, *primaryHandle);
+        return subsessionHandle;
+    }
+
+    /**
+     * Gives back a subsession once its operation is over. It is closed rather
+     * than kept if the TEE failed it or if the pool is already full.
+     */
+    void release(CK_SESSION_HANDLE primaryHandle, CK_SESSION_HANDLE subsessionHandle,
+            bool broken) {
+        pthread_mutex_lock(&mLock);
+        Primary* primary = findPrimary(primaryHandle);
+        primary->busy--;
+        if (!broken && primary->numIdle < SUBSESSION_POOL_SIZE) {
+            primary->idle[primary->numIdle++] = subsessionHandle;
+            pthread_mutex_unlock(&mLock);
+            return;
+        }
+        pthread_mutex_unlock(&mLock);
+
+        CK_RV rv = TEE_TIMED(STAT_CLOSE_SESSION, C_CloseSession(subsessionHandle));
+        ALOGV("Closing subsession 0x%x: 0x%x", subsessionHandle, rv);
+    }
+
+    /**
+     * Looks up the handles of a key under a primary session. On success both
+     * handles are in use until they are given back with putKey().
+     */
+    bool getKey(CK_SESSION_HANDLE primary, const uint8_t* id, CK_OBJECT_HANDLE* publicKey,
+            CK_OBJECT_HANDLE* privateKey) {
+        pthread_mutex_lock(&mLock);
+        KeyHandles* key = findKey(primary, id);
+        if (key != NULL) {
+            key->lastUse = ++mClock;
+            key->users += 2;
+            *publicKey = key->publicKey;
+            *privateKey = key->privateKey;
+        }
+        pthread_mutex_unlock(&mLock);
+        return key != NULL;
+    }
+
+    /**
+     * Keeps the handles just found for a key, in place of the key used the
+     * longest time ago. Returns false if every entry is in use, in which case
+     * the caller still owns the handles.
+     */
+    bool addKey(CK_SESSION_HANDLE primary, const uint8_t* id, CK_OBJECT_HANDLE publicKey,
+            CK_OBJECT_HANDLE privateKey) {
+        KeyHandles evicted;
+        evicted.users = -1;
+
+        pthread_mutex_lock(&mLock);
+        KeyHandles* key = NULL;
+        for (size_t i = 0; i < KEY_CACHE_SIZE; i++) {
+            KeyHandles* k = &mKeys[i];
+            if (k->users > 0) {
+                continue;
+            }
+            if (!k->valid) {
+                key = k;
+                break;
+            }
+            if (key == NULL || k->lastUse < key->lastUse) {
+                key = k;
+            }
+        }
+        if (key == NULL) {
+            pthread_mutex_unlock(&mLock);
+            return false;
+        }
+        if (key->valid) {
+            evicted = *key;
+        }
+
+        memcpy(key->id, id, ID_LENGTH);
+        key->primary = primary;
+        key->publicKey = publicKey;
+        key->privateKey = privateKey;
+        key->lastUse = ++mClock;
+        key->users = 2;
+        key->valid = true;
+        pthread_mutex_unlock(&mLock);
+
+        if (evicted.users == 0) {
+            close_object_handle(evicted.primary, evicted.publicKey);
+            close_object_handle(evicted.primary, evicted.privateKey);
+        }
+        return true;
+    }
+
+    /** Gives back one of the handles returned by getKey() or added with addKey(). */
+    void putKey(CK_SESSION_HANDLE primary, CK_OBJECT_HANDLE handle) {
+        KeyHandles released;
+        released.users = -1;
+
+        pthread_mutex_lock(&mLock);
+        for (size_t i = 0; i < KEY_CACHE_SIZE; i++) {
+            KeyHandles* key = &mKeys[i];
+            if (key->users > 0 && key->primary == primary
+                    && (key->publicKey == handle || key->privateKey == handle)) {
+                key->users--;
+                if (key->users == 0 && !key->valid) {
+                    released = *key;
+                }
+                break;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+
+        if (released.users == 0) {
+            close_object_handle(released.primary, released.publicKey);
+            close_object_handle(released.primary, released.privateKey);
+        }
+    }
+
+    /**
+     * Drops the handles of a deleted key, under every primary session. Those
+     * still in use are closed once given back.
+     */
+    void forgetKey(const uint8_t* id) {
+        KeyHandles released[KEY_CACHE_SIZE];
+        size_t numReleased = 0;
+
+        pthread_mutex_lock(&mLock);
+        for (size_t i = 0; i < KEY_CACHE_SIZE; i++) {
+            KeyHandles* key = &mKeys[i];
+            if (!key->valid || memcmp(key->id, id, ID_LENGTH) != 0) {
+                continue;
+            }
+            key->valid = false;
+            if (key->users == 0) {
+                released[numReleased++] = *key;
+            }
+        }
+        PublicKey* publicKey = findPublicKey(id);
+        if (publicKey != NULL) {
+            free_public_key(publicKey);
         }
+        pthread_mutex_unlock(&mLock);
+
+        for (size_t i = 0; i < numReleased; i++) {
+            close_object_handle(released[i].primary, released[i].publicKey);
+            close_object_handle(released[i].primary, released[i].privateKey);
+        }
+    }
+
+    /**
+     * Looks up the public key of a key. Returns a new reference the caller has
+     * to free, or NULL if it wasn't exported yet.
+     */
+    EVP_PKEY* getPublicKey(const uint8_t* id) {
+        pthread_mutex_lock(&mLock);
+        EVP_PKEY* pkey = NULL;
+        PublicKey* publicKey = findPublicKey(id);
+        if (publicKey != NULL) {
+            publicKey->lastUse = ++mClock;
+            pkey = publicKey->pkey;
+            EVP_PKEY_up_ref(pkey);
+        }
+        pthread_mutex_unlock(&mLock);
+        return pkey;
+    }
+
+    /**
+     * Copies the encoded public key of a key into a new buffer the caller has
+     * to free, if it was encoded already.
+     */
+    bool getPublicKeyDer(const uint8_t* id, uint8_t** der, size_t* derLength) {
+        bool found = false;
+
+        pthread_mutex_lock(&mLock);
+        PublicKey* publicKey = findPublicKey(id);
+        if (publicKey != NULL && publicKey->der != NULL) {
+            publicKey->lastUse = ++mClock;
+            *der = static_cast<uint8_t*>(malloc(publicKey->derLength));
+            if (*der != NULL) {
+                memcpy(*der, publicKey->der, publicKey->derLength);
+                *derLength = publicKey->derLength;
+                found = true;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+
+        return found;
+    }
+
+    /**
+     * Keeps a reference to the public key just exported for a key, in place of
+     * the one used the longest time ago, and a copy of its encoding if der
+     * isn't NULL.
+     */
+    void addPublicKey(const uint8_t* id, EVP_PKEY* pkey, const uint8_t* der, size_t derLength) {
+        uint8_t* derCopy = NULL;
+        if (der != NULL) {
+            derCopy = static_cast<uint8_t*>(malloc(derLength));
+            if (derCopy != NULL) {
+                memcpy(derCopy, der, derLength);
+            }
+        }
+
+        pthread_mutex_lock(&mLock);
+        PublicKey* publicKey = findPublicKey(id);
+        if (publicKey != NULL && derCopy == NULL) {
+            // Keep whatever encoding is there already.
+            publicKey->lastUse = ++mClock;
+            pthread_mutex_unlock(&mLock);
+            return;
+        }
+        if (publicKey == NULL) {
+            publicKey = &mPublicKeys[0];
+            for (size_t i = 0; i < PUBLIC_KEY_CACHE_SIZE; i++) {
+                if (mPublicKeys[i].pkey == NULL) {
+                    publicKey = &mPublicKeys[i];
+                    break;
+                }
+                if (mPublicKeys[i].lastUse < publicKey->lastUse) {
+                    publicKey = &mPublicKeys[i];
+                }
+            }
+        }
+        if (publicKey->pkey != NULL) {
+            free_public_key(publicKey);
+        }
+
+        memcpy(publicKey->id, id, ID_LENGTH);
+        EVP_PKEY_up_ref(pkey);
+        publicKey->pkey = pkey;
+        publicKey->der = derCopy;
+        publicKey->derLength = derCopy != NULL ? derLength : 0;
+        publicKey->lastUse = ++mClock;
+        pthread_mutex_unlock(&mLock);
+    }
+
+private:
+    struct Primary {
+        CK_SESSION_HANDLE handle;
+        CK_SESSION_HANDLE idle[SUBSESSION_POOL_SIZE];
+        size_t numIdle;
+        /** The subsessions in use by an operation. */
+        int busy;
+    };
+
+    /* It must be called with the mLock held. */
+    Primary* findPrimary(CK_SESSION_HANDLE handle) {
+        for (size_t p = 1; p < mNumPrimaries; p++) {
+            if (mPrimaries[p].handle == handle) {
+                return &mPrimaries[p];
+            }
+        }
+        return &mPrimaries[0];
+    }
+
+    /* It must be called with the mLock held. */
+    KeyHandles* findKey(CK_SESSION_HANDLE primary, const uint8_t* id) {
+        for (size_t i = 0; i < KEY_CACHE_SIZE; i++) {
+            if (mKeys[i].valid && mKeys[i].primary == primary
+                    && memcmp(mKeys[i].id, id, ID_LENGTH) == 0) {
+                return &mKeys[i];
+            }
+        }
+        return NULL;
+    }
+
+    /* It must be called with the mLock held. */
+    PublicKey* findPublicKey(const uint8_t* id) {
+        for (size_t i = 0; i < PUBLIC_KEY_CACHE_SIZE; i++) {
+            if (mPublicKeys[i].pkey != NULL && memcmp(mPublicKeys[i].id, id, ID_LENGTH) == 0) {
+                return &mPublicKeys[i];
+            }
+        }
+        return NULL;
+    }
+
+    KeyPool* mKeyPool;
+
+    pthread_mutex_t mLock;
+    Primary mPrimaries[MAX_PRIMARY_SESSIONS];
+    size_t mNumPrimaries;
+    time_t mLastActivity;
+
+    KeyHandles mKeys[KEY_CACHE_SIZE];
+    PublicKey mPublicKeys[PUBLIC_KEY_CACHE_SIZE];
+    uint32_t mClock;
+};
+
+class CryptoSession {
+public:
+    CryptoSession(TeeContext* context, bool background = false) :
+            mContext(context), mPrimary(CK_INVALID_HANDLE), mBroken(false) {
+        mSubsession = context->acquire(background, &mPrimary);
     }
 
     ~CryptoSession() {
         if (mSubsession != CK_INVALID_HANDLE) {
-            CK_RV rv = C_CloseSession(mSubsession);
-            ALOGV("Closing subsession 0x%x: 0x%x", mSubsession, rv);
+            mContext->release(mPrimary, mSubsession, mBroken);
             mSubsession = CK_INVALID_HANDLE;
         }
     }
@@ -145,43 +746,72 @@ public:
     }
 
     CK_SESSION_HANDLE getPrimary() const {
-        return mHandle;
+        return mPrimary;
+    }
+
+    TeeContext* getContext() const {
+        return mContext;
+    }
+
+    /**
+     * Passes through the result of a call made on the subsession, and
+     * remembers if it shows that the subsession can't be reused.
+     */
+    CK_RV check(CK_RV rv) const {
+        switch (rv) {
+        case CKR_SESSION_HANDLE_INVALID:
+        case CKR_SESSION_CLOSED:
+        case CKR_OPERATION_ACTIVE:
+        case CKR_DEVICE_ERROR:
+        case CKR_DEVICE_REMOVED:
+            mBroken = true;
+            break;
+        }
+        return rv;
     }
 
 private:
-    CK_SESSION_HANDLE mHandle;
+    TeeContext* mContext;
+    CK_SESSION_HANDLE mPrimary;
     CK_SESSION_HANDLE mSubsession;
+    mutable bool mBroken;
 };
 
 class ObjectHandle {
 public:
     ObjectHandle(const CryptoSession* session, CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE) :
-            mSession(session), mHandle(handle) {
+            mSession(session), mHandle(handle), mCached(false) {
     }
 
     ~ObjectHandle() {
-        if (mHandle != CK_INVALID_HANDLE) {
-            CK_RV rv = C_CloseObjectHandle(mSession->getPrimary(), mHandle);
-            if (rv != CKR_OK) {
-                ALOGW("Couldn't close object handle 0x%x: 0x%x", mHandle, rv);
-            } else {
-                ALOGV("Closing object handle 0x%x", mHandle);
-                mHandle = CK_INVALID_HANDLE;
-            }
+        if (mHandle == CK_INVALID_HANDLE) {
+            return;
         }
+        if (mCached) {
+            mSession->getContext()->putKey(mSession->getPrimary(), mHandle);
+        } else {
+            close_object_handle(mSession->getPrimary(), mHandle);
+        }
+        mHandle = CK_INVALID_HANDLE;
     }
 
     CK_OBJECT_HANDLE get() const {
         return mHandle;
     }
 
-    void reset(CK_OBJECT_HANDLE handle) {
+    /**
+     * A cached handle belongs to the TeeContext, it is given back to it
+     * rather than closed.
+     */
+    void reset(CK_OBJECT_HANDLE handle, bool cached = false) {
         mHandle = handle;
+        mCached = cached;
     }
 
 private:
     const CryptoSession* mSession;
     CK_OBJECT_HANDLE mHandle;
+    bool mCached;
 };
 
 
@@ -194,6 +824,17 @@ private:
     typeof (obj.release()) _dummy __attribute__((unused)) = obj.release()
 
 
+/*
+ * The error strings are only needed to log the errors: with the init
+ * deferred, the first one loads them.
+ */
+static pthread_once_t sErrorStringsOnce = PTHREAD_ONCE_INIT;
+
+static void loadErrorStrings() {
+    ERR_load_crypto_strings();
+    ERR_load_BIO_strings();
+}
+
 /*
  * Checks this thread's OpenSSL error queue and logs if
  * necessary.
@@ -203,6 +844,7 @@ static void logOpenSSLError(const char* location) {
 
     if (error != 0) {
         char message[256];
+        pthread_once(&sErrorStringsOnce, loadErrorStrings);
         ERR_error_string_n(error, message, sizeof(message));
         ALOGE("OpenSSL error in %s %d: %s", location, error, message);
     }
@@ -212,29 +854,61 @@ static void logOpenSSLError(const char* location) {
 }
 
 
+static void set_attribute(CK_ATTRIBUTE* attrib, CK_ATTRIBUTE_TYPE type, void* pValue,
+        CK_ULONG ulValueLen) {
+    attrib->type = type;
+    attrib->pValue = pValue;
+    attrib->ulValueLen = ulValueLen;
+}
+
 /**
- * Convert from OpenSSL's BIGNUM format to TEE's Big Integer format.
+ * The big integers of a key to import, converted from OpenSSL's BIGNUM format
+ * to TEE's Big Integer format into one allocation. It is zeroed once the key
+ * was handed to the TEE.
  */
-static ByteArray* bignum_to_array(const BIGNUM* bn) {
-    const int bignumSize = BN_num_bytes(bn);
+class BignumArena {
+public:
+    BignumArena(size_t size) :
+            mArray(new CK_BYTE[size]), mSize(size), mUsed(0) {
+    }
 
-    Unique_CK_BYTE bytes(new CK_BYTE[bignumSize]);
+    ~BignumArena() {
+        if (mArray != NULL) {
+            OPENSSL_cleanse(mArray, mSize);
+            delete[] mArray;
+        }
+    }
 
-    unsigned char* tmp = reinterpret_cast<unsigned char*>(bytes.get());
-    if (int(BN_bn2bin(bn, tmp)) != bignumSize) {
-        ALOGE("public exponent size wasn't what was expected");
-        return NULL;
+    static size_t sizeOf(const BIGNUM* bn) {
+        return bn != NULL ? BN_num_bytes(bn) : 0;
     }
 
-    return new ByteArray(bytes.release(), bignumSize);
-}
+    /**
+     * Converts bn into the arena and makes it the value of attrib.
+     */
+    int append(CK_ATTRIBUTE* attrib, CK_ATTRIBUTE_TYPE type, const BIGNUM* bn) {
+        const size_t bignumSize = BN_num_bytes(bn);
+        if (mArray == NULL || bignumSize > mSize - mUsed) {
+            ALOGE("big integer 0x%x doesn't fit in the arena", type);
+            return -1;
+        }
 
-static void set_attribute(CK_ATTRIBUTE* attrib, CK_ATTRIBUTE_TYPE type, void* pValue,
-        CK_ULONG ulValueLen) {
-    attrib->type = type;
-    attrib->pValue = pValue;
-    attrib->ulValueLen = ulValueLen;
-}
+        CK_BYTE* tmp = mArray + mUsed;
+        if (size_t(BN_bn2bin(bn, reinterpret_cast<unsigned char*>(tmp))) != bignumSize) {
+            ALOGE("big integer 0x%x size wasn't what was expected", type);
+            return -1;
+        }
+
+        set_attribute(attrib, type, tmp, bignumSize);
+        mUsed += bignumSize;
+        return 0;
+    }
+
+private:
+    CK_BYTE* mArray;
+    size_t mSize;
+    size_t mUsed;
+};
 
 static ByteArray* generate_random_id() {
     Unique_ByteArray id(new ByteArray(ID_LENGTH));
@@ -245,17 +919,30 @@ static ByteArray* generate_random_id() {
     return id.release();
 }
 
-static int keyblob_save(ByteArray* objId, uint8_t** key_blob, size_t* key_blob_length) {
-    Unique_ByteArray handleBlob(new ByteArray(sizeof(uint32_t) + objId->length()));
+/**
+ * Writes the blob of a key. Those of RSA keys stay in the first version, for
+ * the blobs to keep working with the builds before EC keys.
+ */
+static int keyblob_save(ByteArray* objId, const keymaster_keypair_t type, uint8_t** key_blob,
+        size_t* key_blob_length) {
+    const uint32_t version = type == TYPE_RSA ? KEY_VERSION : KEY_VERSION_TYPED;
+    Unique_ByteArray handleBlob(new ByteArray(sizeof(uint32_t) + objId->length()
+            + (version == KEY_VERSION_TYPED ? sizeof(uint32_t) : 0)));
     if (handleBlob.get() == NULL) {
         ALOGE("Could not allocate key blob");
         return -1;
     }
     uint8_t* tmp = handleBlob->get();
     for (size_t i = 0; i < sizeof(uint32_t); i++) {
-        *tmp++ = KEY_VERSION >> ((sizeof(uint32_t) - i - 1) * 8);
+        *tmp++ = version >> ((sizeof(uint32_t) - i - 1) * 8);
     }
     memcpy(tmp, objId->get(), objId->length());
+    tmp += objId->length();
+    if (version == KEY_VERSION_TYPED) {
+        for (size_t i = 0; i < sizeof(uint32_t); i++) {
+            *tmp++ = uint32_t(type) >> ((sizeof(uint32_t) - i - 1) * 8);
+        }
+    }
 
     *key_blob_length = handleBlob->length();
     *key_blob = handleBlob->get();
@@ -266,6 +953,7 @@ static int keyblob_save(ByteArray* objId, uint8_t** key_blob, size_t* key_blob_l
 
 static int find_single_object(const uint8_t* obj_id, const size_t obj_id_length,
         CK_OBJECT_CLASS obj_class, const CryptoSession* session, ObjectHandle* object) {
+    StatTimer timer(STAT_FIND_OBJECT);
 
     // Note that the CKA_ID attribute is never written, so we can cast away const here.
     void* obj_id_ptr = reinterpret_cast<void*>(const_cast<uint8_t*>(obj_id));
@@ -274,8 +962,8 @@ static int find_single_object(const uint8_t* obj_id, const size_t obj_id_length,
             { CKA_CLASS, &obj_class, sizeof(obj_class) },
     };
 
-    CK_RV rv = C_FindObjectsInit(session->get(), attributes,
-            sizeof(attributes) / sizeof(CK_ATTRIBUTE));
+    CK_RV rv = session->check(C_FindObjectsInit(session->get(), attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE)));
     if (rv != CKR_OK) {
         ALOGE("Error in C_FindObjectsInit: 0x%x", rv);
         return -1;
@@ -284,7 +972,7 @@ static int find_single_object(const uint8_t* obj_id, const size_t obj_id_length,
     CK_OBJECT_HANDLE tmpHandle;
     CK_ULONG tmpCount;
 
-    rv = C_FindObjects(session->get(), &tmpHandle, 1, &tmpCount);
+    rv = session->check(C_FindObjects(session->get(), &tmpHandle, 1, &tmpCount));
     ALOGV("Found %d object 0x%x : class 0x%x", tmpCount, tmpHandle, obj_class);
     if (rv != CKR_OK || tmpCount != 1) {
         C_FindObjectsFinal(session->get());
@@ -297,16 +985,20 @@ static int find_single_object(const uint8_t* obj_id, const size_t obj_id_length,
     return 0;
 }
 
-static int keyblob_restore(const CryptoSession* session, const uint8_t* keyBlob,
-        const size_t keyBlobLength, ObjectHandle* public_key, ObjectHandle* private_key) {
+/**
+ * Checks a key blob and returns the ID of its key, or NULL if it's invalid.
+ * The type of the key is returned in type if it isn't NULL.
+ */
+static const uint8_t* keyblob_id(const uint8_t* keyBlob, const size_t keyBlobLength,
+        keymaster_keypair_t* type = NULL) {
     if (keyBlob == NULL) {
         ALOGE("key blob was null");
-        return -1;
+        return NULL;
     }
 
     if (keyBlobLength < (sizeof(KEY_VERSION) + ID_LENGTH)) {
         ALOGE("key blob is not correct size");
-        return -1;
+        return NULL;
     }
 
     uint32_t keyVersion = 0;
@@ -316,60 +1008,90 @@ static int keyblob_restore(const CryptoSession* session, const uint8_t* keyBlob,
         keyVersion = (keyVersion << 8) | *p++;
     }
 
-    if (keyVersion != 1) {
+    uint32_t keyType = TYPE_RSA;
+    if (keyVersion == KEY_VERSION_TYPED) {
+        if (keyBlobLength < (sizeof(KEY_VERSION) + ID_LENGTH + sizeof(keyType))) {
+            ALOGE("key blob is not correct size");
+            return NULL;
+        }
+        keyType = 0;
+        for (size_t i = 0; i < sizeof(keyType); i++) {
+            keyType = (keyType << 8) | p[ID_LENGTH + i];
+        }
+        if (keyType != TYPE_EC) {
+            ALOGE("Invalid key type %d", keyType);
+            return NULL;
+        }
+    } else if (keyVersion != KEY_VERSION) {
         ALOGE("Invalid key version %d", keyVersion);
-        return -1;
+        return NULL;
     }
 
-    return find_single_object(p, ID_LENGTH, CKO_PUBLIC_KEY, session, public_key)
-            || find_single_object(p, ID_LENGTH, CKO_PRIVATE_KEY, session, private_key);
+    if (type != NULL) {
+        *type = keymaster_keypair_t(keyType);
+    }
+    return p;
 }
 
-static int tee_generate_keypair(const keymaster_device_t* dev,
-        const keymaster_keypair_t type, const void* key_params,
-        uint8_t** key_blob, size_t* key_blob_length) {
-    CK_BBOOL bTRUE = CK_TRUE;
-
-    if (type != TYPE_RSA) {
-        ALOGW("Unknown key type %d", type);
+static int keyblob_restore(const CryptoSession* session, const uint8_t* keyBlob,
+        const size_t keyBlobLength, ObjectHandle* public_key, ObjectHandle* private_key) {
+    const uint8_t* p = keyblob_id(keyBlob, keyBlobLength);
+    if (p == NULL) {
         return -1;
     }
 
-    if (key_params == NULL) {
-        ALOGW("generate_keypair params were NULL");
+    TeeContext* context = session->getContext();
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+    if (context->getKey(session->getPrimary(), p, &hPublicKey, &hPrivateKey)) {
+        ALOGV("Cached public handle = 0x%x, private handle = 0x%x", hPublicKey, hPrivateKey);
+        public_key->reset(hPublicKey, true);
+        private_key->reset(hPrivateKey, true);
+        return 0;
+    }
+
+    if (find_single_object(p, ID_LENGTH, CKO_PUBLIC_KEY, session, public_key)
+            || find_single_object(p, ID_LENGTH, CKO_PRIVATE_KEY, session, private_key)) {
         return -1;
     }
 
-    keymaster_rsa_keygen_params_t* rsa_params = (keymaster_rsa_keygen_params_t*) key_params;
+    if (context->addKey(session->getPrimary(), p, public_key->get(), private_key->get())) {
+        public_key->reset(public_key->get(), true);
+        private_key->reset(private_key->get(), true);
+    }
+    return 0;
+}
+
+/**
+ * Generates an RSA key pair as token objects with the given ID. The handles
+ * are returned in publicKey and privateKey.
+ */
+static int generate_rsa_keypair(const CryptoSession* session, const CK_ULONG modulusBits,
+        const uint64_t exp, ByteArray* objId, ObjectHandle* publicKey,
+        ObjectHandle* privateKey) {
+    CK_BBOOL bTRUE = CK_TRUE;
 
     CK_MECHANISM mechanism = {
             CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0,
     };
-    CK_ULONG modulusBits = (CK_ULONG) rsa_params->modulus_size;
+    CK_ULONG bits = modulusBits;
 
     /**
      * Convert our unsigned 64-bit integer to the TEE Big Integer class. It's
      * an unsigned array of bytes with MSB first.
      */
     CK_BYTE publicExponent[sizeof(uint64_t)];
-    const uint64_t exp = rsa_params->public_exponent;
     size_t offset = sizeof(publicExponent) - 1;
     for (size_t i = 0; i < sizeof(publicExponent); i++) {
         publicExponent[offset--] = (exp >> (i * CHAR_BIT)) & 0xFF;
     }
 
-    Unique_ByteArray objId(generate_random_id());
-    if (objId.get() == NULL) {
-        ALOGE("Couldn't generate random key ID");
-        return -1;
-    }
-
     CK_ATTRIBUTE publicKeyTemplate[] = {
             {CKA_ID,              objId->get(),   objId->length()},
             {CKA_TOKEN,           &bTRUE,         sizeof(bTRUE)},
             {CKA_ENCRYPT,         &bTRUE,         sizeof(bTRUE)},
             {CKA_VERIFY,          &bTRUE,         sizeof(bTRUE)},
-            {CKA_MODULUS_BITS,    &modulusBits,   sizeof(modulusBits)},
+            {CKA_MODULUS_BITS,    &bits,          sizeof(bits)},
             {CKA_PUBLIC_EXPONENT, publicExponent, sizeof(publicExponent)},
     };
 
@@ -380,77 +1102,548 @@ static int tee_generate_keypair(const keymaster_device_t* dev,
             {CKA_SIGN,            &bTRUE,         sizeof(bTRUE)},
     };
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
-
     CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
-    CK_RV rv = C_GenerateKeyPair(session.get(),
+    CK_RV rv = session->check(TEE_TIMED(STAT_GENERATE_KEYPAIR, C_GenerateKeyPair(session->get(),
             &mechanism,
             publicKeyTemplate,
             sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
             privateKeyTemplate,
             sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
             &hPublicKey,
-            &hPrivateKey);
+            &hPrivateKey)));
 
     if (rv != CKR_OK) {
         ALOGE("Generate keypair failed: 0x%x", rv);
         return -1;
     }
 
-    ObjectHandle publicKey(&session, hPublicKey);
-    ObjectHandle privateKey(&session, hPrivateKey);
-    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
+    publicKey->reset(hPublicKey);
+    privateKey->reset(hPrivateKey);
+    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey->get(), privateKey->get());
 
-    return keyblob_save(objId.get(), key_blob, key_blob_length);
+    return 0;
 }
 
-static int tee_import_keypair(const keymaster_device_t* dev,
-        const uint8_t* key, const size_t key_length,
-        uint8_t** key_blob, size_t* key_blob_length) {
-    CK_RV rv;
+/**
+ * Returns the OpenSSL curve of a keymaster_ec_keygen_params_t field size, or
+ * NID_undef if it isn't one of the NIST prime curves.
+ */
+static int ec_curve_nid(const uint32_t fieldSize) {
+    switch (fieldSize) {
+    case 192:
+        return NID_X9_62_prime192v1;
+    case 224:
+        return NID_secp224r1;
+    case 256:
+        return NID_X9_62_prime256v1;
+    case 384:
+        return NID_secp384r1;
+    case 521:
+        return NID_secp521r1;
+    default:
+        return NID_undef;
+    }
+}
+
+/**
+ * Encodes the CKA_EC_PARAMS of a curve, the DER of its named curve OID.
+ */
+static ByteArray* ec_params_for_curve(const int nid) {
+    ASN1_OBJECT* oid = const_cast<ASN1_OBJECT*>(OBJ_nid2obj(nid));
+    if (oid == NULL) {
+        logOpenSSLError("ec_params_for_curve");
+        return NULL;
+    }
+
+    int len = i2d_ASN1_OBJECT(oid, NULL);
+    if (len <= 0) {
+        logOpenSSLError("ec_params_for_curve");
+        return NULL;
+    }
+
+    Unique_ByteArray params(new ByteArray(len));
+    unsigned char* tmp = reinterpret_cast<unsigned char*>(params->get());
+    if (i2d_ASN1_OBJECT(oid, &tmp) != len) {
+        logOpenSSLError("ec_params_for_curve");
+        return NULL;
+    }
+
+    return params.release();
+}
+
+/**
+ * Generates an EC key pair on the given curve as token objects with the given
+ * ID. The handles are returned in publicKey and privateKey.
+ */
+static int generate_ec_keypair(const CryptoSession* session, const int nid, ByteArray* objId,
+        ObjectHandle* publicKey, ObjectHandle* privateKey) {
     CK_BBOOL bTRUE = CK_TRUE;
 
-    if (key == NULL) {
-        ALOGW("provided key is null");
+    CK_MECHANISM mechanism = {
+            CKM_EC_KEY_PAIR_GEN, NULL, 0,
+    };
+
+    Unique_ByteArray ecParams(ec_params_for_curve(nid));
+    if (ecParams.get() == NULL) {
         return -1;
     }
 
-    Unique_PKCS8_PRIV_KEY_INFO pkcs8(d2i_PKCS8_PRIV_KEY_INFO(NULL, &key, key_length));
-    if (pkcs8.get() == NULL) {
-        logOpenSSLError("tee_import_keypair");
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_ID,              objId->get(),     objId->length()},
+            {CKA_TOKEN,           &bTRUE,           sizeof(bTRUE)},
+            {CKA_VERIFY,          &bTRUE,           sizeof(bTRUE)},
+            {CKA_EC_PARAMS,       ecParams->get(),  ecParams->length()},
+    };
+
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+            {CKA_ID,              objId->get(),     objId->length()},
+            {CKA_TOKEN,           &bTRUE,           sizeof(bTRUE)},
+            {CKA_SIGN,            &bTRUE,           sizeof(bTRUE)},
+    };
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+    CK_RV rv = session->check(TEE_TIMED(STAT_GENERATE_KEYPAIR, C_GenerateKeyPair(session->get(),
+            &mechanism,
+            publicKeyTemplate,
+            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            privateKeyTemplate,
+            sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPublicKey,
+            &hPrivateKey)));
+
+    if (rv != CKR_OK) {
+        ALOGE("Generate EC keypair failed: 0x%x", rv);
         return -1;
     }
 
-    /* assign to EVP */
-    Unique_EVP_PKEY pkey(EVP_PKCS82PKEY(pkcs8.get()));
-    if (pkey.get() == NULL) {
-        logOpenSSLError("tee_import_keypair");
+    publicKey->reset(hPublicKey);
+    privateKey->reset(hPrivateKey);
+    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey->get(), privateKey->get());
+
+    return 0;
+}
+
+/** Where the keys generated ahead of time are listed, in keystore's directory. */
+#define KEY_POOL_FILE "/data/misc/keystore/.tuna_keypool"
+
+/** The number of keys generated ahead of time for each kind of key, 0 to stop. */
+#define KEY_POOL_SIZE_PROPERTY "persist.keymaster.pool_size"
+#define KEY_POOL_SIZE_DEFAULT 1
+
+#define KEY_POOL_MAX_KINDS 4
+#define KEY_POOL_MAX_KEYS 8
+
+/** The seconds without any keymaster call before keys are generated. */
+#define KEY_POOL_IDLE_SECONDS 30
+
+/** The seconds between two checks of whether keys can be generated. */
+#define KEY_POOL_POLL_SECONDS 60
+
+#define BATTERY_STATUS_FILE "/sys/class/power_supply/battery/status"
+
+/** keystore asks for 2048 bit keys with the F4 exponent unless told otherwise. */
+#define KEY_POOL_DEFAULT_BITS 2048
+#define KEY_POOL_DEFAULT_EXPONENT 65537
+
+struct PooledKey {
+    uint32_t modulusBits;
+    uint64_t publicExponent;
+    uint8_t id[ID_LENGTH];
+};
+
+/**
+ * The RSA key pairs generated in the background while the device charges and
+ * nobody uses the keymaster, so that generate_keypair only has to hand one out
+ * instead of having the TEE search primes for seconds. The pool is refilled
+ * for each (modulus size, public exponent) asked for since the keymaster was
+ * opened.
+ *
+ * The pooled keys are token objects, their IDs are kept in KEY_POOL_FILE so
+ * that they are not lost when keystore restarts.
+ */
+class KeyPool {
+public:
+    KeyPool(TeeContext* context) :
+            mContext(context), mThreadStarted(false), mStopping(false), mTarget(0),
+            mNumKinds(0), mNumKeys(0) {
+        pthread_mutex_init(&mLock, NULL);
+        pthread_cond_init(&mCond, NULL);
+    }
+
+    ~KeyPool() {
+        if (mThreadStarted) {
+            pthread_mutex_lock(&mLock);
+            mStopping = true;
+            pthread_cond_signal(&mCond);
+            pthread_mutex_unlock(&mLock);
+            pthread_join(mThread, NULL);
+        }
+        pthread_cond_destroy(&mCond);
+        pthread_mutex_destroy(&mLock);
+    }
+
+    int start() {
+        // What is left of an earlier pool is still handed out.
+        pthread_mutex_lock(&mLock);
+        load();
+        pthread_mutex_unlock(&mLock);
+
+        mTarget = property_get_int32(KEY_POOL_SIZE_PROPERTY, KEY_POOL_SIZE_DEFAULT);
+        if (mTarget <= 0) {
+            return 0;
+        }
+
+        want(KEY_POOL_DEFAULT_BITS, KEY_POOL_DEFAULT_EXPONENT);
+
+        if (pthread_create(&mThread, NULL, threadLoop, this) != 0) {
+            ALOGE("Couldn't start the key pool thread");
+            return -1;
+        }
+        mThreadStarted = true;
+        return 0;
+    }
+
+    /**
+     * Takes a pooled key of the given kind and copies its ID to id. It's
+     * only given out once it's off the list in KEY_POOL_FILE.
+     */
+    bool claim(uint32_t modulusBits, uint64_t publicExponent, uint8_t* id) {
+        bool claimed = false;
+
+        pthread_mutex_lock(&mLock);
+        for (size_t i = 0; i < mNumKeys; i++) {
+            if (mKeys[i].modulusBits != modulusBits ||
+                    mKeys[i].publicExponent != publicExponent) {
+                continue;
+            }
+
+            PooledKey key = mKeys[i];
+            mKeys[i] = mKeys[--mNumKeys];
+            if (save()) {
+                mKeys[mNumKeys++] = key;
+                break;
+            }
+            memcpy(id, key.id, ID_LENGTH);
+            claimed = true;
+            break;
+        }
+        pthread_cond_signal(&mCond);
+        pthread_mutex_unlock(&mLock);
+
+        return claimed;
+    }
+
+    /** Keeps keys of the given kind ready from now on. */
+    void want(uint32_t modulusBits, uint64_t publicExponent) {
+        pthread_mutex_lock(&mLock);
+        findKind(modulusBits, publicExponent, true);
+        pthread_cond_signal(&mCond);
+        pthread_mutex_unlock(&mLock);
+    }
+
+private:
+    struct Kind {
+        uint32_t modulusBits;
+        uint64_t publicExponent;
+    };
+
+    static void* threadLoop(void* arg) {
+        static_cast<KeyPool*>(arg)->run();
+        return NULL;
+    }
+
+    void run() {
+        pthread_mutex_lock(&mLock);
+        while (!mStopping) {
+            const Kind* kind = NULL;
+            if (mNumKeys < KEY_POOL_MAX_KEYS) {
+                kind = findMissingKind();
+            }
+
+            if (kind != NULL && mContext->getIdleTime() >= KEY_POOL_IDLE_SECONDS &&
+                    isCharging()) {
+                Kind k = *kind;
+                pthread_mutex_unlock(&mLock);
+                generate(k);
+                pthread_mutex_lock(&mLock);
+                continue;
+            }
+
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += KEY_POOL_POLL_SECONDS;
+            pthread_cond_timedwait(&mCond, &mLock, &ts);
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    /*
+     * Generates a key of the given kind and adds it to the pool, or destroys
+     * it if it can't be listed.
+     */
+    void generate(const Kind& kind) {
+        Unique_ByteArray objId(generate_random_id());
+        if (objId.get() == NULL) {
+            ALOGE("Couldn't generate random key ID");
+            return;
+        }
+
+        CryptoSession session(mContext, true);
+        ObjectHandle publicKey(&session);
+        ObjectHandle privateKey(&session);
+
+        ALOGV("Generating a %u bit key for the pool", kind.modulusBits);
+        if (generate_rsa_keypair(&session, kind.modulusBits, kind.publicExponent, objId.get(),
+                &publicKey, &privateKey)) {
+            return;
+        }
+
+        pthread_mutex_lock(&mLock);
+        PooledKey* key = &mKeys[mNumKeys++];
+        key->modulusBits = kind.modulusBits;
+        key->publicExponent = kind.publicExponent;
+        memcpy(key->id, objId->get(), ID_LENGTH);
+        int err = save();
+        if (err) {
+            mNumKeys--;
+        }
+        pthread_mutex_unlock(&mLock);
+
+        if (err) {
+            session.check(TEE_TIMED(STAT_DESTROY_OBJECT,
+                    C_DestroyObject(session.get(), privateKey.get())));
+            session.check(TEE_TIMED(STAT_DESTROY_OBJECT,
+                    C_DestroyObject(session.get(), publicKey.get())));
+        }
+    }
+
+    static bool isCharging() {
+        char status[16];
+        int fd = open(BATTERY_STATUS_FILE, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        ssize_t len = read(fd, status, sizeof(status) - 1);
+        close(fd);
+        if (len <= 0) {
+            return false;
+        }
+        status[len] = '\0';
+        return !strncmp(status, "Charging", 8) || !strncmp(status, "Full", 4);
+    }
+
+    /* It must be called with the mLock held. */
+    Kind* findKind(uint32_t modulusBits, uint64_t publicExponent, bool add) {
+        for (size_t i = 0; i < mNumKinds; i++) {
+            if (mKinds[i].modulusBits == modulusBits &&
+                    mKinds[i].publicExponent == publicExponent) {
+                return &mKinds[i];
+            }
+        }
+        if (!add || mNumKinds >= KEY_POOL_MAX_KINDS) {
+            return NULL;
+        }
+        Kind* kind = &mKinds[mNumKinds++];
+        kind->modulusBits = modulusBits;
+        kind->publicExponent = publicExponent;
+        return kind;
+    }
+
+    /* It must be called with the mLock held. */
+    const Kind* findMissingKind() const {
+        for (size_t i = 0; i < mNumKinds; i++) {
+            int count = 0;
+            for (size_t j = 0; j < mNumKeys; j++) {
+                if (mKeys[j].modulusBits == mKinds[i].modulusBits &&
+                        mKeys[j].publicExponent == mKinds[i].publicExponent) {
+                    count++;
+                }
+            }
+            if (count < mTarget) {
+                return &mKinds[i];
+            }
+        }
+        return NULL;
+    }
+
+    /* It must be called with the mLock held. */
+    void load() {
+        FILE* file = fopen(KEY_POOL_FILE, "r");
+        if (file == NULL) {
+            return;
+        }
+
+        unsigned int bits;
+        unsigned long long exponent;
+        char hex[ID_LENGTH * 2 + 1];
+        while (mNumKeys < KEY_POOL_MAX_KEYS &&
+                fscanf(file, "%u %llu %64s", &bits, &exponent, hex) == 3) {
+            PooledKey* key = &mKeys[mNumKeys];
+            if (strlen(hex) != ID_LENGTH * 2) {
+                continue;
+            }
+            for (size_t i = 0; i < ID_LENGTH; i++) {
+                unsigned int byte;
+                sscanf(hex + i * 2, "%2x", &byte);
+                key->id[i] = byte;
+            }
+            key->modulusBits = bits;
+            key->publicExponent = exponent;
+            findKind(bits, exponent, true);
+            mNumKeys++;
+        }
+        fclose(file);
+
+        ALOGV("%u keys in the pool", (unsigned int) mNumKeys);
+    }
+
+    /* It must be called with the mLock held. */
+    int save() {
+        FILE* file = fopen(KEY_POOL_FILE ".tmp", "w");
+        if (file == NULL) {
+            ALOGE("Couldn't write %s: %s", KEY_POOL_FILE, strerror(errno));
+            return -1;
+        }
+
+        for (size_t i = 0; i < mNumKeys; i++) {
+            fprintf(file, "%u %llu ", mKeys[i].modulusBits,
+                    (unsigned long long) mKeys[i].publicExponent);
+            for (size_t j = 0; j < ID_LENGTH; j++) {
+                fprintf(file, "%02x", mKeys[i].id[j]);
+            }
+            fputc('\n', file);
+        }
+
+        if (fflush(file) || fsync(fileno(file))) {
+            ALOGE("Couldn't write %s: %s", KEY_POOL_FILE, strerror(errno));
+            fclose(file);
+            return -1;
+        }
+        fclose(file);
+
+        if (rename(KEY_POOL_FILE ".tmp", KEY_POOL_FILE)) {
+            ALOGE("Couldn't write %s: %s", KEY_POOL_FILE, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    TeeContext* mContext;
+
+    pthread_t mThread;
+    bool mThreadStarted;
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    bool mStopping;
+    int mTarget;
+
+    Kind mKinds[KEY_POOL_MAX_KINDS];
+    size_t mNumKinds;
+    PooledKey mKeys[KEY_POOL_MAX_KEYS];
+    size_t mNumKeys;
+};
+
+static int tee_generate_keypair(const keymaster_device_t* dev,
+        const keymaster_keypair_t type, const void* key_params,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    StatTimer timer(STAT_OP_GENERATE);
+
+    if (type != TYPE_RSA && type != TYPE_EC) {
+        ALOGW("Unknown key type %d", type);
         return -1;
     }
 
-    if (EVP_PKEY_type(pkey->type) != EVP_PKEY_RSA) {
-        ALOGE("Unsupported key type: %d", EVP_PKEY_type(pkey->type));
+    if (key_params == NULL) {
+        ALOGW("generate_keypair params were NULL");
         return -1;
     }
 
-    Unique_RSA rsa(EVP_PKEY_get1_RSA(pkey.get()));
-    if (rsa.get() == NULL) {
-        logOpenSSLError("tee_import_keypair");
+    TeeContext* context = reinterpret_cast<TeeContext*>(dev->context);
+
+    if (type == TYPE_EC) {
+        keymaster_ec_keygen_params_t* ec_params = (keymaster_ec_keygen_params_t*) key_params;
+        int nid = ec_curve_nid(ec_params->field_size);
+        if (nid == NID_undef) {
+            ALOGW("Unsupported EC field size %u", ec_params->field_size);
+            return -1;
+        }
+
+        Unique_ByteArray objId(generate_random_id());
+        if (objId.get() == NULL) {
+            ALOGE("Couldn't generate random key ID");
+            return -1;
+        }
+
+        CryptoSession session(context);
+        ObjectHandle publicKey(&session);
+        ObjectHandle privateKey(&session);
+
+        if (generate_ec_keypair(&session, nid, objId.get(), &publicKey, &privateKey)) {
+            return -1;
+        }
+
+        return keyblob_save(objId.get(), TYPE_EC, key_blob, key_blob_length);
+    }
+
+    keymaster_rsa_keygen_params_t* rsa_params = (keymaster_rsa_keygen_params_t*) key_params;
+    KeyPool* keyPool = context->getKeyPool();
+
+    Unique_ByteArray objId(new ByteArray(ID_LENGTH));
+    if (keyPool != NULL && keyPool->claim(rsa_params->modulus_size,
+            rsa_params->public_exponent, objId->get())) {
+        ALOGV("Using a pooled %u bit key", rsa_params->modulus_size);
+        return keyblob_save(objId.get(), TYPE_RSA, key_blob, key_blob_length);
+    }
+    if (keyPool != NULL) {
+        keyPool->want(rsa_params->modulus_size, rsa_params->public_exponent);
+    }
+
+    objId.reset(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
         return -1;
     }
 
-    Unique_ByteArray modulus(bignum_to_array(rsa->n));
-    if (modulus.get() == NULL) {
-        ALOGW("Could not convert modulus to array");
+    CryptoSession session(context);
+    ObjectHandle publicKey(&session);
+    ObjectHandle privateKey(&session);
+
+    if (generate_rsa_keypair(&session, rsa_params->modulus_size, rsa_params->public_exponent,
+            objId.get(), &publicKey, &privateKey)) {
         return -1;
     }
 
-    Unique_ByteArray publicExponent(bignum_to_array(rsa->e));
-    if (publicExponent.get() == NULL) {
-        ALOGW("Could not convert publicExponent to array");
+    return keyblob_save(objId.get(), TYPE_RSA, key_blob, key_blob_length);
+}
+
+/**
+ * Imports an RSA key pair as token objects, and returns its key blob.
+ */
+static int import_rsa_keypair(const CryptoSession* session, EVP_PKEY* pkey,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    CK_RV rv;
+    CK_BBOOL bTRUE = CK_TRUE;
+
+    Unique_RSA rsa(EVP_PKEY_get1_RSA(pkey));
+    if (rsa.get() == NULL) {
+        logOpenSSLError("tee_import_keypair");
         return -1;
     }
 
+    /*
+     * If we have the prime, prime exponents, and coefficient, we can
+     * copy them in.
+     */
+    bool has_extra_data = (rsa->p != NULL) && (rsa->q != NULL) && (rsa->dmp1 != NULL) &&
+            (rsa->dmq1 != NULL) && (rsa->iqmp != NULL);
+
+    BignumArena arena(BignumArena::sizeOf(rsa->n) + BignumArena::sizeOf(rsa->e)
+            + BignumArena::sizeOf(rsa->d)
+            + (has_extra_data ? BignumArena::sizeOf(rsa->p) + BignumArena::sizeOf(rsa->q)
+                    + BignumArena::sizeOf(rsa->dmp1) + BignumArena::sizeOf(rsa->dmq1)
+                    + BignumArena::sizeOf(rsa->iqmp) : 0));
+
     CK_KEY_TYPE rsaType = CKK_RSA;
 
     CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
@@ -468,29 +1661,26 @@ static int tee_import_keypair(const keymaster_device_t* dev,
             {CKA_KEY_TYPE,        &rsaType,              sizeof(rsaType)},
             {CKA_ENCRYPT,         &bTRUE,                sizeof(bTRUE)},
             {CKA_VERIFY,          &bTRUE,                sizeof(bTRUE)},
-            {CKA_MODULUS,         modulus->get(),        modulus->length()},
-            {CKA_PUBLIC_EXPONENT, publicExponent->get(), publicExponent->length()},
+            {CKA_MODULUS,         NULL,                  0},
+            {CKA_PUBLIC_EXPONENT, NULL,                  0},
     };
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    if (arena.append(&publicKeyTemplate[6], CKA_MODULUS, rsa->n)
+            || arena.append(&publicKeyTemplate[7], CKA_PUBLIC_EXPONENT, rsa->e)) {
+        ALOGW("Could not convert the public key");
+        return -1;
+    }
 
     CK_OBJECT_HANDLE hPublicKey;
-    rv = C_CreateObject(session.get(),
+    rv = session->check(TEE_TIMED(STAT_CREATE_OBJECT, C_CreateObject(session->get(),
             publicKeyTemplate,
             sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
-            &hPublicKey);
+            &hPublicKey)));
     if (rv != CKR_OK) {
         ALOGE("Creation of public key failed: 0x%x", rv);
         return -1;
     }
-    ObjectHandle publicKey(&session, hPublicKey);
-
-    Unique_ByteArray privateExponent(bignum_to_array(rsa->d));
-    if (privateExponent.get() == NULL) {
-        ALOGW("Could not convert private exponent");
-        return -1;
-    }
-
+    ObjectHandle publicKey(session, hPublicKey);
 
     /*
      * Normally we need:
@@ -520,15 +1710,7 @@ static int tee_import_keypair(const keymaster_device_t* dev,
      */
 #define PRIV_ATTRIB_EXTENDED_NUM (PRIV_ATTRIB_NORMAL_NUM + 5)
 
-    /*
-     * If we have the prime, prime exponents, and coefficient, we can
-     * copy them in.
-     */
-    bool has_extra_data = (rsa->p != NULL) && (rsa->q != NULL) && (rsa->dmp1 != NULL) &&
-            (rsa->dmq1 != NULL) && (rsa->iqmp != NULL);
-
-    Unique_CK_ATTRIBUTE privateKeyTemplate(new CK_ATTRIBUTE[
-            has_extra_data ? PRIV_ATTRIB_EXTENDED_NUM : PRIV_ATTRIB_NORMAL_NUM]);
+    CK_ATTRIBUTE privateKeyTemplate[PRIV_ATTRIB_EXTENDED_NUM];
 
     CK_OBJECT_CLASS privClass = CKO_PRIVATE_KEY;
 
@@ -542,101 +1724,266 @@ static int tee_import_keypair(const keymaster_device_t* dev,
     set_attribute(&privateKeyTemplate[templateOffset++], CKA_DECRYPT, &bTRUE, sizeof(bTRUE));
     set_attribute(&privateKeyTemplate[templateOffset++], CKA_SIGN, &bTRUE, sizeof(bTRUE));
 
-    set_attribute(&privateKeyTemplate[templateOffset++], CKA_MODULUS, modulus->get(),
-            modulus->length());
-    set_attribute(&privateKeyTemplate[templateOffset++], CKA_PUBLIC_EXPONENT,
-            publicExponent->get(), publicExponent->length());
-    set_attribute(&privateKeyTemplate[templateOffset++], CKA_PRIVATE_EXPONENT,
-            privateExponent->get(), privateExponent->length());
+    // The modulus and public exponent are already in the arena.
+    privateKeyTemplate[templateOffset++] = publicKeyTemplate[6];
+    privateKeyTemplate[templateOffset++] = publicKeyTemplate[7];
+    if (arena.append(&privateKeyTemplate[templateOffset++], CKA_PRIVATE_EXPONENT, rsa->d)) {
+        ALOGW("Could not convert private exponent");
+        return -1;
+    }
 
-    Unique_ByteArray prime1, prime2, exp1, exp2, coeff;
     if (has_extra_data) {
-        prime1.reset(bignum_to_array(rsa->p));
-        if (prime1->get() == NULL) {
-            ALOGW("Could not convert prime1");
+        if (arena.append(&privateKeyTemplate[templateOffset++], CKA_PRIME_1, rsa->p)
+                || arena.append(&privateKeyTemplate[templateOffset++], CKA_PRIME_2, rsa->q)
+                || arena.append(&privateKeyTemplate[templateOffset++], CKA_EXPONENT_1,
+                        rsa->dmp1)
+                || arena.append(&privateKeyTemplate[templateOffset++], CKA_EXPONENT_2,
+                        rsa->dmq1)
+                || arena.append(&privateKeyTemplate[templateOffset++], CKA_COEFFICIENT,
+                        rsa->iqmp)) {
+            ALOGW("Could not convert the CRT values");
             return -1;
         }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_PRIME_1, prime1->get(),
-                prime1->length());
+    }
 
-        prime2.reset(bignum_to_array(rsa->q));
-        if (prime2->get() == NULL) {
-            ALOGW("Could not convert prime2");
-            return -1;
-        }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_PRIME_2, prime2->get(),
-                prime2->length());
+    CK_OBJECT_HANDLE hPrivateKey;
+    rv = session->check(TEE_TIMED(STAT_CREATE_OBJECT, C_CreateObject(session->get(),
+            privateKeyTemplate,
+            templateOffset,
+            &hPrivateKey)));
+    if (rv != CKR_OK) {
+        ALOGE("Creation of private key failed: 0x%x", rv);
+        return -1;
+    }
+    ObjectHandle privateKey(session, hPrivateKey);
 
-        exp1.reset(bignum_to_array(rsa->dmp1));
-        if (exp1->get() == NULL) {
-            ALOGW("Could not convert exponent 1");
-            return -1;
-        }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_EXPONENT_1, exp1->get(),
-                exp1->length());
+    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
-        exp2.reset(bignum_to_array(rsa->dmq1));
-        if (exp2->get() == NULL) {
-            ALOGW("Could not convert exponent 2");
-            return -1;
-        }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_EXPONENT_2, exp2->get(),
-                exp2->length());
+    return keyblob_save(objId.get(), TYPE_RSA, key_blob, key_blob_length);
+}
 
-        coeff.reset(bignum_to_array(rsa->iqmp));
-        if (coeff->get() == NULL) {
-            ALOGW("Could not convert coefficient");
-            return -1;
-        }
-        set_attribute(&privateKeyTemplate[templateOffset++], CKA_COEFFICIENT, coeff->get(),
-                coeff->length());
+/**
+ * Encodes the CKA_EC_POINT of a public key, its uncompressed point wrapped in
+ * a DER OCTET STRING.
+ */
+static ByteArray* ec_point_of_key(const EC_KEY* ec) {
+    const EC_GROUP* group = EC_KEY_get0_group(ec);
+    const EC_POINT* point = EC_KEY_get0_public_key(ec);
+    if (group == NULL || point == NULL) {
+        ALOGW("EC key has no public point");
+        return NULL;
+    }
+
+    size_t pointLength = EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED, NULL,
+            0, NULL);
+    // Even P-521 points only take one more byte of length.
+    if (pointLength == 0 || pointLength > 0xff) {
+        logOpenSSLError("ec_point_of_key");
+        return NULL;
+    }
+
+    const size_t headerLength = pointLength < 0x80 ? 2 : 3;
+    Unique_ByteArray ecPoint(new ByteArray(headerLength + pointLength));
+    CK_BYTE* tmp = ecPoint->get();
+    *tmp++ = V_ASN1_OCTET_STRING;
+    if (headerLength == 3) {
+        *tmp++ = 0x81;
+    }
+    *tmp++ = pointLength;
+
+    if (EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+            reinterpret_cast<unsigned char*>(tmp), pointLength, NULL) != pointLength) {
+        logOpenSSLError("ec_point_of_key");
+        return NULL;
+    }
+
+    return ecPoint.release();
+}
+
+/**
+ * Imports an EC key pair on a named curve as token objects, and returns its
+ * key blob.
+ */
+static int import_ec_keypair(const CryptoSession* session, EVP_PKEY* pkey,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    CK_BBOOL bTRUE = CK_TRUE;
+
+    Unique_EC_KEY ec(EVP_PKEY_get1_EC_KEY(pkey));
+    if (ec.get() == NULL) {
+        logOpenSSLError("tee_import_keypair");
+        return -1;
+    }
+
+    const EC_GROUP* group = EC_KEY_get0_group(ec.get());
+    const BIGNUM* privateValue = EC_KEY_get0_private_key(ec.get());
+    if (group == NULL || privateValue == NULL) {
+        ALOGW("EC key has no curve or private value");
+        return -1;
+    }
+
+    Unique_ByteArray ecParams(ec_params_for_curve(EC_GROUP_get_curve_name(group)));
+    if (ecParams.get() == NULL) {
+        return -1;
+    }
+
+    Unique_ByteArray ecPoint(ec_point_of_key(ec.get()));
+    if (ecPoint.get() == NULL) {
+        return -1;
+    }
+
+    BignumArena arena(BignumArena::sizeOf(privateValue));
+
+    CK_KEY_TYPE ecType = CKK_EC;
+
+    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+    CK_OBJECT_CLASS privClass = CKO_PRIVATE_KEY;
+
+    Unique_ByteArray objId(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
+        return -1;
+    }
+
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_ID,              objId->get(),          objId->length()},
+            {CKA_TOKEN,           &bTRUE,                sizeof(bTRUE)},
+            {CKA_CLASS,           &pubClass,             sizeof(pubClass)},
+            {CKA_KEY_TYPE,        &ecType,               sizeof(ecType)},
+            {CKA_VERIFY,          &bTRUE,                sizeof(bTRUE)},
+            {CKA_EC_PARAMS,       ecParams->get(),       ecParams->length()},
+            {CKA_EC_POINT,        ecPoint->get(),        ecPoint->length()},
+    };
+
+    CK_OBJECT_HANDLE hPublicKey;
+    CK_RV rv = session->check(TEE_TIMED(STAT_CREATE_OBJECT, C_CreateObject(session->get(),
+            publicKeyTemplate,
+            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPublicKey)));
+    if (rv != CKR_OK) {
+        ALOGE("Creation of public key failed: 0x%x", rv);
+        return -1;
+    }
+    ObjectHandle publicKey(session, hPublicKey);
+
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+            {CKA_ID,              objId->get(),          objId->length()},
+            {CKA_TOKEN,           &bTRUE,                sizeof(bTRUE)},
+            {CKA_CLASS,           &privClass,            sizeof(privClass)},
+            {CKA_KEY_TYPE,        &ecType,               sizeof(ecType)},
+            {CKA_SIGN,            &bTRUE,                sizeof(bTRUE)},
+            {CKA_EC_PARAMS,       ecParams->get(),       ecParams->length()},
+            {CKA_VALUE,           NULL,                  0},
+    };
+
+    if (arena.append(&privateKeyTemplate[6], CKA_VALUE, privateValue)) {
+        ALOGW("Could not convert the private value");
+        return -1;
     }
 
     CK_OBJECT_HANDLE hPrivateKey;
-    rv = C_CreateObject(session.get(),
-            privateKeyTemplate.get(),
-            templateOffset,
-            &hPrivateKey);
+    rv = session->check(TEE_TIMED(STAT_CREATE_OBJECT, C_CreateObject(session->get(),
+            privateKeyTemplate,
+            sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPrivateKey)));
     if (rv != CKR_OK) {
         ALOGE("Creation of private key failed: 0x%x", rv);
         return -1;
     }
-    ObjectHandle privateKey(&session, hPrivateKey);
+    ObjectHandle privateKey(session, hPrivateKey);
 
     ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
-    return keyblob_save(objId.get(), key_blob, key_blob_length);
+    return keyblob_save(objId.get(), TYPE_EC, key_blob, key_blob_length);
 }
 
-static int tee_get_keypair_public(const keymaster_device* dev,
-        const uint8_t* key_blob, const size_t key_blob_length,
-        uint8_t** x509_data, size_t* x509_data_length) {
+/**
+ * Imports a PKCS#8 key pair as token objects, and returns its key blob.
+ */
+static int import_keypair(const CryptoSession* session,
+        const uint8_t* key, const size_t key_length,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    if (key == NULL) {
+        ALOGW("provided key is null");
+        return -1;
+    }
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    Unique_PKCS8_PRIV_KEY_INFO pkcs8(d2i_PKCS8_PRIV_KEY_INFO(NULL, &key, key_length));
+    if (pkcs8.get() == NULL) {
+        logOpenSSLError("tee_import_keypair");
+        return -1;
+    }
 
-    ObjectHandle publicKey(&session);
-    ObjectHandle privateKey(&session);
+    /* assign to EVP */
+    Unique_EVP_PKEY pkey(EVP_PKCS82PKEY(pkcs8.get()));
+    if (pkey.get() == NULL) {
+        logOpenSSLError("tee_import_keypair");
+        return -1;
+    }
 
-    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+    switch (EVP_PKEY_type(pkey->type)) {
+    case EVP_PKEY_RSA:
+        return import_rsa_keypair(session, pkey.get(), key_blob, key_blob_length);
+    case EVP_PKEY_EC:
+        return import_ec_keypair(session, pkey.get(), key_blob, key_blob_length);
+    default:
+        ALOGE("Unsupported key type: %d", EVP_PKEY_type(pkey->type));
         return -1;
     }
+}
 
-    if (x509_data == NULL || x509_data_length == NULL) {
-        ALOGW("Provided destination variables were null");
+static int tee_import_keypair(const keymaster_device_t* dev,
+        const uint8_t* key, const size_t key_length,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    StatTimer timer(STAT_OP_IMPORT);
+
+    CryptoSession session(reinterpret_cast<TeeContext*>(dev->context));
+
+    return import_keypair(&session, key, key_length, key_blob, key_blob_length);
+}
+
+/*
+ * See keymaster_tuna_import_keypairs_t in keymaster_tuna.h.
+ */
+extern "C" __attribute__ ((visibility ("default")))
+int keymaster_tuna_import_keypairs(const keymaster_device_t* dev,
+        const uint8_t* const* keys, const size_t* keyLength, const size_t count,
+        uint8_t** keyBlobs, size_t* keyBlobLength) {
+    ALOGV("keymaster_tuna_import_keypairs(%p, %llu keys)", dev, (unsigned long long) count);
+
+    if (keys == NULL || keyLength == NULL || keyBlobs == NULL || keyBlobLength == NULL) {
+        ALOGW("Provided input or output variables were null");
         return -1;
     }
 
+    CryptoSession session(reinterpret_cast<TeeContext*>(dev->context));
+
+    for (size_t i = 0; i < count; i++) {
+        if (import_keypair(&session, keys[i], keyLength[i], &keyBlobs[i],
+                &keyBlobLength[i])) {
+            ALOGW("Importing key %llu failed", (unsigned long long) i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the modulus and the public exponent of a key out of the TEE.
+ */
+static RSA* export_rsa_public_key(const CryptoSession* session, const ObjectHandle* publicKey) {
     CK_ATTRIBUTE attributes[] = {
             {CKA_MODULUS,         NULL, 0},
             {CKA_PUBLIC_EXPONENT, NULL, 0},
     };
 
     // Call first to get the sizes of the values.
-    CK_RV rv = C_GetAttributeValue(session.get(), publicKey.get(), attributes,
-            sizeof(attributes)/sizeof(CK_ATTRIBUTE));
+    CK_RV rv = session->check(TEE_TIMED(STAT_GET_ATTRIBUTE,
+            C_GetAttributeValue(session->get(), publicKey->get(), attributes,
+            sizeof(attributes)/sizeof(CK_ATTRIBUTE))));
     if (rv != CKR_OK) {
         ALOGW("Could not query attribute value sizes: 0x%02x", rv);
-        return -1;
+        return NULL;
     }
 
     ByteArray modulus(new CK_BYTE[attributes[0].ulValueLen], attributes[0].ulValueLen);
@@ -645,11 +1992,12 @@ static int tee_get_keypair_public(const keymaster_device* dev,
     attributes[0].pValue = modulus.get();
     attributes[1].pValue = exponent.get();
 
-    rv = C_GetAttributeValue(session.get(), publicKey.get(), attributes,
-            sizeof(attributes) / sizeof(CK_ATTRIBUTE));
+    rv = session->check(TEE_TIMED(STAT_GET_ATTRIBUTE,
+            C_GetAttributeValue(session->get(), publicKey->get(), attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE))));
     if (rv != CKR_OK) {
         ALOGW("Could not query attribute values: 0x%02x", rv);
-        return -1;
+        return NULL;
     }
 
     ALOGV("modulus is %d, exponent is %d", modulus.length(), exponent.length());
@@ -657,33 +2005,175 @@ static int tee_get_keypair_public(const keymaster_device* dev,
     Unique_RSA rsa(RSA_new());
     if (rsa.get() == NULL) {
         ALOGE("Could not allocate RSA structure");
-        return -1;
+        return NULL;
     }
 
     rsa->n = BN_bin2bn(reinterpret_cast<const unsigned char*>(modulus.get()), modulus.length(),
             NULL);
     if (rsa->n == NULL) {
-        logOpenSSLError("tee_get_keypair_public");
-        return -1;
+        logOpenSSLError("export_public_key");
+        return NULL;
     }
 
     rsa->e = BN_bin2bn(reinterpret_cast<const unsigned char*>(exponent.get()), exponent.length(),
             NULL);
     if (rsa->e == NULL) {
-        logOpenSSLError("tee_get_keypair_public");
-        return -1;
+        logOpenSSLError("export_public_key");
+        return NULL;
     }
 
+    return rsa.release();
+}
+
+/**
+ * Reads the curve and the point of a key out of the TEE.
+ */
+static EC_KEY* export_ec_public_key(const CryptoSession* session, const ObjectHandle* publicKey) {
+    CK_ATTRIBUTE attributes[] = {
+            {CKA_EC_PARAMS, NULL, 0},
+            {CKA_EC_POINT,  NULL, 0},
+    };
+
+    // Call first to get the sizes of the values.
+    CK_RV rv = session->check(TEE_TIMED(STAT_GET_ATTRIBUTE,
+            C_GetAttributeValue(session->get(), publicKey->get(), attributes,
+            sizeof(attributes)/sizeof(CK_ATTRIBUTE))));
+    if (rv != CKR_OK) {
+        ALOGW("Could not query attribute value sizes: 0x%02x", rv);
+        return NULL;
+    }
+
+    ByteArray ecParams(new CK_BYTE[attributes[0].ulValueLen], attributes[0].ulValueLen);
+    ByteArray ecPoint(new CK_BYTE[attributes[1].ulValueLen], attributes[1].ulValueLen);
+
+    attributes[0].pValue = ecParams.get();
+    attributes[1].pValue = ecPoint.get();
+
+    rv = session->check(TEE_TIMED(STAT_GET_ATTRIBUTE,
+            C_GetAttributeValue(session->get(), publicKey->get(), attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE))));
+    if (rv != CKR_OK) {
+        ALOGW("Could not query attribute values: 0x%02x", rv);
+        return NULL;
+    }
+
+    ALOGV("EC params are %d, point is %d", ecParams.length(), ecPoint.length());
+
+    const unsigned char* tmp = reinterpret_cast<const unsigned char*>(ecParams.get());
+    Unique_ASN1_OBJECT oid(d2i_ASN1_OBJECT(NULL, &tmp, ecParams.length()));
+    if (oid.get() == NULL) {
+        logOpenSSLError("export_public_key");
+        return NULL;
+    }
+
+    Unique_EC_KEY ec(EC_KEY_new_by_curve_name(OBJ_obj2nid(oid.get())));
+    if (ec.get() == NULL) {
+        logOpenSSLError("export_public_key");
+        return NULL;
+    }
+
+    /*
+     * The point should come as a DER OCTET STRING, but some tokens leave out
+     * the wrapping: it's only taken off when its length covers the rest.
+     */
+    const unsigned char* point = reinterpret_cast<const unsigned char*>(ecPoint.get());
+    size_t pointLength = ecPoint.length();
+    if (pointLength >= 2 && point[0] == V_ASN1_OCTET_STRING) {
+        if (point[1] == pointLength - 2) {
+            point += 2;
+            pointLength -= 2;
+        } else if (pointLength >= 3 && point[1] == 0x81 && point[2] == pointLength - 3) {
+            point += 3;
+            pointLength -= 3;
+        }
+    }
+
+    const EC_GROUP* group = EC_KEY_get0_group(ec.get());
+    Unique_EC_POINT pubPoint(EC_POINT_new(group));
+    if (pubPoint.get() == NULL
+            || !EC_POINT_oct2point(group, pubPoint.get(), point, pointLength, NULL)
+            || !EC_KEY_set_public_key(ec.get(), pubPoint.get())) {
+        logOpenSSLError("export_public_key");
+        return NULL;
+    }
+
+    return ec.release();
+}
+
+/**
+ * Reads the public key of a key of the given type out of the TEE.
+ */
+static EVP_PKEY* export_public_key(const CryptoSession* session, const ObjectHandle* publicKey,
+        const keymaster_keypair_t type) {
     Unique_EVP_PKEY pkey(EVP_PKEY_new());
     if (pkey.get() == NULL) {
         ALOGE("Could not allocate EVP_PKEY structure");
+        return NULL;
+    }
+
+    if (type == TYPE_EC) {
+        Unique_EC_KEY ec(export_ec_public_key(session, publicKey));
+        if (ec.get() == NULL) {
+            return NULL;
+        }
+        if (EVP_PKEY_set1_EC_KEY(pkey.get(), ec.get()) != 1) {
+            logOpenSSLError("export_public_key");
+            return NULL;
+        }
+    } else {
+        Unique_RSA rsa(export_rsa_public_key(session, publicKey));
+        if (rsa.get() == NULL) {
+            return NULL;
+        }
+        if (EVP_PKEY_set1_RSA(pkey.get(), rsa.get()) != 1) {
+            logOpenSSLError("export_public_key");
+            return NULL;
+        }
+    }
+
+    return pkey.release();
+}
+
+static int tee_get_keypair_public(const keymaster_device* dev,
+        const uint8_t* key_blob, const size_t key_blob_length,
+        uint8_t** x509_data, size_t* x509_data_length) {
+    StatTimer timer(STAT_OP_GET_PUBLIC);
+
+    if (x509_data == NULL || x509_data_length == NULL) {
+        ALOGW("Provided destination variables were null");
         return -1;
     }
-    if (EVP_PKEY_assign_RSA(pkey.get(), rsa.get()) != 1) {
-        logOpenSSLError("tee_get_keypair_public");
+
+    keymaster_keypair_t type;
+    const uint8_t* id = keyblob_id(key_blob, key_blob_length, &type);
+    if (id == NULL) {
         return -1;
     }
-    OWNERSHIP_TRANSFERRED(rsa);
+
+    TeeContext* context = reinterpret_cast<TeeContext*>(dev->context);
+
+    // Keystore asks again each time it builds a certificate for the key.
+    if (context->getPublicKeyDer(id, x509_data, x509_data_length)) {
+        ALOGV("Length of cached x509 data is %llu", (unsigned long long) *x509_data_length);
+        return 0;
+    }
+
+    Unique_EVP_PKEY pkey(context->getPublicKey(id));
+    if (pkey.get() == NULL) {
+        CryptoSession session(context);
+
+        ObjectHandle publicKey(&session);
+        ObjectHandle privateKey(&session);
+
+        if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+            return -1;
+        }
+
+        pkey.reset(export_public_key(&session, &publicKey, type));
+        if (pkey.get() == NULL) {
+            return -1;
+        }
+    }
 
     int len = i2d_PUBKEY(pkey.get(), NULL);
     if (len <= 0) {
@@ -703,6 +2193,8 @@ static int tee_get_keypair_public(const keymaster_device* dev,
         return -1;
     }
 
+    context->addPublicKey(id, pkey.get(), key.get(), len);
+
     ALOGV("Length of x509 data is %d", len);
     *x509_data_length = len;
     *x509_data = key.release();
@@ -712,8 +2204,9 @@ static int tee_get_keypair_public(const keymaster_device* dev,
 
 static int tee_delete_keypair(const keymaster_device* dev,
             const uint8_t* key_blob, const size_t key_blob_length) {
+    StatTimer timer(STAT_OP_DELETE);
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    CryptoSession session(reinterpret_cast<TeeContext*>(dev->context));
 
     ObjectHandle publicKey(&session);
     ObjectHandle privateKey(&session);
@@ -722,15 +2215,20 @@ static int tee_delete_keypair(const keymaster_device* dev,
         return -1;
     }
 
+    // The handles are closed once the ones held here are given back.
+    session.getContext()->forgetKey(keyblob_id(key_blob, key_blob_length));
+
     // Delete the private key.
-    CK_RV rv = C_DestroyObject(session.get(), privateKey.get());
+    CK_RV rv = session.check(TEE_TIMED(STAT_DESTROY_OBJECT,
+                    C_DestroyObject(session.get(), privateKey.get())));
     if (rv != CKR_OK) {
         ALOGW("Could destroy private key object: 0x%02x", rv);
         return -1;
     }
 
     // Delete the public key.
-    rv = C_DestroyObject(session.get(), publicKey.get());
+    rv = session.check(TEE_TIMED(STAT_DESTROY_OBJECT,
+                    C_DestroyObject(session.get(), publicKey.get())));
     if (rv != CKR_OK) {
         ALOGW("Could destroy public key object: 0x%02x", rv);
         return -1;
@@ -739,11 +2237,122 @@ static int tee_delete_keypair(const keymaster_device* dev,
     return 0;
 }
 
+static int check_sign_params(const keymaster_keypair_t type, const void* params) {
+    if (type == TYPE_EC) {
+        keymaster_ec_sign_params_t* sign_params = (keymaster_ec_sign_params_t*) params;
+        if (sign_params->digest_type != DIGEST_NONE) {
+            ALOGW("Cannot handle digest type %d", sign_params->digest_type);
+            return -1;
+        }
+        return 0;
+    }
+
+    keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
+    if (sign_params->digest_type != DIGEST_NONE) {
+        ALOGW("Cannot handle digest type %d", sign_params->digest_type);
+        return -1;
+    } else if (sign_params->padding_type != PADDING_NONE) {
+        ALOGW("Cannot handle padding type %d", sign_params->padding_type);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Signs with CKM_RSA_X_509. On input signatureLength is the size of the
+ * signature buffer, on output the size of the signature.
+ */
+static int sign_raw_rsa(const CryptoSession* session, const ObjectHandle* privateKey,
+        const uint8_t* data, const size_t dataLength, CK_BYTE* signature,
+        CK_ULONG* signatureLength) {
+    CK_MECHANISM rawRsaMechanism = {
+            CKM_RSA_X_509, NULL, 0
+    };
+
+    CK_RV rv = session->check(TEE_TIMED(STAT_SIGN_INIT,
+            C_SignInit(session->get(), &rawRsaMechanism, privateKey->get())));
+    if (rv != CKR_OK) {
+        ALOGV("C_SignInit failed: 0x%x", rv);
+        return -1;
+    }
+
+    rv = session->check(TEE_TIMED(STAT_SIGN,
+            C_Sign(session->get(), data, dataLength, signature, signatureLength)));
+    if (rv != CKR_OK) {
+        ALOGV("C_SignFinal failed: 0x%x", rv);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Signs with CKM_ECDSA, whose r and s come back side by side, and encodes them
+ * as the DER ECDSA-Sig-Value that keystore expects. On input signatureLength
+ * is the size of the signature buffer, on output the size of the signature.
+ */
+static int sign_ecdsa(const CryptoSession* session, const ObjectHandle* privateKey,
+        const uint8_t* data, const size_t dataLength, CK_BYTE* signature,
+        CK_ULONG* signatureLength) {
+    CK_MECHANISM ecdsaMechanism = {
+            CKM_ECDSA, NULL, 0
+    };
+
+    CK_RV rv = session->check(TEE_TIMED(STAT_SIGN_INIT,
+            C_SignInit(session->get(), &ecdsaMechanism, privateKey->get())));
+    if (rv != CKR_OK) {
+        ALOGV("C_SignInit failed: 0x%x", rv);
+        return -1;
+    }
+
+    // Two P-521 values at the most.
+    CK_BYTE rawSignature[2 * 66];
+    CK_ULONG rawSignatureLength = sizeof(rawSignature);
+    rv = session->check(TEE_TIMED(STAT_SIGN,
+            C_Sign(session->get(), data, dataLength, rawSignature, &rawSignatureLength)));
+    if (rv != CKR_OK) {
+        ALOGV("C_SignFinal failed: 0x%x", rv);
+        return -1;
+    }
+    if (rawSignatureLength == 0 || rawSignatureLength % 2 != 0) {
+        ALOGW("ECDSA signature size %llu isn't two values",
+                (unsigned long long) rawSignatureLength);
+        return -1;
+    }
+
+    const size_t valueLength = rawSignatureLength / 2;
+    Unique_ECDSA_SIG sig(ECDSA_SIG_new());
+    if (sig.get() == NULL
+            || BN_bin2bn(rawSignature, valueLength, sig->r) == NULL
+            || BN_bin2bn(rawSignature + valueLength, valueLength, sig->s) == NULL) {
+        logOpenSSLError("tee_sign_data");
+        return -1;
+    }
+
+    int len = i2d_ECDSA_SIG(sig.get(), NULL);
+    if (len <= 0 || CK_ULONG(len) > *signatureLength) {
+        logOpenSSLError("tee_sign_data");
+        return -1;
+    }
+
+    unsigned char* tmp = reinterpret_cast<unsigned char*>(signature);
+    if (i2d_ECDSA_SIG(sig.get(), &tmp) != len) {
+        logOpenSSLError("tee_sign_data");
+        return -1;
+    }
+    *signatureLength = len;
+
+    return 0;
+}
+
 static int tee_sign_data(const keymaster_device_t* dev,
         const void* params,
         const uint8_t* key_blob, const size_t key_blob_length,
         const uint8_t* data, const size_t dataLength,
         uint8_t** signedData, size_t* signedDataLength) {
+    StatTimer timer(STAT_OP_SIGN);
+    TUNA_TRACE_SCOPE("tee_sign_data");
+
     ALOGV("tee_sign_data(%p, %p, %llu, %p, %llu, %p, %p)", dev, key_blob,
             (unsigned long long) key_blob_length, data, (unsigned long long) dataLength, signedData,
             signedDataLength);
@@ -753,41 +2362,32 @@ static int tee_sign_data(const keymaster_device_t* dev,
         return -1;
     }
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
-
-    ObjectHandle publicKey(&session);
-    ObjectHandle privateKey(&session);
-
-    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+    keymaster_keypair_t type;
+    if (keyblob_id(key_blob, key_blob_length, &type) == NULL) {
         return -1;
     }
-    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
-    keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
-    if (sign_params->digest_type != DIGEST_NONE) {
-        ALOGW("Cannot handle digest type %d", sign_params->digest_type);
-        return -1;
-    } else if (sign_params->padding_type != PADDING_NONE) {
-        ALOGW("Cannot handle padding type %d", sign_params->padding_type);
+    if (check_sign_params(type, params)) {
         return -1;
     }
 
-    CK_MECHANISM rawRsaMechanism = {
-            CKM_RSA_X_509, NULL, 0
-    };
+    CryptoSession session(reinterpret_cast<TeeContext*>(dev->context));
 
-    CK_RV rv = C_SignInit(session.get(), &rawRsaMechanism, privateKey.get());
-    if (rv != CKR_OK) {
-        ALOGV("C_SignInit failed: 0x%x", rv);
+    ObjectHandle publicKey(&session);
+    ObjectHandle privateKey(&session);
+
+    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
         return -1;
     }
+    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
     CK_BYTE signature[1024];
     CK_ULONG signatureLength = 1024;
 
-    rv = C_Sign(session.get(), data, dataLength, signature, &signatureLength);
-    if (rv != CKR_OK) {
-        ALOGV("C_SignFinal failed: 0x%x", rv);
+    int err = type == TYPE_EC
+            ? sign_ecdsa(&session, &privateKey, data, dataLength, signature, &signatureLength)
+            : sign_raw_rsa(&session, &privateKey, data, dataLength, signature, &signatureLength);
+    if (err) {
         return -1;
     }
 
@@ -809,11 +2409,140 @@ static int tee_sign_data(const keymaster_device_t* dev,
     return 0;
 }
 
+/*
+ * See keymaster_tuna_sign_data_batch_t in keymaster_tuna.h.
+ */
+extern "C" __attribute__ ((visibility ("default")))
+int keymaster_tuna_sign_data_batch(const keymaster_device_t* dev,
+        const void* params,
+        const uint8_t* key_blob, const size_t key_blob_length,
+        const uint8_t* const* data, const size_t* dataLength, const size_t count,
+        uint8_t* signatures, const size_t signatureLength) {
+    TUNA_TRACE_SCOPE("keymaster_tuna_sign_data_batch");
+    ALOGV("keymaster_tuna_sign_data_batch(%p, %p, %llu, %llu inputs)", dev, key_blob,
+            (unsigned long long) key_blob_length, (unsigned long long) count);
+
+    if (params == NULL) {
+        ALOGW("Signing params were null");
+        return -1;
+    }
+
+    if (data == NULL || dataLength == NULL || signatures == NULL) {
+        ALOGW("Provided input or output variables were null");
+        return -1;
+    }
+
+    // The ECDSA signatures don't all have the same size.
+    keymaster_keypair_t type;
+    if (keyblob_id(key_blob, key_blob_length, &type) == NULL) {
+        return -1;
+    }
+    if (type != TYPE_RSA) {
+        ALOGW("Only RSA keys can sign in batches");
+        return -1;
+    }
+
+    if (check_sign_params(type, params)) {
+        return -1;
+    }
+
+    CryptoSession session(reinterpret_cast<TeeContext*>(dev->context));
+
+    ObjectHandle publicKey(&session);
+    ObjectHandle privateKey(&session);
+
+    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+        return -1;
+    }
+    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
+
+    uint8_t* signature = signatures;
+    for (size_t i = 0; i < count; i++) {
+        CK_ULONG length = signatureLength;
+        if (sign_raw_rsa(&session, &privateKey, data[i], dataLength[i], signature, &length)) {
+            ALOGW("Signing input %llu failed", (unsigned long long) i);
+            return -1;
+        }
+        if (length != signatureLength) {
+            ALOGW("Signature size %llu doesn't match the expected %llu",
+                    (unsigned long long) length, (unsigned long long) signatureLength);
+            return -1;
+        }
+        signature += signatureLength;
+    }
+
+    return 0;
+}
+
+/**
+ * Does the raw RSA public operation of CKM_RSA_X_509 in the normal world: the
+ * signature raised to the public exponent has to give back the signed data,
+ * left padded with zeroes to the size of the modulus.
+ */
+static int verify_raw_rsa(RSA* rsa, const uint8_t* signedData, const size_t signedDataLength,
+        const uint8_t* signature, const size_t signatureLength) {
+    const size_t modulusLength = RSA_size(rsa);
+    if (signatureLength != modulusLength || signedDataLength > modulusLength) {
+        ALOGV("Signature size %llu or data size %llu don't match the key size %llu",
+                (unsigned long long) signatureLength, (unsigned long long) signedDataLength,
+                (unsigned long long) modulusLength);
+        return -1;
+    }
+
+    UniquePtr<uint8_t[]> recovered(new uint8_t[modulusLength]);
+    if (recovered.get() == NULL) {
+        ALOGE("Couldn't allocate memory to verify signature");
+        return -1;
+    }
+
+    int len = TEE_TIMED(STAT_VERIFY_RSA, RSA_public_decrypt(signatureLength, signature,
+            recovered.get(), rsa, RSA_NO_PADDING));
+    if (len != int(modulusLength)) {
+        logOpenSSLError("tee_verify_data");
+        return -1;
+    }
+
+    const size_t padding = modulusLength - signedDataLength;
+    for (size_t i = 0; i < padding; i++) {
+        if (recovered[i] != 0) {
+            ALOGV("Signature doesn't match the data");
+            return -1;
+        }
+    }
+    if (memcmp(recovered.get() + padding, signedData, signedDataLength) != 0) {
+        ALOGV("Signature doesn't match the data");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Verifies a DER ECDSA signature in the normal world.
+ */
+static int verify_ecdsa(EC_KEY* ec, const uint8_t* signedData, const size_t signedDataLength,
+        const uint8_t* signature, const size_t signatureLength) {
+    int result = TEE_TIMED(STAT_VERIFY_EC, ECDSA_verify(0, signedData, signedDataLength,
+            signature, signatureLength, ec));
+    if (result != 1) {
+        if (result < 0) {
+            logOpenSSLError("tee_verify_data");
+        } else {
+            ALOGV("Signature doesn't match the data");
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
 static int tee_verify_data(const keymaster_device_t* dev,
         const void* params,
         const uint8_t* keyBlob, const size_t keyBlobLength,
         const uint8_t* signedData, const size_t signedDataLength,
         const uint8_t* signature, const size_t signatureLength) {
+    StatTimer timer(STAT_OP_VERIFY);
+
     ALOGV("tee_verify_data(%p, %p, %llu, %p, %llu, %p, %llu)", dev, keyBlob,
             (unsigned long long) keyBlobLength, signedData, (unsigned long long) signedDataLength,
             signature, (unsigned long long) signatureLength);
@@ -823,60 +2552,147 @@ static int tee_verify_data(const keymaster_device_t* dev,
         return -1;
     }
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
-
-    ObjectHandle publicKey(&session);
-    ObjectHandle privateKey(&session);
-
-    if (keyblob_restore(&session, keyBlob, keyBlobLength, &publicKey, &privateKey)) {
+    keymaster_keypair_t type;
+    const uint8_t* id = keyblob_id(keyBlob, keyBlobLength, &type);
+    if (id == NULL) {
         return -1;
     }
-    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
-    keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
-    if (sign_params->digest_type != DIGEST_NONE) {
-        ALOGW("Cannot handle digest type %d", sign_params->digest_type);
-        return -1;
-    } else if (sign_params->padding_type != PADDING_NONE) {
-        ALOGW("Cannot handle padding type %d", sign_params->padding_type);
+    if (check_sign_params(type, params)) {
         return -1;
     }
 
-    CK_MECHANISM rawRsaMechanism = {
-            CKM_RSA_X_509, NULL, 0
-    };
+    TeeContext* context = reinterpret_cast<TeeContext*>(dev->context);
 
-    CK_RV rv = C_VerifyInit(session.get(), &rawRsaMechanism, publicKey.get());
-    if (rv != CKR_OK) {
-        ALOGV("C_VerifyInit failed: 0x%x", rv);
-        return -1;
+    // Only the first verification with a key has to go to the TEE, for its public key.
+    Unique_EVP_PKEY pkey(context->getPublicKey(id));
+    if (pkey.get() == NULL) {
+        CryptoSession session(context);
+
+        ObjectHandle publicKey(&session);
+        ObjectHandle privateKey(&session);
+
+        if (keyblob_restore(&session, keyBlob, keyBlobLength, &publicKey, &privateKey)) {
+            return -1;
+        }
+        ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
+
+        pkey.reset(export_public_key(&session, &publicKey, type));
+        if (pkey.get() == NULL) {
+            return -1;
+        }
+        context->addPublicKey(id, pkey.get(), NULL, 0);
     }
 
-    // This is a bad prototype for this function. C_Verify should have only const args.
-    rv = C_Verify(session.get(), signedData, signedDataLength,
-            const_cast<unsigned char*>(signature), signatureLength);
-    if (rv != CKR_OK) {
-        ALOGV("C_Verify failed: 0x%x", rv);
+    if (type == TYPE_EC) {
+        Unique_EC_KEY ec(EVP_PKEY_get1_EC_KEY(pkey.get()));
+        if (ec.get() == NULL) {
+            logOpenSSLError("tee_verify_data");
+            return -1;
+        }
+        return verify_ecdsa(ec.get(), signedData, signedDataLength, signature,
+                signatureLength);
+    }
+
+    Unique_RSA rsa(EVP_PKEY_get1_RSA(pkey.get()));
+    if (rsa.get() == NULL) {
+        logOpenSSLError("tee_verify_data");
         return -1;
     }
+    return verify_raw_rsa(rsa.get(), signedData, signedDataLength, signature, signatureLength);
+}
+
+/*
+ * See keymaster_tuna_dump_t in keymaster_tuna.h.
+ */
+extern "C" __attribute__ ((visibility ("default")))
+int keymaster_tuna_dump(const keymaster_device_t* dev __attribute__((unused)), int fd) {
+    dprintf(fd, "Keymaster latency, per <128us/256us/.../2s/more:\n");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        const LatencyStat* stat = &sStats[i];
+        uint32_t count = stat->count.load(std::memory_order_relaxed);
+        if (count == 0) {
+            continue;
+        }
+
+        char hist[LATENCY_BUCKETS * 11 + 1];
+        size_t len = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            len += snprintf(hist + len, sizeof(hist) - len, " %u",
+                    stat->buckets[b].load(std::memory_order_relaxed));
+        }
+
+        dprintf(fd, "  %s: %u calls, avg %llu us, max %u us,%s\n", sStatNames[i], count,
+                (unsigned long long) (stat->totalUs.load(std::memory_order_relaxed) / count),
+                stat->maxUs.load(std::memory_order_relaxed), hist);
+    }
 
     return 0;
 }
 
+/*
+ * C_Initialize and C_Finalize are per process, so they are counted for the
+ * devices opened from the module.
+ */
+static pthread_mutex_t sTeeLock = PTHREAD_MUTEX_INITIALIZER;
+static int sTeeUsers;
+
+static CK_RV tee_initialize() {
+    CK_RV rv = CKR_OK;
+
+    pthread_mutex_lock(&sTeeLock);
+    if (sTeeUsers == 0) {
+        rv = C_Initialize(NULL);
+    }
+    if (rv == CKR_OK) {
+        sTeeUsers++;
+    }
+    pthread_mutex_unlock(&sTeeLock);
+
+    return rv;
+}
+
+static void tee_finalize() {
+    pthread_mutex_lock(&sTeeLock);
+    if (--sTeeUsers == 0) {
+        CK_RV finalizeRV = C_Finalize(NULL_PTR);
+        if (finalizeRV != CKR_OK) {
+            ALOGE("Error closing the TEE");
+        }
+    }
+    pthread_mutex_unlock(&sTeeLock);
+}
+
+/**
+ * Whether the TEE generates and signs with EC keys. Without it keystore
+ * keeps the EC keys in its software keymaster.
+ */
+static bool tee_supports_ec() {
+    static const CK_MECHANISM_TYPE mechanisms[] = {
+            CKM_EC_KEY_PAIR_GEN, CKM_ECDSA,
+    };
+
+    for (size_t i = 0; i < sizeof(mechanisms) / sizeof(mechanisms[0]); i++) {
+        CK_MECHANISM_INFO info;
+        CK_RV rv = C_GetMechanismInfo(CKV_TOKEN_USER, mechanisms[i], &info);
+        if (rv != CKR_OK) {
+            ALOGI("TEE lacks EC mechanism 0x%lx: 0x%x", (unsigned long) mechanisms[i], rv);
+            return false;
+        }
+    }
+    return true;
+}
+
 /* Close an opened OpenSSL instance */
 static int tee_close(hw_device_t *dev) {
     keymaster_device_t *keymaster_dev = (keymaster_device_t *) dev;
     if (keymaster_dev != NULL) {
-        CK_SESSION_HANDLE handle = reinterpret_cast<CK_SESSION_HANDLE>(keymaster_dev->context);
-        if (handle != CK_INVALID_HANDLE) {
-            C_CloseSession(handle);
-        }
+        TeeContext* context = reinterpret_cast<TeeContext*>(keymaster_dev->context);
+        delete context->getKeyPool();
+        delete context;
     }
 
-    CK_RV finalizeRV = C_Finalize(NULL_PTR);
-    if (finalizeRV != CKR_OK) {
-        ALOGE("Error closing the TEE");
-    }
+    tee_finalize();
     free(dev);
 
     return 0;
@@ -908,16 +2724,20 @@ static int tee_open(const hw_module_t* module, const char* name,
     dev->verify_data = tee_verify_data;
     dev->delete_all = NULL;
 
-    CK_RV initializeRV = C_Initialize(NULL);
+    struct tuna_boot_profile profile;
+    tuna_boot_profile_begin(&profile, "keymaster");
+
+    CK_RV initializeRV = tee_initialize();
     if (initializeRV != CKR_OK) {
         ALOGE("Error initializing TEE: 0x%x", initializeRV);
         return -ENODEV;
     }
+    tuna_boot_profile_phase(&profile, "C_Initialize");
 
     CK_INFO info;
     CK_RV infoRV = C_GetInfo(&info);
     if (infoRV != CKR_OK) {
-        (void) C_Finalize(NULL_PTR);
+        tee_finalize();
         ALOGE("Error getting information about TEE during initialization: 0x%x", infoRV);
         return -ENODEV;
     }
@@ -927,24 +2747,56 @@ static int tee_open(const hw_module_t* module, const char* name,
            info.manufacturerID, info.flags, info.libraryDescription,
            info.libraryVersion.major, info.libraryVersion.minor);
 
-    CK_SESSION_HANDLE sessionHandle = CK_INVALID_HANDLE;
+    if (tee_supports_ec()) {
+        dev->flags |= KEYMASTER_SUPPORTS_EC;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_CONF);
+    size_t wanted = cores < 1 ? 1 : cores > MAX_PRIMARY_SESSIONS ? MAX_PRIMARY_SESSIONS : cores;
+
+    CK_SESSION_HANDLE sessionHandles[MAX_PRIMARY_SESSIONS];
+    size_t numSessions = 0;
+
+    while (numSessions < wanted) {
+        CK_SESSION_HANDLE sessionHandle = CK_INVALID_HANDLE;
+
+        CK_RV openSessionRV = C_OpenSession(CKV_TOKEN_USER,
+                CKF_SERIAL_SESSION | CKF_RW_SESSION,
+                NULL,
+                NULL,
+                &sessionHandle);
 
-    CK_RV openSessionRV = C_OpenSession(CKV_TOKEN_USER,
-            CKF_SERIAL_SESSION | CKF_RW_SESSION,
-            NULL,
-            NULL,
-            &sessionHandle);
+        if (openSessionRV != CKR_OK || sessionHandle == CK_INVALID_HANDLE) {
+            ALOGE("Error opening primary session with TEE: 0x%x", openSessionRV);
+            break;
+        }
+        sessionHandles[numSessions++] = sessionHandle;
+    }
 
-    if (openSessionRV != CKR_OK || sessionHandle == CK_INVALID_HANDLE) {
-        (void) C_Finalize(NULL_PTR);
-        ALOGE("Error opening primary session with TEE: 0x%x", openSessionRV);
+    // The first one is needed, the others only spread the load.
+    if (numSessions == 0) {
+        tee_finalize();
         return -1;
     }
+    ALOGV("Opened %u primary sessions", (unsigned int) numSessions);
+    tuna_boot_profile_phase(&profile, "sessions");
 
-    ERR_load_crypto_strings();
-    ERR_load_BIO_strings();
+    if (!tuna_deferred_init()) {
+        pthread_once(&sErrorStringsOnce, loadErrorStrings);
+        tuna_boot_profile_phase(&profile, "error_strings");
+    }
+
+    TeeContext* context = new TeeContext(sessionHandles, numSessions);
+    KeyPool* keyPool = new KeyPool(context);
+    if (keyPool->start() == 0) {
+        context->setKeyPool(keyPool);
+    } else {
+        delete keyPool;
+    }
+    tuna_boot_profile_phase(&profile, "key_pool");
+    tuna_boot_profile_end(&profile);
 
-    dev->context = reinterpret_cast<void*>(sessionHandle);
+    dev->context = reinterpret_cast<void*>(context);
     *device = reinterpret_cast<hw_device_t*>(dev.release());
 
     return 0;
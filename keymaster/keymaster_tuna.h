@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KEYMASTER_TUNA_H
+#define KEYMASTER_TUNA_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/keymaster0.h>
+
+__BEGIN_DECLS
+
+/**
+ * Extensions of keystore.tuna beyond the keymaster0 API. They take a device
+ * opened from the module and are looked up with dlsym() on the handle that
+ * hw_get_module() keeps in the module's dso.
+ */
+
+#define KEYMASTER_TUNA_SIGN_DATA_BATCH "keymaster_tuna_sign_data_batch"
+
+/**
+ * Signs count inputs with one key, like as many sign_data calls but with the
+ * key restored once for all of them. The signature of data[i] is written to
+ * signatures + i * signature_length, where signature_length is the size of
+ * the key's modulus. Only RSA keys are taken, since the size of ECDSA
+ * signatures varies.
+ *
+ * Returns 0 on success, or -1 with the signatures before the failed input
+ * already written.
+ */
+typedef int (*keymaster_tuna_sign_data_batch_t)(const struct keymaster0_device* dev,
+        const void* signing_params,
+        const uint8_t* key_blob, const size_t key_blob_length,
+        const uint8_t* const* data, const size_t* data_length, const size_t count,
+        uint8_t* signatures, const size_t signature_length);
+
+#define KEYMASTER_TUNA_IMPORT_KEYPAIRS "keymaster_tuna_import_keypairs"
+
+/**
+ * Imports count PKCS#8 key pairs, like as many import_keypair calls but in
+ * one TEE session. The blob of keys[i] is returned in key_blobs[i], to be
+ * freed by the caller.
+ *
+ * Returns 0 on success, or -1 with the blobs of the keys before the failed one
+ * already returned.
+ */
+typedef int (*keymaster_tuna_import_keypairs_t)(const struct keymaster0_device* dev,
+        const uint8_t* const* keys, const size_t* key_length, const size_t count,
+        uint8_t** key_blobs, size_t* key_blob_length);
+
+#define KEYMASTER_TUNA_DUMP "keymaster_tuna_dump"
+
+/**
+ * Writes to fd the latency histograms of the keymaster operations, and of the
+ * TEE calls they made, since the module was loaded.
+ */
+typedef int (*keymaster_tuna_dump_t)(const struct keymaster0_device* dev, int fd);
+
+__END_DECLS
+
+#endif  // KEYMASTER_TUNA_H
@@ -25,4 +25,8 @@ LOCAL_SHARED_LIBRARIES := \
 LOCAL_MODULE := gps.$(TARGET_BOOTLOADER_BOARD_NAME)
 LOCAL_MODULE_RELATIVE_PATH := hw
 
+ifeq ($(GPS_SHIM_VERBOSE),true)
+	LOCAL_CFLAGS += -DGPS_SHIM_VERBOSE
+endif
+
 include $(BUILD_SHARED_LIBRARY)
@@ -20,25 +20,44 @@
 
 #include <dlfcn.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "gps.h"
 #define REAL_GPS_PATH "/vendor/lib/hw/gps.omap4.so"
 
+/*
+ * Tracing of the calls that keep coming once the HAL is up, built in only
+ * with GPS_SHIM_VERBOSE so that the others don't even format the arguments.
+ */
+#ifdef GPS_SHIM_VERBOSE
+#define SHIM_LOGD(...) ALOGD(__VA_ARGS__)
+#else
+#define SHIM_LOGD(...) do { } while (0)
+#endif
+
 const GpsInterface* (*vendor_get_gps_interface)(struct gps_device_t* dev);
 const void* (*vendor_get_extension)(const char* name);
 int (*vendor_init)(GpsCallbacks* gpsCallbacks);
+gps_location_callback framework_location_cb;
 void (*vendor_set_ref_location)(const AGpsRefLocationNoLTE *agps_reflocation, size_t sz_struct);
 
+// the vendor's RIL interface, once its ref_location callback is shimmed, and
+// the name it was asked for with; callers pass the same string every time
+static AGpsRilInterface *shim_ril;
+static const char *shim_ril_name;
+
 void shim_set_ref_location(AGpsRefLocation *agps_reflocation, size_t sz_struct) {
 	AGpsRefLocationNoLTE vendor_ref;
 	if (sizeof(AGpsRefLocationNoLTE) > sz_struct) {
 		ALOGE("%s: AGpsRefLocation is too small, bailing out!", __func__);
 		return;
 	}
-	ALOGD("%s: shimming AGpsRefLocation", __func__);
+	SHIM_LOGD("%s: shimming AGpsRefLocation", __func__);
 	vendor_ref.type = agps_reflocation->type;
 	vendor_ref.u.cellID.type = agps_reflocation->u.cellID.type;
 	vendor_ref.u.cellID.mcc = agps_reflocation->u.cellID.mcc;
@@ -46,19 +65,19 @@ void shim_set_ref_location(AGpsRefLocation *agps_reflocation, size_t sz_struct)
 	vendor_ref.u.cellID.lac = agps_reflocation->u.cellID.lac;
 	vendor_ref.u.cellID.cid = agps_reflocation->u.cellID.cid;
 	vendor_ref.u.mac = agps_reflocation->u.mac;
-	ALOGD("%s: Size of AGpsRefLocation              : %d", __func__, sizeof(AGpsRefLocation));
-	ALOGD("%s: Size of vendor's AGpsRefLocationNoLTE: %d", __func__, sizeof(AGpsRefLocationNoLTE));
+	SHIM_LOGD("%s: Size of AGpsRefLocation              : %zu", __func__, sizeof(AGpsRefLocation));
+	SHIM_LOGD("%s: Size of vendor's AGpsRefLocationNoLTE: %zu", __func__, sizeof(AGpsRefLocationNoLTE));
 
 	vendor_set_ref_location(&vendor_ref, sizeof(AGpsRefLocationNoLTE));
-	ALOGD("%s: Executed vendor's set_ref_location with following parameters:", __func__);
-	ALOGD("%s: type          : %d => %d", __func__, agps_reflocation->type, vendor_ref.type);
-	ALOGD("%s: cellID.u.type : %d => %d", __func__, agps_reflocation->u.cellID.type, vendor_ref.u.cellID.type);
-	ALOGD("%s: cellID.u.mcc  : %d => %d", __func__, agps_reflocation->u.cellID.mcc, vendor_ref.u.cellID.mcc);
-	ALOGD("%s: cellID.u.mnc  : %d => %d", __func__, agps_reflocation->u.cellID.mnc, vendor_ref.u.cellID.mnc);
-	ALOGD("%s: cellID.u.cid  : %d => %d", __func__, agps_reflocation->u.cellID.cid, vendor_ref.u.cellID.cid);
-	ALOGD("%s: cellID.u.tac  : %d => NOT SUPPORTED", __func__, agps_reflocation->u.cellID.tac);
-	ALOGD("%s: cellID.u.pcid : %d => NOT SUPPORTED", __func__, agps_reflocation->u.cellID.pcid);
-	ALOGD("%s: u.mac         : %d => %d", __func__, agps_reflocation->u.mac, vendor_ref.u.mac);
+	SHIM_LOGD("%s: Executed vendor's set_ref_location with following parameters:", __func__);
+	SHIM_LOGD("%s: type          : %d => %d", __func__, agps_reflocation->type, vendor_ref.type);
+	SHIM_LOGD("%s: cellID.u.type : %d => %d", __func__, agps_reflocation->u.cellID.type, vendor_ref.u.cellID.type);
+	SHIM_LOGD("%s: cellID.u.mcc  : %d => %d", __func__, agps_reflocation->u.cellID.mcc, vendor_ref.u.cellID.mcc);
+	SHIM_LOGD("%s: cellID.u.mnc  : %d => %d", __func__, agps_reflocation->u.cellID.mnc, vendor_ref.u.cellID.mnc);
+	SHIM_LOGD("%s: cellID.u.cid  : %d => %d", __func__, agps_reflocation->u.cellID.cid, vendor_ref.u.cellID.cid);
+	SHIM_LOGD("%s: cellID.u.tac  : %d => NOT SUPPORTED", __func__, agps_reflocation->u.cellID.tac);
+	SHIM_LOGD("%s: cellID.u.pcid : %d => NOT SUPPORTED", __func__, agps_reflocation->u.cellID.pcid);
+	SHIM_LOGD("%s: u.mac         : %d => %d", __func__, agps_reflocation->u.mac, vendor_ref.u.mac);
 
 	agps_reflocation->type = vendor_ref.type;
 	agps_reflocation->u.cellID.type = vendor_ref.u.cellID.type;
@@ -69,16 +88,331 @@ void shim_set_ref_location(AGpsRefLocation *agps_reflocation, size_t sz_struct)
 	agps_reflocation->u.mac = vendor_ref.u.mac;
 }
 
+/*
+ * The fixes from the vendor HAL go through shim_location_cb, which runs on
+ * the vendor's callback thread. There it moves the software geofences and
+ * either batches the fix or passes it on to the framework. shim_lock guards
+ * both, the callbacks are made after it is released.
+ */
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_GEOFENCES 32
+
+static const double EARTH_RADIUS_M = 6371009.0;
+
+typedef struct {
+	int used;
+	int paused;
+	int32_t id;
+	double latitude;
+	double longitude;
+	double radius;
+	int last_transition;
+	int monitor_transitions;
+} Geofence;
+
+static GpsGeofenceCallbacks *geofence_callbacks;
+static Geofence geofences[MAX_GEOFENCES];
+static int geofence_available;
+
+static struct {
+	gps_tuna_batch_callback batch_cb;
+	uint64_t interval_ns;
+	uint64_t last_delivery_ns;
+	GpsLocation ring[GPS_TUNA_BATCH_SIZE];
+	size_t head;
+	size_t count;
+} batch;
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double distance_m(double lat1, double lon1, double lat2, double lon2) {
+	double dlat = (lat2 - lat1) * M_PI / 180.0;
+	double dlon = (lon2 - lon1) * M_PI / 180.0;
+	double a = sin(dlat / 2) * sin(dlat / 2) +
+			cos(lat1 * M_PI / 180.0) * cos(lat2 * M_PI / 180.0) *
+			sin(dlon / 2) * sin(dlon / 2);
+	return 2 * EARTH_RADIUS_M * atan2(sqrt(a), sqrt(1 - a));
+}
+
+/* Returns the index of the geofence id, or -1. It must be called with the
+ * shim_lock held. */
+static int find_geofence(int32_t id) {
+	int i;
+	for (i = 0; i < MAX_GEOFENCES; i++) {
+		if (geofences[i].used && geofences[i].id == id)
+			return i;
+	}
+	return -1;
+}
+
+static void shim_geofence_init(GpsGeofenceCallbacks* callbacks) {
+	pthread_mutex_lock(&shim_lock);
+	geofence_callbacks = callbacks;
+	memset(geofences, 0, sizeof(geofences));
+	geofence_available = 0;
+	pthread_mutex_unlock(&shim_lock);
+}
+
+static void shim_add_geofence_area(int32_t geofence_id, double latitude,
+		double longitude, double radius_meters, int last_transition,
+		int monitor_transitions, int notification_responsiveness_ms __unused,
+		int unknown_timer_ms __unused) {
+	int status = GPS_GEOFENCE_OPERATION_SUCCESS;
+	int i;
+
+	pthread_mutex_lock(&shim_lock);
+	if (find_geofence(geofence_id) >= 0) {
+		status = GPS_GEOFENCE_ERROR_ID_EXISTS;
+	} else if (monitor_transitions & ~(GPS_GEOFENCE_ENTERED |
+			GPS_GEOFENCE_EXITED | GPS_GEOFENCE_UNCERTAIN)) {
+		status = GPS_GEOFENCE_ERROR_INVALID_TRANSITION;
+	} else {
+		for (i = 0; i < MAX_GEOFENCES && geofences[i].used; i++)
+			;
+		if (i == MAX_GEOFENCES) {
+			status = GPS_GEOFENCE_ERROR_TOO_MANY_GEOFENCES;
+		} else {
+			Geofence *g = &geofences[i];
+			memset(g, 0, sizeof(*g));
+			g->used = 1;
+			g->id = geofence_id;
+			g->latitude = latitude;
+			g->longitude = longitude;
+			g->radius = radius_meters;
+			g->last_transition = last_transition;
+			g->monitor_transitions = monitor_transitions;
+		}
+	}
+	pthread_mutex_unlock(&shim_lock);
+
+	if (geofence_callbacks)
+		geofence_callbacks->geofence_add_callback(geofence_id, status);
+}
+
+static void shim_pause_geofence(int32_t geofence_id) {
+	pthread_mutex_lock(&shim_lock);
+	int i = find_geofence(geofence_id);
+	if (i >= 0)
+		geofences[i].paused = 1;
+	pthread_mutex_unlock(&shim_lock);
+
+	if (geofence_callbacks)
+		geofence_callbacks->geofence_pause_callback(geofence_id, i >= 0 ?
+				GPS_GEOFENCE_OPERATION_SUCCESS : GPS_GEOFENCE_ERROR_ID_UNKNOWN);
+}
+
+static void shim_resume_geofence(int32_t geofence_id, int monitor_transitions) {
+	pthread_mutex_lock(&shim_lock);
+	int i = find_geofence(geofence_id);
+	if (i >= 0) {
+		geofences[i].paused = 0;
+		geofences[i].monitor_transitions = monitor_transitions;
+	}
+	pthread_mutex_unlock(&shim_lock);
+
+	if (geofence_callbacks)
+		geofence_callbacks->geofence_resume_callback(geofence_id, i >= 0 ?
+				GPS_GEOFENCE_OPERATION_SUCCESS : GPS_GEOFENCE_ERROR_ID_UNKNOWN);
+}
+
+static void shim_remove_geofence_area(int32_t geofence_id) {
+	pthread_mutex_lock(&shim_lock);
+	int i = find_geofence(geofence_id);
+	if (i >= 0)
+		geofences[i].used = 0;
+	pthread_mutex_unlock(&shim_lock);
+
+	if (geofence_callbacks)
+		geofence_callbacks->geofence_remove_callback(geofence_id, i >= 0 ?
+				GPS_GEOFENCE_OPERATION_SUCCESS : GPS_GEOFENCE_ERROR_ID_UNKNOWN);
+}
+
+/*
+ * Geofences evaluated on the fixes of the GPS, for a vendor HAL without its
+ * own. A fix is only inside or outside a geofence when its accuracy circle
+ * is, so that the noise at the border doesn't make transitions.
+ */
+static GpsGeofencingInterface shim_geofencing = {
+	.size = sizeof(GpsGeofencingInterface),
+	.init = shim_geofence_init,
+	.add_geofence_area = shim_add_geofence_area,
+	.pause_geofence = shim_pause_geofence,
+	.resume_geofence = shim_resume_geofence,
+	.remove_geofence_area = shim_remove_geofence_area,
+};
+
+/* Fills transitions with the geofences location moved in or out of, and
+ * returns how many. It must be called with the shim_lock held. */
+static int update_geofences(const GpsLocation* location, int32_t* ids,
+		int32_t* transitions) {
+	double accuracy = (location->flags & GPS_LOCATION_HAS_ACCURACY) ?
+			location->accuracy : 0;
+	int n = 0;
+	int i;
+
+	for (i = 0; i < MAX_GEOFENCES; i++) {
+		Geofence *g = &geofences[i];
+		if (!g->used || g->paused)
+			continue;
+
+		double d = distance_m(location->latitude, location->longitude,
+				g->latitude, g->longitude);
+		int transition;
+		if (d + accuracy <= g->radius)
+			transition = GPS_GEOFENCE_ENTERED;
+		else if (d - accuracy > g->radius)
+			transition = GPS_GEOFENCE_EXITED;
+		else
+			continue;
+
+		if (transition != g->last_transition &&
+				(g->monitor_transitions & transition)) {
+			ids[n] = g->id;
+			transitions[n] = transition;
+			n++;
+		}
+		g->last_transition = transition;
+	}
+	return n;
+}
+
+/* Moves the batched fixes to out, oldest first, and returns how many. It must
+ * be called with the shim_lock held. */
+static size_t take_batch(GpsLocation* out) {
+	size_t first = (batch.head + GPS_TUNA_BATCH_SIZE - batch.count) % GPS_TUNA_BATCH_SIZE;
+	size_t n = batch.count;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = batch.ring[(first + i) % GPS_TUNA_BATCH_SIZE];
+	batch.count = 0;
+	batch.last_delivery_ns = monotonic_ns();
+	return n;
+}
+
+static void shim_location_cb(GpsLocation* location) {
+	int32_t ids[MAX_GEOFENCES], transitions[MAX_GEOFENCES];
+	GpsLocation out[GPS_TUNA_BATCH_SIZE];
+	gps_tuna_batch_callback batch_cb = NULL;
+	size_t batched = 0;
+	int batching;
+	int num_transitions = 0;
+	int now_available = 0;
+	int i;
+
+	pthread_mutex_lock(&shim_lock);
+	if (geofence_callbacks && (location->flags & GPS_LOCATION_HAS_LAT_LONG)) {
+		num_transitions = update_geofences(location, ids, transitions);
+		now_available = !geofence_available;
+		geofence_available = 1;
+	}
+
+	batching = batch.batch_cb != NULL;
+	if (batching) {
+		batch.ring[batch.head] = *location;
+		batch.head = (batch.head + 1) % GPS_TUNA_BATCH_SIZE;
+		batch.count++;
+		if (batch.count == GPS_TUNA_BATCH_SIZE ||
+				monotonic_ns() - batch.last_delivery_ns >= batch.interval_ns) {
+			batch_cb = batch.batch_cb;
+			batched = take_batch(out);
+		}
+	}
+	pthread_mutex_unlock(&shim_lock);
+
+	if (now_available)
+		geofence_callbacks->geofence_status_callback(GPS_GEOFENCE_AVAILABLE, location);
+	for (i = 0; i < num_transitions; i++) {
+		geofence_callbacks->geofence_transition_callback(ids[i], location,
+				transitions[i], location->timestamp);
+	}
+
+	if (batch_cb) {
+		SHIM_LOGD("%s: delivering %zu fixes", __func__, batched);
+		batch_cb(out, batched);
+	} else if (!batching && framework_location_cb) {
+		framework_location_cb(location);
+	}
+}
+
+static int shim_batching_start(gps_tuna_batch_callback batch_cb, uint32_t interval_ms) {
+	if (!batch_cb || !interval_ms)
+		return -1;
+
+	pthread_mutex_lock(&shim_lock);
+	batch.batch_cb = batch_cb;
+	batch.interval_ns = interval_ms * 1000000ULL;
+	batch.last_delivery_ns = monotonic_ns();
+	pthread_mutex_unlock(&shim_lock);
+	ALOGD("%s: batching fixes every %u ms", __func__, interval_ms);
+	return 0;
+}
+
+static void shim_batching_flush_or_stop(int stop) {
+	GpsLocation out[GPS_TUNA_BATCH_SIZE];
+	gps_tuna_batch_callback batch_cb;
+	size_t batched;
+
+	pthread_mutex_lock(&shim_lock);
+	batch_cb = batch.batch_cb;
+	batched = take_batch(out);
+	if (stop)
+		batch.batch_cb = NULL;
+	pthread_mutex_unlock(&shim_lock);
+
+	if (batch_cb && batched)
+		batch_cb(out, batched);
+}
+
+static void shim_batching_stop(void) {
+	shim_batching_flush_or_stop(1);
+}
+
+static void shim_batching_flush(void) {
+	shim_batching_flush_or_stop(0);
+}
+
+static GpsTunaBatchingInterface shim_batching = {
+	.size = sizeof(GpsTunaBatchingInterface),
+	.start = shim_batching_start,
+	.stop = shim_batching_stop,
+	.flush = shim_batching_flush,
+};
+
 const void* shim_get_extension(const char* name) {
-	ALOGD("%s(%s)", __func__, name);
+	SHIM_LOGD("%s(%s)", __func__, name);
+	if (shim_ril && name == shim_ril_name)
+		return shim_ril;
 	if (strcmp(name, AGPS_RIL_INTERFACE) == 0) {
+		// shimming it again would make the shim call itself
+		if (shim_ril) {
+			shim_ril_name = name;
+			return shim_ril;
+		}
 		// RIL interface
 		AGpsRilInterface *ril = (AGpsRilInterface*)vendor_get_extension(name);
+		if (!ril)
+			return NULL;
 		// now we shim the ref_location callback
 		ALOGD("%s: shimming RIL ref_location callback", __func__);
 		vendor_set_ref_location = ril->set_ref_location;
 		ril->set_ref_location = shim_set_ref_location;
+		shim_ril = ril;
+		shim_ril_name = name;
 		return ril;
+	} else if (strcmp(name, GPS_GEOFENCING_INTERFACE) == 0) {
+		const void *vendor = vendor_get_extension(name);
+		if (vendor)
+			return vendor;
+		ALOGD("%s: no vendor geofencing, using the shim's", __func__);
+		return &shim_geofencing;
+	} else if (strcmp(name, GPS_TUNA_BATCHING_INTERFACE) == 0) {
+		return &shim_batching;
 	} else {
 		return vendor_get_extension(name);
 	}
@@ -88,7 +422,8 @@ int shim_init (GpsCallbacks* gpsCallbacks) {
 	ALOGD("%s: shimming GpsCallbacks", __func__);
 	GpsCallbacks_Legacy vendor_gpsCallbacks;
 	vendor_gpsCallbacks.size = sizeof(GpsCallbacks_Legacy);
-	vendor_gpsCallbacks.location_cb = gpsCallbacks->location_cb;
+	framework_location_cb = gpsCallbacks->location_cb;
+	vendor_gpsCallbacks.location_cb = shim_location_cb;
 	vendor_gpsCallbacks.status_cb = gpsCallbacks->status_cb;
 	vendor_gpsCallbacks.sv_status_cb = gpsCallbacks->sv_status_cb;
 	vendor_gpsCallbacks.nmea_cb = gpsCallbacks->nmea_cb;
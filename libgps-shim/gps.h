@@ -67,3 +67,28 @@ typedef struct {
 		AGpsRefLocationMac			mac;
     } u;
 } AGpsRefLocationNoLTE;
+
+/*
+ * Batching of the fixes, an extension of the shim got with
+ * get_extension(GPS_TUNA_BATCHING_INTERFACE). While it runs, the fixes of the
+ * vendor HAL are kept instead of going to location_cb, and handed to the
+ * batch callback interval_ms apart, or sooner if GPS_TUNA_BATCH_SIZE of them
+ * are waiting. The caller starts it when nobody looks at the location every
+ * second, while the screen is off for instance. Geofences still see every fix.
+ */
+#define GPS_TUNA_BATCHING_INTERFACE "gps_tuna_batching"
+
+#define GPS_TUNA_BATCH_SIZE 64
+
+typedef void (*gps_tuna_batch_callback)(GpsLocation* locations, size_t count);
+
+typedef struct {
+    /** set to sizeof(GpsTunaBatchingInterface) */
+    size_t size;
+    /** Returns 0, or -1 if interval_ms is 0. */
+    int (*start)(gps_tuna_batch_callback batch_cb, uint32_t interval_ms);
+    /** Hands over the fixes kept and sends the next ones to location_cb. */
+    void (*stop)(void);
+    /** Hands over the fixes kept now. */
+    void (*flush)(void);
+} GpsTunaBatchingInterface;
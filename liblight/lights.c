@@ -16,6 +16,8 @@
 
 #define LOG_TAG "lights"
 #include <cutils/log.h>
+#include <cutils/properties.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -23,10 +25,15 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 #include <hardware/lights.h>
 #include <linux/leds-an30259a.h>
 
+#include "lights_tuna.h"
+
 static pthread_once_t g_init = PTHREAD_ONCE_INIT;
 static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -57,35 +64,176 @@ enum LED_Type {
 // a "stack" of virtual LED states
 static struct an30259a_pr_control g_led_states[LED_TYPE_LAST];
 
+#define MAX_PATTERN_STEPS	16
+
+// longest time_slope_* the controller takes
+#define LED_MAX_SLOPE_MS	7680
+// the controller rounds up each half of a blink to this
+#define LED_HALF_PERIOD_MS	500
+
+/*
+ * A pattern is compiled into steps, each one a program of the LED controller
+ * shown for duration_ms. Blinks the controller repeats by itself are one step,
+ * so the thread only wakes up when the program has to change, and not at all
+ * for a repeating pattern of one step.
+ */
+struct led_step {
+	struct an30259a_pr_control ctl;
+	uint32_t duration_ms;
+};
+
+struct led_pattern {
+	struct led_step steps[MAX_PATTERN_STEPS];
+	int num_steps;
+	int step;
+	int repeat;
+	int active;
+	int64_t deadline_ns;
+};
+
+static struct led_pattern g_patterns[LED_TYPE_LAST];
+static int g_pattern_timer = -1;
+static int g_pattern_thread_started;
+static pthread_t g_pattern_thread;
+
+// guards g_led_states and the patterns, taken before g_lock
+static pthread_mutex_t g_leds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// one refresh of the panel, 60Hz
+#define BACKLIGHT_FRAME_NS	16666667LL
+
+/*
+ * The backlight has its own lock so that brightness animations don't wait
+ * behind the LEDs. The sysfs file stays open, and a value the panel already
+ * has isn't written again. With ro.lights.coalesce_backlight set, updates
+ * closer than a frame to the last write are left to the writer thread, which
+ * writes only the latest of them once the frame is over.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	int written;		// last value the panel got, -1 if unknown
+	int pending;		// value the writer thread has to write, or -1
+	int64_t last_write_ns;
+	int coalesce;
+	int thread_started;
+	pthread_t thread;
+} g_backlight;
+
 void init_g_lock(void)
 {
 	pthread_mutex_init(&g_lock, NULL);
 	memset(g_led_states, 0, sizeof(g_led_states));
+
+	pthread_mutex_init(&g_backlight.lock, NULL);
+	pthread_cond_init(&g_backlight.cond, NULL);
+	g_backlight.fd = -1;
+	g_backlight.written = -1;
+	g_backlight.pending = -1;
+	g_backlight.coalesce = property_get_bool("ro.lights.coalesce_backlight", 0);
 }
 
-static int write_int(char const *path, int value)
+static int64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* It must be called with the g_backlight.lock held. */
+static int backlight_write_locked(int value)
 {
-	int fd;
 	static int already_warned;
+	char buffer[20];
+	int bytes;
+	int err;
+
+	if (value == g_backlight.written)
+		return 0;
+
+	if (g_backlight.fd < 0) {
+		g_backlight.fd = open(LCD_FILE, O_RDWR);
+		if (g_backlight.fd < 0) {
+			err = -errno;
+			if (already_warned == 0) {
+				ALOGE("failed to open %s\n", LCD_FILE);
+				already_warned = 1;
+			}
+			return err;
+		}
+		already_warned = 0;
+	}
 
-	already_warned = 0;
+	ALOGV("backlight_write: value %d", value);
+	bytes = snprintf(buffer, sizeof(buffer), "%d\n", value);
+	if (pwrite(g_backlight.fd, buffer, bytes, 0) < 0) {
+		// start over with a new fd, the driver may have gone away
+		err = -errno;
+		close(g_backlight.fd);
+		g_backlight.fd = -1;
+		g_backlight.written = -1;
+		return err;
+	}
 
-	ALOGV("write_int: path %s, value %d", path, value);
-	fd = open(path, O_RDWR);
+	g_backlight.written = value;
+	g_backlight.last_write_ns = monotonic_ns();
+	return 0;
+}
 
-	if (fd >= 0) {
-		char buffer[20];
-		int bytes = sprintf(buffer, "%d\n", value);
-		int amt = write(fd, buffer, bytes);
-		close(fd);
-		return amt == -1 ? -errno : 0;
-	} else {
-		if (already_warned == 0) {
-			ALOGE("write_int failed to open %s\n", path);
-			already_warned = 1;
+static void *backlight_thread(void *arg __unused)
+{
+	pthread_mutex_lock(&g_backlight.lock);
+	for (;;) {
+		while (g_backlight.pending < 0)
+			pthread_cond_wait(&g_backlight.cond, &g_backlight.lock);
+
+		int64_t due = g_backlight.last_write_ns + BACKLIGHT_FRAME_NS;
+		int64_t now = monotonic_ns();
+		if (now < due) {
+			pthread_mutex_unlock(&g_backlight.lock);
+			struct timespec ts = { 0, due - now };
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&g_backlight.lock);
 		}
-		return -errno;
+
+		int value = g_backlight.pending;
+		g_backlight.pending = -1;
+		if (value >= 0 && backlight_write_locked(value))
+			ALOGE("failed to write the backlight");
 	}
+	return NULL;
+}
+
+static int backlight_set(int value)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&g_backlight.lock);
+	if (g_backlight.coalesce &&
+			monotonic_ns() - g_backlight.last_write_ns < BACKLIGHT_FRAME_NS) {
+		if (!g_backlight.thread_started) {
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			g_backlight.thread_started = !pthread_create(&g_backlight.thread,
+					&attr, backlight_thread, NULL);
+			pthread_attr_destroy(&attr);
+		}
+		if (g_backlight.thread_started) {
+			g_backlight.pending = value;
+			pthread_cond_signal(&g_backlight.cond);
+			pthread_mutex_unlock(&g_backlight.lock);
+			return 0;
+		}
+	}
+
+	// a value written now supersedes the one left to the thread
+	g_backlight.pending = -1;
+	err = backlight_write_locked(value);
+	pthread_mutex_unlock(&g_backlight.lock);
+	return err;
 }
 
 static int rgb_to_brightness(struct light_state_t const *state)
@@ -99,14 +247,7 @@ static int rgb_to_brightness(struct light_state_t const *state)
 static int set_light_backlight(struct light_device_t *dev __unused,
 			struct light_state_t const *state)
 {
-	int err = 0;
-	int brightness = rgb_to_brightness(state);
-
-	pthread_mutex_lock(&g_lock);
-	err = write_int(LCD_FILE, brightness);
-
-	pthread_mutex_unlock(&g_lock);
-	return err;
+	return backlight_set(rgb_to_brightness(state));
 }
 
 static int close_lights(struct light_device_t *dev)
@@ -119,28 +260,61 @@ static int close_lights(struct light_device_t *dev)
 }
 
 /* LEDs */
+
+/*
+ * The LED device stays open once IMAX is set on it, and the last control
+ * block programmed is kept so that the same state isn't sent again. Both go
+ * with the g_lock.
+ */
+static int g_led_fd = -1;
+static struct an30259a_pr_control g_led_applied;
+static int g_led_applied_valid;
+
+/* It must be called with the g_lock held. */
+static int open_leds_locked(void)
+{
+	int imax = IMAX;
+
+	if (g_led_fd >= 0)
+		return 0;
+
+	g_led_fd = open(LED_FILE, O_RDWR);
+	if (g_led_fd < 0) {
+		ALOGE("failed to open %s!", LED_FILE);
+		return -errno;
+	}
+
+	if (ioctl(g_led_fd, AN30259A_PR_SET_IMAX, &imax))
+		ALOGE("failed to set imax");
+	g_led_applied_valid = 0;
+	return 0;
+}
+
 static int write_leds(struct an30259a_pr_control *led)
 {
 	int err = 0;
-	int imax = IMAX;
-	int fd;
 
 	pthread_mutex_lock(&g_lock);
 
-	fd = open(LED_FILE, O_RDWR);
-	if (fd >= 0) {
-		err = ioctl(fd, AN30259A_PR_SET_IMAX, &imax);
-		if (err)
-			ALOGE("failed to set imax");
+	if (g_led_applied_valid &&
+			!memcmp(&g_led_applied, led, sizeof(g_led_applied))) {
+		pthread_mutex_unlock(&g_lock);
+		return 0;
+	}
 
-		err = ioctl(fd, AN30259A_PR_SET_LED, led);
-		if (err < 0)
+	err = open_leds_locked();
+	if (!err) {
+		err = ioctl(g_led_fd, AN30259A_PR_SET_LED, led);
+		if (err < 0) {
 			ALOGE("failed to set leds!");
-
-		close(fd);
-	} else {
-		ALOGE("failed to open %s!", LED_FILE);
-		err =  -errno;
+			// open the device again next time, and program it from scratch
+			close(g_led_fd);
+			g_led_fd = -1;
+			g_led_applied_valid = 0;
+		} else {
+			g_led_applied = *led;
+			g_led_applied_valid = 1;
+		}
 	}
 
 	pthread_mutex_unlock(&g_lock);
@@ -152,7 +326,7 @@ static int write_leds(struct an30259a_pr_control *led)
 static int write_leds_priority()
 {
 	// find the highest priority virtual LED that should be illuminated and
-	// call write_leds() with it
+	// call write_leds() with it; write_leds() skips it if that's already shown
 	int i;
 
 	for (i = 0; i < LED_TYPE_LAST; i++) {
@@ -173,6 +347,10 @@ static int set_light_leds(struct light_state_t const *state, int type)
 	}
 
 	struct an30259a_pr_control *led_state = &g_led_states[type];
+	int err;
+
+	pthread_mutex_lock(&g_leds_lock);
+	g_patterns[type].active = 0;
 
 	// set the LED information to the proper element of the array without actually
 	// changing the physical LED yet
@@ -202,6 +380,7 @@ static int set_light_leds(struct light_state_t const *state, int type)
 			led_state->time_off = state->flashOffMS;
 			break;
 		default:
+			pthread_mutex_unlock(&g_leds_lock);
 			return -EINVAL;
 		}
 	} else {
@@ -209,7 +388,9 @@ static int set_light_leds(struct light_state_t const *state, int type)
 	}
 
 	// allow write_leds_priority determine if the physical LED should be changed
-	return write_leds_priority();
+	err = write_leds_priority();
+	pthread_mutex_unlock(&g_leds_lock);
+	return err;
 }
 
 static int set_light_leds_notifications(struct light_device_t *dev __unused,
@@ -237,6 +418,231 @@ static int set_light_leds_battery(struct light_device_t *dev __unused,
 }
 #endif
 
+/* Patterns */
+static uint32_t round_up_half_period(uint32_t ms)
+{
+	return (ms + LED_HALF_PERIOD_MS - 1) / LED_HALF_PERIOD_MS * LED_HALF_PERIOD_MS;
+}
+
+static int add_step(struct led_pattern *p, struct an30259a_pr_control const *ctl,
+		uint32_t duration_ms)
+{
+	if (duration_ms == 0)
+		return 0;
+
+	// the same program again just keeps running
+	if (p->num_steps > 0 &&
+			!memcmp(&p->steps[p->num_steps - 1].ctl, ctl, sizeof(*ctl))) {
+		p->steps[p->num_steps - 1].duration_ms += duration_ms;
+		return 0;
+	}
+	if (p->num_steps >= MAX_PATTERN_STEPS)
+		return -EINVAL;
+
+	p->steps[p->num_steps].ctl = *ctl;
+	p->steps[p->num_steps].duration_ms = duration_ms;
+	p->num_steps++;
+	return 0;
+}
+
+static int compile_pattern(struct lights_tuna_segment const *seg, size_t count,
+		struct led_pattern *p)
+{
+	struct an30259a_pr_control ctl;
+	size_t i = 0;
+
+	p->num_steps = 0;
+	while (i < count) {
+		uint32_t color = seg[i].color & 0x00ffffff;
+		uint32_t duration;
+
+		memset(&ctl, 0, sizeof(ctl));
+		if (color && i + 1 < count && !(seg[i + 1].color & 0x00ffffff) &&
+				seg[i].ramp_ms <= LED_MAX_SLOPE_MS &&
+				seg[i + 1].ramp_ms <= LED_MAX_SLOPE_MS) {
+			// an on/off pair is one period of a hardware blink
+			uint32_t up = seg[i].ramp_ms, down = seg[i + 1].ramp_ms;
+
+			ctl.color = color;
+			ctl.time_on = seg[i].hold_ms;
+			ctl.time_off = seg[i + 1].hold_ms;
+			if (up || down) {
+				ctl.state = LED_LIGHT_SLOPE;
+				ctl.time_slope_up_1 = up * SLOPE_UP_1 / (SLOPE_UP_1 + SLOPE_UP_2);
+				ctl.time_slope_up_2 = up - ctl.time_slope_up_1;
+				ctl.time_slope_down_1 = down * SLOPE_DOWN_1 / (SLOPE_DOWN_1 + SLOPE_DOWN_2);
+				ctl.time_slope_down_2 = down - ctl.time_slope_down_1;
+				ctl.mid_brightness = MID_BRIGHTNESS;
+			} else {
+				ctl.state = LED_LIGHT_PULSE;
+			}
+			duration = round_up_half_period(up + seg[i].hold_ms) +
+					round_up_half_period(down + seg[i + 1].hold_ms);
+			i += 2;
+		} else {
+			ctl.color = color;
+			ctl.state = color ? LED_LIGHT_ON : LED_LIGHT_OFF;
+			duration = seg[i].ramp_ms + seg[i].hold_ms;
+			i++;
+		}
+
+		if (add_step(p, &ctl, duration))
+			return -EINVAL;
+	}
+	return 0;
+}
+
+/* It must be called with the g_leds_lock held. */
+static void arm_pattern_timer_locked(void)
+{
+	struct itimerspec its;
+	int64_t next = 0;
+	int i;
+
+	for (i = 0; i < LED_TYPE_LAST; i++) {
+		struct led_pattern *p = &g_patterns[i];
+		if (p->active && p->deadline_ns && (!next || p->deadline_ns < next))
+			next = p->deadline_ns;
+	}
+
+	// a zero it_value disarms it
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000LL;
+	its.it_value.tv_nsec = next % 1000000000LL;
+	if (timerfd_settime(g_pattern_timer, TFD_TIMER_ABSTIME, &its, NULL))
+		ALOGE("failed to arm the pattern timer: %s", strerror(errno));
+}
+
+/* It must be called with the g_leds_lock held. */
+static void show_step_locked(int type, int64_t now)
+{
+	struct led_pattern *p = &g_patterns[type];
+	struct led_step const *step = &p->steps[p->step];
+
+	g_led_states[type] = step->ctl;
+	if (p->num_steps == 1 && p->repeat)
+		p->deadline_ns = 0;
+	else
+		p->deadline_ns = now + step->duration_ms * 1000000LL;
+}
+
+static void *pattern_thread(void *arg __unused)
+{
+	uint64_t expirations;
+	int i;
+
+	for (;;) {
+		if (read(g_pattern_timer, &expirations, sizeof(expirations)) < 0 &&
+				errno != EINTR && errno != EAGAIN) {
+			ALOGE("failed to read the pattern timer: %s", strerror(errno));
+			return NULL;
+		}
+
+		pthread_mutex_lock(&g_leds_lock);
+		int64_t now = monotonic_ns();
+		int changed = 0;
+		for (i = 0; i < LED_TYPE_LAST; i++) {
+			struct led_pattern *p = &g_patterns[i];
+			if (!p->active || !p->deadline_ns || p->deadline_ns > now)
+				continue;
+
+			if (++p->step == p->num_steps) {
+				if (!p->repeat) {
+					p->active = 0;
+					memset(&g_led_states[i], 0, sizeof(g_led_states[i]));
+					changed = 1;
+					continue;
+				}
+				p->step = 0;
+			}
+			// a step missed in suspend starts over from now
+			show_step_locked(i, now);
+			changed = 1;
+		}
+		if (changed)
+			write_leds_priority();
+		arm_pattern_timer_locked();
+		pthread_mutex_unlock(&g_leds_lock);
+	}
+	return NULL;
+}
+
+/* It must be called with the g_leds_lock held. */
+static int start_pattern_thread_locked(void)
+{
+	if (g_pattern_thread_started)
+		return 0;
+
+	if (g_pattern_timer < 0) {
+		g_pattern_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (g_pattern_timer < 0) {
+			ALOGE("failed to create the pattern timer: %s", strerror(errno));
+			return -errno;
+		}
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int err = pthread_create(&g_pattern_thread, &attr, pattern_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		ALOGE("failed to start the pattern thread: %s", strerror(err));
+		return -err;
+	}
+	g_pattern_thread_started = 1;
+	return 0;
+}
+
+static int led_type_of(struct light_device_t const *dev)
+{
+	if (dev->set_light == set_light_leds_notifications)
+		return LED_TYPE_NOTIFICATION;
+	if (dev->set_light == set_light_leds_attention)
+		return LED_TYPE_ATTENTION;
+#ifdef CHARGING_LED
+	if (dev->set_light == set_light_leds_battery)
+		return LED_TYPE_CHARGING;
+#endif
+	return -1;
+}
+
+int lights_tuna_set_pattern(struct light_device_t *dev,
+		struct lights_tuna_segment const *segments, size_t count, int repeat)
+{
+	struct led_pattern pattern;
+	int type = led_type_of(dev);
+	int err = 0;
+
+	if (type < 0)
+		return -EINVAL;
+
+	memset(&pattern, 0, sizeof(pattern));
+	if (compile_pattern(segments, count, &pattern))
+		return -EINVAL;
+	pattern.repeat = repeat;
+	pattern.active = pattern.num_steps > 0;
+
+	pthread_mutex_lock(&g_leds_lock);
+	g_patterns[type] = pattern;
+	if (pattern.active) {
+		show_step_locked(type, monotonic_ns());
+		if (g_patterns[type].deadline_ns)
+			err = start_pattern_thread_locked();
+	} else {
+		memset(&g_led_states[type], 0, sizeof(g_led_states[type]));
+	}
+	if (!err) {
+		err = write_leds_priority();
+		if (g_pattern_timer >= 0)
+			arm_pattern_timer_locked();
+	} else {
+		g_patterns[type].active = 0;
+	}
+	pthread_mutex_unlock(&g_leds_lock);
+	return err;
+}
+
 static int open_lights(const struct hw_module_t *module, char const *name,
 						struct hw_device_t **device)
 {
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIGHTS_TUNA_H
+#define LIGHTS_TUNA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/lights.h>
+
+__BEGIN_DECLS
+
+/*
+ * Extensions of lights.tuna beyond the lights API. They take a device opened
+ * from the module and are looked up with dlsym() on the handle that
+ * hw_get_module() keeps in the module's dso.
+ */
+
+#define LIGHTS_TUNA_SET_PATTERN "lights_tuna_set_pattern"
+
+/*
+ * One segment of a pattern: the LED goes to color, in ramp_ms if the color
+ * before it or after it is black, and stays there for hold_ms. The hardware
+ * can't fade from one color to another, such a change is immediate.
+ */
+struct lights_tuna_segment {
+	uint32_t color;
+	uint16_t ramp_ms;
+	uint16_t hold_ms;
+};
+
+/*
+ * Shows the count segments on the notifications, attention or battery LED of
+ * dev, in place of its light state, until the next set_light on it. A pattern
+ * that doesn't repeat leaves the LED off at its end. Every on/off pair of
+ * segments in one color becomes a blink that the LED controller runs by itself,
+ * so the times of those pairs are rounded up to whole half seconds, the first
+ * one with its ramp up and the second one with its ramp down.
+ *
+ * Returns 0, -EINVAL if the pattern needs more steps than the module keeps,
+ * or a negative errno from the LED device.
+ */
+typedef int (*lights_tuna_set_pattern_t)(struct light_device_t *dev,
+		const struct lights_tuna_segment *segments, size_t count,
+		int repeat);
+
+__END_DECLS
+
+#endif  // LIGHTS_TUNA_H
@@ -32,23 +32,33 @@ LOCAL_C_INCLUDES := \
 	$(LOCAL_PATH)/mlsdk/mllite \
 	$(LOCAL_PATH)/mlsdk/mldmp \
 	$(LOCAL_PATH)/mlsdk/external/aichi \
-	$(LOCAL_PATH)/mlsdk/external/akmd
+	$(LOCAL_PATH)/mlsdk/external/akmd \
+	$(LOCAL_PATH)/../include
 
 LOCAL_SRC_FILES := \
 	sensors.cpp \
 	SensorBase.cpp \
+	BarometerSensor.cpp \
 	MPLSensor.cpp \
+	DirectChannel.cpp \
 	InputEventReader.cpp \
 	LightSensor.cpp \
 	ProximitySensor.cpp \
 	PressureSensor.cpp \
+	ReplaySensor.cpp \
 	SamsungSensorBase.cpp \
+	SensorPolicy.cpp \
+	SensorTime.cpp \
 	TemperatureSensor.cpp
 
-LOCAL_SHARED_LIBRARIES := liblog libcutils libutils libdl libmllite libmlplatform
+LOCAL_SHARED_LIBRARIES := liblog libcutils libutils libdl libhardware_legacy libmllite libmlplatform
 LOCAL_CFLAGS := -DLOG_TAG=\"Sensors\"
 LOCAL_CPPFLAGS := -DLINUX=1
 LOCAL_CLANG := true
 LOCAL_CFLAGS += -Wall -Werror
 
+ifeq ($(TARGET_TUNA_TRACE),true)
+LOCAL_CFLAGS += -DTUNA_TRACE
+endif
+
 include $(BUILD_SHARED_LIBRARY)
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2011 Samsung
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <pthread.h>
+#include <linux/input.h>
+
+#include "BarometerSensor.h"
+
+/*****************************************************************************/
+
+BarometerSensor::BarometerSensor(const char *data_name, int sensor_code,
+                                 float scale, const char *threshold_property)
+    : SamsungSensorBase(data_name, sensor_code),
+      mScale(scale),
+      mThresholdProperty(threshold_property),
+      mThreshold(0),
+      mFilter(FILTER_MEDIAN),
+      mOversample(1),
+      mDecimation(1),
+      mNumSamples(0),
+      mIir(0),
+      mHaveLast(false),
+      mLastValue(0),
+      mFifoLock(PTHREAD_MUTEX_INITIALIZER),
+      mFifoCount(0),
+      mLatency(0),
+      mReleasing(false)
+{
+    loadConfig();
+}
+
+BarometerSensor::~BarometerSensor() {
+}
+
+void BarometerSensor::loadConfig()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(BAROMETER_OVERSAMPLE_PROPERTY, value,
+                 BAROMETER_OVERSAMPLE_DEFAULT);
+    mOversample = atoi(value);
+    if (mOversample < 1)
+        mOversample = 1;
+    if (mOversample > BAROMETER_OVERSAMPLE_MAX)
+        mOversample = BAROMETER_OVERSAMPLE_MAX;
+
+    property_get(BAROMETER_FILTER_PROPERTY, value, "median");
+    mFilter = strcmp(value, "iir") ? FILTER_MEDIAN : FILTER_IIR;
+
+    property_get(mThresholdProperty, value, "0");
+    mThreshold = fabsf(atof(value));
+
+    ALOGV("%s: %d samples per event, %s filter, threshold %f", data_name,
+          mOversample, mFilter == FILTER_IIR ? "iir" : "median", mThreshold);
+}
+
+/* must be called with mLock held */
+void BarometerSensor::resetFilter()
+{
+    mNumSamples = 0;
+    mHaveLast = false;
+}
+
+/* must be called with mLock held, once mDecimation samples are in */
+float BarometerSensor::filterSamples()
+{
+    if (mFilter == FILTER_IIR)
+        return mIir;
+
+    float sorted[BAROMETER_OVERSAMPLE_MAX];
+    for (int i = 0; i < mNumSamples; i++) {
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > mSamples[i]; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = mSamples[i];
+    }
+    int mid = mNumSamples / 2;
+    if (mNumSamples & 1)
+        return sorted[mid];
+    return (sorted[mid - 1] + sorted[mid]) / 2;
+}
+
+int BarometerSensor::handleEnable(int en)
+{
+    if (en)
+        resetFilter();
+    return 0;
+}
+
+/* one event per mDecimation samples, dropped while it stays within the
+ * threshold of the last one reported */
+bool BarometerSensor::handleEvent(input_event const *event)
+{
+    float value = event->value * mScale;
+
+    if (mFilter == FILTER_IIR) {
+        // one pole with a time constant of one event period
+        if (!mNumSamples && !mHaveLast)
+            mIir = value;
+        else
+            mIir += (value - mIir) / mDecimation;
+    } else {
+        mSamples[mNumSamples] = value;
+    }
+    if (++mNumSamples < mDecimation)
+        return false;
+
+    value = filterSamples();
+    mNumSamples = 0;
+    if (mHaveLast && fabsf(value - mLastValue) < mThreshold)
+        return false;
+
+    mHaveLast = true;
+    mLastValue = value;
+    mPendingEvent.data[0] = value;
+    return true;
+}
+
+int BarometerSensor::enable(int32_t handle, int en)
+{
+    int err = SamsungSensorBase::enable(handle, en);
+
+    // what a disabled sensor still held in the FIFO is dropped
+    if (!err && !en) {
+        pthread_mutex_lock(&mFifoLock);
+        mFifoCount = 0;
+        mReleasing = false;
+        pthread_mutex_unlock(&mFifoLock);
+    }
+    return err;
+}
+
+int BarometerSensor::setDelay(int32_t handle, int64_t ns)
+{
+    int decimation = mOversample;
+    if (ns / decimation < BAROMETER_MIN_DELAY_NS)
+        decimation = ns / BAROMETER_MIN_DELAY_NS;
+    if (decimation < 1)
+        decimation = 1;
+
+    pthread_mutex_lock(&mLock);
+    if (decimation != mDecimation) {
+        mDecimation = decimation;
+        resetFilter();
+    }
+    pthread_mutex_unlock(&mLock);
+
+    return SamsungSensorBase::setDelay(handle, ns / decimation);
+}
+
+int BarometerSensor::batch(int32_t handle, int flags, int64_t ns,
+                           int64_t timeout)
+{
+    if (flags & SENSORS_BATCH_DRY_RUN)
+        return 0;
+
+    pthread_mutex_lock(&mFifoLock);
+    mLatency = timeout;
+    // leaving batch mode hands over what was held
+    if (!timeout && mFifoCount)
+        mReleasing = true;
+    pthread_mutex_unlock(&mFifoLock);
+
+    return setDelay(handle, ns);
+}
+
+int BarometerSensor::flush(int32_t handle __unused)
+{
+    pthread_mutex_lock(&mFifoLock);
+    if (mFifoCount)
+        mReleasing = true;
+    pthread_mutex_unlock(&mFifoLock);
+    return 0;
+}
+
+bool BarometerSensor::hasPendingEvents() const {
+    return mReleasing;
+}
+
+int BarometerSensor::readEvents(sensors_event_t* data, int count)
+{
+    if (count < 1)
+        return -EINVAL;
+
+    pthread_mutex_lock(&mFifoLock);
+    if (!mLatency && !mFifoCount) {
+        int nb = SamsungSensorBase::readEvents(data, count);
+        pthread_mutex_unlock(&mFifoLock);
+        return nb;
+    }
+
+    int room = BAROMETER_FIFO_EVENTS - mFifoCount;
+    if (room) {
+        int nb = SamsungSensorBase::readEvents(mFifo + mFifoCount, room);
+        if (nb > 0)
+            mFifoCount += nb;
+    }
+
+    if (mFifoCount && (!mLatency || mFifoCount == BAROMETER_FIFO_EVENTS ||
+                       getTimestamp() - mFifo[0].timestamp >= mLatency))
+        mReleasing = true;
+
+    int numEventReceived = 0;
+    if (mReleasing) {
+        numEventReceived = count < mFifoCount ? count : mFifoCount;
+        memcpy(data, mFifo, numEventReceived * sizeof(*data));
+        mFifoCount -= numEventReceived;
+        memmove(mFifo, mFifo + numEventReceived, mFifoCount * sizeof(*data));
+        mReleasing = mFifoCount > 0;
+    }
+    pthread_mutex_unlock(&mFifoLock);
+    return numEventReceived;
+}
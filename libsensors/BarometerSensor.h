@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2011 Samsung
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_BAROMETER_SENSOR_H
+#define ANDROID_BAROMETER_SENSOR_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include "sensors.h"
+#include "SamsungSensorBase.h"
+#include "InputEventReader.h"
+
+/*****************************************************************************/
+
+/* samples of the BMP180 filtered into each event, the driver is run that
+ * much faster than requested but never beyond its 20 ms minimum delay */
+#define BAROMETER_OVERSAMPLE_PROPERTY "ro.sensors.baro.oversample"
+#define BAROMETER_OVERSAMPLE_DEFAULT  "4"
+#define BAROMETER_OVERSAMPLE_MAX      8
+/* "median" of the samples of each event, or "iir" low pass over them */
+#define BAROMETER_FILTER_PROPERTY     "ro.sensors.baro.filter"
+#define BAROMETER_MIN_DELAY_NS        20000000LL
+
+/* events held while batching, before the framework has to take them */
+#define BAROMETER_FIFO_EVENTS         128
+
+struct input_event;
+
+/*
+ * The pressure and temperature channels of the BMP180 input device. Each
+ * event is filtered from several samples; with a threshold set it is only
+ * reported once the value moved by that much, and with a report latency the
+ * events are held in a software FIFO until it expires, it fills up or the
+ * framework flushes it.
+ */
+class BarometerSensor:public SamsungSensorBase {
+    enum Filter {
+        FILTER_MEDIAN,
+        FILTER_IIR,
+    };
+
+    float mScale;
+    const char *mThresholdProperty;
+    float mThreshold; //on-change threshold in sensor units, 0 reports all
+    Filter mFilter;
+    int mOversample; //configured samples per event
+    int mDecimation; //samples per event at the current delay
+    float mSamples[BAROMETER_OVERSAMPLE_MAX];
+    int mNumSamples;
+    float mIir;
+    bool mHaveLast;
+    float mLastValue;
+
+    pthread_mutex_t mFifoLock;
+    sensors_event_t mFifo[BAROMETER_FIFO_EVENTS];
+    int mFifoCount;
+    int64_t mLatency;
+    bool mReleasing; //the FIFO is being handed to the framework
+
+    void loadConfig();
+    void resetFilter();
+    float filterSamples();
+
+protected:
+    BarometerSensor(const char *data_name, int sensor_code, float scale,
+                    const char *threshold_property);
+
+    virtual int handleEnable(int en);
+    virtual bool handleEvent(input_event const * event);
+
+public:
+    virtual ~BarometerSensor();
+    virtual int enable(int32_t handle, int en);
+    virtual int setDelay(int32_t handle, int64_t ns);
+    virtual int batch(int32_t handle, int flags, int64_t ns, int64_t timeout);
+    virtual int flush(int32_t handle);
+    virtual bool hasPendingEvents() const;
+    virtual int readEvents(sensors_event_t *data, int count);
+};
+
+/*****************************************************************************/
+
+#endif /* ANDROID_BAROMETER_SENSOR_H */
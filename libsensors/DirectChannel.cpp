@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <cutils/log.h>
+
+#include "DirectChannel.h"
+
+/*****************************************************************************/
+
+DirectChannel::DirectChannel(int fd, size_t size)
+    : mFd(-1),
+      mSize(0),
+      mBase(NULL),
+      mEvents(0),
+      mNext(0),
+      mCounter(0)
+{
+    if (size < sizeof(sensors_event_t)) {
+        ALOGE("direct channel too small (%zu bytes)", size);
+        return;
+    }
+
+    // the client keeps its own fd
+    mFd = dup(fd);
+    if (mFd < 0) {
+        ALOGE("unable to dup the direct channel fd (%s)", strerror(errno));
+        return;
+    }
+
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (base == MAP_FAILED) {
+        ALOGE("unable to map the direct channel (%s)", strerror(errno));
+        close(mFd);
+        mFd = -1;
+        return;
+    }
+
+    mSize = size;
+    mBase = (sensors_event_t*)base;
+    mEvents = mSize / sizeof(sensors_event_t);
+    memset(mBase, 0, mSize);
+}
+
+DirectChannel::~DirectChannel()
+{
+    if (mBase)
+        munmap(mBase, mSize);
+    if (mFd >= 0)
+        close(mFd);
+}
+
+void DirectChannel::write(sensors_event_t const* event, int token)
+{
+    sensors_event_t* slot = mBase + mNext;
+
+    mNext = (mNext + 1) % mEvents;
+    // 0 marks a slot which was never written
+    if (++mCounter == 0)
+        mCounter = 1;
+
+    memcpy(slot, event, sizeof(*slot));
+    slot->version = sizeof(sensors_event_t);
+    slot->sensor = token;
+    __atomic_store_n(&slot->reserved0, mCounter, __ATOMIC_RELEASE);
+}
+
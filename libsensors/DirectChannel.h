@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DIRECT_CHANNEL_H
+#define ANDROID_DIRECT_CHANNEL_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include <hardware/sensors.h>
+
+/* the direct report API only exists in the newer sensors headers */
+#ifdef SENSOR_FLAG_SHIFT_DIRECT_REPORT
+#define SENSORS_HAVE_DIRECT_CHANNEL 1
+#endif
+
+/*****************************************************************************/
+
+/* a client provided shared memory region filled as a ring of
+ * sensors_event_t, in the SENSOR_DIRECT_FMT_SENSORS_EVENT layout: the client
+ * polls the atomic counter in reserved0 of the next slot, written last. */
+class DirectChannel
+{
+    int mFd;
+    size_t mSize;
+    sensors_event_t* mBase;
+    size_t mEvents;
+    size_t mNext;
+    int32_t mCounter;
+
+public:
+    DirectChannel(int fd, size_t size);
+    ~DirectChannel();
+    bool isValid() const { return mBase != NULL; }
+    void write(sensors_event_t const* event, int token);
+};
+
+/*****************************************************************************/
+
+#endif  // ANDROID_DIRECT_CHANNEL_H
@@ -23,25 +23,53 @@
 #include <sys/select.h>
 #include <cutils/log.h>
 #include <pthread.h>
+#include <stdlib.h>
 
 #include "LightSensor.h"
 
-LightSensor::LightSensor()
-    : SamsungSensorBase("lightsensor-level", ABS_MISC)
+// Convert adc value to lux assuming:
+// I = 10 * log(Ev) uA
+// R = 24kOhm
+// Max adc value 1023 = 1.25V
+// 1/4 of light reaches sensor
+const LightSensor::Curve LightSensor::tunaCurve = { 1.25f, 24.0f, 4.0f };
+
+LightSensor::LightSensor(const Curve& curve)
+    : SamsungSensorBase("lightsensor-level", ABS_MISC),
+      mLastLevel(-1)
 {
     mPendingEvent.sensor = ID_L;
     mPendingEvent.type = SENSOR_TYPE_LIGHT;
+
+    // V / R gives the current in mA, so 100 * V / R / 1023 per adc step
+    // in decades of Ev
+    float decadesPerLevel = 100.0f * curve.fullScaleV / curve.loadKOhm /
+            (LIGHT_ADC_LEVELS - 1);
+    for (int i = 0; i < LIGHT_ADC_LEVELS; i++)
+        mLux[i] = powf(10, i * decadesPerLevel) * curve.luxScale;
+}
+
+int LightSensor::handleEnable(int en) {
+    if (en)
+        mLastLevel = -1;
+    return 0;
 }
 
 bool LightSensor::handleEvent(input_event const *event) {
     if (event->value == -1) {
         return false;
     }
-    // Convert adc value to lux assuming:
-    // I = 10 * log(Ev) uA
-    // R = 24kOhm
-    // Max adc value 1023 = 1.25V
-    // 1/4 of light reaches sensor
-    mPendingEvent.light = powf(10, event->value * (125.0f / 1023.0f / 24.0f)) * 4;
+
+    int level = event->value;
+    if (level < 0)
+        level = 0;
+    else if (level >= LIGHT_ADC_LEVELS)
+        level = LIGHT_ADC_LEVELS - 1;
+
+    if (mLastLevel >= 0 && abs(level - mLastLevel) < LIGHT_ADC_HYSTERESIS)
+        return false;
+
+    mLastLevel = level;
+    mPendingEvent.light = mLux[level];
     return true;
 }
@@ -28,13 +28,34 @@
 
 /*****************************************************************************/
 
+/* the lightsensor-level ADC is 10 bit */
+#define LIGHT_ADC_LEVELS 1024
+
+/* ADC counts the level has to move by from the last reported one before a
+ * new event is sent, a count is about 1.2% of lux; 0 reports every change */
+#define LIGHT_ADC_HYSTERESIS 2
+
 struct input_event;
 
 class LightSensor:public SamsungSensorBase {
+public:
+    /* photodiode response the lux table is built from, see tunaCurve */
+    struct Curve {
+        float fullScaleV;   // voltage of the largest ADC value
+        float loadKOhm;     // load resistor, I = 10 * log(Ev) uA through it
+        float luxScale;     // inverse of the fraction of light reaching it
+    };
+
+    static const Curve tunaCurve;
 
+    LightSensor(const Curve& curve = tunaCurve);
+
+private:
+    float mLux[LIGHT_ADC_LEVELS];
+    int mLastLevel; //ADC level of the last event, -1 if none yet
+
+    virtual int handleEnable(int en);
     virtual bool handleEvent(input_event const * event);
-public:
-    LightSensor();
 };
 
 /*****************************************************************************/
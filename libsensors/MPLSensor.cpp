@@ -33,10 +33,14 @@
 #include <utils/KeyedVector.h>
 
 #include "MPLSensor.h"
+#include "SensorTime.h"
+#include "tuna_boot_profile.h"
+#include "tuna_trace.h"
 
 #include "math.h"
 #include "ml.h"
 #include "mlFIFO.h"
+#include "mlFIFOHW.h"
 #include "mlsl.h"
 #include "mlos.h"
 #include "ml_stored_data.h"
@@ -113,18 +117,32 @@ void setCallbackObject(MPLSensor* gbpt)
 #define LA_ENABLED ((1<<ID_LA) & enabled_sensors)
 #define GR_ENABLED ((1<<ID_GR) & enabled_sensors)
 #define RV_ENABLED ((1<<ID_RV) & enabled_sensors)
+#define SM_ENABLED ((1<<ID_SM) & enabled_sensors)
+#define SD_ENABLED ((1<<ID_SD) & enabled_sensors)
+#define GRV_ENABLED ((1<<ID_GRV) & enabled_sensors)
+#define GYU_ENABLED ((1<<ID_GYU) & enabled_sensors)
+#define MU_ENABLED ((1<<ID_MU) & enabled_sensors)
 
 MPLSensor::MPLSensor() :
     SensorBase(NULL),
-            mNewData(0),
+            mNewData(0), mPacketCount(0), mLastPacketTime(0), mPacketStep(0),
             mDmpStarted(false),
             mMasterSensorMask(INV_ALL_SENSORS),
             mLocalSensorMask(ALL_MPL_SENSORS_NP),
             mCurFifoRate(-1), mHaveGoodMpuCal(false), mHaveGoodCompassCal(false),
             mUseTimerIrqAccel(false), mUsetimerIrqCompass(true),
             mUseTimerirq(false),
-            mEnabled(0), mPendingMask(0),
-            mForceSleep(false), mNineAxisEnabled(false)
+            mRequestedEnabled(0), mConfigPending(false), mWakeUpRequested(false),
+            mEnabled(0), mPollEnabled(0),
+            mRingHead(0), mRingCount(0), mBurstEvents(0),
+            mDroppedEvents(0), mNumDirectEvents(0),
+            mBatchPeriodMs(0), mFlushPending(false),
+            mForceSleep(false), mSuspendRunning(false),
+            mMotion(true), mMotionMs(0), mStepMs(0), mStepArmed(false),
+            mIrqReady(0),
+            mNineAxisEnabled(false),
+            mCalLen(0), mCalThreadRunning(false), mCalExit(false),
+            mCalLoadPending(false)
 {
     FUNC_LOG;
     int mpu_int_fd;
@@ -133,6 +151,14 @@ MPLSensor::MPLSensor() :
     ALOGV_IF(EXTRA_VERBOSE, "MPLSensor constructor: numSensors = %d", numSensors);
 
     pthread_mutex_init(&mMplMutex, NULL);
+    pthread_mutex_init(&mConfigLock, NULL);
+    pthread_mutex_init(&mCalLock, NULL);
+    pthread_cond_init(&mCalCond, NULL);
+
+    if (pthread_create(&mCalThread, NULL, calWriterThread, this) == 0)
+        mCalThreadRunning = true;
+    else
+        ALOGE("cannot create the calibration writer, storing synchronously");
 
     for (size_t i = 0; i < ARRAY_SIZE(mPollFds); i++) {
         mPollFds[i].fd = -1;
@@ -210,6 +236,26 @@ MPLSensor::MPLSensor() :
     mPendingEvents[Orientation].type = SENSOR_TYPE_ORIENTATION;
     mPendingEvents[Orientation].orientation.status = SENSOR_STATUS_ACCURACY_HIGH;
 
+    mPendingEvents[SignificantMotion].version = sizeof(sensors_event_t);
+    mPendingEvents[SignificantMotion].sensor = ID_SM;
+    mPendingEvents[SignificantMotion].type = SENSOR_TYPE_SIGNIFICANT_MOTION;
+
+    mPendingEvents[StepDetector].version = sizeof(sensors_event_t);
+    mPendingEvents[StepDetector].sensor = ID_SD;
+    mPendingEvents[StepDetector].type = SENSOR_TYPE_STEP_DETECTOR;
+
+    mPendingEvents[GameRotationVector].version = sizeof(sensors_event_t);
+    mPendingEvents[GameRotationVector].sensor = ID_GRV;
+    mPendingEvents[GameRotationVector].type = SENSOR_TYPE_GAME_ROTATION_VECTOR;
+
+    mPendingEvents[GyroUncalibrated].version = sizeof(sensors_event_t);
+    mPendingEvents[GyroUncalibrated].sensor = ID_GYU;
+    mPendingEvents[GyroUncalibrated].type = SENSOR_TYPE_GYROSCOPE_UNCALIBRATED;
+
+    mPendingEvents[MagneticFieldUncalibrated].version = sizeof(sensors_event_t);
+    mPendingEvents[MagneticFieldUncalibrated].sensor = ID_MU;
+    mPendingEvents[MagneticFieldUncalibrated].type = SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED;
+
     mHandlers[RotationVector] = &MPLSensor::rvHandler;
     mHandlers[LinearAccel] = &MPLSensor::laHandler;
     mHandlers[Gravity] = &MPLSensor::gravHandler;
@@ -217,9 +263,24 @@ MPLSensor::MPLSensor() :
     mHandlers[Accelerometer] = &MPLSensor::accelHandler;
     mHandlers[MagneticField] = &MPLSensor::compassHandler;
     mHandlers[Orientation] = &MPLSensor::orienHandler;
+    mHandlers[SignificantMotion] = &MPLSensor::sigMotionHandler;
+    mHandlers[StepDetector] = &MPLSensor::stepHandler;
+    mHandlers[GameRotationVector] = &MPLSensor::grvHandler;
+    mHandlers[GyroUncalibrated] = &MPLSensor::gyroUncalHandler;
+    mHandlers[MagneticFieldUncalibrated] = &MPLSensor::compassUncalHandler;
 
-    for (int i = 0; i < numSensors; i++)
+    for (int i = 0; i < numSensors; i++) {
         mDelays[i] = 30000000LLU; // 30 ms by default
+        mLatencies[i] = 0;
+        mDecimation[i] = 1;
+        mDecimCount[i] = 0;
+        mDirectChannels[i] = NULL;
+        mDirectDelays[i] = 0;
+        mDirectDecimation[i] = 1;
+        mDirectCount[i] = 0;
+    }
+    memcpy(mRequestedDelays, mDelays, sizeof(mDelays));
+    memcpy(mRequestedLatencies, mLatencies, sizeof(mLatencies));
 
     if (inv_serial_start(port) != INV_SUCCESS) {
         ALOGE("Fatal Error : could not open MPL serial interface");
@@ -237,6 +298,15 @@ MPLSensor::MPLSensor() :
 MPLSensor::~MPLSensor()
 {
     FUNC_LOG;
+    if (mCalThreadRunning) {
+        //the writer flushes a pending snapshot before exiting
+        pthread_mutex_lock(&mCalLock);
+        mCalExit = true;
+        pthread_cond_signal(&mCalCond);
+        pthread_mutex_unlock(&mCalLock);
+        pthread_join(mCalThread, NULL);
+    }
+
     pthread_mutex_lock(&mMplMutex);
     if (inv_dmp_stop() != INV_SUCCESS) {
         ALOGW("Error: could not stop the DMP correctly.\n");
@@ -251,28 +321,63 @@ MPLSensor::~MPLSensor()
     }
     pthread_mutex_unlock(&mMplMutex);
     pthread_mutex_destroy(&mMplMutex);
+    pthread_mutex_destroy(&mConfigLock);
+    pthread_mutex_destroy(&mCalLock);
+    pthread_cond_destroy(&mCalCond);
+}
+
+/* read the record of an irq which fired, the drivers merge the interrupts
+ * not read yet into one record of the latest irq time */
+bool MPLSensor::readIrq(int fd)
+{
+    struct mpuirq_data irqdata;
+
+    if (read(fd, &irqdata, sizeof(irqdata)) <= 0)
+        return false;
+    //keep the most recent of the irqs which fired
+    unsigned long long t = SensorTime::fromClock(MPUIRQ_CLOCK, irqdata.irqtime);
+    if (t > irq_timestamp)
+        irq_timestamp = t;
+    return true;
 }
 
 /* clear any data from our various filehandles */
 void MPLSensor::clearIrqData(bool* irq_set)
 {
     unsigned int i;
-    int nread;
-    struct mpuirq_data irqdata;
 
     poll(mPollFds, ARRAY_SIZE(mPollFds), 0); //check which ones need to be cleared
 
     for (i = 0; i < ARRAY_SIZE(mPollFds); i++) {
-        int cur_fd = mPollFds[i].fd;
         if (mPollFds[i].revents & POLLIN) {
-            nread = read(cur_fd, &irqdata, sizeof(irqdata));
-            if (nread > 0) {
+            if (readIrq(mPollFds[i].fd))
                 irq_set[i] = true;
-                irq_timestamp = irqdata.irqtime;
-            }
         }
         mPollFds[i].revents = 0;
     }
+    mIrqReady = 0;
+}
+
+/* an irq fd was reported readable by the poll loop, called from the poll
+ * thread before the readEvents which will read it */
+void MPLSensor::irqReady(int fd)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(mPollFds); i++) {
+        if (mPollFds[i].fd == fd)
+            mIrqReady |= 1 << i;
+    }
+}
+
+/* read the irqs reported by irqReady since the last readEvents, all of
+ * them are handled by a single inv_update_data */
+void MPLSensor::readReadyIrqs()
+{
+    for (size_t i = 0; mIrqReady && i < ARRAY_SIZE(mPollFds); i++) {
+        if (mIrqReady & (1 << i)) {
+            mIrqReady &= ~(1 << i);
+            readIrq(mPollFds[i].fd);
+        }
+    }
 }
 
 /* set the power states of the various sensors based on the bits set in the
@@ -285,22 +390,25 @@ void MPLSensor::setPowerStates(int enabled_sensors)
 
     if (LA_ENABLED || GR_ENABLED || RV_ENABLED || O_ENABLED) {
         mLocalSensorMask = ALL_MPL_SENSORS_NP;
-    } else if (!A_ENABLED && !M_ENABLED && !GY_ENABLED) {
+    } else if (!A_ENABLED && !M_ENABLED && !GY_ENABLED && !SM_ENABLED
+            && !SD_ENABLED && !GRV_ENABLED && !GYU_ENABLED && !MU_ENABLED) {
         mLocalSensorMask = 0;
     } else {
-        if (GY_ENABLED) {
+        //the game rotation vector is the DMP quaternion, without compass
+        if (GY_ENABLED || GRV_ENABLED || GYU_ENABLED) {
             mLocalSensorMask |= INV_THREE_AXIS_GYRO;
         } else {
             mLocalSensorMask &= ~INV_THREE_AXIS_GYRO;
         }
 
-        if (A_ENABLED) {
+        //the trigger sensors and the motion state run off the accelerometer
+        if (A_ENABLED || SM_ENABLED || SD_ENABLED || GRV_ENABLED) {
             mLocalSensorMask |= (INV_THREE_AXIS_ACCEL);
         } else {
             mLocalSensorMask &= ~(INV_THREE_AXIS_ACCEL);
         }
 
-        if (M_ENABLED) {
+        if (M_ENABLED || MU_ENABLED) {
             mLocalSensorMask |= INV_THREE_AXIS_COMPASS;
         } else {
             mLocalSensorMask &= ~(INV_THREE_AXIS_COMPASS);
@@ -312,10 +420,26 @@ void MPLSensor::setPowerStates(int enabled_sensors)
 
     unsigned long sen_mask = mLocalSensorMask & mMasterSensorMask;
 
-    bool changing_sensors = ((inv_get_dl_config()->requested_sensors
-            != sen_mask) && (sen_mask != 0));
+    unsigned long cur_mask = inv_get_dl_config()->requested_sensors;
+    bool changing_sensors = ((cur_mask != sen_mask) && (sen_mask != 0));
     bool restart = (!mDmpStarted) && (sen_mask != 0);
 
+    /* while the DMP keeps running, inv_set_mpu_sensors powers the slaves
+     * up and down on the fly: the FIFO contents are the same for every
+     * DMP mask, so only a switch in or out of the DMP modes restarts it */
+    if (changing_sensors && !restart && (cur_mask & INV_DMP_PROCESSOR)
+            && (sen_mask & INV_DMP_PROCESSOR)) {
+        ALOGV_IF(EXTRA_VERBOSE, "live sensor change %lx -> %lx", cur_mask,
+                sen_mask);
+        rv = inv_set_mpu_sensors(sen_mask);
+        if (rv == INV_SUCCESS) {
+            changing_sensors = false;
+            mLastPacketTime = 0;
+        } else {
+            ALOGW("live sensor change failed (%d), restarting the DMP", rv);
+        }
+    }
+
     if (changing_sensors || restart) {
 
         ALOGV_IF(EXTRA_VERBOSE, "cs:%d rs:%d ", changing_sensors, restart);
@@ -348,13 +472,6 @@ void MPLSensor::setPowerStates(int enabled_sensors)
         }
 
         if (!mDmpStarted) {
-            if (mHaveGoodMpuCal || mHaveGoodCompassCal) {
-                rv = inv_store_calibration();
-                ALOGE_IF(rv != INV_SUCCESS,
-                        "error: unable to store MPL calibration file");
-                mHaveGoodMpuCal = false;
-                mHaveGoodCompassCal = false;
-            }
             rv = inv_dmp_start();
             ALOGE_IF(rv != INV_SUCCESS, "unable to start dmp");
             mDmpStarted = true;
@@ -373,7 +490,162 @@ void MPLSensor::setPowerStates(int enabled_sensors)
 
         mDmpStarted = false;
         mCurFifoRate = -1;
+        mLastPacketTime = 0;
+
+        //nothing is waiting on the sensors now, save the calibration
+        if (mHaveGoodMpuCal || mHaveGoodCompassCal) {
+            queueCalibration();
+            mHaveGoodMpuCal = false;
+            mHaveGoodCompassCal = false;
+        }
+    }
+
+    updateBatching();
+}
+
+/* snapshot the calibration for the writer thread, which stores it without
+ * holding up the sensors.  Must be called with the mMplMutex held. */
+void MPLSensor::queueCalibration()
+{
+    FUNC_LOG;
+    inv_error_t rv;
+    unsigned int len;
+
+    if (!mCalThreadRunning) {
+        rv = inv_store_calibration();
+        ALOGE_IF(rv != INV_SUCCESS,
+                "error: unable to store MPL calibration file");
+        return;
+    }
+
+    pthread_mutex_lock(&mCalLock);
+    rv = inv_serialize_calibration((unsigned char*) mCalBuf, sizeof(mCalBuf),
+                                   &len);
+    if (rv == INV_SUCCESS) {
+        //a snapshot not written yet is simply replaced by the newer one
+        mCalLen = len;
+        pthread_cond_signal(&mCalCond);
+    } else {
+        ALOGE("error: unable to serialize MPL calibration (%d)", (int) rv);
+    }
+    pthread_mutex_unlock(&mCalLock);
+}
+
+void* MPLSensor::calWriterThread(void* arg)
+{
+    static_cast<MPLSensor*>(arg)->calWriterLoop();
+    return NULL;
+}
+
+/* writes the queued calibration snapshots, at most one per
+ * MPL_CAL_WRITE_INTERVAL_NS; the last one is written right away on exit */
+void MPLSensor::calWriterLoop()
+{
+    unsigned long long buf[ARRAY_SIZE(mCalBuf)];
+    int64_t nextWrite = 0;
+    struct timespec ts;
+
+    pthread_mutex_lock(&mCalLock);
+    for (;;) {
+        unsigned int len;
+        int64_t now;
+
+        while (!mCalLen && !mCalExit && !mCalLoadPending)
+            pthread_cond_wait(&mCalCond, &mCalLock);
+        if (mCalLoadPending && !mCalExit) {
+            mCalLoadPending = false;
+            pthread_mutex_unlock(&mCalLock);
+            loadDeferredCalibration();
+            pthread_mutex_lock(&mCalLock);
+            continue;
+        }
+        if (!mCalLen)
+            break;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        //the interval is also bounded in case the wall clock went back
+        if (!mCalExit && now < nextWrite
+                && nextWrite - now <= MPL_CAL_WRITE_INTERVAL_NS) {
+            ts.tv_sec = nextWrite / 1000000000LL;
+            ts.tv_nsec = nextWrite % 1000000000LL;
+            pthread_cond_timedwait(&mCalCond, &mCalLock, &ts);
+            continue;
+        }
+
+        len = mCalLen;
+        memcpy(buf, mCalBuf, len);
+        mCalLen = 0;
+        pthread_mutex_unlock(&mCalLock);
+
+        if (inv_serial_write_cal((unsigned char*) buf, len) != INV_SUCCESS)
+            ALOGE("error: unable to store MPL calibration file");
+        nextWrite = now + MPL_CAL_WRITE_INTERVAL_NS;
+
+        pthread_mutex_lock(&mCalLock);
+    }
+    pthread_mutex_unlock(&mCalLock);
+}
+
+/* let the DMP FIFO fill up to the smallest report latency of the enabled
+ * sensors and drain it from the timerirq instead of taking a FIFO interrupt
+ * per sample.  Batching needs the DMP, the timerirq is otherwise used by the
+ * non DMP modes only.  It must be called with the mMplMutex held. */
+void MPLSensor::updateBatching()
+{
+    int period = 0;
+
+    if (mDmpStarted
+            && (inv_get_dl_config()->requested_sensors & INV_DMP_PROCESSOR)) {
+        int64_t latency = -1;
+        for (int i = 0; i < numSensors; i++) {
+            if ((mEnabled & (1 << i))
+                    && (latency < 0 || mLatencies[i] < latency))
+                latency = mLatencies[i];
+        }
+
+        if (latency > 0) {
+            int step = inv_get_sample_step_size_ms();
+            //leave a quarter of the FIFO as margin for the read latency
+            int max = inv_get_fifo_max_packets() * step * 3 / 4;
+
+            period = latency / 1000000LL;
+            if (period > max)
+                period = max;
+            if (period <= step)
+                period = 0;
+        }
+    }
+
+    if (period == mBatchPeriodMs)
+        return;
+
+    if (period) {
+        inv_set_fifo_interrupt(0);
+        ioctl(mIrqFds.valueFor(TIMERIRQ_FD), TIMERIRQ_START,
+              (unsigned long) period);
+    } else {
+        ioctl(mIrqFds.valueFor(TIMERIRQ_FD), TIMERIRQ_STOP, 0);
+        if (mDmpStarted)
+            inv_set_fifo_interrupt(1);
+    }
+    ALOGV_IF(EXTRA_VERBOSE, "batching period %d ms", period);
+    mBatchPeriodMs = period;
+}
+
+/* the calibration loaded after the HAL is open, on the writer thread.  The
+ * sensors run on the factory biases until it is in. */
+void MPLSensor::loadDeferredCalibration()
+{
+    struct tuna_boot_profile profile;
+
+    tuna_boot_profile_begin(&profile, "sensors.deferred");
+    pthread_mutex_lock(&mMplMutex);
+    if (inv_load_calibration() != INV_SUCCESS) {
+        ALOGE("could not open MPL calibration file");
     }
+    pthread_mutex_unlock(&mMplMutex);
+    tuna_boot_profile_phase(&profile, "calibration");
 }
 
 /**
@@ -384,7 +656,9 @@ void MPLSensor::initMPL()
     FUNC_LOG;
     inv_error_t result;
     unsigned short bias_update_mask = 0xFFFF;
+    struct tuna_boot_profile profile;
 
+    tuna_boot_profile_begin(&profile, "sensors.mpl");
     if (inv_dmp_open() != INV_SUCCESS) {
         ALOGE("Fatal Error : could not open DMP correctly.\n");
     }
@@ -392,9 +666,18 @@ void MPLSensor::initMPL()
     result = inv_set_mpu_sensors(ALL_MPL_SENSORS_NP); //default to all sensors, also makes 9axis enable work
     ALOGE_IF(result != INV_SUCCESS,
             "Fatal Error : could not set enabled sensors.");
+    tuna_boot_profile_phase(&profile, "dmp_open");
 
-    if (inv_load_calibration() != INV_SUCCESS) {
-        ALOGE("could not open MPL calibration file");
+    if (mCalThreadRunning && tuna_deferred_init()) {
+        pthread_mutex_lock(&mCalLock);
+        mCalLoadPending = true;
+        pthread_cond_signal(&mCalCond);
+        pthread_mutex_unlock(&mCalLock);
+    } else {
+        if (inv_load_calibration() != INV_SUCCESS) {
+            ALOGE("could not open MPL calibration file");
+        }
+        tuna_boot_profile_phase(&profile, "calibration");
     }
 
     //check for the 9axis fusion library: if available load it and start 9x
@@ -418,6 +701,8 @@ void MPLSensor::initMPL()
         const char* error = dlerror();
         ALOGE("libinvensense_mpl.so not found, 9x sensor fusion disabled (%s)",error);
     }
+    //not deferred: the sensor list depends on it
+    tuna_boot_profile_phase(&profile, "9x_fusion");
 
     if (inv_set_bias_update(bias_update_mask) != INV_SUCCESS) {
         ALOGE("Error : Bias update function could not be set.\n");
@@ -437,6 +722,8 @@ void MPLSensor::initMPL()
     }
 
     setupCallbacks();
+    tuna_boot_profile_phase(&profile, "interrupts");
+    tuna_boot_profile_end(&profile);
 }
 
 /** setup the fifo contents.
@@ -446,6 +733,9 @@ void MPLSensor::setupFIFO()
     FUNC_LOG;
     inv_error_t result;
 
+    //each element writes a few DMP keys, send them together
+    inv_begin_mpu_memory_batch();
+
     result = inv_send_accel(INV_ALL, INV_32_BIT);
     if (result != INV_SUCCESS) {
         ALOGE("Fatal error: inv_send_accel returned %d\n", result);
@@ -476,6 +766,11 @@ void MPLSensor::setupFIFO()
     if (result != INV_SUCCESS) {
         ALOGE("Fatal error: inv_send_gyro returned %d\n", result);
     }
+
+    result = inv_flush_mpu_memory_batch();
+    if (result != INV_SUCCESS) {
+        ALOGE("Fatal error: inv_flush_mpu_memory_batch returned %d\n", result);
+    }
 }
 
 /**
@@ -499,6 +794,10 @@ void MPLSensor::setupCallbacks()
 void MPLSensor::cbOnMotion(uint16_t val)
 {
     FUNC_LOG;
+    mMotion = (val == INV_MOTION);
+    if (!mMotion && mMotionMs > 0)
+        mMotionMs = 0;
+
     //after the first no motion, the gyro should be calibrated well
     if (val == 2) {
         if ((inv_get_dl_config()->requested_sensors) & INV_THREE_AXIS_GYRO) {
@@ -510,9 +809,155 @@ void MPLSensor::cbOnMotion(uint16_t val)
 }
 
 
+/* called once per decoded FIFO packet from inv_update_data, with the
+ * mMplMutex held.  Each packet is turned into events right away since the
+ * MPL state only holds the latest one; the packet index stands in for the
+ * timestamp until the whole burst has been read. */
 void MPLSensor::cbProcData()
 {
     mNewData = 1;
+    mPacketCount++;
+
+    for (int i = 0; i < numSensors; i++) {
+        if (mEnabled & (1 << i)) {
+            bool poll = false, direct = false;
+
+            if ((mPollEnabled & (1 << i)) && ++mDecimCount[i] >= mDecimation[i]) {
+                mDecimCount[i] = 0;
+                poll = true;
+            }
+            if (mDirectChannels[i] && ++mDirectCount[i] >= mDirectDecimation[i]) {
+                mDirectCount[i] = 0;
+                direct = mNumDirectEvents < MPL_EVENT_RING_SIZE;
+            }
+            if (!poll && !direct)
+                continue;
+
+            uint32_t mask = 0;
+            CALL_MEMBER_FN(this,mHandlers[i])(mPendingEvents + i, &mask, i);
+            if (mask) {
+                mPendingEvents[i].timestamp = mPacketCount - 1;
+                if (poll)
+                    queueEvent(mPendingEvents + i);
+                if (direct)
+                    mDirectEvents[mNumDirectEvents++] = mPendingEvents[i];
+            }
+        }
+    }
+}
+
+/* hand the events of the last burst to their direct channels, once their
+ * timestamps are known.  It must be called with the mMplMutex held. */
+void MPLSensor::writeDirectEvents()
+{
+    for (int i = 0; i < mNumDirectEvents; i++) {
+        sensors_event_t* ev = &mDirectEvents[i];
+        int what = handleToDriver(ev->sensor);
+
+        if (!mDirectChannels[what])
+            continue;
+        ev->timestamp = packetTimestamp(ev->timestamp);
+        //the report token is the sensor handle plus one, 0 is not valid
+        mDirectChannels[what]->write(ev, ev->sensor + 1);
+    }
+    mNumDirectEvents = 0;
+}
+
+/* start (ns > 0) or stop a report of a sensor into a direct channel.  The
+ * sensor keeps running for the direct channel whether or not it is
+ * activated for the poll. */
+int MPLSensor::configDirectReport(int32_t handle, DirectChannel* channel, int64_t ns)
+{
+    FUNC_LOG;
+
+    int what = handleToDriver(handle);
+
+    if (uint32_t(what) >= numSensors || isTrigger(what))
+        return -EINVAL;
+
+    pthread_mutex_lock(&mMplMutex);
+    if (ns > 0) {
+        mDirectChannels[what] = channel;
+        mDirectDelays[what] = ns;
+    } else if (!channel || mDirectChannels[what] == channel) {
+        mDirectChannels[what] = NULL;
+    }
+    pthread_mutex_unlock(&mMplMutex);
+
+    pthread_mutex_lock(&mConfigLock);
+    mConfigPending = true;
+    pthread_mutex_unlock(&mConfigLock);
+    return 0;
+}
+
+/* the channel may be freed once this returns */
+void MPLSensor::stopDirectReports(DirectChannel* channel)
+{
+    FUNC_LOG;
+    bool changed = false;
+
+    pthread_mutex_lock(&mMplMutex);
+    for (int i = 0; i < numSensors; i++) {
+        if (mDirectChannels[i] == channel) {
+            mDirectChannels[i] = NULL;
+            changed = true;
+        }
+    }
+    pthread_mutex_unlock(&mMplMutex);
+
+    if (changed) {
+        pthread_mutex_lock(&mConfigLock);
+        mConfigPending = true;
+        pthread_mutex_unlock(&mConfigLock);
+    }
+}
+
+/* the oldest events are dropped when the reader falls behind.
+ * It must be called with the mMplMutex held. */
+void MPLSensor::queueEvent(sensors_event_t const* event)
+{
+    if (mRingCount == MPL_EVENT_RING_SIZE) {
+        mDroppedEvents++;
+        mRingHead = (mRingHead + 1) % MPL_EVENT_RING_SIZE;
+        mRingCount--;
+    }
+    mEventRing[(mRingHead + mRingCount) % MPL_EVENT_RING_SIZE] = *event;
+    mRingCount++;
+    if (mBurstEvents < mRingCount)
+        mBurstEvents++;
+}
+
+/* place the packets decoded by the last inv_update_data in time.  The DMP
+ * samples at a fixed step, so a burst read on a single irq is spread back
+ * from the newest packet.  That one is placed a step after the previous
+ * burst as long as this stays within a step of the irq time, which is the
+ * drain time when batching, and at the irq time otherwise.
+ * It must be called with the mMplMutex held, once per inv_update_data. */
+void MPLSensor::syncPacketTime()
+{
+    int64_t irq_ts = irq_timestamp;
+
+    mPacketStep = 0;
+    if (!mDmpStarted || mPacketCount <= 0
+            || !(inv_get_dl_config()->requested_sensors & INV_DMP_PROCESSOR)) {
+        mLastPacketTime = irq_ts;
+        return;
+    }
+
+    mPacketStep = inv_get_sample_step_size_ms() * 1000000LL;
+    int64_t newest = mLastPacketTime + mPacketCount * mPacketStep;
+
+    if (!mLastPacketTime || newest > irq_ts || newest <= irq_ts - 2 * mPacketStep)
+        newest = irq_ts;
+    mLastPacketTime = newest;
+}
+
+/* time of the packet at index of the ones decoded by the last
+ * inv_update_data, counting from 0.  It must be called with the mMplMutex
+ * held, after syncPacketTime. */
+int64_t MPLSensor::packetTimestamp(int index) const
+{
+    return mLastPacketTime - (mPacketCount - 1 - index) * mPacketStep;
 }
 
 // these handlers transform mpl data into one of the Android sensor types.
@@ -576,22 +1021,54 @@ void MPLSensor::compassHandler(sensors_event_t* s, uint32_t* pending_mask,
         *pending_mask |= (1 << index);
 }
 
-void MPLSensor::rvHandler(sensors_event_t* s, uint32_t* pending_mask,
-                           int index)
+/* the gyro as read from the FIFO, before the hardware offsets took the MPL
+ * bias estimate out, along with that bias */
+void MPLSensor::gyroUncalHandler(sensors_event_t* s, uint32_t* pending_mask,
+                                  int index)
 {
     VFUNC_LOG;
-    float quat[4];
-    float norm = 0;
+    float gyro[3], bias[3];
     inv_error_t res;
 
-    res = inv_get_quaternion_float(quat);
+    res = inv_get_gyro_float(gyro);
+    if (res == INV_SUCCESS)
+        res = inv_get_gyro_bias_float(bias);
+    if (res != INV_SUCCESS)
+        return;
 
-    if (res != INV_SUCCESS) {
-        *pending_mask &= ~(1 << index);
+    for (int i = 0; i < 3; i++) {
+        s->uncalibrated_gyro.uncalib[i] = (gyro[i] + bias[i]) * M_PI / 180.0;
+        s->uncalibrated_gyro.bias[i] = bias[i] * M_PI / 180.0;
+    }
+    *pending_mask |= (1 << index);
+}
+
+/* the compass with its soft iron correction, the hard iron bias estimate of
+ * the MPL is reported instead of being removed */
+void MPLSensor::compassUncalHandler(sensors_event_t* s, uint32_t* pending_mask,
+                                     int index)
+{
+    VFUNC_LOG;
+    float mag[3], bias[3];
+    inv_error_t res;
+
+    res = inv_get_magnetometer_float(mag);
+    if (res == INV_SUCCESS)
+        res = inv_get_magnetometer_bias_float(bias);
+    if (res != INV_SUCCESS)
         return;
-    } else {
-        *pending_mask |= (1 << index);
+
+    for (int i = 0; i < 3; i++) {
+        s->uncalibrated_magnetic.uncalib[i] = mag[i] + bias[i];
+        s->uncalibrated_magnetic.bias[i] = bias[i];
     }
+    *pending_mask |= (1 << index);
+}
+
+/* fills a rotation vector event from a unit quaternion, w first */
+static void quatToRotationVector(sensors_event_t* s, float* quat)
+{
+    float norm = 0;
 
     norm = quat[1] * quat[1] + quat[2] * quat[2] + quat[3] * quat[3]
             + FLT_EPSILON;
@@ -620,6 +1097,49 @@ void MPLSensor::rvHandler(sensors_event_t* s, uint32_t* pending_mask,
     s->data[4] = -1;      // "estimated heading Accuracy (in radians) (-1 if unavailable)"
 }
 
+void MPLSensor::rvHandler(sensors_event_t* s, uint32_t* pending_mask,
+                           int index)
+{
+    VFUNC_LOG;
+    float quat[4];
+    inv_error_t res;
+
+    res = inv_get_quaternion_float(quat);
+
+    if (res != INV_SUCCESS) {
+        *pending_mask &= ~(1 << index);
+        return;
+    } else {
+        *pending_mask |= (1 << index);
+    }
+
+    quatToRotationVector(s, quat);
+}
+
+/* the DMP quaternion, before the MPL corrects its heading with the compass */
+void MPLSensor::grvHandler(sensors_event_t* s, uint32_t* pending_mask,
+                            int index)
+{
+    VFUNC_LOG;
+    long q30[4];
+    float quat[4];
+    inv_error_t res;
+
+    res = inv_get_6axis_quaternion(q30);
+
+    if (res != INV_SUCCESS) {
+        *pending_mask &= ~(1 << index);
+        return;
+    } else {
+        *pending_mask |= (1 << index);
+    }
+
+    for (int i = 0; i < 4; i++)
+        quat[i] = q30[i] / (float)(1L << 30);
+    quatToRotationVector(s, quat);
+    s->data[4] = 0;
+}
+
 void MPLSensor::laHandler(sensors_event_t* s, uint32_t* pending_mask,
                            int index)
 {
@@ -708,6 +1228,72 @@ void MPLSensor::orienHandler(sensors_event_t* s, uint32_t* pending_mask,
         ALOGW("orienHandler: data not valid (%d)", (int) res);
 }
 
+/* time the packets seen by a handler stand for, from the DMP step and the
+ * decimation.  It must be called with the mMplMutex held. */
+int MPLSensor::triggerStepMs(int index) const
+{
+    int step = inv_get_sample_step_size_ms();
+    return (step > 0 ? step : 1) * mDecimation[index];
+}
+
+/* one-shot: fires once the MPL motion state, from the DMP motion interrupt
+ * and the no motion detection, stayed in motion for MPL_SIG_MOTION_MS, then
+ * disables itself */
+void MPLSensor::sigMotionHandler(sensors_event_t* s, uint32_t* pending_mask,
+                                 int index)
+{
+    VFUNC_LOG;
+
+    if (mMotionMs < 0 || !mMotion)
+        return;
+    mMotionMs += triggerStepMs(index);
+    if (mMotionMs < MPL_SIG_MOTION_MS)
+        return;
+
+    mMotionMs = -1;
+    s->data[0] = 1.0f;
+    *pending_mask |= (1 << index);
+
+    //the event is still delivered, the next applyConfig powers it down
+    pthread_mutex_lock(&mConfigLock);
+    mRequestedEnabled &= ~(1 << index);
+    mConfigPending = true;
+    pthread_mutex_unlock(&mConfigLock);
+}
+
+/* peaks of the acceleration magnitude while the MPL sees motion, so that
+ * the device lying still or being turned over slowly counts no steps */
+void MPLSensor::stepHandler(sensors_event_t* s, uint32_t* pending_mask,
+                            int index)
+{
+    VFUNC_LOG;
+    float a[3];
+
+    if (mStepMs < MPL_STEP_MIN_MS)
+        mStepMs += triggerStepMs(index);
+    if (!mMotion) {
+        mStepArmed = false;
+        return;
+    }
+    if (inv_get_accel_float(a) != INV_SUCCESS)
+        return;
+
+    float g = sqrtf(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+    if (g < MPL_STEP_VALLEY_G) {
+        mStepArmed = true;
+    } else if (mStepArmed && g > MPL_STEP_PEAK_G
+            && mStepMs >= MPL_STEP_MIN_MS) {
+        mStepArmed = false;
+        mStepMs = 0;
+        s->data[0] = 1.0f;
+        *pending_mask |= (1 << index);
+    }
+}
+
+/* enable, setDelay and batch only record the request: the poll thread
+ * applies it at the start of its next read, so that the I2C traffic of a
+ * reconfiguration never has to wait for a FIFO drain and the other way
+ * around.  The poll context wakes the poll thread after each request. */
 int MPLSensor::enable(int32_t handle, int en)
 {
     FUNC_LOG;
@@ -717,23 +1303,15 @@ int MPLSensor::enable(int32_t handle, int en)
     if (uint32_t(what) >= numSensors)
         return -EINVAL;
 
-    int newState = en ? 1 : 0;
-    int err = 0;
-
-    pthread_mutex_lock(&mMplMutex);
-    if ((uint32_t(newState) << what) != (mEnabled & (1 << what))) {
-        short flags = newState;
-        mEnabled &= ~(1 << what);
-        mEnabled |= (uint32_t(flags) << what);
-        ALOGV_IF(EXTRA_VERBOSE, "mEnabled = %x", mEnabled);
-        setPowerStates(mEnabled);
-        pthread_mutex_unlock(&mMplMutex);
-        if (!newState)
-            update_delay();
-        return err;
-    }
-    pthread_mutex_unlock(&mMplMutex);
-    return err;
+    pthread_mutex_lock(&mConfigLock);
+    if (en)
+        mRequestedEnabled |= (1 << what);
+    else
+        mRequestedEnabled &= ~(1 << what);
+    ALOGV_IF(EXTRA_VERBOSE, "requested enabled = %x", mRequestedEnabled);
+    mConfigPending = true;
+    pthread_mutex_unlock(&mConfigLock);
+    return 0;
 }
 
 int MPLSensor::setDelay(int32_t handle, int64_t ns)
@@ -750,45 +1328,149 @@ int MPLSensor::setDelay(int32_t handle, int64_t ns)
     if (ns < 0)
         return -EINVAL;
 
-    pthread_mutex_lock(&mMplMutex);
-    mDelays[what] = ns;
-    pthread_mutex_unlock(&mMplMutex);
-    return update_delay();
+    pthread_mutex_lock(&mConfigLock);
+    mRequestedDelays[what] = isTrigger(what) ? MPL_TRIGGER_DELAY_NS : ns;
+    mConfigPending = true;
+    pthread_mutex_unlock(&mConfigLock);
+    return 0;
+}
+
+int MPLSensor::batch(int32_t handle, int flags, int64_t ns, int64_t timeout)
+{
+    FUNC_LOG;
+
+    int what = handleToDriver(handle);
+
+    if (uint32_t(what) >= numSensors)
+        return -EINVAL;
+
+    if (ns < 0 || timeout < 0)
+        return -EINVAL;
+
+    if (flags & SENSORS_BATCH_DRY_RUN)
+        return 0;
+
+    pthread_mutex_lock(&mConfigLock);
+    mRequestedDelays[what] = isTrigger(what) ? MPL_TRIGGER_DELAY_NS : ns;
+    mRequestedLatencies[what] = what == SignificantMotion ?
+            MPL_SIG_MOTION_LATENCY_NS : timeout;
+    mConfigPending = true;
+    pthread_mutex_unlock(&mConfigLock);
+    return 0;
 }
 
+int MPLSensor::flush(int32_t handle)
+{
+    FUNC_LOG;
+
+    int what = handleToDriver(handle);
+
+    //one-shot sensors have nothing to flush
+    if (uint32_t(what) >= numSensors || what == SignificantMotion)
+        return -EINVAL;
+
+    pthread_mutex_lock(&mConfigLock);
+    if (!(mRequestedEnabled & (1 << what))) {
+        pthread_mutex_unlock(&mConfigLock);
+        return -EINVAL;
+    }
+    //the next readEvents drains the FIFO whether or not an irq came in
+    mFlushPending = true;
+    pthread_mutex_unlock(&mConfigLock);
+    return 0;
+}
+
+bool MPLSensor::hasPendingEvents() const
+{
+    return mFlushPending || mConfigPending || mRingCount;
+}
+
+/* bring the sensor state in line with the last requests, between two
+ * FIFO drains.  It must be called with the mMplMutex held. */
+void MPLSensor::applyConfig()
+{
+    uint32_t enabled;
+
+    pthread_mutex_lock(&mConfigLock);
+    if (!mConfigPending) {
+        pthread_mutex_unlock(&mConfigLock);
+        return;
+    }
+    //the trigger sensors start over when they are enabled
+    uint32_t started = mRequestedEnabled & ~mPollEnabled;
+    if (started & (1 << SignificantMotion))
+        mMotionMs = 0;
+    if (started & (1 << StepDetector)) {
+        mStepMs = MPL_STEP_MIN_MS;
+        mStepArmed = false;
+    }
+    mPollEnabled = mRequestedEnabled;
+    memcpy(mDelays, mRequestedDelays, sizeof(mDelays));
+    memcpy(mLatencies, mRequestedLatencies, sizeof(mLatencies));
+    mConfigPending = false;
+    pthread_mutex_unlock(&mConfigLock);
+
+    enabled = mPollEnabled;
+    for (int i = 0; i < numSensors; i++) {
+        if (mDirectChannels[i])
+            enabled |= (1 << i);
+    }
+    if (enabled != mEnabled) {
+        mEnabled = enabled;
+        ALOGV_IF(EXTRA_VERBOSE, "mEnabled = %x", mEnabled);
+        setPowerStates(mEnabled);
+    }
+    update_delay();
+}
+
+/* program the FIFO rate for the fastest enabled sensor.
+ * It must be called with the mMplMutex held. */
 int MPLSensor::update_delay()
 {
     FUNC_LOG;
     int rv = 0;
     bool irq_set[5];
 
-    pthread_mutex_lock(&mMplMutex);
-
     if (mEnabled) {
         uint64_t wanted = -1LLU;
         for (int i = 0; i < numSensors; i++) {
             if (mEnabled & (1 << i)) {
-                uint64_t ns = mDelays[i];
+                uint64_t ns = (mPollEnabled & (1 << i)) ? mDelays[i] : -1LLU;
+                if (mDirectChannels[i] && mDirectDelays[i] < ns)
+                    ns = mDirectDelays[i];
+                uint64_t min = minDelay(i);
+                ns = ns > min ? ns : min;
                 wanted = wanted < ns ? wanted : ns;
             }
         }
 
-        //Limit all rates to 100Hz max. 100Hz = 10ms = 10000000ns
-        if (wanted < 10000000LLU) {
-            wanted = 10000000LLU;
-        }
-
         int rate = ((wanted) / 5000000LLU) - ((wanted % 5000000LLU == 0) ? 1
                                                                          : 0); //mpu fifo rate is in increments of 5ms
-        if (rate == 0) //KLP disallow fifo rate 0
+        if (rate == 0 && wanted > (uint64_t) MPL_HIGH_RATE_DELAY_NS) //KLP disallow fifo rate 0
             rate = 1;
 
+        //the sensors slower than the FIFO, by request or by their rate cap,
+        //get every n-th packet
+        for (int i = 0; i < numSensors; i++) {
+            int64_t step = (rate + 1) * 5000000LL;
+            int64_t delay = mDelays[i] > (uint64_t) minDelay(i) ?
+                    mDelays[i] : minDelay(i);
+            int n = delay / step;
+            mDecimation[i] = n > 1 ? n : 1;
+
+            int64_t period = mDirectDelays[i] > (uint64_t) minDelay(i) ?
+                    mDirectDelays[i] : minDelay(i);
+            n = period / step;
+            mDirectDecimation[i] = n > 1 ? n : 1;
+        }
+
         if (rate != mCurFifoRate) {
             inv_error_t res; // = inv_dmp_stop();
             res = inv_set_fifo_rate(rate);
             ALOGE_IF(res != INV_SUCCESS, "error setting FIFO rate");
 
             mCurFifoRate = rate;
+            mLastPacketTime = 0;
             rv = (res == INV_SUCCESS);
         }
 
@@ -811,23 +1493,28 @@ int MPLSensor::update_delay()
             }
         }
 
+        updateBatching();
     }
-    pthread_mutex_unlock(&mMplMutex);
     return rv;
 }
 
 int MPLSensor::readEvents(sensors_event_t* data, int count)
 {
     //VFUNC_LOG;
-    bool irq_set[5] = { false, false, false, false, false };
     inv_error_t rv;
     if (count < 1)
         return -EINVAL;
+    TUNA_TRACE_SCOPE("MPLSensor::readEvents");
     int numEventReceived = 0;
 
-    clearIrqData(irq_set);
+    readReadyIrqs();
 
     pthread_mutex_lock(&mMplMutex);
+    applyConfig();
+    mFlushPending = false;
+    mPacketCount = 0;
+    mBurstEvents = 0;
+    mNumDirectEvents = 0;
     if (mDmpStarted) {
         rv = inv_update_data();
         ALOGE_IF(rv != INV_SUCCESS, "inv_update_data error (code %d)", (int) rv);
@@ -837,32 +1524,35 @@ int MPLSensor::readEvents(sensors_event_t* data, int count)
                 "MPLSensor::readEvents called, but there's nothing to do.");
     }
 
-    pthread_mutex_unlock(&mMplMutex);
+    if (mNewData) {
+        mNewData = 0;
 
-    if (!mNewData) {
-        ALOGV_IF(EXTRA_VERBOSE, "no new data");
-        return 0;
-    }
-    mNewData = 0;
-
-    /* google timestamp */
-    pthread_mutex_lock(&mMplMutex);
-    for (int i = 0; i < numSensors; i++) {
-        if (mEnabled & (1 << i)) {
-            CALL_MEMBER_FN(this,mHandlers[i])(mPendingEvents + i,
-                                              &mPendingMask, i);
-            mPendingEvents[i].timestamp = irq_timestamp;
+        /* google timestamp */
+        syncPacketTime();
+        for (int i = mRingCount - mBurstEvents; i < mRingCount; i++) {
+            sensors_event_t* ev =
+                    &mEventRing[(mRingHead + i) % MPL_EVENT_RING_SIZE];
+            ev->timestamp = packetTimestamp(ev->timestamp);
         }
+        writeDirectEvents();
+    } else {
+        ALOGV_IF(EXTRA_VERBOSE && !mRingCount, "no new data");
     }
-
-    for (int j = 0; count && mPendingMask && j < numSensors; j++) {
-        if (mPendingMask & (1 << j)) {
-            mPendingMask &= ~(1 << j);
-            if (mEnabled & (1 << j)) {
-                *data++ = mPendingEvents[j];
-                count--;
-                numEventReceived++;
-            }
+    ALOGW_IF(mDroppedEvents, "event ring full, dropped %d events", mDroppedEvents);
+    mDroppedEvents = 0;
+
+    //events of sensors disabled meanwhile are dropped, but for the one-shot
+    //which disabled itself when it fired
+    while (count && mRingCount) {
+        sensors_event_t const* ev = &mEventRing[mRingHead];
+        int what = handleToDriver(ev->sensor);
+        mRingHead = (mRingHead + 1) % MPL_EVENT_RING_SIZE;
+        mRingCount--;
+        if ((mPollEnabled & (1 << what))
+                || (what == SignificantMotion && mMotionMs < 0)) {
+            *data++ = *ev;
+            count--;
+            numEventReceived++;
         }
     }
 
@@ -909,10 +1599,36 @@ void MPLSensor::handlePowerEvent()
     ioctl(fd, MPU_PM_EVENT_HANDLED, 0);
 }
 
+/* keep the DMP running through a suspend for a wake-up client outside of
+ * the MPL, as long as it has an MPL sensor enabled */
+void MPLSensor::setWakeUpRequested(bool requested)
+{
+    pthread_mutex_lock(&mConfigLock);
+    mWakeUpRequested = requested;
+    pthread_mutex_unlock(&mConfigLock);
+}
+
 void MPLSensor::sleepEvent()
 {
     VFUNC_LOG;
     pthread_mutex_lock(&mMplMutex);
+    pthread_mutex_lock(&mConfigLock);
+    bool wake_up = mWakeUpRequested && mEnabled;
+    pthread_mutex_unlock(&mConfigLock);
+    if (mDmpStarted && (wake_up || (mEnabled & MPL_WAKE_UP_SENSORS))) {
+        //leave the DMP alone, only its motion interrupt may wake us up
+        if (mBatchPeriodMs)
+            ioctl(mIrqFds.valueFor(TIMERIRQ_FD), TIMERIRQ_STOP, 0);
+        inv_set_fifo_interrupt(0);
+        if (inv_set_ignore_system_suspend(TRUE) == INV_SUCCESS) {
+            mSuspendRunning = true;
+            pthread_mutex_unlock(&mMplMutex);
+            return;
+        }
+        ALOGW("could not keep the DMP running, stopping it for the suspend");
+        mBatchPeriodMs = -1;
+        updateBatching();
+    }
     if (mEnabled != 0) {
         mForceSleep = true;
         mOldEnabledMask = mEnabled;
@@ -925,6 +1641,15 @@ void MPLSensor::wakeEvent()
 {
     VFUNC_LOG;
     pthread_mutex_lock(&mMplMutex);
+    if (mSuspendRunning) {
+        inv_set_ignore_system_suspend(FALSE);
+        //nobody drained the FIFO while suspended, drop what it holds
+        inv_reset_fifo();
+        mLastPacketTime = 0;
+        mBatchPeriodMs = -1;
+        updateBatching();
+        mSuspendRunning = false;
+    }
     if (mForceSleep) {
         setPowerStates((mOldEnabledMask | mEnabled));
         mForceSleep = false;
@@ -934,12 +1659,13 @@ void MPLSensor::wakeEvent()
 
 /** fill in the sensor list based on which sensors are configured.
  *  return the number of configured sensors.
- *  parameter list must point to a memory region of at least 7*sizeof(sensor_t)
+ *  parameter list must point to a memory region of at least
+ *  numSensors*sizeof(sensor_t), in the order of the sensor enum
  *  parameter len gives the length of the buffer pointed to by list
  */
 int MPLSensor::populateSensorList(struct sensor_t *list, size_t len)
 {
-    int numsensors = 7;
+    int numsensors = numSensors;
 
     if (len < numsensors * sizeof(sensor_t)) {
         ALOGE("sensor list too small, not populating.");
@@ -947,9 +1673,25 @@ int MPLSensor::populateSensorList(struct sensor_t *list, size_t len)
     }
 
     if (!mNineAxisEnabled) {
-        /* no 9-axis sensors, zero fill that part of the list */
+        /* no 9-axis sensors, the trigger sensors, the game rotation
+         * vector and the uncalibrated sensors, which only need the DMP,
+         * follow the raw ones and the rest of the list is zero filled */
+        int dmp = numSensors - SignificantMotion;
         numsensors = 3;
-        memset(list + numsensors, 0, (7 - numsensors) * sizeof(struct sensor_t));
+        memmove(list + numsensors, list + SignificantMotion,
+                dmp * sizeof(struct sensor_t));
+        numsensors += dmp;
+        memset(list + numsensors, 0,
+               (numSensors - numsensors) * sizeof(struct sensor_t));
+    }
+
+    for (int i = 0; i < numsensors; i++) {
+        int what = handleToDriver(list[i].handle);
+        //the trigger sensors keep their reporting mode delays
+        if (isTrigger(what))
+            continue;
+        list[i].fifoMaxEventCount = inv_get_fifo_max_packets();
+        list[i].minDelay = minDelay(what) / 1000;
     }
 
     return numsensors;
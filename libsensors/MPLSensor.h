@@ -23,10 +23,46 @@
 #include <sys/cdefs.h>
 #include <sys/types.h>
 #include <poll.h>
+#include <pthread.h>
 #include <utils/Vector.h>
 #include <utils/KeyedVector.h>
 #include "sensors.h"
 #include "SensorBase.h"
+#include "DirectChannel.h"
+#include "ml_stored_data.h"
+
+/* decoded events waiting for readEvents, enough for a full DMP FIFO of the
+ * smallest packets with every sensor enabled */
+#define MPL_EVENT_RING_SIZE 256
+
+/* fastest sampling periods: the gyro and the rotation vector may run the
+ * DMP at its full 200Hz, the other sensors stay capped to 100Hz */
+#define MPL_HIGH_RATE_DELAY_NS  5000000LL
+#define MPL_MAX_RATE_DELAY_NS   10000000LL
+
+/* minimum time between two writes of the calibration file, to spare the
+ * eMMC when sensors are toggled often */
+#define MPL_CAL_WRITE_INTERVAL_NS 60000000000LL
+
+/* wake-up sensors, the DMP keeps running through a suspend while one of
+ * them is enabled, or setWakeUpRequested asked for it, and wakes the system
+ * with its motion interrupt */
+#define MPL_WAKE_UP_SENSORS (1 << ID_SM)
+
+/* the trigger sensors are computed from the accelerometer packets at this
+ * period, whatever rate they are asked for */
+#define MPL_TRIGGER_DELAY_NS 20000000LL
+
+/* the MPL has to see motion for this long before it is significant, the
+ * report may come that late anyway so the FIFO is drained in batches */
+#define MPL_SIG_MOTION_MS 5000
+#define MPL_SIG_MOTION_LATENCY_NS 1000000000LL
+
+/* a step is a peak of |a| above MPL_STEP_PEAK_G after it fell below
+ * MPL_STEP_VALLEY_G, at most one per MPL_STEP_MIN_MS */
+#define MPL_STEP_PEAK_G 1.15f
+#define MPL_STEP_VALLEY_G 1.0f
+#define MPL_STEP_MIN_MS 250
 
 /*****************************************************************************/
 /** MPLSensor implementation which fits into the HAL example for crespo provided
@@ -51,11 +87,19 @@ public:
         RotationVector,
         LinearAccel,
         Gravity,
+        SignificantMotion,
+        StepDetector,
+        GameRotationVector,
+        GyroUncalibrated,
+        MagneticFieldUncalibrated,
         numSensors
     };
 
     virtual int setDelay(int32_t handle, int64_t ns);
     virtual int enable(int32_t handle, int enabled);
+    virtual int batch(int32_t handle, int flags, int64_t ns, int64_t timeout);
+    virtual int flush(int32_t handle);
+    virtual bool hasPendingEvents() const;
     virtual int readEvents(sensors_event_t *data, int count);
     virtual int getFd() const;
     virtual int getAccelFd() const;
@@ -65,27 +109,52 @@ public:
     virtual void sleepEvent();
     virtual void wakeEvent();
     int populateSensorList(struct sensor_t *list, size_t len);
+    int configDirectReport(int32_t handle, DirectChannel* channel, int64_t ns);
+    void stopDirectReports(DirectChannel* channel);
+    void irqReady(int fd);
+    void setWakeUpRequested(bool requested);
     void cbOnMotion(uint16_t);
     void cbProcData();
 
 protected:
 
+    bool readIrq(int fd);
     void clearIrqData(bool* irq_set);
+    void readReadyIrqs();
     void setPowerStates(int enabledsensor);
+    void updateBatching();
+    void applyConfig();
+    void syncPacketTime();
+    void queueEvent(sensors_event_t const* event);
+    void writeDirectEvents();
+    void queueCalibration();
+    void calWriterLoop();
+    void loadDeferredCalibration();
+    static void* calWriterThread(void* arg);
+    int64_t packetTimestamp(int index) const;
     void initMPL();
     void setupFIFO();
     void setupCallbacks();
     void gyroHandler(sensors_event_t *data, uint32_t *pendmask, int index);
     void accelHandler(sensors_event_t *data, uint32_t *pendmask, int index);
     void compassHandler(sensors_event_t *data, uint32_t *pendmask, int index);
+    void gyroUncalHandler(sensors_event_t *data, uint32_t *pendmask, int index);
+    void compassUncalHandler(sensors_event_t *data, uint32_t *pendmask, int index);
     void rvHandler(sensors_event_t *data, uint32_t *pendmask, int index);
+    void grvHandler(sensors_event_t *data, uint32_t *pendmask, int index);
     void laHandler(sensors_event_t *data, uint32_t *pendmask, int index);
     void gravHandler(sensors_event_t *data, uint32_t *pendmask, int index);
+    void sigMotionHandler(sensors_event_t *data, uint32_t *pendmask, int index);
+    void stepHandler(sensors_event_t *data, uint32_t *pendmask, int index);
+    int triggerStepMs(int index) const;
     void orienHandler(sensors_event_t *data, uint32_t *pendmask, int index);
     void calcOrientationSensor(float *Rx, float *Val);
     int estimateCompassAccuracy();
 
     int mNewData; //flag indicating that the MPL calculated new output values
+    int mPacketCount; //FIFO packets decoded by the last inv_update_data
+    int64_t mLastPacketTime; //reconstructed time of the newest packet, 0 to resync
+    int64_t mPacketStep; //DMP sample step in ns, 0 outside the DMP modes
     int mDmpStarted;
     long mMasterSensorMask;
     long mLocalSensorMask;
@@ -96,7 +165,14 @@ protected:
     bool mUsetimerIrqCompass;
     bool mUseTimerirq;
     struct pollfd mPollFds[4];
-    pthread_mutex_t mMplMutex;
+    pthread_mutex_t mMplMutex; //MPL and data plane, taken by the poll thread
+    pthread_mutex_t mConfigLock; //the requested configuration below
+
+    uint32_t mRequestedEnabled;
+    uint64_t mRequestedDelays[numSensors];
+    int64_t mRequestedLatencies[numSensors];
+    bool mConfigPending;
+    bool mWakeUpRequested; //a fused sensor of the HAL has to wake the system
 
     enum FILEHANDLES
     {
@@ -109,17 +185,64 @@ private:
     int accel_fd;
     int timer_fd;
 
-    uint32_t mEnabled;
-    uint32_t mPendingMask;
+    uint32_t mEnabled; //sensors running, for the poll or a direct channel
+    uint32_t mPollEnabled;
     sensors_event_t mPendingEvents[numSensors];
+    sensors_event_t mEventRing[MPL_EVENT_RING_SIZE];
+    int mRingHead; //oldest queued event
+    int mRingCount;
+    int mBurstEvents; //events queued by the current inv_update_data
+    int mDroppedEvents;
+
+    //direct reports, changed with the mMplMutex held
+    DirectChannel* mDirectChannels[numSensors];
+    uint64_t mDirectDelays[numSensors];
+    int mDirectDecimation[numSensors];
+    int mDirectCount[numSensors];
+    //events of the current burst for the direct channels
+    sensors_event_t mDirectEvents[MPL_EVENT_RING_SIZE];
+    int mNumDirectEvents;
     uint64_t mDelays[numSensors];
+    int mDecimation[numSensors]; //packets per event, to keep the rate caps
+    int mDecimCount[numSensors];
+    int64_t mLatencies[numSensors];
+    int mBatchPeriodMs; //timerirq period draining the FIFO, 0 when not batching
+    bool mFlushPending;
     hfunc_t mHandlers[numSensors];
     bool mForceSleep;
+    bool mSuspendRunning; //the DMP was left running through the suspend
+    bool mMotion; //last motion state of the MPL, it starts out moving
+    int mMotionMs; //time in motion seen by the significant motion, -1 once fired
+    int mStepMs; //time since the last step
+    bool mStepArmed; //|a| fell below the valley since the last step
+    uint32_t mIrqReady; //mPollFds reported readable, not read yet
     long int mOldEnabledMask;
     android::KeyedVector<int, int> mIrqFds;
 
     bool mNineAxisEnabled;
 
+    //calibration persistence, written out by calWriterLoop, which also
+    //loads it when the init is deferred
+    pthread_t mCalThread;
+    pthread_mutex_t mCalLock;
+    pthread_cond_t mCalCond;
+    unsigned long long mCalBuf[INV_CAL_MAX_LEN / sizeof(unsigned long long)];
+    unsigned int mCalLen; //length of the snapshot to write, 0 if none
+    bool mCalThreadRunning;
+    bool mCalExit;
+    bool mCalLoadPending;
+
+    static int64_t minDelay(int what) {
+        return (what == Gyro || what == RotationVector ||
+                what == GameRotationVector || what == GyroUncalibrated) ?
+                MPL_HIGH_RATE_DELAY_NS : MPL_MAX_RATE_DELAY_NS;
+    }
+
+    /* sensors which report on a detection rather than per sample */
+    static bool isTrigger(int what) {
+        return what == SignificantMotion || what == StepDetector;
+    }
+
     int handleToDriver(int handle) const {
         switch (handle) {
             case ID_A:
@@ -136,6 +259,16 @@ private:
                 return RotationVector;
             case ID_LA:
                 return LinearAccel;
+            case ID_SM:
+                return SignificantMotion;
+            case ID_SD:
+                return StepDetector;
+            case ID_GRV:
+                return GameRotationVector;
+            case ID_GYU:
+                return GyroUncalibrated;
+            case ID_MU:
+                return MagneticFieldUncalibrated;
         }
         return handle;
     }
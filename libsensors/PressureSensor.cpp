@@ -33,13 +33,9 @@
 #define PRESSURE_HECTO (1.0f/100.0f)
 
 PressureSensor::PressureSensor()
-    : SamsungSensorBase("barometer", ABS_PRESSURE)
+    : BarometerSensor("barometer", ABS_PRESSURE, PRESSURE_HECTO,
+                      PRESSURE_THRESHOLD_PROPERTY)
 {
     mPendingEvent.sensor = ID_PR;
     mPendingEvent.type = SENSOR_TYPE_PRESSURE;
 }
-
-bool PressureSensor::handleEvent(input_event const *event) {
-    mPendingEvent.pressure = event->value * PRESSURE_HECTO;
-    return true;
-}
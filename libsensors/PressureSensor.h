@@ -23,16 +23,15 @@
 #include <sys/types.h>
 
 #include "sensors.h"
-#include "SamsungSensorBase.h"
+#include "BarometerSensor.h"
 #include "InputEventReader.h"
 
-/*****************************************************************************/
-
-struct input_event;
+/* change in hPa an event must carry to be reported, 0 reports all */
+#define PRESSURE_THRESHOLD_PROPERTY "ro.sensors.pressure.threshold"
 
-class PressureSensor:public SamsungSensorBase {
-    virtual bool handleEvent(input_event const * event);
+/*****************************************************************************/
 
+class PressureSensor:public BarometerSensor {
 public:
     PressureSensor();
 };
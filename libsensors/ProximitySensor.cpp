@@ -20,20 +20,43 @@
 #include <poll.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <string.h>
 #include <sys/select.h>
+#include <sys/timerfd.h>
 #include <pthread.h>
 
 #include <cutils/log.h>
+#include <hardware_legacy/power.h>
 
 #include "ProximitySensor.h"
 
 /*****************************************************************************/
 
 ProximitySensor::ProximitySensor()
-    : SamsungSensorBase("proximity", ABS_DISTANCE)
+    : SamsungSensorBase("proximity", ABS_DISTANCE),
+      mRawIndex(-1),
+      mRawSince(0),
+      mReportedIndex(-1),
+      mWakeLocked(false)
 {
     mPendingEvent.sensor = ID_P;
     mPendingEvent.type = SENSOR_TYPE_PROXIMITY;
+
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ALOGE_IF(mTimerFd < 0, "could not create the proximity timer (%s)",
+             strerror(errno));
+}
+
+ProximitySensor::~ProximitySensor()
+{
+    setWakeLock(false);
+    if (mTimerFd >= 0)
+        close(mTimerFd);
+}
+
+int ProximitySensor::getTimerFd() const
+{
+    return mTimerFd;
 }
 
 int ProximitySensor::setDelay(int32_t handle __unused, int64_t ns __unused)
@@ -50,21 +73,109 @@ bool ProximitySensor::hasPendingEvents() const {
     return mHasPendingEvent;
 }
 
+/* It must be called with the mLock held, 0 disarms the timer. */
+void ProximitySensor::setTimer(int64_t ns)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000LL;
+    its.it_value.tv_nsec = ns % 1000000000LL;
+    if (mTimerFd >= 0)
+        timerfd_settime(mTimerFd, 0, &its, NULL);
+}
+
+/* It must be called with the mLock held. */
+void ProximitySensor::setWakeLock(bool locked)
+{
+    if (locked == mWakeLocked)
+        return;
+    if (locked)
+        acquire_wake_lock(PARTIAL_WAKE_LOCK, PROXIMITY_WAKE_LOCK);
+    else
+        release_wake_lock(PROXIMITY_WAKE_LOCK);
+    mWakeLocked = locked;
+}
+
+/* the initial state is reported as soon as the sensor is enabled, the
+ * transitions once they held long enough */
 int ProximitySensor::handleEnable(int en) {
-    if (!en)
+    if (!en) {
+        setTimer(0);
+        setWakeLock(false);
+        mReportedIndex = -1;
         return 0;
+    }
 
     struct input_absinfo absinfo;
     if (!ioctl(data_fd, EVIOCGABS(ABS_DISTANCE), &absinfo)) {
         mHasPendingEvent = true;
         mPendingEvent.distance = indexToValue(absinfo.value);
+        mRawIndex = mReportedIndex = absinfo.value;
+        mRawSince = getTimestamp();
         return 0;
     } else {
         return -1;
     }
 }
 
+/* the driver states only feed the debouncing, readEvents reports them */
 bool ProximitySensor::handleEvent(input_event const *event) {
-    mPendingEvent.distance = indexToValue(event->value);
+    if (event->value != mRawIndex) {
+        mRawIndex = event->value;
+        mRawSince = eventTime(event);
+    }
+    return false;
+}
+
+/*
+ * Returns true when the pending state held long enough to be reported,
+ * arms the timer for it otherwise.
+ *
+ * It must be called with the mLock held.
+ */
+bool ProximitySensor::updateState(int64_t now)
+{
+    if (!mEnabled || mReportedIndex < 0 || mRawIndex == mReportedIndex) {
+        setTimer(0);
+        setWakeLock(false);
+        return false;
+    }
+
+    int64_t hold = indexToValue(mRawIndex) < PROXIMITY_THRESHOLD_GP2A ?
+            PROXIMITY_NEAR_HOLD_NS : PROXIMITY_FAR_HOLD_NS;
+    int64_t left = mRawSince + hold - now;
+    if (left > 0) {
+        setWakeLock(true);
+        setTimer(left);
+        return false;
+    }
+
+    mReportedIndex = mRawIndex;
+    mPendingEvent.distance = indexToValue(mRawIndex);
+    mPendingEvent.timestamp = now;
+    setTimer(0);
+    setWakeLock(false);
     return true;
 }
+
+int ProximitySensor::readEvents(sensors_event_t* data, int count)
+{
+    uint64_t expirations;
+
+    if (count < 1)
+        return -EINVAL;
+
+    if (mTimerFd >= 0)
+        read(mTimerFd, &expirations, sizeof(expirations));
+
+    int numEventReceived = SamsungSensorBase::readEvents(data, count);
+    if (numEventReceived < 0)
+        return numEventReceived;
+
+    pthread_mutex_lock(&mLock);
+    if (numEventReceived < count && updateState(getTimestamp()))
+        data[numEventReceived++] = mPendingEvent;
+    pthread_mutex_unlock(&mLock);
+    return numEventReceived;
+}
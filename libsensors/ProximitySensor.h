@@ -30,20 +30,41 @@
  * this hardware */
 #define PROXIMITY_THRESHOLD_GP2A  5.0f
 
+/* time a new state has to hold before it is reported. The GP2A has its own
+ * distance hysteresis, what chatters at its threshold is filtered in time:
+ * covering blanks the in-call screen quickly, uncovering has to last */
+#define PROXIMITY_NEAR_HOLD_NS    100000000LL
+#define PROXIMITY_FAR_HOLD_NS     300000000LL
+
+/* keeps the device up while a transition is being confirmed */
+#define PROXIMITY_WAKE_LOCK       "sensors_proximity"
+
 /*****************************************************************************/
 
 struct input_event;
 
 class ProximitySensor:public SamsungSensorBase {
+    int mTimerFd;
+    int mRawIndex; //last state read from the driver
+    int64_t mRawSince;
+    int mReportedIndex; //last state reported, -1 before the first
+    bool mWakeLocked;
 
     virtual int handleEnable(int en);
     virtual bool handleEvent(input_event const * event);
 
     float indexToValue(size_t index) const;
+    void setTimer(int64_t ns);
+    void setWakeLock(bool locked);
+    bool updateState(int64_t now);
 public:
     ProximitySensor();
+    virtual ~ProximitySensor();
     virtual int setDelay(int32_t handle, int64_t ns);
     virtual bool hasPendingEvents() const;
+    virtual int readEvents(sensors_event_t *data, int count);
+    /* expires when a pending state has held long enough */
+    int getTimerFd() const;
 };
 
 /*****************************************************************************/
@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "ReplaySensor.h"
+#include "SensorTime.h"
+
+/*****************************************************************************/
+
+int ReplaySensor::sRecordFd = -2;
+
+ReplaySensor* ReplaySensor::open()
+{
+    char path[PROPERTY_VALUE_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    struct stat st;
+    int fd;
+
+    property_get(SENSOR_REPLAY_PROPERTY, path, "");
+    if (!path[0])
+        return NULL;
+
+    property_get(SENSOR_REPLAY_SPEED_PROPERTY, value, "1");
+    float speed = atof(value);
+    if (speed < 0)
+        speed = 1;
+
+    bool stream = !stat(path, &st) && S_ISSOCK(st.st_mode);
+    if (stream) {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0)
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+    } else {
+        fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        ALOGE("could not open the sensor trace %s (%s)", path, strerror(errno));
+        return NULL;
+    }
+
+    ALOGI("replaying the sensor trace %s at %gx", path, speed);
+    return new ReplaySensor(path, fd, stream, speed);
+}
+
+ReplaySensor::ReplaySensor(const char* path, int fd, bool stream, float speed)
+    : SensorBase(NULL),
+      mTraceFd(fd),
+      mStream(stream),
+      mSpeed(speed),
+      mPollFd(-1),
+      mWatching(false),
+      mRunning(false),
+      mEnded(false),
+      mPending(false),
+      mNextLen(0),
+      mHasNext(false),
+      mHasFirst(false),
+      mFirst(0),
+      mStart(0),
+      mLastStamp(0)
+{
+    strlcpy(mPath, path, sizeof(mPath));
+    memset(&mTotal, 0, sizeof(mTotal));
+    memset(&mPeriod, 0, sizeof(mPeriod));
+    pthread_mutex_init(&mLock, NULL);
+
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ALOGE_IF(mTimerFd < 0, "could not create the replay timer (%s)",
+             strerror(errno));
+
+    if (mStream) {
+        mPollFd = epoll_create(1);
+        ALOGE_IF(mPollFd < 0, "could not create the replay epoll fd (%s)",
+                 strerror(errno));
+        watchStream(true);
+    }
+}
+
+ReplaySensor::~ReplaySensor()
+{
+    if (mTimerFd >= 0)
+        close(mTimerFd);
+    if (mPollFd >= 0)
+        close(mPollFd);
+    if (mTraceFd >= 0)
+        close(mTraceFd);
+    pthread_mutex_destroy(&mLock);
+}
+
+int ReplaySensor::getFd() const
+{
+    return mPollFd;
+}
+
+/*
+ * The trace socket is only polled while its data can be taken, not while
+ * the next event waits for its time: the epoll is level-triggered.
+ *
+ * It must be called with the mLock held, or from the constructor.
+ */
+void ReplaySensor::watchStream(bool watch)
+{
+    struct epoll_event ev;
+
+    if (mPollFd < 0 || mTraceFd < 0 || watch == mWatching)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epoll_ctl(mPollFd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, mTraceFd, &ev) < 0)
+        ALOGE("error %s the sensor trace socket (%s)",
+              watch ? "polling" : "unpolling", strerror(errno));
+    else
+        mWatching = watch;
+}
+
+/* It must be called with the mLock held. */
+void ReplaySensor::endTrace()
+{
+    mEnded = true;
+    // a socket which hung up would stay readable
+    if (mStream && mTraceFd >= 0) {
+        watchStream(false);
+        close(mTraceFd);
+        mTraceFd = -1;
+    }
+}
+
+int ReplaySensor::getTimerFd() const
+{
+    return mTimerFd;
+}
+
+bool ReplaySensor::hasPendingEvents() const
+{
+    return mPending;
+}
+
+/* It must be called with the mLock held, 0 disarms the timer. */
+void ReplaySensor::setTimer(int64_t ns)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000LL;
+    its.it_value.tv_nsec = ns % 1000000000LL;
+    if (mTimerFd >= 0)
+        timerfd_settime(mTimerFd, 0, &its, NULL);
+}
+
+/* It must be called with the mLock held. */
+void ReplaySensor::start(int64_t now)
+{
+    // a trace file replays from its start on each run, a socket goes on
+    if (!mStream && lseek(mTraceFd, 0, SEEK_SET) == 0) {
+        mNextLen = 0;
+        mHasNext = false;
+        mEnded = false;
+    }
+    mRunning = !mEnded;
+    mHasFirst = false;
+    mStart = now;
+    memset(&mTotal, 0, sizeof(mTotal));
+    memset(&mPeriod, 0, sizeof(mPeriod));
+    mTotal.since = mPeriod.since = now;
+    mPending = mRunning;
+}
+
+/* It must be called with the mLock held. */
+void ReplaySensor::stop(int64_t now)
+{
+    if (mRunning)
+        report(now, true);
+    mRunning = false;
+    mPending = false;
+    setTimer(0);
+    // the next events of a socket are dropped until the next run
+    if (mStream)
+        mHasNext = false;
+    watchStream(true);
+}
+
+/*
+ * Reads the next event of the trace into mNext, false when there is none
+ * for now: a socket has no more data or the trace ended.
+ *
+ * It must be called with the mLock held.
+ */
+bool ReplaySensor::readNext()
+{
+    while (!mHasNext && !mEnded) {
+        ssize_t n = read(mTraceFd, (char*)&mNext + mNextLen,
+                         sizeof(mNext) - mNextLen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return false;
+        if (n <= 0) {
+            ALOGE_IF(n < 0, "error reading the sensor trace (%s)", strerror(errno));
+            endTrace();
+            break;
+        }
+
+        mNextLen += n;
+        if (mNextLen < sizeof(mNext))
+            continue;
+        mNextLen = 0;
+
+        if (mNext.version != sizeof(sensors_event_t)) {
+            ALOGE("%s is not a sensor trace of this HAL", mPath);
+            endTrace();
+            break;
+        }
+        // the flush completes answer the requests of the recording
+        if (mNext.type == SENSOR_TYPE_META_DATA)
+            continue;
+        mHasNext = true;
+    }
+    return mHasNext;
+}
+
+/* It must be called with the mLock held. */
+int64_t ReplaySensor::dueTime(int64_t timestamp, int64_t now)
+{
+    if (!mHasFirst) {
+        mHasFirst = true;
+        mFirst = timestamp;
+    }
+    if (!mSpeed)
+        return now;
+    return mStart + int64_t((timestamp - mFirst) / mSpeed);
+}
+
+int ReplaySensor::enable(int32_t handle, int enabled)
+{
+    int64_t now = SensorTime::now();
+
+    pthread_mutex_lock(&mLock);
+    bool wasIdle = mEnabled.isEmpty();
+    if (enabled)
+        mEnabled.add(handle);
+    else
+        mEnabled.remove(handle);
+
+    if (wasIdle && !mEnabled.isEmpty())
+        start(now);
+    else if (!wasIdle && mEnabled.isEmpty())
+        stop(now);
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
+
+int ReplaySensor::readEvents(sensors_event_t* data, int count)
+{
+    uint64_t expirations;
+    int64_t now = SensorTime::now();
+    int nb = 0;
+
+    if (count < 1)
+        return -EINVAL;
+
+    pthread_mutex_lock(&mLock);
+    if (mTimerFd >= 0)
+        read(mTimerFd, &expirations, sizeof(expirations));
+
+    mPending = false;
+    // what a socket sends while no sensor of the trace runs is dropped
+    while (!mRunning && mStream && readNext())
+        mHasNext = false;
+
+    while (mRunning && count && readNext()) {
+        int64_t due = dueTime(mNext.timestamp, now);
+        if (due > now) {
+            setTimer(due - now);
+            break;
+        }
+        mHasNext = false;
+
+        if (mEnabled.indexOf(mNext.sensor) < 0) {
+            mTotal.dropped++;
+            mPeriod.dropped++;
+            continue;
+        }
+
+        // as fast as the framework polls the events of a read are all due
+        // now, they are spaced to keep the timestamps increasing
+        *data = mNext;
+        data->timestamp = due > mLastStamp ? due : mLastStamp + 1;
+        mLastStamp = data->timestamp;
+        data++;
+        count--;
+        nb++;
+
+        uint64_t lagUs = (now - due) / 1000;
+        Stats* const stats[] = { &mTotal, &mPeriod };
+        for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+            stats[i]->events++;
+            stats[i]->sumLagUs += lagUs;
+            if (lagUs > stats[i]->maxLagUs)
+                stats[i]->maxLagUs = lagUs > UINT32_MAX ? UINT32_MAX : lagUs;
+            if (now - due > SENSOR_REPLAY_LATE_NS)
+                stats[i]->late++;
+        }
+    }
+
+    if (mRunning && mEnded) {
+        ALOGI("end of the sensor trace %s", mPath);
+        report(now, true);
+        mRunning = false;
+    } else if (mRunning && now - mPeriod.since >= SENSOR_REPLAY_REPORT_NS) {
+        report(now, false);
+        memset(&mPeriod, 0, sizeof(mPeriod));
+        mPeriod.since = now;
+    }
+    watchStream(!mRunning || !mHasNext);
+    pthread_mutex_unlock(&mLock);
+    return nb;
+}
+
+/* It must be called with the mLock held. */
+void ReplaySensor::report(int64_t now, bool last)
+{
+    Stats const* s = last ? &mTotal : &mPeriod;
+    int64_t ms = (now - s->since) / 1000000;
+
+    ALOGI("replay %s: %u events in %lld ms, %llu/s, %u dropped,"
+          " lag avg %llu us max %u us, %u late",
+          last ? "total" : "period", s->events, (long long) ms,
+          (unsigned long long) (ms ? s->events * 1000ULL / ms : 0),
+          s->dropped,
+          (unsigned long long) (s->events ? s->sumLagUs / s->events : 0),
+          s->maxLagUs, s->late);
+}
+
+void ReplaySensor::record(sensors_event_t const* data, int count)
+{
+    if (sRecordFd == -2) {
+        char path[PROPERTY_VALUE_MAX];
+        property_get(SENSOR_RECORD_PROPERTY, path, "");
+        sRecordFd = -1;
+        if (path[0]) {
+            sRecordFd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            ALOGE_IF(sRecordFd < 0, "could not create the sensor trace %s (%s)",
+                     path, strerror(errno));
+        }
+    }
+    if (sRecordFd < 0)
+        return;
+
+    // the flush completes are not part of the trace
+    int i = 0;
+    while (i < count) {
+        int run = 0;
+        while (i + run < count && data[i + run].type != SENSOR_TYPE_META_DATA)
+            run++;
+        if (run && write(sRecordFd, data + i, run * sizeof(*data)) < 0) {
+            ALOGE("error writing the sensor trace (%s)", strerror(errno));
+            close(sRecordFd);
+            sRecordFd = -1;
+            return;
+        }
+        i += run + 1;
+    }
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_REPLAY_SENSOR_H
+#define ANDROID_REPLAY_SENSOR_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include <hardware/sensors.h>
+#include <utils/SortedVector.h>
+
+#include "SensorBase.h"
+
+/* set to a trace to replay instead of the hardware: a file of the
+ * sensors_event_t the HAL delivered, as SENSOR_RECORD_PROPERTY writes them,
+ * or a UNIX stream socket sending such records */
+#define SENSOR_REPLAY_PROPERTY          "debug.sensors.replay"
+
+/* comma separated drivers the trace replaces among mpl, light, proximity,
+ * pressure and temperature, all of them when empty */
+#define SENSOR_REPLAY_DRIVERS_PROPERTY  "debug.sensors.replay.drivers"
+
+/* rate of the replay relative to the trace, 0 replays as fast as the
+ * framework polls */
+#define SENSOR_REPLAY_SPEED_PROPERTY    "debug.sensors.replay.speed"
+
+/* set to a file to record the events the framework gets into */
+#define SENSOR_RECORD_PROPERTY          "debug.sensors.record"
+
+/* period of the throughput report of a running replay */
+#define SENSOR_REPLAY_REPORT_NS         5000000000LL
+
+/* an event read later than this after it was due counts as late */
+#define SENSOR_REPLAY_LATE_NS           1000000LL
+
+/*****************************************************************************/
+
+/*
+ * Feeds the sensors of the drivers it replaces from a trace. The trace
+ * starts over when the first of its sensors is enabled and its events are
+ * restamped with the time they are due, the events of the sensors not
+ * enabled are dropped. The per sensor delivery latency is reported by
+ * SensorTime as for the hardware, see SENSOR_LATENCY_PROPERTY.
+ */
+class ReplaySensor : public SensorBase {
+public:
+    /* the replay the properties ask for, NULL when there is none */
+    static ReplaySensor* open();
+    virtual ~ReplaySensor();
+
+    virtual int readEvents(sensors_event_t* data, int count);
+    virtual bool hasPendingEvents() const;
+    /* readable when the data of a trace socket can be read, -1 for a
+     * trace file */
+    virtual int getFd() const;
+    virtual int enable(int32_t handle, int enabled);
+    /* expires when the next event of the trace is due */
+    int getTimerFd() const;
+
+    /* append the events handed to the framework by a poll to the record
+     * file. Only called from the poll thread. */
+    static void record(sensors_event_t const* data, int count);
+
+private:
+    ReplaySensor(const char* path, int fd, bool stream, float speed);
+
+    bool readNext();
+    int64_t dueTime(int64_t timestamp, int64_t now);
+    void start(int64_t now);
+    void stop(int64_t now);
+    void setTimer(int64_t ns);
+    void watchStream(bool watch);
+    void endTrace();
+    void report(int64_t now, bool last);
+
+    char mPath[PATH_MAX];
+    int mTraceFd;
+    bool mStream;
+    float mSpeed;
+    int mTimerFd;
+    // holds the trace socket while it is polled
+    int mPollFd;
+    bool mWatching;
+
+    pthread_mutex_t mLock;
+    android::SortedVector<int32_t> mEnabled;
+    bool mRunning;
+    bool mEnded;
+    volatile bool mPending;
+
+    // next record of the trace, mNextLen bytes of it read so far
+    sensors_event_t mNext;
+    size_t mNextLen;
+    bool mHasNext;
+    // trace time of the first event replayed and when it was due
+    bool mHasFirst;
+    int64_t mFirst;
+    int64_t mStart;
+    // timestamp of the last event replayed
+    int64_t mLastStamp;
+
+    struct Stats {
+        int64_t since;
+        uint32_t events;
+        uint32_t dropped;
+        uint32_t late;
+        uint64_t sumLagUs;
+        uint32_t maxLagUs;
+    };
+    Stats mTotal;
+    Stats mPeriod;
+
+    static int sRecordFd;
+};
+
+/*****************************************************************************/
+
+#endif  // ANDROID_REPLAY_SENSOR_H
@@ -25,8 +25,15 @@
 #include <cutils/log.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
 
 #include "SamsungSensorBase.h"
+#include "SensorTime.h"
+
+pthread_mutex_t SamsungSensorBase::sPollDelayLock = PTHREAD_MUTEX_INITIALIZER;
+android::KeyedVector<android::String8, int64_t> SamsungSensorBase::sPollDelays;
 
 char *SamsungSensorBase::makeSysfsName(const char *input_name,
                                        const char *file_name) {
@@ -56,11 +63,18 @@ int SamsungSensorBase::handleEnable(int en __unused) {
 }
 
 SamsungSensorBase::SamsungSensorBase(const char *data_name,
-                                     int sensor_code)
+                                     int sensor_code,
+                                     size_t reader_events)
     : SensorBase(data_name),
       mEnabled(true),
       mHasPendingEvent(false),
-      mInputReader(4),
+      mEventClock(false),
+      mFrameUpdated(false),
+      mInputReader(reader_events),
+      mInputSysfsEnable(NULL),
+      mInputSysfsPollDelay(NULL),
+      mEnableFd(-1),
+      mPollDelayFd(-1),
       mSensorCode(sensor_code),
       mLock(PTHREAD_MUTEX_INITIALIZER)
 {
@@ -84,6 +98,16 @@ SamsungSensorBase::SamsungSensorBase(const char *data_name,
     int flags = fcntl(data_fd, F_GETFL, 0);
     fcntl(data_fd, F_SETFL, flags | O_NONBLOCK);
 
+    /* sensor events are on the elapsedRealtimeNanos clock, input events
+     * are on the wall clock unless evdev can be told otherwise.  Without
+     * it the event times are converted when they are read. */
+#ifdef EVIOCSCLOCKID
+    int clockId = CLOCK_BOOTTIME;
+    mEventClock = !ioctl(data_fd, EVIOCSCLOCKID, &clockId);
+#endif
+    ALOGV_IF(!mEventClock, "%s: no boottime input clock, converting times",
+             data_name);
+
     enable(0, 0);
 }
 
@@ -91,28 +115,40 @@ SamsungSensorBase::~SamsungSensorBase() {
     if (mEnabled) {
         enable(0, 0);
     }
+    if (mEnableFd >= 0)
+        close(mEnableFd);
+    if (mPollDelayFd >= 0)
+        close(mPollDelayFd);
     delete[] mInputSysfsEnable;
     delete[] mInputSysfsPollDelay;
 }
 
+/* the sysfs nodes stay open for the life of the sensor, each write stores
+ * the whole value from the start of the attribute */
+int SamsungSensorBase::writeSysfs(int *fd, const char *name,
+                                  const char *value, size_t len)
+{
+    if (*fd < 0) {
+        if (!name)
+            return -1;
+        *fd = open(name, O_RDWR);
+        if (*fd < 0)
+            return -1;
+    }
+    return pwrite(*fd, value, len, 0);
+}
+
 int SamsungSensorBase::enable(int32_t handle __unused, int en)
 {
     int err = 0;
     pthread_mutex_lock(&mLock);
     if (en != mEnabled) {
-        int fd;
-        fd = open(mInputSysfsEnable, O_RDWR);
-        if (fd >= 0) {
-            err = write(fd, en ? "1" : "0", 2);
-            close(fd);
-            if (err < 0) {
-                goto cleanup;
-            }
-            mEnabled = en;
-            err = handleEnable(en);
-        } else {
-            err = -1;
+        err = writeSysfs(&mEnableFd, mInputSysfsEnable, en ? "1" : "0", 2);
+        if (err < 0) {
+            goto cleanup;
         }
+        mEnabled = en;
+        err = handleEnable(en);
     }
 cleanup:
     pthread_mutex_unlock(&mLock);
@@ -121,28 +157,39 @@ cleanup:
 
 int SamsungSensorBase::setDelay(int32_t handle __unused, int64_t ns)
 {
-    int fd;
     int result = 0;
     char buf[21];
+
+    if (!mInputSysfsPollDelay)
+        return -1;
+
+    android::String8 node(mInputSysfsPollDelay);
     pthread_mutex_lock(&mLock);
-    fd = open(mInputSysfsPollDelay, O_RDWR);
-    if (fd < 0) {
-        result = -1;
-        goto done;
+    pthread_mutex_lock(&sPollDelayLock);
+    //SensorService resends the delays of every client, skip the repeats
+    ssize_t index = sPollDelays.indexOfKey(node);
+    if (index < 0 || sPollDelays.valueAt(index) != ns) {
+        sprintf(buf, "%lld", (long long) ns);
+        if (writeSysfs(&mPollDelayFd, mInputSysfsPollDelay, buf,
+                       strlen(buf) + 1) < 0) {
+            result = -1;
+        } else {
+            sPollDelays.replaceValueFor(node, ns);
+        }
     }
-    sprintf(buf, "%lld", ns);
-    write(fd, buf, strlen(buf)+1);
-    close(fd);
-done:
+    pthread_mutex_unlock(&sPollDelayLock);
     pthread_mutex_unlock(&mLock);
     return result;
 }
 
 int64_t SamsungSensorBase::getTimestamp() {
-    struct timespec t;
-    t.tv_sec = t.tv_nsec = 0;
-    clock_gettime(CLOCK_BOOTTIME, &t);
-    return int64_t(t.tv_sec)*1000000000LL + t.tv_nsec;
+    return SensorTime::now();
+}
+
+/* the time of an input event on the sensor event clock */
+int64_t SamsungSensorBase::eventTime(input_event const * event) const {
+    return mEventClock ? timevalToNano(event->time) :
+            SensorTime::fromClock(CLOCK_REALTIME, timevalToNano(event->time));
 }
 
 int SamsungSensorBase::readEvents(sensors_event_t* data, int count)
@@ -163,17 +210,23 @@ int SamsungSensorBase::readEvents(sensors_event_t* data, int count)
         goto done;
     }
 
+    /* one sensor event per input frame, with the last value the frame
+     * carried for our axis */
     input_event const* event;
     while (count && mInputReader.readEvent(data_fd, &event)) {
         if (event->type == EV_ABS) {
             if (event->code == mSensorCode) {
-                if (mEnabled && handleEvent(event)) {
-                    mPendingEvent.timestamp = timevalToNano(event->time);
-                    *data++ = mPendingEvent;
-                    count--;
-                    numEventReceived++;
-                }
+                if (mEnabled && handleEvent(event))
+                    mFrameUpdated = true;
+            }
+        } else if (event->type == EV_SYN && event->code == SYN_REPORT) {
+            if (mFrameUpdated && mEnabled) {
+                mPendingEvent.timestamp = eventTime(event);
+                *data++ = mPendingEvent;
+                count--;
+                numEventReceived++;
             }
+            mFrameUpdated = false;
         }
         mInputReader.next();
     }
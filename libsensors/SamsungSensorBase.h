@@ -22,6 +22,9 @@
 #include <sys/cdefs.h>
 #include <sys/types.h>
 
+#include <utils/KeyedVector.h>
+#include <utils/String8.h>
+
 #include "sensors.h"
 #include "SensorBase.h"
 #include "SamsungSensorBase.h"
@@ -29,31 +32,46 @@
 
 /*****************************************************************************/
 
+/* input events buffered per sensor, enough to drain a burst in one read */
+#define INPUT_READER_EVENTS 32
+
 class SamsungSensorBase:public SensorBase {
 protected:
     bool mEnabled;
     bool mHasPendingEvent;
+    bool mEventClock; //input event times are on the sensor event clock
+    bool mFrameUpdated; //the current input frame changed mPendingEvent
     InputEventCircularReader mInputReader;
     sensors_event_t mPendingEvent;
     char *mInputSysfsEnable;
     char *mInputSysfsPollDelay;
+    int mEnableFd;
+    int mPollDelayFd;
     int mSensorCode;
     pthread_mutex_t mLock;
 
+    // last value written to each poll_delay node, the pressure and
+    // temperature channels share the one of the barometer
+    static pthread_mutex_t sPollDelayLock;
+    static android::KeyedVector<android::String8, int64_t> sPollDelays;
+
     static int64_t getTimestamp();
     static int64_t timevalToNano(timeval const& t) {
         return t.tv_sec*1000000000LL + t.tv_usec*1000;
     }
+    int64_t eventTime(input_event const * event) const;
 
     char *makeSysfsName(const char *input_name,
                         const char *input_file);
+    int writeSysfs(int *fd, const char *name, const char *value, size_t len);
 
     virtual int handleEnable(int en);
     virtual bool handleEvent(input_event const * event);
 
 public:
     SamsungSensorBase(const char* data_name,
-                      int sensor_code);
+                      int sensor_code,
+                      size_t reader_events = INPUT_READER_EVENTS);
 
     virtual ~SamsungSensorBase();
     virtual int enable(int32_t handle, int en);
@@ -24,6 +24,7 @@
 #include <sys/select.h>
 
 #include <cutils/log.h>
+#include <hardware/sensors.h>
 
 #include <linux/input.h>
 
@@ -54,6 +55,16 @@ int SensorBase::setDelay(int32_t handle __unused, int64_t ns __unused) {
     return 0;
 }
 
+int SensorBase::batch(int32_t handle, int flags, int64_t ns, int64_t timeout __unused) {
+    if (flags & SENSORS_BATCH_DRY_RUN)
+        return 0;
+    return setDelay(handle, ns);
+}
+
+int SensorBase::flush(int32_t handle __unused) {
+    return 0;
+}
+
 bool SensorBase::hasPendingEvents() const {
     return false;
 }
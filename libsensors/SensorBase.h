@@ -45,6 +45,11 @@ public:
     virtual int getFd() const;
     virtual int setDelay(int32_t handle, int64_t ns);
     virtual int enable(int32_t handle, int enabled) = 0;
+    /* sensors without a hardware FIFO ignore the report latency */
+    virtual int batch(int32_t handle, int flags, int64_t ns, int64_t timeout);
+    /* makes the events buffered by the driver readable: the flush complete event
+     * itself is queued by the poll context */
+    virtual int flush(int32_t handle);
 };
 
 /*****************************************************************************/
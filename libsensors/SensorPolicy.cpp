@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include <cutils/log.h>
+#include <hardware/sensors.h>
+
+#include "SensorPolicy.h"
+#include "ProximitySensor.h"
+
+/*****************************************************************************/
+
+/* low pass of the acceleration, per accelerometer event */
+#define GRAVITY_FILTER      0.2f
+
+/* distance of |a| from g, in m/s^2, under which the device is still */
+#define STILL_TOLERANCE     0.6f
+
+/* a device lying flat is on a table rather than in a pocket */
+#define FLAT_COS            0.9f
+
+static float norm(float const* v)
+{
+    return sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+}
+
+static float cosAngle(float const* a, float const* b)
+{
+    float n = norm(a) * norm(b);
+    if (n <= 0)
+        return 1.0f;
+    return (a[0] * b[0] + a[1] * b[1] + a[2] * b[2]) / n;
+}
+
+SensorPolicy::SensorPolicy()
+    : SensorBase(NULL),
+      mEnabled(0),
+      mUserEnabled(0),
+      mSourcesChanged(false),
+      mNear(false),
+      mNearSince(0),
+      mPocketState(-1),
+      mHaveGravity(false),
+      mStillSince(0),
+      mArmed(false),
+      mNumPending(0)
+{
+    pthread_mutex_init(&mLock, NULL);
+    memset(mGravity, 0, sizeof(mGravity));
+    memset(mRest, 0, sizeof(mRest));
+    memset(mPending, 0, sizeof(mPending));
+}
+
+SensorPolicy::~SensorPolicy()
+{
+    pthread_mutex_destroy(&mLock);
+}
+
+bool SensorPolicy::isSource(int32_t handle)
+{
+    return sourceBit(handle) != 0;
+}
+
+uint32_t SensorPolicy::sourceBit(int32_t handle)
+{
+    switch (handle) {
+        case ID_P:
+            return ProximitySource;
+        case ID_A:
+            return AccelSource;
+    }
+    return 0;
+}
+
+int SensorPolicy::enable(int32_t handle, int en)
+{
+    int what = handle - ID_POLICY_BASE;
+    if (uint32_t(what) >= numSensors)
+        return -EINVAL;
+
+    pthread_mutex_lock(&mLock);
+    if (en) {
+        mEnabled |= (1 << what);
+    } else {
+        mEnabled &= ~(1 << what);
+    }
+    //start over from the next events of the sources
+    if (what == Pocket)
+        mPocketState = -1;
+    else
+        mArmed = false;
+    mStillSince = 0;
+    pthread_mutex_unlock(&mLock);
+    return 0;
+}
+
+int SensorPolicy::flush(int32_t handle)
+{
+    return handle == ID_PICKUP ? -EINVAL : 0;
+}
+
+bool SensorPolicy::isActive() const
+{
+    pthread_mutex_lock(&mLock);
+    bool active = mEnabled != 0;
+    pthread_mutex_unlock(&mLock);
+    return active;
+}
+
+void SensorPolicy::setUserEnabled(int32_t handle, bool en)
+{
+    pthread_mutex_lock(&mLock);
+    if (en)
+        mUserEnabled |= sourceBit(handle);
+    else
+        mUserEnabled &= ~sourceBit(handle);
+    pthread_mutex_unlock(&mLock);
+}
+
+bool SensorPolicy::isUserEnabled(int32_t handle) const
+{
+    pthread_mutex_lock(&mLock);
+    bool en = mUserEnabled & sourceBit(handle);
+    pthread_mutex_unlock(&mLock);
+    return en;
+}
+
+bool SensorPolicy::wants(int32_t handle) const
+{
+    pthread_mutex_lock(&mLock);
+    //both fused sensors look at both sources
+    bool wanted = mEnabled || (mUserEnabled & sourceBit(handle));
+    pthread_mutex_unlock(&mLock);
+    return wanted;
+}
+
+bool SensorPolicy::takeSourcesChanged()
+{
+    pthread_mutex_lock(&mLock);
+    bool changed = mSourcesChanged;
+    mSourcesChanged = false;
+    pthread_mutex_unlock(&mLock);
+    return changed;
+}
+
+bool SensorPolicy::hasPendingEvents() const
+{
+    return mNumPending;
+}
+
+/* queue an event of a fused sensor.  It must be called with the mLock
+ * held. */
+void SensorPolicy::report(int what, int64_t timestamp, float value)
+{
+    if (mNumPending >= int(ARRAY_SIZE(mPending))) {
+        ALOGW("fused sensor event dropped, the queue is full");
+        return;
+    }
+
+    sensors_event_t* ev = &mPending[mNumPending++];
+    memset(ev, 0, sizeof(*ev));
+    ev->version = sizeof(sensors_event_t);
+    ev->sensor = ID_POLICY_BASE + what;
+    ev->type = what == Pocket ? SENSOR_TYPE_TUNA_POCKET :
+            SENSOR_TYPE_PICK_UP_GESTURE;
+    ev->timestamp = timestamp;
+    ev->data[0] = value;
+}
+
+/* It must be called with the mLock held. */
+void SensorPolicy::processProximity(sensors_event_t const* event)
+{
+    bool near = event->distance < PROXIMITY_THRESHOLD_GP2A;
+
+    if (near && !mNear)
+        mNearSince = event->timestamp;
+    mNear = near;
+
+    //leaving the pocket is seen right away, entering it once the proximity
+    //stayed covered long enough, on the next accelerometer event
+    if ((mEnabled & (1 << Pocket)) && !near && mPocketState != 0) {
+        mPocketState = 0;
+        report(Pocket, event->timestamp, 0.0f);
+    }
+}
+
+/* It must be called with the mLock held. */
+void SensorPolicy::processAccel(sensors_event_t const* event)
+{
+    float const* a = event->acceleration.v;
+
+    if (!mHaveGravity) {
+        memcpy(mGravity, a, sizeof(mGravity));
+        mHaveGravity = true;
+    } else {
+        for (int i = 0; i < 3; i++)
+            mGravity[i] += (a[i] - mGravity[i]) * GRAVITY_FILTER;
+    }
+
+    float g = norm(mGravity);
+    bool flat = g > 0 && fabsf(mGravity[2]) > FLAT_COS * g;
+    if ((mEnabled & (1 << Pocket)) && mNear && mPocketState != 1 &&
+            event->timestamp - mNearSince >= SENSOR_POLICY_POCKET_NS && !flat) {
+        mPocketState = 1;
+        report(Pocket, event->timestamp, 1.0f);
+    }
+
+    if (!(mEnabled & (1 << Pickup)))
+        return;
+
+    if (fabsf(norm(a) - GRAVITY_EARTH) < STILL_TOLERANCE) {
+        if (!mStillSince)
+            mStillSince = event->timestamp;
+        //stay with the newest rest position until the device moves
+        if (event->timestamp - mStillSince >= SENSOR_POLICY_REST_NS) {
+            memcpy(mRest, mGravity, sizeof(mRest));
+            mArmed = true;
+        }
+    } else {
+        mStillSince = 0;
+    }
+
+    //a pick-up tilts the device and uncovers the proximity
+    if (mArmed && !mNear && cosAngle(mGravity, mRest) <
+            cosf(SENSOR_POLICY_PICKUP_ANGLE * float(M_PI) / 180.0f)) {
+        report(Pickup, event->timestamp, 1.0f);
+        //one-shot, the poll context stops the sources it no longer needs
+        mEnabled &= ~(1 << Pickup);
+        mArmed = false;
+        mSourcesChanged = true;
+    }
+}
+
+int SensorPolicy::filterEvents(sensors_event_t* data, int count)
+{
+    int kept = 0;
+
+    pthread_mutex_lock(&mLock);
+    for (int i = 0; i < count; i++) {
+        sensors_event_t const* ev = &data[i];
+        uint32_t source = ev->type == SENSOR_TYPE_META_DATA ? 0 :
+                sourceBit(ev->sensor);
+
+        if (source == ProximitySource)
+            processProximity(ev);
+        else if (source == AccelSource)
+            processAccel(ev);
+
+        if (source && !(mUserEnabled & source))
+            continue;
+        if (kept != i)
+            data[kept] = *ev;
+        kept++;
+    }
+    pthread_mutex_unlock(&mLock);
+    return kept;
+}
+
+int SensorPolicy::readEvents(sensors_event_t* data, int count)
+{
+    if (count < 1)
+        return -EINVAL;
+
+    pthread_mutex_lock(&mLock);
+    int n = mNumPending < count ? mNumPending : count;
+    memcpy(data, mPending, n * sizeof(*data));
+    mNumPending -= n;
+    memmove(mPending, mPending + n, mNumPending * sizeof(*mPending));
+    pthread_mutex_unlock(&mLock);
+    return n;
+}
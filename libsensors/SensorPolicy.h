@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SENSOR_POLICY_H
+#define ANDROID_SENSOR_POLICY_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include "sensors.h"
+#include "SensorBase.h"
+
+/*****************************************************************************/
+
+/* values[0] is 1 while the device is in a pocket or a bag, 0 out of it */
+#define SENSOR_TYPE_TUNA_POCKET          (SENSOR_TYPE_DEVICE_PRIVATE_BASE + 1)
+#define SENSOR_STRING_TYPE_TUNA_POCKET   "com.cyanogenmod.sensor.pocket"
+
+/* rate of the accelerometer while only the policy runs it */
+#define SENSOR_POLICY_ACCEL_DELAY_NS     100000000LL
+
+/* time the proximity has to stay covered before the device is in a pocket,
+ * a hand wave is shorter; the doze service uses the same second */
+#define SENSOR_POLICY_POCKET_NS          1000000000LL
+
+/* time the device has to lie still before a pick-up can trigger */
+#define SENSOR_POLICY_REST_NS            1000000000LL
+
+/* tilt away from the rest position reported as a pick-up, in degrees */
+#define SENSOR_POLICY_PICKUP_ANGLE       35.0f
+
+struct sensors_event_t;
+
+/* pocket and pick-up detection fused in the HAL from the proximity and the
+ * MPL accelerometer, so that nobody has to keep both streams open in user
+ * space while the screen is off.  The poll context runs the sources while
+ * either the framework or one of the fused sensors needs them, and the
+ * policy drops the source events the framework did not ask for. */
+class SensorPolicy : public SensorBase {
+public:
+    SensorPolicy();
+    virtual ~SensorPolicy();
+
+    virtual int enable(int32_t handle, int enabled);
+    virtual int readEvents(sensors_event_t* data, int count);
+    virtual bool hasPendingEvents() const;
+    /* the pick-up is one-shot and cannot be flushed */
+    virtual int flush(int32_t handle);
+
+    /* the physical sensors the fused ones are computed from */
+    static bool isSource(int32_t handle);
+    bool isActive() const;
+    void setUserEnabled(int32_t handle, bool enabled);
+    bool isUserEnabled(int32_t handle) const;
+    /* whether a source has to run, for the framework or for the policy */
+    bool wants(int32_t handle) const;
+    /* feed the events read from a driver to the policy and remove those of
+     * the sources the framework did not enable, returns the count left */
+    int filterEvents(sensors_event_t* data, int count);
+    /* true once after a one-shot sensor fired and disabled itself */
+    bool takeSourcesChanged();
+
+private:
+    enum {
+        Pocket = 0,
+        Pickup,
+        numSensors
+    };
+
+    enum {
+        ProximitySource = 1 << 0,
+        AccelSource = 1 << 1,
+    };
+
+    static uint32_t sourceBit(int32_t handle);
+    void processProximity(sensors_event_t const* event);
+    void processAccel(sensors_event_t const* event);
+    void report(int what, int64_t timestamp, float value);
+
+    mutable pthread_mutex_t mLock;
+    uint32_t mEnabled;      // fused sensors, bit per index
+    uint32_t mUserEnabled;  // sources the framework enabled itself
+    bool mSourcesChanged;
+
+    bool mNear;
+    int64_t mNearSince;
+    int mPocketState;       // last reported, -1 before the first event
+
+    float mGravity[3];      // low passed acceleration
+    bool mHaveGravity;
+    float mRest[3];         // gravity while the device was lying still
+    int64_t mStillSince;    // 0 while moving
+    bool mArmed;            // still long enough for a pick-up
+
+    sensors_event_t mPending[4];
+    int mNumPending;
+};
+
+/*****************************************************************************/
+
+#endif  // ANDROID_SENSOR_POLICY_H
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <hardware/sensors.h>
+
+#include "SensorTime.h"
+
+/*****************************************************************************/
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+int64_t SensorTime::sPeriod = -1;
+int64_t SensorTime::sLastDump;
+SensorTime::Latency SensorTime::sLatency[16];
+
+static int64_t clockNs(clockid_t clock)
+{
+    struct timespec t;
+    t.tv_sec = t.tv_nsec = 0;
+    clock_gettime(clock, &t);
+    return int64_t(t.tv_sec)*1000000000LL + t.tv_nsec;
+}
+
+int64_t SensorTime::now()
+{
+    return clockNs(CLOCK_BOOTTIME);
+}
+
+int64_t SensorTime::fromClock(clockid_t clock, int64_t ns)
+{
+    if (clock == CLOCK_BOOTTIME)
+        return ns;
+
+    //the offset changes with each suspend or clock set, take it now
+    int64_t before = clockNs(clock);
+    int64_t boot = now();
+    int64_t after = clockNs(clock);
+    return ns + boot - (before + (after - before) / 2);
+}
+
+SensorTime::Latency* SensorTime::latencyFor(int32_t handle)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(sLatency); i++) {
+        if (sLatency[i].count && sLatency[i].handle == handle)
+            return &sLatency[i];
+        if (!sLatency[i].count) {
+            sLatency[i].handle = handle;
+            return &sLatency[i];
+        }
+    }
+    return NULL;
+}
+
+void SensorTime::recordDelivery(sensors_event_t const* data, int count)
+{
+    if (sPeriod < 0) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get(SENSOR_LATENCY_PROPERTY, value, "0");
+        sPeriod = atoi(value) * 1000000000LL;
+    }
+    if (!sPeriod || count <= 0)
+        return;
+
+    int64_t t = now();
+    for (int i = 0; i < count; i++) {
+        if (data[i].type == SENSOR_TYPE_META_DATA)
+            continue;
+        Latency* l = latencyFor(data[i].sensor);
+        if (!l)
+            continue;
+
+        int64_t us = (t - data[i].timestamp) / 1000;
+        if (us < 0)
+            us = 0;
+        int b = 0;
+        while (b < SENSOR_LATENCY_BUCKETS - 1 && us >= (500LL << b))
+            b++;
+        l->buckets[b]++;
+        l->count++;
+        l->sumUs += us;
+        if (us > l->maxUs)
+            l->maxUs = us > UINT32_MAX ? UINT32_MAX : us;
+    }
+
+    if (t - sLastDump >= sPeriod) {
+        sLastDump = t;
+        dumpLatency();
+    }
+}
+
+void SensorTime::dumpLatency()
+{
+    for (size_t i = 0; i < ARRAY_SIZE(sLatency); i++) {
+        Latency const* l = &sLatency[i];
+        if (!l->count)
+            break;
+
+        char hist[SENSOR_LATENCY_BUCKETS * 12];
+        size_t len = 0;
+        for (int b = 0; b < SENSOR_LATENCY_BUCKETS; b++)
+            len += snprintf(hist + len, sizeof(hist) - len, " %u",
+                            l->buckets[b]);
+
+        ALOGI("latency handle 0x%x: %u events avg %llu us max %u us,"
+              " per 0.5/1/2/.../512/more ms:%s", l->handle, l->count,
+              (unsigned long long) (l->sumUs / l->count), l->maxUs, hist);
+    }
+}
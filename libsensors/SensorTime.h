@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SENSOR_TIME_H
+#define ANDROID_SENSOR_TIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*****************************************************************************/
+
+/* clock of the irqtime the mpuirq and timerirq drivers report */
+#define MPUIRQ_CLOCK CLOCK_MONOTONIC
+
+/* set to a period in seconds to log the delivery latency of each sensor */
+#define SENSOR_LATENCY_PROPERTY "debug.sensors.latency"
+
+/* latency buckets, bucket i counts what took less than 2^i * 500us and the
+ * last one everything longer */
+#define SENSOR_LATENCY_BUCKETS 12
+
+struct sensors_event_t;
+
+/* every event timestamp of the HAL is on the elapsedRealtimeNanos clock,
+ * CLOCK_BOOTTIME; the drivers do not all stamp on that clock */
+class SensorTime {
+public:
+    static int64_t now();
+    /* convert a recent time of another clock to the sensor clock */
+    static int64_t fromClock(clockid_t clock, int64_t ns);
+
+    /* count the latency of the events handed to the framework by a poll.
+     * Only called from the poll thread. */
+    static void recordDelivery(sensors_event_t const* data, int count);
+
+private:
+    struct Latency {
+        int32_t handle;
+        uint32_t count;
+        uint64_t sumUs;
+        uint32_t maxUs;
+        uint32_t buckets[SENSOR_LATENCY_BUCKETS];
+    };
+
+    static Latency* latencyFor(int32_t handle);
+    static void dumpLatency();
+
+    static int64_t sPeriod;
+    static int64_t sLastDump;
+    static Latency sLatency[16];
+};
+
+/*****************************************************************************/
+
+#endif  // ANDROID_SENSOR_TIME_H
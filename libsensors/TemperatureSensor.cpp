@@ -29,13 +29,9 @@
 #define TEMPERATURE_CELCIUS (1.0f/10.0f)
 
 TemperatureSensor::TemperatureSensor()
-    : SamsungSensorBase("barometer", ABS_MISC)
+    : BarometerSensor("barometer", ABS_MISC, TEMPERATURE_CELCIUS,
+                      TEMPERATURE_THRESHOLD_PROPERTY)
 {
     mPendingEvent.sensor = ID_T;
     mPendingEvent.type = SENSOR_TYPE_AMBIENT_TEMPERATURE;
 }
-
-bool TemperatureSensor::handleEvent(input_event const *event) {
-    mPendingEvent.temperature = event->value * TEMPERATURE_CELCIUS;
-    return true;
-}
@@ -23,16 +23,15 @@
 #include <sys/types.h>
 
 #include "sensors.h"
-#include "SamsungSensorBase.h"
+#include "BarometerSensor.h"
 #include "InputEventReader.h"
 
-/*****************************************************************************/
-
-struct input_event;
+/* change in degrees C an event must carry to be reported, 0 reports all */
+#define TEMPERATURE_THRESHOLD_PROPERTY "ro.sensors.temperature.threshold"
 
-class TemperatureSensor:public SamsungSensorBase {
-    virtual bool handleEvent(input_event const * event);
+/*****************************************************************************/
 
+class TemperatureSensor:public BarometerSensor {
 public:
     TemperatureSensor();
 };
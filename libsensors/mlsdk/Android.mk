@@ -38,12 +38,17 @@ ifeq ($(BOARD_INVENSENSE_APPLY_COMPASS_NOISE_FILTER),true)
 	LOCAL_CFLAGS += -DAPPLY_COMPASS_FILTER
 endif
 
+ifeq ($(TARGET_TUNA_TRACE),true)
+	LOCAL_CFLAGS += -DTUNA_TRACE
+endif
+
 LOCAL_C_INCLUDES := \
 	$(MLSDK_PATH)/mllite \
 	$(MLSDK_PATH)/mlutils \
 	$(MLSDK_PATH)/platform/include \
 	$(MLSDK_PATH)/platform/include/linux \
-	$(MLSDK_PATH)/platform/linux
+	$(MLSDK_PATH)/platform/linux \
+	$(MLSDK_PATH)/../../include
 
 LOCAL_SRC_FILES := \
 	mlsdk/mllite/accel.c \
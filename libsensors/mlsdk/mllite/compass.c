@@ -85,52 +85,107 @@ static void adaptive_filter_init(struct yas_adaptive_filter *adap_filter)
     adap_filter->len = YAS_DEFAULT_FILTER_LEN;
 }
 
-static int cmpfloat(const void *p1, const void *p2)
+/**
+ *  @internal
+ *  @brief  Find the insertion point of a value in the sorted window.
+ *  @return the index of the first element not less than val.
+ */
+static int sorted_lower_bound(const float *sorted, int num, float val)
 {
-    return *(float*)p1 - *(float*)p2;
+    int lo = 0, hi = num;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sorted[mid] < val)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
+static void sorted_insert(float *sorted, int num, float val)
+{
+    int pos = sorted_lower_bound(sorted, num, val);
 
-static float adaptive_filter_filter(struct yas_adaptive_filter *adap_filter, float in)
+    memmove(&sorted[pos + 1], &sorted[pos], (num - pos) * sizeof(float));
+    sorted[pos] = val;
+}
+
+static void sorted_replace(float *sorted, int num, float out, float in)
+{
+    int pos = sorted_lower_bound(sorted, num, out);
+
+    /* shift the neighbours over the outgoing slot towards the new value */
+    if (in >= out) {
+        while (pos + 1 < num && sorted[pos + 1] < in) {
+            sorted[pos] = sorted[pos + 1];
+            pos++;
+        }
+    } else {
+        while (pos > 0 && sorted[pos - 1] > in) {
+            sorted[pos] = sorted[pos - 1];
+            pos--;
+        }
+    }
+    sorted[pos] = in;
+}
+
+/**
+ *  @internal
+ *  @brief  Recompute the running sums from the window to stop rounding
+ *          errors from accumulating; called once per pass over the window.
+ */
+static void adaptive_filter_resync(struct yas_adaptive_filter *adap_filter)
 {
-    float avg, sum, median, sorted[YAS_DEFAULT_FILTER_LEN];
     int i;
+
+    adap_filter->sum = 0;
+    adap_filter->sumsq = 0;
+    for (i = 0; i < adap_filter->num; i++) {
+        double v = adap_filter->sequence[i];
+        adap_filter->sum += v;
+        adap_filter->sumsq += v * v;
+    }
+}
+
+static float adaptive_filter_filter(struct yas_adaptive_filter *adap_filter, float in)
+{
+    float avg, var, median, out;
     int len = adap_filter->len;
 
     if (len <= 1) {
         return in;
     }
     if (adap_filter->num < len) {
+        sorted_insert(adap_filter->sorted, adap_filter->num, in);
         adap_filter->sequence[adap_filter->index++] = in;
+        adap_filter->sum += in;
+        adap_filter->sumsq += (double)in * in;
         adap_filter->num++;
         return in;
     }
     if (len <= adap_filter->index) {
         adap_filter->index = 0;
+        adaptive_filter_resync(adap_filter);
     }
+    out = adap_filter->sequence[adap_filter->index];
     adap_filter->sequence[adap_filter->index++] = in;
+    sorted_replace(adap_filter->sorted, len, out, in);
+    adap_filter->sum += (double)in - out;
+    adap_filter->sumsq += (double)in * in - (double)out * out;
 
-    avg = 0;
-    for (i = 0; i < len; i++) {
-        avg += adap_filter->sequence[i];
-    }
-    avg /= len;
-
-    memcpy(sorted, adap_filter->sequence, len * sizeof(float));
-    qsort(&sorted, len, sizeof(float), cmpfloat);
-    median = sorted[len/2];
-
-    sum = 0;
-    for (i = 0; i < len; i++) {
-        sum += powf(avg - adap_filter->sequence[i], 2);
-    }
-    sum /= len;
+    avg = adap_filter->sum / len;
+    median = adap_filter->sorted[len/2];
+    var = adap_filter->sumsq / len - (double)avg * avg;
+    if (var < 0)
+        var = 0;
 
-    if (sum <= adap_filter->noise) {
+    if (var <= adap_filter->noise) {
         return median;
     }
 
-    return ((in - avg) * (sum - adap_filter->noise) / sum + avg);
+    return ((in - avg) * (var - adap_filter->noise) / var + avg);
 }
 
 static void thresh_filter_init(struct yas_thresh_filter *thresh_filter)
@@ -231,6 +286,11 @@ inv_error_t inv_get_compass_data(long *data)
         return INV_ERROR_INVALID_CONFIGURATION;
     }
 
+    /* The MPU3050 auxiliary I2C master serves a single slave, which the
+       DMP reads into its own accel registers: on tuna that is the BMA250,
+       and the YAS530 is wired to the host bus.  The compass samples can
+       therefore not come in the DMP FIFO packet and are read here, at the
+       50 Hz of the supervisor, in the same pass as the FIFO drain. */
     if (mldl_cfg->pdata->compass.bus == EXT_SLAVE_BUS_PRIMARY ||
         !(mldl_cfg->requested_sensors & INV_DMP_PROCESSOR)) {
         /*--- read the compass sensor data.
@@ -49,6 +49,10 @@ struct yas_adaptive_filter {
     int len;
     float noise;
     float sequence[YAS_MAX_FILTER_LEN];
+    /* running statistics over sequence, kept up to date per sample */
+    double sum;
+    double sumsq;
+    float sorted[YAS_MAX_FILTER_LEN];
 };
 
 struct yas_thresh_filter {
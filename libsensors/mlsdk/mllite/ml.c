@@ -66,6 +66,7 @@
 #include "mlBiasNoMotion.h"
 #include "mlSetGyroBias.h"
 #include "log.h"
+#include "tuna_trace.h"
 #undef MPL_LOG_TAG
 #define MPL_LOG_TAG "MPL-ml"
 
@@ -816,6 +817,8 @@ inv_error_t inv_update_data(void)
     uint_fast8_t mpu_interrupt;
     struct mldl_cfg *mldl_cfg = inv_get_dl_config();
 
+    TUNA_TRACE_SCOPE("inv_update_data");
+
     if (inv_get_state() != INV_STATE_DMP_STARTED)
         return INV_ERROR_SM_IMPROPER_STATE;
 
@@ -399,6 +399,8 @@ struct inv_obj_t {
     inv_error_t inv_get_linear_accel_float(float *data);
     inv_error_t inv_get_gravity_float(float *data);
     inv_error_t inv_get_magnetometer_float(float *data);
+    inv_error_t inv_get_gyro_bias_float(float *data);
+    inv_error_t inv_get_magnetometer_bias_float(float *data);
     inv_error_t inv_get_compass_accuracy(int *accuracy);
     inv_error_t inv_set_accel_bias(long *data);
     inv_error_t inv_set_gyro_temp_slope(long *data);
@@ -76,6 +76,7 @@ static inv_error_t inv_update_bias(void)
     INVENSENSE_FUNC_START;
     inv_error_t result;
     unsigned char regs[12];
+    int caller;
     short bias[GYRO_NUM_AXES];
 
     if ((inv_params_obj.bias_mode & INV_BIAS_FROM_NO_MOTION)
@@ -109,9 +110,11 @@ static inv_error_t inv_update_bias(void)
             return result;
         }
 
+        caller = inv_serial_set_caller(INV_SERIAL_CALLER_CAL);
         result =
             inv_serial_read(inv_get_serial_handle(), inv_get_mpu_slave_addr(),
                             MPUREG_TEMP_OUT_H, 2, regs);
+        inv_serial_set_caller(caller);
         if (result) {
             LOG_RESULT_LOCATION(result);
             return result;
@@ -127,23 +130,20 @@ static inv_error_t inv_update_bias(void)
     return INV_SUCCESS;
 }
 
-static inv_error_t MLAccelMotionDetection(struct inv_obj_t *inv_obj)
+static inv_error_t MLAccelMotionDetection(struct inv_obj_t *inv_obj,
+                                          unsigned long currentTime)
 {
-    long gain;
-    unsigned long timeChange;
+    long gain, keep;
     long rate;
     inv_error_t result;
     long accel[3], temp;
     long long accelMag;
-    unsigned long currentTime;
     int kk;
 
     if (!inv_accel_present()) {
         return INV_SUCCESS;
     }
 
-    currentTime = inv_get_tick_count();
-
     // We always run the accel low pass filter at the highest sample rate possible
     result = inv_get_accel(accel);
     if (result != INV_ERROR_FEATURE_NOT_ENABLED) {
@@ -156,14 +156,14 @@ static inv_error_t MLAccelMotionDetection(struct inv_obj_t *inv_obj)
             rate = 200;
 
         gain = inv_obj->accel_lpf_gain * rate;
-        timeChange = inv_get_fifo_rate();
+        keep = (1L << 30) - gain;
 
         accelMag = 0;
         for (kk = 0; kk < ACCEL_NUM_AXES; ++kk) {
             inv_obj->accel_lpf[kk] =
-                inv_q30_mult(((1L << 30) - gain), inv_obj->accel_lpf[kk]);
-            inv_obj->accel_lpf[kk] += inv_q30_mult(gain, accel[kk]);
-            temp = accel[0] - inv_obj->accel_lpf[0];
+                inv_q30_mult(keep, inv_obj->accel_lpf[kk]) +
+                inv_q30_mult(gain, accel[kk]);
+            temp = accel[kk] - inv_obj->accel_lpf[kk];
             accelMag += (long long)temp *temp;
         }
 
@@ -206,10 +206,11 @@ static inv_error_t MLPollMotionStatus(struct inv_obj_t * inv_obj)
     unsigned long currentTime;
     inv_error_t result;
 
-    result = MLAccelMotionDetection(inv_obj);
-
+    // one tick count read per packet, shared by the checks below
     currentTime = inv_get_tick_count();
 
+    result = MLAccelMotionDetection(inv_obj, currentTime);
+
     // If it is not time to poll for a no motion event, return
     if (((inv_obj->interrupt_sources & INV_INT_MOTION) == 0) &&
         ((currentTime - inv_obj->poll_no_motion) <= 1000))
@@ -233,7 +234,7 @@ static inv_error_t MLPollMotionStatus(struct inv_obj_t * inv_obj)
         if (motionFlag == inv_obj->motion_duration) {
             if (inv_obj->motion_state == INV_MOTION) {
                 inv_update_bias();
-                repeatBiasUpdateTime = inv_get_tick_count();
+                repeatBiasUpdateTime = currentTime;
 
                 regs[0] = DINAD8 + 1;
                 regs[1] = DINA0C;
@@ -281,9 +282,9 @@ static inv_error_t MLPollMotionStatus(struct inv_obj_t * inv_obj)
             }
         }
         if (inv_obj->motion_state == INV_NO_MOTION) {
-            if ((inv_get_tick_count() - repeatBiasUpdateTime) > 4000) {
+            if ((currentTime - repeatBiasUpdateTime) > 4000) {
                 inv_update_bias();
-                repeatBiasUpdateTime = inv_get_tick_count();
+                repeatBiasUpdateTime = currentTime;
             }
         }
     }
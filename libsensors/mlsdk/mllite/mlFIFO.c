@@ -32,6 +32,8 @@
 **/
 
 #include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <string.h>
 #include "mpu.h"
 #include "mpu3050.h"
@@ -119,11 +121,22 @@ const int fifo_base_offset[NUMFIFOELEMENTS] = {
     REF_GARBAGE * 4
 };
 
+/* a run of big endian words of the same size going to consecutive entries
+   of fifo_obj.decoded, see inv_set_footer() */
+struct fifo_run {
+    unsigned char src;          // byte offset in the packet
+    unsigned char dst;          // first entry of fifo_obj.decoded
+    unsigned char count;        // number of words
+    unsigned char shift;        // 0 for 32 bit words, 16 for 16 bit ones
+};
+
 struct fifo_obj {
     void (*fifo_process_cb) (void);
     long decoded[REF_LAST];
     long decoded_accel[INV_MAX_NUM_ACCEL_SAMPLES][ACCEL_NUM_AXES];
     int offsets[REF_LAST * 4];
+    struct fifo_run runs[REF_LAST];
+    int num_runs;               // 0 if the layout needs the byte decoder
     int cache;
     uint_fast8_t gyro_source;
     unsigned short fifo_rate;
@@ -134,6 +147,7 @@ struct fifo_obj {
     long acc_bias_filt[3];
     float acc_filter_coef;
     long gravity_cache[3];
+    long rot_mat_cache[9];
 };
 
 static struct fifo_obj fifo_obj;
@@ -142,15 +156,25 @@ static struct fifo_obj fifo_obj;
 #define FIFO_CACHE_GYRO 2
 #define FIFO_CACHE_GRAVITY_BODY 4
 #define FIFO_CACHE_ACC_BIAS 8
+#define FIFO_CACHE_ROT_MAT 16
 
-struct fifo_rate_obj {
-    // These describe callbacks happening everytime a FIFO block is processed
+struct fifo_rate_table {
     int_fast8_t num_cb;
-    HANDLE mutex;
     inv_obj_func fifo_process_cb[MAX_HIGH_RATE_PROCESSES];
     int priority[MAX_HIGH_RATE_PROCESSES];
 };
 
+struct fifo_rate_obj {
+    // These describe callbacks happening everytime a FIFO block is processed.
+    // (Un)registration takes the mutex, edits the table not in use and
+    // publishes it; inv_run_fifo_rate_processes() runs the published table
+    // without locking.
+    HANDLE mutex;
+    struct fifo_rate_table tables[2];
+    struct fifo_rate_table *_Atomic current;
+    atomic_int readers;
+};
+
 struct fifo_rate_obj fifo_rate_obj;
 
 /** Sets accuracy to be one of 0, INV_32_BIT, or INV_16_BIT. Looks up old
@@ -246,6 +270,34 @@ static inv_error_t inv_construct3_fifo(unsigned char *regs,
     return result;
 }
 
+/**
+ *  @internal
+ *  @brief  Append a word of the packet layout to the decode runs, merging
+ *          it with the previous run when both are contiguous.
+ *  @param  src     byte offset of the word in the packet.
+ *  @param  dst     entry of fifo_obj.decoded it goes to.
+ *  @param  is32    non-zero for a 32 bit word.
+ */
+static void inv_add_fifo_run(int src, int dst, int is32)
+{
+    struct fifo_run *run;
+    unsigned char shift = is32 ? 0 : 16;
+
+    if (fifo_obj.num_runs > 0) {
+        run = &fifo_obj.runs[fifo_obj.num_runs - 1];
+        if (run->shift == shift && run->dst + run->count == dst &&
+            run->src + run->count * (is32 ? 4 : 2) == src) {
+            run->count++;
+            return;
+        }
+    }
+    run = &fifo_obj.runs[fifo_obj.num_runs++];
+    run->src = (unsigned char)src;
+    run->dst = (unsigned char)dst;
+    run->count = 1;
+    run->shift = shift;
+}
+
 /**
  * @internal
  * Puts footer on FIFO data.
@@ -258,8 +310,10 @@ static inv_error_t inv_set_footer(void)
     int offset;
     int result;
     int *fifo_offsets_ptr = fifo_obj.offsets;
+    int byte_order_ok = TRUE;
 
     fifo_obj.fifo_packet_size = 0;
+    fifo_obj.num_runs = 0;
     for (i = 0; i < NUMFIFOELEMENTS; i++) {
         tmp_count = 0;
         offset = fifo_base_offset[i];
@@ -270,7 +324,11 @@ static inv_error_t inv_set_footer(void)
                     tmp_count += 2;
                     *fifo_offsets_ptr++ = offset + 2;
                     *fifo_offsets_ptr++ = offset + 3;
+                    byte_order_ok = FALSE;
                 } else {
+                    inv_add_fifo_run(fifo_obj.fifo_packet_size + tmp_count,
+                                     offset / 4,
+                                     fifo_obj.data_config[i] & INV_32_BIT);
                     tmp_count += 2;
                     *fifo_offsets_ptr++ = offset + 3;
                     *fifo_offsets_ptr++ = offset + 2;
@@ -294,6 +352,10 @@ static inv_error_t inv_set_footer(void)
             return result;
         }
         fifo_obj.data_config[CONFIG_FOOTER] = 0x0001 | INV_16_BIT;
+        offset = fifo_base_offset[CONFIG_FOOTER];
+        inv_add_fifo_run(fifo_obj.fifo_packet_size, offset / 4, 0);
+        *fifo_offsets_ptr++ = offset + 3;
+        *fifo_offsets_ptr++ = offset + 2;
         fifo_obj.fifo_packet_size += 2;
     } else if (fifo_obj.data_config[CONFIG_FOOTER] &&
                (fifo_obj.fifo_packet_size == 2)) {
@@ -306,7 +368,10 @@ static inv_error_t inv_set_footer(void)
         }
         fifo_obj.data_config[CONFIG_FOOTER] = 0;
         fifo_obj.fifo_packet_size = 0;
+        fifo_obj.num_runs = 0;
     }
+    if (!byte_order_ok)
+        fifo_obj.num_runs = 0;
 
     return INV_SUCCESS;
 }
@@ -425,6 +490,7 @@ inv_error_t inv_init_fifo_param(void)
         return INV_ERROR_OS_CREATE_FAILED;
     }
     fifo_rate_obj.mutex = (HANDLE)pm;
+    atomic_store(&fifo_rate_obj.current, &fifo_rate_obj.tables[0]);
 
     result = inv_register_state_callback(inv_state_change_fifo);
     if (result) {
@@ -494,9 +560,12 @@ inv_error_t inv_read_and_process_fifo(int_fast8_t numPackets,
 {
     int_fast8_t packet;
     inv_error_t result = INV_SUCCESS;
-    uint_fast16_t read;
     struct mldl_cfg *mldl_cfg = inv_get_dl_config();
     int kk;
+    /* packets drained in one burst, decoded from memory */
+    unsigned char staging[FIFO_HW_SIZE + FIFO_FOOTER_SIZE];
+    uint_fast16_t staged = 0;
+    uint_fast16_t next = 0;
 
     if (NULL == processed)
         return INV_ERROR_INVALID_PARAMETER;
@@ -507,18 +576,25 @@ inv_error_t inv_read_and_process_fifo(int_fast8_t numPackets,
 
     for (packet = 0; packet < numPackets; ++packet) {
         if (mldl_cfg->requested_sensors & INV_DMP_PROCESSOR) {
-            unsigned char footer_n_data[MAX_FIFO_LENGTH + FIFO_FOOTER_SIZE];
-            unsigned char *buf = &footer_n_data[FIFO_FOOTER_SIZE];
-            read = inv_get_fifo((uint_fast16_t) fifo_obj.fifo_packet_size,
-                                footer_n_data);
-            if (0 == read ||
-                read != fifo_obj.fifo_packet_size - FIFO_FOOTER_SIZE) {
-                result = inv_get_fifo_status();
-                if (INV_SUCCESS != result) {
-                    memset(fifo_obj.decoded, 0, sizeof(fifo_obj.decoded));
+            unsigned char *buf;
+            if (next == staged) {
+                // refill once everything read so far has been decoded
+                int caller = inv_serial_set_caller(INV_SERIAL_CALLER_FIFO);
+                staged = inv_get_fifo_packets(
+                    (uint_fast16_t) fifo_obj.fifo_packet_size,
+                    (uint_fast16_t) (numPackets - packet), staging);
+                inv_serial_set_caller(caller);
+                next = 0;
+                if (0 == staged) {
+                    result = inv_get_fifo_status();
+                    if (INV_SUCCESS != result) {
+                        memset(fifo_obj.decoded, 0, sizeof(fifo_obj.decoded));
+                    }
+                    return result;
                 }
-                return result;
             }
+            buf = &staging[next * fifo_obj.fifo_packet_size + FIFO_FOOTER_SIZE];
+            next++;
 
             result = inv_process_fifo_packet(buf);
             if (result) {
@@ -635,16 +711,35 @@ inv_error_t inv_process_fifo_packet(const unsigned char *dmpData)
 
     memset(&fifo_obj.decoded, 0, sizeof(fifo_obj.decoded));
 
-    for (kk = 0; kk < N; ++kk) {
-        p[fifo_obj.offsets[kk]] = *dmpData++;
+    if (fifo_obj.num_runs) {
+        // word decoder for the layouts without special byte ordering
+        int rr;
+        for (rr = 0; rr < fifo_obj.num_runs; ++rr) {
+            const struct fifo_run *run = &fifo_obj.runs[rr];
+            const unsigned char *src = dmpData + run->src;
+            long *dst = &fifo_obj.decoded[run->dst];
+            if (run->shift) {
+                for (kk = 0; kk < run->count; ++kk, src += 2)
+                    dst[kk] = (int32_t)(((uint32_t)src[0] << 24) |
+                                        ((uint32_t)src[1] << 16));
+            } else {
+                for (kk = 0; kk < run->count; ++kk, src += 4)
+                    dst[kk] = (int32_t)(((uint32_t)src[0] << 24) |
+                                        ((uint32_t)src[1] << 16) |
+                                        ((uint32_t)src[2] << 8) |
+                                        (uint32_t)src[3]);
+            }
+        }
+    } else {
+        for (kk = 0; kk < N; ++kk) {
+            p[fifo_obj.offsets[kk]] = *dmpData++;
+        }
     }
 
     // If multiplies are much greater cost than if checks, you could check
     // to see if fifo_scale is non-zero first, or equal to (1L<<30)
-    for (kk = 0; kk < REF_LAST; ++kk) {
-        fifo_obj.decoded[kk] =
-            inv_q30_mult(fifo_obj.decoded[kk], fifo_scale[kk]);
-    }
+    inv_q30_mult_array(fifo_obj.decoded, fifo_scale, fifo_obj.decoded,
+                       REF_LAST);
 
     memcpy(&fifo_obj.decoded[REF_QUATERNION_6AXIS],
            &fifo_obj.decoded[REF_QUATERNION], 4 * sizeof(long));
@@ -994,36 +1089,24 @@ inv_error_t inv_get_gyro(long *data)
  */
 inv_error_t inv_get_gravity(long *data)
 {
-    long quat[4];
+    long rot[9];
     int ii;
     inv_error_t result;
 
     if (data == NULL)
         return INV_ERROR_INVALID_PARAMETER;
 
-    if (!fifo_obj.data_config[CONFIG_QUAT])
-        return INV_ERROR_FEATURE_NOT_ENABLED;
-
     if ((fifo_obj.cache & FIFO_CACHE_GRAVITY_BODY) == 0) {
-        fifo_obj.cache |= FIFO_CACHE_GRAVITY_BODY;
-
-        // Compute it from Quaternion
-        result = inv_get_quaternion(quat);
+        // The last row of the rotation matrix is gravity in body frame
+        result = inv_get_rot_mat(rot);
         if (result) {
             LOG_RESULT_LOCATION(result);
             return result;
         }
-
-        data[0] =
-            inv_q29_mult(quat[1], quat[3]) - inv_q29_mult(quat[2], quat[0]);
-        data[1] =
-            inv_q29_mult(quat[2], quat[3]) + inv_q29_mult(quat[1], quat[0]);
-        data[2] =
-            (inv_q29_mult(quat[3], quat[3]) + inv_q29_mult(quat[0], quat[0])) -
-            1073741824L;
+        fifo_obj.cache |= FIFO_CACHE_GRAVITY_BODY;
 
         for (ii = 0; ii < ACCEL_NUM_AXES; ii++) {
-            data[ii] >>= 14;
+            data[ii] = rot[6 + ii] >> 14;
             fifo_obj.gravity_cache[ii] = data[ii];
         }
     } else {
@@ -1035,6 +1118,38 @@ inv_error_t inv_get_gravity(long *data)
     return INV_SUCCESS;
 }
 
+/**
+ *  @brief  Get the rotation matrix of the current fusion solution.
+ *          It is computed from the quaternion at most once per FIFO
+ *          packet and shared by the gravity, linear acceleration and
+ *          orientation outputs.
+ *  @param  data
+ *              9-element rotation matrix, see inv_quaternion_to_rotation().
+ *              One is 2^30.
+ *  @return 0 on success or an error code.
+ */
+inv_error_t inv_get_rot_mat(long *data)
+{
+    long quat[4];
+    inv_error_t result;
+
+    if (data == NULL)
+        return INV_ERROR_INVALID_PARAMETER;
+
+    if ((fifo_obj.cache & FIFO_CACHE_ROT_MAT) == 0) {
+        result = inv_get_quaternion(quat);
+        if (result) {
+            LOG_RESULT_LOCATION(result);
+            return result;
+        }
+        fifo_obj.cache |= FIFO_CACHE_ROT_MAT;
+        inv_quaternion_to_rotation(quat, fifo_obj.rot_mat_cache);
+    }
+    memcpy(data, fifo_obj.rot_mat_cache, sizeof(fifo_obj.rot_mat_cache));
+
+    return INV_SUCCESS;
+}
+
 /**
  *  @brief      Returns 3-element vector of accelerometer data in body frame
  *              with gravity removed.
@@ -1262,6 +1377,22 @@ int_fast16_t inv_get_sample_step_size_ms(void)
         return fifo_obj.sample_step_size_ms;
 }
 
+/**
+ * @brief   Returns the number of whole packets the hardware FIFO can hold with
+ *          the current FIFO contents.
+ *
+ * Used to bound the time FIFO packets can be left unread before the FIFO
+ * overflows.
+ *
+ * @return  number of packets, 0 if nothing is sent to the FIFO.
+ */
+uint_fast16_t inv_get_fifo_max_packets(void)
+{
+    if (fifo_obj.fifo_packet_size == 0)
+        return 0;
+    return FIFO_HW_SIZE / fifo_obj.fifo_packet_size;
+}
+
 /**
  *  @brief  The gyro data magnitude squared :
  *          (1 degree per second)^2 = 2^6 = 2^GYRO_MAG_SQR_SHIFT.
@@ -1319,6 +1450,35 @@ void inv_override_quaternion(float *q)
     }
 }
 
+/**
+ * @internal
+ * @brief   Get a copy of the published callback table to edit.
+ *          Must be called with the fifo_rate_obj mutex held.
+ */
+static struct fifo_rate_table *fifo_rate_edit_table(void)
+{
+    struct fifo_rate_table *cur = atomic_load(&fifo_rate_obj.current);
+    struct fifo_rate_table *next = (cur == &fifo_rate_obj.tables[0]) ?
+        &fifo_rate_obj.tables[1] : &fifo_rate_obj.tables[0];
+
+    *next = *cur;
+    return next;
+}
+
+/**
+ * @internal
+ * @brief   Make an edited callback table the one run for each packet, and
+ *          wait until the previous one is no longer being run so that it
+ *          can be edited next time.
+ *          Must be called with the fifo_rate_obj mutex held.
+ */
+static void fifo_rate_publish_table(struct fifo_rate_table *table)
+{
+    atomic_store(&fifo_rate_obj.current, table);
+    while (atomic_load(&fifo_rate_obj.readers))
+        sched_yield();
+}
+
 /**
  * @internal
  * @brief   This registers a function to be called for each set of
@@ -1332,45 +1492,48 @@ inv_error_t inv_register_fifo_rate_process(inv_obj_func func, int priority)
 {
     INVENSENSE_FUNC_START;
     inv_error_t result = INV_SUCCESS;
+    struct fifo_rate_table *table;
     int kk, nn;
 
     pthread_mutex_t *pm = (pthread_mutex_t*)fifo_rate_obj.mutex;
     if (pthread_mutex_lock(pm) == -1) {
         return INV_ERROR_OS_LOCK_FAILED;
     }
+    table = fifo_rate_edit_table();
 
     // Make sure we haven't registered this function already
     // Or used the same priority
-    for (kk = 0; kk < fifo_rate_obj.num_cb; ++kk) {
-        if ((fifo_rate_obj.fifo_process_cb[kk] == func) ||
-            (fifo_rate_obj.priority[kk] == priority)) {
+    for (kk = 0; kk < table->num_cb; ++kk) {
+        if ((table->fifo_process_cb[kk] == func) ||
+            (table->priority[kk] == priority)) {
             pthread_mutex_unlock(pm);
             return INV_ERROR_INVALID_PARAMETER;
         }
     }
 
     // Make sure we have not filled up our number of allowable callbacks
-    if (fifo_rate_obj.num_cb <= MAX_HIGH_RATE_PROCESSES - 1) {
+    if (table->num_cb <= MAX_HIGH_RATE_PROCESSES - 1) {
         kk = 0;
-        if (fifo_rate_obj.num_cb != 0) {
+        if (table->num_cb != 0) {
             // set kk to be where this new callback goes in the array
-            while ((kk < fifo_rate_obj.num_cb) &&
-                   (fifo_rate_obj.priority[kk] < priority)) {
+            while ((kk < table->num_cb) &&
+                   (table->priority[kk] < priority)) {
                 kk++;
             }
-            if (kk != fifo_rate_obj.num_cb) {
+            if (kk != table->num_cb) {
                 // We need to move the others
-                for (nn = fifo_rate_obj.num_cb; nn > kk; --nn) {
-                    fifo_rate_obj.fifo_process_cb[nn] =
-                        fifo_rate_obj.fifo_process_cb[nn - 1];
-                    fifo_rate_obj.priority[nn] = fifo_rate_obj.priority[nn - 1];
+                for (nn = table->num_cb; nn > kk; --nn) {
+                    table->fifo_process_cb[nn] =
+                        table->fifo_process_cb[nn - 1];
+                    table->priority[nn] = table->priority[nn - 1];
                 }
             }
         }
         // Add new callback
-        fifo_rate_obj.fifo_process_cb[kk] = func;
-        fifo_rate_obj.priority[kk] = priority;
-        fifo_rate_obj.num_cb++;
+        table->fifo_process_cb[kk] = func;
+        table->priority[kk] = priority;
+        table->num_cb++;
+        fifo_rate_publish_table(table);
     } else {
         result = INV_ERROR_MEMORY_EXAUSTED;
     }
@@ -1390,25 +1553,28 @@ inv_error_t inv_unregister_fifo_rate_process(inv_obj_func func)
     INVENSENSE_FUNC_START;
     int kk, jj;
     inv_error_t result;
+    struct fifo_rate_table *table;
 
     pthread_mutex_t *pm = (pthread_mutex_t*)fifo_rate_obj.mutex;
     if (pthread_mutex_lock(pm) == -1) {
         return INV_ERROR_OS_LOCK_FAILED;
     }
+    table = fifo_rate_edit_table();
 
     // Make sure we haven't registered this function already
     result = INV_ERROR_INVALID_PARAMETER;
-    for (kk = 0; kk < fifo_rate_obj.num_cb; ++kk) {
-        if (fifo_rate_obj.fifo_process_cb[kk] == func) {
-            for (jj = kk + 1; jj < fifo_rate_obj.num_cb; ++jj) {
-                fifo_rate_obj.fifo_process_cb[jj - 1] =
-                    fifo_rate_obj.fifo_process_cb[jj];
-                fifo_rate_obj.priority[jj - 1] =
-                    fifo_rate_obj.priority[jj];
+    for (kk = 0; kk < table->num_cb; ++kk) {
+        if (table->fifo_process_cb[kk] == func) {
+            for (jj = kk + 1; jj < table->num_cb; ++jj) {
+                table->fifo_process_cb[jj - 1] =
+                    table->fifo_process_cb[jj];
+                table->priority[jj - 1] =
+                    table->priority[jj];
             }
-            fifo_rate_obj.fifo_process_cb[fifo_rate_obj.num_cb - 1] = NULL;
-            fifo_rate_obj.priority[fifo_rate_obj.num_cb - 1] = 0;
-            fifo_rate_obj.num_cb--;
+            table->fifo_process_cb[table->num_cb - 1] = NULL;
+            table->priority[table->num_cb - 1] = 0;
+            table->num_cb--;
+            fifo_rate_publish_table(table);
             result = INV_SUCCESS;
             break;
         }
@@ -1433,20 +1599,20 @@ inv_error_t inv_run_fifo_rate_processes(void)
 {
     int kk;
     inv_error_t result = INV_SUCCESS, result2;
+    const struct fifo_rate_table *table;
 
-    pthread_mutex_t *pm = (pthread_mutex_t*)fifo_rate_obj.mutex;
-    if (pthread_mutex_lock(pm) == -1) {
-        MPL_LOGE("MLOsLockMutex returned %d\n", INV_ERROR_OS_LOCK_FAILED);
-        return INV_ERROR_OS_LOCK_FAILED;
-    }
+    // announce the reader before picking the table, see
+    // fifo_rate_publish_table()
+    atomic_fetch_add(&fifo_rate_obj.readers, 1);
+    table = atomic_load(&fifo_rate_obj.current);
 
     // User callbacks take priority over the fifo_process_cb callback
     if (fifo_obj.fifo_process_cb)
         fifo_obj.fifo_process_cb();
 
-    for (kk = 0; kk < fifo_rate_obj.num_cb; ++kk) {
-        if (fifo_rate_obj.fifo_process_cb[kk]) {
-            result2 = fifo_rate_obj.fifo_process_cb[kk] (&inv_obj);
+    for (kk = 0; table && kk < table->num_cb; ++kk) {
+        if (table->fifo_process_cb[kk]) {
+            result2 = table->fifo_process_cb[kk] (&inv_obj);
             if (result == INV_SUCCESS)
 #ifdef UMPL
 	 setUmplDataInFIFOFlag(TRUE);
@@ -1455,7 +1621,7 @@ inv_error_t inv_run_fifo_rate_processes(void)
         }
     }
 
-    pthread_mutex_unlock(pm);
+    atomic_fetch_sub(&fifo_rate_obj.readers, 1);
     return result;
 }
 
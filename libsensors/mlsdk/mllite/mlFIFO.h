@@ -71,6 +71,7 @@ extern "C" {
     inv_error_t inv_set_fifo_rate(unsigned short fifoRate);
     unsigned short inv_get_fifo_rate(void);
     int_fast16_t inv_get_sample_step_size_ms(void);
+    uint_fast16_t inv_get_fifo_max_packets(void);
     long inv_decode_temperature(short tempReg);
 
     // Register callbacks after a packet of FIFO data is processed
@@ -96,6 +97,7 @@ extern "C" {
     inv_error_t inv_get_gyro(long *data);
     inv_error_t inv_get_linear_accel(long *data);
     inv_error_t inv_get_gravity(long *data);
+    inv_error_t inv_get_rot_mat(long *data);
 
     // Get Floating Point data from FIFO
     inv_error_t inv_get_accel_float(float *data);
@@ -44,6 +44,7 @@
 #include "mlsl.h"
 
 #include "log.h"
+#include "tuna_trace.h"
 #undef MPL_LOG_TAG
 #define MPL_LOG_TAG "MPL-fifo"
 
@@ -174,6 +175,107 @@ uint_fast16_t inv_get_fifo(uint_fast16_t length, unsigned char *buffer)
     return length - FIFO_FOOTER_SIZE;
 }
 
+/**
+ *  @internal
+ *  @brief  used to get every whole packet stored in the FIFO in one go.
+ *          The FIFO count is read once, the packets are pulled in a
+ *          single burst and the overflow status is checked once, which
+ *          saves two serial transactions per packet over inv_get_fifo().
+ *  @param  length
+ *              Size of one packet, including its trailing FIFO footer.
+ *  @param  maxPackets
+ *              Maximum number of packets to read.
+ *  @param  buffer
+ *              the bytes of FIFO data.  Packet k starts at
+ *              buffer + k * length + FIFO_FOOTER_SIZE, preceded by the
+ *              footer of the previous packet.
+ *              Note that this buffer <b>must</b> be at least
+ *              maxPackets * length bytes large.
+ *  @return number of packets read.
+**/
+uint_fast16_t inv_get_fifo_packets(uint_fast16_t length,
+                                   uint_fast16_t maxPackets,
+                                   unsigned char *buffer)
+{
+    INVENSENSE_FUNC_START;
+    inv_error_t result;
+    uint_fast16_t inFifo;
+    uint_fast16_t packets;
+    uint_fast16_t toRead;
+    uint_fast16_t kk;
+    int_fast8_t ii;
+
+    /*---- make sure length is correct ----*/
+    if (length > MAX_FIFO_LENGTH || length <= FIFO_FOOTER_SIZE ||
+        NULL == buffer) {
+        fifo_objHW.fifoError = INV_ERROR_INVALID_PARAMETER;
+        return 0;
+    }
+
+    result = inv_get_fifo_length(&inFifo);
+    if (INV_SUCCESS != result) {
+        fifo_objHW.fifoError = result;
+        return 0;
+    }
+    TUNA_TRACE_INT("fifo_count", inFifo);
+    // a packet is complete once its own footer is in the fifo, see
+    // inv_get_fifo() for the footer left over by the previous read
+    if (inFifo < length + fifo_objHW.fifoCount) {
+        fifo_objHW.fifoError = INV_SUCCESS;
+        return 0;
+    }
+    packets = (inFifo - fifo_objHW.fifoCount) / length;
+    if (packets > maxPackets)
+        packets = maxPackets;
+    if (packets > FIFO_HW_SIZE / length)
+        packets = FIFO_HW_SIZE / length;
+
+    toRead = packets * length - FIFO_FOOTER_SIZE + fifo_objHW.fifoCount;
+    result =
+        inv_read_fifo(fifo_objHW.fifoCount >
+                      0 ? buffer : buffer + FIFO_FOOTER_SIZE, toRead);
+    if (INV_SUCCESS != result) {
+        fifo_objHW.fifoError = result;
+        return 0;
+    }
+    // Make sure the fifo didn't overflow before or during the read
+    result = inv_serial_read(inv_get_serial_handle(), inv_get_mpu_slave_addr(),
+                             MPUREG_INT_STATUS, 1, &fifo_objHW.fifoOverflow);
+    if (INV_SUCCESS != result) {
+        fifo_objHW.fifoError = result;
+        return 0;
+    }
+
+    if (fifo_objHW.fifoOverflow & BIT_INT_STATUS_FIFO_OVERLOW) {
+        MPL_LOGV("Resetting Fifo : Overflow\n");
+        inv_reset_fifo();
+        fifo_objHW.fifoError = INV_ERROR_FIFO_OVERFLOW;
+        return 0;
+    }
+
+    /* Check every footer, the first one is only there when the fifo was
+     * read since it was reset */
+    for (kk = 0; kk < packets; ++kk) {
+        unsigned char *footer = buffer + kk * length;
+        int_fast8_t footerSize = kk ? FIFO_FOOTER_SIZE : fifo_objHW.fifoCount;
+        for (ii = 0; ii < footerSize; ++ii) {
+            if (footer[ii] != gFifoFooter[ii]) {
+                MPL_LOGV("Resetting Fifo : Invalid footer : 0x%02x 0x%02x\n",
+                         footer[0], footer[1]);
+                inv_reset_fifo();
+                fifo_objHW.fifoError = INV_ERROR_FIFO_FOOTER;
+                return 0;
+            }
+        }
+    }
+
+    if (fifo_objHW.fifoCount == 0) {
+        fifo_objHW.fifoCount = FIFO_FOOTER_SIZE;
+    }
+
+    return packets;
+}
+
 /**
  *  @brief  Used to query the status of the FIFO.
  *  @return INV_SUCCESS if the fifo is OK. An error code otherwise.
@@ -32,6 +32,9 @@ extern "C" {
 #define FIFO_FOOTER_SIZE            (2)
 
     uint_fast16_t inv_get_fifo(uint_fast16_t length, unsigned char *buffer);
+    uint_fast16_t inv_get_fifo_packets(uint_fast16_t length,
+                                       uint_fast16_t maxPackets,
+                                       unsigned char *buffer);
     inv_error_t inv_get_fifo_status(void);
     inv_error_t inv_get_fifo_length(uint_fast16_t * len);
     short inv_get_fifo_count(void);
@@ -19,6 +19,13 @@
 #include "mlMathFunc.h"
 #include "mlinclude.h"
 
+/* The NEON backend is picked at build time whenever the target has NEON
+ * and long is 32 bits wide; define INV_MATH_SCALAR to force the scalar
+ * reference code, which both backends must match bit for bit. */
+#if defined(__ARM_NEON__) && !defined(__aarch64__) && !defined(INV_MATH_SCALAR)
+#define INV_MATH_NEON
+#include <arm_neon.h>
+#endif
 
 /** Performs a multiply and shift by 29. These are good functions to write in assembly on
  * with devices with small memory where you want to get rid of the long long which some
@@ -52,6 +59,61 @@ long inv_q30_mult(long a, long b)
     return result;
 }
 
+/** Performs inv_q30_mult() element wise over two arrays.
+ * @param[in] a
+ * @param[in] b
+ * @param[out] out out[i] = ((long long)a[i]*b[i])>>30, may alias a or b
+ * @param[in] len number of elements
+*/
+void inv_q30_mult_array(const long *a, const long *b, long *out, int len)
+{
+    int i = 0;
+#ifdef INV_MATH_NEON
+    for (; i + 4 <= len; i += 4) {
+        int32x4_t va = vld1q_s32((const int32_t *)&a[i]);
+        int32x4_t vb = vld1q_s32((const int32_t *)&b[i]);
+        int32x2_t lo = vshrn_n_s64(vmull_s32(vget_low_s32(va),
+                                             vget_low_s32(vb)), 30);
+        int32x2_t hi = vshrn_n_s64(vmull_s32(vget_high_s32(va),
+                                             vget_high_s32(vb)), 30);
+        vst1q_s32((int32_t *)&out[i], vcombine_s32(lo, hi));
+    }
+#endif
+    for (; i < len; i++)
+        out[i] = inv_q30_mult(a[i], b[i]);
+}
+
+#ifdef INV_MATH_NEON
+void inv_q_mult(const long *q1, const long *q2, long *qProd)
+{
+    static const int32_t sign1[4] = { -1, 1, -1, 1 };
+    static const int32_t sign2[4] = { -1, 1, 1, -1 };
+    static const int32_t sign3[4] = { -1, -1, 1, 1 };
+    int32x4_t b0, b1, b2, b3;
+    int64x2_t lo, hi;
+
+    INVENSENSE_FUNC_START;
+    /* qProd = q1[0] * (b0 b1 b2 b3) + q1[1] * (-b1 b0 -b3 b2)
+     *       + q1[2] * (-b2 b3 b0 -b1) + q1[3] * (-b3 -b2 b1 b0) */
+    b0 = vld1q_s32((const int32_t *)q2);
+    b1 = vmulq_s32(vrev64q_s32(b0), vld1q_s32(sign1));
+    b2 = vcombine_s32(vget_high_s32(b0), vget_low_s32(b0));
+    b3 = vmulq_s32(vrev64q_s32(b2), vld1q_s32(sign3));
+    b2 = vmulq_s32(b2, vld1q_s32(sign2));
+
+    lo = vmull_n_s32(vget_low_s32(b0), q1[0]);
+    lo = vmlal_n_s32(lo, vget_low_s32(b1), q1[1]);
+    lo = vmlal_n_s32(lo, vget_low_s32(b2), q1[2]);
+    lo = vmlal_n_s32(lo, vget_low_s32(b3), q1[3]);
+    hi = vmull_n_s32(vget_high_s32(b0), q1[0]);
+    hi = vmlal_n_s32(hi, vget_high_s32(b1), q1[1]);
+    hi = vmlal_n_s32(hi, vget_high_s32(b2), q1[2]);
+    hi = vmlal_n_s32(hi, vget_high_s32(b3), q1[3]);
+
+    vst1q_s32((int32_t *)qProd,
+              vcombine_s32(vshrn_n_s64(lo, 30), vshrn_n_s64(hi, 30)));
+}
+#else
 void inv_q_mult(const long *q1, const long *q2, long *qProd)
 {
     INVENSENSE_FUNC_START;
@@ -68,6 +130,7 @@ void inv_q_mult(const long *q1, const long *q2, long *qProd)
         (long)(((long long)q1[0] * q2[3] + (long long)q1[1] * q2[2] -
                 (long long)q1[2] * q2[1] + (long long)q1[3] * q2[0]) >> 30);
 }
+#endif
 
 void inv_q_invert(const long *q, long *qInverted)
 {
@@ -87,6 +150,40 @@ void inv_q_invert(const long *q, long *qInverted)
  *             by a 3 element column vector transform a vector from Body
  *             to World.
  */
+#ifdef INV_MATH_NEON
+void inv_quaternion_to_rotation(const long *quat, long *rot)
+{
+    const int32_t l[4] = { quat[1], quat[1], quat[2], quat[3] };
+    const int32_t r[4] = { quat[2], quat[3], quat[3], quat[0] };
+    const int32_t l2[2] = { quat[2], quat[1] };
+    int32x4_t q = vld1q_s32((const int32_t *)quat);
+    int32x4_t vl = vld1q_s32(l);
+    int32x4_t vr = vld1q_s32(r);
+    int32x2_t q0 = vdup_n_s32(quat[0]);
+    int32_t sq[4], cr[4], c0[2];
+
+    /* the ten distinct q29 products, each truncated on its own exactly
+     * like the scalar inv_q29_mult() terms */
+    vst1q_s32(sq, vcombine_s32(
+                  vshrn_n_s64(vmull_s32(vget_low_s32(q), vget_low_s32(q)), 29),
+                  vshrn_n_s64(vmull_s32(vget_high_s32(q), vget_high_s32(q)), 29)));
+    vst1q_s32(cr, vcombine_s32(
+                  vshrn_n_s64(vmull_s32(vget_low_s32(vl), vget_low_s32(vr)), 29),
+                  vshrn_n_s64(vmull_s32(vget_high_s32(vl), vget_high_s32(vr)), 29)));
+    vst1_s32(c0, vshrn_n_s64(vmull_s32(vld1_s32(l2), q0), 29));
+
+    /* sq = q0q0 q1q1 q2q2 q3q3, cr = q1q2 q1q3 q2q3 q3q0, c0 = q2q0 q1q0 */
+    rot[0] = sq[1] + sq[0] - 1073741824L;
+    rot[1] = cr[0] - cr[3];
+    rot[2] = cr[1] + c0[0];
+    rot[3] = cr[0] + cr[3];
+    rot[4] = sq[2] + sq[0] - 1073741824L;
+    rot[5] = cr[2] - c0[1];
+    rot[6] = cr[1] - c0[0];
+    rot[7] = cr[2] + c0[1];
+    rot[8] = sq[3] + sq[0] - 1073741824L;
+}
+#else
 void inv_quaternion_to_rotation(const long *quat, long *rot)
 {
     rot[0] =
@@ -105,6 +202,7 @@ void inv_quaternion_to_rotation(const long *quat, long *rot)
         inv_q29_mult(quat[3], quat[3]) + inv_q29_mult(quat[0],
                                                       quat[0]) - 1073741824L;
 }
+#endif
 
 /** Converts a 32-bit long to a big endian byte stream */
 unsigned char *inv_int32_to_big8(long x, unsigned char *big8)
@@ -26,6 +26,7 @@ extern "C" {
 
     long inv_q29_mult(long a, long b);
     long inv_q30_mult(long a, long b);
+    void inv_q30_mult_array(const long *a, const long *b, long *out, int len);
     void inv_q_mult(const long *q1, const long *q2, long *qProd);
     void inv_q_invert(const long *q, long *qInverted);
     void inv_quaternion_to_rotation(const long *quat, long *rot);
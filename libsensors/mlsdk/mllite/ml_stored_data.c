@@ -32,6 +32,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "ml_stored_data.h"
 #include "ml.h"
 #include "mlFIFO.h"
@@ -76,6 +77,53 @@ extern struct inv_obj_t inv_obj;
 #define STORECAL_LOG(...)
 #endif
 
+/*
+    Calibration type 6 is a snapshot of the parsed calibration state in
+    native layout, so that it can be loaded with a single copy (or used in
+    place from a mapped file) instead of being decoded value by value.
+    The record keeps the usual header and trailing checksum; the snapshot
+    itself starts on an 8 byte boundary after a 2 byte pad.
+*/
+#define INV_CAL_TYPE_SNAPSHOT   (6)
+#define INV_CAL_SNAPSHOT_OFFSET (8)
+
+struct inv_cal_snapshot {
+    uint32_t layout;
+    int temp_ptrs[BINS];
+    long temp_valid_data[BINS];
+    float temp_data[BINS][PTS_PER_BIN];
+    float x_gyro_temp_data[BINS][PTS_PER_BIN];
+    float y_gyro_temp_data[BINS][PTS_PER_BIN];
+    float z_gyro_temp_data[BINS][PTS_PER_BIN];
+    long accel_bias[3];
+    long got_compass_bias;
+    int got_init_compass_bias;
+    long compass_state;
+    long compass_bias_error[3];
+    long init_compass_bias[3];
+    long compass_bias[3];
+    int compass_peaks[18];
+    long compass_scale[3];
+    double compass_bias_v[3];
+    double compass_bias_ptr[9];
+    double compass_prev_xty[6];
+    double compass_prev_m[36];
+    long compass_offsets[3];
+    unsigned short compass_offset_valid;
+    int compass_accuracy;
+};
+
+/* bump the high byte whenever the meaning of a field changes; a change of
+   size is caught by the low bits */
+#define INV_CAL_SNAPSHOT_LAYOUT \
+    ((1UL << 24) | (sizeof(struct inv_cal_snapshot) & 0xffffff))
+#define INV_CAL_SNAPSHOT_LEN \
+    (INV_CAL_SNAPSHOT_OFFSET + sizeof(struct inv_cal_snapshot) + \
+     INV_CAL_CHK_LEN)
+
+typedef char inv_cal_snapshot_fits[
+    INV_CAL_SNAPSHOT_LEN <= INV_CAL_MAX_LEN ? 1 : -1];
+
 /**
  *  @brief  Duplicate of the inv_temp_comp_find_bin function in the libmpl
  *          advanced algorithms library. To remove cross-dependency, for now,
@@ -93,6 +141,7 @@ static int FindTempBin(float temp)
     return bin;
 }
 
+#ifdef INV_CAL_STORE_V4
 /**
  * @brief   Returns the length of the <b>MPL internal calibration data</b>.
  *          Should be called before allocating the memory required to store
@@ -118,6 +167,7 @@ static unsigned int inv_get_cal_length(void)
         INV_CAL_CHK_LEN;        // checksum
     return length;
 }
+#endif
 
 /**
  *  @brief  Loads a type 0 set of calibration data.
@@ -1140,6 +1190,115 @@ static inv_error_t inv_load_cal_V5(unsigned char *calData, unsigned short len)
     return INV_SUCCESS;
 }
 
+/**
+ *  @brief  Loads a type 6 set of calibration data.
+ *          Type 6 is a snapshot of the same state as type 4 in the native
+ *          layout of struct inv_cal_snapshot, so it is copied back into
+ *          the MPL state without any parsing.
+ *          A snapshot written by a build with a different layout is
+ *          rejected; the next store writes a fresh one.
+ *
+ *  @pre    inv_dmp_open()
+ *          @ifnot MPL_MF
+ *              or inv_open_low_power_pedometer()
+ *              or inv_eis_open_dmp()
+ *          @endif
+ *          must have been called.
+ *
+ *  @param  calData
+ *              A pointer to an array of bytes to be parsed, aligned for
+ *              double.
+ *  @param  len
+ *              the length of the calibration
+ *
+ *  @return INV_SUCCESS if successful, a non-zero error code otherwise.
+ */
+static inv_error_t inv_load_cal_V6(unsigned char *calData, unsigned short len)
+{
+    INVENSENSE_FUNC_START;
+    const struct inv_cal_snapshot *snap =
+        (const struct inv_cal_snapshot *)(calData + INV_CAL_SNAPSHOT_OFFSET);
+    inv_error_t result;
+
+    LOADCAL_LOG("Entering inv_load_cal_V6\n");
+
+    if (len != INV_CAL_SNAPSHOT_LEN) {
+        MPL_LOGE("Calibration data type 6 must be %d bytes long (got %d)\n",
+                 (int)INV_CAL_SNAPSHOT_LEN, len);
+        return INV_ERROR_FILE_READ;
+    }
+    if (snap->layout != INV_CAL_SNAPSHOT_LAYOUT) {
+        MPL_LOGE("Calibration snapshot layout %08x does not match %08lx\n",
+                 snap->layout, INV_CAL_SNAPSHOT_LAYOUT);
+        return INV_ERROR_FILE_READ;
+    }
+
+    memcpy(inv_obj.temp_ptrs, snap->temp_ptrs, sizeof(snap->temp_ptrs));
+    memcpy(inv_obj.temp_valid_data, snap->temp_valid_data,
+           sizeof(snap->temp_valid_data));
+    memcpy(inv_obj.temp_data, snap->temp_data, sizeof(snap->temp_data));
+    memcpy(inv_obj.x_gyro_temp_data, snap->x_gyro_temp_data,
+           sizeof(snap->x_gyro_temp_data));
+    memcpy(inv_obj.y_gyro_temp_data, snap->y_gyro_temp_data,
+           sizeof(snap->y_gyro_temp_data));
+    memcpy(inv_obj.z_gyro_temp_data, snap->z_gyro_temp_data,
+           sizeof(snap->z_gyro_temp_data));
+
+    result = inv_set_accel_bias((long *)snap->accel_bias);
+    if (result) {
+        LOG_RESULT_LOCATION(result);
+        return result;
+    }
+
+    inv_reset_compass_calibration();
+
+    inv_obj.got_compass_bias = snap->got_compass_bias;
+    inv_obj.got_init_compass_bias = snap->got_init_compass_bias;
+    inv_obj.compass_state = snap->compass_state;
+    memcpy(inv_obj.compass_bias_error, snap->compass_bias_error,
+           sizeof(snap->compass_bias_error));
+    memcpy(inv_obj.init_compass_bias, snap->init_compass_bias,
+           sizeof(snap->init_compass_bias));
+    memcpy(inv_obj.compass_bias, snap->compass_bias,
+           sizeof(snap->compass_bias));
+    memcpy(inv_obj.compass_peaks, snap->compass_peaks,
+           sizeof(snap->compass_peaks));
+    memcpy(inv_obj.compass_scale, snap->compass_scale,
+           sizeof(snap->compass_scale));
+    memcpy(inv_obj.compass_bias_v, snap->compass_bias_v,
+           sizeof(snap->compass_bias_v));
+    memcpy(inv_obj.compass_bias_ptr, snap->compass_bias_ptr,
+           sizeof(snap->compass_bias_ptr));
+    memcpy(inv_obj.compass_prev_xty, snap->compass_prev_xty,
+           sizeof(snap->compass_prev_xty));
+    memcpy(inv_obj.compass_prev_m, snap->compass_prev_m,
+           sizeof(snap->compass_prev_m));
+
+    inv_obj.flags[INV_COMPASS_OFFSET_VALID] = snap->compass_offset_valid;
+    memcpy(inv_obj.compass_offsets, snap->compass_offsets,
+           sizeof(snap->compass_offsets));
+    inv_obj.compass_accuracy = snap->compass_accuracy;
+
+    /* push the compass offset values to the device */
+    result = inv_set_compass_offset();
+    if (result == INV_SUCCESS) {
+        if (inv_compass_check_range() != INV_SUCCESS) {
+            MPL_LOGI("range check fail");
+            inv_reset_compass_calibration();
+            inv_obj.flags[INV_COMPASS_OFFSET_VALID] = 0;
+            inv_set_compass_offset();
+        }
+    }
+
+    inv_obj.got_no_motion_bias = TRUE;
+    LOADCAL_LOG("got_no_motion_bias = 1\n");
+    inv_obj.cal_loaded_flag = TRUE;
+    LOADCAL_LOG("cal_loaded_flag = 1\n");
+
+    LOADCAL_LOG("Exiting inv_load_cal_V6\n");
+    return INV_SUCCESS;
+}
+
 /**
  * @brief   Loads a set of calibration data.
  *          It parses a binary data set containing calibration data.
@@ -1154,10 +1313,12 @@ static inv_error_t inv_load_cal_V5(unsigned char *calData, unsigned short len)
  *
  * @param   calData
  *              A pointer to an array of bytes to be parsed.
+ * @param   length
+ *              The amount of bytes available in the array.
  *
  * @return  INV_SUCCESS if successful, a non-zero error code otherwise.
  */
-static inv_error_t inv_load_cal(unsigned char *calData)
+static inv_error_t inv_load_cal(unsigned char *calData, unsigned int length)
 {
     INVENSENSE_FUNC_START;
     int calType = 0;
@@ -1172,7 +1333,8 @@ static inv_error_t inv_load_cal(unsigned char *calData)
         inv_load_cal_V2,
         inv_load_cal_V3,
         inv_load_cal_V4,
-        inv_load_cal_V5
+        inv_load_cal_V5,
+        inv_load_cal_V6
     };
 
     if (inv_get_state() < INV_STATE_DMP_OPENED)
@@ -1187,11 +1349,16 @@ static inv_error_t inv_load_cal(unsigned char *calData)
     len += (int)calData[3];
 
     calType = ((int)calData[4]) * 256 + ((int)calData[5]);
-    if (calType > 5) {
+    if (calType > INV_CAL_TYPE_SNAPSHOT) {
         MPL_LOGE("Unsupported calibration file format %d. "
-                 "Valid types 0..5\n", calType);
+                 "Valid types 0..%d\n", calType, INV_CAL_TYPE_SNAPSHOT);
         return INV_ERROR_INVALID_PARAMETER;
     }
+    if (len < INV_CAL_HDR_LEN + INV_CAL_CHK_LEN || len > (int)length) {
+        MPL_LOGE("Calibration record length %d does not fit in %d bytes\n",
+                 len, length);
+        return INV_ERROR_FILE_READ;
+    }
 
     /* check the checksum */
     chk = 0;
@@ -1243,6 +1410,7 @@ static inv_error_t inv_get_accel_bias(long *data)
     return result;
 }
 
+#ifdef INV_CAL_STORE_V4
 /**
  *  @brief  Stores a set of calibration data.
  *          It generates a binary data set containing calibration data.
@@ -1505,6 +1673,96 @@ static inv_error_t inv_store_cal(unsigned char *calData, int length)
     STORECAL_LOG("Exiting inv_store_cal\n");
     return INV_SUCCESS;
 }
+#endif
+
+/**
+ *  @brief  Stores the calibration state as a type 6 snapshot.
+ *          See inv_load_cal_V6().
+ *
+ *  @pre    inv_dmp_open()
+ *
+ *  @param  calData
+ *              A pointer to an array of INV_CAL_SNAPSHOT_LEN bytes, aligned
+ *              for double.
+ *
+ *  @return INV_SUCCESS if successful, a non-zero error code otherwise.
+ */
+static inv_error_t inv_store_cal_snapshot(unsigned char *calData)
+{
+    INVENSENSE_FUNC_START;
+    struct inv_cal_snapshot *snap =
+        (struct inv_cal_snapshot *)(calData + INV_CAL_SNAPSHOT_OFFSET);
+    const unsigned int length = INV_CAL_SNAPSHOT_LEN;
+    uint32_t chk;
+    int ptr;
+
+    if (inv_get_state() < INV_STATE_DMP_OPENED)
+        return INV_ERROR_SM_IMPROPER_STATE;
+
+    STORECAL_LOG("Entering inv_store_cal_snapshot\n");
+
+    memset(calData, 0, length);
+    calData[0] = (unsigned char)((length >> 24) & 0xff);
+    calData[1] = (unsigned char)((length >> 16) & 0xff);
+    calData[2] = (unsigned char)((length >> 8) & 0xff);
+    calData[3] = (unsigned char)(length & 0xff);
+    calData[4] = 0;
+    calData[5] = INV_CAL_TYPE_SNAPSHOT;
+
+    snap->layout = INV_CAL_SNAPSHOT_LAYOUT;
+    memcpy(snap->temp_ptrs, inv_obj.temp_ptrs, sizeof(snap->temp_ptrs));
+    memcpy(snap->temp_valid_data, inv_obj.temp_valid_data,
+           sizeof(snap->temp_valid_data));
+    memcpy(snap->temp_data, inv_obj.temp_data, sizeof(snap->temp_data));
+    memcpy(snap->x_gyro_temp_data, inv_obj.x_gyro_temp_data,
+           sizeof(snap->x_gyro_temp_data));
+    memcpy(snap->y_gyro_temp_data, inv_obj.y_gyro_temp_data,
+           sizeof(snap->y_gyro_temp_data));
+    memcpy(snap->z_gyro_temp_data, inv_obj.z_gyro_temp_data,
+           sizeof(snap->z_gyro_temp_data));
+    inv_get_accel_bias(snap->accel_bias);
+
+    snap->got_compass_bias = inv_obj.got_compass_bias;
+    snap->got_init_compass_bias = inv_obj.got_init_compass_bias;
+    /* like type 4, restart a calibrated compass from the settle state */
+    if (inv_obj.compass_state == SF_UNCALIBRATED)
+        snap->compass_state = SF_UNCALIBRATED;
+    else
+        snap->compass_state = SF_STARTUP_SETTLE;
+    memcpy(snap->compass_bias_error, inv_obj.compass_bias_error,
+           sizeof(snap->compass_bias_error));
+    memcpy(snap->init_compass_bias, inv_obj.init_compass_bias,
+           sizeof(snap->init_compass_bias));
+    memcpy(snap->compass_bias, inv_obj.compass_bias,
+           sizeof(snap->compass_bias));
+    memcpy(snap->compass_peaks, inv_obj.compass_peaks,
+           sizeof(snap->compass_peaks));
+    memcpy(snap->compass_scale, inv_obj.compass_scale,
+           sizeof(snap->compass_scale));
+    memcpy(snap->compass_bias_v, inv_obj.compass_bias_v,
+           sizeof(snap->compass_bias_v));
+    memcpy(snap->compass_bias_ptr, inv_obj.compass_bias_ptr,
+           sizeof(snap->compass_bias_ptr));
+    memcpy(snap->compass_prev_xty, inv_obj.compass_prev_xty,
+           sizeof(snap->compass_prev_xty));
+    memcpy(snap->compass_prev_m, inv_obj.compass_prev_m,
+           sizeof(snap->compass_prev_m));
+    snap->compass_offset_valid = inv_obj.flags[INV_COMPASS_OFFSET_VALID];
+    memcpy(snap->compass_offsets, inv_obj.compass_offsets,
+           sizeof(snap->compass_offsets));
+    snap->compass_accuracy = inv_obj.compass_accuracy;
+
+    chk = inv_checksum(calData + INV_CAL_HDR_LEN,
+                       length - (INV_CAL_HDR_LEN + INV_CAL_CHK_LEN));
+    ptr = length - INV_CAL_CHK_LEN;
+    calData[ptr++] = (unsigned char)((chk >> 24) & 0xff);
+    calData[ptr++] = (unsigned char)((chk >> 16) & 0xff);
+    calData[ptr++] = (unsigned char)((chk >> 8) & 0xff);
+    calData[ptr++] = (unsigned char)(chk & 0xff);
+
+    STORECAL_LOG("Exiting inv_store_cal_snapshot\n");
+    return INV_SUCCESS;
+}
 
 /**
  *  @brief  Load a calibration file.
@@ -1518,48 +1776,77 @@ static inv_error_t inv_store_cal(unsigned char *calData, int length)
  */
 inv_error_t inv_load_calibration(void)
 {
-    unsigned char *calData;
+    /* long long keeps the snapshot in the buffer aligned for double */
+    unsigned long long calBuf[INV_CAL_MAX_LEN / sizeof(unsigned long long)];
+    unsigned char *calData = (unsigned char *)calBuf;
     inv_error_t result;
     unsigned int length;
 
     if (inv_get_state() < INV_STATE_DMP_OPENED)
         return INV_ERROR_SM_IMPROPER_STATE;
 
-    result = inv_serial_get_cal_length(&length);
+    result = inv_serial_read_cal_all(calData, sizeof(calBuf), &length);
     if (result == INV_ERROR_FILE_OPEN) {
         MPL_LOGI("Calibration data not loaded\n");
         return INV_SUCCESS;
     }
-    if (result || length <= 0) {
-        MPL_LOGE("Could not get file calibration length - "
-                 "error %d - aborting\n", result);
-        return result;
-    }
-    calData = (unsigned char *)malloc(length);
-    if (!calData) {
-        MPL_LOGE("Could not allocate buffer of %d bytes - "
-                 "aborting\n", length);
-        return INV_ERROR_MEMORY_EXAUSTED;
-    }
-    result = inv_serial_read_cal(calData, length);
     if (result) {
         MPL_LOGE("Could not read the calibration data from file - "
                  "error %d - aborting\n", result);
-        goto free_mem_n_exit;
-
+        return INV_SUCCESS;
     }
-    result = inv_load_cal(calData);
+    result = inv_load_cal(calData, length);
     if (result) {
         MPL_LOGE("Could not load the calibration data - "
                  "error %d - aborting\n", result);
-        goto free_mem_n_exit;
-
     }
 
+    return INV_SUCCESS;
+}
 
+/**
+ *  @brief  Serialize the runtime calibration data, in the format written
+ *          by inv_store_calibration(), so that it can be written out later
+ *          without holding up the MPL.
+ *
+ *  @pre    Must be in INV_STATE_DMP_OPENED state.
+ *
+ *  @param  cal
+ *              buffer for the calibration data, aligned for double.
+ *  @param  max_len
+ *              size of the buffer, INV_CAL_MAX_LEN is always enough.
+ *  @param  len
+ *              length of the serialized data.
+ *
+ *  @return 0 or error code.
+ */
+inv_error_t inv_serialize_calibration(unsigned char *cal, unsigned int max_len,
+                                      unsigned int *len)
+{
+    inv_error_t result;
+    unsigned int length;
+
+    if (inv_get_state() < INV_STATE_DMP_OPENED)
+        return INV_ERROR_SM_IMPROPER_STATE;
 
-free_mem_n_exit:
-    free(calData);
+#ifdef INV_CAL_STORE_V4
+    /* the type 4 format can still be read by older libraries */
+    length = inv_get_cal_length();
+#else
+    length = INV_CAL_SNAPSHOT_LEN;
+#endif
+    if (length > max_len)
+        return INV_ERROR_INVALID_PARAMETER;
+
+#ifdef INV_CAL_STORE_V4
+    result = inv_store_cal(cal, length);
+#else
+    result = inv_store_cal_snapshot(cal);
+#endif
+    if (result)
+        return result;
+
+    *len = length;
     return INV_SUCCESS;
 }
 
@@ -1575,38 +1862,25 @@ free_mem_n_exit:
  */
 inv_error_t inv_store_calibration(void)
 {
-    unsigned char *calData;
+    unsigned long long calBuf[INV_CAL_MAX_LEN / sizeof(unsigned long long)];
+    unsigned char *calData = (unsigned char *)calBuf;
     inv_error_t result;
     unsigned int length;
 
     if (inv_get_state() < INV_STATE_DMP_OPENED)
         return INV_ERROR_SM_IMPROPER_STATE;
 
-    length = inv_get_cal_length();
-    calData = (unsigned char *)malloc(length);
-    if (!calData) {
-        MPL_LOGE("Could not allocate buffer of %d bytes - "
-                 "aborting\n", length);
-        return INV_ERROR_MEMORY_EXAUSTED;
-    }
-    result = inv_store_cal(calData, length);
+    result = inv_serialize_calibration(calData, sizeof(calBuf), &length);
     if (result) {
         MPL_LOGE("Could not store calibrated data on file - "
                  "error %d - aborting\n", result);
-        goto free_mem_n_exit;
-
+        return INV_SUCCESS;
     }
     result = inv_serial_write_cal(calData, length);
     if (result) {
         MPL_LOGE("Could not write calibration data - " "error %d\n", result);
-        goto free_mem_n_exit;
-
     }
 
-
-
-free_mem_n_exit:
-    free(calData);
     return INV_SUCCESS;
 }
 
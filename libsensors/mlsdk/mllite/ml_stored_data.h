@@ -42,12 +42,16 @@ extern "C" {
 #define INV_CAL_COMPASS_LEN  (555 + 5)
 #define INV_CAL_HDR_LEN      (6)
 #define INV_CAL_CHK_LEN      (4)
+#define INV_CAL_MAX_LEN      (4096)
 
 /*
     APIs
 */
     inv_error_t inv_load_calibration(void);
     inv_error_t inv_store_calibration(void);
+    inv_error_t inv_serialize_calibration(unsigned char *cal,
+                                          unsigned int max_len,
+                                          unsigned int *len);
 
 #ifdef __cplusplus
 }
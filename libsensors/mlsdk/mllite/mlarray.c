@@ -213,9 +213,12 @@ inv_error_t inv_get_rot_mat_float(float *data)
         return INV_ERROR_INVALID_PARAMETER;
     }
     {
-        long qdata[4], rdata[9];
-        inv_get_quaternion(qdata);
-        inv_quaternion_to_rotation(qdata, rdata);
+        long rdata[9];
+        result = inv_get_rot_mat(rdata);
+        if (result) {
+            LOG_RESULT_LOCATION(result);
+            return result;
+        }
         data[0] = (float)rdata[0] / 1073741824.0f;
         data[1] = (float)rdata[1] / 1073741824.0f;
         data[2] = (float)rdata[2] / 1073741824.0f;
@@ -350,6 +353,94 @@ inv_error_t inv_get_magnetometer_float(float *data)
     return result;
 }
 
+/**
+ *  @brief  inv_get_gyro_bias_float is used to get the gyroscope bias
+ *          currently removed from the gyroscope measurements.
+ *          The argument array elements are ordered X,Y,Z, in the body frame
+ *          of inv_get_gyro_float().
+ *          The values are in units of dps (degrees per second).
+ *
+ *  @pre    MLDmpOpen() \ifnot UMPL or MLDmpPedometerStandAloneOpen() \endif
+ *          must have been called.
+ *
+ *  @param  data
+ *              A pointer to an array to be passed back to the user.
+ *              <b>Must be 3 cells long</b>.
+ *
+ *  @return INV_SUCCESS if the command is successful; an error code otherwise.
+ */
+inv_error_t inv_get_gyro_bias_float(float *data)
+{
+    INVENSENSE_FUNC_START;
+
+    struct mldl_cfg *mldl_cfg = inv_get_dl_config();
+    int i, j;
+
+    if (inv_get_state() < INV_STATE_DMP_OPENED)
+        return INV_ERROR_SM_IMPROPER_STATE;
+
+    if (NULL == data || NULL == mldl_cfg || NULL == mldl_cfg->pdata) {
+        return INV_ERROR_INVALID_PARAMETER;
+    }
+
+    /* the bias is kept in the chip frame */
+    for (i = 0; i < GYRO_NUM_AXES; i++) {
+        data[i] = 0;
+        for (j = 0; j < GYRO_NUM_AXES; j++) {
+            data[i] += (float)inv_obj.gyro_bias[j] / 65536.0f *
+                mldl_cfg->pdata->orientation[i * 3 + j];
+        }
+    }
+
+    return INV_SUCCESS;
+}
+
+/**
+ *  @cond MPL
+ *  @brief  inv_get_magnetometer_bias_float is used to get the hard iron bias
+ *          currently removed from the magnetometer data, in the frame and
+ *          units of inv_get_magnetometer_float().
+ *
+ *  @pre    MLDmpOpen() \ifnot UMPL or MLDmpPedometerStandAloneOpen() \endif
+ *          must have been called.
+ *
+ *  @param  data
+ *              A pointer to an array to be passed back to the user.
+ *              <b>Must be 3 cells long</b>.
+ *
+ *  @return INV_SUCCESS if the command is successful; an error code otherwise.
+ *  @endcond
+ */
+inv_error_t inv_get_magnetometer_bias_float(float *data)
+{
+    INVENSENSE_FUNC_START;
+
+    float bias[3];
+    int i, j;
+
+    if (inv_get_state() < INV_STATE_DMP_OPENED)
+        return INV_ERROR_SM_IMPROPER_STATE;
+
+    if (NULL == data || inv_obj.compass_sens == 0) {
+        return INV_ERROR_INVALID_PARAMETER;
+    }
+
+    /* same scaling and calibration matrix as compass_calibrated_data */
+    for (i = 0; i < 3; i++) {
+        bias[i] = (float)inv_obj.compass_bias[i] *
+            inv_obj.compass_scale[i] / 65536.0f;
+    }
+    for (i = 0; i < 3; i++) {
+        data[i] = 0;
+        for (j = 0; j < 3; j++) {
+            data[i] += bias[j] * inv_obj.compass_cal[i * 3 + j];
+        }
+        data[i] = data[i] / inv_obj.compass_sens / 65536.0f;
+    }
+
+    return INV_SUCCESS;
+}
+
 /**
  * Returns the curren compass accuracy.
  *
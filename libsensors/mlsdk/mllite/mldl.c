@@ -61,7 +61,9 @@
 /* -    Variables.     - */
 /* --------------------- */
 
-#define MAX_LOAD_WRITE_SIZE (MPU_MEM_BANK_SIZE/2)   /* 128 */
+/* a memory write cannot cross a bank, so a whole bank is the largest burst;
+   the serial layer splits it further if the bus needs to */
+#define MAX_LOAD_WRITE_SIZE (MPU_MEM_BANK_SIZE)     /* 256 */
 
 /*---- structure containing control variables used by MLDL ----*/
 static struct mldl_cfg mldlCfg;
@@ -80,6 +82,17 @@ unsigned short (*sGetAddress) (unsigned short key) = NULL;
 static const unsigned char *localDmpMemory = NULL;
 static unsigned short localDmpMemorySize = 0;
 
+/* memory writes queued between inv_begin_mpu_memory_batch() and
+   inv_flush_mpu_memory_batch(), the bytes themselves are in mldlCfg.ram */
+#define MAX_MEMORY_BATCH (16)
+struct mem_range {
+    unsigned char bank;
+    unsigned char start;
+    unsigned short length;
+};
+static struct mem_range sMemBatch[MAX_MEMORY_BATCH];
+static int sMemBatchCount = -1;     /* -1 when not batching */
+
 /**
  *  @internal
  *  @brief Sets the function to use to convert keys to addresses. This
@@ -445,12 +458,29 @@ inv_error_t inv_set_full_scale(float fullScale)
     return INV_SUCCESS;
 }
 
+/**
+ *  @brief  Let the device run through a system suspend.  The driver
+ *          normally suspends the MPU with the system; with this set the
+ *          DMP keeps running and its interrupt can wake the system up.
+ *          The setting is sent to the driver right away while the gyro
+ *          runs, or with the next resume otherwise.
+ *  @param  ignore  TRUE to keep running through the system suspends.
+ *  @return INV_SUCCESS if successful, a non-zero error code otherwise.
+ */
 inv_error_t inv_set_ignore_system_suspend(unsigned char ignore)
 {
     INVENSENSE_FUNC_START;
+    inv_error_t result;
 
     mldlCfg.ignore_system_suspend = ignore;
+    if (mldlCfg.gyro_is_suspended)
+        return INV_SUCCESS;
 
+    result = inv_mpu_set_config(&mldlCfg, sMLSLHandle);
+    if (result) {
+        LOG_RESULT_LOCATION(result);
+        return result;
+    }
     return INV_SUCCESS;
 }
 
@@ -561,8 +591,10 @@ inv_error_t inv_set_offset(const short *offset)
     }
 
     if (!mldlCfg.gyro_is_suspended) {
+        int caller = inv_serial_set_caller(INV_SERIAL_CALLER_CAL);
         regs[0] = MPUREG_X_OFFS_USRH;
         result = inv_serial_write(sMLSLHandle, mldlCfg.addr, 7, regs);
+        inv_serial_set_caller(caller);
         if (result) {
             LOG_RESULT_LOCATION(result);
             return result;
@@ -573,6 +605,103 @@ inv_error_t inv_set_offset(const short *offset)
     return INV_SUCCESS;
 }
 
+/**
+ *  @internal
+ *  @brief  Write the queued memory ranges to the MPU.
+ *  @return INV_SUCCESS if successful, a non-zero error code otherwise.
+ */
+static inv_error_t inv_write_mpu_memory_batch(void)
+{
+    inv_error_t result = INV_SUCCESS;
+    int ii;
+
+    for (ii = 0; ii < sMemBatchCount; ii++) {
+        struct mem_range *range = &sMemBatch[ii];
+        if (mldlCfg.gyro_is_suspended) {
+            mldlCfg.gyro_needs_reset = TRUE;
+            break;
+        }
+        result = inv_serial_write_mem(sMLSLHandle, mldlCfg.addr,
+                                      ((range->bank << 8) | range->start),
+                                      range->length,
+                                      &mldlCfg.ram[range->bank][range->start]);
+        if (result) {
+            LOG_RESULT_LOCATION(result);
+            break;
+        }
+    }
+    sMemBatchCount = 0;
+    return result;
+}
+
+/**
+ *  @internal
+ *  @brief  Queue a memory write done while batching, merging it with the
+ *          previous one when the two are contiguous.
+ *  @return INV_SUCCESS if successful, a non-zero error code otherwise.
+ */
+static inv_error_t inv_queue_mpu_memory(unsigned char bank,
+                                        unsigned short memAddr,
+                                        unsigned short length)
+{
+    struct mem_range *range;
+
+    if (sMemBatchCount > 0) {
+        range = &sMemBatch[sMemBatchCount - 1];
+        if (range->bank == bank &&
+            memAddr >= range->start &&
+            memAddr <= range->start + range->length) {
+            if (memAddr + length > range->start + range->length)
+                range->length = memAddr + length - range->start;
+            return INV_SUCCESS;
+        }
+    }
+    if (sMemBatchCount == MAX_MEMORY_BATCH) {
+        inv_error_t result = inv_write_mpu_memory_batch();
+        if (result) {
+            LOG_RESULT_LOCATION(result);
+            return result;
+        }
+    }
+    range = &sMemBatch[sMemBatchCount++];
+    range->bank = bank;
+    range->start = (unsigned char)memAddr;
+    range->length = length;
+    return INV_SUCCESS;
+}
+
+/**
+ *  @brief  Start queueing the DMP memory writes instead of sending each
+ *          one on its own, so that a configuration made of several keys
+ *          costs less serial transactions.  Contiguous writes are merged
+ *          and everything is sent, in order, by
+ *          inv_flush_mpu_memory_batch().  A memory read flushes the queue
+ *          first.
+ *  @return INV_SUCCESS, or INV_ERROR_SM_IMPROPER_STATE if already batching.
+ */
+inv_error_t inv_begin_mpu_memory_batch(void)
+{
+    if (sMemBatchCount >= 0)
+        return INV_ERROR_SM_IMPROPER_STATE;
+    sMemBatchCount = 0;
+    return INV_SUCCESS;
+}
+
+/**
+ *  @brief  Send the memory writes queued since inv_begin_mpu_memory_batch()
+ *          and stop queueing.
+ *  @return INV_SUCCESS if successful, a non-zero error code otherwise.
+ */
+inv_error_t inv_flush_mpu_memory_batch(void)
+{
+    inv_error_t result = INV_SUCCESS;
+
+    if (sMemBatchCount > 0)
+        result = inv_write_mpu_memory_batch();
+    sMemBatchCount = -1;
+    return result;
+}
+
 /**
  *  @internal
  *  @brief  used to get the specified number of bytes in the specified MPU
@@ -608,6 +737,13 @@ inv_get_mpu_memory_one_bank(unsigned char bank,
         memcpy(buffer, &mldlCfg.ram[bank][memAddr], length);
         result = INV_SUCCESS;
     } else {
+        if (sMemBatchCount > 0) {
+            result = inv_write_mpu_memory_batch();
+            if (result) {
+                LOG_RESULT_LOCATION(result);
+                return result;
+            }
+        }
         result = inv_serial_read_mem(sMLSLHandle, mldlCfg.addr,
                                      ((bank << 8) | memAddr), length, buffer);
         if (result) {
@@ -653,7 +789,13 @@ inv_error_t inv_set_mpu_memory_one_bank(unsigned char bank,
 
     different = memcmp(&mldlCfg.ram[bank][memAddr], buffer, length);
     memcpy(&mldlCfg.ram[bank][memAddr], buffer, length);
-    if (!mldlCfg.gyro_is_suspended) {
+    if (!mldlCfg.gyro_is_suspended && sMemBatchCount >= 0) {
+        result = inv_queue_mpu_memory(bank, memAddr, length);
+        if (result) {
+            LOG_RESULT_LOCATION(result);
+            return result;
+        }
+    } else if (!mldlCfg.gyro_is_suspended) {
         result = inv_serial_write_mem(sMLSLHandle, mldlCfg.addr,
                                       ((bank << 8) | memAddr), length, buffer);
         if (result) {
@@ -804,12 +946,28 @@ inv_error_t inv_load_dmp(const unsigned char *buffer,
     inv_error_t result = INV_SUCCESS;
     unsigned short toWrite;
     unsigned short memAddr = 0;
+    int caller;
     localDmpMemory = buffer;
     localDmpMemorySize = length;
 
     mldlCfg.dmp_cfg1 = (config >> 8);
     mldlCfg.dmp_cfg2 = (config & 0xff);
 
+    if (length > sizeof(mldlCfg.ram))
+        return INV_ERROR_INVALID_PARAMETER;
+
+    /* mldlCfg.ram is the driver's copy of the DMP memory, the one it
+       restores the device from when it resumes it.  While the gyro is
+       suspended and that copy already holds this image, there is nothing
+       to upload.  A running DMP may have changed its own memory, so it is
+       always reloaded. */
+    if (mldlCfg.gyro_is_suspended && !mldlCfg.gyro_needs_reset &&
+        !memcmp(&mldlCfg.ram[0][0], buffer, length)) {
+        MPL_LOGV("DMP image already loaded, skipping upload\n");
+        return INV_SUCCESS;
+    }
+
+    caller = inv_serial_set_caller(INV_SERIAL_CALLER_DMP_LOAD);
     while (length > 0) {
         toWrite = length;
         if (toWrite > MAX_LOAD_WRITE_SIZE)
@@ -820,13 +978,14 @@ inv_error_t inv_load_dmp(const unsigned char *buffer,
                                         buffer);
         if (result) {
             LOG_RESULT_LOCATION(result);
-            return result;
+            break;
         }
 
         buffer += toWrite;
         memAddr += toWrite;
         length -= toWrite;
     }
+    inv_serial_set_caller(caller);
 
     return result;
 }
@@ -133,6 +133,8 @@ extern "C" {
     inv_error_t inv_set_mpu_memory(unsigned short key,
                                    unsigned short length,
                                    const unsigned char *buffer);
+    inv_error_t inv_begin_mpu_memory_batch(void);
+    inv_error_t inv_flush_mpu_memory_batch(void);
     inv_error_t inv_load_dmp(const unsigned char *buffer,
                              unsigned short length,
                              unsigned short startAddress);
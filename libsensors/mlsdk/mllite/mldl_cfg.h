@@ -141,6 +141,8 @@ int inv_mpu_suspend(struct mldl_cfg *mldl_cfg,
 		    void *compass_handle,
 		    void *pressure_handle,
 		    unsigned long sensors);
+int inv_mpu_set_config(struct mldl_cfg *mldl_cfg,
+		       void *gyro_handle);
 
 /* Slave Read functions */
 int inv_mpu_slave_read(struct mldl_cfg *mldl_cfg,
@@ -315,6 +315,29 @@ int inv_mpu_suspend(struct mldl_cfg *mldl_cfg,
     return result;
 }
 
+/**
+ * Send the configuration to the driver without resuming or suspending
+ * anything, for the settings it only looks at later like
+ * ignore_system_suspend.
+ *
+ * @param mldl_cfg pointer to the mldl configuration structure
+ * @param gyro_handle handle to the gyro sensor
+ *
+ * @return 0 or non-zero error code
+ */
+int inv_mpu_set_config(struct mldl_cfg *mldl_cfg,
+                       void *gyro_handle)
+{
+    int result;
+
+    result = ioctl((int)(uintptr_t)gyro_handle, MPU_SET_MPU_CONFIG, mldl_cfg);
+    if (result) {
+        LOG_RESULT_LOCATION(result);
+        return result;
+    }
+    return result;
+}
+
 /**
  * Send slave configuration information
  *
@@ -335,11 +358,15 @@ int inv_mpu_slave_read(struct mldl_cfg *mldl_cfg,
 		unsigned char *data)
 {
     int result;
+    int caller;
+    long long start;
     if (!mldl_cfg || !gyro_handle || !data || !slave) {
         LOG_RESULT_LOCATION(INV_ERROR_INVALID_PARAMETER);
         return INV_ERROR_INVALID_PARAMETER;
     }
 
+    caller = inv_serial_set_caller(INV_SERIAL_CALLER_SLAVE);
+    start = inv_serial_profile_start();
     switch (slave->type) {
     case EXT_SLAVE_TYPE_ACCELEROMETER:
         result = ioctl((int)(uintptr_t)gyro_handle, MPU_READ_ACCEL, data);
@@ -348,9 +375,12 @@ int inv_mpu_slave_read(struct mldl_cfg *mldl_cfg,
         result = ioctl((int)(uintptr_t)gyro_handle, MPU_READ_COMPASS, data);
         break;
     default:
+        inv_serial_set_caller(caller);
         LOG_RESULT_LOCATION(INV_ERROR_INVALID_PARAMETER);
         return INV_ERROR_INVALID_PARAMETER;
     }
+    inv_serial_profile_end(INV_SERIAL_OP_READ_SLAVE, start, slave->read_len);
+    inv_serial_set_caller(caller);
 
     return result;
 }
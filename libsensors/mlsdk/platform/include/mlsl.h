@@ -226,6 +226,70 @@ inv_error_t inv_serial_read_cal(unsigned char *cal, unsigned int len);
  */
 inv_error_t inv_serial_write_cal(unsigned char *cal, unsigned int len);
 
+/**
+ *  inv_serial_read_cal_all() - read the whole calibration data in one go.
+ *  @cal	buffer for the calibration data.
+ *  @max_len	size of the buffer.
+ *  @len	number of bytes read.
+ *
+ *	Replaces the inv_serial_get_cal_length() and inv_serial_read_cal()
+ *	pair, which open and read the storage twice.
+ *
+ *  returns INV_SUCCESS if successful, INV_ERROR_FILE_OPEN if there is no
+ *  calibration data, another non-zero error code otherwise.
+ */
+inv_error_t inv_serial_read_cal_all(unsigned char *cal, unsigned int max_len,
+				    unsigned int *len);
+
+/* callers and operations the serial profile is broken down by */
+enum inv_serial_caller {
+	INV_SERIAL_CALLER_OTHER = 0,
+	INV_SERIAL_CALLER_FIFO,
+	INV_SERIAL_CALLER_DMP_LOAD,
+	INV_SERIAL_CALLER_CAL,
+	INV_SERIAL_CALLER_SLAVE,
+	INV_SERIAL_NUM_CALLERS
+};
+
+enum inv_serial_op {
+	INV_SERIAL_OP_WRITE = 0,
+	INV_SERIAL_OP_READ,
+	INV_SERIAL_OP_WRITE_MEM,
+	INV_SERIAL_OP_READ_MEM,
+	INV_SERIAL_OP_READ_FIFO,
+	INV_SERIAL_OP_READ_SLAVE,
+	INV_SERIAL_NUM_OPS
+};
+
+/**
+ *  inv_serial_set_caller() - tag the serial transactions of this thread.
+ *  @caller	one of enum inv_serial_caller.
+ *
+ *	When the debug.mpl.serial_profile property is set to a period in
+ *	seconds, the serial layer counts the transactions, bytes and ioctl
+ *	time of each thread by caller and operation, and logs them every
+ *	period.
+ *
+ *  returns the previous caller, to restore once done.
+ */
+int inv_serial_set_caller(int caller);
+
+/**
+ *  inv_serial_profile_start() - start timing a transaction made outside
+ *	of the serial layer.
+ *
+ *  returns the value to give to inv_serial_profile_end().
+ */
+long long inv_serial_profile_start(void);
+
+/**
+ *  inv_serial_profile_end() - count a transaction.
+ *  @op		one of enum inv_serial_op.
+ *  @start	value returned by inv_serial_profile_start().
+ *  @bytes	number of bytes transferred.
+ */
+void inv_serial_profile_end(int op, long long start, unsigned int bytes);
+
 /**
  *  inv_serial_get_cal_length() - Get the calibration length from the storage.
  *  @len	lenght to be returned
@@ -36,6 +36,7 @@
 /* ------------------ */
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -45,6 +46,9 @@
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
+
+#include <cutils/properties.h>
 
 #include "mpu.h"
 #include "mpu3050.h"
@@ -56,6 +60,7 @@
 
 #define MLCAL_ID      (0x0A0B0C0DL)
 #define MLCAL_FILE    "/data/cal.bin"
+#define MLCAL_TMP_FILE "/data/cal.bin.tmp"
 #define MLCFG_ID      (0x01020304L)
 #define MLCFG_FILE    "/data/cfg.bin"
 
@@ -69,6 +74,10 @@
 
 #define SERIAL_FULL_DEBUG (0)
 
+/* Set to the dump period in seconds to count the serial transactions, see
+   inv_serial_profile_end() */
+#define SERIAL_PROFILE_PROPERTY "debug.mpl.serial_profile"
+
 /* --------------- */
 /* - Prototypes. - */
 /* --------------- */
@@ -81,10 +90,167 @@
 /* - Global and Static vars. - */
 /* --------------------------- */
 
+struct serial_counter {
+    unsigned long calls;
+    unsigned long long bytes;
+    unsigned long long ns;
+    unsigned long long max_ns;
+};
+
+/* one per thread, so that the counting never takes a lock */
+struct serial_profile {
+    int tid;
+    int caller;
+    struct serial_counter counters[INV_SERIAL_NUM_CALLERS][INV_SERIAL_NUM_OPS];
+    struct serial_profile *next;
+};
+
+static const char *const sCallerNames[INV_SERIAL_NUM_CALLERS] = {
+    "other", "fifo", "dmp load", "cal", "slave",
+};
+static const char *const sOpNames[INV_SERIAL_NUM_OPS] = {
+    "write", "read", "write mem", "read mem", "read fifo", "read slave",
+};
+
+static long long sProfilePeriodNs;
+static long long sProfileLastDump;
+static pthread_once_t sProfileOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t sProfileKey;
+static pthread_mutex_t sProfileLock = PTHREAD_MUTEX_INITIALIZER;
+static struct serial_profile *sProfiles;
+
 /* ---------------- */
 /* - Definitions. - */
 /* ---------------- */
 
+static long long inv_serial_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* formats data as hex for the SERIAL_FULL_DEBUG logs */
+static const char *inv_serial_hex(const unsigned char *data,
+                                  unsigned short length,
+                                  char *out, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t ii;
+
+    for (ii = 0; ii < length && ii * 2 + 2 < size; ii++) {
+        out[ii * 2] = digits[data[ii] >> 4];
+        out[ii * 2 + 1] = digits[data[ii] & 0xf];
+    }
+    out[ii * 2] = '\0';
+    return out;
+}
+
+static void inv_serial_profile_init(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(SERIAL_PROFILE_PROPERTY, value, "0");
+    sProfilePeriodNs = atoi(value) * 1000000000LL;
+    pthread_key_create(&sProfileKey, NULL);
+}
+
+/* the calling thread counters, NULL when the profile is off */
+static struct serial_profile *inv_serial_profile_get(void)
+{
+    struct serial_profile *profile;
+
+    pthread_once(&sProfileOnce, inv_serial_profile_init);
+    if (sProfilePeriodNs <= 0)
+        return NULL;
+
+    profile = pthread_getspecific(sProfileKey);
+    if (profile)
+        return profile;
+
+    /* never freed, the list is walked by the dump without the threads */
+    profile = calloc(1, sizeof(*profile));
+    if (!profile)
+        return NULL;
+    profile->tid = gettid();
+    pthread_mutex_lock(&sProfileLock);
+    profile->next = sProfiles;
+    sProfiles = profile;
+    pthread_mutex_unlock(&sProfileLock);
+    pthread_setspecific(sProfileKey, profile);
+    return profile;
+}
+
+static void inv_serial_profile_dump(void)
+{
+    struct serial_profile *profile;
+    int caller, op;
+
+    pthread_mutex_lock(&sProfileLock);
+    for (profile = sProfiles; profile; profile = profile->next) {
+        for (caller = 0; caller < INV_SERIAL_NUM_CALLERS; caller++) {
+            for (op = 0; op < INV_SERIAL_NUM_OPS; op++) {
+                struct serial_counter *c = &profile->counters[caller][op];
+                if (!c->calls)
+                    continue;
+                MPL_LOGI("serial tid %d %s %s: %lu calls %llu bytes, "
+                         "%llu us avg %llu us max %llu us\n",
+                         profile->tid, sCallerNames[caller], sOpNames[op],
+                         c->calls, c->bytes, c->ns / 1000,
+                         c->ns / c->calls / 1000, c->max_ns / 1000);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sProfileLock);
+}
+
+int inv_serial_set_caller(int caller)
+{
+    struct serial_profile *profile = inv_serial_profile_get();
+    int previous;
+
+    if (!profile)
+        return INV_SERIAL_CALLER_OTHER;
+    previous = profile->caller;
+    if (caller >= 0 && caller < INV_SERIAL_NUM_CALLERS)
+        profile->caller = caller;
+    return previous;
+}
+
+long long inv_serial_profile_start(void)
+{
+    pthread_once(&sProfileOnce, inv_serial_profile_init);
+    return sProfilePeriodNs > 0 ? inv_serial_now_ns() : 0;
+}
+
+void inv_serial_profile_end(int op, long long start, unsigned int bytes)
+{
+    struct serial_profile *profile;
+    struct serial_counter *c;
+    long long now, ns;
+
+    if (!start)
+        return;
+    profile = inv_serial_profile_get();
+    if (!profile)
+        return;
+
+    now = inv_serial_now_ns();
+    ns = now - start;
+    c = &profile->counters[profile->caller][op];
+    c->calls++;
+    c->bytes += bytes;
+    c->ns += ns;
+    if ((unsigned long long)ns > c->max_ns)
+        c->max_ns = ns;
+
+    /* racy on purpose, at worst two threads dump at the same time */
+    if (now - sProfileLastDump >= sProfilePeriodNs) {
+        sProfileLastDump = now;
+        inv_serial_profile_dump();
+    }
+}
+
 inv_error_t inv_serial_read_cal(unsigned char *cal, unsigned int len)
 {
     FILE *fp;
@@ -122,9 +288,11 @@ inv_error_t inv_serial_write_cal(unsigned char *cal, unsigned int len)
     unsigned int bytesWritten;
     inv_error_t result = INV_SUCCESS;
 
-    fp = fopen(MLCAL_FILE,"wb");
+    /* write a new file and rename it over the old one, so that a crash or
+       a power loss never leaves a truncated calibration behind */
+    fp = fopen(MLCAL_TMP_FILE,"wb");
     if (fp == NULL) {
-        MPL_LOGE("Cannot open file \"%s\" for write\n", MLCAL_FILE);
+        MPL_LOGE("Cannot open file \"%s\" for write\n", MLCAL_TMP_FILE);
         return INV_ERROR_FILE_OPEN;
     }
     bytesWritten = fwrite(cal, 1, len, fp);
@@ -133,7 +301,56 @@ inv_error_t inv_serial_write_cal(unsigned char *cal, unsigned int len)
                  bytesWritten, len);
         result = INV_ERROR_FILE_WRITE;
     }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        MPL_LOGE("Cannot sync file \"%s\": %s\n", MLCAL_TMP_FILE,
+                 strerror(errno));
+        result = INV_ERROR_FILE_WRITE;
+    }
     fclose(fp);
+
+    if (result == INV_SUCCESS && rename(MLCAL_TMP_FILE, MLCAL_FILE) != 0) {
+        MPL_LOGE("Cannot rename \"%s\" to \"%s\": %s\n", MLCAL_TMP_FILE,
+                 MLCAL_FILE, strerror(errno));
+        result = INV_ERROR_FILE_WRITE;
+    }
+    if (result != INV_SUCCESS)
+        unlink(MLCAL_TMP_FILE);
+    return result;
+}
+
+inv_error_t inv_serial_read_cal_all(unsigned char *cal, unsigned int max_len,
+                                    unsigned int *len)
+{
+    struct stat st;
+    ssize_t bytesRead;
+    inv_error_t result = INV_SUCCESS;
+    int fd;
+
+    *len = 0;
+
+    fd = open(MLCAL_FILE, O_RDONLY);
+    if (fd < 0) {
+        MPL_LOGE("Cannot open file \"%s\" for read\n", MLCAL_FILE);
+        return INV_ERROR_FILE_OPEN;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 ||
+            (unsigned long long)st.st_size > max_len) {
+        MPL_LOGE("Calibration file size (%ld) is not within 1..%u\n",
+                 (long)st.st_size, max_len);
+        result = INV_ERROR_FILE_READ;
+        goto read_cal_all_end;
+    }
+    bytesRead = read(fd, cal, st.st_size);
+    if (bytesRead != st.st_size) {
+        MPL_LOGE("bytes read (%d) don't match file size (%ld)\n",
+                 (int)bytesRead, (long)st.st_size);
+        result = INV_ERROR_FILE_READ;
+        goto read_cal_all_end;
+    }
+    *len = bytesRead;
+
+read_cal_all_end:
+    close(fd);
     return result;
 }
 
@@ -208,6 +425,7 @@ inv_error_t inv_serial_write(void *sl_handle,
 {
     INVENSENSE_FUNC_START;
     struct mpu_read_write msg;
+    long long start;
     inv_error_t result;
 
     if (NULL == data) {
@@ -218,18 +436,16 @@ inv_error_t inv_serial_write(void *sl_handle,
     msg.length  = length;
     msg.data    = (unsigned char*)data;
 
-    if ((result = ioctl((int)(uintptr_t)sl_handle, MPU_WRITE, &msg))) {
+    start = inv_serial_profile_start();
+    result = ioctl((int)(uintptr_t)sl_handle, MPU_WRITE, &msg);
+    inv_serial_profile_end(INV_SERIAL_OP_WRITE, start, length);
+    if (result) {
         MPL_LOGE("I2C Error: could not write: R:%02x L:%d %d \n",
                  data[0], length, result);
        return result;
     } else if (SERIAL_FULL_DEBUG) {
-        char data_buff[4096] = "";
-        char strchar[3];
-        int ii;
-        for (ii = 0; ii < length; ii++) {
-            snprintf(strchar, sizeof(strchar), "%02x", data[0]);
-            strncat(data_buff, strchar, (sizeof(data_buff) - strlen(data_buff) - 1));
-        }
+        char data_buff[4096];
+        inv_serial_hex(data, length, data_buff, sizeof(data_buff));
         MPL_LOGI("I2C Write Success %02x %02x: %s \n",
                  data[0], length, data_buff);
     }
@@ -246,6 +462,7 @@ inv_error_t inv_serial_read(void *sl_handle,
     INVENSENSE_FUNC_START;
     int result = INV_SUCCESS;
     struct mpu_read_write msg;
+    long long start;
 
     if (NULL == data) {
         return INV_ERROR_INVALID_PARAMETER;
@@ -255,20 +472,17 @@ inv_error_t inv_serial_read(void *sl_handle,
     msg.length  = length;
     msg.data    = data;
 
+    start = inv_serial_profile_start();
     result = ioctl((int)(uintptr_t)sl_handle, MPU_READ, &msg);
+    inv_serial_profile_end(INV_SERIAL_OP_READ, start, length);
 
     if (result != INV_SUCCESS) {
         MPL_LOGE("I2C Error %08x: could not read: R:%02x L:%d\n",
                  result, registerAddr, length);
         result = INV_ERROR_SERIAL_READ;
     } else if (SERIAL_FULL_DEBUG) {
-        char data_buff[4096] = "";
-        char strchar[3];
-        int ii;
-        for (ii = 0; ii < length; ii++) {
-            snprintf(strchar, sizeof(strchar), "%02x", data[0]);
-            strncat(data_buff, strchar, (sizeof(data_buff) - strlen(data_buff) - 1));
-        }
+        char data_buff[4096];
+        inv_serial_hex(data, length, data_buff, sizeof(data_buff));
         MPL_LOGI("I2C Read  Success %02x %02x: %s \n",
                   registerAddr, length, data_buff);
     }
@@ -284,24 +498,22 @@ inv_error_t inv_serial_write_mem(void *sl_handle,
 {
     INVENSENSE_FUNC_START;
     struct mpu_read_write msg;
+    long long start;
     int result;
 
     msg.address = memAddr;
     msg.length  = length;
     msg.data    = (unsigned char *)data;
 
+    start = inv_serial_profile_start();
     result = ioctl((int)(uintptr_t)sl_handle, MPU_WRITE_MEM, &msg);
+    inv_serial_profile_end(INV_SERIAL_OP_WRITE_MEM, start, length);
     if (result) {
         LOG_RESULT_LOCATION(result);
         return result;
     } else if (SERIAL_FULL_DEBUG) {
-        char data_buff[4096] = "";
-        char strchar[3];
-        int ii;
-        for (ii = 0; ii < length; ii++) {
-            snprintf(strchar, sizeof(strchar), "%02x", data[0]);
-            strncat(data_buff, strchar, (sizeof(data_buff) - strlen(data_buff) - 1));
-        }
+        char data_buff[4096];
+        inv_serial_hex(data, length, data_buff, sizeof(data_buff));
         MPL_LOGI("I2C WriteMem Success %04x %04x: %s \n",
                  memAddr, length, data_buff);
     }
@@ -316,6 +528,7 @@ inv_error_t inv_serial_read_mem(void *sl_handle,
 {
     INVENSENSE_FUNC_START;
     struct mpu_read_write msg;
+    long long start;
     int result;
 
     if (NULL == data) {
@@ -326,19 +539,16 @@ inv_error_t inv_serial_read_mem(void *sl_handle,
     msg.length  = length;
     msg.data    = data;
 
+    start = inv_serial_profile_start();
     result = ioctl((int)(uintptr_t)sl_handle, MPU_READ_MEM, &msg);
+    inv_serial_profile_end(INV_SERIAL_OP_READ_MEM, start, length);
     if (result != INV_SUCCESS) {
         MPL_LOGE("I2C Error %08x: could not read memory: A:%04x L:%d\n",
                  result, memAddr, length);
         return INV_ERROR_SERIAL_READ;
     } else if (SERIAL_FULL_DEBUG) {
-        char data_buff[4096] = "";
-        char strchar[3];
-        int ii;
-        for (ii = 0; ii < length; ii++) {
-            snprintf(strchar, sizeof(strchar), "%02x", data[0]);
-            strncat(data_buff, strchar, (sizeof(data_buff) - strlen(data_buff) - 1));
-        }
+        char data_buff[4096];
+        inv_serial_hex(data, length, data_buff, sizeof(data_buff));
         MPL_LOGI("I2C ReadMem Success %04x %04x: %s\n",
                  memAddr, length, data_buff);
     }
@@ -352,6 +562,7 @@ inv_error_t inv_serial_read_fifo(void *sl_handle,
 {
     INVENSENSE_FUNC_START;
     struct mpu_read_write msg;
+    long long start;
     int result;
 
     if (NULL == data) {
@@ -362,19 +573,16 @@ inv_error_t inv_serial_read_fifo(void *sl_handle,
     msg.length  = length;
     msg.data    = data;
 
+    start = inv_serial_profile_start();
     result = ioctl((int)(uintptr_t)sl_handle, MPU_READ_FIFO, &msg);
+    inv_serial_profile_end(INV_SERIAL_OP_READ_FIFO, start, length);
     if (result != INV_SUCCESS) {
         MPL_LOGE("I2C Error %08x: could not read fifo: R:%02x L:%d\n",
                  result, MPUREG_FIFO_R_W, length);
         return INV_ERROR_SERIAL_READ;
     } else if (SERIAL_FULL_DEBUG) {
-        char data_buff[4096] = "";
-        char strchar[3];
-        int ii;
-        for (ii = 0; ii < length; ii++) {
-            snprintf(strchar, sizeof(strchar), "%02x", data[0]);
-            strncat(data_buff, strchar, (sizeof(data_buff) - strlen(data_buff) - 1));
-        }
+        char data_buff[4096];
+        inv_serial_hex(data, length, data_buff, sizeof(data_buff));
         MPL_LOGI("I2C ReadFifo Success %02x %02x: %s\n",
                  MPUREG_FIFO_R_W, length, data_buff);
     }
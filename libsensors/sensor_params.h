@@ -62,6 +62,14 @@
 #define NINEAXIS_LINEAR_ACCEL_RANGE      (ACCEL_BMA250_RANGE)
 #define NINEAXIS_LINEAR_ACCEL_RESOLUTION (ACCEL_BMA250_RESOLUTION)
 #define NINEAXIS_LINEAR_ACCEL_POWER      (NINEAXIS_POWER)
+/******************************************/
+//SIXAXIS, the DMP quaternion without the compass
+#define SIXAXIS_POWER (ACCEL_BMA250_POWER + \
+                       GYRO_MPU3050_POWER)
+
+#define SIXAXIS_GAME_ROTATION_VECTOR_RANGE      (1.0f)
+#define SIXAXIS_GAME_ROTATION_VECTOR_RESOLUTION (0.00001f)
+#define SIXAXIS_GAME_ROTATION_VECTOR_POWER      (SIXAXIS_POWER)
 
 #endif
 
@@ -24,23 +24,31 @@
 #include <errno.h>
 #include <dirent.h>
 #include <math.h>
-#include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 
 #include <linux/input.h>
 
+#include <cutils/properties.h>
 #include <utils/Atomic.h>
 #include <utils/Log.h>
+#include <utils/KeyedVector.h>
+#include <utils/Vector.h>
 
 #include "sensors.h"
 #include "sensor_params.h"
 
 #include "MPLSensor.h"
+#include "DirectChannel.h"
 #include "LightSensor.h"
+#include "SensorPolicy.h"
+#include "SensorTime.h"
 #include "ProximitySensor.h"
 #include "PressureSensor.h"
+#include "ReplaySensor.h"
 #include "TemperatureSensor.h"
+#include "tuna_boot_profile.h"
 
 
 /*****************************************************************************/
@@ -52,6 +60,11 @@
 #define SENSORS_ROTATION_VECTOR  (1<<ID_RV)
 #define SENSORS_LINEAR_ACCEL     (1<<ID_LA)
 #define SENSORS_GRAVITY          (1<<ID_GR)
+#define SENSORS_SIGNIFICANT_MOTION (1<<ID_SM)
+#define SENSORS_STEP_DETECTOR    (1<<ID_SD)
+#define SENSORS_GAME_ROTATION_VECTOR (1<<ID_GRV)
+#define SENSORS_GYROSCOPE_UNCALIBRATED (1<<ID_GYU)
+#define SENSORS_MAGNETIC_FIELD_UNCALIBRATED (1<<ID_MU)
 #define SENSORS_GYROSCOPE        (1<<ID_GY)
 #define SENSORS_ACCELERATION     (1<<ID_A)
 #define SENSORS_MAGNETIC_FIELD   (1<<ID_M)
@@ -64,6 +77,11 @@
 #define SENSORS_ROTATION_VECTOR_HANDLE  (ID_RV)
 #define SENSORS_LINEAR_ACCEL_HANDLE     (ID_LA)
 #define SENSORS_GRAVITY_HANDLE          (ID_GR)
+#define SENSORS_SIGNIFICANT_MOTION_HANDLE (ID_SM)
+#define SENSORS_STEP_DETECTOR_HANDLE    (ID_SD)
+#define SENSORS_GAME_ROTATION_VECTOR_HANDLE (ID_GRV)
+#define SENSORS_GYROSCOPE_UNCALIBRATED_HANDLE (ID_GYU)
+#define SENSORS_MAGNETIC_FIELD_UNCALIBRATED_HANDLE (ID_MU)
 #define SENSORS_GYROSCOPE_HANDLE        (ID_GY)
 #define SENSORS_ACCELERATION_HANDLE     (ID_A)
 #define SENSORS_MAGNETIC_FIELD_HANDLE   (ID_M)
@@ -72,11 +90,13 @@
 #define SENSORS_PROXIMITY_HANDLE        (ID_P)
 #define SENSORS_PRESSURE_HANDLE         (ID_PR)
 #define SENSORS_TEMPERATURE_HANDLE      (ID_T)
+#define SENSORS_POCKET_HANDLE           (ID_POCKET)
+#define SENSORS_PICKUP_HANDLE           (ID_PICKUP)
 
 /*****************************************************************************/
 
 /* The SENSORS Module */
-#define LOCAL_SENSORS (4)
+#define LOCAL_SENSORS (6)
 static struct sensor_t sSensorList[LOCAL_SENSORS + MPLSensor::numSensors] =
 {
     {"GP2A Light", "Sharp", 1, SENSORS_LIGHT_HANDLE,
@@ -86,11 +106,19 @@ static struct sensor_t sSensorList[LOCAL_SENSORS + MPLSensor::numSensors] =
      SENSOR_TYPE_PROXIMITY, 5.0f, 5.0f, 0.75f, 0, 0, 0,
      SENSOR_STRING_TYPE_PROXIMITY, "", 0, SENSOR_FLAG_WAKE_UP | SENSOR_FLAG_ON_CHANGE_MODE, {}},
     {"BMP180 Pressure", "Bosch", 1, SENSORS_PRESSURE_HANDLE,
-     SENSOR_TYPE_PRESSURE, 1100.0f, 0.01f, 0.67f, 20000, 0, 0,
+     SENSOR_TYPE_PRESSURE, 1100.0f, 0.01f, 0.67f, 20000,
+     BAROMETER_FIFO_EVENTS, BAROMETER_FIFO_EVENTS,
      SENSOR_STRING_TYPE_PRESSURE, "", 20000, SENSOR_FLAG_CONTINUOUS_MODE, {}},
     {"BMP180 Temperature", "Bosch", 1, SENSORS_TEMPERATURE_HANDLE,
-     SENSOR_TYPE_AMBIENT_TEMPERATURE, 850.0f, 0.1f, 0.67f, 20000, 0, 0,
+     SENSOR_TYPE_AMBIENT_TEMPERATURE, 850.0f, 0.1f, 0.67f, 20000,
+     BAROMETER_FIFO_EVENTS, BAROMETER_FIFO_EVENTS,
      SENSOR_STRING_TYPE_AMBIENT_TEMPERATURE, "", 20000, SENSOR_FLAG_CONTINUOUS_MODE, {}},
+    {"Pocket Detector", "Tuna", 1, SENSORS_POCKET_HANDLE,
+     SENSOR_TYPE_TUNA_POCKET, 1.0f, 1.0f, 0.75f + ACCEL_BMA250_POWER, 0, 0, 0,
+     SENSOR_STRING_TYPE_TUNA_POCKET, "", 0, SENSOR_FLAG_WAKE_UP | SENSOR_FLAG_ON_CHANGE_MODE, {}},
+    {"Pick-up Gesture", "Tuna", 1, SENSORS_PICKUP_HANDLE,
+     SENSOR_TYPE_PICK_UP_GESTURE, 1.0f, 1.0f, 0.75f + ACCEL_BMA250_POWER, -1, 0, 0,
+     SENSOR_STRING_TYPE_PICK_UP_GESTURE, "", 0, SENSOR_FLAG_WAKE_UP | SENSOR_FLAG_ONE_SHOT_MODE, {}},
     {"MPL Gyroscope", "Invensense", 1, SENSORS_GYROSCOPE_HANDLE,
      SENSOR_TYPE_GYROSCOPE, GYRO_MPU3050_RANGE, GYRO_MPU3050_RESOLUTION,
      GYRO_MPU3050_POWER, 10000, 0, 0, SENSOR_STRING_TYPE_GYROSCOPE, "",
@@ -119,6 +147,25 @@ static struct sensor_t sSensorList[LOCAL_SENSORS + MPLSensor::numSensors] =
      SENSOR_TYPE_GRAVITY, NINEAXIS_GRAVITY_RANGE, NINEAXIS_GRAVITY_RESOLUTION,
      NINEAXIS_GRAVITY_POWER, 10000, 0, 0, SENSOR_STRING_TYPE_GRAVITY, "",
      0, SENSOR_FLAG_CONTINUOUS_MODE, {}},
+    {"MPL Significant Motion", "Invensense", 1, SENSORS_SIGNIFICANT_MOTION_HANDLE,
+     SENSOR_TYPE_SIGNIFICANT_MOTION, 1.0f, 1.0f, ACCEL_BMA250_POWER, -1, 0, 0,
+     SENSOR_STRING_TYPE_SIGNIFICANT_MOTION, "", 0,
+     SENSOR_FLAG_WAKE_UP | SENSOR_FLAG_ONE_SHOT_MODE, {}},
+    {"MPL Step Detector", "Invensense", 1, SENSORS_STEP_DETECTOR_HANDLE,
+     SENSOR_TYPE_STEP_DETECTOR, 1.0f, 1.0f, ACCEL_BMA250_POWER, 0, 0, 0,
+     SENSOR_STRING_TYPE_STEP_DETECTOR, "", 0, SENSOR_FLAG_SPECIAL_REPORTING_MODE, {}},
+    {"MPL Game Rotation Vector", "Invensense", 1, SENSORS_GAME_ROTATION_VECTOR_HANDLE,
+     SENSOR_TYPE_GAME_ROTATION_VECTOR, SIXAXIS_GAME_ROTATION_VECTOR_RANGE,
+     SIXAXIS_GAME_ROTATION_VECTOR_RESOLUTION, SIXAXIS_GAME_ROTATION_VECTOR_POWER, 10000, 0, 0,
+     SENSOR_STRING_TYPE_GAME_ROTATION_VECTOR, "", 0, SENSOR_FLAG_CONTINUOUS_MODE, {}},
+    {"MPL Gyroscope Uncalibrated", "Invensense", 1, SENSORS_GYROSCOPE_UNCALIBRATED_HANDLE,
+     SENSOR_TYPE_GYROSCOPE_UNCALIBRATED, GYRO_MPU3050_RANGE, GYRO_MPU3050_RESOLUTION,
+     GYRO_MPU3050_POWER, 10000, 0, 0, SENSOR_STRING_TYPE_GYROSCOPE_UNCALIBRATED, "",
+     0, SENSOR_FLAG_CONTINUOUS_MODE, {}},
+    {"MPL Magnetic Field Uncalibrated", "Invensense", 1, SENSORS_MAGNETIC_FIELD_UNCALIBRATED_HANDLE,
+     SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED, COMPASS_YAS530_RANGE, COMPASS_YAS530_RESOLUTION,
+     COMPASS_YAS530_POWER, 10000, 0, 0, SENSOR_STRING_TYPE_MAGNETIC_FIELD_UNCALIBRATED, "",
+     0, SENSOR_FLAG_CONTINUOUS_MODE, {}},
 };
 static int numSensors = LOCAL_SENSORS;
 
@@ -161,35 +208,98 @@ struct sensors_module_t HAL_MODULE_INFO_SYM = {
 };
 
 struct sensors_poll_context_t {
-    struct sensors_poll_device_t device; // must be first
+    struct sensors_poll_device_1 device; // must be first
 
         sensors_poll_context_t();
         ~sensors_poll_context_t();
     int activate(int handle, int enabled);
     int setDelay(int handle, int64_t ns);
     int pollEvents(sensors_event_t* data, int count);
+    int batch(int handle, int flags, int64_t ns, int64_t timeout);
+    int flush(int handle);
+#ifdef SENSORS_HAVE_DIRECT_CHANNEL
+    int registerDirectChannel(const struct sensors_direct_mem_t* mem, int channel_handle);
+    int configDirectReport(int handle, int channel_handle, int rate_level);
+#endif
 
 private:
     enum {
-        mpl               = 0,  //all mpl entries must be consecutive and in this order
-        mpl_accel,
-        mpl_timer,
+        mpl               = 0,
         light,
         proximity,
         pressure,
         temperature,
-        numSensorDrivers,       // wake pipe goes here
-        mpl_power,              //special handle for MPL pm interaction
+        policy,                 //fused sensors, no fd of its own
+        replay,                 //trace replacing the mReplayed drivers
+        numSensorDrivers,
+    };
+
+    // every fd of the event loop, the epoll data is the index in mFds
+    enum {
+        mpl_data_fd       = 0,
+        mpl_accel_fd,
+        mpl_timer_fd,
+        mpl_power_fd,           //MPL pm interaction
+        light_fd,
+        proximity_fd,
+        proximity_timer_fd,
+        pressure_fd,
+        temperature_fd,
+        replay_timer_fd,
+        replay_data_fd,         //trace socket, polled through its own epoll
+        wake_fd,
         numFds,
     };
 
-    static const size_t wake = numFds - 2;
+    typedef void (sensors_poll_context_t::*fd_handler_t)(int driver, int fd);
+    struct fd_entry {
+        int fd;
+        int driver;
+        fd_handler_t handler;
+    };
+
     static const char WAKE_MESSAGE = 'W';
-    struct pollfd mPollFds[numFds];
+    int mEpollFd;
+    struct fd_entry mFds[numFds];
     int mWritePipeFd;
     SensorBase* mSensors[numSensorDrivers];
+    // one bit per driver which may have events to read
+    volatile int32_t mReady;
+    // one bit per driver whose sensors the replay feeds
+    int32_t mReplayed;
+
+    // handles of the flush requests not completed yet, in request order
+    pthread_mutex_t mFlushLock;
+    android::Vector<int> mPendingFlushes;
+
+    // direct report channels by handle, only fed by the MPL
+    android::KeyedVector<int, DirectChannel*> mDirectChannels;
+    int mNextDirectChannel;
+
+    // serializes the source changes of the fused sensors
+    pthread_mutex_t mPolicyLock;
+
+    void addFd(int index, int fd, int driver, fd_handler_t handler);
+    void markReady(int driver);
+    void onDataReady(int driver, int fd);
+    void onMplIrq(int driver, int fd);
+    void onPowerEvent(int driver, int fd);
+    void onWake(int driver, int fd);
+    void wakeUp();
+    void kick(int driver);
+    int updateSources();
+    size_t pendingFlushes();
+    int readFlushCompletes(sensors_event_t* data, int count, size_t max);
+    int32_t replayedDrivers() const;
 
     int handleToDriver(int handle) const {
+        int driver = handleToHardware(handle);
+        if (driver >= 0 && (mReplayed & (1 << driver)))
+            return replay;
+        return driver;
+    }
+
+    int handleToHardware(int handle) const {
         switch (handle) {
             case ID_RV:
             case ID_LA:
@@ -198,6 +308,11 @@ private:
             case ID_A:
             case ID_M:
             case ID_O:
+            case ID_SM:
+            case ID_SD:
+            case ID_GRV:
+            case ID_GYU:
+            case ID_MU:
                 return mpl;
             case ID_L:
                 return light;
@@ -207,9 +322,16 @@ private:
                 return pressure;
             case ID_T:
                 return temperature;
+            case ID_POCKET:
+            case ID_PICKUP:
+                return policy;
         }
         return -EINVAL;
     }
+
+    SensorPolicy* sensorPolicy() const {
+        return (SensorPolicy*)mSensors[policy];
+    }
 };
 
 /*****************************************************************************/
@@ -217,47 +339,75 @@ private:
 sensors_poll_context_t::sensors_poll_context_t()
 {
     FUNC_LOG;
+    struct tuna_boot_profile profile;
+
+    tuna_boot_profile_begin(&profile, "sensors");
     MPLSensor* p_mplsen = new MPLSensor();
+    tuna_boot_profile_phase(&profile, "mpl");
     setCallbackObject(p_mplsen); //setup the callback object for handing mpl callbacks
     numSensors =
         LOCAL_SENSORS +
         p_mplsen->populateSensorList(sSensorList + LOCAL_SENSORS,
                                      sizeof(sSensorList[0]) * (ARRAY_SIZE(sSensorList) - LOCAL_SENSORS));
+#ifdef SENSORS_HAVE_DIRECT_CHANNEL
+    // the MPL sensors can report into ashmem, at 200Hz for those allowed to,
+    // the trigger sensors excepted
+    for (int i = LOCAL_SENSORS; i < numSensors; i++) {
+        if ((sSensorList[i].flags & REPORTING_MODE_MASK) != SENSOR_FLAG_CONTINUOUS_MODE)
+            continue;
+        int level = sSensorList[i].minDelay <= MPL_HIGH_RATE_DELAY_NS / 1000 ?
+                SENSOR_DIRECT_RATE_FAST : SENSOR_DIRECT_RATE_NORMAL;
+        sSensorList[i].flags |= SENSOR_FLAG_DIRECT_CHANNEL_ASHMEM |
+                (level << SENSOR_FLAG_SHIFT_DIRECT_REPORT);
+    }
+#endif
 
-    mSensors[mpl] = p_mplsen;
-    mPollFds[mpl].fd = mSensors[mpl]->getFd();
-    mPollFds[mpl].events = POLLIN;
-    mPollFds[mpl].revents = 0;
-
-    mSensors[mpl_accel] = mSensors[mpl];
-    mPollFds[mpl_accel].fd = ((MPLSensor*)mSensors[mpl])->getAccelFd();
-    mPollFds[mpl_accel].events = POLLIN;
-    mPollFds[mpl_accel].revents = 0;
+    mReady = 0;
+    mNextDirectChannel = 1;
+    mEpollFd = epoll_create(numFds);
+    ALOGE_IF(mEpollFd < 0, "error creating epoll fd (%s)", strerror(errno));
 
-    mSensors[mpl_timer] = mSensors[mpl];
-    mPollFds[mpl_timer].fd = ((MPLSensor*)mSensors[mpl])->getTimerFd();
-    mPollFds[mpl_timer].events = POLLIN;
-    mPollFds[mpl_timer].revents = 0;
+    mSensors[mpl] = p_mplsen;
+    addFd(mpl_data_fd, p_mplsen->getFd(), mpl,
+          &sensors_poll_context_t::onMplIrq);
+    addFd(mpl_accel_fd, p_mplsen->getAccelFd(), mpl,
+          &sensors_poll_context_t::onMplIrq);
+    addFd(mpl_timer_fd, p_mplsen->getTimerFd(), mpl,
+          &sensors_poll_context_t::onMplIrq);
+    addFd(mpl_power_fd, p_mplsen->getPowerFd(), mpl,
+          &sensors_poll_context_t::onPowerEvent);
 
     mSensors[light] = new LightSensor();
-    mPollFds[light].fd = mSensors[light]->getFd();
-    mPollFds[light].events = POLLIN;
-    mPollFds[light].revents = 0;
+    addFd(light_fd, mSensors[light]->getFd(), light,
+          &sensors_poll_context_t::onDataReady);
 
-    mSensors[proximity] = new ProximitySensor();
-    mPollFds[proximity].fd = mSensors[proximity]->getFd();
-    mPollFds[proximity].events = POLLIN;
-    mPollFds[proximity].revents = 0;
+    ProximitySensor* p_proximity = new ProximitySensor();
+    mSensors[proximity] = p_proximity;
+    addFd(proximity_fd, p_proximity->getFd(), proximity,
+          &sensors_poll_context_t::onDataReady);
+    addFd(proximity_timer_fd, p_proximity->getTimerFd(), proximity,
+          &sensors_poll_context_t::onDataReady);
 
     mSensors[pressure] = new PressureSensor();
-    mPollFds[pressure].fd = mSensors[pressure]->getFd();
-    mPollFds[pressure].events = POLLIN;
-    mPollFds[pressure].revents = 0;
+    addFd(pressure_fd, mSensors[pressure]->getFd(), pressure,
+          &sensors_poll_context_t::onDataReady);
 
     mSensors[temperature] = new TemperatureSensor();
-    mPollFds[temperature].fd = mSensors[temperature]->getFd();
-    mPollFds[temperature].events = POLLIN;
-    mPollFds[temperature].revents = 0;
+    addFd(temperature_fd, mSensors[temperature]->getFd(), temperature,
+          &sensors_poll_context_t::onDataReady);
+    tuna_boot_profile_phase(&profile, "input_sensors");
+
+    mSensors[policy] = new SensorPolicy();
+
+    // the replaced drivers stay open but idle, their handles are routed to
+    // the replay
+    ReplaySensor* p_replay = ReplaySensor::open();
+    mSensors[replay] = p_replay;
+    mReplayed = p_replay ? replayedDrivers() : 0;
+    addFd(replay_timer_fd, p_replay ? p_replay->getTimerFd() : -1, replay,
+          &sensors_poll_context_t::onDataReady);
+    addFd(replay_data_fd, p_replay ? p_replay->getFd() : -1, replay,
+          &sensors_poll_context_t::onDataReady);
 
     int wakeFds[2];
     int result = pipe(wakeFds);
@@ -265,15 +415,11 @@ sensors_poll_context_t::sensors_poll_context_t()
     fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
     fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
     mWritePipeFd = wakeFds[1];
+    addFd(wake_fd, wakeFds[0], -1, &sensors_poll_context_t::onWake);
 
-    mPollFds[wake].fd = wakeFds[0];
-    mPollFds[wake].events = POLLIN;
-    mPollFds[wake].revents = 0;
-
-    //setup MPL pm interaction handle
-    mPollFds[mpl_power].fd = ((MPLSensor*)mSensors[mpl])->getPowerFd();
-    mPollFds[mpl_power].events = POLLIN;
-    mPollFds[mpl_power].revents = 0;
+    pthread_mutex_init(&mFlushLock, NULL);
+    pthread_mutex_init(&mPolicyLock, NULL);
+    tuna_boot_profile_end(&profile);
 }
 
 sensors_poll_context_t::~sensors_poll_context_t()
@@ -282,8 +428,114 @@ sensors_poll_context_t::~sensors_poll_context_t()
     for (int i = 0; i < numSensorDrivers; i++) {
         delete mSensors[i];
     }
-    close(mPollFds[wake].fd);
+    for (size_t i = 0; i < mDirectChannels.size(); i++)
+        delete mDirectChannels.valueAt(i);
+    close(mFds[wake_fd].fd);
     close(mWritePipeFd);
+    close(mEpollFd);
+    pthread_mutex_destroy(&mFlushLock);
+    pthread_mutex_destroy(&mPolicyLock);
+}
+
+void sensors_poll_context_t::addFd(int index, int fd, int driver, fd_handler_t handler)
+{
+    struct epoll_event ev;
+
+    mFds[index].fd = fd;
+    mFds[index].driver = driver;
+    mFds[index].handler = handler;
+
+    if (fd < 0)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = index;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        ALOGE("error adding fd %d to epoll (%s)", fd, strerror(errno));
+}
+
+/* queue a driver for the next read pass, callable from any thread */
+void sensors_poll_context_t::markReady(int driver)
+{
+    android_atomic_or(1 << driver, &mReady);
+}
+
+/* a driver which applies its configuration from the poll thread has it
+ * pending after the request, make the poll thread read it */
+void sensors_poll_context_t::kick(int driver)
+{
+    if (mSensors[driver]->hasPendingEvents()) {
+        markReady(driver);
+        wakeUp();
+    }
+}
+
+void sensors_poll_context_t::onDataReady(int driver, int fd __unused)
+{
+    markReady(driver);
+}
+
+/* the MPL irqs of one epoll_wait are read together by the next readEvents,
+ * which then runs inv_update_data once for all of them */
+void sensors_poll_context_t::onMplIrq(int driver, int fd)
+{
+    ((MPLSensor*)mSensors[driver])->irqReady(fd);
+    markReady(driver);
+}
+
+void sensors_poll_context_t::onPowerEvent(int driver, int fd __unused)
+{
+    ((MPLSensor*)mSensors[driver])->handlePowerEvent();
+}
+
+void sensors_poll_context_t::onWake(int driver __unused, int fd __unused)
+{
+    char msg[16];
+    int result;
+
+    // one message per request, several may have piled up
+    do {
+        result = read(mFds[wake_fd].fd, msg, sizeof(msg));
+        for (int i = 0; i < result; i++)
+            ALOGE_IF(msg[i] != WAKE_MESSAGE, "unknown message on wake queue (0x%02x)", int(msg[i]));
+    } while (result == sizeof(msg));
+    ALOGE_IF(result < 0 && errno != EAGAIN, "error reading from wake pipe (%s)", strerror(errno));
+}
+
+void sensors_poll_context_t::wakeUp()
+{
+    const char wakeMessage(WAKE_MESSAGE);
+    int result = write(mWritePipeFd, &wakeMessage, 1);
+    ALOGE_IF(result < 0, "error sending wake message (%s)", strerror(errno));
+}
+
+/* run each source of the fused sensors while the framework or the policy
+ * needs it, at the policy rate while only the policy does.  It must be
+ * called with the mPolicyLock held. */
+int sensors_poll_context_t::updateSources()
+{
+    static const int sources[] = { ID_P, ID_A };
+    SensorPolicy* const fused = sensorPolicy();
+    int err = 0;
+
+    // the fused sensors wake the system, the DMP has to see the motion
+    ((MPLSensor*)mSensors[mpl])->setWakeUpRequested(fused->isActive());
+
+    for (size_t i = 0; i < ARRAY_SIZE(sources); i++) {
+        int handle = sources[i];
+        int driver = handleToDriver(handle);
+        bool wanted = fused->wants(handle);
+
+        if (wanted && !fused->isUserEnabled(handle))
+            mSensors[driver]->batch(handle, 0, SENSOR_POLICY_ACCEL_DELAY_NS, 0);
+        int e = mSensors[driver]->enable(handle, wanted);
+        if (e)
+            err = e;
+        else if (mSensors[driver]->hasPendingEvents())
+            markReady(driver);
+    }
+    return err;
 }
 
 int sensors_poll_context_t::activate(int handle, int enabled)
@@ -291,11 +543,25 @@ int sensors_poll_context_t::activate(int handle, int enabled)
     FUNC_LOG;
     int index = handleToDriver(handle);
     if (index < 0) return index;
-    int err =  mSensors[index]->enable(handle, enabled);
+    int err;
+    if (index == policy || SensorPolicy::isSource(handle)) {
+        pthread_mutex_lock(&mPolicyLock);
+        if (index == policy) {
+            err = sensorPolicy()->enable(handle, enabled);
+        } else {
+            sensorPolicy()->setUserEnabled(handle, enabled);
+            err = 0;
+        }
+        if (!err)
+            err = updateSources();
+        pthread_mutex_unlock(&mPolicyLock);
+    } else {
+        err = mSensors[index]->enable(handle, enabled);
+    }
     if (!err) {
-        const char wakeMessage(WAKE_MESSAGE);
-        int result = write(mWritePipeFd, &wakeMessage, 1);
-        ALOGE_IF(result < 0, "error sending wake message (%s)", strerror(errno));
+        if (mSensors[index]->hasPendingEvents())
+            markReady(index);
+        wakeUp();
     }
     return err;
 }
@@ -305,40 +571,230 @@ int sensors_poll_context_t::setDelay(int handle, int64_t ns)
     FUNC_LOG;
     int index = handleToDriver(handle);
     if (index < 0) return index;
-    return mSensors[index]->setDelay(handle, ns);
+    int err = mSensors[index]->setDelay(handle, ns);
+    if (err >= 0)
+        kick(index);
+    return err;
+}
+
+int sensors_poll_context_t::batch(int handle, int flags, int64_t ns, int64_t timeout)
+{
+    FUNC_LOG;
+    int index = handleToDriver(handle);
+    if (index < 0) return index;
+    int err = mSensors[index]->batch(handle, flags, ns, timeout);
+    if (!err)
+        kick(index);
+    return err;
+}
+
+int sensors_poll_context_t::flush(int handle)
+{
+    FUNC_LOG;
+    int index = handleToDriver(handle);
+    if (index < 0) return index;
+    int err = mSensors[index]->flush(handle);
+    if (err)
+        return err;
+
+    if (mSensors[index]->hasPendingEvents())
+        markReady(index);
+    pthread_mutex_lock(&mFlushLock);
+    mPendingFlushes.add(handle);
+    pthread_mutex_unlock(&mFlushLock);
+    wakeUp();
+    return 0;
+}
+
+#ifdef SENSORS_HAVE_DIRECT_CHANNEL
+int sensors_poll_context_t::registerDirectChannel(const struct sensors_direct_mem_t* mem,
+                                                  int channel_handle)
+{
+    FUNC_LOG;
+    MPLSensor* mpl_sensor = (MPLSensor*)mSensors[mpl];
+
+    if (!mem) {
+        ssize_t index = mDirectChannels.indexOfKey(channel_handle);
+        if (index < 0)
+            return -EINVAL;
+        DirectChannel* channel = mDirectChannels.valueAt(index);
+        mpl_sensor->stopDirectReports(channel);
+        kick(mpl);
+        mDirectChannels.removeItemsAt(index);
+        delete channel;
+        return 0;
+    }
+
+    if (mem->type != SENSOR_DIRECT_MEM_TYPE_ASHMEM
+            || mem->format != SENSOR_DIRECT_FMT_SENSORS_EVENT
+            || !mem->handle || mem->handle->numFds < 1)
+        return -EINVAL;
+
+    DirectChannel* channel = new DirectChannel(mem->handle->data[0], mem->size);
+    if (!channel->isValid()) {
+        delete channel;
+        return -ENOMEM;
+    }
+    int handle = mNextDirectChannel++;
+    mDirectChannels.add(handle, channel);
+    return handle;
+}
+
+int sensors_poll_context_t::configDirectReport(int handle, int channel_handle,
+                                               int rate_level)
+{
+    FUNC_LOG;
+    MPLSensor* mpl_sensor = (MPLSensor*)mSensors[mpl];
+
+    ssize_t index = mDirectChannels.indexOfKey(channel_handle);
+    if (index < 0)
+        return -EINVAL;
+    DirectChannel* channel = mDirectChannels.valueAt(index);
+
+    // stop everything reported into the channel
+    if (handle == -1) {
+        if (rate_level != SENSOR_DIRECT_RATE_STOP)
+            return -EINVAL;
+        mpl_sensor->stopDirectReports(channel);
+        kick(mpl);
+        return 0;
+    }
+
+    if (handleToDriver(handle) != mpl)
+        return -EINVAL;
+
+    int64_t ns;
+    switch (rate_level) {
+        case SENSOR_DIRECT_RATE_STOP:
+            ns = 0;
+            break;
+        case SENSOR_DIRECT_RATE_NORMAL:
+            ns = 20000000LL;
+            break;
+        case SENSOR_DIRECT_RATE_FAST:
+            ns = MPL_HIGH_RATE_DELAY_NS;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    int err = mpl_sensor->configDirectReport(handle, channel, ns);
+    if (err)
+        return err;
+    kick(mpl);
+    // the MPLSensor report tokens
+    return ns ? handle + 1 : 0;
+}
+#endif
+
+/* the drivers SENSOR_REPLAY_DRIVERS_PROPERTY names */
+int32_t sensors_poll_context_t::replayedDrivers() const
+{
+    // indexed by driver
+    static const char* const names[] = {
+        "mpl", "light", "proximity", "pressure", "temperature",
+    };
+    char value[PROPERTY_VALUE_MAX];
+    char* save;
+    int32_t drivers = 0;
+
+    property_get(SENSOR_REPLAY_DRIVERS_PROPERTY, value, "");
+    for (char* name = strtok_r(value, ",", &save); name;
+         name = strtok_r(NULL, ",", &save)) {
+        size_t i = 0;
+        while (i < ARRAY_SIZE(names) && strcmp(name, names[i]))
+            i++;
+        if (i < ARRAY_SIZE(names))
+            drivers |= 1 << i;
+        else
+            ALOGE("no sensor driver %s to replay", name);
+    }
+    if (!drivers)
+        drivers = (1 << ARRAY_SIZE(names)) - 1;
+    ALOGI("replaying the sensors of the drivers 0x%x", drivers);
+    return drivers;
+}
+
+size_t sensors_poll_context_t::pendingFlushes()
+{
+    pthread_mutex_lock(&mFlushLock);
+    size_t n = mPendingFlushes.size();
+    pthread_mutex_unlock(&mFlushLock);
+    return n;
+}
+
+/* returns up to max flush complete events, oldest request first */
+int sensors_poll_context_t::readFlushCompletes(sensors_event_t* data, int count, size_t max)
+{
+    int nb = 0;
+
+    pthread_mutex_lock(&mFlushLock);
+    while (count && max && !mPendingFlushes.isEmpty()) {
+        memset(data, 0, sizeof(*data));
+        data->version = META_DATA_VERSION;
+        data->type = SENSOR_TYPE_META_DATA;
+        data->meta_data.what = META_DATA_FLUSH_COMPLETE;
+        data->meta_data.sensor = mPendingFlushes[0];
+        mPendingFlushes.removeAt(0);
+        data++;
+        count--;
+        max--;
+        nb++;
+    }
+    pthread_mutex_unlock(&mFlushLock);
+    return nb;
 }
 
 int sensors_poll_context_t::pollEvents(sensors_event_t* data, int count)
 {
     //FUNC_LOG;
+    struct epoll_event events[numFds];
+    sensors_event_t const* const first = data;
     int nbEvents = 0;
     int n = 0;
-    int polltime = -1;
 
     do {
-        // see if we have some leftover from the last poll()
-        for (int i = 0; count && i < numSensorDrivers; i++) {
+        // flushes requested so far complete after the events read below
+        size_t flushes = pendingFlushes();
+
+        // read only the drivers which signalled, those still holding
+        // events when the buffer fills up stay queued
+        int32_t ready = android_atomic_and(0, &mReady);
+        for (int i = 0; count && ready; i++) {
+            if (!(ready & (1 << i)))
+                continue;
+            ready &= ~(1 << i);
+
             SensorBase* const sensor(mSensors[i]);
-            if ((mPollFds[i].revents & POLLIN) || (sensor->hasPendingEvents())) {
-                int nb = sensor->readEvents(data, count);
-                if (nb < count) {
-                    // no more data for this sensor
-                    mPollFds[i].revents = 0;
-                }
-                count -= nb;
-                nbEvents += nb;
-                data += nb;
-
-                //special handling for the mpl, which has multiple handles
-                if (i == mpl) {
-                    i += 2; //skip accel and timer
-                    mPollFds[mpl_accel].revents = 0;
-                    mPollFds[mpl_timer].revents = 0;
-                } else if (i == mpl_accel) {
-                    i += 1; //skip timer
-                    mPollFds[mpl_timer].revents = 0;
-                }
+            int nb = sensor->readEvents(data, count);
+            if (nb < 0)
+                nb = 0;
+            if (nb >= count || sensor->hasPendingEvents())
+                markReady(i);
+            if (i != policy) {
+                nb = sensorPolicy()->filterEvents(data, nb);
+                if (sensorPolicy()->hasPendingEvents())
+                    markReady(policy);
             }
+            count -= nb;
+            nbEvents += nb;
+            data += nb;
+        }
+        if (ready)
+            android_atomic_or(ready, &mReady);
+
+        // a one-shot fused sensor fired, stop what it alone ran
+        if (sensorPolicy()->takeSourcesChanged()) {
+            pthread_mutex_lock(&mPolicyLock);
+            updateSources();
+            pthread_mutex_unlock(&mPolicyLock);
+        }
+
+        if (count && flushes) {
+            int nb = readFlushCompletes(data, count, flushes);
+            count -= nb;
+            nbEvents += nb;
+            data += nb;
         }
 
         if (count) {
@@ -346,27 +802,23 @@ int sensors_poll_context_t::pollEvents(sensors_event_t* data, int count)
             // some events immediately or just wait if we don't have
             // anything to return
             do {
-                n = poll(mPollFds, numFds, nbEvents ? 0 : polltime);
+                n = epoll_wait(mEpollFd, events, numFds,
+                               (nbEvents || mReady) ? 0 : -1);
             } while (n < 0 && errno == EINTR);
             if (n < 0) {
-                ALOGE("poll() failed (%s)", strerror(errno));
+                ALOGE("epoll_wait() failed (%s)", strerror(errno));
                 return -errno;
             }
-            if (mPollFds[wake].revents & POLLIN) {
-                char msg;
-                int result = read(mPollFds[wake].fd, &msg, 1);
-                ALOGE_IF(result < 0, "error reading from wake pipe (%s)", strerror(errno));
-                ALOGE_IF(msg != WAKE_MESSAGE, "unknown message on wake queue (0x%02x)", int(msg));
-                mPollFds[wake].revents = 0;
-            }
-            if (mPollFds[mpl_power].revents & POLLIN) {
-                ((MPLSensor*)mSensors[mpl])->handlePowerEvent();
-                mPollFds[mpl_power].revents = 0;
+            for (int i = 0; i < n; i++) {
+                struct fd_entry const* fd = &mFds[events[i].data.u32];
+                (this->*fd->handler)(fd->driver, fd->fd);
             }
         }
         // if we have events and space, go read them
-    } while (n && count);
+    } while ((n || mReady) && count);
 
+    SensorTime::recordDelivery(first, nbEvents);
+    ReplaySensor::record(first, nbEvents);
     return nbEvents;
 }
 
@@ -406,6 +858,41 @@ static int poll__poll(struct sensors_poll_device_t *dev,
     return ctx->pollEvents(data, count);
 }
 
+static int poll__batch(struct sensors_poll_device_1 *dev,
+                       int handle, int flags, int64_t ns, int64_t timeout)
+{
+    FUNC_LOG;
+    sensors_poll_context_t *ctx = (sensors_poll_context_t *)dev;
+    return ctx->batch(handle, flags, ns, timeout);
+}
+
+static int poll__flush(struct sensors_poll_device_1 *dev, int handle)
+{
+    FUNC_LOG;
+    sensors_poll_context_t *ctx = (sensors_poll_context_t *)dev;
+    return ctx->flush(handle);
+}
+
+#ifdef SENSORS_HAVE_DIRECT_CHANNEL
+static int poll__register_direct_channel(struct sensors_poll_device_1 *dev,
+                                         const struct sensors_direct_mem_t* mem,
+                                         int channel_handle)
+{
+    FUNC_LOG;
+    sensors_poll_context_t *ctx = (sensors_poll_context_t *)dev;
+    return ctx->registerDirectChannel(mem, channel_handle);
+}
+
+static int poll__config_direct_report(struct sensors_poll_device_1 *dev,
+                                      int handle, int channel_handle,
+                                      const struct sensors_direct_cfg_t *config)
+{
+    FUNC_LOG;
+    sensors_poll_context_t *ctx = (sensors_poll_context_t *)dev;
+    return ctx->configDirectReport(handle, channel_handle, config->rate_level);
+}
+#endif
+
 /*****************************************************************************/
 
 /** Open a new instance of a sensor device using name */
@@ -417,16 +904,21 @@ static int open_sensors(const struct hw_module_t* module,
     int status = -EINVAL;
     sensors_poll_context_t *dev = new sensors_poll_context_t();
 
-    memset(&dev->device, 0, sizeof(sensors_poll_device_t));
+    memset(&dev->device, 0, sizeof(sensors_poll_device_1));
 
     dev->device.common.tag = HARDWARE_DEVICE_TAG;
-    // TODO: We can't expect this version to be supported forever...
-    dev->device.common.version  = SENSORS_DEVICE_API_VERSION_0_1;
+    dev->device.common.version  = SENSORS_DEVICE_API_VERSION_1_3;
     dev->device.common.module   = const_cast<hw_module_t*>(module);
     dev->device.common.close    = poll__close;
     dev->device.activate        = poll__activate;
     dev->device.setDelay        = poll__setDelay;
     dev->device.poll            = poll__poll;
+    dev->device.batch           = poll__batch;
+    dev->device.flush           = poll__flush;
+#ifdef SENSORS_HAVE_DIRECT_CHANNEL
+    dev->device.register_direct_channel = poll__register_direct_channel;
+    dev->device.config_direct_report    = poll__config_direct_report;
+#endif
 
     *device = &dev->device.common;
     status = 0;
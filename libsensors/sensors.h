@@ -41,6 +41,11 @@ __BEGIN_DECLS
 #define ID_RV (ID_O + 1)
 #define ID_LA (ID_RV + 1)
 #define ID_GR (ID_LA + 1)
+#define ID_SM (ID_GR + 1)
+#define ID_SD (ID_SM + 1)
+#define ID_GRV (ID_SD + 1)
+#define ID_GYU (ID_GRV + 1)
+#define ID_MU (ID_GYU + 1)
 
 #define ID_SAMSUNG_BASE (0x1000)
 #define ID_L  (ID_SAMSUNG_BASE)
@@ -48,6 +53,10 @@ __BEGIN_DECLS
 #define ID_PR (ID_P + 1)
 #define ID_T  (ID_PR + 1)
 
+#define ID_POLICY_BASE (0x2000)
+#define ID_POCKET (ID_POLICY_BASE)
+#define ID_PICKUP (ID_POCKET + 1)
+
 /*****************************************************************************/
 
 
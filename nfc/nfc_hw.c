@@ -13,10 +13,14 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#define LOG_TAG "nfc_hw"
+
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 
+#include <cutils/log.h>
+#include <cutils/properties.h>
 #include <hardware/hardware.h>
 #include <hardware/nfc.h>
 
@@ -108,7 +112,98 @@ static uint8_t pn544_eedata_settings[][4] = {
     ,{0x00,0x9F,0x09,0x00} // 0x00 - Disable EMD support, 0x01 - Enable EMD support
 };
 
+/*
+ * Low-power polling profiles, picked with persist.nfc.polling_profile. Their
+ * settings take the place of the ones above at the same addresses. The stack
+ * writes the EEPROM settings each time NFC is enabled, so turning NFC off and
+ * on again applies a new profile.
+ */
+struct eedata_profile {
+    const char *name;
+    uint8_t settings[5][4];
+};
+
+#define DEFAULT_PROFILE "balanced"
+
+static const struct eedata_profile pn544_eedata_profiles[] = {
+    {
+        // tags seen right away, for kiosks: no low-power polling
+        "fast-detect", {
+             {0x00,0x9E,0x74,0x00} // low-power polling disabled
+            ,{0x00,0x9E,0x7D,0xB0} // 4 retries after low power detection
+            ,{0x00,0x9F,0x28,0x01} // 1 measurement per low-power poll
+            ,{0x00,0x9F,0x35,0x14} // Card Emulation mode kept 250 ms
+            ,{0x00,0x9F,0x36,0x60} //
+        },
+    }, {
+        // the settings above
+        "balanced", {
+             {0x00,0x9E,0x74,0xB0} // max sensitivity, 3 low-power polls per regular poll
+            ,{0x00,0x9E,0x7D,0xB0} // 4 retries after low power detection
+            ,{0x00,0x9F,0x28,0x01} // 1 measurement per low-power poll
+            ,{0x00,0x9F,0x35,0x14} // Card Emulation mode kept 250 ms
+            ,{0x00,0x9F,0x36,0x60} //
+        },
+    }, {
+        // in a pocket: fewer false detections, less time with the field on
+        "ultra-low-power", {
+             {0x00,0x9E,0x74,0xB2} // lower sensitivity, 3 low-power polls per regular poll
+            ,{0x00,0x9E,0x7D,0x90} // 2 retries after low power detection
+            ,{0x00,0x9F,0x28,0x01} // 1 measurement per low-power poll
+            ,{0x00,0x9F,0x35,0x04} // Card Emulation mode kept 50 ms, the default
+            ,{0x00,0x9F,0x36,0x11} //
+        },
+    },
+};
+
+#define NUM_PROFILES (sizeof(pn544_eedata_profiles) / sizeof(pn544_eedata_profiles[0]))
+#define NUM_EEDATA_SETTINGS (sizeof(pn544_eedata_settings) / 4)
+
+static const struct eedata_profile *find_profile(const char *name) {
+    size_t i;
+
+    for (i = 0; i < NUM_PROFILES; i++) {
+        if (strcmp(pn544_eedata_profiles[i].name, name) == 0)
+            return &pn544_eedata_profiles[i];
+    }
+    return NULL;
+}
+
+/*
+ * Returns a copy of pn544_eedata_settings with the settings of the profile
+ * selected, to be freed with the device.
+ */
+static uint8_t *make_eedata_settings(void) {
+    char name[PROPERTY_VALUE_MAX];
+    const struct eedata_profile *profile;
+    uint8_t (*settings)[4];
+    size_t i, j;
+
+    property_get("persist.nfc.polling_profile", name, DEFAULT_PROFILE);
+    profile = find_profile(name);
+    if (profile == NULL) {
+        ALOGW("unknown polling profile %s, using " DEFAULT_PROFILE, name);
+        profile = find_profile(DEFAULT_PROFILE);
+    }
+
+    settings = malloc(sizeof(pn544_eedata_settings));
+    if (settings == NULL)
+        return NULL;
+    memcpy(settings, pn544_eedata_settings, sizeof(pn544_eedata_settings));
+
+    for (i = 0; i < NUM_EEDATA_SETTINGS; i++) {
+        for (j = 0; j < sizeof(profile->settings) / 4; j++) {
+            if (memcmp(settings[i], profile->settings[j], 3) == 0)
+                settings[i][3] = profile->settings[j][3];
+        }
+    }
+
+    ALOGD("using the %s polling profile", profile->name);
+    return (uint8_t *)settings;
+}
+
 static int pn544_close(hw_device_t *dev) {
+    free(((nfc_pn544_device_t *)dev)->eeprom_settings);
     free(dev);
 
     return 0;
@@ -122,14 +217,21 @@ static int nfc_open(const hw_module_t* module, const char* name,
         hw_device_t** device) {
     if (strcmp(name, NFC_PN544_CONTROLLER) == 0) {
         nfc_pn544_device_t *dev = calloc(1, sizeof(nfc_pn544_device_t));
+        if (dev == NULL)
+            return -ENOMEM;
+
+        dev->eeprom_settings = make_eedata_settings();
+        if (dev->eeprom_settings == NULL) {
+            free(dev);
+            return -ENOMEM;
+        }
 
         dev->common.tag = HARDWARE_DEVICE_TAG;
         dev->common.version = 0;
         dev->common.module = (struct hw_module_t*) module;
         dev->common.close = pn544_close;
 
-        dev->num_eeprom_settings = sizeof(pn544_eedata_settings) / 4;
-        dev->eeprom_settings = (uint8_t*)pn544_eedata_settings;
+        dev->num_eeprom_settings = NUM_EEDATA_SETTINGS;
         dev->linktype = PN544_LINK_TYPE_UART;
         dev->device_node = "/dev/ttyO3";
         dev->enable_i2c_workaround = 0;
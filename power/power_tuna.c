@@ -0,0 +1,382 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_TAG "Tuna PowerHAL"
+#include <utils/Log.h>
+
+#include <hardware/hardware.h>
+#include <hardware/power.h>
+
+#include "power_tuna.h"
+
+#define CPUFREQ_INTERACTIVE "/sys/devices/system/cpu/cpufreq/interactive/"
+#define BOOSTPULSE_PATH (CPUFREQ_INTERACTIVE "boostpulse")
+#define BOOST_PATH (CPUFREQ_INTERACTIVE "boost")
+#define CPU0_CPUFREQ "/sys/devices/system/cpu/cpu0/cpufreq/"
+#define SCALINGMAXFREQ_PATH (CPU0_CPUFREQ "scaling_max_freq")
+#define SCALINGMINFREQ_PATH (CPU0_CPUFREQ "scaling_min_freq")
+#define CPUINFOMINFREQ_PATH (CPU0_CPUFREQ "cpuinfo_min_freq")
+#define CPU1_ONLINE_PATH "/sys/devices/system/cpu/cpu1/online"
+
+// how long a launch keeps the boost if the end of it never comes
+#define LAUNCH_BOOST_MAX_SEC 5
+
+#define MAX_PERF_LOCKS 8
+
+struct tuna_power_module {
+    struct power_module base;
+    pthread_mutex_t lock;
+    int boostpulse_fd;
+    int boostpulse_warned;
+    int interactive;
+    int low_power;
+    int vsync_boost;
+    int launch_boost;
+    // bumped by each launch, so that a stale timeout doesn't end a newer one
+    unsigned launch_id;
+    // what update_state() last wrote, hotplug in particular isn't cheap
+    const char *cur_max_freq;
+    int cur_boost;
+    int cur_cpu1_online;
+};
+
+static char screen_off_max_freq[] = "700000";
+static char low_power_max_freq[] = "920000";
+static char scaling_max_freq[] = "1200000";
+
+static void sysfs_write(const char *path, const char *s)
+{
+    char buf[80];
+    int len;
+    int fd = open(path, O_WRONLY);
+
+    if (fd < 0) {
+        strerror_r(errno, buf, sizeof(buf));
+        ALOGE("Error opening %s: %s\n", path, buf);
+        return;
+    }
+
+    len = write(fd, s, strlen(s));
+    if (len < 0) {
+        strerror_r(errno, buf, sizeof(buf));
+        ALOGE("Error writing to %s: %s\n", path, buf);
+    }
+
+    close(fd);
+}
+
+/*
+ * Performance locks of the other HALs. The framework's power HAL never
+ * touches scaling_min_freq, so the copies of the module loaded by other
+ * processes keep their floor to themselves.
+ */
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int perf_lock_freqs[MAX_PERF_LOCKS];
+static unsigned int perf_cur_min_freq;
+static unsigned int perf_cpuinfo_min_freq;
+
+/* It must be called with the perf_lock held. */
+static void perf_lock_update(void)
+{
+    unsigned int min_freq = 0;
+    char buf[16];
+    int i;
+
+    for (i = 0; i < MAX_PERF_LOCKS; i++) {
+        if (perf_lock_freqs[i] > min_freq)
+            min_freq = perf_lock_freqs[i];
+    }
+
+    if (!perf_cpuinfo_min_freq) {
+        int fd = open(CPUINFOMINFREQ_PATH, O_RDONLY);
+        int len = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+
+        if (len > 0) {
+            buf[len] = '\0';
+            perf_cpuinfo_min_freq = strtoul(buf, NULL, 10);
+        }
+        if (fd >= 0)
+            close(fd);
+        if (!perf_cpuinfo_min_freq)
+            perf_cpuinfo_min_freq = 350000;
+    }
+    // without any lock, back to the lowest OPP
+    if (min_freq < perf_cpuinfo_min_freq)
+        min_freq = perf_cpuinfo_min_freq;
+
+    if (min_freq != perf_cur_min_freq) {
+        snprintf(buf, sizeof(buf), "%u", min_freq);
+        sysfs_write(SCALINGMINFREQ_PATH, buf);
+        perf_cur_min_freq = min_freq;
+    }
+}
+
+int power_tuna_perf_lock_acquire(unsigned int min_freq_khz)
+{
+    int handle = -EBUSY;
+    int i;
+
+    if (min_freq_khz == 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&perf_lock);
+    for (i = 0; i < MAX_PERF_LOCKS; i++) {
+        if (!perf_lock_freqs[i]) {
+            perf_lock_freqs[i] = min_freq_khz;
+            handle = i;
+            perf_lock_update();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&perf_lock);
+
+    if (handle < 0)
+        ALOGE("No performance lock left for %u kHz\n", min_freq_khz);
+    return handle;
+}
+
+void power_tuna_perf_lock_release(int handle)
+{
+    if (handle < 0 || handle >= MAX_PERF_LOCKS)
+        return;
+
+    pthread_mutex_lock(&perf_lock);
+    if (perf_lock_freqs[handle]) {
+        perf_lock_freqs[handle] = 0;
+        perf_lock_update();
+    }
+    pthread_mutex_unlock(&perf_lock);
+}
+
+static void tuna_power_init(struct power_module *module __unused)
+{
+    /*
+     * cpufreq interactive governor: timer 20ms, min sample 60ms,
+     * hispeed 700MHz at load 99%, held 80ms before going above it.
+     */
+    sysfs_write(CPUFREQ_INTERACTIVE "timer_rate", "20000");
+    sysfs_write(CPUFREQ_INTERACTIVE "min_sample_time", "60000");
+    sysfs_write(CPUFREQ_INTERACTIVE "hispeed_freq", "700000");
+    sysfs_write(CPUFREQ_INTERACTIVE "go_hispeed_load", "99");
+    sysfs_write(CPUFREQ_INTERACTIVE "above_hispeed_delay", "80000");
+}
+
+/* It must be called with the lock held. */
+static int boostpulse_open(struct tuna_power_module *tuna)
+{
+    char buf[80];
+
+    if (tuna->boostpulse_fd < 0) {
+        tuna->boostpulse_fd = open(BOOSTPULSE_PATH, O_WRONLY);
+
+        if (tuna->boostpulse_fd < 0) {
+            if (!tuna->boostpulse_warned) {
+                strerror_r(errno, buf, sizeof(buf));
+                ALOGE("Error opening %s: %s\n", BOOSTPULSE_PATH, buf);
+                tuna->boostpulse_warned = 1;
+            }
+        }
+    }
+
+    return tuna->boostpulse_fd;
+}
+
+/*
+ * Applies what the screen, the low power mode and the boosts want from the
+ * frequency cap, the boost of the governor and the second core. It must be
+ * called with the lock held.
+ */
+static void update_state(struct tuna_power_module *tuna)
+{
+    int boosted = tuna->vsync_boost || tuna->launch_boost;
+    const char *max_freq;
+    int cpu1_online;
+
+    if (!tuna->interactive)
+        max_freq = screen_off_max_freq;
+    else if (tuna->low_power && !boosted)
+        max_freq = low_power_max_freq;
+    else
+        max_freq = scaling_max_freq;
+    if (max_freq != tuna->cur_max_freq) {
+        sysfs_write(SCALINGMAXFREQ_PATH, max_freq);
+        tuna->cur_max_freq = max_freq;
+    }
+
+    if (boosted != tuna->cur_boost) {
+        sysfs_write(BOOST_PATH, boosted ? "1" : "0");
+        tuna->cur_boost = boosted;
+    }
+
+    // a launch wants both cores, the low power mode gets by with one
+    cpu1_online = !tuna->low_power || boosted;
+    if (cpu1_online != tuna->cur_cpu1_online) {
+        sysfs_write(CPU1_ONLINE_PATH, cpu1_online ? "1" : "0");
+        tuna->cur_cpu1_online = cpu1_online;
+    }
+}
+
+static void tuna_power_set_interactive(struct power_module *module, int on)
+{
+    struct tuna_power_module *tuna = (struct tuna_power_module *) module;
+
+    /*
+     * Lower maximum frequency when screen is off.  CPU 0 and 1 share a
+     * cpufreq policy.
+     */
+    pthread_mutex_lock(&tuna->lock);
+    tuna->interactive = on;
+    update_state(tuna);
+    pthread_mutex_unlock(&tuna->lock);
+}
+
+struct launch_timeout {
+    struct tuna_power_module *tuna;
+    unsigned launch_id;
+};
+
+static void *launch_timeout_thread(void *arg)
+{
+    struct launch_timeout timeout = *(struct launch_timeout *) arg;
+    struct tuna_power_module *tuna = timeout.tuna;
+
+    free(arg);
+    sleep(LAUNCH_BOOST_MAX_SEC);
+
+    pthread_mutex_lock(&tuna->lock);
+    if (tuna->launch_boost && tuna->launch_id == timeout.launch_id) {
+        ALOGW("launch boost timed out");
+        tuna->launch_boost = 0;
+        update_state(tuna);
+    }
+    pthread_mutex_unlock(&tuna->lock);
+    return NULL;
+}
+
+/* It must be called with the lock held. */
+static void start_launch_timeout(struct tuna_power_module *tuna)
+{
+    struct launch_timeout *timeout = malloc(sizeof(*timeout));
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (timeout == NULL)
+        return;
+    timeout->tuna = tuna;
+    timeout->launch_id = tuna->launch_id;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, launch_timeout_thread, timeout))
+        free(timeout);
+    pthread_attr_destroy(&attr);
+}
+
+static void tuna_power_hint(struct power_module *module, power_hint_t hint,
+                            void *data)
+{
+    struct tuna_power_module *tuna = (struct tuna_power_module *) module;
+    char buf[80];
+    int len;
+    int on = data ? *(int *) data : 0;
+
+    switch (hint) {
+    case POWER_HINT_INTERACTION:
+        pthread_mutex_lock(&tuna->lock);
+        // the cap of the low power mode stays, the pulse works under it
+        if (boostpulse_open(tuna) >= 0) {
+            len = write(tuna->boostpulse_fd, "1", 1);
+
+            if (len < 0) {
+                strerror_r(errno, buf, sizeof(buf));
+                ALOGE("Error writing to %s: %s\n", BOOSTPULSE_PATH, buf);
+            }
+        }
+        pthread_mutex_unlock(&tuna->lock);
+        break;
+
+    case POWER_HINT_VSYNC:
+        pthread_mutex_lock(&tuna->lock);
+        if (tuna->vsync_boost != !!on) {
+            tuna->vsync_boost = !!on;
+            update_state(tuna);
+        }
+        pthread_mutex_unlock(&tuna->lock);
+        break;
+
+    case POWER_HINT_LAUNCH:
+        pthread_mutex_lock(&tuna->lock);
+        if (!data || on) {
+            tuna->launch_id++;
+            tuna->launch_boost = 1;
+            start_launch_timeout(tuna);
+        } else {
+            tuna->launch_boost = 0;
+        }
+        update_state(tuna);
+        pthread_mutex_unlock(&tuna->lock);
+        break;
+
+    case POWER_HINT_LOW_POWER:
+        pthread_mutex_lock(&tuna->lock);
+        tuna->low_power = !!on;
+        update_state(tuna);
+        pthread_mutex_unlock(&tuna->lock);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static struct hw_module_methods_t power_module_methods = {
+    .open = NULL,
+};
+
+struct tuna_power_module HAL_MODULE_INFO_SYM = {
+    .base = {
+        .common = {
+            .tag = HARDWARE_MODULE_TAG,
+            .module_api_version = POWER_MODULE_API_VERSION_0_2,
+            .hal_api_version = HARDWARE_HAL_API_VERSION,
+            .id = POWER_HARDWARE_MODULE_ID,
+            .name = "Tuna Power HAL",
+            .author = "The Android Open Source Project",
+            .methods = &power_module_methods,
+        },
+
+       .init = tuna_power_init,
+       .setInteractive = tuna_power_set_interactive,
+       .powerHint = tuna_power_hint,
+    },
+
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .boostpulse_fd = -1,
+    .boostpulse_warned = 0,
+    .interactive = 1,
+    .cur_boost = -1,
+    .cur_cpu1_online = -1,
+};
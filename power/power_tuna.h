@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POWER_TUNA_H
+#define POWER_TUNA_H
+
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/**
+ * Extensions of power.tuna beyond the power HAL API, for the other HALs of
+ * the device. They are looked up with dlsym() on the handle that
+ * hw_get_module() keeps in the module's dso.
+ *
+ * The locks are those of the calling process: each process loading the
+ * module has its own set.
+ */
+
+#define POWER_TUNA_PERF_LOCK_ACQUIRE "power_tuna_perf_lock_acquire"
+
+/**
+ * Keeps the CPU at min_freq_khz or above until the lock is released. The
+ * floor applied is the highest of the locks held.
+ *
+ * Returns the handle of the lock, or a negative errno.
+ */
+typedef int (*power_tuna_perf_lock_acquire_t)(unsigned int min_freq_khz);
+
+#define POWER_TUNA_PERF_LOCK_RELEASE "power_tuna_perf_lock_release"
+
+/**
+ * Releases a lock returned by the acquire function.
+ */
+typedef void (*power_tuna_perf_lock_release_t)(int handle);
+
+__END_DECLS
+
+#endif  // POWER_TUNA_H
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +36,10 @@
 
 #define SMALL_BUFFER_SIZE 0x20
 
+// Flashing goes through an aligned buffer of this size, with O_DIRECT
+#define FLASH_CHUNK_SIZE 0x20000 // 128KB
+#define FLASH_ALIGNMENT 4096
+
 // A combination of these defines the specification of the device.
 #define OMAP4460  0x1
 #define OMAP4430  0x2
@@ -157,56 +162,121 @@ int get_xloader_offset() {
   return -1;
 }
 
-int write_pit_partition_table(const char* image_data,
-                              size_t image_size __unused) {
-  int written = 0;
-  int to_write;
-  const char* curr;
-
-
-  int mmcfd = open(MMC_LOCATION, O_RDWR);
-  if (mmcfd < 0) {
-    fprintf(stderr, "Could not open %s\n", MMC_LOCATION);
-    return -1;
+// Opens a block device for flash_region(), with O_DIRECT if it takes it.
+static int open_flash(const char* path) {
+  int fd = open(path, O_RDWR | O_DIRECT);
+  if (fd < 0 && errno == EINVAL) {
+    fd = open(path, O_RDWR);
   }
-
-  // zero out gpt magic field
-  if (lseek(mmcfd, SECTOR_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "Couldn't seek to the start of sector 1\n");
-    close(mmcfd);
-    return -1;
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
   }
+  return fd;
+}
 
-  char buf[SECTOR_SIZE];
-  if (read(mmcfd, buf, SECTOR_SIZE) != SECTOR_SIZE) {
-    fprintf(stderr, "Failed to read sector 1\n");
-    close(mmcfd);
-    return -1;
+static int pread_full(int fd, char* buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
   }
+  return 0;
+}
 
-  memset(buf, 0, 8);
+static int pwrite_full(int fd, const char* buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
 
-  if (lseek(mmcfd, SECTOR_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "Couldn't seek to the start of sector 1, part 2\n");
-    close(mmcfd);
+// Writes len bytes of data at offset, a multiple of SECTOR_SIZE, of the
+// device fd. Only the chunks whose content differs are written, the sectors
+// around the end of data keep what they had. What was written is read back
+// and compared once it is on the device.
+//
+// Returns 1 if something was written, 0 if the device already had data, or
+// -1 on failure.
+static int flash_region(int fd, off_t offset, const char* data, size_t len,
+                        const char* what) {
+  char* buf = static_cast<char*>(memalign(FLASH_ALIGNMENT, FLASH_CHUNK_SIZE));
+  if (buf == NULL) {
+    fprintf(stderr, "Out of memory flashing %s\n", what);
     return -1;
   }
 
-  to_write = SECTOR_SIZE;
-  curr = buf;
-  while (to_write > 0) {
-    written = write(mmcfd, curr, to_write);
-    if (written < 0 && errno != EINTR) {
-      fprintf(stderr, "Couldn't overwrite sector 1\n");
-      close(mmcfd);
-      return -1;
+  int changed = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    // the second pass, if anything changed, checks what the device has now
+    if (pass == 1) {
+      if (!changed) {
+        break;
+      }
+      if (fsync(fd) != 0) {
+        fprintf(stderr, "Failed to sync %s: %s\n", what, strerror(errno));
+        free(buf);
+        return -1;
+      }
     }
-    if (written > 0) {
-      to_write -= written;
-      curr += written;
+
+    for (size_t pos = 0; pos < len; pos += FLASH_CHUNK_SIZE) {
+      size_t n = len - pos < FLASH_CHUNK_SIZE ? len - pos : FLASH_CHUNK_SIZE;
+      size_t blocks = (n + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+
+      if (pread_full(fd, buf, blocks, offset + pos) < 0) {
+        fprintf(stderr, "Failed reading %s at %zu: %s\n", what, pos, strerror(errno));
+        free(buf);
+        return -1;
+      }
+      if (memcmp(buf, data + pos, n) == 0) {
+        continue;
+      }
+      if (pass == 1) {
+        fprintf(stderr, "Verification of %s failed at %zu\n", what, pos);
+        free(buf);
+        return -1;
+      }
+
+      memcpy(buf, data + pos, n);
+      if (pwrite_full(fd, buf, blocks, offset + pos) < 0) {
+        fprintf(stderr, "Failed writing %s at %zu: %s\n", what, pos, strerror(errno));
+        free(buf);
+        return -1;
+      }
+      changed = 1;
     }
   }
 
+  free(buf);
+  if (!changed) {
+    fprintf(stderr, "%s is up to date, not written\n", what);
+  }
+  return changed;
+}
+
+int write_pit_partition_table(const char* image_data,
+                              size_t image_size __unused) {
+  int mmcfd = open_flash(MMC_LOCATION);
+  if (mmcfd < 0) {
+    return -1;
+  }
+
   // modify the pit partition info to reflect userdata size
   // before writing the pit partition table
   char pit_partition_copy[PIT_PARTITION_TABLE_SIZE];
@@ -238,26 +308,19 @@ int write_pit_partition_table(const char* image_data,
     return -1;
   }
 
-  // copy the modified pit partition table data to the correct location
-  if (lseek(mmcfd, PIT_PARTITION_TABLE_LOCATION, SEEK_SET) < 0) {
-    fprintf(stderr, "Couldn't seek to the pit partition table location\n");
+  // zero out gpt magic field
+  static const char zero_magic[8] = { 0 };
+  if (flash_region(mmcfd, SECTOR_SIZE, zero_magic, sizeof(zero_magic),
+                   "gpt magic") < 0) {
     close(mmcfd);
     return -1;
   }
 
-  to_write = PIT_PARTITION_TABLE_SIZE;
-  curr = pit_partition_copy;
-  while (to_write > 0) {
-    written = write(mmcfd, curr, to_write);
-    if (written < 0 && errno != EINTR) {
-      fprintf(stderr, "Failed writing pit partition table\n");
-      close(mmcfd);
-      return -1;
-    }
-    if (written > 0) {
-      to_write -= written;
-      curr += written;
-    }
+  // copy the modified pit partition table data to the correct location
+  if (flash_region(mmcfd, PIT_PARTITION_TABLE_LOCATION, pit_partition_copy,
+                   PIT_PARTITION_TABLE_SIZE, "pit partition table") < 0) {
+    close(mmcfd);
+    return -1;
   }
 
   if (close(mmcfd) != 0) {
@@ -280,16 +343,16 @@ int write_xloader(const char* image_data,
   // The offsets into xloader part of the bootloader image
   xloader_offset += PIT_PARTITION_TABLE_SIZE;
 
-  FILE* xloader = fopen(xloader_loc, "r+b");
-  if (xloader == NULL) {
-    fprintf(stderr, "Could not open %s\n", xloader_loc);
+  int xloader = open_flash(xloader_loc);
+  if (xloader < 0) {
     return -1;
   }
 
   // index into the correct xloader offset
-  int written = fwrite(image_data+xloader_offset, 1, BOOT_PART_LEN, xloader);
-  int close_status = fclose(xloader);
-  if (written != BOOT_PART_LEN || close_status != 0) {
+  int written = flash_region(xloader, 0, image_data + xloader_offset,
+                             BOOT_PART_LEN, "xloader");
+  int close_status = close(xloader);
+  if (written < 0 || close_status != 0) {
     fprintf(stderr, "Failed writing to /xloader\n");
     return -1;
   }
@@ -301,15 +364,14 @@ int write_sbl(const char* image_data,
               size_t image_size,
               const char* sbl_loc) {
   int sbl_size = image_size - SBL_OFFSET;
-  FILE* sbl = fopen(sbl_loc, "r+b");
-  if (sbl == NULL) {
-    fprintf(stderr, "Could not open %s\n", sbl_loc);
+  int sbl = open_flash(sbl_loc);
+  if (sbl < 0) {
     return -1;
   }
 
-  int written = fwrite(image_data+SBL_OFFSET, 1, sbl_size, sbl);
-  int close_status = fclose(sbl);
-  if (written != sbl_size || close_status != 0) {
+  int written = flash_region(sbl, 0, image_data + SBL_OFFSET, sbl_size, "sbl");
+  int close_status = close(sbl);
+  if (written < 0 || close_status != 0) {
     fprintf(stderr, "Failed writing to /sbl\n");
     return -1;
   }
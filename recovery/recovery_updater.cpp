@@ -27,6 +27,8 @@
 
 #include "error_code.h"
 #include "edify/expr.h"
+#include "minzip/Zip.h"
+#include "updater/updater.h"
 #include "recovery_updater.h"
 #include "bootloader.h"
 #include "update_cdma_modem.h"
@@ -59,12 +61,63 @@ int read_whole_file(const char* fname,
 }
 
 
+/*
+ * Gets the image an updater function was given, a blob or the name of an
+ * entry of the package. An entry stored without compression is used where the
+ * package is mapped, the others get inflated into *inflated, to be freed by
+ * the caller.
+ */
+static int get_image(const char* name, State* state, Value* img,
+                     const char** image_data, size_t* image_size,
+                     unsigned char** inflated)
+{
+    *inflated = NULL;
+    if (img->type == VAL_BLOB) {
+        *image_data = img->data;
+        *image_size = img->size;
+        return 0;
+    }
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    const ZipEntry* entry = mzFindZipEntry(ui->package_zip, img->data);
+    if (entry == NULL) {
+        fprintf(stderr, "%s: no %s in package\n", name, img->data);
+        return -1;
+    }
+
+    *image_size = mzGetZipEntryUncompLen(entry);
+    if (entry->compression == STORED) {
+        *image_data = (const char*)ui->package_zip_addr + mzGetZipEntryOffset(entry);
+        return 0;
+    }
+
+    *inflated = (unsigned char*)malloc(*image_size);
+    if (*inflated == NULL || !mzExtractZipEntryToBuffer(ui->package_zip, entry, *inflated)) {
+        fprintf(stderr, "%s: can't extract %s\n", name, img->data);
+        return -1;
+    }
+    *image_data = (const char*)*inflated;
+    return 0;
+}
+
+// Moves the progress bar within the part the script gave to the step.
+static void set_progress(void* cookie, float fraction)
+{
+    State* state = (State*)cookie;
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    fprintf(ui->cmd_pipe, "set_progress %f\n", fraction);
+    fflush(ui->cmd_pipe);
+}
+
 Value* WriteBootloaderFn(const char* name, State* state, int argc, Expr* argv[])
 {
     int result = -1;
     Value* img;
     Value* xloader_loc;
     Value* sbl_loc;
+    const char* image_data;
+    size_t image_size;
+    unsigned char* inflated;
 
     if (argc != 3) {
         return ErrorAbort(state, kArgsParsingFailure, "%s() expects 3 args, got %d", name, argc);
@@ -74,7 +127,7 @@ Value* WriteBootloaderFn(const char* name, State* state, int argc, Expr* argv[])
         return NULL;
     }
 
-    if(img->type != VAL_BLOB ||
+    if((img->type != VAL_BLOB && img->type != VAL_STRING) ||
        xloader_loc->type != VAL_STRING ||
        sbl_loc->type != VAL_STRING) {
       FreeValue(img);
@@ -83,8 +136,11 @@ Value* WriteBootloaderFn(const char* name, State* state, int argc, Expr* argv[])
       return ErrorAbort(state, kArgsParsingFailure, "%s(): argument types are incorrect", name);
     }
 
-    result = update_bootloader(img->data, img->size,
-                               xloader_loc->data, sbl_loc->data);
+    if (get_image(name, state, img, &image_data, &image_size, &inflated) == 0) {
+        result = update_bootloader(image_data, image_size,
+                                   xloader_loc->data, sbl_loc->data);
+    }
+    free(inflated);
     FreeValue(img);
     FreeValue(xloader_loc);
     FreeValue(sbl_loc);
@@ -95,6 +151,9 @@ Value* UpdateCdmaModemFn(const char* name, State* state, int argc, Expr* argv[])
 {
     int result = -1;
     Value* img;
+    const char* image_data;
+    size_t image_size;
+    unsigned char* inflated;
 
     if (argc != 1) {
         return ErrorAbort(state, kArgsParsingFailure, "%s() expects 1 arg, got %d", name, argc);
@@ -104,12 +163,15 @@ Value* UpdateCdmaModemFn(const char* name, State* state, int argc, Expr* argv[])
         return NULL;
     }
 
-    if(img->type != VAL_BLOB) {
+    if(img->type != VAL_BLOB && img->type != VAL_STRING) {
       FreeValue(img);
       return ErrorAbort(state, kArgsParsingFailure, "%s(): argument types are incorrect", name);
     }
 
-    result = update_cdma_modem(img->data, img->size);
+    if (get_image(name, state, img, &image_data, &image_size, &inflated) == 0) {
+        result = update_cdma_modem(image_data, image_size, set_progress, state);
+    }
+    free(inflated);
     FreeValue(img);
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
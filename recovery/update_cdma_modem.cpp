@@ -71,10 +71,12 @@ static int modem_download_ioctl(int sel)
   return modem_download_ioctl_fw(sel, NULL);
 }
 
-int update_cdma_modem(const char* image_data, size_t image_size) {
+int update_cdma_modem(const char* image_data, size_t image_size,
+                      modem_progress_fn progress, void* cookie) {
   int ret;
   struct dpram_firmware fw;
 
+  progress(cookie, 0.0f);
   ret = modem_download_ioctl(IOCTL_MODEM_GOTA_START);
   if (ret < 0) {
     fprintf(stderr, "IOCTL_MODEM_GOTA_START failed: (%d)\n", ret);
@@ -86,6 +88,7 @@ int update_cdma_modem(const char* image_data, size_t image_size) {
     fprintf(stderr, "IOCTL_MODEM_BOOT_ON failed: (%d)\n", ret);
     return -1;
   }
+  progress(cookie, 0.1f);
 
   fw.firmware = image_data;
   fw.size = image_size;
@@ -96,6 +99,7 @@ int update_cdma_modem(const char* image_data, size_t image_size) {
     fprintf(stderr, "IOCTL_MODEM_FW_UPDATE failed: (%d)\n", ret);
     return -1;
   }
+  progress(cookie, 0.9f);
 
   ret = modem_download_ioctl(IOCTL_MODEM_BOOT_OFF);
   if (ret < 0) {
@@ -103,6 +107,7 @@ int update_cdma_modem(const char* image_data, size_t image_size) {
     return -1;
   }
 
+  progress(cookie, 1.0f);
   printf("Firmware update was successful\n");
 
   return 0;
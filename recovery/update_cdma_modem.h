@@ -17,6 +17,10 @@
 #ifndef __UPDATE_CDMA_MODEM_H__
 #define __UPDATE_CDMA_MODEM_H__
 
-int update_cdma_modem(const char* image_data, size_t image_size);
+// Called with the fraction of the update done, from 0 to 1.
+typedef void (*modem_progress_fn)(void* cookie, float fraction);
+
+int update_cdma_modem(const char* image_data, size_t image_size,
+                      modem_progress_fn progress, void* cookie);
 
 #endif
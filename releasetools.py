@@ -16,6 +16,7 @@
 (installing the bootloader and radio images)."""
 
 import common
+import zipfile
 
 def FullOTA_InstallEnd(info):
   try:
@@ -110,12 +111,14 @@ def FsSizeFix(info):
   info.script.AppendExtra('''assert(samsung.fs_size_fix());''')
 
 def WriteBootloader(info, bootloader_img):
-  common.ZipWriteStr(info.output_zip, "bootloader.img", bootloader_img)
+  # stored, so that the updater flashes it from the mapped package
+  common.ZipWriteStr(info.output_zip, "bootloader.img", bootloader_img,
+                     compress_type=zipfile.ZIP_STORED)
   fstab = info.info_dict["fstab"]
 
   info.script.Print("Writing bootloader...")
   info.script.AppendExtra('''assert(samsung.write_bootloader(
-    package_extract_file("bootloader.img"), "%s", "%s"));''' % \
+    "bootloader.img", "%s", "%s"));''' % \
     (fstab["/xloader"].device, fstab["/sbl"].device))
 
 def WriteRadio(info, target_radio_img, source_radio_img=None):
@@ -148,10 +151,13 @@ def WriteRadio(info, target_radio_img, source_radio_img=None):
             "-", tf.size, tf.sha1, sf.sha1, "radio.img.p")
 
 def WriteRadioCdma(info, radio_cdma_img):
-  common.ZipWriteStr(info.output_zip, "radio-cdma.img", radio_cdma_img)
+  # stored, so that the updater hands the modem the mapped package
+  common.ZipWriteStr(info.output_zip, "radio-cdma.img", radio_cdma_img,
+                     compress_type=zipfile.ZIP_STORED)
   info.script.Print("Writing CDMA radio...")
+  info.script.ShowProgress(0.05, 0)
   info.script.AppendExtra('''assert(samsung.update_cdma_modem(
-    package_extract_file("radio-cdma.img")));''')
+    "radio-cdma.img"));''')
 
 def TunaVariantSetup(info):
   # /system should be mounted when FullOTA_InstallEnd is fired off...
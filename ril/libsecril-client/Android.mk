@@ -8,12 +8,17 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_SRC_FILES:= \
     secril-client.cpp
 
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../../include
+
 LOCAL_SHARED_LIBRARIES := \
     libutils \
-    libbinder \
     libcutils \
     libhardware_legacy
 
 LOCAL_MODULE:= libsecril-client
 
+ifeq ($(TARGET_TUNA_TRACE),true)
+LOCAL_CFLAGS += -DTUNA_TRACE
+endif
+
 include $(BUILD_SHARED_LIBRARY)
@@ -8,7 +8,7 @@
 
 #define LOG_TAG "RILClient"
 
-#include <binder/Parcel.h>
+#include <utils/Errors.h>
 #include <telephony/ril.h>
 #include <cutils/record_stream.h>
 
@@ -19,9 +19,14 @@
 #include <sys/types.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <time.h>
 #include <utils/Log.h>
 #include <pthread.h>
 #include "secril-client.h"
+#include "tuna_trace.h"
 #include <hardware_legacy/power.h> // For wakelock
 
 
@@ -32,12 +37,21 @@ namespace android {
 //---------------------------------------------------------------------------
 // Defines
 //---------------------------------------------------------------------------
-#define DBG 1
+#define DBG 0
 #define MULTI_CLIENT_SOCKET_NAME "Multiclient"
 
 #define MAX_COMMAND_BYTES       (8 * 1024)
 #define REQ_POOL_SIZE           32
-#define TOKEN_POOL_SIZE         32
+#define TOKEN_POOL_SIZE         128
+#define TOKEN_POOL_WORDS        (TOKEN_POOL_SIZE / 32)
+#define TX_QUEUE_SIZE           (2 * MAX_COMMAND_BYTES)
+#define BATCH_POOL_SIZE         8
+#define BATCH_CMD_BYTES         8
+#define RECONNECT_MIN_MS        100
+#define RECONNECT_MAX_MS        5000
+#define TRACE_POOL_SIZE         64      // completed requests kept for the dump
+#define TRACE_SAMPLE            64      // one completion logged out of
+#define SHARED_CLIENT_POOL_SIZE 8       // clients of the shared connection
 
 // Constants for response types
 #define RESPONSE_SOLICITED      0
@@ -56,6 +70,7 @@ namespace android {
 #define REQ_SET_TWO_MIC_CTRL        108
 #define REQ_GET_WB_AMR              109
 #define REQ_SET_LOOPBACK            110
+#define REQ_AUDIO_BATCH             111
 
 // OEM request function ID
 #define OEM_FUNC_SOUND          0x08
@@ -95,10 +110,23 @@ namespace android {
 // Type definitions
 //---------------------------------------------------------------------------
 typedef struct _ReqHistory {
-    int         token;  // token used for request
-    uint32_t    id;     // request ID
+    struct _RilClientPrv *client;   // client which sent it, NULL once closed
+    uint32_t        id;         // request ID
+    RilOnComplete   handler;    // handler registered for the ID when sent
+    int64_t         enqueue_ns; // monotonic time the request was made
+    int64_t         send_ns;    // and handed to the socket or send queue
 } ReqHistory;
 
+typedef struct _ReqTrace {
+    uint32_t        id;         // request ID
+    int32_t         token;
+    int32_t         err;        // RIL error of the response
+    int32_t         len;        // response data length
+    int64_t         enqueue_ns;
+    int64_t         send_ns;
+    int64_t         complete_ns;
+} ReqTrace;
+
 typedef struct _ReqRespHandler {
     uint32_t        id;         // request ID
     RilOnComplete   handler;    // handler function
@@ -109,39 +137,92 @@ typedef struct _UnsolHandler {
     RilOnUnsolicited    handler;    // handler function
 } UnsolHandler;
 
+typedef struct _BatchCmd {
+    uint32_t        id;         // request ID
+    size_t          len;
+    char            data[BATCH_CMD_BYTES];  // OEM request data
+} BatchCmd;
+
+// A record read in place in the RecordStream buffer, laid out as the
+// Parcel rild wrote it: native int32 fields, data padded to 4 bytes.
+typedef struct _RecordReader {
+    const uint8_t   *data;
+    size_t          len;
+    size_t          pos;
+} RecordReader;
+
 typedef struct _RilClientPrv {
     HRilClient      parent;
+    struct _RilClientPrv *conn; // connection used, itself unless shared
+    uint8_t         b_shared;   // client of the shared connection?
+    uint8_t         b_shared_conn;  // the shared connection, without parent
+    struct _RilClientPrv *clients[SHARED_CLIENT_POOL_SIZE]; // its clients
     uint8_t         b_connect;  // connected to server?
     int             sock;       // socket
     int             pipefd[2];
-    fd_set          sock_rfds;  // for read with select()
+    int             epfd;       // reader epoll, watches the socket for room too
     RecordStream    *p_rs;
-    uint32_t        token_pool; // each bit in token_pool used for token.
-                                // so, pool size is 32.
+    uint32_t        token_pool[TOKEN_POOL_WORDS];   // a bit per token in use
     pthread_t       tid_reader; // socket reader thread id
-    ReqHistory      history[TOKEN_POOL_SIZE];       // request history
+    ReqHistory      history[TOKEN_POOL_SIZE];       // request history, by token - 1, under tx_lock
     ReqRespHandler  req_handlers[REQ_POOL_SIZE];    // request response handler list
     UnsolHandler    unsol_handlers[REQ_POOL_SIZE];  // unsolicited response handler list
     RilOnError      err_cb;         // error callback
     void            *err_cb_data;   // error callback data
     uint8_t b_del_handler;
+    pthread_mutex_t tx_lock;    // requests sent and the send queue
+    uint8_t         b_tx_queue; // queue what the socket can't take, don't block
+    size_t          tx_len;     // bytes queued from tx_queue[0]
+    uint8_t         tx_queue[TX_QUEUE_SIZE];
+    uint8_t         b_batch;    // audio requests held until the commit?
+    int             batch_cnt;
+    BatchCmd        batch[BATCH_POOL_SIZE];         // audio batch being built
+    RilOnComplete   batch_cb;       // batch completion callback
+    int             batch_left;     // batch requests still to complete
+    uint8_t         b_auto_reconnect;   // reconnect in the reader thread on EOS?
+    uint8_t         b_reconnect;    // reader thread waiting to reconnect
+    int             replay_cnt;
+    BatchCmd        replay[BATCH_POOL_SIZE];        // audio state sent again on reconnect
+    uint32_t        trace_cnt;      // requests completed, written by the reader
+    ReqTrace        trace[TRACE_POOL_SIZE];         // last requests completed
 } RilClientPrv;
 
 
 //---------------------------------------------------------------------------
 // Local static function prototypes
 //---------------------------------------------------------------------------
+static RilClientPrv * NewClientPrv(HRilClient parent);
+static int ConnectSocket(RilClientPrv *client_prv);
+static int DisconnectSocket(RilClientPrv *client_prv);
+static int ConnectShared(RilClientPrv *client_prv);
+static int DisconnectShared(RilClientPrv *client_prv);
+static void LockShared(RilClientPrv *conn);
+static void UnlockShared(RilClientPrv *conn);
+static void NotifyError(RilClientPrv *conn, int error);
 static void * RxReaderFunc(void *param);
 static int processRxBuffer(RilClientPrv *prv, void *buffer, size_t buflen);
+static status_t RecordReadInt32(RecordReader *r, int32_t *val);
+static const void * RecordReadInplace(RecordReader *r, size_t len);
 static uint32_t AllocateToken(uint32_t *token_pool);
 static void FreeToken(uint32_t *token_pool, uint32_t token);
 static uint8_t IsValidToken(uint32_t *token_pool, uint32_t token);
-static int blockingWrite(int fd, const void *buffer, size_t len);
+static RilOnComplete FindReqHandlerById(RilClientPrv *prv, uint32_t id);
+static int SendFrame(RilClientPrv *prv, struct iovec *iov, int iovcnt);
+static void FlushTxQueue(RilClientPrv *prv);
+static void CloseSocket(RilClientPrv *prv);
 static int RecordReqHistory(RilClientPrv *prv, int token, uint32_t id);
 static void ClearReqHistory(RilClientPrv *prv, int token);
+static void ReleaseToken(RilClientPrv *conn, int token);
 static RilOnComplete FindReqHandler(RilClientPrv *prv, int token, uint32_t *id);
 static RilOnUnsolicited FindUnsolHandler(RilClientPrv *prv, uint32_t id);
 static int SendOemRequestHookRaw(HRilClient client, int req_id, char *data, size_t len);
+static int SendAudioRequest(HRilClient client, uint32_t req_id, char *data, size_t len);
+static BatchCmd * FindBatchCmd(BatchCmd *cmds, int *cnt, uint32_t id, char *data);
+static int SendBatch(RilClientPrv *prv, BatchCmd *batch, int cnt, RilOnComplete handler);
+static int Reconnect(RilClientPrv *prv);
+static void ReplayAudioState(RilClientPrv *prv);
+static int64_t TraceNow(void);
+static void TraceComplete(RilClientPrv *prv, int token, int32_t err, int32_t len);
 static bool isValidSoundType(SoundType type);
 static bool isValidAudioPath(AudioPath path);
 static bool isValidSoundClockCondition(SoundClockCondition condition);
@@ -151,6 +232,12 @@ static bool isValidTwoMicCtrl(TwoMicSolDevice device, TwoMicSolReport report);
 static char ConvertSoundType(SoundType type);
 static char ConvertAudioPath(AudioPath path);
 
+// The shared connection of the process, NULL until a shared client connects.
+// sSharedLock guards its client list and is held by its reader thread while
+// it calls the handlers of the clients, so that none is closed meanwhile.
+static pthread_mutex_t sSharedLock = PTHREAD_MUTEX_INITIALIZER;
+static RilClientPrv *sSharedConn = NULL;
+
 
 /**
  * @fn  int RegisterUnsolicitedHandler(HRilClient client, uint32_t id, RilOnUnsolicited handler)
@@ -306,21 +393,52 @@ HRilClient OpenClient_RILD(void) {
     if (client == NULL)
         return NULL;
 
-    client->prv = (RilClientPrv *)malloc(sizeof(RilClientPrv));
+    client->prv = NewClientPrv(client);
     if (client->prv == NULL) {
         free(client);
         return NULL;
     }
 
-    memset(client->prv, 0, sizeof(RilClientPrv));
+    return client;
+}
+
+
+/**
+ * @fn  HRilClient OpenSharedClient_RILD(void)
+ *
+ * @params  None.
+ *
+ * @return  Client handle, NULL on error.
+ */
+extern "C"
+HRilClient OpenSharedClient_RILD(void) {
+    HRilClient client = OpenClient_RILD();
+    if (client == NULL)
+        return NULL;
 
-    ((RilClientPrv *)(client->prv))->parent = client;
-    ((RilClientPrv *)(client->prv))->sock = -1;
+    ((RilClientPrv *)(client->prv))->b_shared = 1;
 
     return client;
 }
 
 
+static RilClientPrv * NewClientPrv(HRilClient parent) {
+    RilClientPrv *prv = (RilClientPrv *)malloc(sizeof(RilClientPrv));
+    if (prv == NULL)
+        return NULL;
+
+    memset(prv, 0, sizeof(RilClientPrv));
+
+    prv->parent = parent;
+    prv->conn = prv;
+    prv->sock = -1;
+    prv->epfd = -1;
+    pthread_mutex_init(&prv->tx_lock, NULL);
+
+    return prv;
+}
+
+
 /**
  * @fn  int Connect_RILD(void)
  *
@@ -339,6 +457,19 @@ int Connect_RILD(HRilClient client) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
+    if (client_prv->b_shared)
+        return ConnectShared(client_prv);
+
+    return ConnectSocket(client_prv);
+}
+
+
+static int ConnectSocket(RilClientPrv *client_prv) {
+    if (client_prv->b_reconnect) {
+        ALOGE("%s: Reconnecting already.", __FUNCTION__);
+        return RIL_CLIENT_ERR_AGAIN;
+    }
+
     // Open client socket and connect to server.
     client_prv->sock = socket_local_client(MULTI_CLIENT_SOCKET_NAME, ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM );
 
@@ -369,14 +500,38 @@ int Connect_RILD(HRilClient client) {
         return RIL_CLIENT_ERR_IO;
     }
 
+    // The socket and the command pipe stay registered until disconnection.
+    client_prv->epfd = epoll_create(2);
+    if (client_prv->epfd < 0) {
+        close(client_prv->sock);
+        close(client_prv->pipefd[0]);
+        close(client_prv->pipefd[1]);
+        ALOGE("%s: Creating epoll failed. %s(%d)", __FUNCTION__, strerror(errno), errno);
+        return RIL_CLIENT_ERR_IO;
+    }
+
+    {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = client_prv->sock;
+        epoll_ctl(client_prv->epfd, EPOLL_CTL_ADD, client_prv->sock, &ev);
+        ev.data.fd = client_prv->pipefd[0];
+        epoll_ctl(client_prv->epfd, EPOLL_CTL_ADD, client_prv->pipefd[0], &ev);
+    }
+    client_prv->tx_len = 0;
+
     // Start socket read thread.
     if (pthread_create(&(client_prv->tid_reader), NULL, RxReaderFunc, (void *)client_prv) != 0) {
         close(client_prv->sock);
         close(client_prv->pipefd[0]);
         close(client_prv->pipefd[1]);
+        close(client_prv->epfd);
 
-        memset(client_prv, 0, sizeof(RilClientPrv));
         client_prv->sock = -1;
+        client_prv->epfd = -1;
+        client_prv->b_connect = 0;
         ALOGE("%s: Can't create Reader thread. %s(%d)", __FUNCTION__, strerror(errno), errno);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -384,6 +539,60 @@ int Connect_RILD(HRilClient client) {
     return RIL_CLIENT_ERR_SUCCESS;
 }
 
+// Attaches a shared client to the connection of the process, which the
+// first one opens. It outlives its clients, so it always reconnects when
+// RIL deamon closes it; only the clients which asked for it get their audio
+// state sent again.
+static int ConnectShared(RilClientPrv *client_prv) {
+    RilClientPrv *conn;
+    int ret;
+    int i;
+
+    pthread_mutex_lock(&sSharedLock);
+
+    conn = sSharedConn;
+    if (conn == NULL) {
+        conn = NewClientPrv(NULL);
+        if (conn == NULL) {
+            pthread_mutex_unlock(&sSharedLock);
+            return RIL_CLIENT_ERR_RESOURCE;
+        }
+        conn->b_shared_conn = 1;
+
+        ret = ConnectSocket(conn);
+        if (ret != RIL_CLIENT_ERR_SUCCESS) {
+            pthread_mutex_destroy(&conn->tx_lock);
+            free(conn);
+            pthread_mutex_unlock(&sSharedLock);
+            return ret;
+        }
+        sSharedConn = conn;
+    }
+
+    if (client_prv->conn == conn) {
+        pthread_mutex_unlock(&sSharedLock);
+        return RIL_CLIENT_ERR_SUCCESS;
+    }
+
+    for (i = 0; i < SHARED_CLIENT_POOL_SIZE; i++) {
+        if (conn->clients[i] == NULL)
+            break;
+    }
+
+    if (i == SHARED_CLIENT_POOL_SIZE) {
+        pthread_mutex_unlock(&sSharedLock);
+        ALOGE("%s: Too many shared clients.", __FUNCTION__);
+        return RIL_CLIENT_ERR_RESOURCE;
+    }
+
+    conn->clients[i] = client_prv;
+    client_prv->conn = conn;
+
+    pthread_mutex_unlock(&sSharedLock);
+
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
 /**
  * @fn  int isConnected_RILD(HRilClient client)
  *
@@ -393,16 +602,16 @@ int Connect_RILD(HRilClient client) {
  */
 extern "C"
 int isConnected_RILD(HRilClient client) {
-    RilClientPrv *client_prv;
+    RilClientPrv *conn;
 
     if (client == NULL || client->prv == NULL) {
         ALOGE("%s: invalid client %p", __FUNCTION__, client);
         return RIL_CLIENT_ERR_INVAL;
     }
 
-    client_prv = (RilClientPrv *)(client->prv);
+    conn = ((RilClientPrv *)(client->prv))->conn;
 
-    return client_prv->b_connect == 1;
+    return conn->b_connect == 1 || conn->b_reconnect == 1;
 }
 
 /**
@@ -415,7 +624,6 @@ int isConnected_RILD(HRilClient client) {
 extern "C"
 int Disconnect_RILD(HRilClient client) {
     RilClientPrv *client_prv;
-    int ret = 0;
 
     if (client == NULL || client->prv == NULL) {
         ALOGE("%s: invalid client %p", __FUNCTION__, client);
@@ -424,12 +632,22 @@ int Disconnect_RILD(HRilClient client) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock == -1)
+    if (client_prv->b_shared)
+        return DisconnectShared(client_prv);
+
+    return DisconnectSocket(client_prv);
+}
+
+
+static int DisconnectSocket(RilClientPrv *client_prv) {
+    int ret = 0;
+
+    if (client_prv->sock == -1 && !client_prv->b_reconnect)
         return RIL_CLIENT_ERR_SUCCESS;
 
     printf("[*] %s(): sock=%d\n", __FUNCTION__, client_prv->sock);
 
-    if (client_prv->sock > 0) {
+    if (client_prv->sock > 0 || client_prv->b_reconnect) {
         do {
             ret = write(client_prv->pipefd[1], "close", strlen("close"));
         } while (ret < 0 && errno == EINTR);
@@ -443,6 +661,51 @@ int Disconnect_RILD(HRilClient client) {
 }
 
 
+// Detaches a shared client, the last one closes the connection. The
+// responses to its requests still in flight are dropped.
+static int DisconnectShared(RilClientPrv *client_prv) {
+    RilClientPrv *conn;
+    bool last = true;
+    int i;
+
+    pthread_mutex_lock(&sSharedLock);
+
+    conn = client_prv->conn;
+    if (conn == client_prv) {
+        pthread_mutex_unlock(&sSharedLock);
+        return RIL_CLIENT_ERR_SUCCESS;
+    }
+
+    pthread_mutex_lock(&conn->tx_lock);
+    for (i = 0; i < TOKEN_POOL_SIZE; i++) {
+        if (conn->history[i].client == client_prv)
+            conn->history[i].client = NULL;
+    }
+    pthread_mutex_unlock(&conn->tx_lock);
+
+    for (i = 0; i < SHARED_CLIENT_POOL_SIZE; i++) {
+        if (conn->clients[i] == client_prv)
+            conn->clients[i] = NULL;
+        else if (conn->clients[i] != NULL)
+            last = false;
+    }
+    client_prv->conn = client_prv;
+
+    if (last)
+        sSharedConn = NULL;
+
+    pthread_mutex_unlock(&sSharedLock);
+
+    if (last) {
+        DisconnectSocket(conn);
+        pthread_mutex_destroy(&conn->tx_lock);
+        free(conn);
+    }
+
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+
 /**
  * @fn  int CloseClient_RILD(HRilClient client)
  *
@@ -459,6 +722,7 @@ int CloseClient_RILD(HRilClient client) {
 
     Disconnect_RILD(client);
 
+    pthread_mutex_destroy(&((RilClientPrv *)(client->prv))->tx_lock);
     free(client->prv);
     free(client);
 
@@ -482,7 +746,7 @@ int SetCallVolume(HRilClient client, SoundType type, int vol_level) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 && !client_prv->conn->b_reconnect) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -500,12 +764,7 @@ int SetCallVolume(HRilClient client, SoundType type, int vol_level) {
     data[4] = ConvertSoundType(type);   // volume type
     data[5] = vol_level;    // volume level
 
-    RegisterRequestCompleteHandler(client, REQ_SET_CALL_VOLUME, NULL);
-
-    ret = SendOemRequestHookRaw(client, REQ_SET_CALL_VOLUME, data, sizeof(data));
-    if (ret != RIL_CLIENT_ERR_SUCCESS) {
-        RegisterRequestCompleteHandler(client, REQ_SET_CALL_VOLUME, NULL);
-    }
+    ret = SendAudioRequest(client, REQ_SET_CALL_VOLUME, data, sizeof(data));
 
     return ret;
 }
@@ -527,7 +786,7 @@ int SetCallAudioPath(HRilClient client, AudioPath path) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 && !client_prv->conn->b_reconnect) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -544,12 +803,7 @@ int SetCallAudioPath(HRilClient client, AudioPath path) {
     data[3] = 0x06;     // data length
     data[4] = ConvertAudioPath(path); // audio path
 
-    RegisterRequestCompleteHandler(client, REQ_SET_AUDIO_PATH, NULL);
-
-    ret = SendOemRequestHookRaw(client, REQ_SET_AUDIO_PATH, data, sizeof(data));
-    if (ret != RIL_CLIENT_ERR_SUCCESS) {
-        RegisterRequestCompleteHandler(client, REQ_SET_AUDIO_PATH, NULL);
-    }
+    ret = SendAudioRequest(client, REQ_SET_AUDIO_PATH, data, sizeof(data));
 
     return ret;
 }
@@ -571,7 +825,7 @@ int SetCallClockSync(HRilClient client, SoundClockCondition condition) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 && !client_prv->conn->b_reconnect) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -588,12 +842,7 @@ int SetCallClockSync(HRilClient client, SoundClockCondition condition) {
     data[3] = 0x05; // data length
     data[4] = condition;
 
-    RegisterRequestCompleteHandler(client, REQ_SET_CALL_CLOCK_SYNC, NULL);
-
-    ret = SendOemRequestHookRaw(client, REQ_SET_CALL_CLOCK_SYNC, data, sizeof(data));
-    if (ret != RIL_CLIENT_ERR_SUCCESS) {
-        RegisterRequestCompleteHandler(client, REQ_SET_CALL_CLOCK_SYNC, NULL);
-    }
+    ret = SendAudioRequest(client, REQ_SET_CALL_CLOCK_SYNC, data, sizeof(data));
 
     return ret;
 }
@@ -614,7 +863,7 @@ int SetVideoCallClockSync(HRilClient client, SoundClockCondition condition) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 ) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -657,7 +906,7 @@ int SetCallRecord(HRilClient client, CallRecCondition condition) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 ) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -700,7 +949,7 @@ int SetMute(HRilClient client, MuteCondition condition) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 && !client_prv->conn->b_reconnect) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -717,12 +966,7 @@ int SetMute(HRilClient client, MuteCondition condition) {
     data[3] = 0x05; // data length
     data[4] = condition;
 
-    RegisterRequestCompleteHandler(client, REQ_SET_CALL_MUTE, NULL);
-
-    ret = SendOemRequestHookRaw(client, REQ_SET_CALL_MUTE, data, sizeof(data));
-    if (ret != RIL_CLIENT_ERR_SUCCESS) {
-        RegisterRequestCompleteHandler(client, REQ_SET_CALL_MUTE, NULL);
-    }
+    ret = SendAudioRequest(client, REQ_SET_CALL_MUTE, data, sizeof(data));
 
     return ret;
 }
@@ -743,7 +987,7 @@ int GetMute(HRilClient client, RilOnComplete handler) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 ) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -782,7 +1026,7 @@ int GetWB_AMR(HRilClient client, RilOnComplete handler) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 ) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -820,7 +1064,7 @@ int SetTwoMicControl(HRilClient client, TwoMicSolDevice device, TwoMicSolReport
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 && !client_prv->conn->b_reconnect) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -838,12 +1082,7 @@ int SetTwoMicControl(HRilClient client, TwoMicSolDevice device, TwoMicSolReport
     data[4] = device;
     data[5] = report;
 
-    RegisterRequestCompleteHandler(client, REQ_SET_TWO_MIC_CTRL, NULL);
-
-    ret = SendOemRequestHookRaw(client, REQ_SET_TWO_MIC_CTRL, data, sizeof(data));
-    if (ret != RIL_CLIENT_ERR_SUCCESS) {
-        RegisterRequestCompleteHandler(client, REQ_SET_TWO_MIC_CTRL, NULL);
-    }
+    ret = SendAudioRequest(client, REQ_SET_TWO_MIC_CTRL, data, sizeof(data));
 
     ALOGE(" - %s", __FUNCTION__);
 
@@ -866,7 +1105,7 @@ int SetLoopbackTest(HRilClient client, LoopbackMode mode, AudioPath path) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 ) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -911,7 +1150,7 @@ int InvokeOemRequestHookRaw(HRilClient client, char *data, size_t len) {
 
     client_prv = (RilClientPrv *)(client->prv);
 
-    if (client_prv->sock < 0 ) {
+    if (client_prv->conn->sock < 0 ) {
         ALOGE("%s: Not connected.", __FUNCTION__);
         return RIL_CLIENT_ERR_CONNECT;
     }
@@ -920,62 +1159,357 @@ int InvokeOemRequestHookRaw(HRilClient client, char *data, size_t len) {
 }
 
 
+/**
+ * @fn  int SetSendQueue_RILD(HRilClient client, int enable)
+ *
+ * @params  client: Client handle.
+ *          enable: 1 to queue the requests the socket can't take, 0 to block.
+ *
+ * @return  0 for success or error code.
+ */
+extern "C"
+int SetSendQueue_RILD(HRilClient client, int enable) {
+    RilClientPrv *client_prv;
+
+    if (client == NULL || client->prv == NULL) {
+        ALOGE("%s: Invalid client %p", __FUNCTION__, client);
+        return RIL_CLIENT_ERR_INVAL;
+    }
+
+    // The send queue is the one of the connection, shared or not.
+    client_prv = ((RilClientPrv *)(client->prv))->conn;
+
+    pthread_mutex_lock(&client_prv->tx_lock);
+    client_prv->b_tx_queue = enable ? 1 : 0;
+    pthread_mutex_unlock(&client_prv->tx_lock);
+
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+
+/**
+ * @fn  int BeginAudioBatch_RILD(HRilClient client)
+ *
+ * @params  client: Client handle.
+ *
+ * @return  0 for success or error code.
+ */
+extern "C"
+int BeginAudioBatch_RILD(HRilClient client) {
+    RilClientPrv *client_prv;
+
+    if (client == NULL || client->prv == NULL) {
+        ALOGE("%s: Invalid client %p", __FUNCTION__, client);
+        return RIL_CLIENT_ERR_INVAL;
+    }
+
+    client_prv = (RilClientPrv *)(client->prv);
+
+    pthread_mutex_lock(&client_prv->tx_lock);
+    client_prv->b_batch = 1;
+    client_prv->batch_cnt = 0;
+    pthread_mutex_unlock(&client_prv->tx_lock);
+
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+
+/**
+ * @fn  int CommitAudioBatch_RILD(HRilClient client, RilOnComplete handler)
+ *
+ * @params  client: Client handle.
+ *          handler: Called once when every request of the batch completed.
+ *
+ * @return  0 for success or error code.
+ */
+extern "C"
+int CommitAudioBatch_RILD(HRilClient client, RilOnComplete handler) {
+    RilClientPrv *client_prv;
+    BatchCmd batch[BATCH_POOL_SIZE];
+    int cnt;
+
+    if (client == NULL || client->prv == NULL) {
+        ALOGE("%s: Invalid client %p", __FUNCTION__, client);
+        return RIL_CLIENT_ERR_INVAL;
+    }
+
+    client_prv = (RilClientPrv *)(client->prv);
+
+    pthread_mutex_lock(&client_prv->tx_lock);
+    cnt = client_prv->b_batch ? client_prv->batch_cnt : 0;
+    memcpy(batch, client_prv->batch, cnt * sizeof(BatchCmd));
+    client_prv->b_batch = 0;
+    client_prv->batch_cnt = 0;
+    pthread_mutex_unlock(&client_prv->tx_lock);
+
+    // The state replayed after the reconnection has the batch already.
+    if (cnt == 0 || client_prv->conn->b_reconnect)
+        return RIL_CLIENT_ERR_SUCCESS;
+
+    if (client_prv->conn->sock < 0 ) {
+        ALOGE("%s: Not connected.", __FUNCTION__);
+        return RIL_CLIENT_ERR_CONNECT;
+    }
+
+    return SendBatch(client_prv, batch, cnt, handler);
+}
+
+
+/**
+ * @fn  int SetAutoReconnect_RILD(HRilClient client, int enable)
+ *
+ * @params  client: Client handle.
+ *          enable: 1 to reconnect and replay the audio state on EOS.
+ *
+ * @return  0 for success or error code.
+ */
+extern "C"
+int SetAutoReconnect_RILD(HRilClient client, int enable) {
+    RilClientPrv *client_prv;
+
+    if (client == NULL || client->prv == NULL) {
+        ALOGE("%s: Invalid client %p", __FUNCTION__, client);
+        return RIL_CLIENT_ERR_INVAL;
+    }
+
+    client_prv = (RilClientPrv *)(client->prv);
+    client_prv->b_auto_reconnect = enable ? 1 : 0;
+
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+
+/**
+ * @fn  int DumpTrace_RILD(HRilClient client, int fd)
+ *
+ * @params  client: Client handle.
+ *          fd: File to write the trace of the last requests completed to.
+ *
+ * @return  0 for success or error code.
+ */
+extern "C"
+int DumpTrace_RILD(HRilClient client, int fd) {
+    RilClientPrv *client_prv;
+    uint32_t cnt;
+    uint32_t i;
+
+    if (client == NULL || client->prv == NULL) {
+        ALOGE("%s: Invalid client %p", __FUNCTION__, client);
+        return RIL_CLIENT_ERR_INVAL;
+    }
+
+    client_prv = (RilClientPrv *)(client->prv);
+
+    // No lock is taken: the trace is only informative.
+    cnt = client_prv->trace_cnt;
+    dprintf(fd, "  RIL requests completed: %u, last %u:\n", cnt,
+            cnt < TRACE_POOL_SIZE ? cnt : TRACE_POOL_SIZE);
+    for (i = cnt < TRACE_POOL_SIZE ? 0 : cnt - TRACE_POOL_SIZE; i < cnt; i++) {
+        const ReqTrace *t = &client_prv->trace[i % TRACE_POOL_SIZE];
+
+        dprintf(fd, "    id %u token %d: sent %lld us, completed %lld us, err %d, %d bytes\n",
+                t->id, t->token, (long long)(t->send_ns - t->enqueue_ns) / 1000,
+                (long long)(t->complete_ns - t->enqueue_ns) / 1000, t->err, t->len);
+    }
+
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+
+static int SendBatch(RilClientPrv *prv, BatchCmd *batch, int cnt, RilOnComplete handler) {
+    static const uint8_t pad[4] = { 0, };
+    RilClientPrv *conn = prv->conn;
+    uint32_t frame[BATCH_POOL_SIZE][4];
+    int token[BATCH_POOL_SIZE];
+    struct iovec iov[BATCH_POOL_SIZE * 3];
+    int ret;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        size_t padded = (batch[i].len + 3) & ~3;
+
+        pthread_mutex_lock(&conn->tx_lock);
+        token[i] = AllocateToken(conn->token_pool);
+        if (token[i] == 0) {
+            pthread_mutex_unlock(&conn->tx_lock);
+            ALOGE("%s: No token.", __FUNCTION__);
+            cnt = i;
+            ret = RIL_CLIENT_ERR_AGAIN;
+            goto error;
+        }
+
+        // The requests of the batch all complete through its handler.
+        conn->history[token[i] - 1].client = prv;
+        conn->history[token[i] - 1].id = REQ_AUDIO_BATCH;
+        conn->history[token[i] - 1].handler = handler;
+        conn->history[token[i] - 1].enqueue_ns = TraceNow();
+        conn->history[token[i] - 1].send_ns = 0;
+        pthread_mutex_unlock(&conn->tx_lock);
+
+        frame[i][1] = RIL_REQUEST_OEM_HOOK_RAW;
+        frame[i][2] = token[i];
+        frame[i][3] = batch[i].len;
+        frame[i][0] = htonl(sizeof(frame[i]) - sizeof(frame[i][0]) + padded);
+
+        iov[i * 3].iov_base = frame[i];
+        iov[i * 3].iov_len = sizeof(frame[i]);
+        iov[i * 3 + 1].iov_base = batch[i].data;
+        iov[i * 3 + 1].iov_len = batch[i].len;
+        iov[i * 3 + 2].iov_base = (void *)pad;
+        iov[i * 3 + 2].iov_len = padded - batch[i].len;
+    }
+
+    __sync_fetch_and_add(&prv->batch_left, cnt);
+    prv->batch_cb = handler;
+
+    // DO TX: the requests pipelined in one write.
+    ret = SendFrame(conn, iov, cnt * 3);
+    if (ret == RIL_CLIENT_ERR_SUCCESS) {
+        int64_t now = TraceNow();
+
+        for (i = 0; i < cnt; i++)
+            conn->history[token[i] - 1].send_ns = now;
+        return RIL_CLIENT_ERR_SUCCESS;
+    }
+
+    ALOGE("%s: send batch failed. (%d)", __FUNCTION__, ret);
+    __sync_fetch_and_sub(&prv->batch_left, cnt);
+
+error:
+    for (i = 0; i < cnt; i++)
+        ReleaseToken(conn, token[i]);
+
+    return ret;
+}
+
+
 static int SendOemRequestHookRaw(HRilClient client, int req_id, char *data, size_t len) {
+    static const uint8_t pad[4] = { 0, };
     int token = 0;
     int ret = 0;
-    uint32_t header = 0;
-    android::Parcel p;
+    uint32_t frame[4];
+    size_t padded = (len + 3) & ~3;
+    struct iovec iov[3];
     RilClientPrv *client_prv;
-    int maxfd = -1;
+    RilClientPrv *conn;
 
     client_prv = (RilClientPrv *)(client->prv);
+    conn = client_prv->conn;
 
-    // Allocate a token.
-    token = AllocateToken(&(client_prv->token_pool));
+    if (sizeof(frame) + padded > MAX_COMMAND_BYTES) {
+        ALOGE("%s: Request too long (%zu)", __FUNCTION__, len);
+        return RIL_CLIENT_ERR_INVAL;
+    }
+
+    // Allocate a token, and record it for the request sent.
+    pthread_mutex_lock(&conn->tx_lock);
+    token = AllocateToken(conn->token_pool);
     if (token == 0) {
+        pthread_mutex_unlock(&conn->tx_lock);
         ALOGE("%s: No token.", __FUNCTION__);
         return RIL_CLIENT_ERR_AGAIN;
     }
 
-    // Record token for the request sent.
-    if (RecordReqHistory(client_prv, token, req_id) != RIL_CLIENT_ERR_SUCCESS) {
+    ret = RecordReqHistory(client_prv, token, req_id);
+    pthread_mutex_unlock(&conn->tx_lock);
+    if (ret != RIL_CLIENT_ERR_SUCCESS) {
         goto error;
     }
 
-    // Make OEM request data.
-    p.writeInt32(RIL_REQUEST_OEM_HOOK_RAW);
-    p.writeInt32(token);
-    p.writeInt32(len);
-    p.write((void *)data, len);
+    // Make OEM request data: the parcel of RIL_REQUEST_OEM_HOOK_RAW, built
+    // in place behind its size header, the data padded as Parcel::write does.
+    frame[1] = RIL_REQUEST_OEM_HOOK_RAW;
+    frame[2] = token;
+    frame[3] = len;
+    frame[0] = htonl(sizeof(frame) - sizeof(frame[0]) + padded);
 
-    // DO TX: header(size).
-    header = htonl(p.dataSize());
+    iov[0].iov_base = frame;
+    iov[0].iov_len = sizeof(frame);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (void *)pad;
+    iov[2].iov_len = padded - len;
 
     if (DBG) ALOGD("%s(): token = %d\n", __FUNCTION__, token);
 
-    ret = blockingWrite(client_prv->sock, (void *)&header, sizeof(header));
-    if (ret < 0) {
-        ALOGE("%s: send request header failed. (%d)", __FUNCTION__, ret);
-        goto error;
+    // DO TX: header(size) and request data together.
+    ret = SendFrame(conn, iov, 3);
+    if (ret != RIL_CLIENT_ERR_SUCCESS) {
+        ALOGE("%s: send request failed. (%d)", __FUNCTION__, ret);
+        ReleaseToken(conn, token);
+        return ret;
     }
 
-    // Do TX: response data.
-    ret = blockingWrite(client_prv->sock, p.data(), p.dataSize());
-    if (ret < 0) {
-        ALOGE("%s: send request data failed. (%d)", __FUNCTION__, ret);
-        goto error;
-    }
+    conn->history[token - 1].send_ns = TraceNow();
 
     return RIL_CLIENT_ERR_SUCCESS;
 
 error:
-    FreeToken(&(client_prv->token_pool), token);
-    ClearReqHistory(client_prv, token);
+    ReleaseToken(conn, token);
 
     return RIL_CLIENT_ERR_UNKNOWN;
 }
 
 
+// The slot of an audio request in a batch: the one of the same type, the
+// volume per sound type, or a new one. NULL when the batch is full.
+static BatchCmd * FindBatchCmd(BatchCmd *cmds, int *cnt, uint32_t id, char *data) {
+    int i;
+
+    for (i = 0; i < *cnt; i++) {
+        if (cmds[i].id == id &&
+                (id != REQ_SET_CALL_VOLUME || cmds[i].data[4] == data[4]))
+            return &cmds[i];
+    }
+
+    if (*cnt < BATCH_POOL_SIZE)
+        return &cmds[(*cnt)++];
+
+    return NULL;
+}
+
+
+// Sends an audio request, or holds it in the open batch where it replaces
+// the one of the same type: only the last volume of a sound type, path, mute
+// or two mic setting matters to the modem. The last of each is also kept to
+// be sent again after a reconnection.
+static int SendAudioRequest(HRilClient client, uint32_t req_id, char *data, size_t len) {
+    RilClientPrv *client_prv = (RilClientPrv *)(client->prv);
+    BatchCmd *cmd = NULL;
+
+    if (len > BATCH_CMD_BYTES)
+        return RIL_CLIENT_ERR_INVAL;
+
+    pthread_mutex_lock(&client_prv->tx_lock);
+    cmd = FindBatchCmd(client_prv->replay, &client_prv->replay_cnt, req_id, data);
+    if (cmd) {
+        cmd->id = req_id;
+        cmd->len = len;
+        memcpy(cmd->data, data, len);
+    }
+
+    if (client_prv->b_batch) {
+        cmd = FindBatchCmd(client_prv->batch, &client_prv->batch_cnt, req_id, data);
+        if (cmd) {
+            cmd->id = req_id;
+            cmd->len = len;
+            memcpy(cmd->data, data, len);
+            pthread_mutex_unlock(&client_prv->tx_lock);
+            return RIL_CLIENT_ERR_SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&client_prv->tx_lock);
+
+    // Sent with the state replayed once reconnected.
+    if (client_prv->conn->b_reconnect)
+        return RIL_CLIENT_ERR_SUCCESS;
+
+    RegisterRequestCompleteHandler(client, req_id, NULL);
+
+    return SendOemRequestHookRaw(client, req_id, data, len);
+}
+
+
 static bool isValidSoundType(SoundType type) {
     return (type >= SOUND_TYPE_VOICE && type <= SOUND_TYPE_BTVOICE);
 }
@@ -1042,28 +1576,40 @@ static char ConvertAudioPath(AudioPath path) {
 
 static void * RxReaderFunc(void *param) {
     RilClientPrv *client_prv = (RilClientPrv *)param;
-    int maxfd = 0;
+    struct epoll_event events[2];
     void *p_record = NULL;
     size_t recordlen = 0;
     int ret = 0;
     int n;
+    int i;
 
     if (client_prv == NULL)
         return NULL;
 
-    maxfd = max(client_prv->sock, client_prv->pipefd[0]) + 1;
-
-    printf("[*] %s() b_connect=%d, maxfd=%d\n", __FUNCTION__, client_prv->b_connect, maxfd);
+    if (DBG) ALOGD("[*] %s() b_connect=%d\n", __FUNCTION__, client_prv->b_connect);
     while (client_prv->b_connect) {
-        FD_ZERO(&(client_prv->sock_rfds));
+        n = epoll_wait(client_prv->epfd, events, 2, -1);
+        if (n < 0 && errno != EINTR) {
+            ALOGE("%s: epoll_wait failed. %s(%d)", __FUNCTION__, strerror(errno), errno);
+            break;
+        }
+
+        for (i = 0; i < n && client_prv->b_connect; i++) {
+            if (events[i].data.fd == client_prv->sock) {
+                if (events[i].events & EPOLLOUT) {
+                    // Room for the requests queued.
+                    pthread_mutex_lock(&client_prv->tx_lock);
+                    FlushTxQueue(client_prv);
+                    pthread_mutex_unlock(&client_prv->tx_lock);
+                }
 
-        FD_SET(client_prv->sock, &(client_prv->sock_rfds));
-        FD_SET(client_prv->pipefd[0], &(client_prv->sock_rfds));
+                if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    continue;
 
-        if (DBG) ALOGD("[*] %s() b_connect=%d\n", __FUNCTION__, client_prv->b_connect);
-        if (select(maxfd, &(client_prv->sock_rfds), NULL, NULL, NULL) > 0) {
-            if (FD_ISSET(client_prv->sock, &(client_prv->sock_rfds))) {
-                // Read incoming data
+                // Read every record available, processed under one wakelock.
+                acquire_wake_lock(PARTIAL_WAKE_LOCK, RIL_CLIENT_WAKE_LOCK);
+                TUNA_TRACE_BEGIN("RxReaderFunc");
+                LockShared(client_prv);
                 for (;;) {
                     // loop until EAGAIN/EINTR, end of stream, or other error
                     ret = record_stream_get_next(client_prv->p_rs, &p_record, &recordlen);
@@ -1074,70 +1620,77 @@ static void * RxReaderFunc(void *param) {
                         break;
                     }
                     else if (ret == 0) {    // && p_record != NULL
-                        n = processRxBuffer(client_prv, p_record, recordlen);
-                        if (n != RIL_CLIENT_ERR_SUCCESS) {
-                            ALOGE("%s: processRXBuffer returns %d", __FUNCTION__, n);
+                        int err = processRxBuffer(client_prv, p_record, recordlen);
+                        if (err != RIL_CLIENT_ERR_SUCCESS) {
+                            ALOGE("%s: processRXBuffer returns %d", __FUNCTION__, err);
                         }
                     }
-                    else {
-                        printf("[*] %s()\n", __FUNCTION__);
-                    }
                 }
+                UnlockShared(client_prv);
+                TUNA_TRACE_END();
+                release_wake_lock(RIL_CLIENT_WAKE_LOCK);
 
                 if (ret == 0 || !(errno == EAGAIN || errno == EINTR)) {
                     // fatal error or end-of-stream
-                    if (client_prv->sock > 0) {
-                        close(client_prv->sock);
-                        client_prv->sock = -1;
-                        client_prv->b_connect = 0;
+                    if (client_prv->b_auto_reconnect || client_prv->b_shared_conn) {
+                        LockShared(client_prv);
+                        NotifyError(client_prv, RIL_CLIENT_ERR_CONNECT);
+                        UnlockShared(client_prv);
+
+                        if (Reconnect(client_prv) == RIL_CLIENT_ERR_SUCCESS)
+                            break;
+
+                        // Disconnected meanwhile.
+                        CloseSocket(client_prv);
+                        close(client_prv->pipefd[0]);
+                        close(client_prv->pipefd[1]);
+                        return NULL;
                     }
 
+                    CloseSocket(client_prv);
+
                     if (client_prv->p_rs)
                         record_stream_free(client_prv->p_rs);
 
                     // EOS
-                    if (client_prv->err_cb) {
-                        client_prv->err_cb(client_prv->err_cb_data, RIL_CLIENT_ERR_CONNECT);
-                        return NULL;
-                    }
+                    NotifyError(client_prv, RIL_CLIENT_ERR_CONNECT);
 
-                    break;
+                    return NULL;
                 }
             }
-            if (FD_ISSET(client_prv->pipefd[0], &(client_prv->sock_rfds))) {
+            else if (events[i].data.fd == client_prv->pipefd[0]) {
                 char end_cmd[10];
 
                 if (DBG) ALOGD("%s(): close\n", __FUNCTION__);
 
                 if (read(client_prv->pipefd[0], end_cmd, sizeof(end_cmd)) > 0) {
-                    close(client_prv->sock);
+                    CloseSocket(client_prv);
                     close(client_prv->pipefd[0]);
                     close(client_prv->pipefd[1]);
-
-                    client_prv->sock = -1;
-                    client_prv->b_connect = 0;
+                    return NULL;
                 }
             }
         }
     }
 
+    CloseSocket(client_prv);
     return NULL;
 }
 
 
-static int processUnsolicited(RilClientPrv *prv, Parcel &p) {
+static int processUnsolicited(RilClientPrv *prv, RecordReader *r) {
     int32_t resp_id, len;
     status_t status;
     const void *data = NULL;
     RilOnUnsolicited unsol_func = NULL;
 
-    status = p.readInt32(&resp_id);
+    status = RecordReadInt32(r, &resp_id);
     if (status != NO_ERROR) {
         ALOGE("%s: read resp_id failed.", __FUNCTION__);
         return RIL_CLIENT_ERR_IO;
     }
 
-    status = p.readInt32(&len);
+    status = RecordReadInt32(r, &len);
     if (status != NO_ERROR) {
         //ALOGE("%s: read length failed. assume zero length.", __FUNCTION__);
         len = 0;
@@ -1146,9 +1699,23 @@ static int processUnsolicited(RilClientPrv *prv, Parcel &p) {
     ALOGD("%s(): resp_id (%d), len(%d)\n", __FUNCTION__, resp_id, len);
 
     if (len)
-        data = p.readInplace(len);
+        data = RecordReadInplace(r, len);
+
+    // Find unsolicited response handler, of every client of a shared
+    // connection.
+    if (prv->b_shared_conn) {
+        for (int i = 0; i < SHARED_CLIENT_POOL_SIZE; i++) {
+            RilClientPrv *client = prv->clients[i];
+
+            if (client == NULL)
+                continue;
+            unsol_func = FindUnsolHandler(client, (uint32_t)resp_id);
+            if (unsol_func)
+                unsol_func(client->parent, data, len);
+        }
+        return RIL_CLIENT_ERR_SUCCESS;
+    }
 
-    // Find unsolicited response handler.
     unsol_func = FindUnsolHandler(prv, (uint32_t)resp_id);
     if (unsol_func) {
         unsol_func(prv->parent, data, len);
@@ -1158,28 +1725,37 @@ static int processUnsolicited(RilClientPrv *prv, Parcel &p) {
 }
 
 
-static int processSolicited(RilClientPrv *prv, Parcel &p) {
-    int32_t token, err, len;
+static int processSolicited(RilClientPrv *prv, RecordReader *r) {
+    int32_t token, err = 0, len = 0;
     status_t status;
     const void *data = NULL;
+    RilClientPrv *client;
     RilOnComplete req_func = NULL;
     int ret = RIL_CLIENT_ERR_SUCCESS;
     uint32_t req_id = 0;
+    bool b_batch, b_pending;
 
     if (DBG) ALOGD("%s()", __FUNCTION__);
 
-    status = p.readInt32(&token);
+    status = RecordReadInt32(r, &token);
     if (status != NO_ERROR) {
         ALOGE("%s: Read token fail. Status %d\n", __FUNCTION__, status);
         return RIL_CLIENT_ERR_IO;
     }
 
-    if (IsValidToken(&(prv->token_pool), token) == 0) {
+    if (IsValidToken(prv->token_pool, token) == 0) {
         ALOGE("%s: Invalid Token", __FUNCTION__);
         return RIL_CLIENT_ERR_INVAL;    // Invalid token.
     }
 
-    status = p.readInt32(&err);
+    // The client which sent the request, NULL if it was closed meanwhile.
+    client = prv->history[token - 1].client;
+
+    // A batch request only completes the batch with the last one.
+    b_batch = prv->history[token - 1].id == REQ_AUDIO_BATCH;
+    b_pending = b_batch && client && __sync_sub_and_fetch(&client->batch_left, 1) != 0;
+
+    status = RecordReadInt32(r, &err);
     if (status != NO_ERROR) {
         ALOGE("%s: Read err fail. Status %d\n", __FUNCTION__, status);
         ret = RIL_CLIENT_ERR_IO;
@@ -1189,57 +1765,85 @@ static int processSolicited(RilClientPrv *prv, Parcel &p) {
     // Don't go further for error response.
     if (err != RIL_CLIENT_ERR_SUCCESS) {
         ALOGE("%s: Error %d\n", __FUNCTION__, err);
-        if (prv->err_cb)
-            prv->err_cb(prv->err_cb_data, err);
+        if (client && client->err_cb)
+            client->err_cb(client->err_cb_data, err);
         ret = RIL_CLIENT_ERR_SUCCESS;
         goto error;
     }
 
-    status = p.readInt32(&len);
+    status = RecordReadInt32(r, &len);
     if (status != NO_ERROR) {
         /* no length field */
         len = 0;
     }
 
     if (len)
-        data = p.readInplace(len);
+        data = RecordReadInplace(r, len);
 
     // Find request handler for the token.
-    // First, FindReqHandler() searches request history with the token
-    // and finds out a request ID. Then, it search request handler table
-    // with the request ID.
+    // The request history slot of the token holds the request ID and the
+    // handler registered for it when the request was sent.
     req_func = FindReqHandler(prv, token, &req_id);
-    if (req_func)
+    if (client && req_func && !b_pending)
     {
         if (DBG) ALOGD("[*] Call handler");
-        req_func(prv->parent, data, len);
+        req_func(client->parent, data, len);
 
-        if(prv->b_del_handler) {
-         prv->b_del_handler = 0;
-            RegisterRequestCompleteHandler(prv->parent, req_id, NULL);
+        if(client->b_del_handler && !b_batch) {
+         client->b_del_handler = 0;
+            RegisterRequestCompleteHandler(client->parent, req_id, NULL);
         }
     } else {
         if (DBG) ALOGD("%s: No handler for token %d\n", __FUNCTION__, token);
     }
 
 error:
-    FreeToken(&(prv->token_pool), token);
-    ClearReqHistory(prv, token);
+    if (client)
+        TraceComplete(client, token, err, len);
+    ReleaseToken(prv, token);
     return ret;
 }
 
 
+static status_t RecordReadInt32(RecordReader *r, int32_t *val) {
+    if (r->len - r->pos < sizeof(*val))
+        return NOT_ENOUGH_DATA;
+
+    memcpy(val, r->data + r->pos, sizeof(*val));
+    r->pos += sizeof(*val);
+    return NO_ERROR;
+}
+
+
+// Returns the next len bytes of the record, NULL if it is shorter.
+static const void * RecordReadInplace(RecordReader *r, size_t len) {
+    size_t padded = (len + 3) & ~(size_t)3;
+    const void *data;
+
+    if (padded < len || r->len - r->pos < padded)
+        return NULL;
+
+    data = r->data + r->pos;
+    r->pos += padded;
+    return data;
+}
+
+
 static int processRxBuffer(RilClientPrv *prv, void *buffer, size_t buflen) {
-    Parcel p;
+    RecordReader r;
     int32_t response_type;
     status_t status;
     int ret = RIL_CLIENT_ERR_SUCCESS;
 
-    acquire_wake_lock(PARTIAL_WAKE_LOCK, RIL_CLIENT_WAKE_LOCK);
-
-    p.setData((uint8_t *)buffer, buflen);
+    TUNA_TRACE_SCOPE("processRxBuffer");
+    // Called with the RIL_CLIENT_WAKE_LOCK held by RxReaderFunc, and the
+    // sSharedLock for the shared connection. The handlers get the data in
+    // place, valid until the next record is read.
+    r.data = (const uint8_t *)buffer;
+    r.len = buflen;
+    r.pos = 0;
 
-    status = p.readInt32(&response_type);
+    status = RecordReadInt32(&r, &response_type);
     if (DBG) ALOGD("%s: status %d response_type %d", __FUNCTION__, status, response_type);
 
     if (status != NO_ERROR) {
@@ -1249,13 +1853,13 @@ static int processRxBuffer(RilClientPrv *prv, void *buffer, size_t buflen) {
 
     // FOr unsolicited response.
     if (response_type == RESPONSE_UNSOLICITED) {
-        ret = processUnsolicited(prv, p);
+        ret = processUnsolicited(prv, &r);
     }
     // For solicited response.
     else if (response_type == RESPONSE_SOLICITED) {
-        ret = processSolicited(prv, p);
-        if (ret != RIL_CLIENT_ERR_SUCCESS && prv->err_cb) {
-            prv->err_cb(prv->err_cb_data, ret);
+        ret = processSolicited(prv, &r);
+        if (ret != RIL_CLIENT_ERR_SUCCESS) {
+            NotifyError(prv, ret);
         }
     }
     else {
@@ -1263,41 +1867,43 @@ static int processRxBuffer(RilClientPrv *prv, void *buffer, size_t buflen) {
     }
 
 EXIT:
-    release_wake_lock(RIL_CLIENT_WAKE_LOCK);
     return ret;
 }
 
 
+// Tokens are the history slot index + 1, so that 0 stays invalid.
 static uint32_t AllocateToken(uint32_t *token_pool) {
     int i;
 
-    // Token pool is full.
-    if (*token_pool == 0xFFFFFFFF)
-        return 0;
-
-    for (i = 0; i < 32; i++) {
-        uint32_t new_token = 0x00000001 << i;
+    for (i = 0; i < TOKEN_POOL_WORDS; i++) {
+        if (token_pool[i] != 0xFFFFFFFF) {
+            int bit = __builtin_ctz(~token_pool[i]);
 
-        if ((*token_pool & new_token) == 0) {
-            *token_pool |= new_token;
-            return new_token;
+            token_pool[i] |= 0x00000001 << bit;
+            return i * 32 + bit + 1;
         }
     }
 
+    // Token pool is full.
     return 0;
 }
 
 
 static void FreeToken(uint32_t *token_pool, uint32_t token) {
-    *token_pool &= ~token;
+    if (token == 0 || token > TOKEN_POOL_SIZE)
+        return;
+
+    token--;
+    token_pool[token / 32] &= ~(0x00000001 << (token % 32));
 }
 
 
 static uint8_t IsValidToken(uint32_t *token_pool, uint32_t token) {
-    if (token == 0)
+    if (token == 0 || token > TOKEN_POOL_SIZE)
         return 0;
 
-    if ((*token_pool & token) == token)
+    token--;
+    if (token_pool[token / 32] & (0x00000001 << (token % 32)))
         return 1;
     else
         return 0;
@@ -1305,35 +1911,38 @@ static uint8_t IsValidToken(uint32_t *token_pool, uint32_t token) {
 
 
 static int RecordReqHistory(RilClientPrv *prv, int token, uint32_t id) {
-    int i = 0;
-
     if (DBG) ALOGD("[*] %s(): token(%d), ID(%d)\n", __FUNCTION__, token, id);
-    for (i = 0; i < TOKEN_POOL_SIZE; i++) {
-        if (prv->history[i].token == 0) {
-            prv->history[i].token = token;
-            prv->history[i].id = id;
-
-            if (DBG) ALOGD("[*] %s(): token(%d), ID(%d)\n", __FUNCTION__, token, id);
 
-            return RIL_CLIENT_ERR_SUCCESS;
-        }
+    if (token <= 0 || token > TOKEN_POOL_SIZE) {
+        ALOGE("%s: No free record for token %d", __FUNCTION__, token);
+        return RIL_CLIENT_ERR_RESOURCE;
     }
 
-    ALOGE("%s: No free record for token %d", __FUNCTION__, token);
+    // In the history of the connection, with the handler of the client.
+    prv->conn->history[token - 1].client = prv;
+    prv->conn->history[token - 1].id = id;
+    prv->conn->history[token - 1].handler = FindReqHandlerById(prv, id);
+    prv->conn->history[token - 1].enqueue_ns = TraceNow();
+    prv->conn->history[token - 1].send_ns = 0;
 
-    return RIL_CLIENT_ERR_RESOURCE;
+    return RIL_CLIENT_ERR_SUCCESS;
 }
 
 static void ClearReqHistory(RilClientPrv *prv, int token) {
-    int i = 0;
-
     if (DBG) ALOGD("[*] %s(): token(%d)\n", __FUNCTION__, token);
-    for (i = 0; i < TOKEN_POOL_SIZE; i++) {
-        if (prv->history[i].token == token) {
-            memset(&(prv->history[i]), 0, sizeof(ReqHistory));
-            break;
-        }
-    }
+
+    if (token > 0 && token <= TOKEN_POOL_SIZE)
+        memset(&(prv->history[token - 1]), 0, sizeof(ReqHistory));
+}
+
+
+// Frees a token of the connection along with its history, as the clients
+// of a shared connection allocate them from several threads.
+static void ReleaseToken(RilClientPrv *conn, int token) {
+    pthread_mutex_lock(&conn->tx_lock);
+    FreeToken(conn->token_pool, token);
+    ClearReqHistory(conn, token);
+    pthread_mutex_unlock(&conn->tx_lock);
 }
 
 
@@ -1350,58 +1959,327 @@ static RilOnUnsolicited FindUnsolHandler(RilClientPrv *prv, uint32_t id) {
 }
 
 
-static RilOnComplete FindReqHandler(RilClientPrv *prv, int token, uint32_t *id) {
-    int i = 0;
-    int j = 0;
+static RilOnComplete FindReqHandlerById(RilClientPrv *prv, uint32_t id) {
+    int i;
+
+    // Search request handler table, once per request sent.
+    for (i = 0; i < REQ_POOL_SIZE; i++) {
+        if (prv->req_handlers[i].id == id)
+            return prv->req_handlers[i].handler;
+    }
 
+    return NULL;
+}
+
+
+static RilOnComplete FindReqHandler(RilClientPrv *prv, int token, uint32_t *id) {
     if (DBG) ALOGD("[*] %s(): token(%d)\n", __FUNCTION__, token);
 
-    // Search request history.
-    for (i = 0; i < TOKEN_POOL_SIZE; i++) {
-        printf("[*] %s(): history_token(%d)\n", __FUNCTION__, prv->history[i].token);
-        if (prv->history[i].token == token) {
-            // Search request handler with request ID found.
-            for (j = 0; j < REQ_POOL_SIZE; j++) {
-                printf("[*] %s(): token(%d), req_id(%d), history_id(%d)\n", __FUNCTION__, token, prv->history[i].id, prv->history[i].id);
-                if (prv->req_handlers[j].id == prv->history[i].id) {
-              *id = prv->req_handlers[j].id;
-                    return prv->req_handlers[j].handler;
-                }
+    if (token <= 0 || token > TOKEN_POOL_SIZE)
+        return NULL;
+
+    *id = prv->history[token - 1].id;
+    return prv->history[token - 1].handler;
+}
+
+// Writes a whole frame, or nothing of it when it can't be queued. What the
+// socket doesn't take goes to the send queue, flushed by the reader thread
+// once there is room, or the caller waits for the room without the queue.
+static int SendFrame(RilClientPrv *prv, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    ssize_t written;
+    int i;
+    int ret = RIL_CLIENT_ERR_SUCCESS;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    pthread_mutex_lock(&prv->tx_lock);
+
+    if (prv->sock < 0) {
+        ret = RIL_CLIENT_ERR_CONNECT;
+        goto exit;
+    }
+
+    // Keep the order of the requests queued before.
+    if (prv->tx_len && !prv->b_tx_queue) {
+        while (prv->tx_len) {
+            struct pollfd pfd = { prv->sock, POLLOUT, 0 };
+
+            pthread_mutex_unlock(&prv->tx_lock);
+            poll(&pfd, 1, -1);
+            pthread_mutex_lock(&prv->tx_lock);
+            if (prv->sock < 0) {
+                ret = RIL_CLIENT_ERR_CONNECT;
+                goto exit;
             }
+            FlushTxQueue(prv);
         }
     }
 
-    return NULL;
-}
+    if (prv->tx_len + total > TX_QUEUE_SIZE && prv->b_tx_queue) {
+        ret = RIL_CLIENT_ERR_AGAIN;
+        goto exit;
+    }
 
-static int blockingWrite(int fd, const void *buffer, size_t len) {
-    size_t writeOffset = 0;
-    const uint8_t *toWrite;
-    ssize_t written = 0;
+    while (total) {
+        if (prv->tx_len)
+            written = 0;    // behind the queue
+        else
+            written = writev(prv->sock, iov, iovcnt);
 
-    if (buffer == NULL)
-        return -1;
+        if (written < 0 && errno == EINTR)
+            continue;
 
-    toWrite = (const uint8_t *)buffer;
+        if (written < 0 && errno != EAGAIN) {
+            ALOGE("RIL Request: unexpected error on write errno:%d", errno);
+            ret = RIL_CLIENT_ERR_IO;
+            goto exit;
+        }
 
-    while (writeOffset < len) {
-        do
-        {
-            written = write(fd, toWrite + writeOffset, len - writeOffset);
-        } while (written < 0 && errno == EINTR);
+        if (written > 0) {
+            total -= written;
+            while (written && written >= (ssize_t)iov->iov_len) {
+                written -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (written) {
+                iov->iov_base = (uint8_t *)iov->iov_base + written;
+                iov->iov_len -= written;
+            }
+            continue;
+        }
 
-        if (written >= 0) {
-            writeOffset += written;
+        if (prv->b_tx_queue) {
+            struct epoll_event ev;
+
+            // Queue the rest of the frame and have the reader send it.
+            for (i = 0; i < iovcnt; i++) {
+                memcpy(prv->tx_queue + prv->tx_len, iov[i].iov_base, iov[i].iov_len);
+                prv->tx_len += iov[i].iov_len;
+            }
+
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT;
+            ev.data.fd = prv->sock;
+            epoll_ctl(prv->epfd, EPOLL_CTL_MOD, prv->sock, &ev);
+            break;
         }
         else {
-            ALOGE ("RIL Response: unexpected error on write errno:%d", errno);
-            printf("RIL Response: unexpected error on write errno:%d\n", errno);
-            close(fd);
-            return -1;
+            struct pollfd pfd = { prv->sock, POLLOUT, 0 };
+
+            do {
+                i = poll(&pfd, 1, -1);
+            } while (i < 0 && errno == EINTR);
         }
     }
 
-    return 0;
+exit:
+    pthread_mutex_unlock(&prv->tx_lock);
+    return ret;
+}
+
+
+// Sends what the socket takes of the send queue. It must be called with the
+// tx_lock held.
+static void FlushTxQueue(RilClientPrv *prv) {
+    ssize_t written;
+
+    while (prv->tx_len) {
+        written = write(prv->sock, prv->tx_queue, prv->tx_len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            if (errno != EAGAIN) {
+                ALOGE("RIL Request: unexpected error on write errno:%d", errno);
+                prv->tx_len = 0;
+            }
+            break;
+        }
+        prv->tx_len -= written;
+        memmove(prv->tx_queue, prv->tx_queue + written, prv->tx_len);
+    }
+
+    if (!prv->tx_len && prv->epfd >= 0) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = prv->sock;
+        epoll_ctl(prv->epfd, EPOLL_CTL_MOD, prv->sock, &ev);
+    }
+}
+
+
+// Closes the connection from the reader thread, dropping the send queue.
+static void CloseSocket(RilClientPrv *prv) {
+    pthread_mutex_lock(&prv->tx_lock);
+    if (prv->sock > 0)
+        close(prv->sock);
+    close(prv->epfd);
+    prv->sock = -1;
+    prv->epfd = -1;
+    prv->tx_len = 0;
+    prv->b_connect = 0;
+    pthread_mutex_unlock(&prv->tx_lock);
+}
+
+
+// Waits and reconnects the lost socket from the reader thread, backing off
+// up to RECONNECT_MAX_MS between tries, then sends the audio state again,
+// of every client which asked for it on the shared connection.
+// Returns RIL_CLIENT_ERR_CONNECT when disconnected meanwhile.
+static int Reconnect(RilClientPrv *prv) {
+    struct epoll_event ev;
+    int delay = RECONNECT_MIN_MS;
+    int sock;
+    int n;
+
+    pthread_mutex_lock(&prv->tx_lock);
+    prv->b_reconnect = 1;
+    prv->b_connect = 0;
+    if (prv->sock > 0)
+        close(prv->sock);
+    prv->sock = -1;
+    prv->tx_len = 0;
+    // The requests in flight are lost with the connection.
+    memset(prv->token_pool, 0, sizeof(prv->token_pool));
+    memset(prv->history, 0, sizeof(prv->history));
+    pthread_mutex_unlock(&prv->tx_lock);
+
+    if (prv->p_rs) {
+        record_stream_free(prv->p_rs);
+        prv->p_rs = NULL;
+    }
+
+    for (;;) {
+        // Only the command pipe is left in the epoll set.
+        n = epoll_wait(prv->epfd, &ev, 1, delay);
+        if (n > 0) {
+            prv->b_reconnect = 0;
+            return RIL_CLIENT_ERR_CONNECT;
+        }
+        if (n < 0 && errno != EINTR) {
+            ALOGE("%s: epoll_wait failed. %s(%d)", __FUNCTION__, strerror(errno), errno);
+            prv->b_reconnect = 0;
+            return RIL_CLIENT_ERR_CONNECT;
+        }
+
+        sock = socket_local_client(MULTI_CLIENT_SOCKET_NAME, ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM );
+        if (sock >= 0 && fcntl(sock, F_SETFL, O_NONBLOCK) == 0)
+            break;
+        if (sock >= 0)
+            close(sock);
+
+        delay = delay * 2 > RECONNECT_MAX_MS ? RECONNECT_MAX_MS : delay * 2;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    epoll_ctl(prv->epfd, EPOLL_CTL_ADD, sock, &ev);
+
+    pthread_mutex_lock(&prv->tx_lock);
+    prv->p_rs = record_stream_new(sock, MAX_COMMAND_BYTES);
+    prv->sock = sock;
+    prv->b_connect = 1;
+    prv->b_reconnect = 0;
+    pthread_mutex_unlock(&prv->tx_lock);
+
+    if (prv->b_shared_conn) {
+        pthread_mutex_lock(&sSharedLock);
+        for (int i = 0; i < SHARED_CLIENT_POOL_SIZE; i++) {
+            if (prv->clients[i] && prv->clients[i]->b_auto_reconnect)
+                ReplayAudioState(prv->clients[i]);
+            else if (prv->clients[i])
+                prv->clients[i]->batch_left = 0;
+        }
+        pthread_mutex_unlock(&sSharedLock);
+    }
+    else {
+        ReplayAudioState(prv);
+    }
+
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+
+// Sends the last audio state of a client again once reconnected.
+static void ReplayAudioState(RilClientPrv *prv) {
+    BatchCmd replay[BATCH_POOL_SIZE];
+    int replay_cnt;
+
+    pthread_mutex_lock(&prv->tx_lock);
+    prv->batch_left = 0;
+    replay_cnt = prv->replay_cnt;
+    memcpy(replay, prv->replay, replay_cnt * sizeof(BatchCmd));
+    pthread_mutex_unlock(&prv->tx_lock);
+
+    ALOGI("%s: reconnected, replaying %d audio requests", __FUNCTION__, replay_cnt);
+
+    if (replay_cnt)
+        SendBatch(prv, replay, replay_cnt, NULL);
+}
+
+
+static void LockShared(RilClientPrv *conn) {
+    if (conn->b_shared_conn)
+        pthread_mutex_lock(&sSharedLock);
+}
+
+
+static void UnlockShared(RilClientPrv *conn) {
+    if (conn->b_shared_conn)
+        pthread_mutex_unlock(&sSharedLock);
+}
+
+
+// Invokes the error callback of the client, or of every client of the shared
+// connection, with the sSharedLock held then.
+static void NotifyError(RilClientPrv *conn, int error) {
+    if (!conn->b_shared_conn) {
+        if (conn->err_cb)
+            conn->err_cb(conn->err_cb_data, error);
+        return;
+    }
+
+    for (int i = 0; i < SHARED_CLIENT_POOL_SIZE; i++) {
+        RilClientPrv *client = conn->clients[i];
+
+        if (client && client->err_cb)
+            client->err_cb(client->err_cb_data, error);
+    }
+}
+
+
+static int64_t TraceNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// Moves the timing of a request completed to the trace ring of the client
+// which sent it. Only the reader thread calls it, one completion out of
+// TRACE_SAMPLE is logged.
+static void TraceComplete(RilClientPrv *prv, int token, int32_t err, int32_t len) {
+    const ReqHistory *h = &prv->conn->history[token - 1];
+    ReqTrace *t = &prv->trace[prv->trace_cnt % TRACE_POOL_SIZE];
+
+    t->id = h->id;
+    t->token = token;
+    t->err = err;
+    t->len = len;
+    t->enqueue_ns = h->enqueue_ns;
+    t->send_ns = h->send_ns;
+    t->complete_ns = TraceNow();
+
+    if (prv->trace_cnt++ % TRACE_SAMPLE == 0)
+        ALOGD("request %u: sent %lld us, completed %lld us, err %d, %d bytes",
+              t->id, (long long)(t->send_ns - t->enqueue_ns) / 1000,
+              (long long)(t->complete_ns - t->enqueue_ns) / 1000, t->err, t->len);
 }
 
 } // namespace android
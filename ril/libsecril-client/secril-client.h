@@ -56,6 +56,19 @@ typedef int (*RilOnError)(void *data, int error);
  */
 HRilClient OpenClient_RILD(void);
 
+/**
+ * Open RILD multi-client on the connection shared by the process. The shared
+ * clients multiplex their requests over one socket and one reader thread,
+ * opened by the first Connect_RILD and closed by the last Disconnect_RILD,
+ * each with its own handlers, batch and error callback. Unsolicited
+ * responses go to the handlers of every shared client. The connection
+ * always reconnects when RIL deamon closes it, SetAutoReconnect_RILD only
+ * choosing whether the audio state of the client is sent again. The
+ * handlers of shared clients must not connect or disconnect shared clients.
+ * Return is client handle, NULL on error.
+ */
+HRilClient OpenSharedClient_RILD(void);
+
 /**
  * Stop RILD multi-client. If client socket was connected,
  * it will be disconnected.
@@ -69,7 +82,7 @@ int CloseClient_RILD(HRilClient client);
 int Connect_RILD(HRilClient client);
 
 /**
- * check whether RILD is connected
+ * check whether RILD is connected, or being reconnected automatically
  * Returns 0 or 1
  */
 int isConnected_RILD(HRilClient client);
@@ -110,6 +123,47 @@ int RegisterErrorCallback(HRilClient client, RilOnError cb, void *data);
  */
 int InvokeOemRequestHookRaw(HRilClient client, char *data, size_t len);
 
+/**
+ * Queue the requests the socket can't take instead of blocking the caller
+ * until the RIL reads them. Off by default, set for every client of a shared
+ * connection. With the queue on, a request that doesn't fit in it returns
+ * RIL_CLIENT_ERR_AGAIN.
+ * Return is 0 or error code.
+ */
+int SetSendQueue_RILD(HRilClient client, int enable);
+
+/**
+ * Start an audio batch. Until the commit, SetCallVolume, SetCallAudioPath,
+ * SetCallClockSync, SetMute and SetTwoMicControl only record their request, a repeated one
+ * replacing the value recorded before (the volume per sound type).
+ * Return is 0 or error code.
+ */
+int BeginAudioBatch_RILD(HRilClient client);
+
+/**
+ * Send the requests of the audio batch together, in one write. The handler,
+ * if not NULL, is invoked once every request of the batch completed.
+ * Return is 0 or error code. For RIL_CLIENT_ERR_AGAIN caller should retry.
+ */
+int CommitAudioBatch_RILD(HRilClient client, RilOnComplete handler);
+
+/**
+ * Reconnect in the client task when RIL deamon closes the connection, with
+ * a growing delay between the tries, and send the last volume, audio path,
+ * mute, clock sync and two mic settings again once reconnected. Meanwhile
+ * these settings are only recorded. The error callback is still invoked
+ * with RIL_CLIENT_ERR_CONNECT when the connection is lost. Off by default.
+ * Return is 0 or error code.
+ */
+int SetAutoReconnect_RILD(HRilClient client, int enable);
+
+/**
+ * Write the timing of the last requests completed to fd: the time each took
+ * to be sent and to complete, its error and response size.
+ * Return is 0 or error code.
+ */
+int DumpTrace_RILD(HRilClient client, int fd);
+
 /**
  * Sound device types.
  */
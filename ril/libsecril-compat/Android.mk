@@ -17,3 +17,17 @@ LOCAL_CFLAGS := -Wall -Werror
 LOCAL_MODULE := libsecril-compat
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	md5.c \
+	md5_test.c
+
+LOCAL_CFLAGS := -Wall -Werror
+
+LOCAL_MODULE := secril_md5_test
+
+include $(BUILD_EXECUTABLE)
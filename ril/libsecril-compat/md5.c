@@ -38,7 +38,7 @@
 #define B m->counter[1]
 #define C m->counter[2]
 #define D m->counter[3]
-#define X data
+#define X x
 
 void
 MD5_Init (struct md5 *m)
@@ -64,10 +64,28 @@ a = b + cshift(a + OP(b,c,d) + X[k] + (i), s)
 #define DO3(a,b,c,d,k,s,i) DOIT(a,b,c,d,k,s,i,H)
 #define DO4(a,b,c,d,k,s,i) DOIT(a,b,c,d,k,s,i,I)
 
+/*
+ * Little-endian word load that is safe at any alignment: ARMv7 turns the
+ * memcpy into a single ldr, so input blocks need not be copied to m->save.
+ */
+static inline u_int32_t
+load32 (const unsigned char *p)
+{
+  u_int32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
 static inline void
-calc (struct md5 *m, u_int32_t *data)
+calc (struct md5 *m, const unsigned char *block)
 {
   u_int32_t AA, BB, CC, DD;
+  u_int32_t x[16];
+  int i;
+
+  for (i = 0; i < 16; ++i)
+    x[i] = load32(block + 4 * i);
 
   AA = A;
   BB = B;
@@ -188,17 +206,23 @@ MD5_Update (struct md5 *m, const void *v, size_t len)
   if (m->sz[0] < old_sz)
       ++m->sz[1];
   offset = (old_sz / 8)  % 64;
-  while(len > 0){
+  if(offset > 0){
     size_t l = min(len, 64 - offset);
     memcpy(m->save + offset, p, l);
     offset += l;
     p += l;
     len -= l;
-    if(offset == 64){
-      calc(m, m->save32);
-      offset = 0;
-    }
+    if(offset < 64)
+      return;
+    calc(m, m->save);
+  }
+  /* Whole blocks are hashed straight from the caller's buffer */
+  while(len >= 64){
+    calc(m, p);
+    p += 64;
+    len -= 64;
   }
+  memcpy(m->save, p, len);
 }
 
 void
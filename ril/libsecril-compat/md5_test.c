@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Known answer tests of the md5.c of libsecril-compat and, with -b, its
+ * throughput on aligned and unaligned buffers.
+ *
+ *   secril_md5_test [-b] [-n megabytes]
+ *
+ * The digests of the RFC 1321 test suite are checked when hashed in one
+ * MD5_Update(), split in every chunk size up to a few blocks and from every
+ * misalignment of the input. Exits with 1 if any of them is wrong.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "md5.h"
+
+/* chunk sizes tried when splitting an input, spanning a few blocks */
+#define MAX_SPLIT 200
+/* misalignments tried, the word loads are 4 bytes */
+#define MAX_MISALIGN 8
+
+struct md5_vector {
+    const char *input;
+    const char *digest;
+};
+
+/* RFC 1321, appendix A.5 */
+static const struct md5_vector sVectors[] = {
+    { "", "d41d8cd98f00b204e9800998ecf8427e" },
+    { "a", "0cc175b9c0f1b6a831c399e269772661" },
+    { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+    { "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+    { "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+    { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+      "d174ab98d277d9f5a5611c2c9f419d9f" },
+    { "1234567890123456789012345678901234567890"
+      "1234567890123456789012345678901234567890",
+      "57edf4a22be3c955ac49da2e2107b67a" },
+};
+
+/* one million 'a', the usual multi-block vector */
+#define MILLION_A_DIGEST "7707d6ae4e027c70eea2a935c2296f21"
+
+static void to_hex(const unsigned char *digest, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[32] = '\0';
+}
+
+/* hashes data by chunks of at most split bytes */
+static void md5_split(const unsigned char *data, size_t len, size_t split, char *hex)
+{
+    unsigned char digest[16];
+    MD5_CTX ctx;
+    size_t done;
+
+    MD5_Init(&ctx);
+    for (done = 0; done < len; done += split)
+        MD5_Update(&ctx, data + done, len - done < split ? len - done : split);
+    MD5_Final(digest, &ctx);
+    to_hex(digest, hex);
+}
+
+static int check(const char *name, const char *hex, const char *expected, size_t split,
+                 size_t misalign)
+{
+    if (strcmp(hex, expected) == 0)
+        return 0;
+    fprintf(stderr, "FAIL %s split %zu misalign %zu: %s, expected %s\n", name, split,
+            misalign, hex, expected);
+    return 1;
+}
+
+/* checks data against expected for every chunk size and misalignment */
+static int check_vector(const char *name, const unsigned char *data, size_t len,
+                        const char *expected)
+{
+    unsigned char *copy = malloc(len + MAX_MISALIGN);
+    char hex[33];
+    size_t split;
+    size_t misalign;
+    int failures = 0;
+
+    if (!copy) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    md5_split(data, len, len ? len : 1, hex);
+    failures += check(name, hex, expected, len, 0);
+
+    for (split = 1; split <= MAX_SPLIT && split < len; split++) {
+        md5_split(data, len, split, hex);
+        failures += check(name, hex, expected, split, 0);
+    }
+
+    for (misalign = 1; misalign < MAX_MISALIGN; misalign++) {
+        memcpy(copy + misalign, data, len);
+        md5_split(copy + misalign, len, len ? len : 1, hex);
+        failures += check(name, hex, expected, len, misalign);
+        /* a split that is not a multiple of 4 misaligns the following chunks too */
+        if (len > 67) {
+            md5_split(copy + misalign, len, 67, hex);
+            failures += check(name, hex, expected, 67, misalign);
+        }
+    }
+
+    free(copy);
+    return failures;
+}
+
+static int run_kat(void)
+{
+    unsigned char *million;
+    char hex[33];
+    size_t i;
+    int failures = 0;
+
+    for (i = 0; i < sizeof(sVectors) / sizeof(sVectors[0]); i++)
+        failures += check_vector(sVectors[i].input, (const unsigned char *)sVectors[i].input,
+                                 strlen(sVectors[i].input), sVectors[i].digest);
+
+    /* one byte more, for a misaligned copy */
+    million = malloc(1000000 + 1);
+    if (!million) {
+        fprintf(stderr, "out of memory\n");
+        return failures + 1;
+    }
+    memset(million, 'a', 1000000 + 1);
+    md5_split(million, 1000000, 1000000, hex);
+    failures += check("million a", hex, MILLION_A_DIGEST, 1000000, 0);
+    md5_split(million, 1000000, 4093, hex);
+    failures += check("million a", hex, MILLION_A_DIGEST, 4093, 0);
+    md5_split(million + 1, 1000000, 1000000, hex);
+    failures += check("million a", hex, MILLION_A_DIGEST, 1000000, 1);
+    free(million);
+
+    printf("md5 known answer tests: %s\n", failures ? "FAILED" : "passed");
+    return failures;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void run_bench(const unsigned char *buffer, size_t size, size_t misalign,
+                      size_t total)
+{
+    unsigned char digest[16];
+    size_t iterations = total / size;
+    size_t i;
+    MD5_CTX ctx;
+    int64_t start;
+    double seconds;
+
+    if (iterations == 0)
+        iterations = 1;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        MD5_Init(&ctx);
+        MD5_Update(&ctx, buffer + misalign, size);
+        MD5_Final(digest, &ctx);
+    }
+    seconds = (now_ns() - start) / 1e9;
+
+    printf("%8zu bytes misalign %zu  %9.2f MB/s  %7.2f ns/byte\n", size, misalign,
+           iterations * size / seconds / 1e6, seconds * 1e9 / (iterations * size));
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b] [-n megabytes]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 16, 64, 1024, 65536 };
+    unsigned char *buffer;
+    bool bench = false;
+    int megabytes = 64;
+    size_t i;
+    int c;
+
+    while ((c = getopt(argc, argv, "bn:")) != -1) {
+        switch (c) {
+        case 'b':
+            bench = true;
+            break;
+        case 'n':
+            megabytes = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (megabytes < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (run_kat() != 0)
+        return 1;
+    if (!bench)
+        return 0;
+
+    buffer = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] + 1);
+    if (!buffer) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] + 1; i++)
+        buffer[i] = i * 131;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        run_bench(buffer, sizes[i], 0, (size_t)megabytes * 1000000);
+        run_bench(buffer, sizes[i], 1, (size_t)megabytes * 1000000);
+    }
+
+    free(buffer);
+    return 0;
+}
@@ -6,6 +6,8 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_SRC_FILES := \
 	secril-shim.cpp
 
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../../include
+
 LOCAL_SHARED_LIBRARIES := \
 	liblog \
 	libril \
@@ -14,6 +16,7 @@ LOCAL_SHARED_LIBRARIES := \
 
 LOCAL_CFLAGS := -Wall -Werror
 LOCAL_CFLAGS += -DSHIM_UPGRADE_VERSION=7
+LOCAL_CPPFLAGS := -std=gnu++14
 
 LOCAL_MODULE := libsecril-shim
 
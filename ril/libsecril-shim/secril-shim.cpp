@@ -1,4 +1,5 @@
 #include "secril-shim.h"
+#include "tuna_boot_profile.h"
 
 /* A copy of the original RIL function table. */
 static const RIL_RadioFunctions *origRilFunctions;
@@ -9,6 +10,26 @@ static const struct RIL_Env *rilEnv;
 /* The tuna variant we're running on. */
 static int tunaVariant = VARIANT_INIT;
 
+/* The last requests forwarded to the RIL, with their timing. Only the
+   values are stored: the strings are built when the ring is dumped. */
+static RequestTrace traceRing[TRACE_RING_SIZE];
+static uint32_t traceHead;
+static uint32_t traceCompleted;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static char traceDumpSeen[PROPERTY_VALUE_MAX];
+
+/* The high-frequency unsolicited responses held back while the screen is off,
+   at most one of each sent per unsolFilterNs; the latest one held is sent on
+   screen-on. */
+static UnsolFilter unsolFilters[] = {
+	{ RIL_UNSOL_SIGNAL_STRENGTH, 0, false, NULL, 0, 0 },
+	{ RIL_UNSOL_CELL_INFO_LIST, 0, false, NULL, 0, 0 },
+	{ RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED, 0, false, NULL, 0, 0 },
+};
+static bool screenOn = true;
+static int64_t unsolFilterNs;
+static pthread_mutex_t unsolFilterLock = PTHREAD_MUTEX_INITIALIZER;
+
 #if SHIM_UPGRADE_VERSION >= 7
 /* For older RILs that do not support new commands RIL_REQUEST_VOICE_RADIO_TECH and
    RIL_UNSOL_VOICE_RADIO_TECH_CHANGED messages, decode the voice radio tech from
@@ -33,6 +54,94 @@ static int simRuimStatus = -1;
 
 
 /* helper functions */
+static int64_t traceNow()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void traceRequest(int request, RIL_Token t, int64_t enqueueNs)
+{
+	RequestInfo *pRI = (RequestInfo *)t;
+	RequestTrace *trace;
+
+	pthread_mutex_lock(&traceLock);
+	trace = &traceRing[traceHead++ % TRACE_RING_SIZE];
+	trace->t = t;
+	trace->request = request;
+	trace->token = pRI ? pRI->token : 0;
+	trace->error = 0;
+	trace->responselen = 0;
+	trace->enqueueNs = enqueueNs;
+	trace->sendNs = traceNow();
+	trace->completeNs = 0;
+	pthread_mutex_unlock(&traceLock);
+}
+
+static int64_t bootNow()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void traceDump()
+{
+	uint32_t i;
+
+	RLOGI("%s: %" PRIu32 " requests completed, the last ones:", __FUNCTION__, traceCompleted);
+	for (i = traceHead > TRACE_RING_SIZE ? traceHead - TRACE_RING_SIZE : 0; i < traceHead; i++) {
+		RequestTrace *trace = &traceRing[i % TRACE_RING_SIZE];
+
+		RLOGI("%s: %s token %" PRId32 ": sent %" PRId64 " us, completed %" PRId64 " us, error %d, %zu bytes",
+		      __FUNCTION__, requestToString(trace->request), trace->token,
+		      (trace->sendNs - trace->enqueueNs) / 1000,
+		      trace->completeNs ? (trace->completeNs - trace->enqueueNs) / 1000 : -1,
+		      trace->error, trace->responselen);
+	}
+}
+
+static void traceComplete(RIL_Token t, RIL_Errno e, size_t responselen)
+{
+	RequestTrace *trace = NULL;
+	char propBuf[PROPERTY_VALUE_MAX];
+	uint32_t i;
+
+	pthread_mutex_lock(&traceLock);
+	/* The request is most likely one of the last ones forwarded. */
+	for (i = 0; i < TRACE_RING_SIZE && i < traceHead; i++) {
+		RequestTrace *candidate = &traceRing[(traceHead - 1 - i) % TRACE_RING_SIZE];
+		if (candidate->t == t && !candidate->completeNs) {
+			trace = candidate;
+			break;
+		}
+	}
+	if (trace) {
+		trace->error = e;
+		trace->responselen = responselen;
+		trace->completeNs = traceNow();
+	}
+
+	if (traceCompleted++ % TRACE_SAMPLE == 0) {
+		if (trace) {
+			RLOGD("%s: %s: sent %" PRId64 " us, completed %" PRId64 " us, %zu bytes", __FUNCTION__,
+			      requestToString(trace->request), (trace->sendNs - trace->enqueueNs) / 1000,
+			      (trace->completeNs - trace->enqueueNs) / 1000, responselen);
+		}
+
+		/* Dump the ring each time the property is given a new value. */
+		property_get(TRACE_DUMP_PROPERTY, propBuf, "");
+		if (strcmp(propBuf, traceDumpSeen)) {
+			strcpy(traceDumpSeen, propBuf);
+			traceDump();
+		}
+	}
+	pthread_mutex_unlock(&traceLock);
+}
+
 #if SHIM_UPGRADE_VERSION >= 7
 static int decodeVoiceRadioTechnology(RIL_RadioState radioState)
 {
@@ -187,53 +296,92 @@ static bool onRequestGetRadioCapability(RIL_Token t)
 	return false;
 }
 
-static void onRequestShim(int request, void *data, size_t datalen, RIL_Token t)
+#if SHIM_UPGRADE_VERSION >= 7
+static void onRequestHookCdmaGetSubscriptionSource(int request, void *data, size_t datalen, RIL_Token t)
+{
+	RLOGI("%s: got request %s: replying with our implementation!", __FUNCTION__, requestToString(request));
+	onRequestCdmaGetSubscriptionSource(t);
+}
+
+static void onRequestHookVoiceRadioTech(int request, void *data, size_t datalen, RIL_Token t)
+{
+	RLOGI("%s: got request %s: replying with our implementation!", __FUNCTION__, requestToString(request));
+	onRequestVoiceRadioTech(t);
+}
+#endif
+
+static void onRequestHookNotSupported(int request, void *data, size_t datalen, RIL_Token t)
+{
+	RLOGW("%s: got request %s: replied with REQUEST_NOT_SUPPPORTED.", __FUNCTION__, requestToString(request));
+	rilEnv->OnRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
+}
+
+/* Necessary; RILJ may fake this for us if we reply not supported, but we can just implement it. */
+static void onRequestHookGetRadioCapability(int request, void *data, size_t datalen, RIL_Token t)
+{
+	if (CC_LIKELY(onRequestGetRadioCapability(t))) {
+		RLOGI("%s: got request %s: replied with our implementation!", __FUNCTION__, requestToString(request));
+		return;
+	}
+	onRequestHookNotSupported(request, data, datalen, t);
+}
+
+/* Still forwarded: the RIL has its own use of the screen state. */
+static void onRequestHookScreenState(int request, void *data, size_t datalen, RIL_Token t)
 {
-	switch (request) {
+	int64_t enqueueNs = traceNow();
+
+	if (data && datalen >= sizeof(int)) {
+		setScreenState(((int *)data)[0] != 0);
+	}
+
+	traceRequest(request, t, enqueueNs);
+	origRilFunctions->onRequest(request, data, datalen, t);
+}
+
+/* The requests answered or looked at here before the RIL. */
+static constexpr ShimHookEntry<RequestHook> requestHookEntries[] = {
 #if SHIM_UPGRADE_VERSION >= 7
-		case RIL_REQUEST_CDMA_GET_SUBSCRIPTION_SOURCE:
-			RLOGI("%s: got request %s: replying with our implementation!", __FUNCTION__, requestToString(request));
-			onRequestCdmaGetSubscriptionSource(t);
-			return;
-		case RIL_REQUEST_VOICE_RADIO_TECH:
-			RLOGI("%s: got request %s: replying with our implementation!", __FUNCTION__, requestToString(request));
-			onRequestVoiceRadioTech(t);
-			return;
+	{ RIL_REQUEST_CDMA_GET_SUBSCRIPTION_SOURCE, onRequestHookCdmaGetSubscriptionSource },
+	{ RIL_REQUEST_VOICE_RADIO_TECH, onRequestHookVoiceRadioTech },
 #endif
-		/* Necessary; RILJ may fake this for us if we reply not supported, but we can just implement it. */
-		case RIL_REQUEST_GET_RADIO_CAPABILITY:
-			if (CC_LIKELY(onRequestGetRadioCapability(t))) {
-				RLOGI("%s: got request %s: replied with our implementation!", __FUNCTION__, requestToString(request));
-				return;
-			}
-			/* else fall through to E_REQUEST_NOT_SUPPORTED */
-		/* The following requests were introduced post-4.3. */
-		case RIL_REQUEST_SIM_TRANSMIT_APDU_BASIC:
-		case RIL_REQUEST_SIM_OPEN_CHANNEL: /* !!! */
-		case RIL_REQUEST_SIM_CLOSE_CHANNEL:
-		case RIL_REQUEST_SIM_TRANSMIT_APDU_CHANNEL:
-		case RIL_REQUEST_NV_READ_ITEM:
-		case RIL_REQUEST_NV_WRITE_ITEM:
-		case RIL_REQUEST_NV_WRITE_CDMA_PRL:
-		case RIL_REQUEST_NV_RESET_CONFIG:
-		case RIL_REQUEST_SET_UICC_SUBSCRIPTION:
-		case RIL_REQUEST_ALLOW_DATA:
-		case RIL_REQUEST_GET_HARDWARE_CONFIG:
-		case RIL_REQUEST_SIM_AUTHENTICATION:
-		case RIL_REQUEST_GET_DC_RT_INFO:
-		case RIL_REQUEST_SET_DC_RT_INFO_RATE:
-		case RIL_REQUEST_SET_DATA_PROFILE:
-		case RIL_REQUEST_SHUTDOWN: /* TODO: Is there something we can do for RIL_REQUEST_SHUTDOWN ? */
-		case RIL_REQUEST_SET_RADIO_CAPABILITY:
-		case RIL_REQUEST_START_LCE:
-		case RIL_REQUEST_STOP_LCE:
-		case RIL_REQUEST_PULL_LCEDATA:
-			RLOGW("%s: got request %s: replied with REQUEST_NOT_SUPPPORTED.", __FUNCTION__, requestToString(request));
-			rilEnv->OnRequestComplete(t, RIL_E_REQUEST_NOT_SUPPORTED, NULL, 0);
-			return;
+	{ RIL_REQUEST_GET_RADIO_CAPABILITY, onRequestHookGetRadioCapability },
+	{ RIL_REQUEST_SCREEN_STATE, onRequestHookScreenState },
+	/* The following requests were introduced post-4.3. */
+	{ RIL_REQUEST_SIM_TRANSMIT_APDU_BASIC, onRequestHookNotSupported },
+	{ RIL_REQUEST_SIM_OPEN_CHANNEL, onRequestHookNotSupported }, /* !!! */
+	{ RIL_REQUEST_SIM_CLOSE_CHANNEL, onRequestHookNotSupported },
+	{ RIL_REQUEST_SIM_TRANSMIT_APDU_CHANNEL, onRequestHookNotSupported },
+	{ RIL_REQUEST_NV_READ_ITEM, onRequestHookNotSupported },
+	{ RIL_REQUEST_NV_WRITE_ITEM, onRequestHookNotSupported },
+	{ RIL_REQUEST_NV_WRITE_CDMA_PRL, onRequestHookNotSupported },
+	{ RIL_REQUEST_NV_RESET_CONFIG, onRequestHookNotSupported },
+	{ RIL_REQUEST_SET_UICC_SUBSCRIPTION, onRequestHookNotSupported },
+	{ RIL_REQUEST_ALLOW_DATA, onRequestHookNotSupported },
+	{ RIL_REQUEST_GET_HARDWARE_CONFIG, onRequestHookNotSupported },
+	{ RIL_REQUEST_SIM_AUTHENTICATION, onRequestHookNotSupported },
+	{ RIL_REQUEST_GET_DC_RT_INFO, onRequestHookNotSupported },
+	{ RIL_REQUEST_SET_DC_RT_INFO_RATE, onRequestHookNotSupported },
+	{ RIL_REQUEST_SET_DATA_PROFILE, onRequestHookNotSupported },
+	{ RIL_REQUEST_SHUTDOWN, onRequestHookNotSupported }, /* TODO: Is there something we can do for RIL_REQUEST_SHUTDOWN ? */
+	{ RIL_REQUEST_SET_RADIO_CAPABILITY, onRequestHookNotSupported },
+	{ RIL_REQUEST_START_LCE, onRequestHookNotSupported },
+	{ RIL_REQUEST_STOP_LCE, onRequestHookNotSupported },
+	{ RIL_REQUEST_PULL_LCEDATA, onRequestHookNotSupported },
+};
+
+static constexpr ShimHookTable<RequestHook> requestHooks = makeShimHookTable(requestHookEntries, 0);
+
+static void onRequestShim(int request, void *data, size_t datalen, RIL_Token t)
+{
+	int64_t enqueueNs = traceNow();
+
+	if (CC_UNLIKELY(requestHooks.has(request))) {
+		requestHooks.get(request)(request, data, datalen, t);
+		return;
 	}
 
-	RLOGD("%s: got request %s: forwarded to RIL.", __FUNCTION__, requestToString(request));
+	traceRequest(request, t, enqueueNs);
 	origRilFunctions->onRequest(request, data, datalen, t);
 }
 
@@ -248,23 +396,40 @@ static RIL_RadioState onStateRequestShim()
 }
 #endif
 
-static void onCompleteGetSimStatus(RIL_Token t, RIL_Errno e, RIL_CardStatus_v5 *v5response)
+/* Android 7.0 mishandles RIL_CardStatus_v5.
+ * We can just fake a v6 response instead. */
+static bool onCompleteGetSimStatus(RIL_Token t, RIL_Errno e, void *response, size_t responselen)
 {
-	RIL_CardStatus_v6 *v6response = (RIL_CardStatus_v6 *)malloc(sizeof(RIL_CardStatus_v6));
+	RIL_CardStatus_v5 *v5response = (RIL_CardStatus_v5 *)response;
+	RIL_CardStatus_v6 v6response;
+
+	/* If this was already a v6 reply, continue as usual. */
+	if (responselen != sizeof(RIL_CardStatus_v5)) {
+		return false;
+	}
 
-	v6response->card_state = v5response->card_state;
-	v6response->universal_pin_state = v5response->universal_pin_state;
-	v6response->gsm_umts_subscription_app_index = v5response->gsm_umts_subscription_app_index;
-	v6response->cdma_subscription_app_index = v5response->cdma_subscription_app_index;
-	v6response->ims_subscription_app_index = -1;
-	v6response->num_applications = v5response->num_applications;
-	memcpy(v6response->applications, v5response->applications, sizeof(RIL_AppStatus) * 8);
+	RLOGI("%s: got request %s: upgrading response.", __FUNCTION__, requestToString(RIL_REQUEST_GET_SIM_STATUS));
 
-	rilEnv->OnRequestComplete(t, e, v6response, sizeof(RIL_CardStatus_v6));
+	v6response.card_state = v5response->card_state;
+	v6response.universal_pin_state = v5response->universal_pin_state;
+	v6response.gsm_umts_subscription_app_index = v5response->gsm_umts_subscription_app_index;
+	v6response.cdma_subscription_app_index = v5response->cdma_subscription_app_index;
+	v6response.ims_subscription_app_index = -1;
+	v6response.num_applications = v5response->num_applications;
+	memcpy(v6response.applications, v5response->applications, sizeof(RIL_AppStatus) * 8);
 
-	free(v6response);
+	rilEnv->OnRequestComplete(t, e, &v6response, sizeof(RIL_CardStatus_v6));
+	return true;
 }
 
+/* The responses upgraded before libril gets them; a hook returning false
+ * has left the response alone. */
+static constexpr ShimHookEntry<CompleteHook> completeHookEntries[] = {
+	{ RIL_REQUEST_GET_SIM_STATUS, onCompleteGetSimStatus },
+};
+
+static constexpr ShimHookTable<CompleteHook> completeHooks = makeShimHookTable(completeHookEntries, 0);
+
 static void onRequestCompleteShim(RIL_Token t, RIL_Errno e, void *response, size_t responselen)
 {
 	int request;
@@ -278,43 +443,40 @@ static void onRequestCompleteShim(RIL_Token t, RIL_Errno e, void *response, size
 	}
 
 	request = pRI->pCI->requestNumber;
+	traceComplete(t, e, responselen);
 
-	switch (request) {
-		case RIL_REQUEST_GET_SIM_STATUS:
-			/* Android 7.0 mishandles RIL_CardStatus_v5.
-			 * We can just fake a v6 response instead. */
-			if (responselen == sizeof(RIL_CardStatus_v5)) {
-				RLOGI("%s: got request %s: upgrading response.", __FUNCTION__, requestToString(request));
-				onCompleteGetSimStatus(t, e, ((RIL_CardStatus_v5 *) response));
-				return;
-			}
-			/* If this was already a v6 reply, continue as usual. */
-			break;
+	if (CC_UNLIKELY(completeHooks.has(request)) &&
+	    completeHooks.get(request)(t, e, response, responselen)) {
+		return;
 	}
 
-	RLOGD("%s: got request %s: forwarded to libril.", __FUNCTION__, requestToString(request));
 null_token_exit:
 	rilEnv->OnRequestComplete(t, e, response, responselen);
 }
 
 #if SHIM_UPGRADE_VERSION >= 7
-static void onUnsolSimRefresh(const int *v6_sim_refresh)
+/* Upgrade SIM_REFRESH to a RIL_SimRefreshResponse_v7 */
+static void onUnsolSimRefresh(int unsolResponse, const void *data, size_t datalen)
 {
-	RIL_SimRefreshResponse_v7 *v7_sim_refresh = (RIL_SimRefreshResponse_v7 *)malloc(sizeof(RIL_SimRefreshResponse_v7));
+	const int *v6_sim_refresh = (const int *)data;
+	RIL_SimRefreshResponse_v7 v7_sim_refresh;
 
-	v7_sim_refresh->result = (RIL_SimRefreshResult)v6_sim_refresh[0];
-	v7_sim_refresh->ef_id  = v6_sim_refresh[1];
-	v7_sim_refresh->aid    = NULL;
+	RLOGI("%s: upgrading SIM_REFRESH to RIL_SimRefreshResponse_v7.", __FUNCTION__);
 
-	rilEnv->OnUnsolicitedResponse(RIL_UNSOL_SIM_REFRESH, v7_sim_refresh, sizeof(RIL_SimRefreshResponse_v7));
+	v7_sim_refresh.result = (RIL_SimRefreshResult)v6_sim_refresh[0];
+	v7_sim_refresh.ef_id  = v6_sim_refresh[1];
+	v7_sim_refresh.aid    = NULL;
 
-	free(v7_sim_refresh);
+	rilEnv->OnUnsolicitedResponse(RIL_UNSOL_SIM_REFRESH, &v7_sim_refresh, sizeof(RIL_SimRefreshResponse_v7));
 }
 #endif
 
 #if SHIM_UPGRADE_VERSION >= 7
-static void onUnsolRadioStateChanged(const void *data, size_t datalen)
+/* Uses old radio states to notify changes for voice radio tech, cdma sub src, and sim status. */
+static void onUnsolRadioStateChanged(int unsolResponse, const void *data, size_t datalen)
 {
+	RLOGI("%s: upgrading RESPONSE_RADIO_STATE_CHANGED.", __FUNCTION__);
+
 	RIL_RadioState newRadioState = origRilFunctions->onStateRequest();
 	if ((newRadioState > RADIO_STATE_UNAVAILABLE) && (newRadioState < RADIO_STATE_ON)) {
 		int newVoiceRadioTech;
@@ -350,32 +512,96 @@ static void onUnsolRadioStateChanged(const void *data, size_t datalen)
 }
 #endif
 
-static void onUnsolicitedResponseShim(int unsolResponse, const void *data, size_t datalen)
+static void onUnsolScreenOffFilter(int unsolResponse, const void *data, size_t datalen)
 {
-	switch (unsolResponse) {
-#if SHIM_UPGRADE_VERSION >= 7
-		case RIL_UNSOL_SIM_REFRESH:
-			/* Upgrade SIM_REFRESH to a RIL_SimRefreshResponse_v7 */
-			RLOGI("%s: upgrading SIM_REFRESH to RIL_SimRefreshResponse_v7.", __FUNCTION__);
-			onUnsolSimRefresh((const int *)data);
-			return;
-		case RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED:
-			/* Uses old radio states to notify changes for voice radio tech, cdma sub src, and sim status. */
-			RLOGI("%s: upgrading RESPONSE_RADIO_STATE_CHANGED.", __FUNCTION__);
-			onUnsolRadioStateChanged(data, datalen);
+	UnsolFilter *filter = NULL;
+	int64_t now;
+	size_t i;
+
+	for (i = 0; i < sizeof(unsolFilters) / sizeof(unsolFilters[0]); i++) {
+		if (unsolFilters[i].unsolResponse == unsolResponse) {
+			filter = &unsolFilters[i];
+			break;
+		}
+	}
+
+	/* The lock is held while sending, to keep the order with the flush on screen-on. */
+	pthread_mutex_lock(&unsolFilterLock);
+	now = bootNow();
+	if (screenOn || unsolFilterNs <= 0 || now - filter->lastSentNs >= unsolFilterNs) {
+		filter->lastSentNs = now;
+		filter->pending = false;
+		rilEnv->OnUnsolicitedResponse(unsolResponse, data, datalen);
+		pthread_mutex_unlock(&unsolFilterLock);
+		return;
+	}
+
+	if (datalen > filter->capacity) {
+		void *buf = realloc(filter->data, datalen);
+		if (CC_UNLIKELY(!buf)) {
+			/* Better sent now than lost. */
+			filter->lastSentNs = now;
+			filter->pending = false;
+			rilEnv->OnUnsolicitedResponse(unsolResponse, data, datalen);
+			pthread_mutex_unlock(&unsolFilterLock);
 			return;
-#endif
+		}
+		filter->data = buf;
+		filter->capacity = datalen;
+	}
+	if (datalen) {
+		memcpy(filter->data, data, datalen);
 	}
+	filter->datalen = datalen;
+	filter->pending = true;
+	pthread_mutex_unlock(&unsolFilterLock);
+}
 
-	rilEnv->OnUnsolicitedResponse(unsolResponse, data, datalen);
+static void setScreenState(bool on)
+{
+	size_t i;
+
+	pthread_mutex_lock(&unsolFilterLock);
+	screenOn = on;
+	if (on) {
+		for (i = 0; i < sizeof(unsolFilters) / sizeof(unsolFilters[0]); i++) {
+			UnsolFilter *filter = &unsolFilters[i];
+
+			if (filter->pending) {
+				filter->pending = false;
+				filter->lastSentNs = bootNow();
+				rilEnv->OnUnsolicitedResponse(filter->unsolResponse,
+				                              filter->datalen ? filter->data : NULL, filter->datalen);
+			}
+		}
+	}
+	pthread_mutex_unlock(&unsolFilterLock);
 }
 
-static void patchMem(void *libHandle, bool beforeRilInit)
+static constexpr ShimHookEntry<UnsolHook> unsolHookEntries[] = {
+#if SHIM_UPGRADE_VERSION >= 7
+	{ RIL_UNSOL_SIM_REFRESH, onUnsolSimRefresh },
+	{ RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED, onUnsolRadioStateChanged },
+#endif
+	{ RIL_UNSOL_SIGNAL_STRENGTH, onUnsolScreenOffFilter },
+	{ RIL_UNSOL_CELL_INFO_LIST, onUnsolScreenOffFilter },
+	{ RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED, onUnsolScreenOffFilter },
+};
+
+static constexpr ShimHookTable<UnsolHook> unsolHooks = makeShimHookTable(unsolHookEntries, RIL_UNSOL_RESPONSE_BASE);
+
+static void onUnsolicitedResponseShim(int unsolResponse, const void *data, size_t datalen)
 {
-	/* hSecOem is a nice symbol to use, it's in all 3 RILs and gives us easy
-	 * access to the memory region we're generally most interested in. */
-	uint8_t *hSecOem;
+	if (CC_UNLIKELY(unsolHooks.has(unsolResponse))) {
+		unsolHooks.get(unsolResponse)(unsolResponse, data, datalen);
+		return;
+	}
+
+	rilEnv->OnUnsolicitedResponse(unsolResponse, data, datalen);
+}
 
+/* The memory patches of the RIL, by variant. */
+static const RilPatch rilPatches[] = {
 	/* MAX_TIMEOUT is used for a call to pthread_cond_timedwait_relative_np.
 	 * The issue is bionic has switched to using absolute timeouts instead of
 	 * relative timeouts, and a maximum time value can cause an overflow in
@@ -383,62 +609,83 @@ static void patchMem(void *libHandle, bool beforeRilInit)
 	 *
 	 * By patching this to 0x01FFFFFF from 0x7FFFFFFF, the timeout should
 	 * expire in about a year rather than 68 years, and the RIL should be good
-	 * up until the year 2036 or so. */
-	uint32_t *MAX_TIMEOUT;
-
-	hSecOem = (uint8_t *)dlsym(libHandle, "hSecOem");
-	if (CC_UNLIKELY(!hSecOem)) {
-		RLOGE("%s: hSecOem could not be found!", __FUNCTION__);
-		/* If hSecOem is not found we can still try the other patches. */
-		goto timeout_patch;
-	}
-
-	RLOGD("%s: hSecOem found at %p!", __FUNCTION__, hSecOem);
-
-	/* hSecOem-based patching. */
-	switch (tunaVariant) {
-		case VARIANT_MAGURO:
-			if (!beforeRilInit) {
-				/* 'ril features' is (only) used to enable/disable an extension
-				 * to LAST_CALL_FAIL_CAUSE. Android had just been happily
-				 * ignoring the extra data being sent, until it did introduce a
-				 * vendor extension for LAST_CALL_FAIL_CAUSE in Android 6.0;
-				 * of course it doesn't like this RIL's extra data now (crashes),
-				 * so we need to disable it. rilFeatures is initialized in
-				 * RIL_Init, so defer it until afterwards. */
-				uint8_t *rilFeatures = hSecOem + 0x1918;
-
-				RLOGD("%s: rilFeatures is currently %" PRIu8 "", __FUNCTION__, *rilFeatures);
-				if (CC_LIKELY(*rilFeatures == 1)) {
-					*rilFeatures = 0;
-					RLOGI("%s: rilFeatures was changed to %" PRIu8 "", __FUNCTION__, *rilFeatures);
-				} else {
-					RLOGW("%s: rilFeatures was not 1; leaving alone", __FUNCTION__);
-				}
+	 * up until the year 2036 or so. Works the same for all RILs. */
+	{ "MAX_TIMEOUT", VARIANT_INIT, true, "MAX_TIMEOUT", 0, sizeof(uint32_t), 0x7FFFFFFF, 0x01FFFFFF },
+	/* hSecOem is a nice symbol to use, it's in all 3 RILs and gives us easy
+	 * access to the memory region we're generally most interested in.
+	 *
+	 * 'ril features' is (only) used to enable/disable an extension
+	 * to LAST_CALL_FAIL_CAUSE. Android had just been happily
+	 * ignoring the extra data being sent, until it did introduce a
+	 * vendor extension for LAST_CALL_FAIL_CAUSE in Android 6.0;
+	 * of course it doesn't like this RIL's extra data now (crashes),
+	 * so we need to disable it. rilFeatures is initialized in
+	 * RIL_Init, so defer it until afterwards. */
+	{ "rilFeatures", VARIANT_MAGURO, false, "hSecOem", 0x1918, sizeof(uint8_t), 1, 0 },
+};
+
+/* The symbols of the patches, each looked up once for both passes. */
+static RilPatchSymbol rilPatchSymbols[sizeof(rilPatches) / sizeof(rilPatches[0])];
+
+static uint8_t *findPatchSymbol(void *libHandle, const char *symbol)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(rilPatchSymbols) / sizeof(rilPatchSymbols[0]); i++) {
+		RilPatchSymbol *cached = &rilPatchSymbols[i];
+
+		if (!cached->symbol) {
+			cached->symbol = symbol;
+			cached->address = (uint8_t *)dlsym(libHandle, symbol);
+			if (CC_UNLIKELY(!cached->address)) {
+				RLOGE("%s: %s could not be found!", __FUNCTION__, symbol);
+			} else {
+				RLOGD("%s: %s found at %p!", __FUNCTION__, symbol, cached->address);
 			}
-			break;
-		case VARIANT_TORO:
-			break;
-		case VARIANT_TOROPLUS:
-			break;
+			return cached->address;
+		}
+		if (!strcmp(cached->symbol, symbol)) {
+			return cached->address;
+		}
 	}
+	return NULL;
+}
 
-timeout_patch:
-	/* MAX_TIMEOUT patch, works the same for all RILs. */
-	if (beforeRilInit) {
-		MAX_TIMEOUT = (uint32_t *)dlsym(libHandle, "MAX_TIMEOUT");
-		if (CC_UNLIKELY(!MAX_TIMEOUT)) {
-			RLOGE("%s: MAX_TIMEOUT could not be found!", __FUNCTION__);
-			return;
+static void patchMem(void *libHandle, bool beforeRilInit)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(rilPatches) / sizeof(rilPatches[0]); i++) {
+		const RilPatch *patch = &rilPatches[i];
+		uint8_t *base;
+		uint32_t current;
+
+		if (patch->beforeRilInit != beforeRilInit ||
+		    (patch->variant != VARIANT_INIT && patch->variant != tunaVariant)) {
+			continue;
+		}
+
+		/* If a symbol is not found we can still try the other patches. */
+		base = findPatchSymbol(libHandle, patch->symbol);
+		if (CC_UNLIKELY(!base)) {
+			continue;
 		}
-		RLOGD("%s: MAX_TIMEOUT found at %p!", __FUNCTION__, MAX_TIMEOUT);
-		RLOGD("%s: MAX_TIMEOUT is currently 0x%" PRIX32, __FUNCTION__, *MAX_TIMEOUT);
-		if (CC_LIKELY(*MAX_TIMEOUT == 0x7FFFFFFF)) {
-			*MAX_TIMEOUT = 0x01FFFFFF;
-			RLOGI("%s: MAX_TIMEOUT was changed to 0x0%" PRIX32, __FUNCTION__, *MAX_TIMEOUT);
+
+		/* Only the value the patch was made for is changed. */
+		current = patch->size == sizeof(uint8_t) ? base[patch->offset] :
+		          *(uint32_t *)(base + patch->offset);
+		RLOGD("%s: %s is currently 0x%" PRIX32, __FUNCTION__, patch->name, current);
+		if (CC_UNLIKELY(current != patch->expected)) {
+			RLOGW("%s: %s was not 0x%" PRIX32 "; leaving alone", __FUNCTION__, patch->name, patch->expected);
+			continue;
+		}
+
+		if (patch->size == sizeof(uint8_t)) {
+			base[patch->offset] = patch->value;
 		} else {
-			RLOGW("%s: MAX_TIMEOUT was not 0x7FFFFFFF; leaving alone", __FUNCTION__);
+			*(uint32_t *)(base + patch->offset) = patch->value;
 		}
+		RLOGI("%s: %s was changed to 0x%" PRIX32, __FUNCTION__, patch->name, patch->value);
 	}
 }
 
@@ -449,7 +696,9 @@ const RIL_RadioFunctions* RIL_Init(const struct RIL_Env *env, int argc, char **a
 	static struct RIL_Env shimmedEnv;
 	void *origRil;
 	char propBuf[PROPERTY_VALUE_MAX];
+	struct tuna_boot_profile profile;
 
+	tuna_boot_profile_begin(&profile, "ril");
 	if (CC_LIKELY(tunaVariant == VARIANT_INIT)) {
 		property_get("ro.product.subdevice", propBuf, "unknown");
 		if (!strcmp(propBuf, "maguro")) {
@@ -464,6 +713,8 @@ const RIL_RadioFunctions* RIL_Init(const struct RIL_Env *env, int argc, char **a
 		RLOGD("%s: got tuna variant: %i", __FUNCTION__, tunaVariant);
 	}
 
+	unsolFilterNs = property_get_int32(UNSOL_FILTER_PROPERTY, UNSOL_FILTER_DEFAULT_MS) * 1000000LL;
+
 	/* Shim the RIL_Env passed to the real RIL, saving a copy of the original */
 	rilEnv = env;
 	shimmedEnv = *env;
@@ -477,6 +728,7 @@ const RIL_RadioFunctions* RIL_Init(const struct RIL_Env *env, int argc, char **a
 		RLOGE("%s: failed to load '" RIL_LIB_PATH  "': %s", __FUNCTION__, dlerror());
 		return NULL;
 	}
+	tuna_boot_profile_phase(&profile, "dlopen");
 
 	origRilInit = (const RIL_RadioFunctions *(*)(const struct RIL_Env *, int, char **))(dlsym(origRil, "RIL_Init"));
 	if (CC_UNLIKELY(!origRilInit)) {
@@ -486,15 +738,19 @@ const RIL_RadioFunctions* RIL_Init(const struct RIL_Env *env, int argc, char **a
 
 	/* Fix RIL issues by patching memory: pre-init pass. */
 	patchMem(origRil, true);
+	tuna_boot_profile_phase(&profile, "patchMem_pre_init");
 
 	origRilFunctions = origRilInit(&shimmedEnv, argc, argv);
 	if (CC_UNLIKELY(!origRilFunctions)) {
 		RLOGE("%s: the original RIL_Init derped.", __FUNCTION__);
 		goto fail_after_dlopen;
 	}
+	tuna_boot_profile_phase(&profile, "RIL_Init");
 
 	/* Fix RIL issues by patching memory: post-init pass. */
 	patchMem(origRil, false);
+	tuna_boot_profile_phase(&profile, "patchMem_post_init");
+	tuna_boot_profile_end(&profile);
 
 	/* Shim functions as needed. */
 	shimmedFunctions = *origRilFunctions;
@@ -6,10 +6,12 @@
 
 #include <dlfcn.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <binder/Parcel.h>
 #include <cutils/compiler.h>
@@ -20,6 +22,12 @@
 
 #define RIL_LIB_PATH "/vendor/lib/libsec-ril.so"
 
+/* Number of forwarded requests kept, and one completion out of TRACE_SAMPLE logged. */
+#define TRACE_RING_SIZE 256
+#define TRACE_SAMPLE 64
+/* Set to a new value to dump the trace ring to the log. */
+#define TRACE_DUMP_PROPERTY "debug.secril.trace_dump"
+
 enum variant_type {
 	VARIANT_INIT,
 	VARIANT_MAGURO,
@@ -37,6 +45,96 @@ typedef struct {
 	int(*responseFunction) (android::Parcel &p, void *response, size_t responselen);
 } CommandInfo;
 
+/* Least time between two unsolicited responses of a filtered kind while the
+ * screen is off, in ms; 0 sends them all. */
+#define UNSOL_FILTER_PROPERTY "persist.radio.unsol_screen_off_ms"
+#define UNSOL_FILTER_DEFAULT_MS 60000
+
+/* The requests and unsolicited responses the shim changes, by number. A
+ * table is built at compile time from a list of entries, with a bit per
+ * number so that everything else takes a single test on its way. */
+#define SHIM_HOOK_MAX 256
+
+typedef void (*RequestHook)(int request, void *data, size_t datalen, RIL_Token t);
+typedef bool (*CompleteHook)(RIL_Token t, RIL_Errno e, void *response, size_t responselen);
+typedef void (*UnsolHook)(int unsolResponse, const void *data, size_t datalen);
+
+template <typename Hook>
+struct ShimHookEntry {
+	int number;
+	Hook hook;
+};
+
+template <typename Hook>
+struct ShimHookTable {
+	int base;
+	uint32_t bits[SHIM_HOOK_MAX / 32];
+	Hook hooks[SHIM_HOOK_MAX];
+
+	constexpr bool has(int number) const {
+		unsigned int i = number - base;
+		return i < SHIM_HOOK_MAX && (bits[i / 32] & (1u << (i % 32)));
+	}
+
+	constexpr Hook get(int number) const {
+		return hooks[number - base];
+	}
+};
+
+/* A number out of SHIM_HOOK_MAX above the base fails the build. */
+template <typename Hook, size_t N>
+constexpr ShimHookTable<Hook> makeShimHookTable(const ShimHookEntry<Hook> (&entries)[N], int base)
+{
+	ShimHookTable<Hook> table = {};
+
+	table.base = base;
+	for (size_t i = 0; i < N; i++) {
+		unsigned int n = entries[i].number - base;
+		table.bits[n / 32] |= 1u << (n % 32);
+		table.hooks[n] = entries[i].hook;
+	}
+	return table;
+}
+
+typedef struct {
+	RIL_Token t;
+	int request;
+	int32_t token;
+	int error;
+	size_t responselen;
+	int64_t enqueueNs;
+	int64_t sendNs;
+	int64_t completeNs;
+} RequestTrace;
+
+typedef struct {
+	int unsolResponse;
+	int64_t lastSentNs;
+	bool pending;
+	void *data;      /* copy of the latest response held back */
+	size_t datalen;
+	size_t capacity;
+} UnsolFilter;
+
+/* A value of the vendor RIL patched in memory, at an offset from one of its
+ * symbols, only if it has the value expected. variant is VARIANT_INIT for the
+ * patches of all variants. */
+typedef struct {
+	const char *name;
+	int variant;
+	bool beforeRilInit;
+	const char *symbol;
+	size_t offset;
+	size_t size;       /* of the value, 1 or 4 bytes */
+	uint32_t expected;
+	uint32_t value;
+} RilPatch;
+
+typedef struct {
+	const char *symbol;
+	uint8_t *address;  /* NULL if not found */
+} RilPatchSymbol;
+
 typedef struct RequestInfo {
 	int32_t token;
 	CommandInfo *pCI;